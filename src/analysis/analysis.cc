@@ -0,0 +1,263 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2019 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+
+  If you modify this Program, or any covered work, by linking or
+  combining it with NVIDIA Corporation's libraries from the NVIDIA CUDA
+  Toolkit and the NVIDIA CUDA Deep Neural Network library (or a
+  modified version of those libraries), containing parts covered by the
+  terms of the respective license agreement, the licensors of this
+  Program grant you additional permission to convey the resulting work.
+*/
+
+#include "analysis/analysis.h"
+
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include "mcts/search.h"
+#include "neural/batcher.h"
+#include "neural/cache.h"
+#include "neural/factory.h"
+#include "utils/exception.h"
+#include "utils/logging.h"
+#include "utils/optionsparser.h"
+
+namespace lczero {
+namespace {
+const OptionId kInputId{"input", "",
+                        "File with a FEN per line to analyse, standard input "
+                        "if empty."};
+const OptionId kOutputId{"output", "",
+                         "File to write the results to, standard output if "
+                         "empty."};
+const OptionId kFormatId{
+    "format", "",
+    "Output format, a JSON object or a CSV row per position. The evaluation "
+    "is from the point of view of the side to move."};
+const OptionId kNodesId{"nodes", "", "Number of visits of every search."};
+const OptionId kParallelismId{"parallelism", "",
+                              "Number of positions searched at the same "
+                              "time."};
+const OptionId kBatchSizeId{"batch-size", "",
+                            "Largest batch sent to the network at once."};
+const OptionId kNNCacheSizeId{
+    "nncache", "NNCacheSize",
+    "Number of positions to store in a memory cache. A large cache can speed "
+    "up searching, but takes memory."};
+
+struct Result {
+  std::string fen;
+  std::string error;
+  // Empty if the game is over.
+  std::string bestmove;
+  int64_t nodes = 0;
+  float q = 0.0f;
+  float d = 0.0f;
+};
+
+void WriteResult(const Result& result, bool csv, std::ostream* out) {
+  const float w = (1.0f + result.q - result.d) / 2;
+  const float l = (1.0f - result.q - result.d) / 2;
+  const int cp = std::lround(290.680623072 * std::tan(1.548090806 * result.q));
+  std::ostringstream line;
+  line << std::fixed << std::setprecision(4);
+  if (csv) {
+    line << result.fen << ',';
+    if (result.error.empty()) {
+      line << result.bestmove << ',' << result.nodes << ','
+           << result.q << ',' << cp << ',' << w << ',' << result.d << ','
+           << l << ',';
+    } else {
+      line << ",,,,,,," << result.error;
+    }
+  } else {
+    line << "{\"fen\":\"" << result.fen << "\",";
+    if (result.error.empty()) {
+      line << "\"bestmove\":\"" << result.bestmove
+           << "\",\"nodes\":" << result.nodes << ",\"q\":" << result.q
+           << ",\"cp\":" << cp << ",\"wdl\":[" << w << ',' << result.d << ','
+           << l << "]}";
+    } else {
+      // Exception messages have no quotes or backslashes to escape, but the
+      // FEN they quote.
+      std::string error = result.error;
+      for (auto& c : error) {
+        if (c == '"' || c == '\\') c = '\'';
+      }
+      line << "\"error\":\"" << error << "\"}";
+    }
+  }
+  *out << line.str() << '\n';
+}
+
+}  // namespace
+
+void Analysis::Run() {
+  OptionsParser options;
+  NetworkFactory::PopulateOptions(&options);
+  options.Add<IntOption>(kNNCacheSizeId, 0, 999999999) = 200000;
+  SearchParams::Populate(&options);
+
+  options.Add<StringOption>(kInputId);
+  options.Add<StringOption>(kOutputId);
+  std::vector<std::string> formats = {"jsonl", "csv"};
+  options.Add<ChoiceOption>(kFormatId, formats) = "jsonl";
+  options.Add<IntOption>(kNodesId, 1, 999999999) = 800;
+  options.Add<IntOption>(kParallelismId, 1, 4096) = 64;
+  options.Add<IntOption>(kBatchSizeId, 1, 65536) = 256;
+
+  if (!options.ProcessAllFlags()) return;
+
+  try {
+    auto option_dict = options.GetOptionsDict();
+
+    std::ifstream input_file;
+    std::istream* input = &std::cin;
+    const auto input_path = option_dict.Get<std::string>(kInputId.GetId());
+    if (!input_path.empty()) {
+      input_file.open(input_path);
+      if (!input_file) throw Exception("Unable to open " + input_path);
+      input = &input_file;
+    }
+    std::ofstream output_file;
+    std::ostream* output = &std::cout;
+    const auto output_path = option_dict.Get<std::string>(kOutputId.GetId());
+    if (!output_path.empty()) {
+      output_file.open(output_path);
+      if (!output_file) throw Exception("Unable to open " + output_path);
+      output = &output_file;
+    }
+    const bool csv = option_dict.Get<std::string>(kFormatId.GetId()) == "csv";
+    if (csv) *output << "fen,bestmove,nodes,q,cp,w,d,l,error\n";
+
+    auto network = NetworkFactory::LoadNetwork(option_dict);
+    NNCache cache;
+    cache.SetCapacity(option_dict.Get<int>(kNNCacheSizeId.GetId()));
+    SearchLimits limits;
+    limits.visits = option_dict.Get<int>(kNodesId.GetId());
+    ComputationBatcher batcher(network.get(),
+                               option_dict.Get<int>(kBatchSizeId.GetId()));
+
+    struct Slot {
+      std::string fen;
+      std::unique_ptr<NodeTree> tree;
+      std::unique_ptr<Search> search;
+      // Kept from search to search for its buffers.
+      std::unique_ptr<SearchWorker> worker;
+    };
+    std::vector<Slot> slots(option_dict.Get<int>(kParallelismId.GetId()));
+    int64_t analysed = 0;
+    const auto start = std::chrono::steady_clock::now();
+    while (true) {
+      // Gather a minibatch of every search, starting new ones as needed.
+      bool searching = false;
+      for (auto& slot : slots) {
+        std::string line;
+        while (!slot.search && std::getline(*input, line)) {
+          const auto begin = line.find_first_not_of(" \t");
+          if (begin == std::string::npos || line[begin] == '#') continue;
+          const auto end = line.find_last_not_of(" \t\r");
+          slot.fen = line.substr(begin, end - begin + 1);
+          Result result;
+          result.fen = slot.fen;
+          // EPD positions have no move counters.
+          std::istringstream fields(slot.fen);
+          std::string field;
+          int field_count = 0;
+          while (fields >> field) ++field_count;
+          try {
+            slot.tree = std::make_unique<NodeTree>();
+            slot.tree->ResetToPosition(
+                field_count == 4 ? slot.fen + " 0 1" : slot.fen, {});
+          } catch (Exception& e) {
+            result.error = e.what();
+            WriteResult(result, csv, output);
+            continue;
+          }
+          // There's nothing to search in a final position.
+          const auto game_result =
+              slot.tree->GetPositionHistory().ComputeGameResult();
+          if (game_result != GameResult::UNDECIDED) {
+            if (game_result == GameResult::DRAW) {
+              result.d = 1.0f;
+            } else {
+              // The side to move lost.
+              result.q = -1.0f;
+            }
+            WriteResult(result, csv, output);
+            ++analysed;
+            continue;
+          }
+          slot.search = std::make_unique<Search>(
+              *slot.tree, network.get(), [](const BestMoveInfo&) {},
+              [](const std::vector<ThinkingInfo>&) {}, limits, option_dict,
+              &cache, nullptr);
+          if (slot.worker) {
+            slot.worker->Reset(slot.search.get());
+          } else {
+            slot.worker = std::make_unique<SearchWorker>(
+                slot.search.get(), slot.search->GetParams());
+          }
+        }
+        if (!slot.search) continue;
+        searching = true;
+        const auto& params = slot.search->GetParams();
+        slot.worker->InitializeIteration(batcher.NewComputation(
+            params.GetMiniBatchSize() + params.GetMaxPrefetchBatch()));
+        slot.worker->GatherMinibatch();
+        slot.worker->MaybePrefetchIntoCache();
+      }
+      if (!searching) break;
+
+      batcher.ComputeBlocking();
+
+      // Use the results, and report the searches which are done.
+      for (auto& slot : slots) {
+        if (!slot.search) continue;
+        slot.worker->RunNNComputation();
+        slot.worker->FetchMinibatchResults();
+        slot.worker->DoBackupUpdate();
+        slot.worker->UpdateCounters();
+        if (slot.search->IsSearchActive()) continue;
+        Result result;
+        result.fen = slot.fen;
+        result.bestmove = slot.search->GetBestMove().first.as_string();
+        result.nodes = slot.search->GetTotalPlayouts();
+        std::tie(result.q, result.d) = slot.search->GetBestEval();
+        WriteResult(result, csv, output);
+        slot.search.reset();
+        slot.tree.reset();
+        ++analysed;
+      }
+    }
+    output->flush();
+
+    const std::chrono::duration<double> time =
+        std::chrono::steady_clock::now() - start;
+    CERR << "Analysed " << analysed << " positions in " << time.count()
+         << "s, " << analysed / time.count() << " per second.";
+  } catch (Exception& ex) {
+    std::cerr << ex.what() << std::endl;
+  }
+}
+
+}  // namespace lczero
@@ -0,0 +1,177 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2018-2019 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+
+  If you modify this Program, or any covered work, by linking or
+  combining it with NVIDIA Corporation's libraries from the NVIDIA CUDA
+  Toolkit and the NVIDIA CUDA Deep Neural Network library (or a
+  modified version of those libraries), containing parts covered by the
+  terms of the respective license agreement, the licensors of this
+  Program grant you additional permission to convey the resulting work.
+*/
+
+#include "benchmark/backendbench.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <random>
+#include <thread>
+#include "chess/position.h"
+#include "neural/encoder.h"
+#include "neural/factory.h"
+#include "utils/exception.h"
+#include "utils/optionsparser.h"
+#include "utils/string.h"
+
+namespace lczero {
+namespace {
+
+const OptionId kBatchSizesId{"batch-sizes", "",
+                             "Comma separated batch sizes to benchmark."};
+const OptionId kConcurrencyId{
+    "concurrency", "",
+    "Comma separated numbers of threads computing batches at the same time."};
+const OptionId kMovetimeId{
+    "movetime", "", "Time to benchmark every configuration, in milliseconds."};
+const OptionId kPositionsId{
+    "positions", "", "Number of different positions to feed the backend."};
+
+// Plies of the random games the positions are taken from.
+const int kMaxGamePly = 120;
+
+// Encodes @count positions along random games, always the same ones.
+std::vector<InputPlanes> EncodeRandomPositions(int count) {
+  std::vector<InputPlanes> planes;
+  std::mt19937 rng(42);
+  PositionHistory history;
+  while (static_cast<int>(planes.size()) < count) {
+    history.Reset(ChessBoard(ChessBoard::kStartposFen), 0, 1);
+    while (static_cast<int>(planes.size()) < count &&
+           history.GetLength() < kMaxGamePly &&
+           history.ComputeGameResult() == GameResult::UNDECIDED) {
+      planes.push_back(
+          EncodePositionForNN(history, 8, FillEmptyHistory::FEN_ONLY));
+      const auto moves = history.Last().GetBoard().GenerateLegalMoves();
+      history.Append(moves[rng() % moves.size()]);
+    }
+  }
+  return planes;
+}
+
+// Nearest-rank percentile of sorted @values.
+double Percentile(const std::vector<double>& values, double fraction) {
+  if (values.empty()) return 0.0;
+  const size_t rank = std::ceil(fraction * values.size());
+  return values[std::max<size_t>(rank, 1) - 1];
+}
+
+}  // namespace
+
+void BackendBenchmark::Run() {
+  OptionsParser options;
+  NetworkFactory::PopulateOptions(&options);
+  options.Add<StringOption>(kBatchSizesId) = "1,8,16,32,64,128,256,512";
+  options.Add<StringOption>(kConcurrencyId) = "1,2";
+  options.Add<IntOption>(kMovetimeId, 1, 999999999) = 3000;
+  options.Add<IntOption>(kPositionsId, 1, 1000000) = 4096;
+
+  if (!options.ProcessAllFlags()) return;
+
+  try {
+    auto option_dict = options.GetOptionsDict();
+    const auto batch_sizes =
+        ParseIntList(option_dict.Get<std::string>(kBatchSizesId.GetId()));
+    const auto concurrencies =
+        ParseIntList(option_dict.Get<std::string>(kConcurrencyId.GetId()));
+    for (const int x : batch_sizes) {
+      if (x < 1) throw Exception("Batch sizes must be positive");
+    }
+    for (const int x : concurrencies) {
+      if (x < 1) throw Exception("Concurrency must be positive");
+    }
+    const auto movetime = std::chrono::milliseconds(
+        option_dict.Get<int>(kMovetimeId.GetId()));
+    const auto planes =
+        EncodeRandomPositions(option_dict.Get<int>(kPositionsId.GetId()));
+
+    auto network = NetworkFactory::LoadNetwork(option_dict);
+
+    for (const int concurrency : concurrencies) {
+      for (const int batch_size : batch_sizes) {
+        std::mutex mutex;
+        // Milliseconds of every computation.
+        std::vector<double> latencies;
+        int64_t positions = 0;
+
+        // Lazy setup for this batch size happens before the clock starts.
+        auto warmup = network->NewComputation();
+        for (int i = 0; i < batch_size; ++i) {
+          warmup->AddInput(InputPlanes(planes[i % planes.size()]));
+        }
+        warmup->ComputeBlocking();
+
+        const auto start = std::chrono::steady_clock::now();
+        const auto deadline = start + movetime;
+        std::vector<std::thread> threads;
+        for (int t = 0; t < concurrency; ++t) {
+          threads.emplace_back([&, t]() {
+            std::vector<double> thread_latencies;
+            size_t next = t * batch_size;
+            while (std::chrono::steady_clock::now() < deadline) {
+              auto computation = network->NewComputation();
+              for (int i = 0; i < batch_size; ++i) {
+                computation->AddInput(
+                    InputPlanes(planes[next++ % planes.size()]));
+              }
+              const auto computation_start = std::chrono::steady_clock::now();
+              computation->ComputeBlocking();
+              const std::chrono::duration<double, std::milli> latency =
+                  std::chrono::steady_clock::now() - computation_start;
+              thread_latencies.push_back(latency.count());
+            }
+            std::lock_guard<std::mutex> lock(mutex);
+            latencies.insert(latencies.end(), thread_latencies.begin(),
+                             thread_latencies.end());
+            positions +=
+                static_cast<int64_t>(thread_latencies.size()) * batch_size;
+          });
+        }
+        for (auto& thread : threads) thread.join();
+        const std::chrono::duration<double> elapsed =
+            std::chrono::steady_clock::now() - start;
+
+        std::sort(latencies.begin(), latencies.end());
+        std::cout << "batch " << std::setw(4) << batch_size << ", concurrency "
+                  << concurrency << ": " << std::fixed << std::setprecision(0)
+                  << std::setw(8) << positions / elapsed.count()
+                  << " pos/s, latency p50 " << std::setprecision(3)
+                  << Percentile(latencies, 0.5) << "ms, p99 "
+                  << Percentile(latencies, 0.99) << "ms over "
+                  << latencies.size() << " batches" << std::endl;
+      }
+    }
+  } catch (Exception& ex) {
+    std::cerr << ex.what() << std::endl;
+  }
+}
+
+}  // namespace lczero
@@ -26,7 +26,22 @@
 */
 
 #include "benchmark/benchmark.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include "mcts/arena.h"
 #include "mcts/search.h"
+#include "utils/string.h"
+
+#if defined(__linux__) || defined(__APPLE__)
+#include <sys/resource.h>
+#endif
 
 namespace lczero {
 namespace {
@@ -39,9 +54,365 @@ const OptionId kNNCacheSizeId{
     "Number of positions to store in a memory cache. A large cache can speed "
     "up searching, but takes memory."};
 const OptionId kNodesId{"nodes", "", "Number of nodes to run as a benchmark."};
-const OptionId kMovetimeId{"movetime", "",
-                           "Benchmark time allocation, in milliseconds."};
-const OptionId kFenId{"fen", "", "Benchmark initial position FEN."};
+const OptionId kMovetimeId{
+    "movetime", "", "Time allocation of every search, in milliseconds."};
+const OptionId kFenId{
+    "fen", "", "Benchmark this position instead of the built-in suite."};
+const OptionId kEpdId{
+    "epd", "",
+    "EPD file with the positions to benchmark instead of the built-in suite."};
+const OptionId kSweepThreadsId{
+    "sweep-threads", "",
+    "Comma separated thread counts to benchmark, instead of --threads."};
+const OptionId kSweepMinibatchSizeId{
+    "sweep-minibatch-size", "",
+    "Comma separated minibatch sizes to benchmark, instead of "
+    "--minibatch-size."};
+const OptionId kWarmupId{
+    "warmup", "", "Untimed searches before the trials of every configuration."};
+const OptionId kTrialsId{
+    "trials", "",
+    "Number of times every configuration searches all positions."};
+const OptionId kJsonId{"json", "", "File to write the results to as JSON."};
+const OptionId kMemoryId{
+    "memory", "",
+    "Also report the memory use of every configuration: bytes per tree node "
+    "and per NN cache entry, node allocations, the garbage collector backlog "
+    "and peak RSS."};
+
+const char* const kPositions[] = {
+    // Openings.
+    "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1",
+    "r1bqkbnr/pppp1ppp/2n5/1B2p3/4P3/5N2/PPPP1PPP/RNBQK2R b KQkq - 3 3",
+    // Middlegames.
+    "r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 10",
+    "4rrk1/pp1n3p/3q2pQ/2p1pb2/2PP4/2P3N1/P2B2PP/4RRK1 b - - 7 19",
+    "rq3rk1/ppp2ppp/1bnpb3/3N2B1/3NP3/7P/PPPQ1PP1/2KR3R w - - 7 14",
+    "r1bq1r1k/1pp1n1pp/1p1p4/4p2Q/4Pp2/1BNP4/PPP2PPP/3R1RK1 w - - 2 14",
+    // Endgames.
+    "8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - - 0 11",
+    "6k1/6p1/6Pp/ppp5/3pn2P/1P3K2/1PP2P2/3N4 b - - 0 1",
+    "3b4/5kp1/1p1p1p1p/pP1PpP1P/P1P1P3/3KN3/8/8 w - - 0 1",
+};
+
+// Number of power of two batch size buckets, the last one takes the rest.
+const int kBatchBuckets = 12;
+
+// Passes computations through to the parent network, counting their batch
+// sizes. Bucket i holds batch sizes from 2^i to 2^(i+1)-1.
+class BatchCountingNetwork : public Network {
+ public:
+  BatchCountingNetwork(Network* parent) : parent_(parent) {}
+
+  std::unique_ptr<NetworkComputation> NewComputation() override;
+
+  void Record(int batch_size) {
+    if (batch_size <= 0) return;
+    int bucket = 0;
+    while (bucket + 1 < kBatchBuckets && (batch_size >> (bucket + 1))) {
+      ++bucket;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    ++counts_[bucket];
+  }
+
+  std::vector<int64_t> TakeCounts() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::vector<int64_t> counts(kBatchBuckets);
+    std::swap(counts, counts_);
+    return counts;
+  }
+
+ private:
+  Network* const parent_;
+  std::mutex mutex_;
+  std::vector<int64_t> counts_ = std::vector<int64_t>(kBatchBuckets);
+};
+
+class BatchCountingComputation : public NetworkComputation {
+ public:
+  BatchCountingComputation(BatchCountingNetwork* network,
+                           std::unique_ptr<NetworkComputation> parent)
+      : network_(network), parent_(std::move(parent)) {}
+
+  void AddInput(InputPlanes&& input) override {
+    parent_->AddInput(std::move(input));
+  }
+  void ComputeBlocking() override {
+    network_->Record(GetBatchSize());
+    parent_->ComputeBlocking();
+  }
+  void ComputeAsync(std::function<void()> callback) override {
+    network_->Record(GetBatchSize());
+    parent_->ComputeAsync(std::move(callback));
+  }
+  void CheckAsyncError() const override { parent_->CheckAsyncError(); }
+  int GetBatchSize() const override { return parent_->GetBatchSize(); }
+  float GetQVal(int sample) const override { return parent_->GetQVal(sample); }
+  float GetDVal(int sample) const override { return parent_->GetDVal(sample); }
+  float GetPVal(int sample, int move_id) const override {
+    return parent_->GetPVal(sample, move_id);
+  }
+
+ private:
+  BatchCountingNetwork* const network_;
+  std::unique_ptr<NetworkComputation> parent_;
+};
+
+std::unique_ptr<NetworkComputation> BatchCountingNetwork::NewComputation() {
+  return std::make_unique<BatchCountingComputation>(this,
+                                                    parent_->NewComputation());
+}
+
+std::string BucketName(int bucket) {
+  const int low = 1 << bucket;
+  if (bucket + 1 == kBatchBuckets) return std::to_string(low) + "+";
+  const int high = (1 << (bucket + 1)) - 1;
+  if (low == high) return std::to_string(low);
+  return std::to_string(low) + "-" + std::to_string(high);
+}
+
+// Reads the positions of an EPD file, EPD opcodes are ignored.
+std::vector<std::string> ReadEpd(const std::string& path) {
+  std::ifstream file(path);
+  if (!file) throw Exception("Unable to open " + path);
+  std::vector<std::string> fens;
+  std::string line;
+  while (std::getline(file, line)) {
+    std::istringstream iss(line);
+    std::string board, side, castlings, en_passant;
+    if (!(iss >> board) || board[0] == '#') continue;
+    if (!(iss >> side >> castlings >> en_passant)) {
+      throw Exception("Bad EPD: " + line);
+    }
+    fens.push_back(board + " " + side + " " + castlings + " " + en_passant +
+                   " 0 1");
+  }
+  if (fens.empty()) throw Exception("No positions in " + path);
+  return fens;
+}
+
+// Returns the peak resident set size of the process in bytes, 0 where it's
+// not known.
+uint64_t GetPeakRss() {
+#if defined(__linux__) || defined(__APPLE__)
+  rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+#ifdef __APPLE__
+  return usage.ru_maxrss;
+#else
+  return static_cast<uint64_t>(usage.ru_maxrss) * 1024;
+#endif
+#else
+  return 0;
+#endif
+}
+
+struct SearchResult {
+  int64_t playouts = 0;
+  double seconds = 0.0;
+};
+
+// Summed over the searches, as measured when each of them ends.
+struct MemoryResult {
+  uint64_t searches = 0;
+  uint64_t nodes = 0;
+  uint64_t edges = 0;
+  // Node arena bytes taken by the trees.
+  uint64_t tree_bytes = 0;
+  uint64_t allocations = 0;
+  uint64_t frees = 0;
+  uint64_t cache_entries = 0;
+  // Entries the caches have room for and the bytes preallocated for them.
+  uint64_t cache_capacity = 0;
+  uint64_t cache_bytes = 0;
+  // Released nodes the garbage collector had to free after each search, and
+  // the time it took.
+  uint64_t gc_backlog = 0;
+  double gc_seconds = 0.0;
+  uint64_t peak_rss = 0;
+};
+
+void CountTree(const Node* root, MemoryResult* memory) {
+  std::vector<const Node*> stack = {root};
+  while (!stack.empty()) {
+    const Node* node = stack.back();
+    stack.pop_back();
+    ++memory->nodes;
+    memory->edges += node->GetNumEdges();
+    for (const Node* child : node->ChildNodes()) stack.push_back(child);
+  }
+}
+
+struct ConfigResult {
+  int threads = 0;
+  int minibatch_size = 0;
+  // NPS of every trial, over all positions.
+  std::vector<double> trial_nps;
+  double nps_mean = 0.0;
+  double nps_stddev = 0.0;
+  uint64_t cache_hits = 0;
+  uint64_t cache_misses = 0;
+  std::vector<int64_t> batch_counts;
+  bool has_memory = false;
+  MemoryResult memory;
+};
+
+// With @memory, the search starts after the garbage collector is done with
+// the previous trees, so that the arena counts only its own.
+SearchResult RunSearch(const std::string& fen, Network* network,
+                       const OptionsDict& options, int threads,
+                       NNCache::Stats* cache_stats, MemoryResult* memory) {
+  if (memory) WaitForGc(std::chrono::seconds(60));
+  const auto bytes_before = NodeArena::GetBytesInUse();
+  const auto arena_before = NodeArena::GetStats();
+
+  auto tree = std::make_unique<NodeTree>();
+  tree->ResetToPosition(fen, {});
+  // A fresh cache every search, so that trials don't hit each others'.
+  NNCache cache;
+  cache.SetCapacity(options.Get<int>(kNNCacheSizeId.GetId()));
+
+  const auto start = std::chrono::steady_clock::now();
+  SearchLimits limits;
+  const int visits = options.Get<int>(kNodesId.GetId());
+  const int movetime = options.Get<int>(kMovetimeId.GetId());
+  if (movetime > -1) {
+    limits.search_deadline = start + std::chrono::milliseconds(movetime);
+  }
+  if (visits > -1) limits.visits = visits;
+
+  SearchResult result;
+  {
+    Search search(*tree, network, [](const BestMoveInfo&) {},
+                  [](const std::vector<ThinkingInfo>&) {}, limits, options,
+                  &cache, nullptr);
+    search.StartThreads(threads);
+    search.Wait();
+    const std::chrono::duration<double> time =
+        std::chrono::steady_clock::now() - start;
+    result = {search.GetTotalPlayouts(), time.count()};
+  }
+
+  if (cache_stats) {
+    const auto stats = cache.GetStats();
+    cache_stats->hits += stats.hits;
+    cache_stats->misses += stats.misses;
+  }
+  if (memory) {
+    const auto arena_after = NodeArena::GetStats();
+    ++memory->searches;
+    CountTree(tree->GetCurrentHead(), memory);
+    memory->tree_bytes += std::max<int64_t>(
+        0, static_cast<int64_t>(NodeArena::GetBytesInUse() - bytes_before));
+    memory->allocations += arena_after.allocations - arena_before.allocations;
+    memory->frees += arena_after.frees - arena_before.frees;
+    memory->cache_entries += cache.GetSize();
+    memory->cache_capacity += cache.GetCapacity();
+    memory->cache_bytes += cache.GetBytesAllocated();
+
+    tree.reset();
+    const auto gc_start = std::chrono::steady_clock::now();
+    memory->gc_backlog += GetGcBacklog();
+    WaitForGc(std::chrono::seconds(60));
+    const std::chrono::duration<double> gc_time =
+        std::chrono::steady_clock::now() - gc_start;
+    memory->gc_seconds += gc_time.count();
+  }
+  return result;
+}
+
+void PrintMemory(const MemoryResult& memory) {
+  const auto per = [](uint64_t total, uint64_t count) {
+    return count ? static_cast<double>(total) / count : 0.0;
+  };
+  std::cout << "  memory: " << std::fixed << std::setprecision(1)
+            << per(memory.tree_bytes, memory.nodes) << " bytes/node ("
+            << per(memory.edges, memory.nodes) << " edges/node, "
+            << per(memory.allocations, memory.nodes) << " allocations/node), "
+            << per(memory.cache_bytes, memory.cache_capacity)
+            << " bytes/cache entry ("
+            << per(memory.cache_entries, memory.searches)
+            << " entries filled), gc backlog "
+            << std::setprecision(0) << per(memory.gc_backlog, memory.searches)
+            << " nodes in " << std::setprecision(1)
+            << 1000.0 * per(memory.gc_seconds, memory.searches)
+            << " ms, peak RSS " << memory.peak_rss / (1024.0 * 1024.0)
+            << " MB" << std::endl;
+}
+
+void PrintResult(const ConfigResult& result) {
+  std::cout << "threads " << result.threads << ", minibatch-size "
+            << result.minibatch_size << ": " << std::fixed
+            << std::setprecision(0) << result.nps_mean << " +- "
+            << result.nps_stddev << " nps over " << result.trial_nps.size()
+            << " trials";
+  const uint64_t lookups = result.cache_hits + result.cache_misses;
+  if (lookups) {
+    std::cout << ", cache hits " << std::setprecision(1)
+              << 100.0 * result.cache_hits / lookups << "%";
+  }
+  std::cout << std::endl << "  batch sizes:";
+  const char* delim = " ";
+  for (int i = 0; i < kBatchBuckets; ++i) {
+    if (result.batch_counts[i] == 0) continue;
+    std::cout << delim << BucketName(i) << ": " << result.batch_counts[i];
+    delim = ", ";
+  }
+  std::cout << std::endl;
+  if (result.has_memory) PrintMemory(result.memory);
+  std::cout << std::defaultfloat << std::setprecision(6);
+}
+
+void WriteJson(const std::string& path, const std::vector<std::string>& fens,
+               const std::vector<ConfigResult>& results) {
+  std::ofstream file(path);
+  if (!file) throw Exception("Unable to write " + path);
+  file << "{\n  \"positions\": [";
+  for (size_t i = 0; i < fens.size(); ++i) {
+    file << (i ? ", " : "") << "\"" << fens[i] << "\"";
+  }
+  file << "],\n  \"configurations\": [";
+  for (size_t i = 0; i < results.size(); ++i) {
+    const auto& result = results[i];
+    const uint64_t lookups = result.cache_hits + result.cache_misses;
+    file << (i ? "," : "") << "\n    {\"threads\": " << result.threads
+         << ", \"minibatch_size\": " << result.minibatch_size
+         << ", \"nps_mean\": " << result.nps_mean
+         << ", \"nps_stddev\": " << result.nps_stddev << ", \"trial_nps\": [";
+    for (size_t j = 0; j < result.trial_nps.size(); ++j) {
+      file << (j ? ", " : "") << result.trial_nps[j];
+    }
+    file << "], \"cache_hit_rate\": "
+         << (lookups ? static_cast<double>(result.cache_hits) / lookups : 0.0)
+         << ", \"batch_sizes\": {";
+    bool first = true;
+    for (int j = 0; j < kBatchBuckets; ++j) {
+      if (result.batch_counts[j] == 0) continue;
+      file << (first ? "" : ", ") << "\"" << BucketName(j)
+           << "\": " << result.batch_counts[j];
+      first = false;
+    }
+    file << "}";
+    if (result.has_memory) {
+      const auto& memory = result.memory;
+      file << ", \"memory\": {\"searches\": " << memory.searches
+           << ", \"nodes\": " << memory.nodes
+           << ", \"edges\": " << memory.edges
+           << ", \"tree_bytes\": " << memory.tree_bytes
+           << ", \"allocations\": " << memory.allocations
+           << ", \"frees\": " << memory.frees
+           << ", \"cache_entries\": " << memory.cache_entries
+           << ", \"cache_capacity\": " << memory.cache_capacity
+           << ", \"cache_bytes\": " << memory.cache_bytes
+           << ", \"gc_backlog\": " << memory.gc_backlog
+           << ", \"gc_seconds\": " << memory.gc_seconds
+           << ", \"peak_rss\": " << memory.peak_rss << "}";
+    }
+    file << "}";
+  }
+  file << "\n  ]\n}\n";
+}
 
 }  // namespace
 
@@ -53,64 +424,108 @@ void Benchmark::Run() {
   SearchParams::Populate(&options);
 
   options.Add<IntOption>(kNodesId, -1, 999999999) = -1;
-  options.Add<IntOption>(kMovetimeId, -1, 999999999) = 10000;
-  options.Add<StringOption>(kFenId) = ChessBoard::kStartposFen;
+  options.Add<IntOption>(kMovetimeId, -1, 999999999) = 1000;
+  options.Add<StringOption>(kFenId);
+  options.Add<StringOption>(kEpdId);
+  options.Add<StringOption>(kSweepThreadsId);
+  options.Add<StringOption>(kSweepMinibatchSizeId);
+  options.Add<IntOption>(kWarmupId, 0, 1000) = 1;
+  options.Add<IntOption>(kTrialsId, 1, 1000) = 3;
+  options.Add<StringOption>(kJsonId);
+  options.Add<BoolOption>(kMemoryId) = false;
 
   if (!options.ProcessAllFlags()) return;
 
   try {
     auto option_dict = options.GetOptionsDict();
 
-    auto network = NetworkFactory::LoadNetwork(option_dict);
-
-    NodeTree tree;
-    tree.ResetToPosition(option_dict.Get<std::string>(kFenId.GetId()), {});
+    std::vector<std::string> fens;
+    const auto fen = option_dict.Get<std::string>(kFenId.GetId());
+    const auto epd = option_dict.Get<std::string>(kEpdId.GetId());
+    if (!fen.empty()) {
+      fens.push_back(fen);
+    } else if (!epd.empty()) {
+      fens = ReadEpd(epd);
+    } else {
+      for (const auto position : kPositions) fens.push_back(position);
+    }
 
-    NNCache cache;
-    cache.SetCapacity(option_dict.Get<int>(kNNCacheSizeId.GetId()));
+    const auto sweep_threads =
+        option_dict.Get<std::string>(kSweepThreadsId.GetId());
+    const std::vector<int> thread_counts =
+        sweep_threads.empty()
+            ? std::vector<int>{option_dict.Get<int>(kThreadsOptionId.GetId())}
+            : ParseIntList(sweep_threads);
+    const auto sweep_minibatch =
+        option_dict.Get<std::string>(kSweepMinibatchSizeId.GetId());
+    const std::vector<int> minibatch_sizes =
+        sweep_minibatch.empty()
+            ? std::vector<int>{option_dict.Get<int>(
+                  SearchParams::kMiniBatchSizeId.GetId())}
+            : ParseIntList(sweep_minibatch);
+    const int warmup = option_dict.Get<int>(kWarmupId.GetId());
+    const int trials = option_dict.Get<int>(kTrialsId.GetId());
+    const bool memory = option_dict.Get<bool>(kMemoryId.GetId());
 
-    const auto start = std::chrono::steady_clock::now();
+    auto network = NetworkFactory::LoadNetwork(option_dict);
+    BatchCountingNetwork counting_network(network.get());
 
-    SearchLimits limits;
-    int visits = option_dict.Get<int>(kNodesId.GetId());
-    const int movetime = option_dict.Get<int>(kMovetimeId.GetId());
-    if (movetime > -1) {
-      limits.search_deadline = start + std::chrono::milliseconds(movetime);
-    }
-    if (visits > -1) {
-        limits.visits = visits;
-    }
+    std::vector<ConfigResult> results;
+    for (const int threads : thread_counts) {
+      for (const int minibatch_size : minibatch_sizes) {
+        if (threads < 1 || minibatch_size < 1) {
+          throw Exception("Thread counts and minibatch sizes must be positive");
+        }
+        OptionsDict config(&option_dict);
+        config.Set<int>(SearchParams::kMiniBatchSizeId.GetId(),
+                        minibatch_size);
 
-    auto search = std::make_unique<Search>(
-        tree, network.get(),
-        std::bind(&Benchmark::OnBestMove, this, std::placeholders::_1),
-        std::bind(&Benchmark::OnInfo, this, std::placeholders::_1), limits,
-        option_dict, &cache, nullptr);
+        for (int i = 0; i < warmup; ++i) {
+          RunSearch(fens[i % fens.size()], network.get(), config, threads,
+                    nullptr, nullptr);
+        }
 
-    search->StartThreads(option_dict.Get<int>(kThreadsOptionId.GetId()));
+        ConfigResult result;
+        result.threads = threads;
+        result.minibatch_size = minibatch_size;
+        result.has_memory = memory;
+        NNCache::Stats cache_stats;
+        counting_network.TakeCounts();
+        for (int trial = 0; trial < trials; ++trial) {
+          SearchResult total;
+          for (const auto& position : fens) {
+            const auto search =
+                RunSearch(position, &counting_network, config, threads,
+                          &cache_stats, memory ? &result.memory : nullptr);
+            total.playouts += search.playouts;
+            total.seconds += search.seconds;
+          }
+          result.trial_nps.push_back(total.playouts / total.seconds);
+        }
+        result.batch_counts = counting_network.TakeCounts();
+        result.cache_hits = cache_stats.hits;
+        result.cache_misses = cache_stats.misses;
+        result.memory.peak_rss = GetPeakRss();
 
-    search->Wait();
+        for (const double nps : result.trial_nps) result.nps_mean += nps;
+        result.nps_mean /= trials;
+        if (trials > 1) {
+          double variance = 0.0;
+          for (const double nps : result.trial_nps) {
+            variance += (nps - result.nps_mean) * (nps - result.nps_mean);
+          }
+          result.nps_stddev = std::sqrt(variance / (trials - 1));
+        }
+        PrintResult(result);
+        results.push_back(result);
+      }
+    }
 
-    const auto end = std::chrono::steady_clock::now();
-    std::chrono::duration<double> time = end - start;
-    std::cout << "Benchmark final time " << time.count() << "s calculating "
-              << search->GetTotalPlayouts() / time.count()
-              << " nodes per second." << std::endl;
+    const auto json = option_dict.Get<std::string>(kJsonId.GetId());
+    if (!json.empty()) WriteJson(json, fens, results);
   } catch (Exception& ex) {
     std::cerr << ex.what() << std::endl;
   }
 }
 
-void Benchmark::OnBestMove(const BestMoveInfo& move) {
-  std::cout << "bestmove " << move.bestmove.as_string() << std::endl;
-}
-
-void Benchmark::OnInfo(const std::vector<ThinkingInfo>& infos) {
-  std::string line = "Benchmark time " + std::to_string(infos[0].time);
-  line += "ms, " + std::to_string(infos[0].nodes) + " nodes, ";
-  line += std::to_string(infos[0].nps) + " nps";
-  if (!infos[0].pv.empty()) line += ", move " + infos[0].pv[0].as_string();
-  std::cout << line << std::endl;
-}
-
 }  // namespace lczero
@@ -34,13 +34,17 @@
 
 namespace lczero {
 
-class Benchmark{
+// Searches a set of positions, the built-in suite or the given ones, with
+// every combination of the swept thread counts and minibatch sizes. Each
+// configuration gets warm-up searches and then repeated trials, and is
+// reported with its NPS mean and deviation, NN cache hit rate and batch size
+// histogram, with --memory its bytes per node and per cache entry, and
+// optionally also as JSON.
+class Benchmark {
  public:
   Benchmark() = default;
 
   void Run();
-  void OnBestMove(const BestMoveInfo& move);
-  void OnInfo(const std::vector<ThinkingInfo>& infos);
 };
 
 }  // namespace lczero
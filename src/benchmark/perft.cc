@@ -0,0 +1,248 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2018 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+
+  If you modify this Program, or any covered work, by linking or
+  combining it with NVIDIA Corporation's libraries from the NVIDIA CUDA
+  Toolkit and the NVIDIA CUDA Deep Neural Network library (or a
+  modified version of those libraries), containing parts covered by the
+  terms of the respective license agreement, the licensors of this
+  Program grant you additional permission to convey the resulting work.
+*/
+
+#include "benchmark/perft.h"
+
+#include <atomic>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <thread>
+#include <vector>
+#include "chess/board.h"
+#include "utils/exception.h"
+#include "utils/hashcat.h"
+#include "utils/optionsparser.h"
+
+namespace lczero {
+namespace {
+
+const OptionId kFenId{"fen", "",
+                      "Position to count, instead of the standard suite."};
+const OptionId kDepthId{
+    "depth", "", "Depth to count to, 0 for the depths of the standard suite."};
+const OptionId kThreadsId{"threads", "",
+                          "Number of threads splitting the root moves."};
+const OptionId kHashId{"hash", "",
+                       "Size of the perft hash table in MiB, 0 to disable."};
+const OptionId kQuickId{"quick", "",
+                        "Use the shallow depths of the standard suite."};
+
+struct PerftPosition {
+  const char* name;
+  const char* fen;
+  int quick_depth;
+  uint64_t quick_nodes;
+  int depth;
+  uint64_t nodes;
+};
+
+// Positions and counts from the Chess Programming Wiki.
+const PerftPosition kPositions[] = {
+    {"startpos", ChessBoard::kStartposFen, 5, 4865609, 6, 119060324},
+    {"kiwipete",
+     "r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 1", 4,
+     4085603, 5, 193690690},
+    {"position3", "8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - - 0 1", 5, 674624, 7,
+     178633661},
+    {"position4",
+     "r2q1rk1/pP1p2pp/Q4n2/bbp1p3/Np6/1B3NBn/pPPP1PPP/R3K2R b KQ - 0 1", 4,
+     422333, 5, 15833292},
+    {"position5", "rnbq1k1r/pp1Pbppp/2p5/8/2B5/8/PPP1NnPP/RNBQK2R w KQ - 1 8",
+     4, 2103487, 5, 89941194},
+    {"position6",
+     "r4rk1/1pp1qppp/p1np1n2/2b1p1B1/2B1P1b1/P1NP1N2/1PP1QPPP/R4RK1 w - - 0 "
+     "10",
+     4, 3894594, 5, 164075551},
+};
+
+// Replace always table of subtree counts, shared by the threads without
+// locks. The key is stored xored with the count, so that a torn entry
+// written by two threads at once doesn't match.
+class PerftHashTable {
+ public:
+  explicit PerftHashTable(size_t megabytes) {
+    size_t size = 1;
+    while (size * 2 * sizeof(Entry) <= megabytes << 20) size *= 2;
+    entries_.reset(new Entry[size]);
+    mask_ = size - 1;
+  }
+
+  bool Probe(uint64_t key, uint64_t* nodes) const {
+    const Entry& entry = entries_[key & mask_];
+    const uint64_t count = entry.nodes.load(std::memory_order_relaxed);
+    if ((entry.key.load(std::memory_order_relaxed) ^ count) != key) {
+      return false;
+    }
+    *nodes = count;
+    return true;
+  }
+
+  void Store(uint64_t key, uint64_t nodes) {
+    Entry& entry = entries_[key & mask_];
+    entry.key.store(key ^ nodes, std::memory_order_relaxed);
+    entry.nodes.store(nodes, std::memory_order_relaxed);
+  }
+
+ private:
+  struct Entry {
+    std::atomic<uint64_t> key{0};
+    std::atomic<uint64_t> nodes{0};
+  };
+
+  std::unique_ptr<Entry[]> entries_;
+  size_t mask_;
+};
+
+uint64_t Perft(const ChessBoard& board, int depth, PerftHashTable* table) {
+  FixedMoveList moves;
+  board.GenerateLegalMoves(&moves);
+  // Leaves are counted, not visited.
+  if (depth == 1) return moves.size();
+  const uint64_t key = table ? HashCat(board.Hash(), depth) : 0;
+  uint64_t nodes = 0;
+  if (table && table->Probe(key, &nodes)) return nodes;
+  for (const Move move : moves) {
+    ChessBoard child = board;
+    child.ApplyMove(move);
+    child.Mirror();
+    nodes += Perft(child, depth - 1, table);
+  }
+  if (table) table->Store(key, nodes);
+  return nodes;
+}
+
+// Root moves are handed out to @threads threads one by one.
+uint64_t ParallelPerft(const ChessBoard& board, int depth, int threads,
+                       PerftHashTable* table) {
+  if (depth == 0) return 1;
+  if (threads == 1 || depth == 1) return Perft(board, depth, table);
+  FixedMoveList moves;
+  board.GenerateLegalMoves(&moves);
+  std::atomic<size_t> next{0};
+  std::atomic<uint64_t> nodes{0};
+  std::vector<std::thread> workers;
+  for (int i = 0; i < threads; ++i) {
+    workers.emplace_back([&]() {
+      uint64_t thread_nodes = 0;
+      for (size_t idx = next++; idx < moves.size(); idx = next++) {
+        ChessBoard child = board;
+        child.ApplyMove(moves[idx]);
+        child.Mirror();
+        thread_nodes += Perft(child, depth - 1, table);
+      }
+      nodes += thread_nodes;
+    });
+  }
+  for (auto& worker : workers) worker.join();
+  return nodes;
+}
+
+}  // namespace
+
+bool PerftBenchmark::Run() {
+  OptionsParser options;
+  options.Add<StringOption>(kFenId);
+  options.Add<IntOption>(kDepthId, 0, 20) = 0;
+  options.Add<IntOption>(kThreadsId, 1, 256) = 1;
+  options.Add<IntOption>(kHashId, 0, 65536) = 0;
+  options.Add<BoolOption>(kQuickId) = false;
+
+  if (!options.ProcessAllFlags()) return false;
+
+  try {
+    auto option_dict = options.GetOptionsDict();
+    const std::string fen = option_dict.Get<std::string>(kFenId.GetId());
+    const int depth_override = option_dict.Get<int>(kDepthId.GetId());
+    const int threads = option_dict.Get<int>(kThreadsId.GetId());
+    const int hash_mb = option_dict.Get<int>(kHashId.GetId());
+    const bool quick = option_dict.Get<bool>(kQuickId.GetId());
+
+    std::vector<PerftPosition> suite;
+    if (fen.empty()) {
+      suite.assign(std::begin(kPositions), std::end(kPositions));
+    } else {
+      // Nothing to check against.
+      suite.push_back({"fen", fen.c_str(), 0, 0, 0, 0});
+    }
+
+    // A table shared by the whole suite would look up positions of earlier
+    // runs and flatten the timings, so each position gets a fresh one.
+    bool ok = true;
+    uint64_t total_nodes = 0;
+    double total_seconds = 0;
+    for (const auto& position : suite) {
+      int depth = quick ? position.quick_depth : position.depth;
+      uint64_t expected = quick ? position.quick_nodes : position.nodes;
+      if (depth_override > 0 && depth_override != depth) {
+        depth = depth_override;
+        expected = 0;
+      }
+      if (depth == 0) depth = 5;
+
+      ChessBoard board;
+      board.SetFromFen(position.fen);
+      std::unique_ptr<PerftHashTable> table;
+      if (hash_mb > 0) table = std::make_unique<PerftHashTable>(hash_mb);
+
+      const auto start = std::chrono::steady_clock::now();
+      const uint64_t nodes =
+          ParallelPerft(board, depth, threads, table.get());
+      const std::chrono::duration<double> elapsed =
+          std::chrono::steady_clock::now() - start;
+      total_nodes += nodes;
+      total_seconds += elapsed.count();
+
+      std::cout << std::left << std::setw(10) << position.name << std::right
+                << " depth " << depth << ": " << std::setw(10) << nodes
+                << " nodes " << std::fixed << std::setprecision(3)
+                << std::setw(8) << elapsed.count() << "s " << std::setw(9)
+                << std::setprecision(0) << nodes / elapsed.count()
+                << " nps";
+      if (expected) {
+        if (nodes == expected) {
+          std::cout << " ok";
+        } else {
+          std::cout << " MISMATCH, expected " << expected;
+          ok = false;
+        }
+      }
+      std::cout << std::endl;
+    }
+    std::cout << "Total: " << total_nodes << " nodes in " << std::fixed
+              << std::setprecision(3) << total_seconds << "s, "
+              << std::setprecision(0) << total_nodes / total_seconds << " nps"
+              << std::endl;
+    return ok;
+  } catch (Exception& ex) {
+    std::cerr << ex.what() << std::endl;
+    return false;
+  }
+}
+
+}  // namespace lczero
@@ -0,0 +1,348 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2019 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+
+  If you modify this Program, or any covered work, by linking or
+  combining it with NVIDIA Corporation's libraries from the NVIDIA CUDA
+  Toolkit and the NVIDIA CUDA Deep Neural Network library (or a
+  modified version of those libraries), containing parts covered by the
+  terms of the respective license agreement, the licensors of this
+  Program grant you additional permission to convey the resulting work.
+*/
+
+#include "benchmark/testsuite.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include "mcts/search.h"
+#include "neural/cache.h"
+#include "neural/factory.h"
+#include "selfplay/openings.h"
+#include "utils/exception.h"
+#include "utils/optionsparser.h"
+#include "utils/string.h"
+
+namespace lczero {
+namespace {
+const OptionId kEpdId{"epd", "",
+                      "EPD file of the suite, with \"bm\" or \"am\" "
+                      "operations."};
+const OptionId kThreadsOptionId{"threads", "Threads",
+                                "Number of (CPU) worker threads of every "
+                                "search.",
+                                't'};
+const OptionId kParallelismId{"parallelism", "",
+                              "Number of positions searched at the same "
+                              "time."};
+const OptionId kNNCacheSizeId{
+    "nncache", "NNCacheSize",
+    "Number of positions to store in the memory cache of every search."};
+const OptionId kNodesId{"nodes", "", "Number of visits of every search."};
+const OptionId kMovetimeId{
+    "movetime", "", "Time allocation of every search, in milliseconds."};
+const OptionId kJsonId{"json", "", "File to write the results to as JSON."};
+
+struct SuitePosition {
+  std::string fen;
+  std::string id;
+  // In the notation of the search, from white's point of view.
+  std::vector<Move> best_moves;
+  std::vector<Move> avoid_moves;
+};
+
+struct PositionResult {
+  bool solved = false;
+  // Visits and milliseconds into the search when the best move became a
+  // solution the last time.
+  int64_t nodes = 0;
+  int64_t time = 0;
+  Move bestmove;
+  int64_t total_nodes = 0;
+  int64_t total_time = 0;
+  std::string error;
+};
+
+// Parses a line of an EPD file, which has the first four fields of a FEN and
+// then operations separated by semicolons. Returns false for lines to skip.
+bool ParseEpdLine(const std::string& line, SuitePosition* position) {
+  std::istringstream iss(line);
+  std::string board, side, castlings, en_passant;
+  if (!(iss >> board) || board[0] == '#') return false;
+  if (!(iss >> side >> castlings >> en_passant)) {
+    throw Exception("Bad EPD: " + line);
+  }
+  position->fen =
+      board + " " + side + " " + castlings + " " + en_passant + " 0 1";
+  std::string operations;
+  std::getline(iss, operations);
+
+  ChessBoard chess_board;
+  chess_board.SetFromFen(position->fen);
+  const bool black_to_move = chess_board.flipped();
+  for (const auto& operation : StrSplit(operations, ";")) {
+    auto operands = StrSplitAtWhitespace(operation);
+    if (operands.empty()) continue;
+    const auto opcode = operands.front();
+    operands.erase(operands.begin());
+    if (opcode == "id") {
+      position->id = Trim(StrJoin(operands));
+      position->id.erase(
+          std::remove(position->id.begin(), position->id.end(), '"'),
+          position->id.end());
+    } else if (opcode == "bm" || opcode == "am") {
+      auto* moves =
+          opcode == "bm" ? &position->best_moves : &position->avoid_moves;
+      for (const auto& san : operands) {
+        Move move = ParseSanMove(chess_board, san);
+        if (black_to_move) move.Mirror();
+        moves->push_back(move);
+      }
+    }
+  }
+  if (position->best_moves.empty() && position->avoid_moves.empty()) {
+    throw Exception("No bm or am operation: " + line);
+  }
+  if (position->id.empty()) position->id = position->fen;
+  return true;
+}
+
+std::vector<SuitePosition> ReadSuite(const std::string& path) {
+  std::ifstream file(path);
+  if (!file) throw Exception("Unable to open " + path);
+  std::vector<SuitePosition> positions;
+  std::string line;
+  while (std::getline(file, line)) {
+    SuitePosition position;
+    if (ParseEpdLine(line, &position)) positions.push_back(position);
+  }
+  if (positions.empty()) throw Exception("No positions in " + path);
+  return positions;
+}
+
+bool IsSolution(const SuitePosition& position, Move move) {
+  const auto contains = [move](const std::vector<Move>& moves) {
+    return std::find(moves.begin(), moves.end(), move) != moves.end();
+  };
+  if (!position.best_moves.empty() && !contains(position.best_moves)) {
+    return false;
+  }
+  return !contains(position.avoid_moves);
+}
+
+PositionResult SearchPosition(const SuitePosition& position, Network* network,
+                              const OptionsDict& options, int threads) {
+  PositionResult result;
+  NodeTree tree;
+  tree.ResetToPosition(position.fen, {});
+  NNCache cache;
+  cache.SetCapacity(options.Get<int>(kNNCacheSizeId.GetId()));
+
+  SearchLimits limits;
+  const int visits = options.Get<int>(kNodesId.GetId());
+  const int movetime = options.Get<int>(kMovetimeId.GetId());
+  if (visits > -1) limits.visits = visits;
+  const auto start = std::chrono::steady_clock::now();
+  if (movetime > -1) {
+    limits.search_deadline = start + std::chrono::milliseconds(movetime);
+  }
+
+  // Infos are sent whenever the best move changes, their first line starts
+  // with it.
+  std::mutex mutex;
+  bool solved = false;
+  auto info_callback = [&](const std::vector<ThinkingInfo>& infos) {
+    if (infos.empty() || infos.front().pv.empty()) return;
+    const auto& info = infos.front();
+    std::lock_guard<std::mutex> lock(mutex);
+    const bool solution = IsSolution(position, info.pv.front());
+    if (solution && !solved) {
+      result.nodes = info.nodes;
+      result.time = info.time;
+    }
+    solved = solution;
+  };
+  Search search(tree, network, [](const BestMoveInfo&) {}, info_callback,
+                limits, options, &cache, nullptr);
+  search.StartThreads(threads);
+  search.Wait();
+  const std::chrono::duration<double, std::milli> time =
+      std::chrono::steady_clock::now() - start;
+
+  result.bestmove = search.GetBestMove().first;
+  result.total_nodes = search.GetTotalPlayouts();
+  result.total_time = static_cast<int64_t>(time.count());
+  result.solved = IsSolution(position, result.bestmove);
+  // Solved without an info on the way, i.e. from the very first visits.
+  if (result.solved && !solved) {
+    result.nodes = 0;
+    result.time = 0;
+  }
+  return result;
+}
+
+void PrintResult(const SuitePosition& position, const PositionResult& result) {
+  std::cout << position.id << ": ";
+  if (!result.error.empty()) {
+    std::cout << "error, " << result.error << std::endl;
+  } else if (result.solved) {
+    std::cout << "solved after " << result.nodes << " nodes, " << result.time
+              << " ms" << std::endl;
+  } else {
+    std::cout << "not solved, " << result.bestmove.as_string() << " after "
+              << result.total_nodes << " nodes" << std::endl;
+  }
+}
+
+// Median of @values, which it sorts.
+int64_t Median(std::vector<int64_t>* values) {
+  if (values->empty()) return 0;
+  std::sort(values->begin(), values->end());
+  return (*values)[values->size() / 2];
+}
+
+void WriteJson(const std::string& path,
+               const std::vector<SuitePosition>& positions,
+               const std::vector<PositionResult>& results,
+               const std::string& summary) {
+  std::ofstream file(path);
+  if (!file) throw Exception("Unable to write " + path);
+  file << "{\n  \"positions\": [";
+  for (size_t i = 0; i < positions.size(); ++i) {
+    const auto& position = positions[i];
+    const auto& result = results[i];
+    // Ids and exception messages have no quotes or backslashes left, but
+    // the FEN that an error quotes.
+    std::string error = result.error;
+    for (auto& c : error) {
+      if (c == '"' || c == '\\') c = '\'';
+    }
+    file << (i ? "," : "") << "\n    {\"id\": \"" << position.id
+         << "\", \"fen\": \"" << position.fen << "\"";
+    if (!error.empty()) {
+      file << ", \"error\": \"" << error << "\"}";
+      continue;
+    }
+    file << ", \"solved\": " << (result.solved ? "true" : "false")
+         << ", \"bestmove\": \"" << result.bestmove.as_string() << "\"";
+    if (result.solved) {
+      file << ", \"nodes\": " << result.nodes << ", \"time\": " << result.time;
+    }
+    file << ", \"total_nodes\": " << result.total_nodes
+         << ", \"total_time\": " << result.total_time << "}";
+  }
+  file << "\n  ],\n  \"summary\": " << summary << "\n}\n";
+}
+
+}  // namespace
+
+void TestSuite::Run() {
+  OptionsParser options;
+  NetworkFactory::PopulateOptions(&options);
+  options.Add<IntOption>(kThreadsOptionId, 1, 128) = 2;
+  options.Add<IntOption>(kNNCacheSizeId, 0, 999999999) = 200000;
+  SearchParams::Populate(&options);
+
+  options.Add<StringOption>(kEpdId);
+  options.Add<IntOption>(kParallelismId, 1, 256) = 1;
+  options.Add<IntOption>(kNodesId, -1, 999999999) = -1;
+  options.Add<IntOption>(kMovetimeId, -1, 999999999) = 10000;
+  options.Add<StringOption>(kJsonId);
+
+  if (!options.ProcessAllFlags()) return;
+
+  try {
+    auto option_dict = options.GetOptionsDict();
+    const auto epd = option_dict.Get<std::string>(kEpdId.GetId());
+    if (epd.empty()) throw Exception("An --epd file is needed");
+    const auto positions = ReadSuite(epd);
+    if (option_dict.Get<int>(kNodesId.GetId()) < 0 &&
+        option_dict.Get<int>(kMovetimeId.GetId()) < 0) {
+      throw Exception("Searches need a --nodes or --movetime budget");
+    }
+    const int threads = option_dict.Get<int>(kThreadsOptionId.GetId());
+    const int parallelism = std::min<int>(
+        option_dict.Get<int>(kParallelismId.GetId()), positions.size());
+
+    auto network = NetworkFactory::LoadNetwork(option_dict);
+
+    // The searches running at once are fed by the same network, so that
+    // their batches can be combined by a multiplexing backend.
+    std::vector<PositionResult> results(positions.size());
+    std::atomic<size_t> next{0};
+    std::mutex output_mutex;
+    std::vector<std::thread> workers;
+    for (int i = 0; i < parallelism; ++i) {
+      workers.emplace_back([&]() {
+        for (size_t index = next++; index < positions.size();
+             index = next++) {
+          auto& result = results[index];
+          try {
+            result = SearchPosition(positions[index], network.get(),
+                                    option_dict, threads);
+          } catch (Exception& ex) {
+            result.error = ex.what();
+          }
+          std::lock_guard<std::mutex> lock(output_mutex);
+          PrintResult(positions[index], result);
+        }
+      });
+    }
+    for (auto& worker : workers) worker.join();
+
+    int solved = 0;
+    std::vector<int64_t> nodes;
+    std::vector<int64_t> times;
+    for (const auto& result : results) {
+      if (!result.solved) continue;
+      ++solved;
+      nodes.push_back(result.nodes);
+      times.push_back(result.time);
+    }
+    int64_t total_time = 0;
+    for (const auto time : times) total_time += time;
+    const int64_t mean_time = solved ? total_time / solved : 0;
+    const int64_t median_nodes = Median(&nodes);
+    const int64_t median_time = Median(&times);
+    std::cout << "Solved " << solved << " of " << positions.size()
+              << ", median " << median_nodes << " nodes and " << median_time
+              << " ms, mean " << mean_time << " ms to the solution."
+              << std::endl;
+
+    const auto json = option_dict.Get<std::string>(kJsonId.GetId());
+    if (!json.empty()) {
+      std::ostringstream summary;
+      summary << "{\"solved\": " << solved
+              << ", \"total\": " << positions.size()
+              << ", \"median_nodes\": " << median_nodes
+              << ", \"median_time\": " << median_time
+              << ", \"mean_time\": " << mean_time << "}";
+      WriteJson(json, positions, results, summary.str());
+    }
+  } catch (Exception& ex) {
+    std::cerr << ex.what() << std::endl;
+  }
+}
+
+}  // namespace lczero
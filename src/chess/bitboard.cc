@@ -32,7 +32,8 @@ namespace lczero {
 
 namespace {
 
-const Move kIdxToMove[] = {
+// Moves in the order of their NN indices.
+constexpr const char* kIdxToMove[] = {
     "a1b1",  "a1c1",  "a1d1",  "a1e1",  "a1f1",  "a1g1",  "a1h1",  "a1a2",
     "a1b2",  "a1c2",  "a1a3",  "a1b3",  "a1c3",  "a1a4",  "a1d4",  "a1a5",
     "a1e5",  "a1a6",  "a1f6",  "a1a7",  "a1g7",  "a1a8",  "a1h8",  "b1a1",
@@ -267,19 +268,41 @@ const Move kIdxToMove[] = {
     "g7g8b", "g7h8q", "g7h8r", "g7h8b", "h7g8q", "h7g8r", "h7g8b", "h7h8q",
     "h7h8r", "h7h8b"};
 
-std::vector<unsigned short> BuildMoveIndices() {
-  std::vector<unsigned short> res(4 * 64 * 64);
+// Returns a move of kIdxToMove packed like Move::as_packed_int().
+constexpr uint16_t PackMove(const char* str) {
+  const int from = (str[1] - '1') * 8 + (str[0] - 'a');
+  const int to = (str[3] - '1') * 8 + (str[2] - 'a');
+  int promotion = 0;
+  switch (str[4]) {
+    case 'q':
+      promotion = static_cast<int>(Move::Promotion::Queen);
+      break;
+    case 'r':
+      promotion = static_cast<int>(Move::Promotion::Rook);
+      break;
+    case 'b':
+      promotion = static_cast<int>(Move::Promotion::Bishop);
+      break;
+  }
+  return promotion * 64 * 64 + from * 64 + to;
+}
+
+struct MoveIndices {
+  uint16_t idx[4 * 64 * 64];
+};
+
+// Built at compile time, so that it's in read-only data.
+constexpr MoveIndices BuildMoveIndices() {
+  MoveIndices res{};
   for (size_t i = 0; i < sizeof(kIdxToMove) / sizeof(kIdxToMove[0]); ++i) {
-    res[kIdxToMove[i].as_packed_int()] = i;
+    res.idx[PackMove(kIdxToMove[i])] = i;
   }
   return res;
 }
 
-const std::vector<unsigned short> kMoveToIdx = BuildMoveIndices();
-const int kKingCastleIndex =
-    kMoveToIdx[BoardSquare("e1").as_int() * 64 + BoardSquare("h1").as_int()];
-const int kQueenCastleIndex =
-    kMoveToIdx[BoardSquare("e1").as_int() * 64 + BoardSquare("a1").as_int()];
+constexpr MoveIndices kMoveToIdx = BuildMoveIndices();
+constexpr int kKingCastleIndex = kMoveToIdx.idx[PackMove("e1h1")];
+constexpr int kQueenCastleIndex = kMoveToIdx.idx[PackMove("e1a1")];
 }  // namespace
 
 Move::Move(const std::string& str, bool black) {
@@ -321,7 +344,7 @@ uint16_t Move::as_packed_int() const {
 }
 
 uint16_t Move::as_nn_index() const {
-  if (!castling()) return kMoveToIdx[as_packed_int()];
+  if (!castling()) return kMoveToIdx.idx[as_packed_int()];
   if (from().col() < to().col()) return kKingCastleIndex;
   return kQueenCastleIndex;
 }
@@ -312,4 +312,26 @@ class Move {
 
 using MoveList = std::vector<Move>;
 
+// Moves kept in place, e.g. on the stack, so that generating them doesn't
+// allocate. No legal position has more than 218 moves.
+class FixedMoveList {
+ public:
+  static constexpr size_t kCapacity = 256;
+
+  void push_back(Move move) {
+    assert(size_ < kCapacity);
+    moves_[size_++] = move;
+  }
+  void clear() { size_ = 0; }
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+  const Move& operator[](size_t idx) const { return moves_[idx]; }
+  const Move* begin() const { return moves_; }
+  const Move* end() const { return moves_ + size_; }
+
+ private:
+  Move moves_[kCapacity];
+  size_t size_ = 0;
+};
+
 }  // namespace lczero
@@ -32,10 +32,19 @@
 #include <cstdlib>
 #include <cstring>
 #include <sstream>
+#include "utils/cpu.h"
 #include "utils/exception.h"
 
+// Pext is only available on x86-64.
+#if !defined(NO_PEXT) && !defined(__x86_64__) && !defined(_M_X64)
+#define NO_PEXT
+#endif
+
 #if not defined(NO_PEXT)
-// Include header for pext instruction.
+// Include headers for the pext instruction.
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
 #include <immintrin.h>
 #endif
 
@@ -43,6 +52,47 @@ namespace lczero {
 
 using std::string;
 
+namespace {
+// Random keys of every piece on every square, castling rights, en passant
+// file and side to move, all in white's view.
+struct ZobristKeys {
+  ZobristKeys() {
+    // Splitmix64, seeded so that the keys are the same in every run.
+    uint64_t state = 0x4c63305a6f627269ULL;
+    auto next = [&state]() {
+      uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+      z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+      z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+      return z ^ (z >> 31);
+    };
+    for (auto& color : pieces) {
+      for (auto& type : color) {
+        for (auto& key : type) key = next();
+      }
+    }
+    // No castling rights keep the key of an empty board 0.
+    castling[0] = 0;
+    for (int i = 1; i < 16; i++) castling[i] = next();
+    for (auto& key : en_passant) key = next();
+    side = next();
+  }
+
+  // By color (white, black), piece type (king, queen, rook, bishop, knight,
+  // pawn) and square.
+  uint64_t pieces[2][6][64];
+  uint64_t castling[16];
+  uint64_t en_passant[8];
+  uint64_t side;
+};
+
+// Initialized on first use, as boards may be set up during static
+// initialization.
+const ZobristKeys& Zobrist() {
+  static const ZobristKeys keys;
+  return keys;
+}
+}  // namespace
+
 const char* ChessBoard::kStartposFen =
     "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1";
 
@@ -64,6 +114,9 @@ void ChessBoard::Mirror() {
   std::swap(our_king_, their_king_);
   castlings_.Mirror();
   flipped_ = !flipped_;
+  // The key is of the position, not of how it's looked at, except for the
+  // side to move.
+  hash_ ^= Zobrist().side;
 }
 
 namespace {
@@ -187,189 +240,57 @@ static const Move::Promotion kPromotions[] = {
 };
 
 // Magic bitboard routines and structures.
-// We use so-called "fancy" magic bitboards.
+// We use so-called "fancy" magic bitboards. On CPUs with a fast pext
+// instruction the tables are indexed with pext of the relevant occupancy
+// instead, which needs the same table sizes but no multiplication.
 
 // Structure holding all relevant magic parameters per square.
 struct MagicParams {
   // Relevant occupancy mask.
   uint64_t mask_;
-  // Pointer to lookup table.
-  BitBoard* attacks_table_;
-#if defined(NO_PEXT)
   // Magic number.
   uint64_t magic_number_;
+  // Offset of the square's attacks in the lookup table.
+  uint32_t table_offset_;
   // Number of bits to shift.
   uint8_t shift_bits_;
-#endif
 };
 
-#if defined(NO_PEXT)
-// Magic numbers determined via trial and error with random number generator
-// such that the number of relevant occupancy bits suffice to index the attacks
-// tables with only constructive collisions.
-static const BitBoard kRookMagicNumbers[] = {
-    0x088000102088C001ULL, 0x10C0200040001000ULL, 0x83001041000B2000ULL,
-    0x0680280080041000ULL, 0x488004000A080080ULL, 0x0100180400010002ULL,
-    0x040001C401021008ULL, 0x02000C04A980C302ULL, 0x0000800040082084ULL,
-    0x5020C00820025000ULL, 0x0001002001044012ULL, 0x0402001020400A00ULL,
-    0x00C0800800040080ULL, 0x4028800200040080ULL, 0x00A0804200802500ULL,
-    0x8004800040802100ULL, 0x0080004000200040ULL, 0x1082810020400100ULL,
-    0x0020004010080040ULL, 0x2004818010042800ULL, 0x0601010008005004ULL,
-    0x4600808002001400ULL, 0x0010040009180210ULL, 0x020412000406C091ULL,
-    0x040084228000C000ULL, 0x8000810100204000ULL, 0x0084110100402000ULL,
-    0x0046001A00204210ULL, 0x2001040080080081ULL, 0x0144020080800400ULL,
-    0x0840108400080229ULL, 0x0480308A0000410CULL, 0x0460324002800081ULL,
-    0x620080A001804000ULL, 0x2800802000801006ULL, 0x0002809000800800ULL,
-    0x4C09040080802800ULL, 0x4808800C00800200ULL, 0x0200311004001802ULL,
-    0x0400008402002141ULL, 0x0410800140008020ULL, 0x000080C001050020ULL,
-    0x004080204A020010ULL, 0x0224201001010038ULL, 0x0109001108010004ULL,
-    0x0282004844020010ULL, 0x8228180110040082ULL, 0x0001000080C10002ULL,
-    0x024000C120801080ULL, 0x0001406481060200ULL, 0x0101243200418600ULL,
-    0x0108800800100080ULL, 0x4022080100100D00ULL, 0x0000843040600801ULL,
-    0x8301000200CC0500ULL, 0x1000004500840200ULL, 0x1100104100800069ULL,
-    0x2001008440001021ULL, 0x2002008830204082ULL, 0x0010145000082101ULL,
-    0x01A2001004200842ULL, 0x1007000608040041ULL, 0x000A08100203028CULL,
-    0x02D4048040290402ULL};
-static const BitBoard kBishopMagicNumbers[] = {
-    0x0008201802242020ULL, 0x0021040424806220ULL, 0x4006360602013080ULL,
-    0x0004410020408002ULL, 0x2102021009001140ULL, 0x08C2021004000001ULL,
-    0x6001031120200820ULL, 0x1018310402201410ULL, 0x401CE00210820484ULL,
-    0x001029D001004100ULL, 0x2C00101080810032ULL, 0x0000082581000010ULL,
-    0x10000A0210110020ULL, 0x200002016C202000ULL, 0x0201018821901000ULL,
-    0x006A0300420A2100ULL, 0x0010014005450400ULL, 0x1008C12008028280ULL,
-    0x00010010004A0040ULL, 0x3000820802044020ULL, 0x0000800405A02820ULL,
-    0x8042004300420240ULL, 0x10060801210D2000ULL, 0x0210840500511061ULL,
-    0x0008142118509020ULL, 0x0021109460040104ULL, 0x00A1480090019030ULL,
-    0x0102008808008020ULL, 0x884084000880E001ULL, 0x040041020A030100ULL,
-    0x3000810104110805ULL, 0x04040A2006808440ULL, 0x0044040404C01100ULL,
-    0x4122B80800245004ULL, 0x0044020502380046ULL, 0x0100400888020200ULL,
-    0x01C0002060020080ULL, 0x4008811100021001ULL, 0x8208450441040609ULL,
-    0x0408004900008088ULL, 0x0294212051220882ULL, 0x000041080810E062ULL,
-    0x10480A018E005000ULL, 0x80400A0204201600ULL, 0x2800200204100682ULL,
-    0x0020200400204441ULL, 0x0A500600A5002400ULL, 0x801602004A010100ULL,
-    0x0801841008040880ULL, 0x10010880C4200028ULL, 0x0400004424040000ULL,
-    0x0401000142022100ULL, 0x00A00010020A0002ULL, 0x1010400204010810ULL,
-    0x0829910400840000ULL, 0x0004235204010080ULL, 0x1002008143082000ULL,
-    0x11840044440C2080ULL, 0x2802A02104030440ULL, 0x6100000900840401ULL,
-    0x1C20A15A90420200ULL, 0x0088414004480280ULL, 0x0000204242881100ULL,
-    0x0240080802809010ULL};
-#endif
-
-// Magic parameters for rooks/bishops.
-static MagicParams rook_magic_params[64];
-static MagicParams bishop_magic_params[64];
-
-// Precomputed attacks bitboard tables.
-static BitBoard rook_attacks_table[102400];
-static BitBoard bishop_attacks_table[5248];
-
-// Builds rook or bishop attacks table.
-static void BuildAttacksTable(MagicParams* magic_params,
-                              BitBoard* attacks_table,
-                              const std::pair<int, int>* directions) {
-  // Offset into lookup table.
-  uint32_t table_offset = 0;
-
-  // Initialize for all board squares.
-  for (unsigned square = 0; square < 64; square++) {
-    const BoardSquare b_sq(square);
-
-    // Calculate relevant occupancy masks.
-    BitBoard mask = {0};
-
-    for (int j = 0; j < 4; j++) {
-      auto direction = directions[j];
-      auto dst_row = b_sq.row();
-      auto dst_col = b_sq.col();
-      while (true) {
-        dst_row += direction.first;
-        dst_col += direction.second;
-        // If the next square in this direction is invalid, the current square
-        // is at the board's edge and should not be added.
-        if (!BoardSquare::IsValid(dst_row + direction.first,
-                                  dst_col + direction.second))
-          break;
-        const BoardSquare destination(dst_row, dst_col);
-        mask.set(destination);
-      }
-    }
-
-    // Set mask.
-    magic_params[square].mask_ = mask.as_int();
+// Magic parameters and attacks tables for rooks and bishops, indexed with
+// magics and with pext. Generated at build time by gen_attacks.cc.
+#include "attacks_tables.h"
 
-    // Cache relevant occupancy board squares.
-    std::vector<BoardSquare> occupancy_squares;
+// Attacks tables in use, chosen at initialization.
+static const uint64_t* rook_attacks_table = kRookMagicAttacks;
+static const uint64_t* bishop_attacks_table = kBishopMagicAttacks;
 
-    for (auto occ_sq : BitBoard(magic_params[square].mask_)) {
-      occupancy_squares.emplace_back(occ_sq);
-    }
-
-#if defined(NO_PEXT)
-    // Set number of shifted bits. The magic numbers have been chosen such that
-    // the number of relevant occupancy bits suffice to index the attacks table.
-    magic_params[square].shift_bits_ = 64 - occupancy_squares.size();
-#endif
-
-    // Set pointer to lookup table.
-    magic_params[square].attacks_table_ = &attacks_table[table_offset];
-
-    // Clear attacks table (used for sanity check later on).
-    for (int i = 0; i < (1 << occupancy_squares.size()); i++) {
-      attacks_table[table_offset + i] = 0;
-    }
+// Whether the attacks tables are indexed with pext, chosen at initialization.
+static bool use_pext = false;
 
-    // Build square attacks table for every possible relevant occupancy
-    // bitboard.
-    for (int i = 0; i < (1 << occupancy_squares.size()); i++) {
-      BitBoard occupancy(0);
-
-      for (size_t bit = 0; bit < occupancy_squares.size(); bit++) {
-        occupancy.set_if(occupancy_squares[bit], (1 << bit) & i);
-      }
-
-      // Calculate attacks bitboard corresponding to this occupancy bitboard.
-      BitBoard attacks(0);
-
-      for (int j = 0; j < 4; j++) {
-        auto direction = directions[j];
-        auto dst_row = b_sq.row();
-        auto dst_col = b_sq.col();
-        while (true) {
-          dst_row += direction.first;
-          dst_col += direction.second;
-          if (!BoardSquare::IsValid(dst_row, dst_col)) break;
-          const BoardSquare destination(dst_row, dst_col);
-          attacks.set(destination);
-          if (occupancy.get(destination)) break;
-        }
-      }
-
-#if defined(NO_PEXT)
-      // Calculate magic index.
-      uint64_t index = occupancy.as_int();
-      index *= magic_params[square].magic_number_;
-      index >>= magic_params[square].shift_bits_;
-
-      // Sanity check. The magic numbers have been chosen such that
-      // the number of relevant occupancy bits suffice to index the attacks
-      // table. If the table already contains an attacks bitboard, possible
-      // collisions should be constructive.
-      if (attacks_table[table_offset + index] != 0 &&
-          attacks_table[table_offset + index] != attacks) {
-        throw Exception("Invalid magic number!");
-      }
+#if not defined(NO_PEXT)
+static inline uint64_t Pext(uint64_t value, uint64_t mask) {
+#if defined(_MSC_VER) || defined(__BMI2__)
+  return _pext_u64(value, mask);
 #else
-      uint64_t index =
-          _pext_u64(occupancy.as_int(), magic_params[square].mask_);
+  // The intrinsic needs BMI2 enabled for the whole function it is inlined
+  // into, the assembly doesn't.
+  uint64_t result;
+  asm("pextq %2, %1, %0" : "=r"(result) : "r"(value), "rm"(mask));
+  return result;
+#endif
+}
 #endif
 
-      // Update table.
-      attacks_table[table_offset + index] = attacks;
-    }
-
-    // Update table offset.
-    table_offset += (1 << occupancy_squares.size());
-  }
+// Returns the index into the square's attacks table of the given occupancy.
+static inline uint64_t AttacksIndex(const MagicParams& params,
+                                    uint64_t occupancy) {
+#if not defined(NO_PEXT)
+  if (use_pext) return Pext(occupancy, params.mask_);
+#endif
+  uint64_t index = occupancy & params.mask_;
+  index *= params.magic_number_;
+  index >>= params.shift_bits_;
+  return index;
 }
 
 // Returns the rook attacks bitboard for the given rook board square and the
@@ -377,18 +298,11 @@ static void BuildAttacksTable(MagicParams* magic_params,
 static inline BitBoard GetRookAttacks(const BoardSquare rook_square,
                                       const BitBoard pieces) {
   // Calculate magic index.
-  const uint8_t square = rook_square.as_int();
-
-#if defined(NO_PEXT)
-  uint64_t index = pieces.as_int() & rook_magic_params[square].mask_;
-  index *= rook_magic_params[square].magic_number_;
-  index >>= rook_magic_params[square].shift_bits_;
-#else
-  uint64_t index = _pext_u64(pieces.as_int(), rook_magic_params[square].mask_);
-#endif
+  const MagicParams& params = kRookMagicParams[rook_square.as_int()];
+  const uint64_t index = AttacksIndex(params, pieces.as_int());
 
   // Return attacks bitboard.
-  return rook_magic_params[square].attacks_table_[index];
+  return rook_attacks_table[params.table_offset_ + index];
 }
 
 // Returns the bishop attacks bitboard for the given bishop board square and
@@ -396,47 +310,81 @@ static inline BitBoard GetRookAttacks(const BoardSquare rook_square,
 static inline BitBoard GetBishopAttacks(const BoardSquare bishop_square,
                                         const BitBoard pieces) {
   // Calculate magic index.
-  const uint8_t square = bishop_square.as_int();
-
-#if defined(NO_PEXT)
-  uint64_t index = pieces.as_int() & bishop_magic_params[square].mask_;
-  index *= bishop_magic_params[square].magic_number_;
-  index >>= bishop_magic_params[square].shift_bits_;
-#else
-  uint64_t index =
-      _pext_u64(pieces.as_int(), bishop_magic_params[square].mask_);
-#endif
+  const MagicParams& params = kBishopMagicParams[bishop_square.as_int()];
+  const uint64_t index = AttacksIndex(params, pieces.as_int());
 
   // Return attacks bitboard.
-  return bishop_magic_params[square].attacks_table_[index];
+  return bishop_attacks_table[params.table_offset_ + index];
 }
 
 }  // namespace
 
-void InitializeMagicBitboards() {
-#if defined(NO_PEXT)
-  // Set magic numbers for all board squares.
-  for (unsigned square = 0; square < 64; square++) {
-    rook_magic_params[square].magic_number_ =
-        kRookMagicNumbers[square].as_int();
-    bishop_magic_params[square].magic_number_ =
-        kBishopMagicNumbers[square].as_int();
-  }
+void InitializeMagicBitboards(bool allow_pext) {
+#if not defined(NO_PEXT)
+  use_pext = allow_pext && GetCpuFeatures().fast_pext;
+  rook_attacks_table = use_pext ? kRookPextAttacks : kRookMagicAttacks;
+  bishop_attacks_table = use_pext ? kBishopPextAttacks : kBishopMagicAttacks;
+#else
+  (void)allow_pext;
 #endif
+}
+
+bool UsingPextAttacks() { return use_pext; }
+
+uint64_t ChessBoard::PieceKey(BoardSquare square, bool ours) const {
+  int type;
+  if (square == our_king_ || square == their_king_) {
+    type = 0;
+  } else if (rooks_.get(square)) {
+    type = bishops_.get(square) ? 1 : 2;
+  } else if (bishops_.get(square)) {
+    type = 3;
+  } else if ((pawns_ & kPawnMask).get(square)) {
+    type = 5;
+  } else {
+    type = 4;
+  }
+  const int abs_square =
+      flipped_ ? square.as_int() ^ 0b111000 : square.as_int();
+  return Zobrist().pieces[ours == flipped_][type][abs_square];
+}
+
+uint64_t ChessBoard::StateKey() const {
+  Castlings castlings = castlings_;
+  if (flipped_) castlings.Mirror();
+  uint64_t key = Zobrist().castling[castlings.as_int()];
+  // The en passant flags are "pawns" on the first and last rank.
+  const BitBoard en_passant = pawns_ - kPawnMask;
+  if (!en_passant.empty()) {
+    key ^= Zobrist().en_passant[(*en_passant.begin()).col()];
+  }
+  return key;
+}
 
-  // Build attacks tables.
-  BuildAttacksTable(rook_magic_params, rook_attacks_table, kRookDirections);
-  BuildAttacksTable(bishop_magic_params, bishop_attacks_table,
-                    kBishopDirections);
+uint64_t ChessBoard::ComputeHash() const {
+  uint64_t hash = StateKey() ^ (flipped_ ? Zobrist().side : 0);
+  for (auto square : our_pieces_) hash ^= PieceKey(square, true);
+  for (auto square : their_pieces_) hash ^= PieceKey(square, false);
+  return hash;
 }
 
 BitBoard ChessBoard::pawns() const { return pawns_ & kPawnMask; }
 
 BitBoard ChessBoard::en_passant() const { return pawns_ - pawns(); }
 
-MoveList ChessBoard::GeneratePseudolegalMoves() const {
-  MoveList result;
-  result.reserve(60);
+template <bool kLegal, typename Add>
+bool ChessBoard::GenerateMoves(const Add& add) const {
+  KingAttackInfo king_attack_info;
+  // Destinations of pieces other than the king: when in check, those which
+  // capture or block the checking piece.
+  BitBoard targets(~0ULL);
+  if (kLegal) {
+    king_attack_info = GenerateKingAttackInfo();
+    if (king_attack_info.in_check()) targets = king_attack_info.attack_lines_;
+  }
+  const auto emit = [&](Move move) {
+    return (!kLegal || IsLegalMove(move, king_attack_info)) && add(move);
+  };
   for (auto source : our_pieces_) {
     // King
     if (source == our_king_) {
@@ -447,7 +395,7 @@ MoveList ChessBoard::GeneratePseudolegalMoves() const {
         const BoardSquare destination(dst_row, dst_col);
         if (our_pieces_.get(destination)) continue;
         if (IsUnderAttack(destination)) continue;
-        result.emplace_back(source, destination);
+        if (emit(Move(source, destination))) return true;
       }
       // Castlings.
       if (castlings_.we_can_00()) {
@@ -467,8 +415,9 @@ MoveList ChessBoard::GeneratePseudolegalMoves() const {
           }
         }
         if (can_castle) {
-          result.emplace_back(source, BoardSquare(0, 6));
-          result.back().SetCastling();
+          Move move(source, BoardSquare(0, 6));
+          move.SetCastling();
+          if (emit(move)) return true;
         }
       }
       if (castlings_.we_can_000()) {
@@ -488,31 +437,41 @@ MoveList ChessBoard::GeneratePseudolegalMoves() const {
           }
         }
         if (can_castle) {
-          result.emplace_back(source, BoardSquare(0, 2));
-          result.back().SetCastling();
+          Move move(source, BoardSquare(0, 2));
+          move.SetCastling();
+          if (emit(move)) return true;
         }
       }
       continue;
     }
+    // Only the king moves out of a double check, and pinned pieces never
+    // resolve a check.
+    if (kLegal && king_attack_info.in_check() &&
+        (king_attack_info.in_double_check() ||
+         king_attack_info.is_pinned(source))) {
+      continue;
+    }
     bool processed_piece = false;
     // Rook (and queen)
     if (rooks_.get(source)) {
       processed_piece = true;
       BitBoard attacked =
-          GetRookAttacks(source, our_pieces_ | their_pieces_) - our_pieces_;
+          (GetRookAttacks(source, our_pieces_ | their_pieces_) & targets) -
+          our_pieces_;
 
       for (const auto& destination : attacked) {
-        result.emplace_back(source, destination);
+        if (emit(Move(source, destination))) return true;
       }
     }
     // Bishop (and queen)
     if (bishops_.get(source)) {
       processed_piece = true;
       BitBoard attacked =
-          GetBishopAttacks(source, our_pieces_ | their_pieces_) - our_pieces_;
+          (GetBishopAttacks(source, our_pieces_ | their_pieces_) & targets) -
+          our_pieces_;
 
       for (const auto& destination : attacked) {
-        result.emplace_back(source, destination);
+        if (emit(Move(source, destination))) return true;
       }
     }
     if (processed_piece) continue;
@@ -526,18 +485,18 @@ MoveList ChessBoard::GeneratePseudolegalMoves() const {
 
         if (!our_pieces_.get(destination) && !their_pieces_.get(destination)) {
           if (dst_row != 7) {
-            result.emplace_back(source, destination);
+            if (emit(Move(source, destination))) return true;
             if (dst_row == 2) {
               // Maybe it'll be possible to move two squares.
               if (!our_pieces_.get(3, dst_col) &&
                   !their_pieces_.get(3, dst_col)) {
-                result.emplace_back(source, BoardSquare(3, dst_col));
+                if (emit(Move(source, BoardSquare(3, dst_col)))) return true;
               }
             }
           } else {
             // Promotions
             for (auto promotion : kPromotions) {
-              result.emplace_back(source, destination, promotion);
+              if (emit(Move(source, destination, promotion))) return true;
             }
           }
         }
@@ -553,17 +512,17 @@ MoveList ChessBoard::GeneratePseudolegalMoves() const {
             if (dst_row == 7) {
               // Promotion.
               for (auto promotion : kPromotions) {
-                result.emplace_back(source, destination, promotion);
+                if (emit(Move(source, destination, promotion))) return true;
               }
             } else {
               // Ordinary capture.
-              result.emplace_back(source, destination);
+              if (emit(Move(source, destination))) return true;
             }
           } else if (dst_row == 5 && pawns_.get(7, dst_col)) {
             // En passant.
             // "Pawn" on opponent's file 8 means that en passant is possible.
             // Those fake pawns are reset in ApplyMove.
-            result.emplace_back(source, destination);
+            if (emit(Move(source, destination))) return true;
           }
         }
       }
@@ -572,11 +531,21 @@ MoveList ChessBoard::GeneratePseudolegalMoves() const {
     // Knight.
     {
       for (const auto destination :
-           kKnightAttacks[source.as_int()] - our_pieces_) {
-        result.emplace_back(source, destination);
+           (kKnightAttacks[source.as_int()] & targets) - our_pieces_) {
+        if (emit(Move(source, destination))) return true;
       }
     }
   }
+  return false;
+}
+
+MoveList ChessBoard::GeneratePseudolegalMoves() const {
+  MoveList result;
+  result.reserve(60);
+  GenerateMoves<false>([&](Move move) {
+    result.push_back(move);
+    return false;
+  });
   return result;
 }
 
@@ -588,6 +557,11 @@ bool ChessBoard::ApplyMove(Move move) {
   const auto to_row = to.row();
   const auto to_col = to.col();
 
+  // The moved and captured pieces and the state are taken out of the key
+  // now, and the moved piece and new state put back in once done.
+  hash_ ^= StateKey() ^ PieceKey(from, true);
+  if (their_pieces_.get(to)) hash_ ^= PieceKey(to, false);
+
   // Move in our pieces.
   our_pieces_.reset(from);
   our_pieces_.set(to);
@@ -608,6 +582,7 @@ bool ChessBoard::ApplyMove(Move move) {
   // En passant
   if (from_row == 4 && pawns_.get(from) && from_col != to_col &&
       pawns_.get(7, to_col)) {
+    hash_ ^= PieceKey(BoardSquare(4, to_col), false);
     pawns_.reset(4, to_col);
     their_pieces_.reset(4, to_col);
   }
@@ -626,17 +601,23 @@ bool ChessBoard::ApplyMove(Move move) {
     // Castling
     if (to_col - from_col > 1) {
       // 0-0
+      hash_ ^= PieceKey(BoardSquare(0, 7), true);
       our_pieces_.reset(7);
       rooks_.reset(7);
       our_pieces_.set(5);
       rooks_.set(5);
+      hash_ ^= PieceKey(BoardSquare(0, 5), true);
     } else if (from_col - to_col > 1) {
       // 0-0-0
+      hash_ ^= PieceKey(BoardSquare(0, 0), true);
       our_pieces_.reset(0);
       rooks_.reset(0);
       our_pieces_.set(3);
       rooks_.set(3);
+      hash_ ^= PieceKey(BoardSquare(0, 3), true);
     }
+    hash_ ^= PieceKey(to, true) ^ StateKey();
+    assert(hash_ == ComputeHash());
     return reset_50_moves;
   }
 
@@ -656,6 +637,8 @@ bool ChessBoard::ApplyMove(Move move) {
       default:;
     }
     pawns_.reset(from);
+    hash_ ^= PieceKey(to, true) ^ StateKey();
+    assert(hash_ == ComputeHash());
     return true;
   }
 
@@ -682,6 +665,8 @@ bool ChessBoard::ApplyMove(Move move) {
       pawns_.set(0, to_col);
     }
   }
+  hash_ ^= PieceKey(to, true) ^ StateKey();
+  assert(hash_ == ComputeHash());
   return reset_50_moves;
 }
 
@@ -911,15 +896,27 @@ bool ChessBoard::IsLegalMove(Move move,
 }
 
 MoveList ChessBoard::GenerateLegalMoves() const {
-  const KingAttackInfo king_attack_info = GenerateKingAttackInfo();
-  MoveList result = GeneratePseudolegalMoves();
-  result.erase(
-      std::remove_if(result.begin(), result.end(),
-                     [&](Move m) { return !IsLegalMove(m, king_attack_info); }),
-      result.end());
+  MoveList result;
+  result.reserve(60);
+  GenerateMoves<true>([&](Move move) {
+    result.push_back(move);
+    return false;
+  });
   return result;
 }
 
+void ChessBoard::GenerateLegalMoves(FixedMoveList* moves) const {
+  moves->clear();
+  GenerateMoves<true>([&](Move move) {
+    moves->push_back(move);
+    return false;
+  });
+}
+
+bool ChessBoard::HasAnyLegalMove() const {
+  return GenerateMoves<true>([](Move) { return true; });
+}
+
 void ChessBoard::SetFromFen(const std::string& fen, int* no_capture_ply,
                             int* moves) {
   Clear();
@@ -1009,6 +1006,7 @@ void ChessBoard::SetFromFen(const std::string& fen, int* no_capture_ply,
   if (who_to_move == "b" || who_to_move == "B") {
     Mirror();
   }
+  hash_ = ComputeHash();
   if (no_capture_ply) *no_capture_ply = no_capture_halfmoves;
   if (moves) *moves = total_moves;
 }
@@ -33,8 +33,13 @@
 
 namespace lczero {
 
-// Initializes internal magic bitboard structures.
-void InitializeMagicBitboards();
+// Chooses how slider attacks are looked up: with pext on CPUs where it is
+// fast, unless @allow_pext is false, otherwise with magics. The tables are
+// generated at build time, so magics work even without this call.
+void InitializeMagicBitboards(bool allow_pext = true);
+
+// Whether slider attacks are looked up with pext.
+bool UsingPextAttacks();
 
 // Represents king attack info used during legal move detection.
 class KingAttackInfo {
@@ -93,17 +98,16 @@ class ChessBoard {
   bool HasMatingMaterial() const;
   // Generates legal moves.
   MoveList GenerateLegalMoves() const;
+  // Same, into @moves, which is cleared first. Only legal moves are generated,
+  // which is faster than filtering pseudolegal ones.
+  void GenerateLegalMoves(FixedMoveList* moves) const;
+  // Checks whether there is any legal move, i.e. it's not mate or stalemate.
+  bool HasAnyLegalMove() const;
   // Check whether pseudolegal move is legal.
   bool IsLegalMove(Move move, const KingAttackInfo& king_attack_info) const;
 
-  uint64_t Hash() const {
-    return HashCat({our_pieces_.as_int(), their_pieces_.as_int(),
-                    rooks_.as_int(), bishops_.as_int(), pawns_.as_int(),
-                    (static_cast<uint32_t>(our_king_.as_int()) << 24) |
-                        (static_cast<uint32_t>(their_king_.as_int()) << 16) |
-                        (static_cast<uint32_t>(castlings_.as_int()) << 8) |
-                        static_cast<uint32_t>(flipped_)});
-  }
+  // Zobrist key of the position, kept up to date by ApplyMove() and Mirror().
+  uint64_t Hash() const { return hash_; }
 
   class Castlings {
    public:
@@ -177,6 +181,17 @@ class ChessBoard {
   bool operator!=(const ChessBoard& other) const { return !operator==(other); }
 
  private:
+  // Calls @add(move) for every pseudolegal move, or every legal one if
+  // @kLegal, until it returns true. Returns whether it did.
+  template <bool kLegal, typename Add>
+  bool GenerateMoves(const Add& add) const;
+  // Computes the Zobrist key from scratch.
+  uint64_t ComputeHash() const;
+  // Zobrist key of the piece on @square, "ours" if @ours.
+  uint64_t PieceKey(BoardSquare square, bool ours) const;
+  // Zobrist keys of the castling rights and the en passant file.
+  uint64_t StateKey() const;
+
   // All white pieces.
   BitBoard our_pieces_;
   // All black pieces.
@@ -195,6 +210,7 @@ class ChessBoard {
   BoardSquare their_king_;
   Castlings castlings_;
   bool flipped_ = false;  // aka "Black to move".
+  uint64_t hash_ = 0;
 };
 
 }  // namespace lczero
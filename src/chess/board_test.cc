@@ -18,6 +18,7 @@
 
 #include <gtest/gtest.h>
 
+#include <chrono>
 #include <iostream>
 #include "src/chess/bitboard.h"
 #include "src/chess/board.h"
@@ -60,6 +61,20 @@ TEST(ChessBoard, PseudolegalMovesStartingPos) {
   EXPECT_EQ(moves.size(), 20);
 }
 
+TEST(ChessBoard, HasAnyLegalMove) {
+  EXPECT_TRUE(ChessBoard(ChessBoard::kStartposFen).HasAnyLegalMove());
+  // Checkmate.
+  EXPECT_FALSE(
+      ChessBoard("R5k1/5ppp/8/8/8/8/8/6K1 b - - 0 1").HasAnyLegalMove());
+  // Stalemate.
+  EXPECT_FALSE(ChessBoard("7k/5Q2/6K1/8/8/8/8/8 b - - 0 1").HasAnyLegalMove());
+  // Only a capture of the checking piece.
+  FixedMoveList moves;
+  ChessBoard("R7/8/7k/8/8/8/6PP/r6K w - - 0 1").GenerateLegalMoves(&moves);
+  ASSERT_EQ(moves.size(), 1u);
+  EXPECT_EQ(moves[0].as_string(), "a8a1");
+}
+
 namespace {
 int Perft(const ChessBoard& board, int max_depth, bool dump = false,
           int depth = 0) {
@@ -166,6 +181,29 @@ TEST(ChessBoard, MoveGenPosition6) {
   EXPECT_EQ(Perft(board, 4), 3894594);
 }
 
+TEST(ChessBoard, PerftPextAgainstMagics) {
+  ChessBoard board;
+  board.SetFromFen(
+      "r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 1");
+  const auto timed_perft = [&]() {
+    const auto start = std::chrono::steady_clock::now();
+    EXPECT_EQ(Perft(board, 4), 4085603);
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                         start)
+        .count();
+  };
+
+  InitializeMagicBitboards(true);
+  if (!UsingPextAttacks()) return;
+  const double pext_time = timed_perft();
+  InitializeMagicBitboards(false);
+  EXPECT_FALSE(UsingPextAttacks());
+  const double magic_time = timed_perft();
+  InitializeMagicBitboards();
+  std::cout << "Perft 4 with pext: " << pext_time
+            << "s, with magics: " << magic_time << "s" << std::endl;
+}
+
 TEST(ChessBoard, HasMatingMaterialStartPosition) {
   ChessBoard board;
   board.SetFromFen(ChessBoard::kStartposFen);
@@ -97,8 +97,9 @@ struct GameInfo {
   GameResult game_result = GameResult::UNDECIDED;
   // Name of the file with training data.
   std::string training_filename;
-  // Game moves.
+  // Game moves, played from start_fen.
   std::vector<Move> moves;
+  std::string start_fen;
   // Index of the game in the tournament (0-based).
   int game_id = -1;
   // The color of the player1, if known.
@@ -119,6 +120,27 @@ struct TournamentInfo {
   // Player1's [win/draw/lose] as [white/black].
   // e.g. results[2][1] is how many times player 1 lost as black.
   int results[3][2] = {{0, 0}, {0, 0}, {0, 0}};
+
+  // NN cache counters of player1 and player2, the same if they share the
+  // cache. Opening hits are hits of positions retained by CacheOpeningPlies.
+  int64_t cache_lookups[2] = {0, 0};
+  int64_t cache_hits[2] = {0, 0};
+  int64_t cache_opening_hits[2] = {0, 0};
+
+  // Moves searched with full and with fast searches (FastSearchProbability).
+  int64_t full_searches = 0;
+  int64_t fast_searches = 0;
+  // Finished games per hour since the tournament started.
+  float games_per_hour = 0.0f;
+
+  // Sequential probability ratio test of player1 against player2, if enabled.
+  // The tournament stops once llr leaves [llr_lower, llr_upper]; sprt_result
+  // is then 1 if the stronger hypothesis (Elo1) was accepted, -1 if Elo0 was.
+  bool sprt = false;
+  float llr = 0.0f;
+  float llr_lower = 0.0f;
+  float llr_upper = 0.0f;
+  int sprt_result = 0;
   using Callback = std::function<void(const TournamentInfo&)>;
 };
 
@@ -0,0 +1,214 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2018-2019 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+
+  If you modify this Program, or any covered work, by linking or
+  combining it with NVIDIA Corporation's libraries from the NVIDIA CUDA
+  Toolkit and the NVIDIA CUDA Deep Neural Network library (or a
+  modified version of those libraries), containing parts covered by the
+  terms of the respective license agreement, the licensors of this
+  Program grant you additional permission to convey the resulting work.
+*/
+
+// Writes the rook and bishop attacks tables of board.cc to the file given as
+// the argument, so that they are in read-only data rather than built at every
+// start. Runs at build time, on the build machine.
+
+#include <cinttypes>
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+namespace {
+
+// Magic numbers determined via trial and error with random number generator
+// such that the number of relevant occupancy bits suffice to index the attacks
+// tables with only constructive collisions.
+const uint64_t kRookMagicNumbers[] = {
+    0x088000102088C001ULL, 0x10C0200040001000ULL, 0x83001041000B2000ULL,
+    0x0680280080041000ULL, 0x488004000A080080ULL, 0x0100180400010002ULL,
+    0x040001C401021008ULL, 0x02000C04A980C302ULL, 0x0000800040082084ULL,
+    0x5020C00820025000ULL, 0x0001002001044012ULL, 0x0402001020400A00ULL,
+    0x00C0800800040080ULL, 0x4028800200040080ULL, 0x00A0804200802500ULL,
+    0x8004800040802100ULL, 0x0080004000200040ULL, 0x1082810020400100ULL,
+    0x0020004010080040ULL, 0x2004818010042800ULL, 0x0601010008005004ULL,
+    0x4600808002001400ULL, 0x0010040009180210ULL, 0x020412000406C091ULL,
+    0x040084228000C000ULL, 0x8000810100204000ULL, 0x0084110100402000ULL,
+    0x0046001A00204210ULL, 0x2001040080080081ULL, 0x0144020080800400ULL,
+    0x0840108400080229ULL, 0x0480308A0000410CULL, 0x0460324002800081ULL,
+    0x620080A001804000ULL, 0x2800802000801006ULL, 0x0002809000800800ULL,
+    0x4C09040080802800ULL, 0x4808800C00800200ULL, 0x0200311004001802ULL,
+    0x0400008402002141ULL, 0x0410800140008020ULL, 0x000080C001050020ULL,
+    0x004080204A020010ULL, 0x0224201001010038ULL, 0x0109001108010004ULL,
+    0x0282004844020010ULL, 0x8228180110040082ULL, 0x0001000080C10002ULL,
+    0x024000C120801080ULL, 0x0001406481060200ULL, 0x0101243200418600ULL,
+    0x0108800800100080ULL, 0x4022080100100D00ULL, 0x0000843040600801ULL,
+    0x8301000200CC0500ULL, 0x1000004500840200ULL, 0x1100104100800069ULL,
+    0x2001008440001021ULL, 0x2002008830204082ULL, 0x0010145000082101ULL,
+    0x01A2001004200842ULL, 0x1007000608040041ULL, 0x000A08100203028CULL,
+    0x02D4048040290402ULL};
+const uint64_t kBishopMagicNumbers[] = {
+    0x0008201802242020ULL, 0x0021040424806220ULL, 0x4006360602013080ULL,
+    0x0004410020408002ULL, 0x2102021009001140ULL, 0x08C2021004000001ULL,
+    0x6001031120200820ULL, 0x1018310402201410ULL, 0x401CE00210820484ULL,
+    0x001029D001004100ULL, 0x2C00101080810032ULL, 0x0000082581000010ULL,
+    0x10000A0210110020ULL, 0x200002016C202000ULL, 0x0201018821901000ULL,
+    0x006A0300420A2100ULL, 0x0010014005450400ULL, 0x1008C12008028280ULL,
+    0x00010010004A0040ULL, 0x3000820802044020ULL, 0x0000800405A02820ULL,
+    0x8042004300420240ULL, 0x10060801210D2000ULL, 0x0210840500511061ULL,
+    0x0008142118509020ULL, 0x0021109460040104ULL, 0x00A1480090019030ULL,
+    0x0102008808008020ULL, 0x884084000880E001ULL, 0x040041020A030100ULL,
+    0x3000810104110805ULL, 0x04040A2006808440ULL, 0x0044040404C01100ULL,
+    0x4122B80800245004ULL, 0x0044020502380046ULL, 0x0100400888020200ULL,
+    0x01C0002060020080ULL, 0x4008811100021001ULL, 0x8208450441040609ULL,
+    0x0408004900008088ULL, 0x0294212051220882ULL, 0x000041080810E062ULL,
+    0x10480A018E005000ULL, 0x80400A0204201600ULL, 0x2800200204100682ULL,
+    0x0020200400204441ULL, 0x0A500600A5002400ULL, 0x801602004A010100ULL,
+    0x0801841008040880ULL, 0x10010880C4200028ULL, 0x0400004424040000ULL,
+    0x0401000142022100ULL, 0x00A00010020A0002ULL, 0x1010400204010810ULL,
+    0x0829910400840000ULL, 0x0004235204010080ULL, 0x1002008143082000ULL,
+    0x11840044440C2080ULL, 0x2802A02104030440ULL, 0x6100000900840401ULL,
+    0x1C20A15A90420200ULL, 0x0088414004480280ULL, 0x0000204242881100ULL,
+    0x0240080802809010ULL};
+
+const int kRookDirections[][2] = {{1, 0}, {-1, 0}, {0, 1}, {0, -1}};
+const int kBishopDirections[][2] = {{1, 1}, {-1, 1}, {1, -1}, {-1, -1}};
+
+bool IsValid(int row, int col) {
+  return row >= 0 && row < 8 && col >= 0 && col < 8;
+}
+
+struct Tables {
+  uint64_t masks[64];
+  uint32_t offsets[64];
+  int shifts[64];
+  // Indexed with the magic multiplication and with pext.
+  std::vector<uint64_t> magic;
+  std::vector<uint64_t> pext;
+};
+
+// Builds rook or bishop attacks tables. Returns false if a magic number has a
+// destructive collision.
+bool BuildAttacksTables(const int (*directions)[2], const uint64_t* magics,
+                        Tables* tables) {
+  for (int square = 0; square < 64; ++square) {
+    const int row = square / 8;
+    const int col = square % 8;
+
+    // Relevant occupancy mask. Squares at the board's edge don't block
+    // anything behind them.
+    uint64_t mask = 0;
+    for (int j = 0; j < 4; ++j) {
+      int dst_row = row + directions[j][0];
+      int dst_col = col + directions[j][1];
+      while (IsValid(dst_row + directions[j][0], dst_col + directions[j][1])) {
+        mask |= 1ULL << (dst_row * 8 + dst_col);
+        dst_row += directions[j][0];
+        dst_col += directions[j][1];
+      }
+    }
+    int bits = 0;
+    for (uint64_t m = mask; m; m &= m - 1) ++bits;
+
+    const uint32_t offset = tables->magic.size();
+    tables->masks[square] = mask;
+    tables->offsets[square] = offset;
+    tables->shifts[square] = 64 - bits;
+    tables->magic.resize(offset + (1 << bits), 0);
+    tables->pext.resize(offset + (1 << bits), 0);
+
+    // Enumerates the occupancies in the order of their pext index.
+    uint64_t occupancy = 0;
+    for (int i = 0; i < (1 << bits); ++i) {
+      uint64_t attacks = 0;
+      for (int j = 0; j < 4; ++j) {
+        int dst_row = row + directions[j][0];
+        int dst_col = col + directions[j][1];
+        while (IsValid(dst_row, dst_col)) {
+          const uint64_t destination = 1ULL << (dst_row * 8 + dst_col);
+          attacks |= destination;
+          if (occupancy & destination) break;
+          dst_row += directions[j][0];
+          dst_col += directions[j][1];
+        }
+      }
+      tables->pext[offset + i] = attacks;
+      uint64_t& entry =
+          tables->magic[offset + ((occupancy * magics[square]) >> (64 - bits))];
+      if (entry != 0 && entry != attacks) return false;
+      entry = attacks;
+      occupancy = (occupancy - mask) & mask;
+    }
+  }
+  return true;
+}
+
+void WriteTable(FILE* file, const char* name,
+                const std::vector<uint64_t>& table) {
+  std::fprintf(file, "const uint64_t %s[%zu] = {", name, table.size());
+  for (size_t i = 0; i < table.size(); ++i) {
+    std::fprintf(file, "%s0x%016" PRIX64 "ULL,", i % 4 ? " " : "\n    ",
+                 table[i]);
+  }
+  std::fprintf(file, "};\n");
+}
+
+void WriteParams(FILE* file, const char* name, const Tables& tables,
+                 const uint64_t* magics) {
+  std::fprintf(file, "const MagicParams %s[64] = {\n", name);
+  for (int square = 0; square < 64; ++square) {
+    std::fprintf(file,
+                 "    {0x%016" PRIX64 "ULL, 0x%016" PRIX64 "ULL, %" PRIu32
+                 ", %d},\n",
+                 tables.masks[square], magics[square], tables.offsets[square],
+                 tables.shifts[square]);
+  }
+  std::fprintf(file, "};\n");
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  if (argc != 2) {
+    std::fprintf(stderr, "Usage: %s <output file>\n", argv[0]);
+    return 1;
+  }
+  Tables rook;
+  Tables bishop;
+  if (!BuildAttacksTables(kRookDirections, kRookMagicNumbers, &rook) ||
+      !BuildAttacksTables(kBishopDirections, kBishopMagicNumbers, &bishop)) {
+    std::fprintf(stderr, "Invalid magic number!\n");
+    return 1;
+  }
+  FILE* file = std::fopen(argv[1], "w");
+  if (!file) {
+    std::fprintf(stderr, "Cannot write %s\n", argv[1]);
+    return 1;
+  }
+  std::fprintf(file,
+               "// Generated by gen_attacks.cc, included into board.cc.\n\n");
+  WriteParams(file, "kRookMagicParams", rook, kRookMagicNumbers);
+  WriteParams(file, "kBishopMagicParams", bishop, kBishopMagicNumbers);
+  WriteTable(file, "kRookMagicAttacks", rook.magic);
+  WriteTable(file, "kBishopMagicAttacks", bishop.magic);
+  std::fprintf(file, "#if not defined(NO_PEXT)\n");
+  WriteTable(file, "kRookPextAttacks", rook.pext);
+  WriteTable(file, "kBishopPextAttacks", bishop.pext);
+  std::fprintf(file, "#endif\n");
+  return std::fclose(file) == 0 ? 0 : 1;
+}
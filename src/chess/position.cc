@@ -71,8 +71,7 @@ std::string Position::DebugString() const { return us_board_.DebugString(); }
 
 GameResult PositionHistory::ComputeGameResult() const {
   const auto& board = Last().GetBoard();
-  auto legal_moves = board.GenerateLegalMoves();
-  if (legal_moves.empty()) {
+  if (!board.HasAnyLegalMove()) {
     if (board.IsUnderCheck()) {
       // Checkmate.
       return IsBlackToMove() ? GameResult::WHITE_WON : GameResult::BLACK_WON;
@@ -92,7 +91,11 @@ GameResult PositionHistory::ComputeGameResult() const {
 void PositionHistory::Reset(const ChessBoard& board, int no_capture_ply,
                             int game_ply) {
   positions_.clear();
+  moves_.clear();
+  rolling_hashes_.clear();
   positions_.emplace_back(board, no_capture_ply, game_ply);
+  moves_.emplace_back();
+  AppendRollingHash();
 }
 
 void PositionHistory::Append(Move m) {
@@ -100,7 +103,22 @@ void PositionHistory::Append(Move m) {
   //                has a bug in implementation of emplace_back, when
   //                reallocation happens. (it also reallocates Last())
   positions_.push_back(Position(Last(), m));
+  moves_.push_back(m);
   positions_.back().SetRepetitions(ComputeLastMoveRepetitions());
+  AppendRollingHash();
+}
+
+namespace {
+uint64_t RotateLeft(uint64_t x, int bits) {
+  bits &= 63;
+  return bits == 0 ? x : (x << bits) | (x >> (64 - bits));
+}
+}  // namespace
+
+void PositionHistory::AppendRollingHash() {
+  const uint64_t previous =
+      rolling_hashes_.empty() ? 0 : RotateLeft(rolling_hashes_.back(), 1);
+  rolling_hashes_.push_back(previous ^ positions_.back().Hash());
 }
 
 int PositionHistory::ComputeLastMoveRepetitions() const {
@@ -110,7 +128,8 @@ int PositionHistory::ComputeLastMoveRepetitions() const {
 
   for (int idx = positions_.size() - 3; idx >= 0; idx -= 2) {
     const auto& pos = positions_[idx];
-    if (pos.GetBoard() == last.GetBoard()) {
+    if (pos.GetBoard().Hash() == last.GetBoard().Hash() &&
+        pos.GetBoard() == last.GetBoard()) {
       return 1 + pos.GetRepetitions();
     }
     if (pos.GetNoCaptureNoPawnPly() < 2) return 0;
@@ -127,14 +146,40 @@ bool PositionHistory::DidRepeatSinceLastZeroingMove() const {
   return false;
 }
 
+size_t PositionHistory::Tail::GetBytes() const {
+  return sizeof(Tail) + positions.capacity() * sizeof(Position) +
+         moves.capacity() * sizeof(Move) +
+         rolling_hashes.capacity() * sizeof(uint64_t);
+}
+
+void PositionHistory::GetTail(int begin, Tail* tail) const {
+  tail->begin = begin;
+  tail->positions.assign(positions_.begin() + begin, positions_.end());
+  tail->moves.assign(moves_.begin() + begin, moves_.end());
+  tail->rolling_hashes.assign(rolling_hashes_.begin() + begin,
+                              rolling_hashes_.end());
+}
+
+void PositionHistory::AppendTail(const Tail& tail, int end) {
+  const int from = GetLength() - tail.begin;
+  const int to = end - tail.begin;
+  assert(from >= 0 && to <= static_cast<int>(tail.positions.size()));
+  positions_.insert(positions_.end(), tail.positions.begin() + from,
+                    tail.positions.begin() + to);
+  moves_.insert(moves_.end(), tail.moves.begin() + from,
+                tail.moves.begin() + to);
+  rolling_hashes_.insert(rolling_hashes_.end(),
+                         tail.rolling_hashes.begin() + from,
+                         tail.rolling_hashes.begin() + to);
+}
+
 uint64_t PositionHistory::HashLast(int positions) const {
-  uint64_t hash = positions;
-  for (auto iter = positions_.rbegin(), end = positions_.rend(); iter != end;
-       ++iter) {
-    if (!positions--) break;
-    hash = HashCat(hash, iter->Hash());
-  }
-  return HashCat(hash, Last().GetNoCaptureNoPawnPly());
+  // Takes the positions before the last @positions out of the rolling hash.
+  const int before = GetLength() - positions - 1;
+  uint64_t hash = rolling_hashes_.back();
+  if (before >= 0) hash ^= RotateLeft(rolling_hashes_[before], positions);
+  return HashCat({static_cast<uint64_t>(positions), hash,
+                  static_cast<uint64_t>(Last().GetNoCaptureNoPawnPly())});
 }
 
 }  // namespace lczero
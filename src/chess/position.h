@@ -28,6 +28,7 @@
 #pragma once
 
 #include <string>
+#include <vector>
 #include "chess/board.h"
 
 namespace lczero {
@@ -104,9 +105,23 @@ class PositionHistory {
   // N-th position of the game, 0-based.
   const Position& GetPositionAt(int idx) const { return positions_[idx]; }
 
+  // Move which led to the N-th position, null for the first one.
+  Move GetMoveAt(int idx) const { return moves_[idx]; }
+
+  // Makes room for @size positions, so that histories growing up to that
+  // don't allocate.
+  void Reserve(int size) {
+    positions_.reserve(size);
+    moves_.reserve(size);
+    rolling_hashes_.reserve(size);
+  }
+
   // Trims position to a given size.
   void Trim(int size) {
     positions_.erase(positions_.begin() + size, positions_.end());
+    moves_.erase(moves_.begin() + size, moves_.end());
+    rolling_hashes_.erase(rolling_hashes_.begin() + size,
+                          rolling_hashes_.end());
   }
 
   // Number of positions in history.
@@ -119,7 +134,11 @@ class PositionHistory {
   void Append(Move m);
 
   // Pops last move from history.
-  void Pop() { positions_.pop_back(); }
+  void Pop() {
+    positions_.pop_back();
+    moves_.pop_back();
+    rolling_hashes_.pop_back();
+  }
 
   // Finds the endgame state (win/lose/draw/nothing) for the last position.
   GameResult ComputeGameResult() const;
@@ -127,16 +146,40 @@ class PositionHistory {
   // Returns whether next move is history should be black's.
   bool IsBlackToMove() const { return Last().IsBlackToMove(); }
 
-  // Builds a hash from last X positions.
+  // Builds a hash from last X positions. Takes constant time.
   uint64_t HashLast(int positions) const;
 
   // Checks for any repetitions since the last time 50 move rule was reset.
   bool DidRepeatSinceLastZeroingMove() const;
 
+  // Positions of a history from some index on, which can be appended to
+  // another history having the same positions before that index.
+  struct Tail {
+    int begin = 0;
+    std::vector<Position> positions;
+    std::vector<Move> moves;
+    std::vector<uint64_t> rolling_hashes;
+    // Bytes the tail takes in memory.
+    size_t GetBytes() const;
+  };
+  // Copies the positions from @begin on into @tail.
+  void GetTail(int begin, Tail* tail) const;
+  // Appends the positions of @tail from the current length up to @end of
+  // them, without replaying their moves. The history must have the same
+  // positions as the one of @tail up to its current length, and at least
+  // tail.begin of them.
+  void AppendTail(const Tail& tail, int end);
+
  private:
   int ComputeLastMoveRepetitions() const;
+  void AppendRollingHash();
 
   std::vector<Position> positions_;
+  std::vector<Move> moves_;
+  // For every position, the hashes of it and all the positions before,
+  // combined so that those of any last positions can be taken out:
+  // rolling_hashes_[i] = rotl(rolling_hashes_[i - 1], 1) ^ positions_[i].Hash()
+  std::vector<uint64_t> rolling_hashes_;
 };
 
 }  // namespace lczero
@@ -128,6 +128,61 @@ TEST(PositionHistory, DidRepeatSinceLastZeroingMoveNeverRepeated) {
   EXPECT_FALSE(history.DidRepeatSinceLastZeroingMove());
 }
 
+TEST(PositionHistory, HashLast) {
+  PositionHistory a;
+  a.Reset(ChessBoard::kStartposBoard, 0, 0);
+  a.Append(Move("g1f3", false));
+  a.Append(Move("g8f6", true));
+  a.Append(Move("b1c3", false));
+  a.Append(Move("b8c6", true));
+  PositionHistory b;
+  b.Reset(ChessBoard::kStartposBoard, 0, 0);
+  b.Append(Move("b1c3", false));
+  b.Append(Move("b8c6", true));
+  b.Append(Move("g1f3", false));
+  b.Append(Move("g8f6", true));
+  // Same position, reached differently.
+  const ChessBoard board(
+      "r1bqkb1r/pppppppp/2n2n2/8/8/2N2N2/PPPPPPPP/R1BQKB1R w KQkq - 4 3");
+  EXPECT_EQ(a.Last().GetBoard().Hash(), board.Hash());
+  EXPECT_EQ(b.Last().GetBoard().Hash(), board.Hash());
+  EXPECT_EQ(a.HashLast(1), b.HashLast(1));
+  EXPECT_NE(a.HashLast(2), b.HashLast(2));
+  // Same positions as before trimming.
+  const uint64_t hash = a.HashLast(8);
+  a.Trim(3);
+  a.Append(Move("b1c3", false));
+  a.Append(Move("b8c6", true));
+  EXPECT_EQ(a.HashLast(8), hash);
+  EXPECT_NE(a.HashLast(4), a.HashLast(5));
+}
+
+TEST(PositionHistory, AppendTail) {
+  PositionHistory a;
+  a.Reset(ChessBoard::kStartposBoard, 0, 0);
+  a.Append(Move("g1f3", false));
+  a.Append(Move("g8f6", true));
+  a.Append(Move("f3g1", false));
+  a.Append(Move("f6g8", true));
+  PositionHistory::Tail tail;
+  a.GetTail(1, &tail);
+  EXPECT_EQ(tail.positions.size(), 4u);
+  PositionHistory b;
+  b.Reset(ChessBoard::kStartposBoard, 0, 0);
+  b.Append(Move("g1f3", false));
+  b.AppendTail(tail, 4);
+  EXPECT_EQ(b.GetLength(), 4);
+  EXPECT_EQ(b.GetMoveAt(3), a.GetMoveAt(3));
+  b.AppendTail(tail, 5);
+  // Repetitions and hashes come along.
+  EXPECT_EQ(b.Last().GetRepetitions(), 1);
+  EXPECT_EQ(b.HashLast(8), a.HashLast(8));
+  b.Append(Move("g1f3", false));
+  a.Append(Move("g1f3", false));
+  EXPECT_EQ(b.HashLast(8), a.HashLast(8));
+  EXPECT_EQ(b.Last().GetRepetitions(), 1);
+}
+
 }  // namespace lczero
 
 int main(int argc, char** argv) {
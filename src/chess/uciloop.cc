@@ -27,16 +27,20 @@
 
 #include "uciloop.h"
 
+#include <condition_variable>
+#include <deque>
 #include <iomanip>
 #include <iostream>
 #include <mutex>
 #include <sstream>
 #include <string>
+#include <thread>
 #include <unordered_map>
 #include <unordered_set>
 #include <utility>
 #include "utils/exception.h"
 #include "utils/logging.h"
+#include "utils/metrics.h"
 #include "utils/string.h"
 #include "version.h"
 
@@ -56,6 +60,8 @@ const std::unordered_map<std::string, std::unordered_set<std::string>>
         {{"start"}, {}},
         {{"stop"}, {}},
         {{"ponderhit"}, {}},
+        {{"savetree"}, {"file"}},
+        {{"loadtree"}, {"file"}},
         {{"quit"}, {}},
         {{"xyzzy"}, {}},
 };
@@ -122,21 +128,129 @@ bool ContainsKey(const std::unordered_map<std::string, std::string>& params,
                  const std::string& key) {
   return params.find(key) != params.end();
 }
+
+Counter gUciResponsesMetric(
+    "lc0_uci_responses_total",
+    "Responses to stop, ponderhit and isready which were timed.");
+Counter gUciLatencyMetric(
+    "lc0_uci_latency_microseconds_total",
+    "Time from reading stop, ponderhit and isready to their response, "
+    "summed.");
+
+// Lines read from stdin, with the time they arrived.
+class InputQueue {
+ public:
+  void Push(std::string line) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      lines_.emplace_back(std::move(line), std::chrono::steady_clock::now());
+    }
+    cv_.notify_one();
+  }
+  void Close() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      closed_ = true;
+    }
+    cv_.notify_one();
+  }
+  // Returns false once closed and empty.
+  bool Pop(std::string* line, std::chrono::steady_clock::time_point* received) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [this]() { return closed_ || !lines_.empty(); });
+    if (lines_.empty()) return false;
+    *line = std::move(lines_.front().first);
+    *received = lines_.front().second;
+    lines_.pop_front();
+    return true;
+  }
+
+ private:
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::deque<std::pair<std::string, std::chrono::steady_clock::time_point>>
+      lines_;
+  bool closed_ = false;
+};
+
+void RecordLatency(const std::string& command,
+                   std::chrono::steady_clock::time_point received) {
+  const auto latency_us = std::chrono::duration_cast<std::chrono::microseconds>(
+                              std::chrono::steady_clock::now() - received)
+                              .count();
+  gUciResponsesMetric.Add();
+  gUciLatencyMetric.Add(latency_us);
+  LOGFILE << "Latency of " << command << ": " << latency_us / 1000.0 << "ms";
+}
+
+bool IsQuit(const std::string& line) {
+  std::istringstream iss(line);
+  std::string token;
+  iss >> token;
+  return token == "quit";
+}
 }  // namespace
 
 void UciLoop::RunLoop() {
   std::cout.setf(std::ios::unitbuf);
+  // Input is read on a thread of its own, so that a command is taken off the
+  // pipe and timestamped as soon as it arrives, even while an earlier one is
+  // being handled. The reader ends at quit, so that it can be joined.
+  InputQueue input;
+  std::thread reader([&input]() {
+    std::string line;
+    while (std::getline(std::cin, line)) {
+      const bool quit = IsQuit(line);
+      input.Push(std::move(line));
+      if (quit) break;
+    }
+    input.Close();
+  });
   std::string line;
-  while (std::getline(std::cin, line)) {
-    LOGFILE << ">> " << line;
-    try {
-      auto command = ParseCommand(line);
-      // Ignore empty line.
-      if (command.first.empty()) continue;
-      if (!DispatchCommand(command.first, command.second)) break;
-    } catch (Exception& ex) {
-      SendResponse(std::string("error ") + ex.what());
+  std::chrono::steady_clock::time_point received;
+  while (input.Pop(&line, &received)) {
+    if (!ProcessLine(line, received)) break;
+  }
+  reader.join();
+}
+
+bool UciLoop::ProcessLine(const std::string& line,
+                          std::chrono::steady_clock::time_point received) {
+  LOGFILE << ">> " << line;
+  try {
+    auto command = ParseCommand(line);
+    // Ignore empty line.
+    if (command.first.empty()) return true;
+    {
+      std::lock_guard<std::mutex> lock(latency_mutex_);
+      if (command.first == "go") {
+        // A stop without a search to stop gets no bestmove.
+        awaited_responses_.clear();
+      } else if (command.first == "stop") {
+        awaited_responses_.push_back({command.first, "bestmove", received});
+      } else if (command.first == "isready") {
+        awaited_responses_.push_back({command.first, "readyok", received});
+      }
     }
+    const bool result = DispatchCommand(command.first, command.second);
+    // The search goes on after ponderhit, it's done once it's under way.
+    if (command.first == "ponderhit") RecordLatency(command.first, received);
+    return result;
+  } catch (Exception& ex) {
+    SendResponse(std::string("error ") + ex.what());
+  }
+  return true;
+}
+
+void UciLoop::MeasureLatency(const std::string& response) {
+  const std::string word = response.substr(0, response.find(' '));
+  std::lock_guard<std::mutex> lock(latency_mutex_);
+  for (auto iter = awaited_responses_.begin();
+       iter != awaited_responses_.end(); ++iter) {
+    if (iter->response != word) continue;
+    RecordLatency(iter->command, iter->received);
+    awaited_responses_.erase(iter);
+    return;
   }
 }
 
@@ -197,6 +311,14 @@ bool UciLoop::DispatchCommand(
     CmdPonderHit();
   } else if (command == "start") {
     CmdStart();
+  } else if (command == "savetree" || command == "loadtree") {
+    const std::string filename = GetOrEmpty(params, "file");
+    if (filename.empty()) throw Exception(command + " requires a file");
+    if (command == "savetree") {
+      CmdSaveTree(filename);
+    } else {
+      CmdLoadTree(filename);
+    }
   } else if (command == "xyzzy") {
     SendResponse("Nothing happens.");
   } else if (command == "quit") {
@@ -209,6 +331,7 @@ bool UciLoop::DispatchCommand(
 
 void UciLoop::SendResponse(const std::string& response) {
   SendResponses({response});
+  MeasureLatency(response);
 }
 
 void UciLoop::SendResponses(const std::vector<std::string>& responses) {
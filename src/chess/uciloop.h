@@ -27,7 +27,9 @@
 
 #pragma once
 
+#include <chrono>
 #include <fstream>
+#include <mutex>
 #include <string>
 #include <unordered_map>
 #include <vector>
@@ -82,11 +84,36 @@ class UciLoop {
   virtual void CmdStop() { throw Exception("Not supported"); }
   virtual void CmdPonderHit() { throw Exception("Not supported"); }
   virtual void CmdStart() { throw Exception("Not supported"); }
+  virtual void CmdSaveTree(const std::string& /*filename*/) {
+    throw Exception("Not supported");
+  }
+  virtual void CmdLoadTree(const std::string& /*filename*/) {
+    throw Exception("Not supported");
+  }
+
+ protected:
+  // Handles one line of input, which arrived at @received. Returns false on
+  // quit.
+  bool ProcessLine(const std::string& line,
+                   std::chrono::steady_clock::time_point received =
+                       std::chrono::steady_clock::now());
 
  private:
   bool DispatchCommand(
       const std::string& command,
       const std::unordered_map<std::string, std::string>& params);
+  // Logs the time from the command awaiting @response, if any, to now.
+  void MeasureLatency(const std::string& response);
+
+  // Commands whose latency is measured up to their response, with the
+  // response's first word and when the command arrived.
+  struct AwaitedResponse {
+    std::string command;
+    std::string response;
+    std::chrono::steady_clock::time_point received;
+  };
+  std::mutex latency_mutex_;
+  std::vector<AwaitedResponse> awaited_responses_;
 };
 
 }  // namespace lczero
@@ -27,12 +27,18 @@
 
 #include <algorithm>
 #include <cmath>
+#include <fstream>
 #include <functional>
+#include <future>
 
 #include "engine.h"
 #include "mcts/search.h"
+#include "utils/affinity.h"
 #include "utils/configfile.h"
+#include "utils/largepages.h"
 #include "utils/logging.h"
+#include "utils/metrics.h"
+#include "utils/random.h"
 
 namespace lczero {
 namespace {
@@ -40,6 +46,35 @@ const int kDefaultThreads = 2;
 
 const OptionId kThreadsOptionId{"threads", "Threads",
                                 "Number of (CPU) worker threads to use.", 't'};
+const OptionId kRootTreesId{
+    "root-trees", "RootTrees",
+    "Number of independent trees to search the position on, the threads "
+    "split among them. The trees share the NN cache, and bestmove goes by the "
+    "visits of the root moves summed over all trees. It's a little less "
+    "efficient search, but scales better on many CPU cores when the shared "
+    "tree is the bottleneck."};
+const OptionId kDistributedPeersId{
+    "distributed-peers", "DistributedPeers",
+    "Comma separated host:port of search workers (lc0 searchworker) to search "
+    "along with, each tree on a share of the root moves. The moves are shared "
+    "out by their visits, and bestmove goes by the visits of all trees. Empty "
+    "to search alone."};
+const OptionId kDistributedIntervalId{
+    "distributed-interval", "DistributedInterval",
+    "Milliseconds between the checks for stats of the search workers. The "
+    "root moves are shared out again every 8."};
+const OptionId kAutoTuneId{
+    "auto-tune", "AutoTune",
+    "Tunes the minibatch size and the number of active search threads while "
+    "searching, for the highest speed. MiniBatchSize and Threads are the "
+    "largest values tried. Not done in the deterministic mode or with "
+    "several root trees."};
+const OptionId kAutoTuneMinBatchId{
+    "auto-tune-min-batch", "AutoTuneMinBatch",
+    "Smallest minibatch size AutoTune tries."};
+const OptionId kAutoTuneMinThreadsId{
+    "auto-tune-min-threads", "AutoTuneMinThreads",
+    "Fewest search threads AutoTune runs."};
 const OptionId kLogFileId{"logfile", "LogFile",
                           "Write log to that file. Special value <stderr> to "
                           "output the log to the console.",
@@ -48,6 +83,33 @@ const OptionId kNNCacheSizeId{
     "nncache", "NNCacheSize",
     "Number of positions to store in a memory cache. A large cache can speed "
     "up searching, but takes memory."};
+const OptionId kNNCacheFileId{
+    "nncache-file", "NNCacheFile",
+    "File to keep the NN cache in between sessions. It's loaded at startup "
+    "(and ignored if written for different weights), positions found in it "
+    "are copied into the memory cache, and it's rewritten on exit."};
+const OptionId kHotSwapNetworkId{
+    "hot-swap-network", "HotSwapNetwork",
+    "When the network changes, load the new one in the background while the "
+    "current one keeps searching, and switch to it between moves once it's "
+    "ready. Evaluations of the old network left in the NN cache are dropped "
+    "as they are found."};
+const OptionId kSmallWeightsFileId{
+    "small-weights", "SmallWeightsFile",
+    "Weights of a smaller network, run on the same backend, which evaluates "
+    "prefetched positions and leaves of a low prior, see SmallNetworkPrior. "
+    "Those are evaluated by the main network later if they get visits. Empty "
+    "to only use the main network."};
+const OptionId kNNCacheSaveIntervalId{
+    "nncache-save-interval", "NNCacheSaveInterval",
+    "When NNCacheFile is set, also save the cache before a search if that "
+    "many seconds passed since the last save. 0 means only on exit."};
+const OptionId kNNCachePolicyId{
+    "nncache-policy", "NNCachePolicy",
+    "Which positions are kept when the NN cache is full. lru evicts the "
+    "oldest ones. tinylfu admits a new position into the main cache only if "
+    "it was seen more often than the one it would replace. weighted gives "
+    "positions looked up again and again further rounds."};
 const OptionId kSlowMoverId{
     "slowmover", "Slowmover",
     "Budgeted time for a move is multiplied by this value, causing the engine "
@@ -74,28 +136,125 @@ const OptionId kSyzygyTablebaseId{
     "List of Syzygy tablebase directories, list entries separated by system "
     "separator (\";\" for Windows, \":\" for Linux).",
     's'};
+const OptionId kSyzygyPreloadId{
+    "syzygy-preload", "SyzygyPreload",
+    "Read the tablebases of up to this many pieces into memory when they are "
+    "loaded, instead of on first use in search. 0 to not preload."};
+const OptionId kSyzygyLockId{
+    "syzygy-lock", "SyzygyLock",
+    "Lock the preloaded tablebases in memory, so that they are never paged "
+    "out. Needs a large enough memory lock limit (ulimit -l)."};
+const OptionId kSyzygyMemoryBudgetId{
+    "syzygy-memory-budget", "SyzygyMemoryBudget",
+    "Memory in MiB the tablebases probed most recently may take up, those "
+    "probed less recently are dropped from memory and the page cache. 0 for "
+    "no limit."};
 const OptionId kSpendSavedTimeId{
     "immediate-time-use", "ImmediateTimeUse",
     "Fraction of time saved by smart pruning, which is added to the budget to "
     "the next move rather than to the entire game. When 1, all saved time is "
     "added to the next move's budget; when 0, saved time is distributed among "
     "all future moves."};
+const OptionId kTimeReuseDiscountId{
+    "time-reuse-discount", "TimeReuseDiscount",
+    "Shortens the time budgeted for a move by this fraction of the share the "
+    "reused tree is expected to have in the tree at the end of the search, "
+    "going by the speed of the previous moves. 0 to budget the same time "
+    "however much of the tree is reused."};
 const OptionId kPonderId{"ponder", "Ponder",
                          "This option is ignored. Here to please chess GUIs."};
-// Warning! When changed, also change number 30 in the help below!
-const size_t kAvgMovesPerPosition = 30;
 const OptionId kRamLimitMbId{
     "ramlimit-mb", "RamLimitMb",
-    "Maximum memory usage for the engine, in megabytes. The estimation is very "
-    "rough, and can be off by a lot. For example, multiple visits to a "
-    "terminal node counted several times, and the estimation assumes that all "
-    "positions have 30 possible moves. When set to 0, no RAM limit is "
-    "enforced."};
+    "Maximum memory usage for the NN cache and search tree, in megabytes. The "
+    "search stops when the tree takes what the cache leaves. When set to 0, "
+    "no RAM limit is enforced."};
+const OptionId kHugePagesId{
+    "huge-pages", "HugePages",
+    "Backs the search tree and the NN cache with 2MB huge pages, which cuts "
+    "TLB misses with large trees and caches. 'transparent' asks the kernel "
+    "for transparent huge pages, 'explicit' takes preallocated ones "
+    "(vm.nr_hugepages) first. Applies to memory allocated afterwards. Linux "
+    "only."};
+const OptionId kNumaPolicyId{
+    "numa-policy", "NumaPolicy",
+    "Placement of the search tree and NN cache memory on machines with "
+    "several NUMA nodes. 'interleave' spreads it over all nodes, "
+    "'firsttouch' keeps tree memory on the node of the search thread which "
+    "uses it. Applies to memory allocated afterwards. Linux only."};
+const OptionId kSearchAffinityId{
+    "search-affinity", "SearchAffinity",
+    "Pins search threads to CPUs. 'compact' gives each thread its own "
+    "physical core, filling one CPU package after the other, 'scatter' takes "
+    "a core of each package in turn. SMT siblings are only used once all "
+    "cores have a thread. A CPU list like 0-7,16 pins the threads to its "
+    "CPUs in turn. 'none' leaves placement to the OS."};
+const OptionId kBackendAffinityId{
+    "backend-affinity", "BackendAffinity",
+    "Pins the worker threads of the multiplexing and demux backends like "
+    "SearchAffinity, but taking CPUs from the end of the order, away from "
+    "the search threads."};
+const OptionId kGcAffinityId{
+    "gc-affinity", "GcAffinity",
+    "Pins the threads freeing released subtrees like BackendAffinity."};
+const OptionId kRamLimitPruneId{
+    "ramlimit-prune", "RamLimitPrune",
+    "When the tree reaches the RAM limit, prune its least visited subtrees "
+    "off the principal variation and keep searching instead of stopping. "
+    "Pruned nodes keep their statistics. Not done with transpositions."};
+
+const OptionId kRetainSiblingsId{
+    "retain-siblings", "RetainSiblings",
+    "Number of the most visited subtrees of moves not played which the tree "
+    "keeps, instead of releasing them, for a position set back to an earlier "
+    "one or to another line, as after a takeback, to reuse them. When set to "
+    "0, only the subtree of the move played is kept."};
+const OptionId kRetainSiblingsVisitsId{
+    "retain-siblings-visits", "RetainSiblingsVisits",
+    "Total visits, about a node each, which the subtrees kept by "
+    "RetainSiblings hold at most; the less visited ones beyond it are "
+    "released."};
+
+const OptionId kBackgroundNodesId{
+    "background-nodes", "BackgroundNodes",
+    "After sending bestmove, keep searching the position in the background "
+    "until the next command, as long as the tree has fewer visits than that. "
+    "The next search reuses the subtree of the move played. RamLimitMb bounds "
+    "it too. When set to 0, the search stops at bestmove."};
+
+// FNV-1a hash of the file content, 0 if the file cannot be read.
+uint64_t HashFileContents(const std::string& filename) {
+  std::ifstream file(filename, std::ios::binary);
+  if (!file) return 0;
+  uint64_t hash = 0xCBF29CE484222325ull;
+  std::vector<char> buffer(1 << 20);
+  while (file) {
+    file.read(buffer.data(), buffer.size());
+    const auto count = file.gcount();
+    for (std::streamsize i = 0; i < count; ++i) {
+      hash = (hash ^ static_cast<unsigned char>(buffer[i])) *
+             0x100000001B3ull;
+    }
+  }
+  return hash;
+}
 
-const size_t kAvgNodeSize = sizeof(Node) + kAvgMovesPerPosition * sizeof(Edge);
-const size_t kAvgCacheItemSize =
-    NNCache::GetItemStructSize() + sizeof(CachedNNRequest) +
-    sizeof(CachedNNRequest::IdxAndProb) * kAvgMovesPerPosition;
+EngineController::LoadedNetwork LoadNetworkWithHash(
+    const OptionsDict& options) {
+  EngineController::LoadedNetwork loaded;
+  // Reading the file once more for its hash goes along with the decoding and
+  // the backend setup. An autodiscovered file is only known afterwards.
+  const std::string option_path =
+      options.Get<std::string>(NetworkFactory::kWeightsId.GetId());
+  auto option_hash =
+      std::async(std::launch::async, HashFileContents, option_path);
+  std::string weights_path;
+  loaded.network = NetworkFactory::LoadNetwork(options, &weights_path);
+  loaded.weights_hash = option_hash.get();
+  if (weights_path != option_path) {
+    loaded.weights_hash = HashFileContents(weights_path);
+  }
+  return loaded;
+}
 
 float ComputeEstimatedMovesToGo(int ply, float midpoint, float steepness) {
   // An analysis of chess games shows that the distribution of game lengths
@@ -119,8 +278,10 @@ float ComputeEstimatedMovesToGo(int ply, float midpoint, float steepness) {
 
 EngineController::EngineController(BestMoveInfo::Callback best_move_callback,
                                    ThinkingInfo::Callback info_callback,
-                                   const OptionsDict& options)
+                                   const OptionsDict& options,
+                                   const SharedResources* shared)
     : options_(options),
+      shared_(shared),
       best_move_callback_(best_move_callback),
       info_callback_(info_callback),
       move_start_time_(std::chrono::steady_clock::now()) {}
@@ -130,7 +291,19 @@ void EngineController::PopulateOptions(OptionsParser* options) {
 
   NetworkFactory::PopulateOptions(options);
   options->Add<IntOption>(kThreadsOptionId, 1, 128) = kDefaultThreads;
+  options->Add<IntOption>(kRootTreesId, 1, 128) = 1;
+  options->Add<StringOption>(kDistributedPeersId);
+  options->Add<IntOption>(kDistributedIntervalId, 10, 60000) = 250;
+  options->Add<BoolOption>(kAutoTuneId) = false;
+  options->Add<IntOption>(kAutoTuneMinBatchId, 1, 1024) = 32;
+  options->Add<IntOption>(kAutoTuneMinThreadsId, 1, 128) = 1;
   options->Add<IntOption>(kNNCacheSizeId, 0, 999999999) = 200000;
+  options->Add<StringOption>(kNNCacheFileId);
+  options->Add<IntOption>(kNNCacheSaveIntervalId, 0, 1000000) = 0;
+  options->Add<BoolOption>(kHotSwapNetworkId) = false;
+  options->Add<StringOption>(kSmallWeightsFileId);
+  std::vector<std::string> cache_policies = {"lru", "tinylfu", "weighted"};
+  options->Add<ChoiceOption>(kNNCachePolicyId, cache_policies) = "lru";
   SearchParams::Populate(options);
 
   options->Add<FloatOption>(kSlowMoverId, 0.0f, 100.0f) = 1.0f;
@@ -138,11 +311,27 @@ void EngineController::PopulateOptions(OptionsParser* options) {
   options->Add<FloatOption>(kTimeMidpointMoveId, 1.0f, 100.0f) = 51.5f;
   options->Add<FloatOption>(kTimeSteepnessId, 1.0f, 100.0f) = 7.0f;
   options->Add<StringOption>(kSyzygyTablebaseId);
+  options->Add<IntOption>(kSyzygyPreloadId, 0, 7) = 0;
+  options->Add<BoolOption>(kSyzygyLockId) = false;
+  options->Add<IntOption>(kSyzygyMemoryBudgetId, 0, 1 << 30) = 0;
   // Add "Ponder" option to signal to GUIs that we support pondering.
   // This option is currently not used by lc0 in any way.
   options->Add<BoolOption>(kPonderId) = true;
   options->Add<FloatOption>(kSpendSavedTimeId, 0.0f, 1.0f) = 1.0f;
+  options->Add<FloatOption>(kTimeReuseDiscountId, 0.0f, 1.0f) = 0.0f;
   options->Add<IntOption>(kRamLimitMbId, 0, 100000000) = 0;
+  options->Add<BoolOption>(kRamLimitPruneId) = false;
+  options->Add<IntOption>(kRetainSiblingsId, 0, 256) = 0;
+  options->Add<IntOption>(kRetainSiblingsVisitsId, 0, 999999999) = 1000000;
+  options->Add<StringOption>(kSearchAffinityId) = "none";
+  options->Add<StringOption>(kBackendAffinityId) = "none";
+  options->Add<StringOption>(kGcAffinityId) = "none";
+  std::vector<std::string> huge_pages = {"off", "transparent", "explicit"};
+  options->Add<ChoiceOption>(kHugePagesId, huge_pages) = "off";
+  std::vector<std::string> numa_policies = {"default", "interleave",
+                                            "firsttouch"};
+  options->Add<ChoiceOption>(kNumaPolicyId, numa_policies) = "default";
+  options->Add<IntOption>(kBackgroundNodesId, 0, 999999999) = 0;
 
   ConfigFile::PopulateOptions(options);
 
@@ -164,23 +353,38 @@ SearchLimits EngineController::PopulateSearchLimits(
     }
   }
   limits.infinite = params.infinite || params.ponder;
+  const int64_t reused_visits = tree_->GetCurrentHead()->GetN();
   if (params.movetime && !limits.infinite) {
     limits.search_deadline = start_time + std::chrono::milliseconds(
                                               *params.movetime - move_overhead);
+    time_manager_.StartSearch(*params.movetime - move_overhead,
+                              reused_visits);
   }
   if (params.nodes) limits.visits = *params.nodes;
+  if (shared_ && shared_->max_visits &&
+      shared_->max_visits < limits.visits) {
+    limits.visits = shared_->max_visits;
+  }
+  int64_t background_nodes = options_.Get<int>(kBackgroundNodesId.GetId());
+  if (shared_ && shared_->max_visits) {
+    background_nodes = std::min(background_nodes, shared_->max_visits);
+  }
+  if (background_nodes) limits.background_visits = background_nodes;
   const int ram_limit = options_.Get<int>(kRamLimitMbId.GetId());
   if (ram_limit) {
-    const auto cache_size =
-        options_.Get<int>(kNNCacheSizeId.GetId()) * kAvgCacheItemSize;
-    int64_t limit = (ram_limit * 1000000LL - cache_size) / kAvgNodeSize;
+    // Both are counted exactly: the cache preallocates its storage, and the
+    // tree counts the arena bytes of its own nodes as it grows.
+    const int64_t cache_size =
+        (shared_ ? shared_->cache : &cache_)->GetBytesAllocated();
+    limits.tree_memory =
+        std::max(int64_t(0), ram_limit * int64_t(1000000) - cache_size);
     LOGFILE << "RAM limit " << ram_limit << "MB. Cache takes "
-            << cache_size / 1000000 << "MB. Remaining memory is enough for "
-            << limit << " nodes.";
-    if (limit < 0) limit = 0;
-    if (limit < limits.visits) limits.visits = limit;
+            << cache_size / 1000000 << "MB. Remaining "
+            << limits.tree_memory / 1000000 << "MB are for the tree.";
+    limits.prune_tree = options_.Get<bool>(kRamLimitPruneId.GetId());
   }
   if (params.depth) limits.depth = *params.depth;
+  limits.predicted_nps = time_manager_.GetPredictedNps();
   if (limits.infinite || !time) return limits;
   const optional<int64_t>& inc = is_black ? params.binc : params.winc;
   const int increment = inc ? std::max(int64_t(0), *inc) : 0;
@@ -230,6 +434,17 @@ SearchLimits EngineController::PopulateSearchLimits(
     time_spared_ms_ -= this_move_time * (slowmover - 1);
   }
 
+  // Fewer new visits are needed when much of the tree is already there.
+  const float reuse_discount =
+      options_.Get<float>(kTimeReuseDiscountId.GetId());
+  if (reuse_discount > 0.0f) {
+    const int64_t shortened = time_manager_.ShortenBudget(
+        this_move_time, reused_visits, reuse_discount);
+    LOGFILE << "Reused " << reused_visits << " visits, budget shortened by "
+            << static_cast<int64_t>(this_move_time) - shortened << "ms.";
+    this_move_time = shortened;
+  }
+
   LOGFILE << "Budgeted time for the move: " << this_move_time << "ms(+"
           << time_to_squander << "ms to squander -"
           << std::chrono::duration_cast<std::chrono::milliseconds>(
@@ -241,16 +456,26 @@ SearchLimits EngineController::PopulateSearchLimits(
   this_move_time += time_to_squander;
 
   // Make sure we don't exceed current time limit with what we calculated.
-  limits.search_deadline =
-      start_time +
-      std::chrono::milliseconds(std::min(static_cast<int64_t>(this_move_time),
-                                         *time - move_overhead));
+  const int64_t budget =
+      std::min(static_cast<int64_t>(this_move_time), *time - move_overhead);
+  limits.search_deadline = start_time + std::chrono::milliseconds(budget);
+  time_manager_.StartSearch(budget, reused_visits);
   return limits;
 }
 
 // Updates values from Uci options.
-void EngineController::UpdateFromUciOptions() {
+void EngineController::UpdateFromUciOptions(bool wait_for_network) {
   SharedLock lock(busy_mutex_);
+  // Whoever shares them sets them up.
+  if (shared_) return;
+
+  // Before the backend threads start.
+  SetThreadAffinity(ThreadRole::kSearch,
+                    options_.Get<std::string>(kSearchAffinityId.GetId()));
+  SetThreadAffinity(ThreadRole::kBackend,
+                    options_.Get<std::string>(kBackendAffinityId.GetId()));
+  SetThreadAffinity(ThreadRole::kGc,
+                    options_.Get<std::string>(kGcAffinityId.GetId()));
 
   // Syzygy tablebases.
   std::string tb_paths = options_.Get<std::string>(kSyzygyTablebaseId.GetId());
@@ -262,22 +487,192 @@ void EngineController::UpdateFromUciOptions() {
       syzygy_tb_ = nullptr;
     } else {
       tb_paths_ = tb_paths;
+      const int preload = options_.Get<int>(kSyzygyPreloadId.GetId());
+      if (preload > 0) {
+        const size_t bytes = syzygy_tb_->preload(
+            preload, options_.Get<bool>(kSyzygyLockId.GetId()));
+        CERR << "Preloaded " << bytes / (1 << 20)
+             << " MiB of Syzygy tablebases.";
+      }
+    }
+  }
+  // Search workers of a distributed search. A failed connection is retried
+  // at the next position.
+  const auto peers = options_.Get<std::string>(kDistributedPeersId.GetId());
+  if (peers != distributed_peers_) {
+    coordinator_.reset();
+    if (!peers.empty()) {
+      coordinator_ = std::make_unique<DistributedCoordinator>(
+          peers,
+          std::chrono::milliseconds(
+              options_.Get<int>(kDistributedIntervalId.GetId())),
+          options_.Get<float>(SearchParams::kCpuctId.GetId()));
     }
+    distributed_peers_ = peers;
+  }
+
+  if (syzygy_tb_) {
+    syzygy_tb_->set_memory_budget(
+        static_cast<size_t>(options_.Get<int>(kSyzygyMemoryBudgetId.GetId()))
+        << 20);
   }
 
   // Network.
-  const auto network_configuration = NetworkFactory::BackendConfiguration(options_);
-  if (network_configuration_ != network_configuration) {
-    network_ = NetworkFactory::LoadNetwork(options_);
-    network_configuration_ = network_configuration;
+  const auto network_configuration =
+      NetworkFactory::BackendConfiguration(options_);
+  bool weights_changed = false;
+  // A network loaded in the background is switched to when no search holds
+  // the current one, unless the options changed again meanwhile. Without a
+  // network yet, the rest of its loading is waited for when one is needed.
+  if (pending_network_.valid() && !search_ &&
+      ((wait_for_network && !network_) ||
+       pending_network_.wait_for(std::chrono::seconds(0)) ==
+           std::future_status::ready)) {
+    auto loaded = pending_network_.get();
+    if (pending_configuration_ == network_configuration) {
+      if (network_) {
+        CERR << "Switched to the network loaded in the background.";
+      }
+      network_ = std::move(loaded.network);
+      network_configuration_ = network_configuration;
+      weights_changed = loaded.weights_hash != weights_hash_;
+      weights_hash_ = loaded.weights_hash;
+    }
+  }
+  if (network_configuration_ != network_configuration &&
+      !pending_network_.valid()) {
+    if ((network_ && options_.Get<bool>(kHotSwapNetworkId.GetId())) ||
+        (!network_ && !wait_for_network)) {
+      StartLoadingNetwork(network_configuration);
+    } else {
+      auto loaded = LoadNetworkWithHash(options_);
+      network_ = std::move(loaded.network);
+      network_configuration_ = network_configuration;
+      weights_changed = loaded.weights_hash != weights_hash_;
+      weights_hash_ = loaded.weights_hash;
+    }
+  }
+  // The small network takes the backend options of the main one.
+  const auto small_weights =
+      options_.Get<std::string>(kSmallWeightsFileId.GetId());
+  OptionsDict small_options(&options_);
+  small_options.Set<std::string>(NetworkFactory::kWeightsId.GetId(),
+                                 small_weights);
+  const NetworkFactory::BackendConfiguration small_configuration(
+      small_options);
+  if (small_configuration != small_configuration_ && wait_for_network) {
+    // Its cached evaluations are stale.
+    if (small_network_) weights_changed = true;
+    small_network_.reset();
+    if (!small_weights.empty()) {
+      small_network_ = NetworkFactory::LoadNetwork(small_options);
+    }
+    small_configuration_ = small_configuration;
   }
 
-  // Cache size.
+  // Cache size and eviction policy.
+  const std::string cache_policy =
+      options_.Get<std::string>(kNNCachePolicyId.GetId());
+  if (cache_policy == "tinylfu") {
+    cache_.SetPolicy(NNCache::Policy::kTinyLfu);
+  } else if (cache_policy == "weighted") {
+    cache_.SetPolicy(NNCache::Policy::kWeighted);
+  } else {
+    cache_.SetPolicy(NNCache::Policy::kLru);
+  }
+  // Before the cache is allocated, and the tree pages which follow.
+  const std::string huge_option =
+      options_.Get<std::string>(kHugePagesId.GetId());
+  HugePages huge_pages = HugePages::kOff;
+  if (huge_option == "transparent") {
+    huge_pages = HugePages::kTransparent;
+  } else if (huge_option == "explicit") {
+    huge_pages = HugePages::kExplicit;
+  }
+  const std::string numa_option =
+      options_.Get<std::string>(kNumaPolicyId.GetId());
+  NumaPolicy numa_policy = NumaPolicy::kDefault;
+  if (numa_option == "interleave") {
+    numa_policy = NumaPolicy::kInterleave;
+  } else if (numa_option == "firsttouch") {
+    numa_policy = NumaPolicy::kFirstTouch;
+  }
+  SetLargeAllocationPolicy(huge_pages, numa_policy);
   cache_.SetCapacity(options_.Get<int>(kNNCacheSizeId.GetId()));
+
+  // Persistent cache. It's keyed by the weights hash, so it waits until the
+  // network is there.
+  const std::string cache_file =
+      options_.Get<std::string>(kNNCacheFileId.GetId());
+  if (!network_) {
+    if (weights_changed) cache_.NewGeneration();
+  } else if (cache_file != nncache_file_ || weights_changed) {
+    // Cached evaluations are only valid for the weights they came from.
+    SaveNNCache();
+    if (weights_changed) cache_.NewGeneration();
+    cache_.CloseFile();
+    nncache_file_ = cache_file;
+    nncache_weights_hash_ = weights_hash_;
+    if (!nncache_file_.empty() &&
+        cache_.LoadFromFile(nncache_file_, nncache_weights_hash_)) {
+      CERR << "Loaded NN cache file " << nncache_file_;
+    }
+    last_nncache_save_ = std::chrono::steady_clock::now();
+  }
+  const int save_interval = options_.Get<int>(kNNCacheSaveIntervalId.GetId());
+  if (save_interval > 0 && !nncache_file_.empty() &&
+      std::chrono::steady_clock::now() - last_nncache_save_ >
+          std::chrono::seconds(save_interval)) {
+    SaveNNCache();
+  }
+}
+
+void EngineController::StartLoadingNetwork(
+    const NetworkFactory::BackendConfiguration& configuration) {
+  // The options may change while it loads, it gets a copy.
+  pending_configuration_ = configuration;
+  pending_network_ =
+      std::async(std::launch::async, [options = OptionsDict(options_)]() {
+        return LoadNetworkWithHash(options);
+      });
+}
+
+void EngineController::SaveNNCache() {
+  if (nncache_file_.empty()) return;
+  try {
+    cache_.SaveToFile(nncache_file_, nncache_weights_hash_);
+  } catch (const Exception& e) {
+    CERR << e.what();
+  }
+  last_nncache_save_ = std::chrono::steady_clock::now();
 }
 
 void EngineController::EnsureReady() {
-  std::unique_lock<RpSharedMutex> lock(busy_mutex_);
+  {
+    std::unique_lock<RpSharedMutex> lock(busy_mutex_);
+  }
+  // A running search may use the network and cache which the options would
+  // replace, then the next position sets them up.
+  bool searching;
+  {
+    SharedLock lock(busy_mutex_);
+    searching = search_ && search_->IsSearchActive();
+  }
+  // With backend warm-up configured, load the network now rather than on the
+  // first position, so that readyok comes after it.
+  const bool warmup =
+      !options_.Get<std::string>(NetworkFactory::kBackendWarmupId.GetId())
+           .empty();
+  if (warmup) {
+    if (!searching) UpdateFromUciOptions();
+  } else if (!shared_) {
+    // Otherwise the options are final by now, and the network loads while the
+    // host goes on with the handshake; the first position waits for the rest.
+    SharedLock lock(busy_mutex_);
+    if (!network_ && !pending_network_.valid()) {
+      StartLoadingNetwork(NetworkFactory::BackendConfiguration(options_));
+    }
+  }
   // If a UCI host is waiting for our ready response, we can consider the move
   // not started until we're done ensuring ready.
   move_start_time_ = std::chrono::steady_clock::now();
@@ -288,12 +683,14 @@ void EngineController::NewGame() {
   // newgame and goes straight into go.
   move_start_time_ = std::chrono::steady_clock::now();
   SharedLock lock(busy_mutex_);
-  cache_.Clear();
-  search_.reset();
+  // Other sessions may still use the evaluations of a shared cache.
+  if (!shared_) cache_.Clear();
+  ResetSearch();
   tree_.reset();
+  helper_trees_.clear();
   time_spared_ms_ = 0;
   current_position_.reset();
-  UpdateFromUciOptions();
+  UpdateFromUciOptions(false);
 }
 
 void EngineController::SetPosition(const std::string& fen,
@@ -303,22 +700,43 @@ void EngineController::SetPosition(const std::string& fen,
   move_start_time_ = std::chrono::steady_clock::now();
   SharedLock lock(busy_mutex_);
   current_position_ = CurrentPosition{fen, moves_str};
-  search_.reset();
+  ResetSearch();
 }
 
 void EngineController::SetupPosition(
     const std::string& fen, const std::vector<std::string>& moves_str) {
   SharedLock lock(busy_mutex_);
-  search_.reset();
+  ResetSearch();
 
   UpdateFromUciOptions();
 
   if (!tree_) tree_ = std::make_unique<NodeTree>();
+  tree_->SetSiblingRetention(
+      options_.Get<int>(kRetainSiblingsId.GetId()),
+      options_.Get<int>(kRetainSiblingsVisitsId.GetId()));
+  int root_trees = options_.Get<int>(kRootTreesId.GetId());
+  // Every tree runs at least one thread, which must stay within the cap.
+  if (shared_ && shared_->max_threads) {
+    root_trees = std::min(root_trees, shared_->max_threads);
+  }
+  helper_trees_.resize(root_trees - 1);
 
   std::vector<Move> moves;
   for (const auto& move : moves_str) moves.emplace_back(move);
   const bool is_same_game = tree_->ResetToPosition(fen, moves);
+  tree_fen_ = fen;
+  tree_moves_ = moves_str;
   if (!is_same_game) time_spared_ms_ = 0;
+  for (auto& tree : helper_trees_) {
+    if (!tree) tree = std::make_unique<NodeTree>();
+    tree->ResetToPosition(fen, moves);
+  }
+}
+
+void EngineController::ResetSearch() {
+  if (coordinator_) coordinator_->Stop();
+  search_.reset();
+  helper_searches_.clear();
 }
 
 void EngineController::Go(const GoParams& params) {
@@ -374,26 +792,111 @@ void EngineController::Go(const GoParams& params) {
 
   // If there is a time limit, also store amount of time saved.
   if (limits.search_deadline) {
-    best_move_callback = [this, limits](const BestMoveInfo& info) {
+    // Nodes of the last info, which is sent right before bestmove.
+    auto nodes = std::make_shared<int64_t>(0);
+    info_callback = [info_callback,
+                     nodes](const std::vector<ThinkingInfo>& infos) {
+      if (!infos.empty() && infos.front().nodes >= 0) {
+        *nodes = infos.front().nodes;
+      }
+      info_callback(infos);
+    };
+    best_move_callback = [this, limits, start_time,
+                          nodes](const BestMoveInfo& info) {
       best_move_callback_(info);
+      const auto now = std::chrono::steady_clock::now();
       if (limits.search_deadline) {
         time_spared_ms_ +=
             std::chrono::duration_cast<std::chrono::milliseconds>(
-                *limits.search_deadline - std::chrono::steady_clock::now())
+                *limits.search_deadline - now)
                 .count();
       }
+      time_manager_.FinishSearch(
+          *nodes, std::chrono::duration_cast<std::chrono::milliseconds>(
+                      now - start_time)
+                      .count());
     };
   }
 
-  search_ = std::make_unique<Search>(*tree_, network_.get(), best_move_callback,
-                                     info_callback, limits, options_, &cache_,
-                                     syzygy_tb_.get());
+  // The other trees of a root parallel group are searched until bestmove.
+  if (!helper_trees_.empty() || coordinator_) {
+    best_move_callback = [this,
+                          best_move_callback](const BestMoveInfo& info) {
+      for (auto& search : helper_searches_) search->Abort();
+      if (coordinator_) coordinator_->Stop();
+      best_move_callback(info);
+    };
+  }
+
+  ResetSearch();
+  Network* const network = shared_ ? shared_->network : network_.get();
+  NNCache* const cache = shared_ ? shared_->cache : &cache_;
+  SyzygyTablebase* const syzygy_tb =
+      shared_ ? shared_->syzygy_tb : syzygy_tb_.get();
+  search_ = std::make_unique<Search>(*tree_, network, best_move_callback,
+                                     info_callback, limits, options_, cache,
+                                     syzygy_tb);
+  search_->SetSmallNetwork(small_network_.get());
+  const int workers = coordinator_ ? coordinator_->GetWorkerCount() : 0;
+  if (!helper_trees_.empty() || workers) {
+    root_stats_ = std::make_unique<SharedRootStats>(helper_trees_.size() + 1 +
+                                                    workers);
+    search_->SetRootStats(root_stats_.get(), 0);
+    SearchLimits helper_limits = limits;
+    helper_limits.infinite = true;
+    helper_limits.search_deadline.reset();
+    helper_limits.background_visits = -1;
+    for (const auto& tree : helper_trees_) {
+      helper_searches_.emplace_back(std::make_unique<Search>(
+          *tree, network, [](const BestMoveInfo&) {},
+          [](const std::vector<ThinkingInfo>&) {}, helper_limits, options_,
+          cache, syzygy_tb));
+      helper_searches_.back()->SetRootStats(root_stats_.get(),
+                                            helper_searches_.size());
+      helper_searches_.back()->SetSmallNetwork(small_network_.get());
+      // Helpers are infinite, but go with the main search.
+      helper_searches_.back()->SetComputationPriority(
+          limits.infinite ? ComputationPriority::kBackground
+                          : ComputationPriority::kNormal);
+    }
+  }
 
   if (limits.search_deadline) {
     LOGFILE << "Timer started at "
             << FormatTime(SteadyClockToSystemClock(move_start_time_));
   }
-  search_->StartThreads(options_.Get<int>(kThreadsOptionId.GetId()));
+  int threads = options_.Get<int>(kThreadsOptionId.GetId());
+  if (shared_ && shared_->max_threads) {
+    threads = std::min(threads, shared_->max_threads);
+  }
+  if (helper_searches_.empty() && options_.Get<bool>(kAutoTuneId.GetId())) {
+    const int max_minibatch =
+        options_.Get<int>(SearchParams::kMiniBatchSizeId.GetId());
+    AutoTuner::Bounds bounds;
+    bounds.min_minibatch =
+        std::min(options_.Get<int>(kAutoTuneMinBatchId.GetId()), max_minibatch);
+    bounds.max_minibatch = max_minibatch;
+    bounds.min_threads =
+        std::min(options_.Get<int>(kAutoTuneMinThreadsId.GetId()), threads);
+    bounds.max_threads = threads;
+    // The tuned settings carry over to the next search unless the limits
+    // changed.
+    if (!auto_tuner_ || auto_tuner_->GetBounds() != bounds) {
+      auto_tuner_ = std::make_unique<AutoTuner>(bounds);
+    }
+    auto_tuner_->StartSearch();
+    search_->SetAutoTuner(auto_tuner_.get());
+  }
+  if (workers) {
+    coordinator_->Start(tree_fen_, tree_moves_, limits.searchmoves,
+                        root_stats_.get(), helper_trees_.size() + 1);
+  }
+  // The main tree takes what doesn't divide evenly.
+  const int trees = helper_searches_.size() + 1;
+  const int tree_threads = std::max(1, threads / trees);
+  for (auto& search : helper_searches_) search->StartThreads(tree_threads);
+  search_->StartThreads(std::max(tree_threads, threads - tree_threads *
+                                                            (trees - 1)));
 }
 
 void EngineController::PonderHit() {
@@ -406,18 +909,63 @@ void EngineController::Stop() {
   if (search_) search_->Stop();
 }
 
-EngineLoop::EngineLoop()
+void EngineController::SaveTree(const std::string& filename) {
+  SharedLock lock(busy_mutex_);
+  if (search_ && search_->IsSearchActive()) {
+    throw Exception("Cannot save the tree while searching");
+  }
+  // The threads of a stopped search may still be winding down.
+  if (search_) search_->Wait();
+  for (auto& search : helper_searches_) search->Wait();
+  if (!tree_) throw Exception("No tree to save");
+  const uint64_t nodes = tree_->SaveTree(filename, weights_hash_);
+  ThinkingInfo info;
+  info.comment = "Saved " + std::to_string(nodes) + " nodes to " + filename;
+  info_callback_({info});
+}
+
+void EngineController::LoadTree(const std::string& filename) {
+  SharedLock lock(busy_mutex_);
+  ResetSearch();
+  // The tree is only good for the network it was searched with.
+  UpdateFromUciOptions();
+  if (!tree_) tree_ = std::make_unique<NodeTree>();
+  if (!tree_->LoadTree(filename, weights_hash_)) {
+    throw Exception("Cannot load tree from " + filename);
+  }
+  // A following "go" searches the loaded position, as would one after the
+  // matching "position" command.
+  std::vector<std::string> moves;
+  for (const auto& move : tree_->GetMoves()) moves.push_back(move.as_string());
+  current_position_ = CurrentPosition{tree_->GetStartingFen(), moves};
+  helper_trees_.clear();
+  ThinkingInfo info;
+  info.comment = "Loaded " + std::to_string(tree_->GetCurrentHead()->GetN()) +
+                 " visits from " + filename;
+  info_callback_({info});
+}
+
+EngineLoop::EngineLoop(const EngineController::SharedResources* shared)
     : engine_(std::bind(&UciLoop::SendBestMove, this, std::placeholders::_1),
               std::bind(&UciLoop::SendInfo, this, std::placeholders::_1),
-              options_.GetOptionsDict()) {
+              options_.GetOptionsDict(), shared),
+      shared_(shared != nullptr) {
   engine_.PopulateOptions(&options_);
-  options_.Add<StringOption>(kLogFileId);
+  // The log and metrics are the process', which sessions sharing resources
+  // don't own.
+  if (!shared_) {
+    options_.Add<StringOption>(kLogFileId);
+    MetricsExporter::PopulateOptions(&options_);
+    Random::PopulateOptions(&options_);
+  }
 }
 
 void EngineLoop::RunLoop() {
   if (!ConfigFile::Init(&options_) || !options_.ProcessAllFlags()) return;
   Logging::Get().SetFilename(
       options_.GetOptionsDict().Get<std::string>(kLogFileId.GetId()));
+  Random::SeedFromOptions(options_.GetOptionsDict());
+  MetricsExporter metrics(options_.GetOptionsDict());
   UciLoop::RunLoop();
 }
 
@@ -438,8 +986,10 @@ void EngineLoop::CmdSetOption(const std::string& name, const std::string& value,
                               const std::string& context) {
   options_.SetUciOption(name, value, context);
   // Set the log filename for the case it was set in UCI option.
-  Logging::Get().SetFilename(
-      options_.GetOptionsDict().Get<std::string>(kLogFileId.GetId()));
+  if (!shared_) {
+    Logging::Get().SetFilename(
+        options_.GetOptionsDict().Get<std::string>(kLogFileId.GetId()));
+  }
 }
 
 void EngineLoop::CmdUciNewGame() { engine_.NewGame(); }
@@ -457,4 +1007,12 @@ void EngineLoop::CmdPonderHit() { engine_.PonderHit(); }
 
 void EngineLoop::CmdStop() { engine_.Stop(); }
 
+void EngineLoop::CmdSaveTree(const std::string& filename) {
+  engine_.SaveTree(filename);
+}
+
+void EngineLoop::CmdLoadTree(const std::string& filename) {
+  engine_.LoadTree(filename);
+}
+
 }  // namespace lczero
@@ -27,8 +27,11 @@
 
 #pragma once
 
+#include <future>
 #include "chess/uciloop.h"
+#include "mcts/distributed.h"
 #include "mcts/search.h"
+#include "mcts/timemgr.h"
 #include "neural/cache.h"
 #include "neural/factory.h"
 #include "neural/network.h"
@@ -50,14 +53,29 @@ struct CurrentPosition {
 
 class EngineController {
  public:
+  // Network, NN cache and tablebases owned by the caller and shared by
+  // several controllers, as by the sessions of the engine server. The
+  // network, cache and tablebase options of the controller are ignored then.
+  struct SharedResources {
+    Network* network = nullptr;
+    NNCache* cache = nullptr;
+    SyzygyTablebase* syzygy_tb = nullptr;
+    // Most threads a search may use over all its trees, 0 for no limit.
+    int max_threads = 0;
+    // Most visits a search may reach, 0 for no limit.
+    int64_t max_visits = 0;
+  };
+
   EngineController(BestMoveInfo::Callback best_move_callback,
                    ThinkingInfo::Callback info_callback,
-                   const OptionsDict& options);
+                   const OptionsDict& options,
+                   const SharedResources* shared = nullptr);
 
   ~EngineController() {
     // Make sure search is destructed first, and it still may be running in
     // a separate thread.
-    search_.reset();
+    ResetSearch();
+    SaveNNCache();
   }
 
   void PopulateOptions(OptionsParser* options);
@@ -78,17 +96,38 @@ class EngineController {
   // Must not block.
   void Stop();
 
+  // Blocks. Write the tree of the current position to a file and restore it
+  // from there, so that a deep analysis can be resumed with "go" later.
+  void SaveTree(const std::string& filename);
+  void LoadTree(const std::string& filename);
+
   SearchLimits PopulateSearchLimits(int ply, bool is_black,
       const GoParams& params,
       std::chrono::steady_clock::time_point start_time);
 
+  struct LoadedNetwork {
+    std::unique_ptr<Network> network;
+    // Hash of the weights file.
+    uint64_t weights_hash = 0;
+  };
+
  private:
-  void UpdateFromUciOptions();
+  // Without @wait_for_network, a network not loaded yet is only started
+  // loading in the background, for a later call to switch to.
+  void UpdateFromUciOptions(bool wait_for_network = true);
+  // Loads the network of the options into pending_network_ on a thread.
+  void StartLoadingNetwork(
+      const NetworkFactory::BackendConfiguration& configuration);
+  // Writes the NN cache into NNCacheFile, if it's set.
+  void SaveNNCache();
 
   void SetupPosition(const std::string& fen,
                      const std::vector<std::string>& moves);
+  // Destroys the searches, which waits for their threads.
+  void ResetSearch();
 
   const OptionsDict& options_;
+  const SharedResources* const shared_;
 
   BestMoveInfo::Callback best_move_callback_;
   ThinkingInfo::Callback info_callback_;
@@ -97,16 +136,42 @@ class EngineController {
   RpSharedMutex busy_mutex_;
   using SharedLock = std::shared_lock<RpSharedMutex>;
 
-  std::unique_ptr<Search> search_;
   std::unique_ptr<NodeTree> tree_;
+  // The other trees of a root parallel group, searched along with tree_.
+  std::vector<std::unique_ptr<NodeTree>> helper_trees_;
+  std::unique_ptr<SharedRootStats> root_stats_;
+  // Search workers of a distributed search, and the DistributedPeers they
+  // are for.
+  std::unique_ptr<DistributedCoordinator> coordinator_;
+  std::string distributed_peers_;
+  // Position of tree_ as given to SetupPosition.
+  std::string tree_fen_;
+  std::vector<std::string> tree_moves_;
+  // Settings tuned over the searches with AutoTune, outlives search_.
+  std::unique_ptr<AutoTuner> auto_tuner_;
+  std::unique_ptr<Search> search_;
+  std::vector<std::unique_ptr<Search>> helper_searches_;
   std::unique_ptr<SyzygyTablebase> syzygy_tb_;
   std::unique_ptr<Network> network_;
+  // Network of SmallWeightsFile, if any.
+  std::unique_ptr<Network> small_network_;
   NNCache cache_;
 
   // Store current TB and network settings to track when they change so that
   // they are reloaded.
   std::string tb_paths_;
   NetworkFactory::BackendConfiguration network_configuration_;
+  NetworkFactory::BackendConfiguration small_configuration_;
+  // Hash of the current weights file.
+  uint64_t weights_hash_ = 0;
+  // Network being loaded in the background, with HotSwapNetwork or for the
+  // first position after isready, and the configuration it was started for.
+  std::future<LoadedNetwork> pending_network_;
+  NetworkFactory::BackendConfiguration pending_configuration_;
+  // Persistent NN cache file, and hash of the weights its content is for.
+  std::string nncache_file_;
+  uint64_t nncache_weights_hash_ = 0;
+  std::chrono::steady_clock::time_point last_nncache_save_;
 
   // The current position as given with SetPosition. For normal (ie. non-ponder)
   // search, the tree is set up with this position, however, during ponder we
@@ -116,12 +181,14 @@ class EngineController {
 
   // How much less time was used by search than what was allocated.
   int64_t time_spared_ms_ = 0;
+  TimeManager time_manager_;
   std::chrono::steady_clock::time_point move_start_time_;
 };
 
 class EngineLoop : public UciLoop {
  public:
-  EngineLoop();
+  explicit EngineLoop(
+      const EngineController::SharedResources* shared = nullptr);
 
   void RunLoop() override;
   void CmdUci() override;
@@ -134,10 +201,14 @@ class EngineLoop : public UciLoop {
   void CmdGo(const GoParams& params) override;
   void CmdPonderHit() override;
   void CmdStop() override;
+  void CmdSaveTree(const std::string& filename) override;
+  void CmdLoadTree(const std::string& filename) override;
 
  private:
   OptionsParser options_;
   EngineController engine_;
+  // Whether the loop is a session using shared resources.
+  const bool shared_;
 };
 
 }  // namespace lczero
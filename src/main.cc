@@ -25,10 +25,20 @@
   Program grant you additional permission to convey the resulting work.
 */
 
+#include "analysis/analysis.h"
+#include "benchmark/backendbench.h"
+#include "benchmark/perft.h"
 #include "benchmark/benchmark.h"
+#include "benchmark/testsuite.h"
 #include "chess/board.h"
 #include "engine.h"
+#include "neural/onnx/converter.h"
+#include "selfplay/converter.h"
 #include "selfplay/loop.h"
+#include "selfplay/rescorer.h"
+#include "server/distributed_worker.h"
+#include "server/eval_server.h"
+#include "server/server.h"
 #include "utils/commandline.h"
 #include "utils/logging.h"
 #include "version.h"
@@ -46,6 +56,24 @@ int main(int argc, const char** argv) {
   CommandLine::RegisterMode("uci", "(default) Act as UCI engine");
   CommandLine::RegisterMode("selfplay", "Play games with itself");
   CommandLine::RegisterMode("benchmark", "Quick benchmark");
+  CommandLine::RegisterMode("backendbench",
+                            "Benchmark the NN backend without search");
+  CommandLine::RegisterMode("perft", "Count and time move generation");
+  CommandLine::RegisterMode("testsuite",
+                            "Time the search to the solutions of an EPD "
+                            "suite");
+  CommandLine::RegisterMode("analyse",
+                            "Search every position of a file of FENs");
+  CommandLine::RegisterMode("converttrainingdata",
+                            "Convert compact training data to V4");
+  CommandLine::RegisterMode("rescoretrainingdata",
+                            "Validate training data and rescore endgames");
+  CommandLine::RegisterMode("server", "Host many UCI sessions over TCP");
+  CommandLine::RegisterMode("evalserver",
+                            "Evaluate batches of remote backends over TCP");
+  CommandLine::RegisterMode("searchworker",
+                            "Search root moves for a distributed search");
+  CommandLine::RegisterMode("export-onnx", "Convert a weights file to ONNX");
 
   if (CommandLine::ConsumeCommand("selfplay")) {
     // Selfplay mode.
@@ -55,6 +83,46 @@ int main(int argc, const char** argv) {
     // Benchmark mode.
     Benchmark benchmark;
     benchmark.Run();
+  } else if (CommandLine::ConsumeCommand("backendbench")) {
+    // Backend throughput and latency, search excluded.
+    BackendBenchmark benchmark;
+    benchmark.Run();
+  } else if (CommandLine::ConsumeCommand("perft")) {
+    // Move generation throughput and correctness.
+    PerftBenchmark perft;
+    if (!perft.Run()) return 1;
+  } else if (CommandLine::ConsumeCommand("testsuite")) {
+    // Visits and time to find known best moves.
+    TestSuite suite;
+    suite.Run();
+  } else if (CommandLine::ConsumeCommand("analyse")) {
+    // Batched analysis of many positions.
+    Analysis analysis;
+    analysis.Run();
+  } else if (CommandLine::ConsumeCommand("converttrainingdata")) {
+    // Compact to V4 training data conversion.
+    TrainingDataConverter converter;
+    converter.Run();
+  } else if (CommandLine::ConsumeCommand("rescoretrainingdata")) {
+    // Validation and tablebase rescoring of V4 training data.
+    TrainingDataRescorer rescorer;
+    rescorer.Run();
+  } else if (CommandLine::ConsumeCommand("server")) {
+    // UCI sessions sharing one network and cache.
+    EngineServer server;
+    server.Run();
+  } else if (CommandLine::ConsumeCommand("evalserver")) {
+    // Network evaluations for remote backends.
+    EvalServer server;
+    server.Run();
+  } else if (CommandLine::ConsumeCommand("searchworker")) {
+    // A share of the root moves of a distributed search.
+    DistributedWorker worker;
+    worker.Run();
+  } else if (CommandLine::ConsumeCommand("export-onnx")) {
+    // Network as an ONNX model, for profiling tools.
+    OnnxExporter exporter;
+    exporter.Run();
   } else {
     // Consuming optional "uci" mode.
     CommandLine::ConsumeCommand("uci");
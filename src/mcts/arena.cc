@@ -0,0 +1,390 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2019 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+
+  If you modify this Program, or any covered work, by linking or
+  combining it with NVIDIA Corporation's libraries from the NVIDIA CUDA
+  Toolkit and the NVIDIA CUDA Deep Neural Network library (or a
+  modified version of those libraries), containing parts covered by the
+  terms of the respective license agreement, the licensors of this
+  Program grant you additional permission to convey the resulting work.
+*/
+
+#include "mcts/arena.h"
+
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <vector>
+#include "utils/largepages.h"
+#include "utils/mutex.h"
+
+namespace lczero {
+
+namespace {
+// All allocations are aligned to this, which is enough for nodes and edges.
+constexpr size_t kAlignment = 8;
+// Number of emptied pages kept for reuse rather than returned to the OS.
+// Pages of chunks are all kept.
+constexpr size_t kMaxSparePages = 64;
+// Free lists, one per allocation size.
+constexpr size_t kNumSizeClasses = NodeArena::kMaxAllocationSize / kAlignment;
+// Number of allocations threads trade free lists in.
+constexpr size_t kRecycleBatch = 64;
+
+size_t RoundUp(size_t size) {
+  return (size + kAlignment - 1) / kAlignment * kAlignment;
+}
+
+struct Page {
+  // Number of freed allocations is subtracted as they happen. The number of
+  // allocations made is only added when the page gets retired by the thread
+  // that allocates from it, so the counter can only reach zero after that.
+  std::atomic<int64_t> live{0};
+  // NUMA node of the thread the page was first given to, which touched it.
+  int node = 0;
+  // Whether carved out of a chunk, which is never released.
+  bool in_chunk = false;
+};
+constexpr size_t kHeaderSize =
+    (sizeof(Page) + kAlignment - 1) / kAlignment * kAlignment;
+// Huge pages and NUMA placement apply to mapped chunks of this many pages.
+constexpr size_t kPagesPerChunk = kHugePageSize / NodeArena::kPageSize;
+static_assert(kPagesPerChunk * NodeArena::kPageSize == kHugePageSize,
+              "Pages don't fill a chunk");
+
+Page* AllocatePage(int node) {
+  void* ptr = AllocateLarge(NodeArena::kPageSize, NodeArena::kPageSize);
+  Page* page = new (ptr) Page();
+  page->node = node;
+  return page;
+}
+
+void ReleasePage(Page* page) {
+  page->~Page();
+  FreeLarge(page, NodeArena::kPageSize);
+}
+
+class PagePool {
+ public:
+  Page* Get() {
+    pages_in_use_.fetch_add(1, std::memory_order_relaxed);
+    const int node = GetNumaPolicy() == NumaPolicy::kFirstTouch
+                         ? GetCurrentNumaNode()
+                         : 0;
+    {
+      Mutex::Lock lock(mutex_);
+      if (static_cast<size_t>(node) < spare_pages_.size() &&
+          !spare_pages_[node].empty()) {
+        Page* page = spare_pages_[node].back();
+        spare_pages_[node].pop_back();
+        if (!page->in_chunk) --spare_heap_pages_;
+        return page;
+      }
+    }
+    if (GetHugePages() == HugePages::kOff &&
+        GetNumaPolicy() != NumaPolicy::kInterleave) {
+      return AllocatePage(node);
+    }
+    // The other pages of the chunk are for the threads of the same node.
+    char* chunk = static_cast<char*>(AllocateLarge(kHugePageSize,
+                                                   kHugePageSize));
+    std::vector<Page*> pages;
+    for (size_t i = 0; i < kPagesPerChunk; ++i) {
+      pages.push_back(new (chunk + i * NodeArena::kPageSize) Page());
+      pages.back()->node = node;
+      pages.back()->in_chunk = true;
+    }
+    Mutex::Lock lock(mutex_);
+    if (spare_pages_.size() <= static_cast<size_t>(node)) {
+      spare_pages_.resize(node + 1);
+    }
+    spare_pages_[node].insert(spare_pages_[node].end(), pages.begin() + 1,
+                              pages.end());
+    return pages.front();
+  }
+
+  void Put(Page* page) {
+    pages_in_use_.fetch_sub(1, std::memory_order_relaxed);
+    page->live.store(0, std::memory_order_relaxed);
+    {
+      Mutex::Lock lock(mutex_);
+      if (page->in_chunk || spare_heap_pages_ < kMaxSparePages) {
+        if (spare_pages_.size() <= static_cast<size_t>(page->node)) {
+          spare_pages_.resize(page->node + 1);
+        }
+        spare_pages_[page->node].push_back(page);
+        if (!page->in_chunk) ++spare_heap_pages_;
+        return;
+      }
+    }
+    ReleasePage(page);
+  }
+
+  size_t GetPagesInUse() const {
+    return pages_in_use_.load(std::memory_order_relaxed);
+  }
+
+ private:
+  Mutex mutex_;
+  // Per NUMA node, only node 0 is used unless NumaPolicy::kFirstTouch.
+  std::vector<std::vector<Page*>> spare_pages_ GUARDED_BY(mutex_);
+  // Spare pages not in chunks, which are released beyond kMaxSparePages.
+  size_t spare_heap_pages_ GUARDED_BY(mutex_) = 0;
+  std::atomic<size_t> pages_in_use_{0};
+};
+
+// The pool is never destroyed, as nodes may still be released by the garbage
+// collector during static destruction.
+PagePool* Pool() {
+  static PagePool* pool = new PagePool();
+  return pool;
+}
+
+// Page which the current thread allocates from.
+class ThreadPage {
+ public:
+  ~ThreadPage() { Retire(); }
+
+  void* Allocate(size_t size) {
+    if (!page_ || offset_ + size > NodeArena::kPageSize) {
+      Retire();
+      page_ = Pool()->Get();
+      offset_ = kHeaderSize;
+    }
+    void* ptr = reinterpret_cast<char*>(page_) + offset_;
+    offset_ += size;
+    ++allocations_;
+    return ptr;
+  }
+
+ private:
+  void Retire() {
+    if (!page_) return;
+    if (page_->live.fetch_add(allocations_, std::memory_order_acq_rel) +
+            allocations_ ==
+        0) {
+      Pool()->Put(page_);
+    }
+    page_ = nullptr;
+    allocations_ = 0;
+  }
+
+  Page* page_ = nullptr;
+  size_t offset_ = 0;
+  int64_t allocations_ = 0;
+};
+
+thread_local ThreadPage tls_page;
+
+std::atomic<bool> recycling{false};
+
+std::atomic<uint64_t> allocations_made{0};
+std::atomic<uint64_t> frees_made{0};
+// Allocations and frees a thread counts before adding them to the totals.
+constexpr uint64_t kCountBatch = 256;
+
+class ThreadCounts {
+ public:
+  ~ThreadCounts() { Flush(); }
+
+  void Allocated() {
+    if (++allocations_ >= kCountBatch) Flush();
+  }
+  void Freed() {
+    if (++frees_ >= kCountBatch) Flush();
+  }
+
+ private:
+  void Flush() {
+    allocations_made.fetch_add(allocations_, std::memory_order_relaxed);
+    frees_made.fetch_add(frees_, std::memory_order_relaxed);
+    allocations_ = 0;
+    frees_ = 0;
+  }
+
+  uint64_t allocations_ = 0;
+  uint64_t frees_ = 0;
+};
+
+thread_local ThreadCounts tls_counts;
+
+// Bytes a thread charges before adding them to its account.
+constexpr int64_t kAccountBatch = 64 * 1024;
+
+thread_local NodeArena::ScopedAccount* tls_account_scope = nullptr;
+
+// Free lists shared by all threads. Allocations on them still count as live
+// in their pages, so the pages stay.
+class Recycler {
+ public:
+  Recycler() : lists_(kNumSizeClasses) {}
+
+  // Takes kRecycleBatch allocations from the back of @list.
+  void PutBatch(size_t size_class, std::vector<void*>* list) {
+    Mutex::Lock lock(mutex_);
+    auto& shared = lists_[size_class];
+    shared.insert(shared.end(), list->end() - kRecycleBatch, list->end());
+    list->resize(list->size() - kRecycleBatch);
+    bytes_.fetch_add(kRecycleBatch * (size_class + 1) * kAlignment,
+                     std::memory_order_relaxed);
+  }
+
+  // Moves up to kRecycleBatch allocations to @list.
+  void GetBatch(size_t size_class, std::vector<void*>* list) {
+    Mutex::Lock lock(mutex_);
+    auto& shared = lists_[size_class];
+    const size_t count = std::min(kRecycleBatch, shared.size());
+    list->insert(list->end(), shared.end() - count, shared.end());
+    shared.resize(shared.size() - count);
+    bytes_.fetch_sub(count * (size_class + 1) * kAlignment,
+                     std::memory_order_relaxed);
+  }
+
+  size_t GetBytes() const { return bytes_.load(std::memory_order_relaxed); }
+
+ private:
+  Mutex mutex_;
+  std::vector<std::vector<void*>> lists_ GUARDED_BY(mutex_);
+  std::atomic<size_t> bytes_{0};
+};
+
+// Never destroyed, like the pool.
+Recycler* SharedRecycler() {
+  static Recycler* recycler = new Recycler();
+  return recycler;
+}
+
+// Free lists of the current thread, not counted in the shared bytes.
+class ThreadFreeLists {
+ public:
+  ~ThreadFreeLists() {
+    for (size_t i = 0; i < lists_.size(); ++i) {
+      while (lists_[i].size() >= kRecycleBatch) {
+        SharedRecycler()->PutBatch(i, &lists_[i]);
+      }
+      // Fewer than a batch are lost to the free lists, but not to their page.
+    }
+  }
+
+  void* Allocate(size_t size_class) {
+    auto& list = Get(size_class);
+    if (list.empty()) SharedRecycler()->GetBatch(size_class, &list);
+    if (list.empty()) return nullptr;
+    void* ptr = list.back();
+    list.pop_back();
+    return ptr;
+  }
+
+  void Free(void* ptr, size_t size_class) {
+    auto& list = Get(size_class);
+    list.push_back(ptr);
+    if (list.size() >= 2 * kRecycleBatch) {
+      SharedRecycler()->PutBatch(size_class, &list);
+    }
+  }
+
+ private:
+  std::vector<void*>& Get(size_t size_class) {
+    if (lists_.empty()) lists_.resize(kNumSizeClasses);
+    return lists_[size_class];
+  }
+
+  std::vector<std::vector<void*>> lists_;
+};
+
+thread_local ThreadFreeLists tls_free_lists;
+}  // namespace
+
+constexpr size_t NodeArena::kPageSize;
+constexpr size_t NodeArena::kMaxAllocationSize;
+
+void* NodeArena::Allocate(size_t size) {
+  assert(size <= kMaxAllocationSize);
+  size = RoundUp(size);
+  tls_counts.Allocated();
+  if (tls_account_scope) tls_account_scope->Charge(size);
+  if (recycling.load(std::memory_order_relaxed)) {
+    void* ptr = tls_free_lists.Allocate(size / kAlignment - 1);
+    if (ptr) return ptr;
+  }
+  return tls_page.Allocate(size);
+}
+
+void NodeArena::Free(void* ptr, size_t size) {
+  if (!ptr) return;
+  size = RoundUp(size);
+  tls_counts.Freed();
+  if (tls_account_scope) {
+    tls_account_scope->Charge(-static_cast<int64_t>(size));
+  }
+  if (recycling.load(std::memory_order_relaxed)) {
+    tls_free_lists.Free(ptr, size / kAlignment - 1);
+    return;
+  }
+  Page* page = reinterpret_cast<Page*>(reinterpret_cast<uintptr_t>(ptr) &
+                                       ~static_cast<uintptr_t>(kPageSize - 1));
+  if (page->live.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+    Pool()->Put(page);
+  }
+}
+
+void NodeArena::EnableRecycling() {
+  recycling.store(true, std::memory_order_relaxed);
+}
+
+size_t NodeArena::GetBytesInUse() {
+  return Pool()->GetPagesInUse() * kPageSize - SharedRecycler()->GetBytes();
+}
+
+NodeArena::ScopedAccount::ScopedAccount(Account* account)
+    : account_(account), outer_(tls_account_scope) {
+  tls_account_scope = this;
+}
+
+NodeArena::ScopedAccount::~ScopedAccount() {
+  Flush();
+  tls_account_scope = outer_;
+}
+
+void NodeArena::ScopedAccount::Charge(int64_t bytes) {
+  pending_ += bytes;
+  if (pending_ >= kAccountBatch || pending_ <= -kAccountBatch) Flush();
+}
+
+void NodeArena::ScopedAccount::Flush() {
+  if (account_ && pending_) {
+    account_->bytes_.fetch_add(pending_, std::memory_order_relaxed);
+  }
+  pending_ = 0;
+}
+
+NodeArena::Account* NodeArena::GetCurrentAccount() {
+  return tls_account_scope ? tls_account_scope->account_ : nullptr;
+}
+
+NodeArena::Stats NodeArena::GetStats() {
+  Stats stats;
+  stats.allocations = allocations_made.load(std::memory_order_relaxed);
+  stats.frees = frees_made.load(std::memory_order_relaxed);
+  return stats;
+}
+
+}  // namespace lczero
@@ -0,0 +1,130 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2019 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+
+  If you modify this Program, or any covered work, by linking or
+  combining it with NVIDIA Corporation's libraries from the NVIDIA CUDA
+  Toolkit and the NVIDIA CUDA Deep Neural Network library (or a
+  modified version of those libraries), containing parts covered by the
+  terms of the respective license agreement, the licensors of this
+  Program grant you additional permission to convey the resulting work.
+*/
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+namespace lczero {
+
+// Allocator for search tree nodes and their edge arrays.
+//
+// Every thread bump-allocates from its own large page, so allocations don't
+// take locks and nodes created close in time (which tend to be released
+// together, when a subtree is dropped) share pages. A page counts its live
+// allocations and is handed back as a whole when the last one is freed, so
+// releasing a subtree doesn't fragment the heap.
+//
+// Once recycling is enabled, freed allocations are kept in free lists by size
+// instead, and new allocations of the same size reuse them. Pages are then
+// never handed back, but a tree that keeps dropping and growing subtrees stays
+// within the pages it has.
+//
+// With huge pages or NUMA interleaving (see utils/largepages.h), pages are
+// carved out of 2MB chunks which are never handed back, only reused.
+class NodeArena {
+ public:
+  // Pages are aligned to their size, so the page of an allocation is found by
+  // masking its address.
+  static constexpr size_t kPageSize = 256 * 1024;
+  // Largest allocation the arena serves.
+  static constexpr size_t kMaxAllocationSize = kPageSize / 16;
+
+  static void* Allocate(size_t size);
+  // @size is the one the allocation was made with.
+  static void Free(void* ptr, size_t size);
+
+  // Enables recycling for the rest of the process.
+  static void EnableRecycling();
+
+  // Returns number of bytes held by pages which have live allocations, less
+  // those in the free lists.
+  static size_t GetBytesInUse();
+
+  class ScopedAccount;
+
+  // Bytes allocated and not freed yet by threads in its scope (see
+  // ScopedAccount), which tells the memory of one tree from that of the others
+  // and from the allocations recycled. It is owned by a shared_ptr, so that
+  // frees queued to happen later can keep it.
+  class Account : public std::enable_shared_from_this<Account> {
+   public:
+    // The last few KB of the threads in scope may be missing.
+    int64_t GetBytes() const { return bytes_.load(std::memory_order_relaxed); }
+
+    // Counts frees which are queued to happen in the scope of the account,
+    // @count is negative once they happened.
+    void AddPendingFrees(int64_t count) {
+      pending_frees_.fetch_add(count, std::memory_order_relaxed);
+    }
+    // Returns whether GetBytes() is still to go down by queued frees.
+    bool HasPendingFrees() const {
+      return pending_frees_.load(std::memory_order_relaxed) > 0;
+    }
+
+   private:
+    std::atomic<int64_t> bytes_{0};
+    std::atomic<int64_t> pending_frees_{0};
+
+    friend class ScopedAccount;
+  };
+
+  // Charges the allocations and frees of the current thread to @account, if
+  // not null, until destroyed. Scopes nest.
+  class ScopedAccount {
+   public:
+    explicit ScopedAccount(Account* account);
+    ~ScopedAccount();
+
+   private:
+    void Charge(int64_t bytes);
+    void Flush();
+
+    Account* const account_;
+    ScopedAccount* const outer_;
+    // Bytes not added to the account yet.
+    int64_t pending_ = 0;
+
+    friend class NodeArena;
+  };
+
+  // Returns the account the current thread is in the scope of, or nullptr.
+  static Account* GetCurrentAccount();
+
+  struct Stats {
+    uint64_t allocations = 0;
+    uint64_t frees = 0;
+  };
+  // Returns the allocations and frees made so far. Threads report them in
+  // batches, so the last few hundred of each running thread may be missing.
+  static Stats GetStats();
+};
+
+}  // namespace lczero
@@ -0,0 +1,141 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2018 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+
+  If you modify this Program, or any covered work, by linking or
+  combining it with NVIDIA Corporation's libraries from the NVIDIA CUDA
+  Toolkit and the NVIDIA CUDA Deep Neural Network library (or a
+  modified version of those libraries), containing parts covered by the
+  terms of the respective license agreement, the licensors of this
+  Program grant you additional permission to convey the resulting work.
+*/
+
+
+#include "mcts/autotune.h"
+
+#include <algorithm>
+#include <cstdio>
+
+namespace lczero {
+
+namespace {
+// How much faster a step has to be to be kept, as speed is noisy.
+const double kMinGain = 0.03;
+// Batches only shrink while more picks than this collide.
+const double kMaxCollisionRate = 0.25;
+}  // namespace
+
+AutoTuner::AutoTuner(const Bounds& bounds)
+    : bounds_(bounds),
+      minibatch_(bounds.max_minibatch),
+      threads_(bounds.max_threads) {}
+
+int AutoTuner::GetMiniBatchSize() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return minibatch_;
+}
+
+int AutoTuner::GetThreads() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return threads_;
+}
+
+void AutoTuner::StartSearch() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  // A step on trial is kept, there's nothing to compare it with.
+  on_trial_ = false;
+}
+
+int* AutoTuner::Value(Knob knob) {
+  return knob == kMiniBatch ? &minibatch_ : &threads_;
+}
+
+int AutoTuner::Next(Knob knob, int direction) const {
+  if (knob == kMiniBatch) {
+    // Geometric steps, batch sizes span orders of magnitude.
+    const int step = std::max(1, minibatch_ / 4);
+    return std::min(bounds_.max_minibatch,
+                    std::max(bounds_.min_minibatch,
+                             minibatch_ + direction * step));
+  }
+  return std::min(bounds_.max_threads,
+                  std::max(bounds_.min_threads, threads_ + direction));
+}
+
+bool AutoTuner::Step(const Sample& sample) {
+  for (int attempt = 0; attempt < 4; ++attempt) {
+    if (knob_ == kMiniBatch && direction_ > 0 &&
+        sample.collision_rate > kMaxCollisionRate) {
+      direction_ = -1;
+    }
+    const int next = Next(knob_, direction_);
+    if (next != *Value(knob_)) {
+      previous_minibatch_ = minibatch_;
+      previous_threads_ = threads_;
+      *Value(knob_) = next;
+      on_trial_ = true;
+      return true;
+    }
+    // At a bound: the other direction, then the other knob.
+    direction_ = -direction_;
+    if (attempt % 2 == 1) knob_ = knob_ == kMiniBatch ? kThreads : kMiniBatch;
+  }
+  return false;
+}
+
+bool AutoTuner::Update(const Sample& sample) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (sample.nps <= 0.0) return false;
+  last_sample_ = sample;
+  if (!on_trial_) {
+    // A baseline, at the start or after a revert.
+    baseline_nps_ = sample.nps;
+    return Step(sample);
+  }
+  on_trial_ = false;
+  if (sample.nps > baseline_nps_ * (1.0 + kMinGain)) {
+    // Better: keep going the same way.
+    baseline_nps_ = sample.nps;
+    failures_ = 0;
+    Step(sample);
+    return true;
+  }
+  minibatch_ = previous_minibatch_;
+  threads_ = previous_threads_;
+  direction_ = -direction_;
+  if (++failures_ >= 2) {
+    // Neither way helps, try the other knob.
+    failures_ = 0;
+    knob_ = knob_ == kMiniBatch ? kThreads : kMiniBatch;
+  }
+  return true;
+}
+
+std::string AutoTuner::GetStatus() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  char buffer[160];
+  std::snprintf(buffer, sizeof(buffer),
+                "autotune minibatch %d threads %d (nps %.0f, collisions "
+                "%.1f%%, nn latency %.1fms)",
+                minibatch_, threads_, last_sample_.nps,
+                100.0 * last_sample_.collision_rate,
+                last_sample_.nn_latency_ms);
+  return buffer;
+}
+
+}  // namespace lczero
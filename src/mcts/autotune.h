@@ -0,0 +1,108 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2018 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+
+  If you modify this Program, or any covered work, by linking or
+  combining it with NVIDIA Corporation's libraries from the NVIDIA CUDA
+  Toolkit and the NVIDIA CUDA Deep Neural Network library (or a
+  modified version of those libraries), containing parts covered by the
+  terms of the respective license agreement, the licensors of this
+  Program grant you additional permission to convey the resulting work.
+*/
+
+
+#pragma once
+
+#include <mutex>
+#include <string>
+
+namespace lczero {
+
+// Online tuner of the minibatch size and the number of active search threads.
+// It hill-climbs on the speed measured over successive intervals: a setting
+// is moved one step, kept if the next interval is faster and reverted
+// otherwise, after which the other direction and then the other setting are
+// tried. Batches don't grow while too many picks collide. Lives across
+// searches, as the best settings change over a game.
+class AutoTuner {
+ public:
+  struct Bounds {
+    int min_minibatch;
+    int max_minibatch;
+    int min_threads;
+    int max_threads;
+
+    bool operator==(const Bounds& other) const {
+      return min_minibatch == other.min_minibatch &&
+             max_minibatch == other.max_minibatch &&
+             min_threads == other.min_threads &&
+             max_threads == other.max_threads;
+    }
+    bool operator!=(const Bounds& other) const { return !(*this == other); }
+  };
+  // Measured over an interval with the current settings.
+  struct Sample {
+    double nps;
+    // Share of picked nodes which were collisions.
+    double collision_rate;
+    // Average time of an NN computation.
+    double nn_latency_ms;
+  };
+
+  // Starts with the largest settings, which are those without the tuner.
+  explicit AutoTuner(const Bounds& bounds);
+
+  const Bounds& GetBounds() const { return bounds_; }
+  int GetMiniBatchSize() const;
+  int GetThreads() const;
+
+  // To be called when a search starts. A new position is not comparable to
+  // the last one, so the next sample is a new baseline.
+  void StartSearch();
+  // Takes the sample of the interval since the last call. Returns whether the
+  // settings changed.
+  bool Update(const Sample& sample);
+  // Describes the settings and the last sample.
+  std::string GetStatus() const;
+
+ private:
+  enum Knob { kMiniBatch, kThreads };
+  // Moves the current knob, trying the other direction and then the other
+  // knob if it's at a bound. Returns false if nothing can move.
+  bool Step(const Sample& sample);
+  int* Value(Knob knob);
+  int Next(Knob knob, int direction) const;
+
+  const Bounds bounds_;
+  mutable std::mutex mutex_;
+  int minibatch_;
+  int threads_;
+  // Settings before the step on trial, and the speed at them.
+  int previous_minibatch_ = 0;
+  int previous_threads_ = 0;
+  double baseline_nps_ = 0.0;
+  // Whether the next sample is of a step, rather than a baseline.
+  bool on_trial_ = false;
+  Knob knob_ = kMiniBatch;
+  int direction_ = -1;
+  // Trials of the knob which failed in a row.
+  int failures_ = 0;
+  Sample last_sample_{};
+};
+
+}  // namespace lczero
@@ -0,0 +1,88 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2018 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+
+  If you modify this Program, or any covered work, by linking or
+  combining it with NVIDIA Corporation's libraries from the NVIDIA CUDA
+  Toolkit and the NVIDIA CUDA Deep Neural Network library (or a
+  modified version of those libraries), containing parts covered by the
+  terms of the respective license agreement, the licensors of this
+  Program grant you additional permission to convey the resulting work.
+*/
+
+
+#include "mcts/autotune.h"
+
+#include <gtest/gtest.h>
+
+#include <cmath>
+
+namespace lczero {
+
+namespace {
+// Speed peaking at a minibatch of 96 and 3 threads.
+AutoTuner::Sample Measure(const AutoTuner& tuner, double collision_rate) {
+  const double batch = tuner.GetMiniBatchSize();
+  const double threads = tuner.GetThreads();
+  const double nps = 100000.0 - 2.0 * std::pow(batch - 96.0, 2) -
+                     5000.0 * std::pow(threads - 3.0, 2);
+  return {nps, collision_rate, 5.0};
+}
+}  // namespace
+
+TEST(AutoTuner, StartsAtLargestSettings) {
+  AutoTuner tuner({16, 256, 1, 4});
+  EXPECT_EQ(256, tuner.GetMiniBatchSize());
+  EXPECT_EQ(4, tuner.GetThreads());
+}
+
+TEST(AutoTuner, ClimbsToFastestSettings) {
+  AutoTuner tuner({16, 256, 1, 4});
+  for (int i = 0; i < 100; ++i) tuner.Update(Measure(tuner, 0.0));
+  // On trial or not, close to the peak.
+  EXPECT_NEAR(96, tuner.GetMiniBatchSize(), 40);
+  EXPECT_NEAR(3, tuner.GetThreads(), 1);
+  tuner.StartSearch();
+  tuner.Update(Measure(tuner, 0.0));
+  EXPECT_LE(16, tuner.GetMiniBatchSize());
+  EXPECT_GE(256, tuner.GetMiniBatchSize());
+}
+
+TEST(AutoTuner, StaysWithinBounds) {
+  AutoTuner tuner({200, 256, 2, 2});
+  for (int i = 0; i < 50; ++i) {
+    tuner.Update(Measure(tuner, 0.0));
+    EXPECT_LE(200, tuner.GetMiniBatchSize());
+    EXPECT_GE(256, tuner.GetMiniBatchSize());
+    EXPECT_EQ(2, tuner.GetThreads());
+  }
+}
+
+TEST(AutoTuner, DoesNotGrowBatchesWithCollisions) {
+  AutoTuner tuner({16, 256, 1, 1});
+  int previous = tuner.GetMiniBatchSize();
+  for (int i = 0; i < 50; ++i) {
+    // Faster every time, which would otherwise keep any step.
+    tuner.Update({1000.0 * (i + 1), 0.5, 5.0});
+    EXPECT_LE(tuner.GetMiniBatchSize(), previous);
+    previous = tuner.GetMiniBatchSize();
+  }
+  EXPECT_EQ(16, tuner.GetMiniBatchSize());
+}
+
+}  // namespace lczero
@@ -0,0 +1,486 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2019 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+
+  If you modify this Program, or any covered work, by linking or
+  combining it with NVIDIA Corporation's libraries from the NVIDIA CUDA
+  Toolkit and the NVIDIA CUDA Deep Neural Network library (or a
+  modified version of those libraries), containing parts covered by the
+  terms of the respective license agreement, the licensors of this
+  Program grant you additional permission to convey the resulting work.
+*/
+
+#include "mcts/distributed.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <limits>
+#include <sstream>
+#include "utils/exception.h"
+#include "utils/logging.h"
+#include "utils/string.h"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+namespace lczero {
+namespace {
+// Reports between sharing out the root moves again.
+const int kRebalanceReports = 8;
+// A host may take on that much more than its share to keep a move.
+const double kRebalanceSlack = 1.25;
+// Steps of the PUCT simulation estimating the shares of the moves.
+const int kShareSimulationSteps = 1000;
+// Visits the shares are estimated over at least.
+const int kMinShareVisits = 10000;
+// FPU reduction of the moves without visits in the simulation.
+const float kShareFpuReduction = 0.33f;
+// Longest wait for a connection to a search worker.
+const std::chrono::milliseconds kConnectTimeout(2000);
+// First and longest wait before reconnecting to a search worker which is
+// gone. It doubles after every failed attempt.
+const std::chrono::milliseconds kMinReconnectDelay(1000);
+const std::chrono::milliseconds kMaxReconnectDelay(60000);
+
+bool Contains(const MoveList& moves, Move move) {
+  return std::find(moves.begin(), moves.end(), move) != moves.end();
+}
+}  // namespace
+
+std::string FormatMoves(const MoveList& moves) {
+  std::string result;
+  for (const auto& move : moves) result += " " + move.as_string();
+  return result;
+}
+
+MoveList ParseMoves(const std::vector<std::string>& words, size_t first) {
+  MoveList moves;
+  for (size_t i = first; i < words.size(); ++i) moves.emplace_back(words[i]);
+  return moves;
+}
+
+std::string FormatTreeStats(const SharedRootStats::TreeStats& tree) {
+  std::ostringstream ss;
+  ss << tree.playouts << ' ' << tree.visits << ' ' << tree.edges.size();
+  for (const auto& edge : tree.edges) {
+    ss << ' ' << edge.move.as_string() << ' ' << edge.n << ' ' << edge.q
+       << ' ' << edge.d << ' ' << edge.p << ' ' << edge.pv.size();
+    for (const auto& move : edge.pv) ss << ' ' << move.as_string();
+  }
+  return ss.str();
+}
+
+bool ParseTreeStats(const std::vector<std::string>& words, size_t first,
+                    SharedRootStats::TreeStats* tree) {
+  *tree = {};
+  size_t pos = first;
+  auto next = [&]() -> const std::string& {
+    static const std::string kEmpty;
+    return pos < words.size() ? words[pos++] : kEmpty;
+  };
+  try {
+    tree->playouts = std::stoll(next());
+    tree->visits = std::stoull(next());
+    const size_t edges = std::stoul(next());
+    if (edges > words.size()) return false;
+    for (size_t i = 0; i < edges; ++i) {
+      tree->edges.emplace_back();
+      auto& edge = tree->edges.back();
+      edge.move = Move(next());
+      edge.n = std::stoul(next());
+      edge.q = std::stof(next());
+      edge.d = std::stof(next());
+      edge.p = std::stof(next());
+      const size_t pv = std::stoul(next());
+      if (pv > words.size()) return false;
+      for (size_t j = 0; j < pv; ++j) edge.pv.emplace_back(next());
+    }
+  } catch (const std::exception&) {
+    return false;
+  }
+  return pos == words.size();
+}
+
+std::vector<RootMoveShare> EstimateRootShares(
+    const std::vector<SharedRootStats::EdgeStats>& edges, float cpuct,
+    int visits) {
+  std::vector<RootMoveShare> shares(edges.size());
+  std::vector<double> n(edges.size());
+  double total = 0.0;
+  double q_sum = 0.0;
+  double visited_policy = 0.0;
+  for (size_t i = 0; i < edges.size(); ++i) {
+    shares[i].move = edges[i].move;
+    n[i] = edges[i].n;
+    total += edges[i].n;
+    q_sum += static_cast<double>(edges[i].q) * edges[i].n;
+    if (edges[i].n) visited_policy += edges[i].p;
+  }
+  const float fpu = (total ? q_sum / total : 0.0) -
+                    kShareFpuReduction * std::sqrt(visited_policy);
+  visits = std::max(visits, kMinShareVisits);
+  const int step = std::max(1, visits / kShareSimulationSteps);
+  for (int left = visits; left > 0 && !edges.empty(); left -= step) {
+    const double numerator = cpuct * std::sqrt(std::max(total, 1.0));
+    size_t best = 0;
+    double best_score = std::numeric_limits<double>::lowest();
+    for (size_t i = 0; i < edges.size(); ++i) {
+      const double q = edges[i].n ? edges[i].q : fpu;
+      const double score = q + numerator * edges[i].p / (1.0 + n[i]);
+      if (score > best_score) {
+        best_score = score;
+        best = i;
+      }
+    }
+    n[best] += step;
+    total += step;
+    shares[best].weight += step;
+  }
+  return shares;
+}
+
+std::vector<MoveList> SplitRootMoves(std::vector<RootMoveShare> shares,
+                                     int hosts,
+                                     const std::vector<MoveList>& previous) {
+  std::vector<MoveList> plan(hosts);
+  if (shares.empty()) return plan;
+  std::stable_sort(shares.begin(), shares.end(),
+                   [](const RootMoveShare& a, const RootMoveShare& b) {
+                     return a.weight > b.weight;
+                   });
+  double total = 0.0;
+  for (const auto& share : shares) total += share.weight;
+  if (total <= 0.0) {
+    for (auto& share : shares) share.weight = 1.0;
+    total = shares.size();
+  }
+  const double target = total / hosts;
+
+  std::vector<double> load(hosts);
+  for (const auto& share : shares) {
+    const int copies = std::min(
+        hosts, std::max(1, static_cast<int>(std::lround(share.weight /
+                                                        target))));
+    const double weight = share.weight / copies;
+    for (int copy = 0; copy < copies; ++copy) {
+      int host = -1;
+      for (int i = 0; i < hosts; ++i) {
+        if (i < static_cast<int>(previous.size()) &&
+            Contains(previous[i], share.move) &&
+            !Contains(plan[i], share.move) &&
+            load[i] + weight <= target * kRebalanceSlack) {
+          host = i;
+          break;
+        }
+      }
+      if (host < 0) {
+        for (int i = 0; i < hosts; ++i) {
+          if (Contains(plan[i], share.move)) continue;
+          if (host < 0 || load[i] < load[host]) host = i;
+        }
+      }
+      plan[host].push_back(share.move);
+      load[host] += weight;
+    }
+  }
+  for (auto& moves : plan) {
+    if (moves.empty()) moves.push_back(shares.front().move);
+  }
+  return plan;
+}
+
+#ifdef _WIN32
+DistributedCoordinator::DistributedCoordinator(const std::string&,
+                                               std::chrono::milliseconds,
+                                               float) {
+  throw Exception("Distributed search is not supported on Windows");
+}
+DistributedCoordinator::~DistributedCoordinator() {}
+void DistributedCoordinator::Start(const std::string&,
+                                   const std::vector<std::string>&,
+                                   const MoveList&, SharedRootStats*, int) {}
+void DistributedCoordinator::Stop() {}
+#else
+namespace {
+// Connects to @peer, which is host:port. Returns the socket, or -1 if no
+// address of the host accepts the connection within kConnectTimeout.
+int ConnectTcp(const std::string& peer) {
+  const auto colon = peer.rfind(':');
+  if (colon == std::string::npos) {
+    throw Exception("Distributed search: expected host:port, got " + peer);
+  }
+  const std::string host = peer.substr(0, colon);
+  const std::string port = peer.substr(colon + 1);
+  addrinfo hints = {};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  addrinfo* addresses = nullptr;
+  if (getaddrinfo(host.c_str(), port.c_str(), &hints, &addresses) != 0) {
+    return -1;
+  }
+  int result = -1;
+  for (auto* address = addresses; address && result < 0;
+       address = address->ai_next) {
+    const int fd =
+        socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+    if (fd < 0) continue;
+    // Connects without blocking, to give up after the timeout.
+    const int flags = fcntl(fd, F_GETFL, 0);
+    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    bool connected = connect(fd, address->ai_addr, address->ai_addrlen) == 0;
+    if (!connected && errno == EINPROGRESS) {
+      pollfd pfd = {fd, POLLOUT, 0};
+      int error = 0;
+      socklen_t length = sizeof(error);
+      connected = poll(&pfd, 1, kConnectTimeout.count()) == 1 &&
+                  getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length) == 0 &&
+                  error == 0;
+    }
+    if (!connected) {
+      close(fd);
+      continue;
+    }
+    fcntl(fd, F_SETFL, flags);
+    const int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    result = fd;
+  }
+  freeaddrinfo(addresses);
+  return result;
+}
+}  // namespace
+
+DistributedCoordinator::DistributedCoordinator(
+    const std::string& peers, std::chrono::milliseconds interval, float cpuct)
+    : interval_(interval), cpuct_(cpuct) {
+  for (const auto& peer : StrSplit(peers, ",")) {
+    Worker worker;
+    worker.address = peer;
+    try {
+      worker.socket = ConnectTcp(peer);
+    } catch (const Exception&) {
+      for (auto& connected : workers_) close(connected.socket);
+      throw;
+    }
+    if (worker.socket < 0) {
+      for (auto& connected : workers_) close(connected.socket);
+      throw Exception("Distributed search: unable to connect to " + peer);
+    }
+    workers_.push_back(std::move(worker));
+  }
+  CERR << "Distributed search with " << workers_.size() << " workers.";
+}
+
+DistributedCoordinator::~DistributedCoordinator() {
+  Stop();
+  for (auto& worker : workers_) {
+    if (worker.socket >= 0) close(worker.socket);
+  }
+}
+
+void DistributedCoordinator::Start(const std::string& fen,
+                                   const std::vector<std::string>& moves,
+                                   const MoveList& searchmoves,
+                                   SharedRootStats* stats, int first_worker) {
+  Stop();
+  stats_ = stats;
+  first_worker_ = first_worker;
+  position_ = "position fen " + fen + " moves";
+  for (const auto& move : moves) position_ += " " + move;
+  for (auto& worker : workers_) {
+    if (worker.socket < 0) continue;
+    if (Send(&worker, position_)) worker.started = false;
+  }
+  searchmoves_ = searchmoves;
+  local_owned_.clear();
+  ++search_id_;
+  stop_ = false;
+  thread_ = std::thread([this]() { Run(); });
+}
+
+void DistributedCoordinator::Stop() {
+  if (!thread_.joinable()) return;
+  stop_ = true;
+  thread_.join();
+  for (auto& worker : workers_) {
+    if (worker.socket >= 0 && worker.started) Send(&worker, "stop");
+  }
+}
+
+void DistributedCoordinator::Run() {
+  auto next_rebalance = std::chrono::steady_clock::now();
+  while (!stop_) {
+    std::vector<pollfd> fds;
+    std::vector<int> indices;
+    for (size_t i = 0; i < workers_.size(); ++i) {
+      if (workers_[i].socket < 0) continue;
+      fds.push_back({workers_[i].socket, POLLIN, 0});
+      indices.push_back(i);
+    }
+    // Just sleeps the interval if there are no workers left.
+    if (poll(fds.data(), fds.size(), interval_.count()) < 0) continue;
+    for (size_t i = 0; i < fds.size(); ++i) {
+      if (fds[i].revents && !Receive(indices[i])) {
+        Disconnect(&workers_[indices[i]]);
+      }
+    }
+    const auto now = std::chrono::steady_clock::now();
+    for (auto& worker : workers_) {
+      if (worker.socket < 0 && now >= worker.reconnect_at &&
+          Reconnect(&worker)) {
+        // Gets its moves and starts with the next rebalance.
+        next_rebalance = now;
+      }
+    }
+    if (now < next_rebalance) continue;
+    // Until the local root has edges, it's tried every interval.
+    next_rebalance =
+        now + (Rebalance() ? interval_ * kRebalanceReports : interval_);
+  }
+}
+
+bool DistributedCoordinator::Receive(int index) {
+  Worker& worker = workers_[index];
+  char buffer[4096];
+  const ssize_t size = recv(worker.socket, buffer, sizeof(buffer), 0);
+  if (size <= 0) return false;
+  worker.buffer.append(buffer, size);
+  size_t end;
+  while ((end = worker.buffer.find('\n')) != std::string::npos) {
+    const std::string line = worker.buffer.substr(0, end);
+    worker.buffer.erase(0, end + 1);
+    const auto words = StrSplitAtWhitespace(line);
+    if (words.empty()) continue;
+    if (words[0] == "error") {
+      CERR << "Search worker " << worker.address << ": " << line.substr(5);
+      return false;
+    }
+    // Stats of an earlier search still may come in after it's stopped.
+    if (words[0] != "stats" || words.size() < 2 ||
+        words[1] != std::to_string(search_id_)) {
+      continue;
+    }
+    SharedRootStats::TreeStats tree;
+    if (!ParseTreeStats(words, 2, &tree)) {
+      CERR << "Search worker " << worker.address << " sent malformed stats.";
+      return false;
+    }
+    stats_->Publish(first_worker_ + index, std::move(tree));
+  }
+  return true;
+}
+
+bool DistributedCoordinator::Rebalance() {
+  // The local tree has the priors of the root moves.
+  const auto local = stats_->Get(0);
+  std::vector<SharedRootStats::EdgeStats> edges;
+  uint64_t visits = 0;
+  for (const auto& edge : local.edges) {
+    if (!searchmoves_.empty() && !Contains(searchmoves_, edge.move)) continue;
+    const auto others = stats_->GetOtherEdge(0, edge.move);
+    edges.push_back(edge);
+    auto& combined = edges.back();
+    combined.n += others.n;
+    if (combined.n) {
+      combined.q = (edge.q * edge.n + others.q * others.n) / combined.n;
+    }
+    visits += combined.n;
+  }
+  if (edges.empty()) return false;
+
+  std::vector<Worker*> hosts;
+  std::vector<MoveList> previous{local_owned_};
+  for (auto& worker : workers_) {
+    if (worker.socket < 0) continue;
+    hosts.push_back(&worker);
+    previous.push_back(worker.owned);
+  }
+  const auto plan = SplitRootMoves(
+      EstimateRootShares(edges, cpuct_, visits / 2), hosts.size() + 1,
+      previous);
+  if (plan[0] != local_owned_) {
+    local_owned_ = plan[0];
+    for (int i = 0; i < first_worker_; ++i) {
+      stats_->SetOwnedMoves(i, local_owned_);
+    }
+  }
+  for (size_t i = 0; i < hosts.size(); ++i) {
+    Worker* worker = hosts[i];
+    if (plan[i + 1] != worker->owned || !worker->started) {
+      worker->owned = plan[i + 1];
+      if (!Send(worker, "own" + FormatMoves(worker->owned))) continue;
+    }
+    if (!worker->started) {
+      worker->started = Send(worker, "go " + std::to_string(search_id_));
+    }
+  }
+  return true;
+}
+
+bool DistributedCoordinator::Send(Worker* worker, const std::string& line) {
+  const std::string data = line + "\n";
+  if (send(worker->socket, data.data(), data.size(), MSG_NOSIGNAL) ==
+      static_cast<ssize_t>(data.size())) {
+    return true;
+  }
+  Disconnect(worker);
+  return false;
+}
+
+void DistributedCoordinator::Disconnect(Worker* worker) {
+  CERR << "Search worker " << worker->address << " is gone.";
+  close(worker->socket);
+  worker->socket = -1;
+  worker->started = false;
+  worker->owned.clear();
+  // Its last stats would stay in the totals, and its moves be left out.
+  if (stats_) {
+    stats_->Publish(first_worker_ + (worker - workers_.data()),
+                    SharedRootStats::TreeStats());
+  }
+  worker->reconnect_delay =
+      std::max(kMinReconnectDelay, worker->reconnect_delay);
+  worker->reconnect_at =
+      std::chrono::steady_clock::now() + worker->reconnect_delay;
+}
+
+bool DistributedCoordinator::Reconnect(Worker* worker) {
+  worker->socket = ConnectTcp(worker->address);
+  if (worker->socket < 0) {
+    worker->reconnect_delay =
+        std::min(kMaxReconnectDelay, worker->reconnect_delay * 2);
+    worker->reconnect_at =
+        std::chrono::steady_clock::now() + worker->reconnect_delay;
+    return false;
+  }
+  CERR << "Search worker " << worker->address << " is back.";
+  worker->buffer.clear();
+  worker->reconnect_delay = std::chrono::milliseconds(0);
+  return Send(worker, position_);
+}
+#endif
+
+}  // namespace lczero
@@ -0,0 +1,153 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2019 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+
+  If you modify this Program, or any covered work, by linking or
+  combining it with NVIDIA Corporation's libraries from the NVIDIA CUDA
+  Toolkit and the NVIDIA CUDA Deep Neural Network library (or a
+  modified version of those libraries), containing parts covered by the
+  terms of the respective license agreement, the licensors of this
+  Program grant you additional permission to convey the resulting work.
+*/
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+#include "chess/bitboard.h"
+#include "mcts/search.h"
+
+namespace lczero {
+
+// Distributed search: lc0 instances on several hosts search one position,
+// each on a tree of its own which is limited to a share of the root moves.
+// The coordinator, the instance the GUI talks to, has its trees first in the
+// SharedRootStats and then one per search worker ("lc0 searchworker"), whose
+// stats arrive over TCP. Bestmove and MultiPV go by the visits of all trees,
+// and the root moves are shared out again as their visits come in.
+//
+// The protocol is text lines. Root moves are as in the tree, ie. from the
+// view of the side to move. To the workers:
+//   position fen <fen> moves <moves>  The position to search next.
+//   own <moves>                       The root moves to search, none for all.
+//   go <id>                           Starts searching, as search @id.
+//   stop                              Stops searching, the tree is kept.
+// And back:
+//   stats <id> <tree stats>           As written by FormatTreeStats().
+
+// Writes and reads the root moves of a protocol line.
+std::string FormatMoves(const MoveList& moves);
+MoveList ParseMoves(const std::vector<std::string>& words, size_t first);
+
+// Writes the tree stats as
+// <playouts> <visits> <edges> {<move> <n> <q> <d> <p> <pv length> <pv>}.
+std::string FormatTreeStats(const SharedRootStats::TreeStats& tree);
+// Reads them from @words starting from @first. Returns false if malformed.
+bool ParseTreeStats(const std::vector<std::string>& words, size_t first,
+                    SharedRootStats::TreeStats* tree);
+
+struct RootMoveShare {
+  Move move;
+  // Visits the move gets, in any unit.
+  double weight = 0.0;
+};
+
+// Visits PUCT would give the root @edges over the next @visits, given their
+// visits so far and their Q and P.
+std::vector<RootMoveShare> EstimateRootShares(
+    const std::vector<SharedRootStats::EdgeStats>& edges, float cpuct,
+    int visits);
+
+// Splits the root moves between @hosts, so that they get about the same
+// weight. A move which is heavier than the share of a host is searched by
+// several, and every host gets at least one move. Moves stay with their
+// @previous host while it isn't overloaded, so that its subtree is kept.
+std::vector<MoveList> SplitRootMoves(std::vector<RootMoveShare> shares,
+                                     int hosts,
+                                     const std::vector<MoveList>& previous);
+
+// The coordinator side, run along the searches of EngineController.
+class DistributedCoordinator {
+ public:
+  // Connects to the search workers at @peers, which is comma separated
+  // host:port. Throws if one can't be reached. The root moves are shared out
+  // again every few @interval, by the PUCT of the root with @cpuct. A worker
+  // which is gone later no longer counts, and is reconnected to during
+  // searches, at growing intervals.
+  DistributedCoordinator(const std::string& peers,
+                         std::chrono::milliseconds interval, float cpuct);
+  ~DistributedCoordinator();
+
+  int GetWorkerCount() const { return workers_.size(); }
+
+  // Makes the workers search the position. The trees of @stats before
+  // @first_worker are the local ones, the next ones are the workers'. The
+  // workers start once the local root has its edges, which are split
+  // between them, or just the @searchmoves if given.
+  void Start(const std::string& fen, const std::vector<std::string>& moves,
+             const MoveList& searchmoves, SharedRootStats* stats,
+             int first_worker);
+  // Stops the search of the workers. Doesn't block on them.
+  void Stop();
+
+ private:
+  struct Worker {
+    std::string address;
+    int socket = -1;
+    // Received data which isn't a whole line yet.
+    std::string buffer;
+    MoveList owned;
+    bool started = false;
+    // When gone, the next attempt to reconnect and the wait after it.
+    std::chrono::steady_clock::time_point reconnect_at;
+    std::chrono::milliseconds reconnect_delay{0};
+  };
+
+  void Run();
+  // Reads what @worker sent, returns false if it's gone.
+  bool Receive(int index);
+  // Shares out the root moves. Returns false if the local root has no edges
+  // yet.
+  bool Rebalance();
+  // Returns false if the worker is gone.
+  bool Send(Worker* worker, const std::string& line);
+  // Drops the stats of @worker from the search, and schedules reconnecting.
+  void Disconnect(Worker* worker);
+  // Returns false if the worker is still gone.
+  bool Reconnect(Worker* worker);
+
+  const std::chrono::milliseconds interval_;
+  const float cpuct_;
+  std::vector<Worker> workers_;
+
+  // State of the current search, set up before the thread starts.
+  SharedRootStats* stats_ = nullptr;
+  int first_worker_ = 0;
+  // Position command of the search, for reconnected workers.
+  std::string position_;
+  MoveList searchmoves_;
+  MoveList local_owned_;
+  uint32_t search_id_ = 0;
+  std::atomic<bool> stop_{false};
+  std::thread thread_;
+};
+
+}  // namespace lczero
@@ -0,0 +1,152 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2019 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+
+  If you modify this Program, or any covered work, by linking or
+  combining it with NVIDIA Corporation's libraries from the NVIDIA CUDA
+  Toolkit and the NVIDIA CUDA Deep Neural Network library (or a
+  modified version of those libraries), containing parts covered by the
+  terms of the respective license agreement, the licensors of this
+  Program grant you additional permission to convey the resulting work.
+*/
+
+#include "mcts/distributed.h"
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include "utils/string.h"
+
+namespace lczero {
+
+namespace {
+int CountHosts(const std::vector<MoveList>& plan, Move move) {
+  int hosts = 0;
+  for (const auto& moves : plan) {
+    hosts += std::count(moves.begin(), moves.end(), move);
+  }
+  return hosts;
+}
+}  // namespace
+
+TEST(DistributedSearch, TreeStatsRoundTrip) {
+  SharedRootStats::TreeStats tree;
+  tree.playouts = 1234;
+  tree.visits = 1300;
+  tree.edges.resize(2);
+  tree.edges[0].move = Move("e2e4");
+  tree.edges[0].n = 1000;
+  tree.edges[0].q = 0.125f;
+  tree.edges[0].d = 0.5f;
+  tree.edges[0].p = 0.25f;
+  tree.edges[0].pv = {Move("e2e4"), Move("c2c4")};
+  tree.edges[1].move = Move("a7a8q");
+
+  const auto words = StrSplitAtWhitespace("stats 7 " + FormatTreeStats(tree));
+  SharedRootStats::TreeStats parsed;
+  ASSERT_TRUE(ParseTreeStats(words, 2, &parsed));
+  EXPECT_EQ(1234, parsed.playouts);
+  EXPECT_EQ(1300u, parsed.visits);
+  ASSERT_EQ(2u, parsed.edges.size());
+  EXPECT_EQ(Move("e2e4"), parsed.edges[0].move);
+  EXPECT_EQ(1000u, parsed.edges[0].n);
+  EXPECT_FLOAT_EQ(0.125f, parsed.edges[0].q);
+  EXPECT_FLOAT_EQ(0.5f, parsed.edges[0].d);
+  EXPECT_FLOAT_EQ(0.25f, parsed.edges[0].p);
+  EXPECT_EQ(tree.edges[0].pv, parsed.edges[0].pv);
+  EXPECT_EQ(Move("a7a8q"), parsed.edges[1].move);
+  EXPECT_TRUE(parsed.edges[1].pv.empty());
+
+  // Cut short.
+  EXPECT_FALSE(ParseTreeStats(
+      std::vector<std::string>(words.begin(), words.end() - 1), 2, &parsed));
+}
+
+TEST(DistributedSearch, SplitsRootMovesByWeight) {
+  const std::vector<RootMoveShare> shares = {{Move("e2e4"), 40.0},
+                                             {Move("d2d4"), 30.0},
+                                             {Move("c2c4"), 20.0},
+                                             {Move("g1f3"), 10.0}};
+  const auto plan = SplitRootMoves(shares, 2, {});
+  ASSERT_EQ(2u, plan.size());
+  EXPECT_EQ((MoveList{Move("e2e4"), Move("g1f3")}), plan[0]);
+  EXPECT_EQ((MoveList{Move("d2d4"), Move("c2c4")}), plan[1]);
+}
+
+TEST(DistributedSearch, SharesHeavyMoves) {
+  // A move of most of the visits goes to most hosts, the others still get
+  // searched.
+  const std::vector<RootMoveShare> shares = {{Move("e2e4"), 80.0},
+                                             {Move("d2d4"), 15.0},
+                                             {Move("c2c4"), 5.0}};
+  const auto plan = SplitRootMoves(shares, 4, {});
+  EXPECT_EQ(3, CountHosts(plan, Move("e2e4")));
+  EXPECT_EQ(1, CountHosts(plan, Move("d2d4")));
+  EXPECT_EQ(1, CountHosts(plan, Move("c2c4")));
+  for (const auto& moves : plan) EXPECT_FALSE(moves.empty());
+
+  // All hosts search the only move.
+  const auto single = SplitRootMoves({{Move("e2e4"), 0.0}}, 3, {});
+  EXPECT_EQ(3, CountHosts(single, Move("e2e4")));
+}
+
+TEST(DistributedSearch, KeepsMovesWithTheirHosts) {
+  const std::vector<RootMoveShare> shares = {{Move("e2e4"), 40.0},
+                                             {Move("d2d4"), 30.0},
+                                             {Move("c2c4"), 20.0},
+                                             {Move("g1f3"), 10.0}};
+  // Not the best split, but within the slack.
+  const std::vector<MoveList> previous = {{Move("e2e4"), Move("c2c4")},
+                                          {Move("d2d4"), Move("g1f3")}};
+  EXPECT_EQ(previous, SplitRootMoves(shares, 2, previous));
+  // Too far off, reshuffled.
+  const std::vector<MoveList> lopsided = {
+      {Move("e2e4"), Move("d2d4"), Move("c2c4")}, {Move("g1f3")}};
+  EXPECT_NE(lopsided, SplitRootMoves(shares, 2, lopsided));
+}
+
+TEST(DistributedSearch, EstimatesSharesByPuct) {
+  std::vector<SharedRootStats::EdgeStats> edges(3);
+  edges[0].move = Move("e2e4");
+  edges[0].n = 1000;
+  edges[0].q = 0.1f;
+  edges[0].p = 0.5f;
+  edges[1].move = Move("d2d4");
+  edges[1].n = 500;
+  edges[1].q = 0.05f;
+  edges[1].p = 0.3f;
+  // Losing, and already searched enough.
+  edges[2].move = Move("h2h4");
+  edges[2].n = 100;
+  edges[2].q = -0.5f;
+  edges[2].p = 0.2f;
+  const auto shares = EstimateRootShares(edges, 2.1f, 10000);
+  ASSERT_EQ(3u, shares.size());
+  double total = 0.0;
+  for (const auto& share : shares) total += share.weight;
+  EXPECT_DOUBLE_EQ(10000.0, total);
+  EXPECT_GT(shares[0].weight, shares[1].weight);
+  EXPECT_GT(shares[1].weight, shares[2].weight);
+}
+
+}  // namespace lczero
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
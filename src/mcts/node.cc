@@ -31,14 +31,24 @@
 #include <bitset>
 #include <cassert>
 #include <cmath>
+#include <condition_variable>
 #include <cstring>
+#include <deque>
+#include <fstream>
 #include <iostream>
+#include <iterator>
+#include <new>
 #include <sstream>
 #include <thread>
+#include <type_traits>
 #include "neural/encoder.h"
 #include "neural/network.h"
+#include "utils/affinity.h"
 #include "utils/exception.h"
+#include "utils/filesystem.h"
 #include "utils/hashcat.h"
+#include "utils/metrics.h"
+#include "utils/trace.h"
 
 namespace lczero {
 
@@ -47,62 +57,174 @@ namespace lczero {
 /////////////////////////////////////////////////////////////////////////
 
 namespace {
-// Periodicity of garbage collection, milliseconds.
-const int kGCIntervalMs = 100;
+// Most threads freeing nodes, a quarter of the CPUs up to that.
+const int kMaxGcThreads = 4;
+
+Gauge gGcBacklogMetric("lc0_gc_backlog",
+                       "Released subtrees waiting for the garbage collector.");
+Gauge gGcBacklogVisitsMetric(
+    "lc0_gc_backlog_visits",
+    "Visits of the released nodes the garbage collector has yet to free.");
+}  // namespace
 
-// Every kGCIntervalMs milliseconds release nodes in a separate GC thread.
+// Frees released subtrees in background threads of low priority, as soon as
+// they are released. A thread frees the nodes of a subtree one sibling list
+// at a time, and hands part of the lists below to idle threads, so that large
+// subtrees are freed in parallel.
 class NodeGarbageCollector {
  public:
-  NodeGarbageCollector() : gc_thread_([this]() { Worker(); }) {}
+  NodeGarbageCollector() {
+    const int threads = std::max(
+        1, std::min<int>(kMaxGcThreads,
+                         std::thread::hardware_concurrency() / 4));
+    for (int i = 0; i < threads; ++i) {
+      gc_threads_.emplace_back([this]() { Worker(); });
+    }
+  }
 
-  // Takes ownership of a subtree, to dispose it in a separate thread when
-  // it has time.
+  // Takes ownership of a subtree, to dispose it in a separate thread. The
+  // frees are charged to the arena account of the current thread.
   void AddToGcQueue(std::unique_ptr<Node> node) {
     if (!node) return;
+    backlog_.fetch_add(GetVisits(node.get()), std::memory_order_relaxed);
+    NodeArena::Account* account = NodeArena::GetCurrentAccount();
+    if (account) account->AddPendingFrees(1);
     Mutex::Lock lock(gc_mutex_);
-    subtrees_to_gc_.emplace_back(std::move(node));
+    subtrees_to_gc_.push_back(
+        {std::move(node), account ? account->shared_from_this() : nullptr});
+    gGcBacklogMetric.Set(subtrees_to_gc_.size());
+    work_cv_.notify_one();
+  }
+
+  uint64_t GetBacklog() const {
+    return std::max<int64_t>(0, backlog_.load(std::memory_order_relaxed));
+  }
+
+  bool Wait(std::chrono::milliseconds timeout) {
+    Mutex::Lock lock(gc_mutex_);
+    return done_cv_.wait_for(lock.get_raw(), timeout, [this]() {
+      return subtrees_to_gc_.empty() && busy_threads_ == 0;
+    });
   }
 
   ~NodeGarbageCollector() {
-    // Flips stop flag and waits for a worker thread to stop.
-    stop_.store(true);
-    gc_thread_.join();
+    // Flips stop flag and waits for the worker threads to stop.
+    {
+      Mutex::Lock lock(gc_mutex_);
+      stop_ = true;
+    }
+    work_cv_.notify_all();
+    for (auto& thread : gc_threads_) thread.join();
   }
 
  private:
-  void GarbageCollect() {
-    while (!stop_.load()) {
-      // Node will be released in destructor when mutex is not locked.
-      std::unique_ptr<Node> node_to_gc;
+  // Sibling list to free, and the account to charge.
+  struct Subtree {
+    std::unique_ptr<Node> nodes;
+    std::shared_ptr<NodeArena::Account> account;
+  };
+
+  // Sums the visits of a node and its siblings.
+  static int64_t GetVisits(const Node* node) {
+    int64_t visits = 0;
+    for (; node; node = node->sibling_.get()) visits += node->GetN();
+    return visits;
+  }
+
+  // Frees the nodes of a sibling list, and moves the lists of their children
+  // to @subtrees.
+  void Dispose(Subtree list, std::vector<Subtree>* subtrees) {
+    int64_t visits = 0;
+    for (Node* node = list.nodes.get(); node; node = node->sibling_.get()) {
+      visits += node->GetN();
+      if (!node->child_) continue;
+      backlog_.fetch_add(GetVisits(node->child_.get()),
+                         std::memory_order_relaxed);
+      if (list.account) list.account->AddPendingFrees(1);
+      subtrees->push_back({node->child_.Release(), list.account});
+    }
+    {
+      NodeArena::ScopedAccount scope(list.account.get());
+      list.nodes.reset();
+    }
+    if (list.account) list.account->AddPendingFrees(-1);
+    gGcBacklogVisitsMetric.Set(
+        backlog_.fetch_sub(visits, std::memory_order_relaxed) - visits);
+  }
+
+  void Worker() {
+    LowerCurrentThreadPriority();
+    // The collector starts before the options are read.
+    PinnedThread pinned(ThreadRole::kGc);
+    std::vector<Subtree> subtrees;
+    while (true) {
+      pinned.Refresh();
       {
-        // Lock the mutex and move last subtree from subtrees_to_gc_ into
-        // node_to_gc.
         Mutex::Lock lock(gc_mutex_);
-        if (subtrees_to_gc_.empty()) return;
-        node_to_gc = std::move(subtrees_to_gc_.back());
+        if (subtrees_to_gc_.empty() && busy_threads_ == 0) {
+          done_cv_.notify_all();
+        }
+        ++idle_threads_;
+        work_cv_.wait(lock.get_raw(), [this]() {
+          return stop_ || !subtrees_to_gc_.empty();
+        });
+        --idle_threads_;
+        if (stop_) return;
+        subtrees.emplace_back(std::move(subtrees_to_gc_.back()));
         subtrees_to_gc_.pop_back();
+        gGcBacklogMetric.Set(subtrees_to_gc_.size());
+        ++busy_threads_;
+      }
+      TRACE_SCOPE("node gc");
+      while (!subtrees.empty()) {
+        Subtree list = std::move(subtrees.back());
+        subtrees.pop_back();
+        Dispose(std::move(list), &subtrees);
+        if (subtrees.size() < 2 ||
+            idle_threads_.load(std::memory_order_relaxed) == 0) {
+          continue;
+        }
+        // Share the lists closest to the root, which likely hold the
+        // largest subtrees.
+        Mutex::Lock lock(gc_mutex_);
+        const size_t share = subtrees.size() / 2;
+        std::move(subtrees.begin(), subtrees.begin() + share,
+                  std::back_inserter(subtrees_to_gc_));
+        subtrees.erase(subtrees.begin(), subtrees.begin() + share);
+        gGcBacklogMetric.Set(subtrees_to_gc_.size());
+        work_cv_.notify_all();
       }
+      Mutex::Lock lock(gc_mutex_);
+      --busy_threads_;
     }
   }
 
-  void Worker() {
-    while (!stop_.load()) {
-      std::this_thread::sleep_for(std::chrono::milliseconds(kGCIntervalMs));
-      GarbageCollect();
-    };
-  }
-
-  mutable Mutex gc_mutex_;
-  std::vector<std::unique_ptr<Node>> subtrees_to_gc_ GUARDED_BY(gc_mutex_);
+  Mutex gc_mutex_;
+  std::vector<Subtree> subtrees_to_gc_ GUARDED_BY(gc_mutex_);
+  // Notified when subtrees are added, and on stop.
+  std::condition_variable work_cv_;
+  // Notified when nothing is left to free.
+  std::condition_variable done_cv_;
+  int busy_threads_ GUARDED_BY(gc_mutex_) = 0;
+  std::atomic<int> idle_threads_{0};
+  // Visits of the released nodes not freed yet.
+  std::atomic<int64_t> backlog_{0};
 
   // When true, Worker() should stop and exit.
-  std::atomic<bool> stop_{false};
-  std::thread gc_thread_;
-};  // namespace
+  bool stop_ GUARDED_BY(gc_mutex_) = false;
+  std::vector<std::thread> gc_threads_;
+};
 
+namespace {
 NodeGarbageCollector gNodeGc;
 }  // namespace
 
+uint64_t GetGcBacklog() { return gNodeGc.GetBacklog(); }
+
+bool WaitForGc(std::chrono::milliseconds timeout) {
+  return gNodeGc.Wait(timeout);
+}
+
 /////////////////////////////////////////////////////////////////////////
 // Edge
 /////////////////////////////////////////////////////////////////////////
@@ -144,22 +266,30 @@ Move Edge::GetMove(bool as_opponent) const {
 // subtracting the two bits from the input and checking for a negative result
 // (the subtraction works despite crossing from exponent to significand). This
 // is combined with the round-to-nearest addition (1<<11) into one op.
-void Edge::SetP(float p) {
+namespace {
+uint16_t CompressP(float p) {
   assert(0.0f <= p && p <= 1.0f);
   constexpr int32_t roundings = (1 << 11) - (3 << 28);
   int32_t tmp;
   std::memcpy(&tmp, &p, sizeof(float));
   tmp += roundings;
-  p_ = (tmp < 0) ? 0 : static_cast<uint16_t>(tmp >> 12);
+  return (tmp < 0) ? 0 : static_cast<uint16_t>(tmp >> 12);
 }
 
-float Edge::GetP() const {
+float DecompressP(uint16_t p) {
   // Reshift into place and set the assumed-set exponent bits.
-  uint32_t tmp = (static_cast<uint32_t>(p_) << 12) | (3 << 28);
+  uint32_t tmp = (static_cast<uint32_t>(p) << 12) | (3 << 28);
   float ret;
   std::memcpy(&ret, &tmp, sizeof(uint32_t));
   return ret;
 }
+}  // namespace
+
+void Edge::SetP(float p) { p_ = CompressP(p); }
+
+float Edge::GetP() const { return DecompressP(p_); }
+
+float Edge::RoundP(float p) { return DecompressP(CompressP(p)); }
 
 void Edge::MakeTerminal(GameResult result) {
   certainty_state_ |= kTerminalMask | kCertainMask | kUpperBound | kLowerBound;
@@ -220,10 +350,22 @@ std::string Edge::DebugString() const {
 // EdgeList
 /////////////////////////////////////////////////////////////////////////
 
-EdgeList::EdgeList(MoveList moves)
-    : edges_(std::make_unique<Edge[]>(moves.size())), size_(moves.size()) {
-  auto* edge = edges_.get();
-  for (const auto move : moves) edge++->SetMove(move);
+EdgeList::EdgeList(const Move* moves, size_t count) {
+  if (count == 0) return;
+  static_assert(sizeof(uint16_t) <= sizeof(Edge), "Edge is too small");
+  static_assert(std::is_trivially_destructible<Edge>::value,
+                "Edges are not destroyed");
+  // One extra slot in front of the edges keeps the size.
+  auto* memory = static_cast<char*>(
+      NodeArena::Allocate(sizeof(Edge) * (count + 1)));
+  new (memory) uint16_t(count);
+  edges_ = reinterpret_cast<Edge*>(memory + sizeof(Edge));
+  auto* edge = edges_;
+  for (size_t i = 0; i < count; i++) (new (edge++) Edge())->SetMove(moves[i]);
+}
+
+EdgeList::~EdgeList() {
+  if (edges_) NodeArena::Free(edges_ - 1, sizeof(Edge) * (size() + 1));
 }
 
 /////////////////////////////////////////////////////////////////////////
@@ -234,7 +376,7 @@ Node* Node::CreateSingleChildNode(Move move) {
   assert(!edges_);
   assert(!child_);
   edges_ = EdgeList({move});
-  child_ = std::make_unique<Node>(this, 0);
+  child_.Reset(std::make_unique<Node>(this, 0));
   return child_.get();
 }
 
@@ -244,11 +386,17 @@ void Node::CreateEdges(const MoveList& moves) {
   edges_ = EdgeList(moves);
 }
 
+void Node::CreateEdges(const FixedMoveList& moves) {
+  assert(!edges_);
+  assert(!child_);
+  edges_ = EdgeList(moves.begin(), moves.size());
+}
+
 Node::ConstIterator Node::Edges() const { return {edges_, &child_}; }
 Node::Iterator Node::Edges() { return {edges_, &child_}; }
 
 void Node::RecomputeNfromChildren() {
-  if (n_ > 1) {
+  if (GetN() > 1) {
     uint32_t visits = 1;
     for (const auto& child : Edges()) visits += child.GetN();
     n_ = visits;
@@ -267,7 +415,7 @@ float Node::GetQ() const {
   //   auto edge = parent_->GetEdgeToNode(this);
   //   if (edge->IsCertain()) return (float)edge->GetEQ();
   // }
-  return q_;
+  return q_.load(std::memory_order_relaxed);
 }
 
 Edge* Node::GetEdgeToNode(const Node* node) const {
@@ -287,71 +435,134 @@ std::string Node::DebugString() const {
   std::ostringstream oss;
   oss << " This:" << this << " Parent:" << parent_ << " Index:" << index_
       << " Child:" << child_.get() << " Sibling:" << sibling_.get()
-      << " Q:" << q_ << " N:" << n_ << " N_:" << n_in_flight_
+      << " Q:" << GetQ() << " N:" << GetN() << " N_:" << GetNInFlight()
       << " Edges:" << edges_.size();
   return oss.str();
 }
 
 bool Node::TryStartScoreUpdate() {
-  if (n_ == 0 && n_in_flight_ > 0) return false;
-  ++n_in_flight_;
+  // Compare-and-swap, so that of several threads racing to an unvisited node
+  // only one gets to extend it.
+  uint32_t n_in_flight = n_in_flight_.load(std::memory_order_acquire);
+  do {
+    if (n_in_flight > 0 && GetN() == 0) return false;
+  } while (!n_in_flight_.compare_exchange_weak(n_in_flight, n_in_flight + 1,
+                                               std::memory_order_acq_rel));
   return true;
 }
 
 void Node::CancelScoreUpdate(int multivisit) {
-  n_in_flight_ -= multivisit;
-  best_child_cached_ = nullptr;
+  n_in_flight_.fetch_sub(multivisit, std::memory_order_acq_rel);
+  InvalidateBestChild();
 }
 
 void Node::FinalizeScoreUpdate(float v, float d, int multivisit) {
+  const uint32_t n = GetN();
   // Recompute Q.
-  q_ += multivisit * (v - q_) / (n_ + multivisit);
-  d_ += multivisit * (d - d_) / (n_ + multivisit);
+  const float q = q_.load(std::memory_order_relaxed);
+  q_.store(q + multivisit * (v - q) / (n + multivisit),
+           std::memory_order_relaxed);
+  const float old_d = d_.load(std::memory_order_relaxed);
+  d_.store(old_d + multivisit * (d - old_d) / (n + multivisit),
+           std::memory_order_relaxed);
 
   // If first visit, update parent's sum of policies visited at least once.
-  if (n_ == 0 && parent_ != nullptr) {
+  if (n == 0 && parent_ != nullptr) {
     parent_->visited_policy_ += parent_->edges_[index_].GetP();
   }
   // Increment N.
-  n_ += multivisit;
+  n_.store(n + multivisit, std::memory_order_release);
   // Decrement virtual loss.
-  n_in_flight_ -= multivisit;
+  n_in_flight_.fetch_sub(multivisit, std::memory_order_acq_rel);
   // Best child is potentially no longer valid.
-  best_child_cached_ = nullptr;
+  InvalidateBestChild();
 }
 
 void Node::UpdateBestChild(const Iterator& best_edge, int visits_allowed) {
-  best_child_cached_ = best_edge.node();
+  Node* best_child = best_edge.node();
   // An edge can point to an unexpanded node with n==0. These nodes don't
   // increment their n_in_flight_ the same way and thus are not safe to cache.
-  if (best_child_cached_ && best_child_cached_->GetN() == 0) {
-    best_child_cached_ = nullptr;
-  }
-  best_child_cache_in_flight_limit_ = visits_allowed + n_in_flight_;
+  if (best_child && best_child->GetN() == 0) best_child = nullptr;
+  // Readers load the child first, so it is stored last.
+  InvalidateBestChild();
+  best_child_cache_in_flight_limit_.store(visits_allowed + GetNInFlight(),
+                                          std::memory_order_relaxed);
+  best_child_cached_.store(best_child, std::memory_order_release);
 }
 
 Node::NodeRange Node::ChildNodes() const { return child_.get(); }
 
-void Node::ReleaseChildren() { gNodeGc.AddToGcQueue(std::move(child_)); }
+void Node::ReleaseChildren() { gNodeGc.AddToGcQueue(child_.Release()); }
+
+void Node::CollapseChildren() {
+  ReleaseChildren();
+  InvalidateBestChild();
+  best_child_cache_in_flight_limit_.store(0, std::memory_order_relaxed);
+  // Children are visited afresh.
+  visited_policy_ = 0.0f;
+}
+
+void Node::Trim() {
+  ReleaseChildren();
+  edges_ = EdgeList();
+  InvalidateBestChild();
+  q_.store(0.0f, std::memory_order_relaxed);
+  d_.store(0.0f, std::memory_order_relaxed);
+  visited_policy_ = 0.0f;
+  n_.store(0, std::memory_order_relaxed);
+  n_in_flight_.store(0, std::memory_order_relaxed);
+  best_child_cache_in_flight_limit_.store(0, std::memory_order_relaxed);
+  small_network_eval_.store(false, std::memory_order_relaxed);
+}
+
+void Node::ReplacePriors(const float* priors) {
+  for (int i = 0; i < edges_.size(); ++i) edges_[i].SetP(priors[i]);
+  visited_policy_ = 0.0f;
+  for (auto* child = child_.get(); child; child = child->sibling_.get()) {
+    if (child->GetN() > 0) visited_policy_ += edges_[child->index_].GetP();
+  }
+  InvalidateBestChild();
+  best_child_cache_in_flight_limit_.store(0, std::memory_order_relaxed);
+}
 
 void Node::ReleaseChildrenExceptOne(Node* node_to_save) {
   // Stores node which will have to survive (or nullptr if it's not found).
   std::unique_ptr<Node> saved_node;
-  // Pointer to unique_ptr, so that we could move from it.
-  for (std::unique_ptr<Node>* node = &child_; *node;
-       node = &(*node)->sibling_) {
+  // Pointer to the link, so that we could take the node from it.
+  for (NodeLink* node = &child_; *node; node = &(*node)->sibling_) {
     // If current node is the one that we have to save.
     if (node->get() == node_to_save) {
       // Kill all remaining siblings.
-      gNodeGc.AddToGcQueue(std::move((*node)->sibling_));
-      // Save the node, and take the ownership from the unique_ptr.
-      saved_node = std::move(*node);
+      gNodeGc.AddToGcQueue((*node)->sibling_.Release());
+      // Save the node, and take the ownership from the link.
+      saved_node = node->Release();
       break;
     }
   }
   // Make saved node the only child. (kills previous siblings).
-  gNodeGc.AddToGcQueue(std::move(child_));
-  child_ = std::move(saved_node);
+  gNodeGc.AddToGcQueue(child_.Release());
+  child_.Reset(std::move(saved_node));
+}
+
+void Node::ReleaseChildrenExcept(const std::vector<Node*>& nodes_to_save) {
+  NodeLink* node = &child_;
+  while (*node) {
+    if (std::find(nodes_to_save.begin(), nodes_to_save.end(), node->get()) !=
+        nodes_to_save.end()) {
+      node = &(*node)->sibling_;
+      continue;
+    }
+    // Unlink the child so that its siblings are not released with it.
+    std::unique_ptr<Node> released = node->Release();
+    node->Reset(released->sibling_.Release());
+    gNodeGc.AddToGcQueue(std::move(released));
+  }
+  visited_policy_ = 0.0f;
+  for (auto* child = child_.get(); child; child = child->sibling_.get()) {
+    if (child->GetN() > 0) visited_policy_ += edges_[child->index_].GetP();
+  }
+  InvalidateBestChild();
+  best_child_cache_in_flight_limit_.store(0, std::memory_order_relaxed);
 }
 
 namespace {
@@ -438,6 +649,8 @@ std::string EdgeAndNode::DebugString() const {
 /////////////////////////////////////////////////////////////////////////
 
 void NodeTree::MakeMove(Move move) {
+  NodeArena::ScopedAccount scope(memory_.get());
+  moves_.push_back(move);
   if (HeadPosition().IsBlackToMove()) move.Mirror();
 
   Node* new_head = nullptr;
@@ -447,7 +660,11 @@ void NodeTree::MakeMove(Move move) {
       break;
     }
   }
-  current_head_->ReleaseChildrenExceptOne(new_head);
+  if (retain_siblings_ > 0) {
+    ReleaseSiblingsRetaining(new_head);
+  } else {
+    current_head_->ReleaseChildrenExceptOne(new_head);
+  }
   current_head_ =
       new_head ? new_head : current_head_->CreateSingleChildNode(move);
   // If certain and no children, reset node (so that n_ =  0).
@@ -460,38 +677,109 @@ void NodeTree::MakeMove(Move move) {
   history_.Append(move);
 }
 
+void NodeTree::ReleaseSiblingsRetaining(Node* new_head) {
+  // Every child off the line from the game begin to the new head is a kept
+  // subtree, be it a sibling of the new head or one from earlier moves.
+  std::vector<Node*> candidates;
+  Node* on_line = new_head;
+  for (Node* node = current_head_; node; node = node->GetParent()) {
+    for (Node* child : node->ChildNodes()) {
+      if (child != on_line && child->GetN() > 0) candidates.push_back(child);
+    }
+    on_line = node;
+  }
+  std::stable_sort(candidates.begin(), candidates.end(),
+                   [](const Node* a, const Node* b) {
+                     return a->GetN() > b->GetN();
+                   });
+  std::vector<Node*> kept;
+  uint64_t visits = 0;
+  for (Node* child : candidates) {
+    if (static_cast<int>(kept.size()) >= retain_siblings_) break;
+    if (visits + child->GetN() > retain_siblings_visits_) continue;
+    visits += child->GetN();
+    kept.push_back(child);
+  }
+
+  on_line = new_head;
+  for (Node* node = current_head_; node; node = node->GetParent()) {
+    int children = 0;
+    bool all_kept = true;
+    for (Node* child : node->ChildNodes()) {
+      ++children;
+      if (child != on_line &&
+          std::find(kept.begin(), kept.end(), child) == kept.end()) {
+        all_kept = false;
+      }
+    }
+    // Nodes above the head usually have nothing to release.
+    if (!all_kept) {
+      std::vector<Node*> nodes_to_save;
+      nodes_to_save.reserve(children);
+      for (Node* child : node->ChildNodes()) {
+        if (child == on_line ||
+            std::find(kept.begin(), kept.end(), child) != kept.end()) {
+          nodes_to_save.push_back(child);
+        }
+      }
+      node->ReleaseChildrenExcept(nodes_to_save);
+    }
+    on_line = node;
+  }
+}
+
 void NodeTree::TrimTreeAtHead() {
-  auto tmp = std::move(current_head_->sibling_);
+  NodeArena::ScopedAccount scope(memory_.get());
   // Send dependent nodes for GC instead of destroying them immediately.
-  gNodeGc.AddToGcQueue(std::move(current_head_->child_));
-  *current_head_ = Node(current_head_->GetParent(), current_head_->index_);
-  current_head_->sibling_ = std::move(tmp);
+  current_head_->Trim();
 }
 
 bool NodeTree::ResetToPosition(const std::string& starting_fen,
                                const std::vector<Move>& moves) {
-  ChessBoard starting_board;
-  int no_capture_ply;
-  int full_moves;
-  starting_board.SetFromFen(starting_fen, &no_capture_ply, &full_moves);
-  if (gamebegin_node_ && history_.Starting().GetBoard() != starting_board) {
-    // Completely different position.
-    DeallocateTree();
-  }
-
-  if (!gamebegin_node_) {
-    gamebegin_node_ = std::make_unique<Node>(nullptr, 0);
-  }
+  NodeArena::ScopedAccount scope(memory_.get());
+  bool seen_old_head;
+  if (gamebegin_node_ && starting_fen == starting_fen_ &&
+      moves.size() >= moves_.size() &&
+      std::equal(moves_.begin(), moves_.end(), moves.begin())) {
+    // Same game with moves added, as in every "position ... moves" of a UCI
+    // game: the head and history are already at the end of the known moves,
+    // only the new ones are played.
+    seen_old_head = true;
+    for (size_t i = moves_.size(); i < moves.size(); ++i) MakeMove(moves[i]);
+  } else {
+    // The FEN is only parsed when it changes.
+    if (starting_fen != starting_fen_ || !gamebegin_node_) {
+      ChessBoard starting_board;
+      int no_capture_ply;
+      int full_moves;
+      starting_board.SetFromFen(starting_fen, &no_capture_ply, &full_moves);
+      if (gamebegin_node_ &&
+          history_.Starting().GetBoard() != starting_board) {
+        // Completely different position.
+        DeallocateTree();
+      }
+      starting_fen_ = starting_fen;
+      starting_board_ = starting_board;
+      starting_no_capture_ply_ = no_capture_ply;
+      starting_full_moves_ = full_moves;
+    }
 
-  history_.Reset(starting_board, no_capture_ply,
-                 full_moves * 2 - (starting_board.flipped() ? 1 : 2));
+    if (!gamebegin_node_) {
+      gamebegin_node_ = std::make_unique<Node>(nullptr, 0);
+    }
 
-  Node* old_head = current_head_;
-  current_head_ = gamebegin_node_.get();
-  bool seen_old_head = (gamebegin_node_.get() == old_head);
-  for (const auto& move : moves) {
-    MakeMove(move);
-    if (old_head == current_head_) seen_old_head = true;
+    history_.Reset(starting_board_, starting_no_capture_ply_,
+                   starting_full_moves_ * 2 -
+                       (starting_board_.flipped() ? 1 : 2));
+    moves_.clear();
+
+    Node* old_head = current_head_;
+    current_head_ = gamebegin_node_.get();
+    seen_old_head = (gamebegin_node_.get() == old_head);
+    for (const auto& move : moves) {
+      MakeMove(move);
+      if (old_head == current_head_) seen_old_head = true;
+    }
   }
 
   // MakeMove guarantees that no siblings exist; but, if we didn't see the old
@@ -502,7 +790,12 @@ bool NodeTree::ResetToPosition(const std::string& starting_fen,
   // Also, if the current_head_ is certain and has no children, reset that
   // as well to allow forced analysis of WDL hits, or possibly 2 or 3 fold
   // or 50 move "draws", etc.
-  if (!seen_old_head ||
+  // Kept subtrees are the exception: a head which still has some of them is
+  // searched on from them, with its N recomputed from theirs and its Q as it
+  // was.
+  const bool reuses_siblings =
+      retain_siblings_ > 0 && current_head_->HasChildNodes();
+  if ((!seen_old_head && !reuses_siblings) ||
       (current_head_->IsCertain() && !current_head_->HasChildren()))
     TrimTreeAtHead();
   // Certainty Propagation: No need to trim the head for certain nodes with
@@ -516,11 +809,328 @@ bool NodeTree::ResetToPosition(const std::string& starting_fen,
 }
 
 void NodeTree::DeallocateTree() {
+  NodeArena::ScopedAccount scope(memory_.get());
   // Same as gamebegin_node_.reset(), but actual deallocation will happen in
   // GC thread.
   gNodeGc.AddToGcQueue(std::move(gamebegin_node_));
   gamebegin_node_ = nullptr;
   current_head_ = nullptr;
+  moves_.clear();
+}
+
+/////////////////////////////////////////////////////////////////////////
+// Tree files
+/////////////////////////////////////////////////////////////////////////
+
+// A tree file is a header, the starting FEN and the moves to the head,
+// followed by the nodes of the head's subtree in preorder. A node is:
+//   u32 n, f32 q, f32 d, f32 visited policy, u16 number of edges,
+//   per edge: u16 move, u16 compressed P, u8 certainty state,
+//   u16 number of child nodes,
+//   per child node, in index order: u16 edge index, then the child node.
+// All values are in the byte order of the machine that wrote them.
+
+namespace {
+const char kTreeFileMagic[8] = {'L', 'c', '0', 'T', 'r', 'e', 'e', '1'};
+struct TreeFileHeader {
+  char magic[8];
+  uint64_t weights_hash;
+};
+static_assert(sizeof(Move) == sizeof(uint16_t), "Move is not 16 bit");
+
+// Writes a file from a background thread, in chunks handed over as they
+// fill up, so that walking the tree and writing overlap.
+class TreeFileWriter {
+ public:
+  explicit TreeFileWriter(const std::string& filename)
+      : filename_(filename),
+        tmp_filename_(filename + ".tmp"),
+        out_(tmp_filename_, std::ios::binary | std::ios::trunc) {
+    if (!out_) throw Exception("Cannot write tree file: " + tmp_filename_);
+    chunk_.reserve(kChunkSize);
+    thread_ = std::thread([this]() { Worker(); });
+  }
+
+  ~TreeFileWriter() {
+    if (thread_.joinable()) Finish();
+  }
+
+  template <typename T>
+  void Append(const T& value) {
+    Append(&value, sizeof(value));
+  }
+
+  void Append(const void* ptr, size_t size) {
+    const char* bytes = static_cast<const char*>(ptr);
+    chunk_.insert(chunk_.end(), bytes, bytes + size);
+    if (chunk_.size() >= kChunkSize) Flush();
+  }
+
+  // Writes the rest and replaces the file. Throws exception on failure.
+  void Commit() {
+    Finish();
+    if (!out_) throw Exception("Cannot write tree file: " + tmp_filename_);
+    out_.close();
+    RenameFile(tmp_filename_, filename_);
+  }
+
+ private:
+  static constexpr size_t kChunkSize = 1 << 20;
+  // Chunks queued at most, which bounds the memory used when the disk is
+  // slower than the walk.
+  static constexpr size_t kMaxQueuedChunks = 8;
+
+  void Flush() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [this]() { return queue_.size() < kMaxQueuedChunks; });
+    queue_.emplace_back(std::move(chunk_));
+    cv_.notify_all();
+    chunk_ = std::vector<char>();
+    chunk_.reserve(kChunkSize);
+  }
+
+  void Finish() {
+    if (!chunk_.empty()) Flush();
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      done_ = true;
+    }
+    cv_.notify_all();
+    thread_.join();
+  }
+
+  void Worker() {
+    while (true) {
+      std::vector<char> chunk;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait(lock, [this]() { return done_ || !queue_.empty(); });
+        if (queue_.empty()) return;
+        chunk = std::move(queue_.front());
+        queue_.pop_front();
+      }
+      cv_.notify_all();
+      out_.write(chunk.data(), chunk.size());
+    }
+  }
+
+  const std::string filename_;
+  const std::string tmp_filename_;
+  std::ofstream out_;
+  std::vector<char> chunk_;
+  std::thread thread_;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::deque<std::vector<char>> queue_;
+  bool done_ = false;
+};
+
+// Reads values from a mapped tree file, checking bounds.
+class TreeFileReader {
+ public:
+  TreeFileReader(const char* data, size_t size)
+      : data_(data), end_(data + size) {}
+
+  template <typename T>
+  bool Read(T* value) {
+    if (static_cast<size_t>(end_ - data_) < sizeof(T)) return false;
+    std::memcpy(value, data_, sizeof(T));
+    data_ += sizeof(T);
+    return true;
+  }
+
+  bool Read(std::string* value, size_t size) {
+    if (static_cast<size_t>(end_ - data_) < size) return false;
+    value->assign(data_, size);
+    data_ += size;
+    return true;
+  }
+
+  bool AtEnd() const { return data_ == end_; }
+
+ private:
+  const char* data_;
+  const char* const end_;
+};
+}  // namespace
+
+uint64_t NodeTree::SaveTree(const std::string& filename,
+                            uint64_t weights_hash) const {
+  if (!current_head_) throw Exception("No tree to save");
+  TreeFileWriter writer(filename);
+  TreeFileHeader header;
+  std::memcpy(header.magic, kTreeFileMagic, sizeof(kTreeFileMagic));
+  header.weights_hash = weights_hash;
+  writer.Append(header);
+  writer.Append(static_cast<uint32_t>(starting_fen_.size()));
+  writer.Append(starting_fen_.data(), starting_fen_.size());
+  writer.Append(static_cast<uint32_t>(moves_.size()));
+  writer.Append(moves_.data(), moves_.size() * sizeof(Move));
+
+  // Preorder walk with an explicit stack, as the tree may be deep.
+  uint64_t nodes = 0;
+  std::vector<const Node*> stack{current_head_};
+  std::vector<const Node*> children;
+  while (!stack.empty()) {
+    const Node* node = stack.back();
+    stack.pop_back();
+    if (node != current_head_) writer.Append(node->index_);
+    ++nodes;
+    writer.Append(node->GetN());
+    writer.Append(node->GetQ());
+    writer.Append(node->GetD());
+    writer.Append(node->visited_policy_);
+    const uint16_t num_edges = node->edges_.size();
+    writer.Append(num_edges);
+    for (uint16_t i = 0; i < num_edges; ++i) {
+      const Edge& edge = node->edges_[i];
+      writer.Append(edge.move_);
+      writer.Append(edge.p_);
+      writer.Append(edge.certainty_state_);
+    }
+    children.clear();
+    for (const Node* child = node->child_.get(); child;
+         child = child->sibling_.get()) {
+      children.push_back(child);
+    }
+    writer.Append(static_cast<uint16_t>(children.size()));
+    stack.insert(stack.end(), children.rbegin(), children.rend());
+  }
+  writer.Commit();
+  return nodes;
+}
+
+bool NodeTree::LoadTree(const std::string& filename, uint64_t weights_hash) {
+  NodeArena::ScopedAccount scope(memory_.get());
+  std::unique_ptr<MappedFile> file;
+  try {
+    file = std::make_unique<MappedFile>(filename);
+  } catch (const Exception&) {
+    return false;
+  }
+  TreeFileReader reader(file->data(), file->size());
+  TreeFileHeader header;
+  if (!reader.Read(&header) ||
+      std::memcmp(header.magic, kTreeFileMagic, sizeof(kTreeFileMagic)) != 0 ||
+      header.weights_hash != weights_hash) {
+    return false;
+  }
+  uint32_t fen_size;
+  std::string fen;
+  uint32_t num_moves;
+  if (!reader.Read(&fen_size) || !reader.Read(&fen, fen_size) ||
+      !reader.Read(&num_moves) || num_moves > file->size()) {
+    return false;
+  }
+  std::vector<Move> moves(num_moves);
+  for (auto& move : moves) {
+    if (!reader.Read(&move)) return false;
+  }
+  try {
+    ResetToPosition(fen, moves);
+  } catch (const Exception&) {
+    return false;
+  }
+  TrimTreeAtHead();
+
+  // Reads the statistics and edges of a node, and how many child nodes
+  // follow. The edges have to be legal moves of @board, the position of the
+  // node, as the search trusts them.
+  auto read_node = [&reader](Node* node, const ChessBoard& board,
+                             uint16_t* num_children) {
+    uint32_t n;
+    float q;
+    float d;
+    uint16_t num_edges;
+    if (!reader.Read(&n) || !reader.Read(&q) || !reader.Read(&d) ||
+        !reader.Read(&node->visited_policy_) || !reader.Read(&num_edges)) {
+      return false;
+    }
+    node->n_.store(n, std::memory_order_relaxed);
+    node->q_.store(q, std::memory_order_relaxed);
+    node->d_.store(d, std::memory_order_relaxed);
+    std::vector<Move> edge_moves(num_edges);
+    std::vector<uint16_t> edge_p(num_edges);
+    std::vector<uint8_t> edge_state(num_edges);
+    for (uint16_t i = 0; i < num_edges; ++i) {
+      if (!reader.Read(&edge_moves[i]) || !reader.Read(&edge_p[i]) ||
+          !reader.Read(&edge_state[i])) {
+        return false;
+      }
+    }
+    if (num_edges > 0) {
+      const MoveList legal_moves = board.GenerateLegalMoves();
+      for (uint16_t i = 0; i < num_edges; ++i) {
+        if (std::find(legal_moves.begin(), legal_moves.end(),
+                      edge_moves[i]) == legal_moves.end() ||
+            std::find(edge_moves.begin(), edge_moves.begin() + i,
+                      edge_moves[i]) != edge_moves.begin() + i) {
+          return false;
+        }
+      }
+    }
+    node->edges_ = EdgeList(edge_moves.data(), num_edges);
+    for (uint16_t i = 0; i < num_edges; ++i) {
+      node->edges_[i].p_ = edge_p[i];
+      node->edges_[i].certainty_state_ = edge_state[i];
+    }
+    return reader.Read(num_children) &&
+           *num_children <= node->edges_.size();
+  };
+
+  struct Frame {
+    Node* node;
+    ChessBoard board;
+    // Child nodes still to read, and where the next one is linked.
+    uint16_t remaining;
+    NodeLink* next;
+    int last_index;
+  };
+  std::vector<Frame> stack;
+  bool ok = true;
+  uint16_t num_children;
+  const ChessBoard& head_board = HeadPosition().GetBoard();
+  if (!read_node(current_head_, head_board, &num_children)) {
+    ok = false;
+  } else if (num_children > 0) {
+    stack.push_back(
+        {current_head_, head_board, num_children, &current_head_->child_, -1});
+  }
+  while (ok && !stack.empty()) {
+    Frame& frame = stack.back();
+    if (frame.remaining == 0) {
+      stack.pop_back();
+      continue;
+    }
+    uint16_t index;
+    // Children are linked in index order, as Edge_Iterator expects.
+    if (!reader.Read(&index) || index <= frame.last_index ||
+        index >= frame.node->edges_.size()) {
+      ok = false;
+      break;
+    }
+    frame.next->Reset(std::make_unique<Node>(frame.node, index));
+    Node* child = frame.next->get();
+    frame.next = &child->sibling_;
+    frame.last_index = index;
+    --frame.remaining;
+    ChessBoard board = frame.board;
+    board.ApplyMove(frame.node->edges_[index].GetMove());
+    board.Mirror();
+    if (!read_node(child, board, &num_children)) {
+      ok = false;
+    } else if (num_children > 0) {
+      stack.push_back({child, board, num_children, &child->child_, -1});
+    }
+  }
+  if (!ok || !reader.AtEnd()) {
+    TrimTreeAtHead();
+    return false;
+  }
+  if (current_head_->GetParent()) {
+    current_head_->GetOwnEdge()->ClearCertaintyState();
+  }
+  return true;
 }
 
 }  // namespace lczero
@@ -28,6 +28,8 @@
 #pragma once
 
 #include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <cmath>
 #include <iostream>
 #include <memory>
@@ -35,6 +37,7 @@
 #include "chess/board.h"
 #include "chess/callbacks.h"
 #include "chess/position.h"
+#include "mcts/arena.h"
 #include "neural/encoder.h"
 #include "neural/writer.h"
 #include "utils/mutex.h"
@@ -85,6 +88,8 @@ class Edge {
   // (but can be changed by adding Dirichlet noise). Must be in [0,1].
   float GetP() const;
   void SetP(float val);
+  // Returns what GetP() gives after SetP(@val).
+  static float RoundP(float val);
 
   void MakeTerminal(GameResult result);
 
@@ -190,21 +195,63 @@ class Edge {
     kClearKeepBounds = 0b00001100,
   };
   friend class EdgeList;
+  friend class NodeTree;
 };
 
-// Array of Edges.
+// Array of Edges, allocated from the NodeArena. The number of edges is stored
+// in a slot in front of the array, so that the list is a single pointer.
 class EdgeList {
  public:
   EdgeList() {}
-  EdgeList(MoveList moves);
-  Edge* get() const { return edges_.get(); }
+  EdgeList(const MoveList& moves) : EdgeList(moves.data(), moves.size()) {}
+  EdgeList(const Move* moves, size_t count);
+  EdgeList(EdgeList&& other) : edges_(other.edges_) { other.edges_ = nullptr; }
+  EdgeList& operator=(EdgeList&& other) {
+    std::swap(edges_, other.edges_);
+    return *this;
+  }
+  ~EdgeList();
+  Edge* get() const { return edges_; }
   Edge& operator[](size_t idx) const { return edges_[idx]; }
-  operator bool() const { return static_cast<bool>(edges_); }
-  uint16_t size() const { return size_; }
+  operator bool() const { return edges_ != nullptr; }
+  uint16_t size() const {
+    return edges_ ? *reinterpret_cast<const uint16_t*>(edges_ - 1) : 0;
+  }
+
+ private:
+  Edge* edges_ = nullptr;
+};
+
+// Owning pointer to the first child or the next sibling of a node. One thread
+// may spawn nodes into a list while others walk it without the spawn mutex
+// (see --lock-free-selection), so the link is set with release and read with
+// acquire semantics.
+class NodeLink {
+ public:
+  NodeLink() = default;
+  NodeLink(const NodeLink&) = delete;
+  NodeLink& operator=(const NodeLink&) = delete;
+  ~NodeLink();
+
+  Node* get() const { return ptr_.load(std::memory_order_acquire); }
+  Node* operator->() const { return get(); }
+  explicit operator bool() const { return get() != nullptr; }
+
+  // Points the link at @node, and frees what it owned before.
+  void Reset(std::unique_ptr<Node> node = nullptr);
+  // Empties the link and hands over what it owned.
+  std::unique_ptr<Node> Release();
+  // Puts @node in front of the node of the link: @node_next, the empty sibling
+  // link of @node, takes that over, then the link points at @node. Walkers see
+  // the list either before or after.
+  void InsertFront(std::unique_ptr<Node> node, NodeLink* node_next) {
+    node_next->ptr_.store(ptr_.load(std::memory_order_relaxed),
+                          std::memory_order_relaxed);
+    ptr_.store(node.release(), std::memory_order_release);
+  }
 
  private:
-  std::unique_ptr<Edge[]> edges_;
-  uint16_t size_ = 0;
+  std::atomic<Node*> ptr_{nullptr};
 };
 
 class EdgeAndNode;
@@ -219,18 +266,27 @@ class Node {
   // Takes pointer to a parent node and own index in a parent.
   Node(Node* parent, uint16_t index) : parent_(parent), index_(index) {}
 
+  // Nodes are allocated from the NodeArena.
+  static void* operator new(size_t size) { return NodeArena::Allocate(size); }
+  static void operator delete(void* ptr, size_t size) {
+    NodeArena::Free(ptr, size);
+  }
+
   // Allocates a new edge and a new node. The node has to be no edges before
   // that.
   Node* CreateSingleChildNode(Move m);
 
   // Creates edges from a movelist. There has to be no edges before that.
   void CreateEdges(const MoveList& moves);
+  void CreateEdges(const FixedMoveList& moves);
 
   // Gets parent node.
   Node* GetParent() const { return parent_; }
 
   // Returns whether a node has children.
   bool HasChildren() const { return edges_; }
+  // Returns whether any child was spawned as a node.
+  bool HasChildNodes() const { return static_cast<bool>(child_); }
 
   // Recalculate n_ from real children visits.
   // This is needed if a node was proved to be certain in a prior
@@ -239,15 +295,20 @@ class Node {
 
   // Returns sum of policy priors which have had at least one playout.
   float GetVisitedPolicy() const;
-  uint32_t GetN() const { return n_; }
-  uint32_t GetNInFlight() const { return n_in_flight_; }
-  uint32_t GetChildrenVisits() const { return n_ > 0 ? n_ - 1 : 0; }
+  uint32_t GetN() const { return n_.load(std::memory_order_relaxed); }
+  uint32_t GetNInFlight() const {
+    return n_in_flight_.load(std::memory_order_relaxed);
+  }
+  uint32_t GetChildrenVisits() const {
+    const uint32_t n = GetN();
+    return n > 0 ? n - 1 : 0;
+  }
   // Returns n = n_if_flight.
-  int GetNStarted() const { return n_ + n_in_flight_; }
+  int GetNStarted() const { return GetN() + GetNInFlight(); }
   // Returns node eval, i.e. average subtree V for non-certain node and -1/0/1
   // for certain nodes.
   float GetQ() const;
-  float GetD() const { return d_; }
+  float GetD() const { return d_.load(std::memory_order_relaxed); }
 
   // Returns whether the node is known to be draw/lose/win.
   bool IsTerminal() const {
@@ -329,18 +390,41 @@ class Node {
   // When search decides to treat one visit as several (in case of collisions
   // or visiting terminal nodes several times), it amplifies the visit by
   // incrementing n_in_flight.
-  void IncrementNInFlight(int multivisit) { n_in_flight_ += multivisit; }
+  void IncrementNInFlight(int multivisit) {
+    n_in_flight_.fetch_add(multivisit, std::memory_order_acq_rel);
+  }
 
   // Updates max depth, if new depth is larger.
   void UpdateMaxDepth(int depth);
 
+  // Whether the node was evaluated by the small network and is yet to be
+  // evaluated by the main one.
+  bool IsSmallNetworkEval() const {
+    return small_network_eval_.load(std::memory_order_relaxed);
+  }
+  void SetSmallNetworkEval() {
+    small_network_eval_.store(true, std::memory_order_relaxed);
+  }
+  // Clears the flag. Returns whether it was set, so that only one thread
+  // re-evaluates the node.
+  bool TakeSmallNetworkEval() {
+    return small_network_eval_.exchange(false, std::memory_order_relaxed);
+  }
+  // Replaces P of the edges with @priors, in the order of the edges, and
+  // recomputes the visited policy.
+  void ReplacePriors(const float* priors);
+
   // Caches the best child if possible.
   void UpdateBestChild(const Iterator& best_edge, int collisions_allowed);
 
   // Gets a cached best child if it is still valid.
   Node* GetCachedBestChild() {
-    if (n_in_flight_ < best_child_cache_in_flight_limit_) {
-      return best_child_cached_;
+    // The child is published after its limit, loading it first pairs them.
+    Node* best_child = best_child_cached_.load(std::memory_order_acquire);
+    if (best_child &&
+        GetNInFlight() <
+            best_child_cache_in_flight_limit_.load(std::memory_order_relaxed)) {
+      return best_child;
     }
     return nullptr;
   }
@@ -348,7 +432,8 @@ class Node {
   // Gets how many more visits the cached value is valid for. Only valid if
   // GetCachedBestChild returns a value.
   int GetRemainingCacheVisits() {
-    return best_child_cache_in_flight_limit_ - n_in_flight_;
+    return best_child_cache_in_flight_limit_.load(std::memory_order_relaxed) -
+           GetNInFlight();
   }
 
   V4TrainingData GetV4TrainingData(GameResult result,
@@ -368,9 +453,18 @@ class Node {
   // Deletes all children.
   void ReleaseChildren();
 
+  // Deletes all children but keeps the edges and own statistics, as if the
+  // subtree had been searched without keeping it. Nothing may be in flight
+  // below the node.
+  void CollapseChildren();
+
   // Deletes all children except one.
   void ReleaseChildrenExceptOne(Node* node);
 
+  // Deletes all children except those listed, which keep their order. Own
+  // statistics stay as they were.
+  void ReleaseChildrenExcept(const std::vector<Node*>& nodes_to_save);
+
   // For a child node, returns corresponding edge.
   Edge* GetEdgeToNode(const Node* node) const;
 
@@ -388,53 +482,66 @@ class Node {
     index_ = index;
   }
 
-  // To minimize the number of padding bytes and to avoid having unnecessary
-  // padding when new fields are added, we arrange the fields by size, largest
-  // to smallest.
+  // Drops the cached best child. Readers don't hold a lock, hence the release
+  // store.
+  void InvalidateBestChild() {
+    best_child_cached_.store(nullptr, std::memory_order_release);
+  }
 
-  // TODO: shrink the padding on this somehow? It takes 16 bytes even though
-  // only 10 are real! Maybe even merge it into this class??
-  EdgeList edges_;
+  // Resets the node into the freshly constructed state, keeping its parent,
+  // index and siblings. Children are sent to the garbage collector.
+  void Trim();
 
-  // 8 byte fields.
-  // Pointer to a parent node. nullptr for the root of tree,
-  // Note: root of tree might not be search->root_node_.
-  Node* parent_ = nullptr;
-  // Pointer to a first child. nullptr for a leaf node.
-  std::unique_ptr<Node> child_;
-  // Pointer to a next sibling. nullptr if there are no further siblings.
-  std::unique_ptr<Node> sibling_;
-  // Cached pointer to best child, valid while n_in_flight <
-  // best_child_cache_in_flight_limit_
-  Node* best_child_cached_ = nullptr;
+  // The statistics which are read when the parent scores its children come
+  // first, so that they share a cache line. Other fields are arranged by size,
+  // largest to smallest, to minimize the number of padding bytes.
 
   // 4 byte fields.
+  // How many completed visits this node had.
+  std::atomic<uint32_t> n_{0};
+  // (AKA virtual loss.) How many threads currently process this node (started
+  // but not finished). This value is added to n during selection which node
+  // to pick in MCTS, and also when selecting the best move.
+  std::atomic<uint32_t> n_in_flight_{0};
   // Average value (from value head of neural network) of all visited nodes in
   // subtree. For terminal nodes, eval is stored. This is from the perspective
   // of the player who "just" moved to reach this position, rather than from the
   // perspective of the player-to-move for the position.
-  float q_ = 0.0f;
+  // Statistics are atomic so that selection may read them and book virtual
+  // loss while other threads do the same (see --lock-free-selection).
+  std::atomic<float> q_{0.0f};
   // Averaged draw probability. Works similarly to Q, except that D is not
   // flipped depending on the side to move.
-  float d_ = 0.0f;
+  std::atomic<float> d_{0.0f};
   // Sum of policy priors which have had at least one playout.
   float visited_policy_ = 0.0f;
-  // How many completed visits this node had.
-  uint32_t n_ = 0;
-  // (AKA virtual loss.) How many threads currently process this node (started
-  // but not finished). This value is added to n during selection which node
-  // to pick in MCTS, and also when selecting the best move.
-  uint32_t n_in_flight_ = 0;
   // If best_child_cached_ is non-null, and n_in_flight_ < this,
   // best_child_cached_ is still the best child.
-  uint32_t best_child_cache_in_flight_limit_ = 0;
+  std::atomic<uint32_t> best_child_cache_in_flight_limit_{0};
+
+  // 8 byte fields.
+  EdgeList edges_;
+  // Pointer to a parent node. nullptr for the root of tree,
+  // Note: root of tree might not be search->root_node_.
+  Node* parent_ = nullptr;
+  // Pointer to a first child. nullptr for a leaf node.
+  NodeLink child_;
+  // Pointer to a next sibling. nullptr if there are no further siblings.
+  NodeLink sibling_;
+  // Cached pointer to best child, valid while n_in_flight <
+  // best_child_cache_in_flight_limit_
+  std::atomic<Node*> best_child_cached_{nullptr};
 
   // 2 byte fields.
   // Index of this node in parent's edge list.
   uint16_t index_;
 
+  // 1 byte fields.
+  std::atomic<bool> small_network_eval_{false};
+
   // TODO(mooskagh) Unfriend NodeTree.
   friend class NodeTree;
+  friend class NodeGarbageCollector;
   friend class Edge_Iterator<true>;
   friend class Edge_Iterator<false>;
   friend class Node_Iterator;
@@ -451,11 +558,22 @@ class Node {
 
 // A basic sanity check. This must be adjusted when Node members are adjusted.
 #if defined(__i386__) || (defined(__arm__) && !defined(__aarch64__))
-static_assert(sizeof(Node) == 52, "Unexpected size of Node for 32bit compile");
+static_assert(sizeof(Node) == 48, "Unexpected size of Node for 32bit compile");
 #else
-static_assert(sizeof(Node) == 80, "Unexpected size of Node");
+static_assert(sizeof(Node) == 72, "Unexpected size of Node");
 #endif
 
+inline NodeLink::~NodeLink() { delete ptr_.load(std::memory_order_relaxed); }
+
+inline void NodeLink::Reset(std::unique_ptr<Node> node) {
+  delete ptr_.exchange(node.release(), std::memory_order_acq_rel);
+}
+
+inline std::unique_ptr<Node> NodeLink::Release() {
+  return std::unique_ptr<Node>(
+      ptr_.exchange(nullptr, std::memory_order_acq_rel));
+}
+
 // Contains Edge and Node pair and set of proxy functions to simplify access
 // to them.
 class EdgeAndNode {
@@ -557,8 +675,7 @@ class EdgeAndNode {
 template <bool is_const>
 class Edge_Iterator : public EdgeAndNode {
  public:
-  using Ptr = std::conditional_t<is_const, const std::unique_ptr<Node>*,
-                                 std::unique_ptr<Node>*>;
+  using Ptr = std::conditional_t<is_const, const NodeLink*, NodeLink*>;
 
   // Creates "end()" iterator.
   Edge_Iterator() {}
@@ -599,23 +716,26 @@ class Edge_Iterator : public EdgeAndNode {
     // idx 5. Here is how it looks like:
     //    node_ptr_ -> &Node(idx_.3).sibling_  ->  Node(idx_.7)
     // Here is how we do that:
-    // 1. Store pointer to a node idx_.7:
-    //    node_ptr_ -> &Node(idx_.3).sibling_  ->  nullptr
-    //    tmp -> Node(idx_.7)
-    std::unique_ptr<Node> tmp = std::move(*node_ptr_);
-    // 2. Create fresh Node(idx_.5):
-    //    node_ptr_ -> &Node(idx_.3).sibling_  ->  Node(idx_.5)
-    //    tmp -> Node(idx_.7)
+    // 1. Create fresh Node(idx_.5), so that the list is cut for as short time
+    //    as possible:
+    //    fresh -> Node(idx_.5)
+    std::unique_ptr<Node> fresh;
     if (node_source && *node_source) {
       (*node_source)->Reinit(parent, current_idx_);
-      *node_ptr_ = std::move(*node_source);
+      fresh = std::move(*node_source);
     } else {
-      *node_ptr_ = std::make_unique<Node>(parent, current_idx_);
+      fresh = std::make_unique<Node>(parent, current_idx_);
     }
-    // 3. Attach stored pointer back to a list:
+    // 2. Attach a node idx_.7 to the fresh node, still leaving it in the list
+    //    for the threads walking it:
+    //    node_ptr_ -> &Node(idx_.3).sibling_  ->  Node(idx_.7)
+    //    fresh -> Node(idx_.5).sibling_ -> Node(idx_.7)
+    // 3. Publish fresh node in the list, which hands Node(idx_.7) over to it:
     //    node_ptr_ ->
     //         &Node(idx_.3).sibling_ -> Node(idx_.5).sibling_ -> Node(idx_.7)
-    (*node_ptr_)->sibling_ = std::move(tmp);
+    // InsertFront() does both.
+    NodeLink* fresh_sibling = &fresh->sibling_;
+    node_ptr_->InsertFront(std::move(fresh), fresh_sibling);
     // 4. Actualize:
     //    node_ -> &Node(idx_.5)
     //    node_ptr_ -> &Node(idx_.5).sibling_ -> Node(idx_.7)
@@ -629,13 +749,15 @@ class Edge_Iterator : public EdgeAndNode {
     // This is needed (and has to be 'while' rather than 'if') as other threads
     // could spawn new nodes between &node_ptr_ and *node_ptr_ while we didn't
     // see.
-    while (*node_ptr_ && (*node_ptr_)->index_ < current_idx_) {
-      node_ptr_ = &(*node_ptr_)->sibling_;
+    Node* next = node_ptr_->get();
+    while (next && next->index_ < current_idx_) {
+      node_ptr_ = &next->sibling_;
+      next = node_ptr_->get();
     }
     // If in the end node_ptr_ points to the node that we need, populate node_
     // and advance node_ptr_.
-    if (*node_ptr_ && (*node_ptr_)->index_ == current_idx_) {
-      node_ = (*node_ptr_).get();
+    if (next && next->index_ == current_idx_) {
+      node_ = next;
       node_ptr_ = &node_->sibling_;
     } else {
       node_ = nullptr;
@@ -673,6 +795,14 @@ class Node::NodeRange {
   friend class Node;
 };
 
+// Returns the number of released nodes the garbage collector has yet to
+// free, as estimated from their visits.
+uint64_t GetGcBacklog();
+
+// Waits until the garbage collector freed everything released so far, for
+// up to @timeout. Returns whether it did.
+bool WaitForGc(std::chrono::milliseconds timeout);
+
 class NodeTree {
  public:
   ~NodeTree() { DeallocateTree(); }
@@ -695,14 +825,59 @@ class NodeTree {
   Node* GetCurrentHead() const { return current_head_; }
   Node* GetGameBeginNode() const { return gamebegin_node_.get(); }
   const PositionHistory& GetPositionHistory() const { return history_; }
+  // Arena account of the nodes of the tree, which searches of it charge their
+  // allocations to, and the nodes released from it until freed.
+  NodeArena::Account* GetMemoryAccount() const { return memory_.get(); }
+
+  // Writes the position and the subtree of the current head to a file, for
+  // LoadTree() to resume the analysis later. The file is written by a
+  // background thread while the tree is walked, and replaced only once
+  // complete. The tree must not be searched meanwhile. @weights_hash
+  // identifies the network the statistics are from. Returns the number of
+  // nodes written, throws exception on failure.
+  uint64_t SaveTree(const std::string& filename, uint64_t weights_hash) const;
+  // Resets the tree to the position of a file written by SaveTree() and
+  // restores the subtree of its head. Returns false, leaving the head empty,
+  // if the file cannot be read, is malformed, has moves which are not legal
+  // in their positions or is for different weights.
+  bool LoadTree(const std::string& filename, uint64_t weights_hash);
+  // Starting FEN and moves of the current head, as last set.
+  const std::string& GetStartingFen() const { return starting_fen_; }
+  const std::vector<Move>& GetMoves() const { return moves_; }
+  // Makes MakeMove() keep up to @count of the most visited subtrees off the
+  // line to the head, with no more than @max_visits visits together, instead
+  // of releasing them; so that ResetToPosition() to an earlier position or to
+  // another line, as for a takeback, reuses their statistics. With 0, as by
+  // default, only the subtree of the move played is kept.
+  void SetSiblingRetention(int count, uint64_t max_visits) {
+    retain_siblings_ = count;
+    retain_siblings_visits_ = max_visits;
+  }
 
  private:
   void DeallocateTree();
+  // Releases the children of the head but @new_head, and the subtrees kept
+  // from earlier moves, except the most visited ones within the retention
+  // limits.
+  void ReleaseSiblingsRetaining(Node* new_head);
   // A node which to start search from.
   Node* current_head_ = nullptr;
   // Root node of a game tree.
   std::unique_ptr<Node> gamebegin_node_;
   PositionHistory history_;
+  // Moves from the starting position to current_head_, as passed in, so that
+  // a ResetToPosition() which extends them only plays the new ones.
+  std::vector<Move> moves_;
+  // Last starting FEN and what it parsed to.
+  std::string starting_fen_;
+  ChessBoard starting_board_;
+  int starting_no_capture_ply_ = 0;
+  int starting_full_moves_ = 0;
+  // Limits of SetSiblingRetention().
+  int retain_siblings_ = 0;
+  uint64_t retain_siblings_visits_ = 0;
+  const std::shared_ptr<NodeArena::Account> memory_ =
+      std::make_shared<NodeArena::Account>();
 };
 
 }  // namespace lczero
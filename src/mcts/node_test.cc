@@ -0,0 +1,240 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2019 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+
+  If you modify this Program, or any covered work, by linking or
+  combining it with NVIDIA Corporation's libraries from the NVIDIA CUDA
+  Toolkit and the NVIDIA CUDA Deep Neural Network library (or a
+  modified version of those libraries), containing parts covered by the
+  terms of the respective license agreement, the licensors of this
+  Program grant you additional permission to convey the resulting work.
+*/
+
+#include "mcts/node.h"
+
+#include <gtest/gtest.h>
+
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+
+namespace lczero {
+
+TEST(NodeTree, ExtendingMovesKeepsTree) {
+  NodeTree tree;
+  EXPECT_FALSE(
+      tree.ResetToPosition(ChessBoard::kStartposFen, {"e2e4", "e7e5"}));
+  Node* head = tree.GetCurrentHead();
+  EXPECT_TRUE(tree.ResetToPosition(ChessBoard::kStartposFen,
+                                   {"e2e4", "e7e5", "g1f3"}));
+  EXPECT_EQ(head, tree.GetCurrentHead()->GetParent());
+  EXPECT_EQ(3, tree.GetPlyCount());
+  EXPECT_EQ(4, tree.GetPositionHistory().GetLength());
+
+  NodeTree replayed;
+  replayed.ResetToPosition(ChessBoard::kStartposFen, {"e2e4", "e7e5", "g1f3"});
+  EXPECT_EQ(replayed.HeadPosition().GetBoard(), tree.HeadPosition().GetBoard());
+  EXPECT_EQ(replayed.HeadPosition().Hash(), tree.HeadPosition().Hash());
+}
+
+TEST(NodeTree, ExtendsAfterMakeMove) {
+  NodeTree tree;
+  tree.ResetToPosition(ChessBoard::kStartposFen, {"e2e4"});
+  tree.MakeMove("e7e5");
+  Node* head = tree.GetCurrentHead();
+  EXPECT_TRUE(tree.ResetToPosition(ChessBoard::kStartposFen,
+                                   {"e2e4", "e7e5", "g1f3"}));
+  EXPECT_EQ(head, tree.GetCurrentHead()->GetParent());
+  EXPECT_EQ(3, tree.GetPlyCount());
+}
+
+TEST(NodeTree, ReplaysShorterMoves) {
+  NodeTree tree;
+  tree.ResetToPosition(ChessBoard::kStartposFen, {"e2e4", "e7e5"});
+  // Going back is not the same game.
+  EXPECT_FALSE(tree.ResetToPosition(ChessBoard::kStartposFen, {"e2e4"}));
+  EXPECT_EQ(1, tree.GetPlyCount());
+  EXPECT_EQ(2, tree.GetPositionHistory().GetLength());
+  EXPECT_TRUE(
+      tree.ResetToPosition(ChessBoard::kStartposFen, {"e2e4", "e7e5"}));
+  EXPECT_EQ(3, tree.GetPositionHistory().GetLength());
+
+  // Another starting position throws the tree away.
+  const std::string fen = "4k3/8/8/8/8/8/8/4K2R w K - 0 1";
+  EXPECT_FALSE(tree.ResetToPosition(fen, {"e1g1"}));
+  EXPECT_EQ(2, tree.GetPositionHistory().GetLength());
+  EXPECT_TRUE(tree.ResetToPosition(fen, {"e1g1", "e8d8"}));
+}
+
+namespace {
+void Visit(Node* node, float v, int visits) {
+  node->IncrementNInFlight(visits);
+  node->FinalizeScoreUpdate(v, 0.25f, visits);
+}
+}  // namespace
+
+TEST(NodeTree, SavesAndLoadsTree) {
+  const std::string filename = testing::TempDir() + "node_test_tree.bin";
+  NodeTree tree;
+  tree.ResetToPosition(ChessBoard::kStartposFen, {"e2e4", "e7e5"});
+  Node* head = tree.GetCurrentHead();
+  head->CreateEdges(tree.HeadPosition().GetBoard().GenerateLegalMoves());
+  Visit(head, 0.1f, 4);
+  int spawned = 0;
+  for (auto edge : head->Edges()) {
+    edge.edge()->SetP(0.5f / (spawned + 1));
+    if (spawned++ % 3 != 1) continue;
+    Node* child = edge.GetOrSpawnNode(head);
+    Visit(child, -0.3f, spawned);
+  }
+  head->Edges().edge()->MakeTerminal(GameResult::DRAW);
+  const uint64_t nodes = tree.SaveTree(filename, 42);
+
+  NodeTree loaded;
+  EXPECT_FALSE(loaded.LoadTree(filename, 43));
+  ASSERT_TRUE(loaded.LoadTree(filename, 42));
+  std::remove(filename.c_str());
+  EXPECT_EQ(tree.GetMoves(), loaded.GetMoves());
+  EXPECT_EQ(tree.HeadPosition().Hash(), loaded.HeadPosition().Hash());
+  const Node* loaded_head = loaded.GetCurrentHead();
+  EXPECT_EQ(head->GetN(), loaded_head->GetN());
+  EXPECT_EQ(head->GetQ(), loaded_head->GetQ());
+  EXPECT_EQ(head->GetD(), loaded_head->GetD());
+  EXPECT_EQ(head->GetVisitedPolicy(), loaded_head->GetVisitedPolicy());
+  ASSERT_EQ(head->GetNumEdges(), loaded_head->GetNumEdges());
+  uint64_t loaded_nodes = 1;
+  auto loaded_edge = loaded_head->Edges();
+  for (auto edge : head->Edges()) {
+    EXPECT_EQ(edge.GetMove(), loaded_edge.GetMove());
+    EXPECT_EQ(edge.GetP(), loaded_edge.GetP());
+    EXPECT_EQ(edge.edge()->GetCertaintyState(),
+              loaded_edge.edge()->GetCertaintyState());
+    EXPECT_EQ(edge.HasNode(), loaded_edge.HasNode());
+    EXPECT_EQ(edge.GetN(), loaded_edge.GetN());
+    EXPECT_EQ(edge.GetQ(0.0f), loaded_edge.GetQ(0.0f));
+    if (loaded_edge.HasNode()) ++loaded_nodes;
+    ++loaded_edge;
+  }
+  EXPECT_EQ(nodes, loaded_nodes);
+}
+
+TEST(NodeTree, RetainsMostVisitedSiblings) {
+  NodeTree tree;
+  tree.SetSiblingRetention(1, 100);
+  tree.ResetToPosition(ChessBoard::kStartposFen, {});
+  Node* head = tree.GetCurrentHead();
+  head->CreateEdges(tree.HeadPosition().GetBoard().GenerateLegalMoves());
+  Visit(head, 0.1f, 10);
+  Node* retained = nullptr;
+  for (auto edge : head->Edges()) {
+    const std::string move = edge.GetMove().as_string();
+    if (move == "e2e4") Visit(edge.GetOrSpawnNode(head), -0.1f, 5);
+    if (move == "d2d4") {
+      retained = edge.GetOrSpawnNode(head);
+      Visit(retained, -0.2f, 3);
+    }
+    if (move == "c2c4") Visit(edge.GetOrSpawnNode(head), -0.3f, 1);
+  }
+  ASSERT_NE(nullptr, retained);
+
+  tree.ResetToPosition(ChessBoard::kStartposFen, {"e2e4"});
+  // The head and the most visited of its siblings are left.
+  int children = 0;
+  for (Node* child : head->ChildNodes()) {
+    EXPECT_TRUE(child == tree.GetCurrentHead() || child == retained);
+    ++children;
+  }
+  EXPECT_EQ(2, children);
+
+  // A takeback keeps both, and another line reuses the retained subtree.
+  const uint32_t played_visits = tree.GetCurrentHead()->GetN();
+  tree.ResetToPosition(ChessBoard::kStartposFen, {});
+  EXPECT_EQ(head, tree.GetCurrentHead());
+  EXPECT_EQ(1 + played_visits + retained->GetN(), head->GetN());
+  tree.ResetToPosition(ChessBoard::kStartposFen, {"d2d4"});
+  EXPECT_EQ(retained, tree.GetCurrentHead());
+
+  // Subtrees beyond the visits budget are released.
+  tree.SetSiblingRetention(1, 0);
+  tree.ResetToPosition(ChessBoard::kStartposFen, {"e2e4"});
+  children = 0;
+  for (Node* child : head->ChildNodes()) {
+    EXPECT_EQ(tree.GetCurrentHead(), child);
+    ++children;
+  }
+  EXPECT_EQ(1, children);
+}
+
+TEST(NodeTree, RejectsTruncatedTree) {
+  const std::string filename = testing::TempDir() + "node_test_truncated.bin";
+  NodeTree tree;
+  tree.ResetToPosition(ChessBoard::kStartposFen, {});
+  Node* head = tree.GetCurrentHead();
+  head->CreateEdges(tree.HeadPosition().GetBoard().GenerateLegalMoves());
+  Visit(head, 0.0f, 1);
+  tree.SaveTree(filename, 0);
+  {
+    std::string data;
+    {
+      std::ifstream in(filename, std::ios::binary);
+      data.assign(std::istreambuf_iterator<char>(in), {});
+    }
+    std::ofstream(filename, std::ios::binary | std::ios::trunc)
+        .write(data.data(), data.size() - 1);
+  }
+  NodeTree loaded;
+  EXPECT_FALSE(loaded.LoadTree(filename, 0));
+  std::remove(filename.c_str());
+  EXPECT_EQ(0u, loaded.GetCurrentHead()->GetN());
+  EXPECT_FALSE(loaded.GetCurrentHead()->HasChildren());
+}
+
+TEST(NodeTree, RejectsIllegalEdges) {
+  const std::string filename = testing::TempDir() + "node_test_illegal.bin";
+  NodeTree tree;
+  tree.ResetToPosition(ChessBoard::kStartposFen, {});
+  ChessBoard other;
+  other.SetFromFen("7k/8/8/8/8/8/8/K7 w - - 0 1");
+  // King moves, which the rook and pawns in the corner block.
+  tree.GetCurrentHead()->CreateEdges(other.GenerateLegalMoves());
+  tree.SaveTree(filename, 0);
+  NodeTree loaded;
+  EXPECT_FALSE(loaded.LoadTree(filename, 0));
+  std::remove(filename.c_str());
+  EXPECT_FALSE(loaded.GetCurrentHead()->HasChildren());
+}
+
+TEST(NodeTree, CountsOwnMemory) {
+  NodeTree tree;
+  tree.ResetToPosition(ChessBoard::kStartposFen, {});
+  const NodeArena::Account* memory = tree.GetMemoryAccount();
+  const int64_t root_bytes = memory->GetBytes();
+  EXPECT_GT(root_bytes, 0);
+  NodeTree other;
+  other.ResetToPosition(ChessBoard::kStartposFen, {"e2e4", "e7e5"});
+  EXPECT_EQ(root_bytes, memory->GetBytes());
+  tree.MakeMove("e2e4");
+  EXPECT_GT(memory->GetBytes(), root_bytes);
+  // The old tree is released to the garbage collector.
+  tree.ResetToPosition("7k/8/8/8/8/8/8/K7 w - - 0 1", {});
+  EXPECT_TRUE(WaitForGc(std::chrono::seconds(10)));
+  EXPECT_FALSE(memory->HasPendingFrees());
+  EXPECT_EQ(root_bytes, memory->GetBytes());
+}
+
+}  // namespace lczero
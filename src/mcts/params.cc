@@ -157,16 +157,23 @@ const OptionId SearchParams::kMaxCollisionEventsId{
 const OptionId SearchParams::kOutOfOrderEvalId{
     "out-of-order-eval", "OutOfOrderEval",
     "During the gathering of a batch for NN to eval, if position happens to be "
-    "in the cache or is terminal, evaluate it right away without sending the "
-    "batch to the NN. When off, this may only happen with the very first node "
-    "of a batch; when on, this can happen with any node."};
+    "in the cache, evaluate it right away without sending the batch to the NN. "
+    "When off, this may only happen with the very first node of a batch; when "
+    "on, this can happen with any node. Terminal and tablebase leaves are "
+    "always backed up before the NN eval, without taking batch slots."};
 const OptionId SearchParams::kMaxOutOfOrderEvalsId{
     "max-out-of-order-evals", "MaxOutOfOrderEvals",
-    "Maximum number of out of order evals during gathering of a batch."};
+    "Maximum number of out of order evals during gathering of a batch. "
+    "Terminal and tablebase leaves don't count."};
 const OptionId SearchParams::kSyzygyFastPlayId{
     "syzygy-fast-play", "SyzygyFastPlay",
     "With DTZ tablebase files, only allow the network pick from winning moves "
     "that have shortest DTZ to play faster (but not necessarily optimally)."};
+const OptionId SearchParams::kSyzygyAsyncProbeId{
+    "syzygy-async-probe", "SyzygyAsyncProbe",
+    "Don't wait for tablebase reads in search. Positions not probed before "
+    "are then probed on a background thread and evaluated by the network in "
+    "the meantime, later visits of them use the tablebase result."};
 const OptionId SearchParams::kMultiPvId{
     "multipv", "MultiPV",
     "Number of game play lines (principal variations) to show in UCI info "
@@ -197,6 +204,87 @@ const OptionId SearchParams::kTwoFoldDrawScoringId{
     "two-fold-draw-scoring", "TwoFoldDrawScoring",
     "Scores two-folds as draws (0.00) in search to use visits more "
     "efficiently. Recommended in conjunction with certainty propagation."};
+const OptionId SearchParams::kLockFreeSelectionId{
+    "lock-free-selection", "LockFreeSelection",
+    "Let search threads pick nodes concurrently, booking virtual loss on "
+    "atomic node counters, instead of serializing them on the tree lock. Only "
+    "spawning of new nodes and backups remain synchronized."};
+const OptionId SearchParams::kMultiLeafPickingId{
+    "multi-leaf-picking", "MultiLeafPicking",
+    "Pick the leaves of a minibatch in one descent from the root, splitting "
+    "the visits among the children by their PUCT scores, instead of one "
+    "descent per leaf. Visits booked on a node being extended by another "
+    "thread count as collisions."};
+const OptionId SearchParams::kTranspositionsId{
+    "transpositions", "Transpositions",
+    "When a new node turns out to be a transposition of a position already "
+    "visited in the search (same board, repetition count and 50-move "
+    "counter), back up the averaged value of that position's subtree rather "
+    "than the bare network eval."};
+const OptionId SearchParams::kPipelinedMinibatchesId{
+    "pipelined-minibatches", "PipelinedMinibatches",
+    "Number of minibatches each search thread keeps in flight. With more than "
+    "one, the thread gathers the next batch while the backend still computes "
+    "the previous one."};
+const OptionId SearchParams::kBatchedBackupId{
+    "batched-backup", "BatchedBackup",
+    "Merge the backup paths of a whole minibatch so that every shared "
+    "ancestor is updated once per batch, and walk the paths under a shared "
+    "lock. Paths which may change certainty bounds are still backed up one "
+    "by one."};
+const OptionId SearchParams::kPrefetchThreadsId{
+    "prefetch-threads", "PrefetchThreads",
+    "Number of threads encoding prefetched positions. With more than one, the "
+    "search thread first collects the speculative leaves and then encodes "
+    "them together with helper threads."};
+const OptionId SearchParams::kCacheOpeningPliesId{
+    "cache-opening-plies", "CacheOpeningPlies",
+    "NN evaluations of positions within that many plies from the start of "
+    "the game are never evicted from the NN cache (up to a quarter of it), so "
+    "that openings played again and again stay evaluated."};
+
+const OptionId SearchParams::kDeterministicId{
+    "deterministic", "Deterministic",
+    "Run the iterations of the search threads one at a time, so that with a "
+    "deterministic backend (such as random) and a node limit every search of "
+    "a position builds the same tree. Temperature and noise still pick moves "
+    "at random. Meant for benchmarking CPU side changes. Minibatches aren't "
+    "pipelined then."};
+const OptionId SearchParams::kDevicePolicyId{
+    "device-policy", "DevicePolicy",
+    "Have backends which support it (cudnn, multigpu, random) pick the "
+    "priors of the legal moves and apply the policy softmax temperature on "
+    "the device, so that only those priors are copied back instead of the "
+    "whole policy."};
+const OptionId SearchParams::kSmallNetworkVisitsId{
+    "small-network-visits", "SmallNetworkVisits",
+    "With SmallWeightsFile, a node evaluated by the small network is "
+    "evaluated again by the main one once it has that many visits. Its priors "
+    "are replaced, and the new value counts as one more visit."};
+const OptionId SearchParams::kSmallNetworkPriorId{
+    "small-network-prior", "SmallNetworkPrior",
+    "With SmallWeightsFile, leaves whose prior is below this are evaluated by "
+    "the small network, as are the prefetched positions. The small network "
+    "has its own entries in the NN cache."};
+const OptionId SearchParams::kBoardSnapshotIntervalId{
+    "board-snapshot-interval", "BoardSnapshotInterval",
+    "Every that many plies along the lines searched often, search threads "
+    "keep a copy of the positions leading there, so that going down those "
+    "lines doesn't replay the moves. 0 to always replay them."};
+const OptionId SearchParams::kBoardSnapshotMemoryId{
+    "board-snapshot-memory", "BoardSnapshotMemory",
+    "MiB each search thread may take for the copies of BoardSnapshotInterval. "
+    "They are dropped when that's reached."};
+const OptionId SearchParams::kWarmStartId{
+    "warm-start", "WarmStart",
+    "As soon as the root is evaluated, send all its unvisited children to the "
+    "NN in one batch, so that the first iterations find them in the cache "
+    "rather than colliding on the few children being expanded."};
+const OptionId SearchParams::kWarmStartGrandchildrenId{
+    "warm-start-grandchildren", "WarmStartGrandchildren",
+    "Number of unvisited grandchildren of the root, the most likely by "
+    "prior, which also go into the WarmStart batch. Only grandchildren of "
+    "children evaluated before, as in a reused tree, have priors."};
 
 void SearchParams::Populate(OptionsParser* options) {
   // Here the uci optimized defaults" are set.
@@ -232,6 +320,7 @@ void SearchParams::Populate(OptionsParser* options) {
   options->Add<BoolOption>(kOutOfOrderEvalId) = true;
   options->Add<IntOption>(kMaxOutOfOrderEvalsId, 1, 10000) = 512;
   options->Add<BoolOption>(kSyzygyFastPlayId) = true;
+  options->Add<BoolOption>(kSyzygyAsyncProbeId) = false;
   options->Add<IntOption>(kMultiPvId, 1, 500) = 1;
   std::vector<std::string> score_type = {"centipawn", "win_percentage", "Q"};
   options->Add<ChoiceOption>(kScoreTypeId, score_type) = "centipawn";
@@ -241,6 +330,21 @@ void SearchParams::Populate(OptionsParser* options) {
   options->Add<FloatOption>(kMinimumKLDGainPerNode, 0.0f, 1.0f) = 0.0f;
   options->Add<BoolOption>(kCertaintyPropagationId) = true;
   options->Add<BoolOption>(kTwoFoldDrawScoringId) = true;
+  options->Add<BoolOption>(kLockFreeSelectionId) = false;
+  options->Add<BoolOption>(kMultiLeafPickingId) = false;
+  options->Add<BoolOption>(kTranspositionsId) = false;
+  options->Add<IntOption>(kPipelinedMinibatchesId, 1, 8) = 1;
+  options->Add<BoolOption>(kBatchedBackupId) = false;
+  options->Add<IntOption>(kPrefetchThreadsId, 1, 32) = 1;
+  options->Add<IntOption>(kCacheOpeningPliesId, 0, 1000) = 0;
+  options->Add<BoolOption>(kDeterministicId) = false;
+  options->Add<BoolOption>(kDevicePolicyId) = false;
+  options->Add<IntOption>(kSmallNetworkVisitsId, 1, 1000000) = 8;
+  options->Add<FloatOption>(kSmallNetworkPriorId, 0.0f, 1.0f) = 0.02f;
+  options->Add<IntOption>(kBoardSnapshotIntervalId, 0, 100) = 0;
+  options->Add<IntOption>(kBoardSnapshotMemoryId, 1, 4096) = 16;
+  options->Add<BoolOption>(kWarmStartId) = false;
+  options->Add<IntOption>(kWarmStartGrandchildrenId, 0, 1024) = 0;
 
   options->HideOption(kLogLiveStatsId);
 }
@@ -274,9 +378,29 @@ SearchParams::SearchParams(const OptionsDict& options)
       kCertaintyPropagation(options.Get<bool>(kCertaintyPropagationId.GetId())),
       kTwoFoldDrawScoring(options.Get<bool>(kTwoFoldDrawScoringId.GetId())),
       kSyzygyFastPlay(options.Get<bool>(kSyzygyFastPlayId.GetId())),
+      kSyzygyAsyncProbe(options.Get<bool>(kSyzygyAsyncProbeId.GetId())),
       kHistoryFill(
           EncodeHistoryFill(options.Get<std::string>(kHistoryFillId.GetId()))),
-      kMiniBatchSize(options.Get<int>(kMiniBatchSizeId.GetId())) {
+      kMiniBatchSize(options.Get<int>(kMiniBatchSizeId.GetId())),
+      kLockFreeSelection(options.Get<bool>(kLockFreeSelectionId.GetId())),
+      kMultiLeafPicking(options.Get<bool>(kMultiLeafPickingId.GetId())),
+      kTranspositions(options.Get<bool>(kTranspositionsId.GetId())),
+      kPipelinedMinibatches(
+          options.Get<int>(kPipelinedMinibatchesId.GetId())),
+      kBatchedBackup(options.Get<bool>(kBatchedBackupId.GetId())),
+      kPrefetchThreads(options.Get<int>(kPrefetchThreadsId.GetId())),
+      kCacheOpeningPlies(options.Get<int>(kCacheOpeningPliesId.GetId())),
+      kDeterministic(options.Get<bool>(kDeterministicId.GetId())),
+      kSmallNetworkVisits(options.Get<int>(kSmallNetworkVisitsId.GetId())),
+      kSmallNetworkPrior(options.Get<float>(kSmallNetworkPriorId.GetId())),
+      kBoardSnapshotInterval(
+          options.Get<int>(kBoardSnapshotIntervalId.GetId())),
+      kBoardSnapshotMemory(
+          static_cast<size_t>(options.Get<int>(kBoardSnapshotMemoryId.GetId()))
+          << 20),
+      kWarmStart(options.Get<bool>(kWarmStartId.GetId())),
+      kWarmStartGrandchildren(
+          options.Get<int>(kWarmStartGrandchildrenId.GetId())) {
 }
 
 }  // namespace lczero
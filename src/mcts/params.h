@@ -88,6 +88,7 @@ class SearchParams {
   int GetMaxCollisionVisitsId() const { return kMaxCollisionVisits; }
   bool GetOutOfOrderEval() const { return kOutOfOrderEval; }
   bool GetSyzygyFastPlay() const { return kSyzygyFastPlay; }
+  bool GetSyzygyAsyncProbe() const { return kSyzygyAsyncProbe; }
   int GetMultiPv() const { return options_.Get<int>(kMultiPvId.GetId()); }
   std::string GetScoreType() const {
     return options_.Get<std::string>(kScoreTypeId.GetId());
@@ -102,7 +103,24 @@ class SearchParams {
     return options_.Get<float>(kMinimumKLDGainPerNode.GetId());
   }
   int GetMaxOutOfOrderEvals() const { return kMaxOutOfOrderEvals; }
-  
+  bool GetLockFreeSelection() const { return kLockFreeSelection; }
+  bool GetMultiLeafPicking() const { return kMultiLeafPicking; }
+  bool GetTranspositions() const { return kTranspositions; }
+  int GetPipelinedMinibatches() const { return kPipelinedMinibatches; }
+  bool GetBatchedBackup() const { return kBatchedBackup; }
+  int GetPrefetchThreads() const { return kPrefetchThreads; }
+  int GetCacheOpeningPlies() const { return kCacheOpeningPlies; }
+  bool GetDeterministic() const { return kDeterministic; }
+  int GetSmallNetworkVisits() const { return kSmallNetworkVisits; }
+  float GetSmallNetworkPrior() const { return kSmallNetworkPrior; }
+  int GetBoardSnapshotInterval() const { return kBoardSnapshotInterval; }
+  size_t GetBoardSnapshotMemory() const { return kBoardSnapshotMemory; }
+  bool GetWarmStart() const { return kWarmStart; }
+  int GetWarmStartGrandchildren() const { return kWarmStartGrandchildren; }
+  bool GetDevicePolicy() const {
+    return options_.Get<bool>(kDevicePolicyId.GetId());
+  }
+
   // Search parameter IDs.
   static const OptionId kMiniBatchSizeId;
   static const OptionId kMaxPrefetchBatchId;
@@ -131,6 +149,7 @@ class SearchParams {
   static const OptionId kMaxCollisionVisitsId;
   static const OptionId kOutOfOrderEvalId;
   static const OptionId kSyzygyFastPlayId;
+  static const OptionId kSyzygyAsyncProbeId;
   static const OptionId kMultiPvId;
   static const OptionId kScoreTypeId;
   static const OptionId kHistoryFillId;
@@ -139,6 +158,21 @@ class SearchParams {
   static const OptionId kMinimumKLDGainPerNode;
   static const OptionId kKLDGainAverageInterval;
   static const OptionId kMaxOutOfOrderEvalsId;
+  static const OptionId kLockFreeSelectionId;
+  static const OptionId kMultiLeafPickingId;
+  static const OptionId kTranspositionsId;
+  static const OptionId kPipelinedMinibatchesId;
+  static const OptionId kBatchedBackupId;
+  static const OptionId kPrefetchThreadsId;
+  static const OptionId kCacheOpeningPliesId;
+  static const OptionId kDeterministicId;
+  static const OptionId kDevicePolicyId;
+  static const OptionId kSmallNetworkVisitsId;
+  static const OptionId kSmallNetworkPriorId;
+  static const OptionId kBoardSnapshotIntervalId;
+  static const OptionId kBoardSnapshotMemoryId;
+  static const OptionId kWarmStartId;
+  static const OptionId kWarmStartGrandchildrenId;
 
  private:
   const OptionsDict& options_;
@@ -167,9 +201,24 @@ class SearchParams {
   const bool kCertaintyPropagation;
   const bool kTwoFoldDrawScoring;
   const bool kSyzygyFastPlay;
+  const bool kSyzygyAsyncProbe;
   const FillEmptyHistory kHistoryFill;
   const int kMiniBatchSize;
   const int kMaxOutOfOrderEvals;
+  const bool kLockFreeSelection;
+  const bool kMultiLeafPicking;
+  const bool kTranspositions;
+  const int kPipelinedMinibatches;
+  const bool kBatchedBackup;
+  const int kPrefetchThreads;
+  const int kCacheOpeningPlies;
+  const bool kDeterministic;
+  const int kSmallNetworkVisits;
+  const float kSmallNetworkPrior;
+  const int kBoardSnapshotInterval;
+  const size_t kBoardSnapshotMemory;
+  const bool kWarmStart;
+  const int kWarmStartGrandchildren;
 };
 
 }  // namespace lczero
@@ -0,0 +1,81 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2019 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+
+  If you modify this Program, or any covered work, by linking or
+  combining it with NVIDIA Corporation's libraries from the NVIDIA CUDA
+  Toolkit and the NVIDIA CUDA Deep Neural Network library (or a
+  modified version of those libraries), containing parts covered by the
+  terms of the respective license agreement, the licensors of this
+  Program grant you additional permission to convey the resulting work.
+*/
+
+#include "mcts/profile.h"
+
+#include <algorithm>
+#include <iomanip>
+#include <sstream>
+
+namespace lczero {
+namespace {
+const char* const kPhaseNames[] = {"gather", "prefetch", "compute", "fetch",
+                                   "backup", "idle",     "lock wait"};
+}  // namespace
+
+void SearchProfile::Add(Phase phase, Clock::time_point start) {
+  const double seconds =
+      std::chrono::duration<double>(Clock::now() - start).count();
+  stages_[phase].histogram.Add(seconds);
+  stages_[phase].total += seconds;
+}
+
+void SearchProfile::Merge(const SearchProfile& other) {
+  for (int i = 0; i < kPhaseCount; ++i) {
+    stages_[i].histogram.Merge(other.stages_[i].histogram);
+    stages_[i].total += other.stages_[i].total;
+  }
+}
+
+void SearchProfile::Clear() {
+  for (auto& stage : stages_) {
+    stage.histogram.Clear();
+    stage.total = 0.0;
+  }
+}
+
+std::vector<std::string> SearchProfile::GetStats() const {
+  double worker_time = 0.0;
+  for (int i = 0; i < kLockWait; ++i) worker_time += stages_[i].total;
+  std::vector<std::string> lines;
+  for (int i = 0; i < kPhaseCount; ++i) {
+    const Stage& stage = stages_[i];
+    const double count = stage.histogram.GetCount();
+    std::ostringstream oss;
+    oss << std::fixed << std::setprecision(1) << "Search " << kPhaseNames[i]
+        << ": " << static_cast<int64_t>(count) << " x "
+        << (count ? stage.total * 1e6 / count : 0.0) << "us (p50 "
+        << stage.histogram.GetQuantile(0.5) * 1e6 << "us, p99 "
+        << stage.histogram.GetQuantile(0.99) * 1e6 << "us), "
+        << stage.total * 100 / std::max(worker_time, 1e-9)
+        << "% of worker time";
+    lines.push_back(oss.str());
+  }
+  return lines;
+}
+
+}  // namespace lczero
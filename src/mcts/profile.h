@@ -0,0 +1,90 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2019 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+
+  If you modify this Program, or any covered work, by linking or
+  combining it with NVIDIA Corporation's libraries from the NVIDIA CUDA
+  Toolkit and the NVIDIA CUDA Deep Neural Network library (or a
+  modified version of those libraries), containing parts covered by the
+  terms of the respective license agreement, the licensors of this
+  Program grant you additional permission to convey the resulting work.
+*/
+
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "utils/histogram.h"
+
+namespace lczero {
+
+// Time spent by search workers in every phase of an iteration, and waiting
+// for the nodes mutex. Each worker fills its own and merges it into the
+// search's once per iteration, so the timers don't contend.
+class SearchProfile {
+ public:
+  using Clock = std::chrono::steady_clock;
+
+  enum Phase {
+    kGather,
+    kPrefetch,
+    kCompute,
+    kFetch,
+    kBackup,
+    // Waiting for other workers, with nothing to pick.
+    kIdle,
+    // Part of the phases above.
+    kLockWait,
+    kPhaseCount
+  };
+
+  // Adds the time from @start to now to @phase.
+  void Add(Phase phase, Clock::time_point start);
+  void Merge(const SearchProfile& other);
+  void Clear();
+
+  // One line per phase with its count, mean, quantiles and share of the
+  // worker time.
+  std::vector<std::string> GetStats() const;
+
+ private:
+  struct Stage {
+    // Seconds, 100ns to 100s.
+    Histogram histogram{-7, 2, 5};
+    double total = 0.0;
+  };
+  std::array<Stage, kPhaseCount> stages_;
+};
+
+// Adds the lifetime of the object to a phase of the profile.
+class ScopedPhaseTimer {
+ public:
+  ScopedPhaseTimer(SearchProfile* profile, SearchProfile::Phase phase)
+      : profile_(profile), phase_(phase), start_(SearchProfile::Clock::now()) {}
+  ~ScopedPhaseTimer() { profile_->Add(phase_, start_); }
+
+ private:
+  SearchProfile* const profile_;
+  const SearchProfile::Phase phase_;
+  const SearchProfile::Clock::time_point start_;
+};
+
+}  // namespace lczero
@@ -0,0 +1,174 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2019 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+
+  If you modify this Program, or any covered work, by linking or
+  combining it with NVIDIA Corporation's libraries from the NVIDIA CUDA
+  Toolkit and the NVIDIA CUDA Deep Neural Network library (or a
+  modified version of those libraries), containing parts covered by the
+  terms of the respective license agreement, the licensors of this
+  Program grant you additional permission to convey the resulting work.
+*/
+
+#include "mcts/puct.h"
+
+#include <cmath>
+#include <cstdint>
+#include <limits>
+
+#include "utils/cpu.h"
+#include "utils/fastmath.h"
+
+#if defined(LC0_CPU_DISPATCH)
+#include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+namespace lczero {
+namespace {
+
+#if defined(LC0_CPU_DISPATCH)
+LC0_TARGET_BEGIN("avx")
+// Scores the first multiple of 8 entries, returns how many.
+int ComputePuctScoresAvx(float numerator, const float* p,
+                         const float* n_started_plus_one, const float* q,
+                         float* scores, int count) {
+  int i = 0;
+  const __m256 num = _mm256_set1_ps(numerator);
+  for (; i + 8 <= count; i += 8) {
+    const __m256 u = _mm256_div_ps(_mm256_mul_ps(num, _mm256_loadu_ps(p + i)),
+                                   _mm256_loadu_ps(n_started_plus_one + i));
+    _mm256_storeu_ps(scores + i, _mm256_add_ps(u, _mm256_loadu_ps(q + i)));
+  }
+  return i;
+}
+LC0_TARGET_END
+
+LC0_TARGET_BEGIN("avx2")
+// Tempers the first multiple of 8 entries, returns how many.
+int TemperPriorsAvx2(float* p, int count, float temperature) {
+  int i = 0;
+  // FastLog2() and FastPow2() on 8 lanes, with the same operations.
+  const __m256 temp = _mm256_set1_ps(temperature);
+  const __m256 min_normal = _mm256_set1_ps(1.17549435E-38f);
+  const __m256 min_exponent = _mm256_set1_ps(-126.0f);
+  const __m256i mantissa_mask = _mm256_set1_epi32(0x7fffff);
+  const __m256i exponent_one = _mm256_set1_epi32(0x7f << 23);
+  for (; i + 8 <= count; i += 8) {
+    const __m256 x = _mm256_loadu_ps(p + i);
+    const __m256i bits = _mm256_castps_si256(x);
+    const __m256 expb = _mm256_cvtepi32_ps(_mm256_srli_epi32(bits, 23));
+    const __m256 m = _mm256_castsi256_ps(
+        _mm256_or_si256(_mm256_and_si256(bits, mantissa_mask), exponent_one));
+    const __m256 log2 = _mm256_add_ps(
+        _mm256_sub_ps(
+            _mm256_mul_ps(
+                m, _mm256_sub_ps(_mm256_set1_ps(2.028011f),
+                                 _mm256_mul_ps(_mm256_set1_ps(0.342671f), m))),
+            _mm256_set1_ps(128.68534f)),
+        expb);
+    const __m256 a = _mm256_div_ps(log2, temp);
+    const __m256 floor = _mm256_floor_ps(a);
+    const __m256 f = _mm256_sub_ps(a, floor);
+    const __m256 pow2 = _mm256_add_ps(
+        _mm256_set1_ps(1.0f),
+        _mm256_mul_ps(
+            f, _mm256_add_ps(_mm256_set1_ps(0.656366f),
+                             _mm256_mul_ps(_mm256_set1_ps(0.343634f), f))));
+    const __m256 result = _mm256_castsi256_ps(_mm256_add_epi32(
+        _mm256_castps_si256(pow2),
+        _mm256_slli_epi32(_mm256_cvtps_epi32(floor), 23)));
+    // Zero for denormal priors and for results below FastPow2()'s range.
+    const __m256 keep =
+        _mm256_and_ps(_mm256_cmp_ps(x, min_normal, _CMP_GE_OQ),
+                      _mm256_cmp_ps(a, min_exponent, _CMP_GE_OQ));
+    _mm256_storeu_ps(p + i, _mm256_and_ps(result, keep));
+  }
+  return i;
+}
+LC0_TARGET_END
+#endif
+
+}  // namespace
+
+void ComputePuctScoresScalar(float numerator, const float* p,
+                             const float* n_started_plus_one, const float* q,
+                             float* scores, int count) {
+  for (int i = 0; i < count; ++i) {
+    scores[i] = numerator * p[i] / n_started_plus_one[i] + q[i];
+  }
+}
+
+void ComputePuctScores(float numerator, const float* p,
+                       const float* n_started_plus_one, const float* q,
+                       float* scores, int count) {
+  int i = 0;
+#if defined(LC0_CPU_DISPATCH)
+  if (GetCpuFeatures().avx) {
+    i = ComputePuctScoresAvx(numerator, p, n_started_plus_one, q, scores,
+                             count);
+  }
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+  const float32x4_t num = vdupq_n_f32(numerator);
+  for (; i + 4 <= count; i += 4) {
+    const float32x4_t u = vdivq_f32(vmulq_f32(num, vld1q_f32(p + i)),
+                                    vld1q_f32(n_started_plus_one + i));
+    vst1q_f32(scores + i, vaddq_f32(u, vld1q_f32(q + i)));
+  }
+#endif
+  ComputePuctScoresScalar(numerator, p + i, n_started_plus_one + i, q + i,
+                          scores + i, count - i);
+}
+
+void TemperPriorsScalar(float* p, int count, float temperature) {
+  for (int i = 0; i < count; ++i) {
+    // Flush denormals to zero.
+    p[i] = p[i] < 1.17549435E-38
+               ? 0.0
+               : FastPow2(FastLog2(p[i]) / temperature);
+  }
+}
+
+void TemperPriors(float* p, int count, float temperature) {
+  int i = 0;
+#if defined(LC0_CPU_DISPATCH)
+  if (GetCpuFeatures().avx2) i = TemperPriorsAvx2(p, count, temperature);
+#endif
+  TemperPriorsScalar(p + i, count - i, temperature);
+}
+
+BestTwoScores FindBestTwoScores(const float* scores, int count) {
+  BestTwoScores result;
+  float best = std::numeric_limits<float>::lowest();
+  float second_best = std::numeric_limits<float>::lowest();
+  for (int i = 0; i < count; ++i) {
+    if (scores[i] > best) {
+      second_best = best;
+      result.second_best = result.best;
+      best = scores[i];
+      result.best = i;
+    } else if (scores[i] > second_best) {
+      second_best = scores[i];
+      result.second_best = i;
+    }
+  }
+  return result;
+}
+
+}  // namespace lczero
@@ -0,0 +1,64 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2019 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+
+  If you modify this Program, or any covered work, by linking or
+  combining it with NVIDIA Corporation's libraries from the NVIDIA CUDA
+  Toolkit and the NVIDIA CUDA Deep Neural Network library (or a
+  modified version of those libraries), containing parts covered by the
+  terms of the respective license agreement, the licensors of this
+  Program grant you additional permission to convey the resulting work.
+*/
+
+#pragma once
+
+namespace lczero {
+
+// Computes PUCT scores of @count children:
+//   scores[i] = numerator * p[i] / n_started_plus_one[i] + q[i]
+// The operations are done in the same order as EdgeAndNode::GetU() + Q, so
+// that the result is bit-exact with the scalar formula. Uses AVX or NEON when
+// the CPU has them.
+void ComputePuctScores(float numerator, const float* p,
+                       const float* n_started_plus_one, const float* q,
+                       float* scores, int count);
+
+// Plain scalar version of ComputePuctScores(), used for the tail of the
+// arrays and as a reference.
+void ComputePuctScoresScalar(float numerator, const float* p,
+                             const float* n_started_plus_one, const float* q,
+                             float* scores, int count);
+
+// Tempers @count priors in place with the policy softmax temperature:
+//   p[i] = FastPow2(FastLog2(p[i]) / temperature)
+// flushing denormals to zero. Uses AVX2 when the CPU has it, which
+// gives the scalar result up to the rounding of contracted multiply-adds.
+void TemperPriors(float* p, int count, float temperature);
+
+// Plain scalar version of TemperPriors().
+void TemperPriorsScalar(float* p, int count, float temperature);
+
+// Indices of the best and of the second best score, -1 if there is none.
+// Ties go to the child which comes first.
+struct BestTwoScores {
+  int best = -1;
+  int second_best = -1;
+};
+BestTwoScores FindBestTwoScores(const float* scores, int count);
+
+}  // namespace lczero
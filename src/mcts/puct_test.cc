@@ -0,0 +1,95 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2019 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+
+  If you modify this Program, or any covered work, by linking or
+  combining it with NVIDIA Corporation's libraries from the NVIDIA CUDA
+  Toolkit and the NVIDIA CUDA Deep Neural Network library (or a
+  modified version of those libraries), containing parts covered by the
+  terms of the respective license agreement, the licensors of this
+  Program grant you additional permission to convey the resulting work.
+*/
+
+#include "mcts/puct.h"
+
+#include <gtest/gtest.h>
+#include <cstring>
+#include <random>
+#include <vector>
+
+namespace lczero {
+
+TEST(PuctScores, MatchScalar) {
+  std::mt19937 gen(42);
+  std::uniform_real_distribution<float> prob(0.0f, 1.0f);
+  std::uniform_real_distribution<float> value(-1.0f, 1.0f);
+  std::uniform_int_distribution<int> visits(0, 100000);
+  for (int count = 0; count < 70; ++count) {
+    std::vector<float> p(count), n(count), q(count);
+    for (int i = 0; i < count; ++i) {
+      p[i] = prob(gen);
+      n[i] = 1 + visits(gen);
+      q[i] = value(gen);
+    }
+    std::vector<float> scores(count), expected(count);
+    ComputePuctScores(3.7f, p.data(), n.data(), q.data(), scores.data(),
+                      count);
+    ComputePuctScoresScalar(3.7f, p.data(), n.data(), q.data(),
+                            expected.data(), count);
+    for (int i = 0; i < count; ++i) {
+      EXPECT_EQ(0, std::memcmp(&scores[i], &expected[i], sizeof(float)));
+    }
+  }
+}
+
+TEST(TemperPriors, MatchScalar) {
+  std::mt19937 gen(42);
+  std::uniform_real_distribution<float> prob(0.0f, 1.0f);
+  for (int count = 0; count < 70; ++count) {
+    std::vector<float> p(count);
+    for (int i = 0; i < count; ++i) p[i] = prob(gen);
+    // Denormal and zero priors are flushed.
+    if (count > 2) {
+      p[0] = 0.0f;
+      p[1] = 1e-40f;
+    }
+    std::vector<float> expected = p;
+    TemperPriors(p.data(), count, 1.61f);
+    TemperPriorsScalar(expected.data(), count, 1.61f);
+    for (int i = 0; i < count; ++i) {
+      EXPECT_NEAR(expected[i], p[i], 1e-6f * expected[i]);
+    }
+  }
+}
+
+TEST(PuctScores, BestTwo) {
+  const float scores[] = {0.1f, 0.5f, 0.3f, 0.5f, 0.4f};
+  const auto best_two = FindBestTwoScores(scores, 5);
+  EXPECT_EQ(1, best_two.best);
+  EXPECT_EQ(3, best_two.second_best);
+
+  const auto single = FindBestTwoScores(scores, 1);
+  EXPECT_EQ(0, single.best);
+  EXPECT_EQ(-1, single.second_best);
+
+  const auto none = FindBestTwoScores(scores, 0);
+  EXPECT_EQ(-1, none.best);
+  EXPECT_EQ(-1, none.second_best);
+}
+
+}  // namespace lczero
@@ -31,17 +31,25 @@
 #include <bitset>
 #include <chrono>
 #include <cmath>
+#include <cstring>
+#include <deque>
 #include <iomanip>
 #include <iostream>
 #include <iterator>
 #include <sstream>
 #include <thread>
 
+#include "mcts/arena.h"
 #include "mcts/node.h"
+#include "mcts/puct.h"
 #include "neural/cache.h"
 #include "neural/encoder.h"
+#include "utils/affinity.h"
 #include "utils/fastmath.h"
+#include "utils/hashcat.h"
+#include "utils/metrics.h"
 #include "utils/random.h"
+#include "utils/trace.h"
 
 namespace lczero {
 
@@ -50,12 +58,161 @@ const int kSmartPruningToleranceNodes = 300;
 const int kSmartPruningToleranceMs = 200;
 // Maximum delay between outputting "uci info" when nothing interesting happens.
 const int kUciInfoMinimumFrequencyMs = 5000;
+
+Counter gNodesMetric("lc0_nodes_total", "Playouts done by searches.");
+Gauge gNpsMetric("lc0_nps", "Nodes per second of the latest search.");
+Counter gTbHitsMetric("lc0_tb_hits_total",
+                      "Tablebase hits of searches, root probes excluded.");
+Counter gCacheHitsMetric("lc0_nncache_hits_total",
+                         "NN cache lookups which found the position.");
+Counter gCacheMissesMetric("lc0_nncache_misses_total",
+                           "NN cache lookups which didn't find the position.");
+Gauge gCacheSizeMetric("lc0_nncache_size",
+                       "Positions in the NN cache of the latest search.");
+Gauge gTreeNodesMetric("lc0_tree_nodes",
+                       "Visits of the root of the latest search tree.");
+Gauge gTreeBytesMetric("lc0_tree_bytes",
+                       "Bytes of the nodes of the last tree searched.");
+Counter gNNBatchesMetric("lc0_nn_batches_total",
+                         "Batches sent to the NN backend by searches.");
+Counter gNNPositionsMetric("lc0_nn_batch_positions_total",
+                           "Positions in the batches sent to the NN backend.");
+Counter gNNLatencyMetric(
+    "lc0_nn_latency_microseconds_total",
+    "Time from sending NN batches to having their results, summed.");
+
+const int kMaxSharedPvLength = 32;
+
+// Most visited line of the subtree of @node.
+std::vector<Move> GetMostVisitedLine(const Node* node) {
+  std::vector<Move> pv;
+  while (node && static_cast<int>(pv.size()) < kMaxSharedPvLength) {
+    EdgeAndNode best;
+    for (const auto& edge : node->Edges()) {
+      if (edge.GetN() > best.GetN()) best = edge;
+    }
+    if (!best) break;
+    pv.push_back(best.GetMove());
+    node = best.node();
+  }
+  return pv;
+}
 }  // namespace
 
+void SharedRootStats::Publish(int index, const Node* root,
+                              int64_t playouts) {
+  TreeStats tree;
+  for (const auto& edge : root->Edges()) {
+    tree.edges.emplace_back();
+    auto& stats = tree.edges.back();
+    stats.move = edge.GetMove();
+    stats.n = edge.GetN();
+    stats.q = edge.GetQ(0.0f);
+    stats.d = edge.GetD();
+    stats.p = edge.GetP();
+    if (keep_pvs_ && stats.n > 0) stats.pv = GetMostVisitedLine(edge.node());
+  }
+  tree.visits = root->GetN();
+  tree.playouts = playouts;
+  Publish(index, std::move(tree));
+}
+
+void SharedRootStats::Publish(int index, TreeStats tree) {
+  Mutex::Lock lock(mutex_);
+  trees_[index] = std::move(tree);
+}
+
+SharedRootStats::TreeStats SharedRootStats::Get(int index) const {
+  Mutex::Lock lock(mutex_);
+  return trees_[index];
+}
+
+int SharedRootStats::GetTreeCount() const {
+  Mutex::Lock lock(mutex_);
+  return trees_.size();
+}
+
+uint64_t SharedRootStats::GetOtherVisits(int index, int edge_index,
+                                         Move move) const {
+  Mutex::Lock lock(mutex_);
+  uint64_t visits = 0;
+  for (int i = 0; i < static_cast<int>(trees_.size()); ++i) {
+    if (i == index) continue;
+    const auto& edges = trees_[i].edges;
+    // Trees of other hosts may have their edges in another order.
+    if (edge_index < static_cast<int>(edges.size()) &&
+        edges[edge_index].move == move) {
+      visits += edges[edge_index].n;
+      continue;
+    }
+    for (const auto& edge : edges) {
+      if (edge.move == move) visits += edge.n;
+    }
+  }
+  return visits;
+}
+
+SharedRootStats::EdgeStats SharedRootStats::GetOtherEdge(int index,
+                                                         Move move) const {
+  Mutex::Lock lock(mutex_);
+  EdgeStats result;
+  result.move = move;
+  double q = 0.0;
+  double d = 0.0;
+  uint32_t pv_visits = 0;
+  for (int i = 0; i < static_cast<int>(trees_.size()); ++i) {
+    if (i == index) continue;
+    for (const auto& edge : trees_[i].edges) {
+      if (edge.move != move) continue;
+      result.n += edge.n;
+      q += static_cast<double>(edge.q) * edge.n;
+      d += static_cast<double>(edge.d) * edge.n;
+      if (edge.n > pv_visits && !edge.pv.empty()) {
+        pv_visits = edge.n;
+        result.pv = edge.pv;
+      }
+    }
+  }
+  if (result.n) {
+    result.q = q / result.n;
+    result.d = d / result.n;
+  }
+  return result;
+}
+
+std::pair<uint64_t, int64_t> SharedRootStats::GetOtherTotals(
+    int index) const {
+  Mutex::Lock lock(mutex_);
+  std::pair<uint64_t, int64_t> totals{0, 0};
+  for (int i = 0; i < static_cast<int>(trees_.size()); ++i) {
+    if (i == index) continue;
+    totals.first += trees_[i].visits;
+    totals.second += trees_[i].playouts;
+  }
+  return totals;
+}
+
+void SharedRootStats::SetOwnedMoves(int index, MoveList moves) {
+  Mutex::Lock lock(mutex_);
+  owned_[index] = std::move(moves);
+  owned_epoch_.fetch_add(1, std::memory_order_release);
+}
+
+bool SharedRootStats::GetOwnedMoves(int index, uint64_t* epoch,
+                                    MoveList* moves) const {
+  if (owned_epoch_.load(std::memory_order_acquire) == *epoch) return false;
+  Mutex::Lock lock(mutex_);
+  *epoch = owned_epoch_.load(std::memory_order_acquire);
+  *moves = owned_[index];
+  return true;
+}
+
 std::string SearchLimits::DebugString() const {
   std::ostringstream ss;
   ss << "visits:" << visits << " playouts:" << playouts << " depth:" << depth
-     << " infinite:" << infinite;
+     << " tree_memory:" << tree_memory << " prune_tree:" << prune_tree
+     << " background_visits:" << background_visits
+     << " predicted_nps:" << predicted_nps << " infinite:" << infinite;
   if (search_deadline) {
     ss << " search_deadline:"
        << FormatTime(SteadyClockToSystemClock(*search_deadline));
@@ -70,16 +227,47 @@ Search::Search(const NodeTree& tree, Network* network,
                SyzygyTablebase* syzygy_tb)
     : ok_to_respond_bestmove_(!limits.infinite),
       root_node_(tree.GetCurrentHead()),
+      tree_account_(tree.GetMemoryAccount()),
       cache_(cache),
       syzygy_tb_(syzygy_tb),
       played_history_(tree.GetPositionHistory()),
       network_(network),
       limits_(limits),
+      priority_(limits.infinite ? ComputationPriority::kBackground
+                                : ComputationPriority::kNormal),
       start_time_(std::chrono::steady_clock::now()),
       initial_visits_(root_node_->GetN()),
+      initial_cache_stats_(cache_->GetStats()),
+      initial_tb_cache_stats_(syzygy_tb ? syzygy_tb->GetCacheStats()
+                                        : SyzygyTablebase::CacheStats()),
+      published_cache_stats_(initial_cache_stats_),
       best_move_callback_(best_move_callback),
       info_callback_(info_callback),
-      params_(options) {}
+      params_(options),
+      prefetch_pool_(std::max(1, params_.GetPrefetchThreads() - 1)),
+      minibatch_size_(params_.GetMiniBatchSize()) {
+  if (params_.GetDevicePolicy() && network_->GathersLegalPolicy()) {
+    device_policy_temp_ = params_.GetPolicySoftmaxTemp();
+    // Priors normalized over the legal moves only differ from raw ones by a
+    // factor, which the search normalizes away anyway.
+    if (device_policy_temp_ != 1.0f) {
+      uint32_t temp_bits;
+      std::memcpy(&temp_bits, &device_policy_temp_, sizeof(temp_bits));
+      cache_salt_ = Hash(temp_bits);
+    }
+  }
+  // Tables are opened in the background as the search gets close to them,
+  // until then such nodes are evaluated by the network.
+  if (syzygy_tb_) {
+    const auto& board = played_history_.Last().GetBoard();
+    if ((board.ours() | board.theirs()).count() <=
+        syzygy_tb_->max_cardinality() + 2) {
+      syzygy_tb_->prepare(played_history_.Last());
+    }
+  }
+  root_syzygy_rank_ = PopulateRootMoveLimit(&root_move_limit_);
+  if (root_syzygy_rank_) tb_hits_.fetch_add(1, std::memory_order_acq_rel);
+}
 
 namespace {
 void ApplyDirichletNoise(Node* node, float eps, double alpha) {
@@ -102,7 +290,11 @@ void ApplyDirichletNoise(Node* node, float eps, double alpha) {
 }
 }  // namespace
 
-void Search::SendUciInfo() REQUIRES(nodes_mutex_) {
+void Search::SendUciInfo() REQUIRES(nodes_mutex_) REQUIRES(counters_mutex_) {
+  info_callback_(GetUciInfos());
+}
+
+std::vector<ThinkingInfo> Search::GetUciInfos() {
   auto edges = GetBestChildrenNoTemperature(root_node_, params_.GetMultiPv());
   const auto score_type = params_.GetScoreType();
 
@@ -116,12 +308,28 @@ void Search::SendUciInfo() REQUIRES(nodes_mutex_) {
   common_info.nodes = total_playouts_ + initial_visits_;
   common_info.hashfull =
       cache_->GetSize() * 1000LL / std::max(cache_->GetCapacity(), 1);
-  common_info.nps =
-      common_info.time ? (total_playouts_ * 1000 / common_info.time) : 0;
+  int64_t playouts = total_playouts_;
+  if (root_stats_) {
+    const auto others = root_stats_->GetOtherTotals(root_stats_index_);
+    common_info.nodes += others.first;
+    playouts += others.second;
+  }
+  common_info.nps = common_info.time ? (playouts * 1000 / common_info.time) : 0;
   common_info.tb_hits = tb_hits_.load(std::memory_order_acquire);
   int multipv = 0;
   for (const auto& edge : edges) {
     float score = edge.GetQ(-root_node_->GetQ());
+    uint64_t nodes = edge.GetN();
+    // The move may be searched by the other trees of a root parallel group
+    // too, or only by them.
+    SharedRootStats::EdgeStats others;
+    if (root_stats_) {
+      others = root_stats_->GetOtherEdge(root_stats_index_, edge.GetMove());
+      if (others.n > 0) {
+        score = (score * nodes + others.q * others.n) / (nodes + others.n);
+        nodes += others.n;
+      }
+    }
     ++multipv;
     uci_infos.emplace_back(common_info);
     auto& uci_info = uci_infos.back();
@@ -134,13 +342,22 @@ void Search::SendUciInfo() REQUIRES(nodes_mutex_) {
     }
     if (params_.GetMultiPv() > 1) {
       uci_info.multipv = multipv;
-      uci_info.nodes = edge.GetN();
+      uci_info.nodes = nodes;
     }
     bool flip = played_history_.IsBlackToMove();
-    for (auto iter = edge; iter;
-         iter = GetBestChildNoTemperature(iter.node()), flip = !flip) {
-      uci_info.pv.push_back(iter.GetMove(flip));
-      if (!iter.node()) break;  // Last edge was dangling, cannot continue.
+    if (others.n > edge.GetN() && !others.pv.empty()) {
+      uci_info.pv.push_back(edge.GetMove(flip));
+      for (Move move : others.pv) {
+        flip = !flip;
+        if (flip) move.Mirror();
+        uci_info.pv.push_back(move);
+      }
+    } else {
+      for (auto iter = edge; iter;
+           iter = GetBestChildNoTemperature(iter.node()), flip = !flip) {
+        uci_info.pv.push_back(iter.GetMove(flip));
+        if (!iter.node()) break;  // Last edge was dangling, cannot continue.
+      }
     }
 
     // Mate display if certain win (or loss) with distance to mate set to
@@ -161,33 +378,44 @@ void Search::SendUciInfo() REQUIRES(nodes_mutex_) {
   if (current_best_edge_ && !edges.empty()) {
     last_outputted_info_edge_ = current_best_edge_.edge();
   }
-
-  info_callback_(uci_infos);
+  return uci_infos;
 }
 
 // Decides whether anything important changed in stats and new info should be
 // shown to a user.
 void Search::MaybeOutputInfo() {
-  SharedMutex::Lock lock(nodes_mutex_);
-  Mutex::Lock counters_lock(counters_mutex_);
-  if (!bestmove_is_sent_ && current_best_edge_ &&
-      (current_best_edge_.edge() != last_outputted_info_edge_ ||
-       last_outputted_uci_info_.depth !=
-           static_cast<int>(cum_depth_ /
-                            (total_playouts_ ? total_playouts_ : 1)) ||
-       last_outputted_uci_info_.seldepth != max_depth_ ||
-       last_outputted_uci_info_.time + kUciInfoMinimumFrequencyMs <
-           GetTimeSinceStart())) {
-    SendUciInfo();
-    if (params_.GetLogLiveStats()) {
-      SendMovesStats();
-    }
-    if (stop_.load(std::memory_order_acquire) && !ok_to_respond_bestmove_) {
-      ThinkingInfo info;
-      info.comment =
-          "WARNING: Search has reached limit and does not make any progress.";
-      info_callback_({info});
+  std::vector<ThinkingInfo> infos;
+  MovesStats moves_stats;
+  {
+    // The nodes lock is only held to take the stats, the output is formatted
+    // and sent after.
+    SharedMutex::Lock lock(nodes_mutex_);
+    Mutex::Lock counters_lock(counters_mutex_);
+    if (bestmove_is_sent_ || !current_best_edge_ ||
+        (current_best_edge_.edge() == last_outputted_info_edge_ &&
+         last_outputted_uci_info_.depth ==
+             static_cast<int>(cum_depth_ /
+                              (total_playouts_ ? total_playouts_ : 1)) &&
+         last_outputted_uci_info_.seldepth == max_depth_ &&
+         last_outputted_uci_info_.time + kUciInfoMinimumFrequencyMs >=
+             GetTimeSinceStart())) {
+      return;
     }
+    infos = GetUciInfos();
+    PublishMetrics();
+    if (params_.GetLogLiveStats()) moves_stats = GetMovesStats();
+  }
+
+  // Bestmove may have been sent meanwhile, the info can't come after it.
+  Mutex::Lock counters_lock(counters_mutex_);
+  if (bestmove_is_sent_) return;
+  info_callback_(infos);
+  if (params_.GetLogLiveStats()) SendMovesStats(moves_stats);
+  if (stop_.load(std::memory_order_acquire) && !ok_to_respond_bestmove_) {
+    ThinkingInfo info;
+    info.comment =
+        "WARNING: Search has reached limit and does not make any progress.";
+    info_callback_({info});
   }
 }
 
@@ -220,76 +448,148 @@ inline float ComputeCpuct(const SearchParams& params, uint32_t N) {
 }
 }  // namespace
 
-std::vector<std::string> Search::GetVerboseStats(Node* node,
-                                                 bool is_black_to_move) const {
+std::vector<Search::ChildStats> Search::GetChildStats(
+    Node* node, bool is_black_to_move) const {
   const float fpu = GetFpu(params_, node, node == root_node_);
   const float cpuct = ComputeCpuct(params_, node->GetN());
   const float U_coeff =
       cpuct * std::sqrt(std::max(node->GetChildrenVisits(), 1u));
 
-  std::vector<EdgeAndNode> edges;
-  for (const auto& edge : node->Edges()) edges.push_back(edge);
+  std::vector<ChildStats> stats;
+  for (const auto& edge : node->Edges()) {
+    ChildStats child;
+    child.move = edge.GetMove(is_black_to_move);
+    child.nn_index = edge.GetMove().as_nn_index();
+    child.n = edge.GetN();
+    child.n_in_flight = edge.GetNInFlight();
+    child.p = edge.GetP();
+    child.q = edge.GetQ(fpu);
+    child.d = edge.GetD();
+    child.u = edge.GetU(U_coeff);
+    if (edge.IsCertain()) {
+      child.v = edge.edge()->GetEQ();
+    } else {
+      NNCacheLock nneval = GetCachedNNEval(edge.node());
+      if (nneval) child.v = -nneval->q;
+    }
+    child.certainty_state = edge.edge()->GetCertaintyState();
+    stats.push_back(child);
+  }
 
-  std::sort(
-      edges.begin(), edges.end(),
-      [&fpu, &U_coeff](EdgeAndNode a, EdgeAndNode b) {
-        return std::forward_as_tuple(a.GetN(), a.GetQ(fpu) + a.GetU(U_coeff)) <
-               std::forward_as_tuple(b.GetN(), b.GetQ(fpu) + b.GetU(U_coeff));
-      });
+  std::sort(stats.begin(), stats.end(),
+            [](const ChildStats& a, const ChildStats& b) {
+              return std::forward_as_tuple(a.n, a.q + a.u) <
+                     std::forward_as_tuple(b.n, b.q + b.u);
+            });
+  return stats;
+}
 
+std::vector<std::string> Search::FormatChildStats(
+    const std::vector<ChildStats>& stats) {
   std::vector<std::string> infos;
-  for (const auto& edge : edges) {
+  for (const auto& child : stats) {
     std::ostringstream oss;
     oss << std::fixed;
 
-    oss << std::left << std::setw(5)
-        << edge.GetMove(is_black_to_move).as_string();
+    oss << std::left << std::setw(5) << child.move.as_string();
 
-    oss << " (" << std::setw(4) << edge.GetMove().as_nn_index() << ")";
+    oss << " (" << std::setw(4) << child.nn_index << ")";
 
-    oss << " N: " << std::right << std::setw(7) << edge.GetN() << " (+"
-        << std::setw(2) << edge.GetNInFlight() << ") ";
+    oss << " N: " << std::right << std::setw(7) << child.n << " (+"
+        << std::setw(2) << child.n_in_flight << ") ";
 
-    oss << "(P: " << std::setw(5) << std::setprecision(2) << edge.GetP() * 100
+    oss << "(P: " << std::setw(5) << std::setprecision(2) << child.p * 100
         << "%) ";
 
-    oss << "(Q: " << std::setw(8) << std::setprecision(5) << edge.GetQ(fpu)
-        << ") ";
+    oss << "(Q: " << std::setw(8) << std::setprecision(5) << child.q << ") ";
 
-    oss << "(D: " << std::setw(6) << std::setprecision(3) << edge.GetD()
-        << ") ";
+    oss << "(D: " << std::setw(6) << std::setprecision(3) << child.d << ") ";
 
-    oss << "(U: " << std::setw(6) << std::setprecision(5) << edge.GetU(U_coeff)
-        << ") ";
+    oss << "(U: " << std::setw(6) << std::setprecision(5) << child.u << ") ";
 
     oss << "(Q+U: " << std::setw(8) << std::setprecision(5)
-        << edge.GetQ(fpu) + edge.GetU(U_coeff) << ") ";
+        << child.q + child.u << ") ";
 
     oss << "(V: ";
-    optional<float> v;
-    if (edge.IsCertain()) {
-      v = edge.edge()->GetEQ();
-    } else {
-      NNCacheLock nneval = GetCachedNNEval(edge.node());
-      if (nneval) v = -nneval->q;
-    }
-    if (v) {
-      oss << std::setw(7) << std::setprecision(4) << *v;
+    if (child.v) {
+      oss << std::setw(7) << std::setprecision(4) << *child.v;
     } else {
       oss << " -.----";
     }
     oss << ") ";
 
-    oss << " C:" << std::bitset<8>(edge.edge()->GetCertaintyState());
+    oss << " C:" << std::bitset<8>(child.certainty_state);
 
     infos.emplace_back(oss.str());
   }
   return infos;
 }
 
-void Search::SendMovesStats() const REQUIRES(counters_mutex_) {
+void Search::PublishMetrics() {
+  gNodesMetric.Add(total_playouts_ - published_playouts_);
+  published_playouts_ = total_playouts_;
+  const int tb_hits = tb_hits_.load(std::memory_order_acquire);
+  gTbHitsMetric.Add(tb_hits - published_tb_hits_);
+  published_tb_hits_ = tb_hits;
+  const NNCache::Stats stats = cache_->GetStats();
+  gCacheHitsMetric.Add(stats.hits - published_cache_stats_.hits);
+  gCacheMissesMetric.Add(stats.misses - published_cache_stats_.misses);
+  published_cache_stats_ = stats;
+  gCacheSizeMetric.Set(cache_->GetSize());
+  const int64_t time = GetTimeSinceStart();
+  if (time > 0) gNpsMetric.Set(total_playouts_ * 1000.0 / time);
+  gTreeNodesMetric.Set(root_node_->GetN());
+  gTreeBytesMetric.Set(tree_account_->GetBytes());
+}
+
+std::string Search::GetCacheStats() const {
+  const NNCache::Stats stats = cache_->GetStats();
+  const uint64_t hits = stats.hits - initial_cache_stats_.hits;
+  const uint64_t misses = stats.misses - initial_cache_stats_.misses;
+  const double hit_rate = hits * 100.0 / std::max<uint64_t>(hits + misses, 1);
+  std::ostringstream oss;
+  oss << "NNCache hits: " << hits << " (" << std::fixed
+      << std::setprecision(1) << hit_rate << "%), misses: " << misses
+      << ", evictions: " << stats.evictions - initial_cache_stats_.evictions
+      << ", rejected: " << stats.rejections - initial_cache_stats_.rejections;
+  return oss.str();
+}
+
+std::string Search::GetTablebaseCacheStats() const {
+  const SyzygyTablebase::CacheStats stats = syzygy_tb_->GetCacheStats();
+  const uint64_t hits = stats.hits - initial_tb_cache_stats_.hits;
+  const uint64_t lookups = stats.lookups - initial_tb_cache_stats_.lookups;
+  std::ostringstream oss;
+  oss << "Syzygy probe cache hits: " << hits << " (" << std::fixed
+      << std::setprecision(1) << hits * 100.0 / std::max<uint64_t>(lookups, 1)
+      << "%), misses: " << lookups - hits;
+  const SyzygyTablebase::MappingStats mapping = syzygy_tb_->GetMappingStats();
+  oss << ", tables: " << mapping.tables << " (" << (mapping.mapped_bytes >> 20)
+      << " MiB, " << (mapping.resident_bytes >> 20)
+      << " MiB resident), evicted: " << mapping.evictions;
+  return oss.str();
+}
+
+Search::MovesStats Search::GetMovesStats() const {
   const bool is_black_to_move = played_history_.IsBlackToMove();
-  auto move_stats = GetVerboseStats(root_node_, is_black_to_move);
+  MovesStats stats;
+  stats.root = GetChildStats(root_node_, is_black_to_move);
+  if (final_bestmove_.HasNode()) {
+    stats.after_best =
+        GetChildStats(final_bestmove_.node(), !is_black_to_move);
+  }
+  return stats;
+}
+
+void Search::SendMovesStats(const MovesStats& stats) const {
+  auto move_stats = FormatChildStats(stats.root);
+  move_stats.push_back(GetCacheStats());
+  if (syzygy_tb_) move_stats.push_back(GetTablebaseCacheStats());
+  {
+    Mutex::Lock lock(profile_mutex_);
+    for (const auto& line : profile_.GetStats()) move_stats.push_back(line);
+  }
+  move_stats.push_back(GetIdleStats());
 
   if (params_.GetVerboseStats()) {
     std::vector<ThinkingInfo> infos;
@@ -304,12 +604,15 @@ void Search::SendMovesStats() const REQUIRES(counters_mutex_) {
     LOGFILE << "=== Move stats:";
     for (const auto& line : move_stats) LOGFILE << line;
   }
+  if (prefetch_evals_ > 0) {
+    LOGFILE << "Prefetched evals: " << prefetch_evals_
+            << ", used: " << prefetch_hits_;
+  }
   if (final_bestmove_.HasNode()) {
     LOGFILE
         << "--- Opponent moves after: "
         << final_bestmove_.GetMove(played_history_.IsBlackToMove()).as_string();
-    for (const auto& line :
-         GetVerboseStats(final_bestmove_.node(), !is_black_to_move)) {
+    for (const auto& line : FormatChildStats(stats.after_best)) {
       LOGFILE << line;
     }
   }
@@ -326,156 +629,538 @@ NNCacheLock Search::GetCachedNNEval(Node* node) const {
   for (auto iter = moves.rbegin(), end = moves.rend(); iter != end; ++iter) {
     history.Append(*iter);
   }
-  const auto hash = history.HashLast(params_.GetCacheHistoryLength() + 1);
-  NNCacheLock nneval(cache_, hash);
+  NNCacheLock nneval(cache_, GetCacheHash(history));
   return nneval;
 }
 
+uint64_t Search::GetCacheHash(const PositionHistory& history) const {
+  const uint64_t hash = history.HashLast(params_.GetCacheHistoryLength() + 1);
+  return cache_salt_ ? HashCat(hash, cache_salt_) : hash;
+}
+
+Mutex& Search::GetSpawnMutex(const Node* node) const {
+  // Nodes are at least 8 byte aligned, so low bits carry no information.
+  return spawn_mutexes_[(reinterpret_cast<uintptr_t>(node) >> 3) %
+                        spawn_mutexes_.size()];
+}
+
+Node* Search::FindOrAddTransposition(uint64_t hash, Node* node) {
+  Mutex::Lock lock(transpositions_mutex_);
+  auto result = transpositions_.emplace(hash, node);
+  return result.second ? nullptr : result.first->second;
+}
+
 void Search::UpdateKLDGain() {
   if (params_.GetMinimumKLDGainPerNode() <= 0) return;
-
-  SharedMutex::Lock nodes_lock(nodes_mutex_);
-  Mutex::Lock lock(counters_mutex_);
-  if (total_playouts_ + initial_visits_ >=
-      prev_dist_visits_total_ + params_.GetKLDGainAverageInterval()) {
-    std::vector<uint32_t> new_visits;
+  int64_t visits;
+  {
+    Mutex::Lock lock(counters_mutex_);
+    visits = total_playouts_ + initial_visits_;
+  }
+  if (visits < prev_dist_visits_total_ + params_.GetKLDGainAverageInterval()) {
+    return;
+  }
+  std::vector<uint32_t> new_visits;
+  {
+    // Visit counts are atomic, the lock only keeps the root edges in place.
+    SharedMutex::SharedLock nodes_lock(nodes_mutex_);
     for (auto edge : root_node_->Edges()) {
       new_visits.push_back(edge.GetN());
     }
-    if (prev_dist_.size() != 0) {
-      double sum1 = 0.0;
-      double sum2 = 0.0;
-      for (decltype(new_visits)::size_type i = 0; i < new_visits.size(); i++) {
-        sum1 += prev_dist_[i];
-        sum2 += new_visits[i];
-      }
-      double kldgain = 0.0;
-      for (decltype(new_visits)::size_type i = 0; i < new_visits.size(); i++) {
-        double o_p = prev_dist_[i] / sum1;
-        double n_p = new_visits[i] / sum2;
-        if (prev_dist_[i] != 0) {
-          kldgain += o_p * log(o_p / n_p);
-        }
-      }
-      if (kldgain / (sum2 - sum1) < params_.GetMinimumKLDGainPerNode()) {
-        kldgain_too_small_ = true;
+  }
+  if (prev_dist_.size() != 0) {
+    double sum1 = 0.0;
+    double sum2 = 0.0;
+    for (decltype(new_visits)::size_type i = 0; i < new_visits.size(); i++) {
+      sum1 += prev_dist_[i];
+      sum2 += new_visits[i];
+    }
+    double kldgain = 0.0;
+    for (decltype(new_visits)::size_type i = 0; i < new_visits.size(); i++) {
+      double o_p = prev_dist_[i] / sum1;
+      double n_p = new_visits[i] / sum2;
+      if (prev_dist_[i] != 0) {
+        kldgain += o_p * log(o_p / n_p);
       }
     }
-    prev_dist_.swap(new_visits);
-    prev_dist_visits_total_ = total_playouts_ + initial_visits_;
+    if (kldgain / (sum2 - sum1) < params_.GetMinimumKLDGainPerNode()) {
+      kldgain_too_small_.store(true, std::memory_order_release);
+    }
   }
+  prev_dist_.swap(new_visits);
+  prev_dist_visits_total_ = visits;
 }
 
 void Search::MaybeTriggerStop() {
   SharedMutex::Lock nodes_lock(nodes_mutex_);
   Mutex::Lock lock(counters_mutex_);
-  // Already responded bestmove, nothing to do here.
-  if (bestmove_is_sent_) return;
+  // Already responded bestmove, only a background search may still have to
+  // stop.
+  if (bestmove_is_sent_) {
+    if (!in_background_.load(std::memory_order_acquire) ||
+        stop_.load(std::memory_order_acquire)) {
+      return;
+    }
+    if (total_playouts_ + initial_visits_ >= limits_.background_visits) {
+      FireStopInternal();
+      LOGFILE << "Stopped background search: Reached visits limit: "
+              << total_playouts_ + initial_visits_
+              << ">=" << limits_.background_visits;
+    }
+    if (IsOutOfTreeMemory()) {
+      FireStopInternal();
+      LOGFILE << "Stopped background search: Reached tree memory limit: "
+              << tree_account_->GetBytes() << ">=" << limits_.tree_memory;
+    }
+    return;
+  }
   // Don't stop when the root node is not yet expanded.
   if (total_playouts_ == 0) return;
 
   // If not yet stopped, try to stop for different reasons.
   if (!stop_.load(std::memory_order_acquire)) {
-    if (kldgain_too_small_) {
-      FireStopInternal();
+    if (kldgain_too_small_.load(std::memory_order_acquire)) {
+      StopForLimit();
       LOGFILE << "Stopped search: KLDGain per node too small.";
     }
     // If smart pruning tells to stop (best move found), stop.
-    if (only_one_possible_move_left_) {
-      FireStopInternal();
+    if (only_one_possible_move_left_.load(std::memory_order_acquire)) {
+      StopForLimit();
       LOGFILE << "Stopped search: Only one move candidate left.";
     }
     // Stop if reached playouts limit.
     if (limits_.playouts >= 0 && total_playouts_ >= limits_.playouts) {
-      FireStopInternal();
+      StopForLimit();
       LOGFILE << "Stopped search: Reached playouts limit: " << total_playouts_
               << ">=" << limits_.playouts;
     }
     // Stop if reached visits limit.
     if (limits_.visits >= 0 &&
         total_playouts_ + initial_visits_ >= limits_.visits) {
-      FireStopInternal();
+      StopForLimit();
       LOGFILE << "Stopped search: Reached visits limit: "
               << total_playouts_ + initial_visits_ << ">=" << limits_.visits;
     }
+    // Stop if the tree has grown beyond its memory budget.
+    if (IsOutOfTreeMemory()) {
+      FireStopInternal();
+      LOGFILE << "Stopped search: Reached tree memory limit: "
+              << tree_account_->GetBytes() << ">=" << limits_.tree_memory;
+    }
     // Stop if reached time limit.
     if (limits_.search_deadline && GetTimeToDeadline() <= 0) {
       LOGFILE << "Stopped search: Ran out of time.";
-      FireStopInternal();
+      StopForLimit();
     }
     // Stop if average depth reached requested depth.
     if (limits_.depth >= 0 &&
         cum_depth_ / (total_playouts_ ? total_playouts_ : 1) >=
             static_cast<unsigned int>(limits_.depth)) {
-      FireStopInternal();
+      StopForLimit();
       LOGFILE << "Stopped search: Reached depth.";
     }
   }
   // If we are the first to see that stop is needed.
   if (stop_.load(std::memory_order_acquire) && ok_to_respond_bestmove_ &&
       !bestmove_is_sent_) {
-    SendUciInfo();
-    EnsureBestMoveKnown();
-    SendMovesStats();
-    best_move_callback_(
-        {final_bestmove_.GetMove(played_history_.IsBlackToMove()),
-         final_pondermove_.GetMove(!played_history_.IsBlackToMove())});
-    bestmove_is_sent_ = true;
-    current_best_edge_ = EdgeAndNode();
+    SendBestMove();
+  }
+}
+
+void Search::StopForLimit() {
+  if (in_background_.load(std::memory_order_acquire)) return;
+  if (!ok_to_respond_bestmove_ || stop_.load(std::memory_order_acquire) ||
+      total_playouts_ + initial_visits_ >= limits_.background_visits) {
+    FireStopInternal();
+    return;
+  }
+  // The threads keep running on the same tree, the next search starts from
+  // the subtree of the move played.
+  SendBestMove();
+  in_background_.store(true, std::memory_order_release);
+  remaining_playouts_.store(std::numeric_limits<int64_t>::max(),
+                            std::memory_order_relaxed);
+  LOGFILE << "Searching in the background up to "
+          << limits_.background_visits << " visits.";
+}
+
+namespace {
+// Nodes closer to the root than that are never pruned.
+const int kMinPruneDepth = 2;
+// Pruning frees at least that share of the root visits, if it can.
+const int kPruneShareDivisor = 4;
+// Pruning starts when the tree is that share of its limit short of it.
+const int kPruneHeadroomDivisor = 8;
+
+// Prunes a tree by collapsing the children of its nodes which are at least
+// kMinPruneDepth plies deep, are off the principal variation and have
+// nothing in flight. At a threshold of T visits, such nodes with at most T
+// visits are collapsed, unless their parent is.
+class TreePruner {
+ public:
+  TreePruner(Node* root, std::vector<const Node*> pv)
+      : root_(root), pv_(std::move(pv)) {}
+
+  // Returns the smallest power of two threshold which frees @target visits,
+  // or the largest one if none does. 0 if nothing can be pruned.
+  uint64_t FindThreshold(uint64_t target) {
+    std::fill(std::begin(freed_), std::end(freed_), 0);
+    Count(root_, 0, std::numeric_limits<uint64_t>::max());
+    if (freed_[kMaxLog] == 0) return 0;
+    int log = 0;
+    while (log < kMaxLog && freed_[log] < target) ++log;
+    freed_visits_ = freed_[log];
+    return uint64_t{1} << log;
+  }
+
+  // Returns the number of visits collapsed at the last found threshold.
+  uint64_t GetFreedVisits() const { return freed_visits_; }
+
+  // Collapses at @threshold, returns the number of nodes collapsed.
+  int Prune(uint64_t threshold) { return Prune(root_, 0, threshold); }
+
+ private:
+  static constexpr int kMaxLog = 32;
+
+  bool IsPrunable(const Node* node, int depth) const {
+    if (depth < kMinPruneDepth || node->GetNInFlight() != 0) return false;
+    if (depth < static_cast<int>(pv_.size()) && pv_[depth] == node) {
+      return false;
+    }
+    return node->HasChildNodes();
+  }
+
+  // @limit is the visits of the closest prunable ancestor, which a
+  // threshold has to stay under for prunable nodes below to be collapsed.
+  void Count(const Node* node, int depth, uint64_t limit) {
+    for (Node* child : node->ChildNodes()) {
+      uint64_t child_limit = limit;
+      if (IsPrunable(child, depth + 1)) {
+        const uint64_t n = child->GetN();
+        int log = 0;
+        while ((uint64_t{1} << log) < n) ++log;
+        for (; log <= kMaxLog && (uint64_t{1} << log) < limit; ++log) {
+          freed_[log] += n - 1;
+        }
+        child_limit = n;
+      }
+      Count(child, depth + 1, child_limit);
+    }
+  }
+
+  int Prune(Node* node, int depth, uint64_t threshold) {
+    int collapsed = 0;
+    for (Node* child : node->ChildNodes()) {
+      if (child->GetN() <= threshold && IsPrunable(child, depth + 1)) {
+        child->CollapseChildren();
+        ++collapsed;
+      } else {
+        collapsed += Prune(child, depth + 1, threshold);
+      }
+    }
+    return collapsed;
+  }
+
+  Node* const root_;
+  const std::vector<const Node*> pv_;
+  // Visits freed at each power of two threshold.
+  uint64_t freed_[kMaxLog + 1];
+  uint64_t freed_visits_ = 0;
+};
+}  // namespace
+
+bool Search::IsOutOfTreeMemory() {
+  if (limits_.tree_memory < 0) return false;
+  const int64_t bytes = tree_account_->GetBytes();
+  if (bytes >= limits_.tree_memory) {
+    // Released nodes still hold memory until the garbage collector frees
+    // them. Rather than wait for that here, under the locks, the next check
+    // sees whether it brought the tree back under the limit. Meanwhile the
+    // tree may only outgrow the limit by the pruning headroom.
+    return !tree_account_->HasPendingFrees() ||
+           bytes >= limits_.tree_memory +
+                        limits_.tree_memory / kPruneHeadroomDivisor;
+  }
+  if (!limits_.prune_tree) return false;
+  // Pruned subtrees are freed by the garbage collector later, so pruning
+  // starts short of the limit and waits for the memory to come back under.
+  const int64_t prune_at =
+      limits_.tree_memory - limits_.tree_memory / kPruneHeadroomDivisor;
+  if (bytes < prune_at) {
+    tree_pruned_ = false;
+    return false;
+  }
+  // If nothing could be pruned, the search goes on up to the limit.
+  if (!tree_pruned_) PruneTree();
+  tree_pruned_ = true;
+  return false;
+}
+
+void Search::PruneTree() {
+  // Minibatches point to transposition nodes which may be anywhere in the
+  // tree, in flight or not.
+  if (params_.GetTranspositions()) return;
+  const auto start = std::chrono::steady_clock::now();
+  std::vector<const Node*> pv;
+  for (Node* node = root_node_; node;
+       node = GetBestChildNoTemperature(node).node()) {
+    pv.push_back(node);
+  }
+  TreePruner pruner(root_node_, std::move(pv));
+  const uint64_t threshold =
+      pruner.FindThreshold(root_node_->GetN() / kPruneShareDivisor);
+  if (threshold == 0) {
+    LOGFILE << "Found no subtree to prune.";
+    return;
   }
+  NodeArena::EnableRecycling();
+  NodeArena::ScopedAccount scope(tree_account_);
+  const int collapsed = pruner.Prune(threshold);
+  LOGFILE << "Pruned " << collapsed << " subtrees of up to " << threshold
+          << " visits, " << pruner.GetFreedVisits() << " visits in total, in "
+          << std::chrono::duration_cast<std::chrono::milliseconds>(
+                 std::chrono::steady_clock::now() - start)
+                 .count()
+          << "ms.";
+}
+
+void Search::SendBestMove() {
+  SendUciInfo();
+  EnsureBestMoveKnown();
+  SendMovesStats(GetMovesStats());
+  best_move_callback_(
+      {final_bestmove_.GetMove(played_history_.IsBlackToMove()),
+       final_pondermove_.GetMove(!played_history_.IsBlackToMove())});
+  bestmove_is_sent_ = true;
+  current_best_edge_ = EdgeAndNode();
+}
+
+WorkerCounters* Search::NewWorkerCounters() {
+  Mutex::Lock lock(worker_counters_mutex_);
+  worker_counters_.emplace_back();
+  return &worker_counters_.back();
+}
+
+void Search::NotifyBackup() {
+  backup_epoch_.fetch_add(1);
+  if (idle_workers_.load() == 0) return;
+  {
+    // A waiter may be between checking the epoch and waiting.
+    Mutex::Lock lock(idle_mutex_);
+  }
+  idle_cv_.notify_all();
+}
+
+void Search::WaitForBackup(uint64_t epoch, std::chrono::microseconds timeout) {
+  // Incremented before checking the epoch, so that NotifyBackup() either
+  // sees the waiter or the waiter sees the new epoch.
+  idle_workers_.fetch_add(1);
+  {
+    Mutex::Lock lock(idle_mutex_);
+    idle_cv_.wait_for(lock.get_raw(), timeout, [&]() {
+      return backup_epoch_.load() > epoch ||
+             stop_.load(std::memory_order_acquire);
+    });
+  }
+  idle_workers_.fetch_sub(1);
+}
+
+std::string Search::GetIdleStats() const {
+  std::ostringstream oss;
+  oss << std::fixed << std::setprecision(1) << "Worker idle time:";
+  Mutex::Lock lock(worker_counters_mutex_);
+  for (const auto& counters : worker_counters_) {
+    oss << " " << counters.idle_us.load(std::memory_order_relaxed) / 1000.0
+        << "ms";
+  }
+  return oss.str();
+}
+
+void Search::AggregateCounters() {
+  int64_t playouts = 0;
+  uint64_t cum_depth = 0;
+  uint16_t max_depth = 0;
+  {
+    Mutex::Lock lock(worker_counters_mutex_);
+    for (const auto& counters : worker_counters_) {
+      playouts += counters.playouts.load(std::memory_order_relaxed);
+      cum_depth += counters.cum_depth.load(std::memory_order_relaxed);
+      max_depth = std::max(max_depth,
+                           counters.max_depth.load(std::memory_order_relaxed));
+    }
+  }
+  Mutex::Lock lock(counters_mutex_);
+  total_playouts_ = playouts;
+  cum_depth_ = cum_depth;
+  max_depth_ = max_depth;
+}
+
+void Search::UpdateStatus() {
+  AggregateCounters();
+  // Once stopped, the bestmove shouldn't wait for locks taken for limits
+  // which no longer matter.
+  if (!stop_.load(std::memory_order_acquire)) {
+    UpdateRemainingMoves();  // Updates smart pruning counters.
+    UpdateKLDGain();
+    PublishRootStats();
+  }
+  MaybeTriggerStop();
+  MaybeOutputInfo();
+  MaybeAutoTune();
+}
+
+void Search::ApplyRootNoise() {
+  // An unexpanded root gets it when it's evaluated.
+  if (!params_.GetNoise() || !root_node_->HasChildren()) return;
+  ApplyDirichletNoise(root_node_, 0.25, 0.3);
+  // Has the visited policy follow the new priors.
+  std::vector<float> priors;
+  priors.reserve(root_node_->GetNumEdges());
+  for (const auto& edge : root_node_->Edges()) priors.push_back(edge.GetP());
+  root_node_->ReplacePriors(priors.data());
+}
+
+void Search::SetAutoTuner(AutoTuner* tuner) {
+  // The batches and threads of the deterministic mode can't vary.
+  if (params_.GetDeterministic()) return;
+  tuner_ = tuner;
+  minibatch_size_.store(tuner->GetMiniBatchSize(), std::memory_order_relaxed);
+  active_threads_.store(tuner->GetThreads(), std::memory_order_relaxed);
+}
+
+void Search::MaybeAutoTune() {
+  if (!tuner_) return;
+  // Long enough for a few batches of every thread, speed is noisy.
+  constexpr auto kTuneInterval = std::chrono::milliseconds(500);
+  TunerSnapshot now;
+  now.time = std::chrono::steady_clock::now();
+  if (tuner_snapshot_ && now.time - tuner_snapshot_->time < kTuneInterval) {
+    return;
+  }
+  {
+    Mutex::Lock lock(worker_counters_mutex_);
+    for (const auto& counters : worker_counters_) {
+      now.playouts += counters.playouts.load(std::memory_order_relaxed);
+      now.picked += counters.picked.load(std::memory_order_relaxed);
+      now.collisions += counters.collisions.load(std::memory_order_relaxed);
+      now.nn_batches += counters.nn_batches.load(std::memory_order_relaxed);
+      now.nn_us += counters.nn_us.load(std::memory_order_relaxed);
+    }
+  }
+  if (!tuner_snapshot_) {
+    // The first interval starts now.
+    tuner_snapshot_ = now;
+    return;
+  }
+  const TunerSnapshot& last = *tuner_snapshot_;
+  const double seconds =
+      std::chrono::duration<double>(now.time - last.time).count();
+  const uint64_t picked = now.picked - last.picked;
+  const uint64_t nn_batches = now.nn_batches - last.nn_batches;
+  AutoTuner::Sample sample;
+  sample.nps = (now.playouts - last.playouts) / seconds;
+  sample.collision_rate =
+      picked ? static_cast<double>(now.collisions - last.collisions) / picked
+             : 0.0;
+  sample.nn_latency_ms =
+      nn_batches ? (now.nn_us - last.nn_us) / 1000.0 / nn_batches : 0.0;
+  tuner_snapshot_ = now;
+  if (!tuner_->Update(sample)) return;
+
+  minibatch_size_.store(tuner_->GetMiniBatchSize(), std::memory_order_relaxed);
+  {
+    // A parked worker may be between checking and waiting.
+    Mutex::Lock lock(idle_mutex_);
+    active_threads_.store(tuner_->GetThreads(), std::memory_order_relaxed);
+  }
+  idle_cv_.notify_all();
+  ThinkingInfo info;
+  info.comment = tuner_->GetStatus();
+  LOGFILE << info.comment;
+  info_callback_({info});
+}
+
+void Search::WaitWhileParked(int index) {
+  Mutex::Lock lock(idle_mutex_);
+  idle_cv_.wait(lock.get_raw(), [&]() {
+    return !IsParked(index) || stop_.load(std::memory_order_acquire);
+  });
+}
+
+void Search::PublishRootStats() {
+  if (!root_stats_) return;
+  SharedMutex::SharedLock nodes_lock(nodes_mutex_);
+  Mutex::Lock lock(counters_mutex_);
+  root_stats_->Publish(root_stats_index_, root_node_, total_playouts_);
 }
 
 void Search::UpdateRemainingMoves() {
   if (params_.GetSmartPruningFactor() <= 0.0f) return;
-  SharedMutex::Lock lock(nodes_mutex_);
-  remaining_playouts_ = std::numeric_limits<int>::max();
-  // Check for how many playouts there is time remaining.
-  if (limits_.search_deadline && !nps_start_time_) {
-    nps_start_time_ = std::chrono::steady_clock::now();
-  } else if (limits_.search_deadline) {
-    const auto time_since_start =
-        std::chrono::duration_cast<std::chrono::milliseconds>(
-            std::chrono::steady_clock::now() - *nps_start_time_)
-            .count();
-    if (time_since_start > kSmartPruningToleranceMs) {
-      const auto nps = 1000LL *
-                           (total_playouts_ + kSmartPruningToleranceNodes) /
-                           time_since_start +
-                       1;
-      const int64_t remaining_time = GetTimeToDeadline();
-      // Put early_exit scaler here so calculation doesn't have to be done on
-      // every node.
-      const int64_t remaining_playouts =
-          remaining_time * nps / params_.GetSmartPruningFactor() / 1000;
-      // Don't assign directly to remaining_playouts_ as overflow is possible.
-      if (remaining_playouts < remaining_playouts_)
-        remaining_playouts_ = remaining_playouts;
-    }
-  }
-  // Check how many visits are left.
-  if (limits_.visits >= 0) {
-    // Add kMiniBatchSize, as it's possible to exceed visits limit by that
-    // number.
-    const auto remaining_visits = limits_.visits - total_playouts_ -
-                                  initial_visits_ + params_.GetMiniBatchSize() -
-                                  1;
-
-    if (remaining_visits < remaining_playouts_)
-      remaining_playouts_ = remaining_visits;
-  }
-  if (limits_.playouts >= 0) {
-    // Add kMiniBatchSize, as it's possible to exceed visits limit by that
-    // number.
-    const auto remaining_playouts =
-        limits_.visits - total_playouts_ + params_.GetMiniBatchSize() + 1;
-    if (remaining_playouts < remaining_playouts_)
-      remaining_playouts_ = remaining_playouts;
+  // Nothing to prune for in the background.
+  if (in_background_.load(std::memory_order_acquire)) return;
+  int64_t remaining = std::numeric_limits<int>::max();
+  {
+    Mutex::Lock counters_lock(counters_mutex_);
+    // Check for how many playouts there is time remaining.
+    if (limits_.search_deadline && !nps_start_time_) {
+      nps_start_time_ = std::chrono::steady_clock::now();
+    } else if (limits_.search_deadline) {
+      const auto time_since_start =
+          std::chrono::duration_cast<std::chrono::milliseconds>(
+              std::chrono::steady_clock::now() - *nps_start_time_)
+              .count();
+      // Too early for a speed of our own, go by the predicted one if known.
+      const bool measured = time_since_start > kSmartPruningToleranceMs;
+      if (measured || limits_.predicted_nps > 0) {
+        const auto nps =
+            measured
+                ? 1000LL * (total_playouts_ + kSmartPruningToleranceNodes) /
+                          time_since_start +
+                      1
+                : limits_.predicted_nps;
+        const int64_t remaining_time = GetTimeToDeadline();
+        // Put early_exit scaler here so calculation doesn't have to be done
+        // on every node.
+        const int64_t remaining_playouts =
+            remaining_time * nps / params_.GetSmartPruningFactor() / 1000;
+        // Don't assign directly to remaining as overflow is possible.
+        if (remaining_playouts < remaining) remaining = remaining_playouts;
+      }
+    }
+    // Check how many visits are left.
+    if (limits_.visits >= 0) {
+      // Add kMiniBatchSize, as it's possible to exceed visits limit by that
+      // number.
+      const auto remaining_visits = limits_.visits - total_playouts_ -
+                                    initial_visits_ +
+                                    params_.GetMiniBatchSize() - 1;
+      if (remaining_visits < remaining) remaining = remaining_visits;
+    }
+    if (limits_.playouts >= 0) {
+      // Add kMiniBatchSize, as it's possible to exceed visits limit by that
+      // number.
+      const auto remaining_playouts =
+          limits_.visits - total_playouts_ + params_.GetMiniBatchSize() + 1;
+      if (remaining_playouts < remaining) remaining = remaining_playouts;
+    }
   }
   // Even if we exceeded limits, don't go crazy by not allowing any playouts.
-  if (remaining_playouts_ <= 1) remaining_playouts_ = 1;
+  if (remaining <= 1) remaining = 1;
+  remaining_playouts_.store(remaining, std::memory_order_relaxed);
+
   // Since remaining_playouts_ has changed, the logic for selecting visited root
   // nodes may also change. Use a 0 visit cancel score update to clear out any
-  // cached best edge.
+  // cached best edge. That takes the exclusive lock, so it's done at most
+  // once per interval rather than on every watchdog tick.
+  constexpr auto kClearInterval = std::chrono::milliseconds(10);
+  const auto now = std::chrono::steady_clock::now();
+  if (remaining == cleared_remaining_playouts_ ||
+      now - last_best_child_clear_ < kClearInterval) {
+    return;
+  }
+  cleared_remaining_playouts_ = remaining;
+  last_best_child_clear_ = now;
+  SharedMutex::Lock lock(nodes_mutex_);
   root_node_->CancelScoreUpdate(0);
 }
 
@@ -501,8 +1186,13 @@ std::pair<Move, Move> Search::GetBestMove() {
 }
 
 std::int64_t Search::GetTotalPlayouts() const {
-  SharedMutex::SharedLock lock(nodes_mutex_);
-  return total_playouts_;
+  // Straight from the workers, the aggregate may lag behind.
+  Mutex::Lock lock(worker_counters_mutex_);
+  int64_t playouts = 0;
+  for (const auto& counters : worker_counters_) {
+    playouts += counters.playouts.load(std::memory_order_relaxed);
+  }
+  return playouts;
 }
 
 int Search::PopulateRootMoveLimit(MoveList* root_moves) const {
@@ -519,12 +1209,16 @@ int Search::PopulateRootMoveLimit(MoveList* root_moves) const {
       (board.ours() | board.theirs()).count() > syzygy_tb_->max_cardinality()) {
     return 0;
   }
+  // Called before the search threads start, the root moves are probed with
+  // as many threads.
+  const int threads = std::max(1u, std::thread::hardware_concurrency());
   return syzygy_tb_->root_probe(
              played_history_.Last(),
              params_.GetSyzygyFastPlay() ||
                  played_history_.DidRepeatSinceLastZeroingMove(),
-             root_moves) ||
-         syzygy_tb_->root_probe_wdl(played_history_.Last(), root_moves);
+             root_moves, threads) ||
+         syzygy_tb_->root_probe_wdl(played_history_.Last(), root_moves,
+                                    threads);
 }
 
 // Computes the best move, maybe with temperature (according to the settings).
@@ -559,10 +1253,7 @@ void Search::EnsureBestMoveKnown() REQUIRES(nodes_mutex_)
 // Returns @count children with most visits.
 std::vector<EdgeAndNode> Search::GetBestChildrenNoTemperature(Node* parent,
                                                               int count) const {
-  MoveList root_limit;
-  if (parent == root_node_) {
-    PopulateRootMoveLimit(&root_limit);
-  }
+  const MoveList& root_limit = root_move_limit_;
   // Best child is selected using the following criteria:
   // with Certainty Propagation:
   // * Prefer terminal wins, then certain wins.
@@ -572,18 +1263,26 @@ std::vector<EdgeAndNode> Search::GetBestChildrenNoTemperature(Node* parent,
   // * If two nodes have equal number:
   //   * If that number is 0, the one with larger prior wins.
   //   * If that number is larger than 0, the one with larger eval wins.
+  // * At the root of a root parallel group, the visits of all trees count.
   using El = std::tuple<int, uint64_t, float, float, EdgeAndNode>;
   std::vector<El> edges;
+  int edge_index = -1;
   for (auto edge : parent->Edges()) {
+    ++edge_index;
     if (parent == root_node_ && !root_limit.empty() &&
         std::find(root_limit.begin(), root_limit.end(), edge.GetMove()) ==
             root_limit.end()) {
       continue;
     }
+    uint64_t visits = edge.GetN();
+    if (parent == root_node_ && root_stats_) {
+      visits += root_stats_->GetOtherVisits(root_stats_index_, edge_index,
+                                            edge.GetMove());
+    }
     edges.emplace_back((params_.GetCertaintyPropagation())
                            ? edge.edge()->GetEQ() * (edge.IsTerminal() + 1)
                            : 0,
-                       edge.GetN(), edge.GetQ(0), edge.GetP(), edge);
+                       visits, edge.GetQ(0), edge.GetP(), edge);
   }
   // Ensure that certain draws have at least as many virtual visits as the
   // first move with Q<=0 (these visits are used during final sort).
@@ -624,10 +1323,7 @@ EdgeAndNode Search::GetBestChildNoTemperature(Node* parent) const {
 // Returns a child chosen according to weighted-by-temperature visit count.
 EdgeAndNode Search::GetBestChildWithTemperature(Node* parent,
                                                 float temperature) const {
-  MoveList root_limit;
-  if (parent == root_node_) {
-    PopulateRootMoveLimit(&root_limit);
-  }
+  const MoveList& root_limit = root_move_limit_;
 
   std::vector<float> cumulative_sums;
   float sum = 0.0;
@@ -688,12 +1384,16 @@ void Search::StartThreads(size_t how_many) {
   Mutex::Lock lock(threads_mutex_);
   // First thread is a watchdog thread.
   if (threads_.size() == 0) {
+    has_watchdog_.store(true, std::memory_order_release);
     threads_.emplace_back([this]() { WatchdogThread(); });
   }
   // Start working threads.
   while (threads_.size() <= how_many) {
-    threads_.emplace_back([this]() {
-      SearchWorker worker(this, params_);
+    // Workers are numbered after the watchdog.
+    const int index = threads_.size() - 1;
+    threads_.emplace_back([this, index]() {
+      PinnedThread pinned(ThreadRole::kSearch);
+      SearchWorker worker(this, params_, index);
       worker.RunBlocking();
     });
   }
@@ -711,30 +1411,30 @@ bool Search::IsSearchActive() const {
 void Search::WatchdogThread() {
   LOGFILE << "Start a watchdog thread.";
   while (true) {
-    MaybeTriggerStop();
-    MaybeOutputInfo();
+    if (params_.GetDeterministic()) {
+      // The workers aggregate between iterations, or smart pruning would
+      // depend on when this thread gets to it.
+      MaybeTriggerStop();
+      MaybeOutputInfo();
+    } else {
+      UpdateStatus();
+    }
 
-    using namespace std::chrono_literals;
-    constexpr auto kMaxWaitTime = std::chrono::milliseconds(100);
-    constexpr auto kMinWaitTime = std::chrono::milliseconds(1);
+    // Workers don't check the limits themselves, so this is also how late a
+    // visits limit or a new best move may be noticed. It's short enough that
+    // deadlines need no wait of their own.
+    constexpr auto kWaitTime = std::chrono::milliseconds(1);
 
     Mutex::Lock lock(counters_mutex_);
     // Only exit when bestmove is responded. It may happen that search threads
     // already all exited, and we need at least one thread that can do that.
-    if (bestmove_is_sent_) break;
-
-    auto remaining_time = limits_.search_deadline
-                              ? std::chrono::milliseconds(GetTimeToDeadline())
-                              : kMaxWaitTime;
-    if (remaining_time > kMaxWaitTime) remaining_time = kMaxWaitTime;
-    if (remaining_time < kMinWaitTime) remaining_time = kMinWaitTime;
-    // There is no real need to have max wait time, and sometimes it's fine
-    // to wait without timeout at all (e.g. in `go nodes` mode), but we
-    // still limit wait time for exotic cases like when pc goes to sleep
-    // mode during thinking.
-    // Minimum wait time is there to prevent busy wait and other threads
-    // starvation.
-    watchdog_cv_.wait_for(lock.get_raw(), remaining_time, [this]() {
+    // A search going on in the background still needs its limits checked.
+    if (bestmove_is_sent_ && (!in_background_.load(std::memory_order_acquire) ||
+                              stop_.load(std::memory_order_acquire))) {
+      break;
+    }
+
+    watchdog_cv_.wait_for(lock.get_raw(), kWaitTime, [this]() {
       return stop_.load(std::memory_order_acquire);
     });
   }
@@ -744,6 +1444,10 @@ void Search::WatchdogThread() {
 void Search::FireStopInternal() {
   stop_.store(true, std::memory_order_release);
   watchdog_cv_.notify_all();
+  {
+    Mutex::Lock lock(idle_mutex_);
+  }
+  idle_cv_.notify_all();
 }
 
 void Search::Stop() {
@@ -774,6 +1478,12 @@ void Search::Wait() {
 Search::~Search() {
   Abort();
   Wait();
+  AggregateCounters();
+  {
+    SharedMutex::Lock lock(nodes_mutex_);
+    Mutex::Lock counters_lock(counters_mutex_);
+    PublishMetrics();
+  }
   LOGFILE << "Search destroyed.";
 }
 
@@ -781,6 +1491,25 @@ Search::~Search() {
 // SearchWorker
 //////////////////////////////////////////////////////////////////////////////
 
+void SearchWorker::Reset(Search* search) {
+  search_ = search;
+  counters_ = search->NewWorkerCounters();
+  params_ = &search->params_;
+  history_ = search->played_history_;
+  history_.Reserve(history_.GetLength() + kHistoryReserve);
+  minibatch_.clear();
+  computation_.reset();
+  root_move_filter_ = search->root_move_limit_;
+  owned_moves_.clear();
+  owned_epoch_ = 0;
+  number_out_of_order_ = 0;
+  number_certain_ = 0;
+  last_encoded_parent_ = nullptr;
+  board_snapshots_.clear();
+  board_snapshot_bytes_ = 0;
+  profile_.Clear();
+}
+
 void SearchWorker::ExecuteOneIteration() {
   // 1. Initialize internal structures.
   InitializeIteration(search_->network_->NewComputation());
@@ -804,90 +1533,248 @@ void SearchWorker::ExecuteOneIteration() {
   UpdateCounters();
 }
 
+void SearchWorker::RunPipelined() {
+  const size_t depth = params_->GetPipelinedMinibatches();
+  std::deque<InFlightMinibatch> in_flight;
+  // As in RunBlocking(), at least one iteration runs even after a very early
+  // stop.
+  bool first_iteration = true;
+  while (true) {
+    // Steps 1-4: gather minibatches and send them to the backend until the
+    // pipeline is full.
+    while (in_flight.size() < depth && !search_->IsParked(index_) &&
+           (first_iteration || search_->IsSearchActive())) {
+      first_iteration = false;
+      InitializeIteration(search_->network_->NewComputation());
+      GatherMinibatch();
+      MaybePrefetchIntoCache();
+      auto done = std::make_shared<std::promise<void>>();
+      in_flight.emplace_back();
+      InFlightMinibatch& batch = in_flight.back();
+      batch.done = done->get_future();
+      batch.start = std::chrono::steady_clock::now();
+      computation_->ComputeAsync([done]() { done->set_value(); });
+      batch.minibatch = std::move(minibatch_);
+      batch.computation = std::move(computation_);
+      batch.number_out_of_order = number_out_of_order_;
+      batch.number_certain = number_certain_;
+    }
+    if (in_flight.empty()) {
+      if (!search_->IsSearchActive()) return;
+      // Parked, with nothing left in flight.
+      search_->WaitWhileParked(index_);
+      continue;
+    }
+
+    // Steps 5-7 for the oldest minibatch, once its results arrive.
+    InFlightMinibatch& batch = in_flight.front();
+    {
+      ScopedPhaseTimer timer(&profile_, SearchProfile::kCompute);
+      TRACE_SCOPE("search compute wait");
+      batch.done.wait();
+    }
+    // As ComputeBlocking() would have.
+    batch.computation->CheckAsyncError();
+    RecordBatchMetrics(batch.computation->GetCacheMisses(), batch.start);
+    minibatch_ = std::move(batch.minibatch);
+    computation_ = std::move(batch.computation);
+    number_out_of_order_ = batch.number_out_of_order;
+    number_certain_ = batch.number_certain;
+    in_flight.pop_front();
+    FetchMinibatchResults();
+    DoBackupUpdate();
+    UpdateCounters();
+  }
+}
+
+void SearchWorker::RunSerialized() {
+  // Iterations only depend on the tree and cache they start from, so running
+  // them one at a time makes the sequence of trees independent of the thread
+  // timing, as long as none starts after the stop. One iteration still has to
+  // run to have a move.
+  while (true) {
+    Mutex::Lock lock(search_->iteration_mutex_);
+    if (!search_->IsSearchActive() && search_->iterations_done_ > 0) return;
+    ExecuteOneIteration();
+    ++search_->iterations_done_;
+  }
+}
+
 // 1. Initialize internal structures.
 // ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 void SearchWorker::InitializeIteration(
     std::unique_ptr<NetworkComputation> computation) {
-  computation_ = std::make_unique<CachingComputation>(std::move(computation),
-                                                      search_->cache_);
+  // The computation of the previous iteration, if done with, is reused for
+  // its storage.
+  if (computation_) {
+    computation_->Reset(std::move(computation));
+  } else {
+    computation_ = std::make_unique<CachingComputation>(
+        std::move(computation), search_->cache_, search_->device_policy_temp_);
+  }
+  if (search_->small_network_) {
+    computation_->SetSmallParent(search_->small_network_->NewComputation());
+  }
+  // Once bestmove is sent, the search leaves the device to the next one.
+  computation_->SetPriority(
+      search_->in_background_.load(std::memory_order_relaxed)
+          ? ComputationPriority::kBackground
+          : search_->priority_);
   minibatch_.clear();
-
-  if (!root_move_filter_populated_) {
-    root_move_filter_populated_ = true;
-    int best_rank = search_->PopulateRootMoveLimit(&root_move_filter_);
-    if (best_rank) {
-      search_->tb_hits_.fetch_add(1, std::memory_order_acq_rel);
-      search_->root_syzygy_rank_ = best_rank;
-    }
+  last_encoded_parent_ = nullptr;
+  idle_epoch_ = search_->backup_epoch_.load();
+  own_backups_ = 0;
+
+  if (search_->root_stats_ &&
+      search_->root_stats_->GetOwnedMoves(search_->root_stats_index_,
+                                          &owned_epoch_, &owned_moves_) &&
+      !root_move_filter_.empty()) {
+    // Only the owned moves which pass the filter, or the whole filter if none
+    // does.
+    owned_moves_.erase(
+        std::remove_if(owned_moves_.begin(), owned_moves_.end(),
+                       [this](Move move) {
+                         return std::find(root_move_filter_.begin(),
+                                          root_move_filter_.end(),
+                                          move) == root_move_filter_.end();
+                       }),
+        owned_moves_.end());
   }
 }
 
 // 2. Gather minibatch.
 // ~~~~~~~~~~~~~~~~~~~~
 void SearchWorker::GatherMinibatch() {
+  ScopedPhaseTimer timer(&profile_, SearchProfile::kGather);
+  TRACE_SCOPE("search gather");
+  NodeArena::ScopedAccount scope(search_->tree_account_);
+  tb_leaves_.clear();
+  tb_positions_.clear();
+  GatherMinibatchLeaves();
+  ProbeTablebaseLeaves();
+  BackupCertainLeaves();
+}
+
+void SearchWorker::GatherMinibatchLeaves() {
   // Total number of nodes to process.
   int minibatch_size = 0;
-  int collision_events_left = params_.GetMaxCollisionEvents();
-  int collisions_left = params_.GetMaxCollisionVisitsId();
+  int collision_events_left = params_->GetMaxCollisionEvents();
+  int collisions_left = params_->GetMaxCollisionVisitsId();
 
   // Number of nodes processed out of order.
   number_out_of_order_ = 0;
+  number_certain_ = 0;
 
   // Gather nodes to process in the current batch.
   // If we had too many (kMiniBatchSize) nodes out of order, also interrupt the
-  // iteration so that search can exit.
-  while (minibatch_size < params_.GetMiniBatchSize() &&
-         number_out_of_order_ < params_.GetMaxOutOfOrderEvals()) {
+  // iteration so that search can exit. Certain leaves take no slots, but are
+  // limited as well, so that iterations end in a nearly solved tree.
+  const int max_minibatch_size = search_->GetMiniBatchSize();
+  while (minibatch_size < max_minibatch_size &&
+         number_out_of_order_ < params_->GetMaxOutOfOrderEvals() &&
+         number_certain_ < max_minibatch_size) {
     // If there's something to process without touching slow neural net, do it.
-    if (minibatch_size > 0 && computation_->GetCacheMisses() == 0) return;
-    // Pick next node to extend.
-    minibatch_.emplace_back(PickNodeToExtend(collisions_left));
-    auto& picked_node = minibatch_.back();
-    auto* node = picked_node.node;
-
-    // There was a collision. If limit has been reached, return, otherwise
-    // just start search of another node.
-    if (picked_node.IsCollision()) {
-      if (--collision_events_left <= 0) return;
-      if ((collisions_left -= picked_node.multivisit) <= 0) return;
-      if (search_->stop_.load(std::memory_order_acquire)) return;
-      continue;
+    if (minibatch_size > 0 && computation_->GetCacheMisses() == 0 &&
+        tb_leaves_.empty()) {
+      return;
+    }
+    // Pick next nodes to extend.
+    const size_t first_picked = minibatch_.size();
+    if (params_->GetMultiLeafPicking()) {
+      PickNodesToExtend(
+          std::min(max_minibatch_size - minibatch_size, collisions_left));
+    } else {
+      minibatch_.emplace_back(PickNodeToExtend(collisions_left));
     }
-    ++minibatch_size;
-
-    // If node is already known as terminal (win/loss/draw according to rules
-    // of the game), it means that we already visited this node before.
-    if (picked_node.IsExtendable()) {
-      // Node was never visited, extend it.
-      ExtendNode(node);
 
-      // Only send uncertain nodes to a neural network.
-      if (!node->IsCertain()) {
+    // All picked nodes are processed before stopping, as their visits are
+    // booked.
+    bool collision_limit_reached = false;
+    size_t kept = first_picked;
+    for (size_t i = first_picked; i < minibatch_.size(); ++i) {
+      if (kept != i) minibatch_[kept] = minibatch_[i];
+      auto& picked_node = minibatch_[kept];
+      auto* node = picked_node.node;
+      counters_->picked.fetch_add(picked_node.multivisit,
+                                  std::memory_order_relaxed);
+
+      // There was a collision. If limit has been reached, return after the
+      // rest, otherwise just start search of another node.
+      if (picked_node.IsCollision()) {
+        counters_->collisions.fetch_add(picked_node.multivisit,
+                                        std::memory_order_relaxed);
+        if (--collision_events_left <= 0) collision_limit_reached = true;
+        if ((collisions_left -= picked_node.multivisit) <= 0) {
+          collision_limit_reached = true;
+        }
+        ++kept;
+        continue;
+      }
+      ++minibatch_size;
+
+      // If node is already known as terminal (win/loss/draw according to
+      // rules of the game), it means that we already visited this node
+      // before.
+      if (picked_node.is_reevaluation) {
+        // The node has its edges, only the evaluation is redone.
+        SetHistoryToNode(node);
         picked_node.nn_queried = true;
-        picked_node.is_cache_hit = AddNodeToComputation(node, true);
+        picked_node.is_cache_hit =
+            AddNodeToComputation(node, node->GetParent(), true, false);
+      } else if (picked_node.IsExtendable()) {
+        // Node was never visited, extend it.
+        if (ExtendNode(node)) {
+          tb_leaves_.push_back(kept);
+        } else if (!node->IsCertain()) {
+          // Only send uncertain nodes to a neural network.
+          picked_node.nn_queried = true;
+          picked_node.is_cache_hit =
+              AddNodeToComputation(node, node->GetParent(), true);
+          if (params_->GetTranspositions()) {
+            // Hash of the last position only; it includes repetitions and the
+            // 50-move counter, so those are never merged.
+            picked_node.transposition =
+                search_->FindOrAddTransposition(history_.HashLast(1), node);
+          }
+        }
       }
-    }
 
-    // If out of order eval is enabled and the node to compute we added last
-    // doesn't require NN eval (i.e. it's a cache hit or terminal node), do
-    // out of order eval for it.
-    if (params_.GetOutOfOrderEval() && picked_node.CanEvalOutOfOrder()) {
-      // Perform out of order eval for the last entry in minibatch_.
-      FetchSingleNodeResult(&picked_node, computation_->GetBatchSize() - 1);
-      {
-        // Nodes mutex for doing node updates.
-        SharedMutex::Lock lock(search_->nodes_mutex_);
-        DoBackupUpdateSingleNode(picked_node);
+      // Certain leaves have their value already, they are backed up together
+      // at the end of the gather.
+      if (!picked_node.nn_queried && node->IsCertain()) {
+        FetchSingleNodeResult(&picked_node, -1);
+        certain_leaves_.push_back(picked_node);
+        --minibatch_size;
+        ++number_certain_;
+        continue;
       }
 
-      // Remove last entry in minibatch_, as it has just been
-      // processed.
-      // If NN eval was already processed out of order, remove it.
-      if (picked_node.nn_queried) computation_->PopCacheHit();
-      minibatch_.pop_back();
-      --minibatch_size;
-      ++number_out_of_order_;
+      // If out of order eval is enabled and the node to compute we added last
+      // doesn't require NN eval (i.e. it's a cache hit), do out of order eval
+      // for it.
+      if (params_->GetOutOfOrderEval() && picked_node.CanEvalOutOfOrder()) {
+        // Perform out of order eval for the entry just added.
+        FetchSingleNodeResult(&picked_node, computation_->GetBatchSize() - 1);
+        {
+          // Nodes mutex for doing node updates.
+          const auto lock_start = SearchProfile::Clock::now();
+          SharedMutex::Lock lock(search_->nodes_mutex_);
+          profile_.Add(SearchProfile::kLockWait, lock_start);
+          DoBackupUpdateSingleNode(picked_node);
+        }
+        NotifyBackup();
+
+        // Drop the entry, as it has just been processed.
+        // If NN eval was already processed out of order, remove it.
+        if (picked_node.nn_queried) computation_->PopCacheHit();
+        --minibatch_size;
+        ++number_out_of_order_;
+        continue;
+      }
+      ++kept;
     }
+    minibatch_.erase(minibatch_.begin() + kept, minibatch_.end());
+    if (collision_limit_reached) return;
     // Check for stop at the end so we have at least one node.
     if (search_->stop_.load(std::memory_order_acquire)) return;
   }
@@ -911,17 +1798,31 @@ SearchWorker::NodeToProcess SearchWorker::PickNodeToExtend(
   // node at each level according to the MCTS formula. n_in_flight_ is
   // incremented for each node in the playout (via TryStartScoreUpdate()).
 
-  Node* node = search_->root_node_;
-  Node::Iterator best_edge;
-  Node::Iterator second_best_edge;
-
   // Precache a newly constructed node to avoid memory allocations being
   // performed while the mutex is held.
   if (!precached_node_) {
     precached_node_ = std::make_unique<Node>(nullptr, 0);
   }
 
+  // With lock-free selection, threads only exclude backups and descend
+  // concurrently, relying on atomic node counters for virtual loss.
+  const auto lock_start = SearchProfile::Clock::now();
+  if (params_->GetLockFreeSelection()) {
+    SharedMutex::SharedLock lock(search_->nodes_mutex_);
+    profile_.Add(SearchProfile::kLockWait, lock_start);
+    return PickNodeToExtendLocked(collision_limit);
+  }
   SharedMutex::Lock lock(search_->nodes_mutex_);
+  profile_.Add(SearchProfile::kLockWait, lock_start);
+  return PickNodeToExtendLocked(collision_limit);
+}
+
+SearchWorker::NodeToProcess SearchWorker::PickNodeToExtendLocked(
+    int collision_limit) {
+  const bool lock_free = params_->GetLockFreeSelection();
+  Node* node = search_->root_node_;
+  Node::Iterator best_edge;
+  Node::Iterator second_best_edge;
 
   // Fetch the current best root node visits for possible smart pruning.
   const int64_t best_node_n = search_->current_best_edge_.GetN();
@@ -941,7 +1842,12 @@ SearchWorker::NodeToProcess SearchWorker::PickNodeToExtend(
     //            (!is_root_node)"), but that would mean extra mutex lock.
     //            Will revisit that after rethinking locking strategy.
     if (!node_already_updated) {
-      node = best_edge.GetOrSpawnNode(/* parent */ node, &precached_node_);
+      if (lock_free) {
+        Mutex::Lock spawn_lock(search_->GetSpawnMutex(node));
+        node = best_edge.GetOrSpawnNode(/* parent */ node, &precached_node_);
+      } else {
+        node = best_edge.GetOrSpawnNode(/* parent */ node, &precached_node_);
+      }
     }
     best_edge.Reset();
     depth++;
@@ -962,8 +1868,13 @@ SearchWorker::NodeToProcess SearchWorker::PickNodeToExtend(
       return NodeToProcess::TerminalHit(node, depth, piececount, 1);
     } else if (!node->HasChildren()) {
       return NodeToProcess::Extension(node, depth, piececount);
+    } else if (ShouldReevaluate(node)) {
+      return NodeToProcess::Reevaluation(node, depth, piececount);
     }
-    Node* possible_shortcut_child = node->GetCachedBestChild();
+    // The best child cache is not updated atomically, so it's only used when
+    // threads pick nodes one at a time.
+    Node* possible_shortcut_child =
+        lock_free ? nullptr : node->GetCachedBestChild();
     if (possible_shortcut_child) {
       // Add two here to reverse the conservatism that goes into calculating the
       // remaining cache visits.
@@ -978,70 +1889,25 @@ SearchWorker::NodeToProcess SearchWorker::PickNodeToExtend(
 
     // If we fall through, then n_in_flight_ has been incremented but this
     // playout remains incomplete; we must go deeper.
-    const float cpuct = ComputeCpuct(params_, node->GetN());
+    const float cpuct = ComputeCpuct(*params_, node->GetN());
     const float puct_mult =
         cpuct * std::sqrt(std::max(node->GetChildrenVisits(), 1u));
-    float best = std::numeric_limits<float>::lowest();
+    const float fpu = GetFpu(*params_, node, is_root_node);
+    Node::Iterator forced_edge;
+    const int possible_moves = ScoreChildren(node, is_root_node, best_node_n,
+                                             puct_mult, fpu, &forced_edge);
+    const int scored_count = scored_children_.size();
+    const BestTwoScores best_two =
+        FindBestTwoScores(child_scores_.data(), scored_count);
+    if (forced_edge) {
+      best_edge = forced_edge;
+    } else if (best_two.best >= 0) {
+      best_edge = scored_children_[best_two.best];
+    }
     float second_best = std::numeric_limits<float>::lowest();
-    int possible_moves = 0;
-    const float fpu = GetFpu(params_, node, is_root_node);
-    bool parent_upperbounded = node->IsOnlyUBounded();
-    for (auto child : node->Edges()) {
-      if (is_root_node) {
-        // If there's no chance to catch up to the current best node with
-        // remaining playouts, don't consider it.
-        // best_move_node_ could have changed since best_node_n was retrieved.
-        // To ensure we have at least one node to expand, always include
-        // current best node.
-        if (child != search_->current_best_edge_ &&
-            search_->remaining_playouts_ < best_node_n - child.GetN()) {
-          continue;
-        }
-        // If play certain win and don't search other
-        // moves at root. If search limit infinite continue searching other
-        // moves.
-        if (params_.GetCertaintyPropagation() && child.edge()->IsCertainWin()) {
-          if (!search_->limits_.infinite) {
-            best_edge = child;
-            possible_moves = 1;
-            break;
-          } else if (search_->current_best_edge_ == child &&
-                     possible_moves > 0) {
-            continue;
-          }
-        }
-        // If root move filter exists, make sure move is in the list.
-        if (!root_move_filter_.empty() &&
-            std::find(root_move_filter_.begin(), root_move_filter_.end(),
-                      child.GetMove()) == root_move_filter_.end()) {
-          continue;
-        }
-        ++possible_moves;
-      }
-      float Q = child.GetQ(fpu);
-
-      // Certainty Propagation. Avoid suboptimal childs.
-      if (params_.GetCertaintyPropagation()) {
-        // Prefers lower bounded childs over drawing children.
-        if (child.edge()->IsOnlyLBounded() && child.GetQ(0) <= 0.0f) Q = 0.01f;
-        // Prefers drawing children over upper bounded childs.
-        if (child.edge()->IsOnlyUBounded() && child.GetQ(0) >= 0.0f) Q = -0.01f;
-        // Penalize exploring suboptimal childs throughout the tree.
-        if (parent_upperbounded) {
-          if (child.edge()->IsOnlyUBounded()) Q -= child.GetN() * 0.1f;
-        }
-      }
-
-      const float score = child.GetU(puct_mult) + Q;
-      if (score > best) {
-        second_best = best;
-        second_best_edge = best_edge;
-        best = score;
-        best_edge = child;
-      } else if (score > second_best) {
-        second_best = score;
-        second_best_edge = child;
-      }
+    if (best_two.second_best >= 0) {
+      second_best_edge = scored_children_[best_two.second_best];
+      second_best = child_scores_[best_two.second_best];
     }
 
     if (second_best_edge) {
@@ -1050,8 +1916,10 @@ SearchWorker::NodeToProcess SearchWorker::PickNodeToExtend(
       // Only cache for n-2 steps as the estimate created by GetVisitsToReachU
       // has potential rounding errors and some conservative logic that can push
       // it up to 2 away from the real value.
-      node->UpdateBestChild(best_edge,
-                            std::max(0, estimated_visits_to_change_best - 2));
+      if (!lock_free) {
+        node->UpdateBestChild(
+            best_edge, std::max(0, estimated_visits_to_change_best - 2));
+      }
       collision_limit =
           std::min(collision_limit, estimated_visits_to_change_best);
       assert(collision_limit >= 1);
@@ -1061,16 +1929,301 @@ SearchWorker::NodeToProcess SearchWorker::PickNodeToExtend(
     if (is_root_node && possible_moves <= 1 && !search_->limits_.infinite) {
       // If there is only one move theoretically possible within remaining time,
       // output it.
-      Mutex::Lock counters_lock(search_->counters_mutex_);
-      search_->only_one_possible_move_left_ = true;
+      search_->only_one_possible_move_left_.store(true,
+                                                  std::memory_order_release);
     }
     is_root_node = false;
   }
 }
 
+int SearchWorker::ScoreChildren(Node* node, bool is_root_node,
+                                int64_t best_node_n, float puct_mult,
+                                float fpu, Node::Iterator* forced_edge) {
+  const bool certainty_propagation = params_->GetCertaintyPropagation();
+  if (is_root_node) {
+    return certainty_propagation
+               ? ScoreChildren<true, true>(node, best_node_n, puct_mult, fpu,
+                                           forced_edge)
+               : ScoreChildren<true, false>(node, best_node_n, puct_mult, fpu,
+                                            forced_edge);
+  }
+  return certainty_propagation
+             ? ScoreChildren<false, true>(node, best_node_n, puct_mult, fpu,
+                                          forced_edge)
+             : ScoreChildren<false, false>(node, best_node_n, puct_mult, fpu,
+                                           forced_edge);
+}
+
+template <bool kRoot, bool kCertaintyPropagation>
+int SearchWorker::ScoreChildren(Node* node, int64_t best_node_n,
+                                float puct_mult, float fpu,
+                                Node::Iterator* forced_edge) {
+  int possible_moves = 0;
+  const bool parent_upperbounded = node->IsOnlyUBounded();
+  // Children which can be picked are gathered into flat arrays, to be
+  // scored in one vectorized pass. If a certain win is found at root, it is
+  // picked right away and the children gathered before it only compete for
+  // the second best.
+  scored_children_.clear();
+  child_p_.clear();
+  child_n_started_.clear();
+  child_q_.clear();
+  for (auto child : node->Edges()) {
+    if (kRoot) {
+      // If there's no chance to catch up to the current best node with
+      // remaining playouts, don't consider it.
+      // best_move_node_ could have changed since best_node_n was retrieved.
+      // To ensure we have at least one node to expand, always include
+      // current best node. A tree limited to some root moves searches all of
+      // them, as the best one may be in another tree.
+      if (owned_moves_.empty() && child != search_->current_best_edge_ &&
+          search_->remaining_playouts_.load(std::memory_order_relaxed) <
+              best_node_n - child.GetN()) {
+        continue;
+      }
+      // If play certain win and don't search other
+      // moves at root. If search limit infinite continue searching other
+      // moves.
+      if (kCertaintyPropagation && child.edge()->IsCertainWin()) {
+        if (!search_->limits_.infinite) {
+          *forced_edge = child;
+          possible_moves = 1;
+          break;
+        } else if (search_->current_best_edge_ == child &&
+                   possible_moves > 0) {
+          continue;
+        }
+      }
+      // If root move filter exists, make sure move is in the list.
+      if (!root_move_filter_.empty() &&
+          std::find(root_move_filter_.begin(), root_move_filter_.end(),
+                    child.GetMove()) == root_move_filter_.end()) {
+        continue;
+      }
+      ++possible_moves;
+      // Moves owned by the other trees of the group are searched there.
+      if (!owned_moves_.empty() &&
+          std::find(owned_moves_.begin(), owned_moves_.end(),
+                    child.GetMove()) == owned_moves_.end()) {
+        continue;
+      }
+    }
+    float Q = child.GetQ(fpu);
+
+    // Certainty Propagation. Avoid suboptimal childs.
+    if (kCertaintyPropagation) {
+      // Prefers lower bounded childs over drawing children.
+      if (child.edge()->IsOnlyLBounded() && child.GetQ(0) <= 0.0f) Q = 0.01f;
+      // Prefers drawing children over upper bounded childs.
+      if (child.edge()->IsOnlyUBounded() && child.GetQ(0) >= 0.0f) Q = -0.01f;
+      // Penalize exploring suboptimal childs throughout the tree.
+      if (parent_upperbounded) {
+        if (child.edge()->IsOnlyUBounded()) Q -= child.GetN() * 0.1f;
+      }
+    }
+
+    scored_children_.push_back(child);
+    child_p_.push_back(child.GetP());
+    child_n_started_.push_back(1 + child.GetNStarted());
+    child_q_.push_back(Q);
+  }
+
+  const int scored_count = scored_children_.size();
+  child_scores_.resize(scored_count);
+  ComputePuctScores(puct_mult, child_p_.data(), child_n_started_.data(),
+                    child_q_.data(), child_scores_.data(), scored_count);
+  return possible_moves;
+}
+
+namespace {
+// Returns how many visits it takes for the PUCT score of a child to drop to
+// @target, computed like EdgeAndNode::GetVisitsToReachU().
+int GetVisitsToReachScore(float p, float n_started_plus_one, float q,
+                          float numerator, float target) {
+  if (q >= target) return std::numeric_limits<int>::max();
+  return std::max(
+      1.0f,
+      std::min(std::floor(p * numerator / (target - q) - n_started_plus_one) +
+                   1,
+               1e9f));
+}
+}  // namespace
+
+void SearchWorker::PickNodesToExtend(int visits) {
+  if (!precached_node_) {
+    precached_node_ = std::make_unique<Node>(nullptr, 0);
+  }
+  const auto lock_start = SearchProfile::Clock::now();
+  const int64_t best_node_n = search_->current_best_edge_.GetN();
+  if (params_->GetLockFreeSelection()) {
+    SharedMutex::SharedLock lock(search_->nodes_mutex_);
+    profile_.Add(SearchProfile::kLockWait, lock_start);
+    PickNodesToExtendLocked(search_->root_node_, visits, 1, best_node_n);
+    return;
+  }
+  SharedMutex::Lock lock(search_->nodes_mutex_);
+  profile_.Add(SearchProfile::kLockWait, lock_start);
+  PickNodesToExtendLocked(search_->root_node_, visits, 1, best_node_n);
+}
+
+void SearchWorker::PickNodesToExtendLocked(Node* node, int visits,
+                                           uint16_t depth,
+                                           int64_t best_node_n) {
+  const bool is_root_node = node == search_->root_node_;
+  const uint16_t piececount = (history_.Last().GetBoard().ours()).count() +
+                              (history_.Last().GetBoard().theirs()).count();
+  // The visits are booked on the node at once, and the parents already have
+  // them booked.
+  if (!node->TryStartScoreUpdate()) {
+    minibatch_.push_back(
+        NodeToProcess::Collision(node, depth, piececount, visits));
+    return;
+  }
+  if (node->IsCertain()) {
+    node->IncrementNInFlight(visits - 1);
+    minibatch_.push_back(
+        NodeToProcess::TerminalHit(node, depth, piececount, visits));
+    return;
+  }
+  if (!node->HasChildren()) {
+    // A leaf takes one visit, the others collide with its extension.
+    minibatch_.push_back(NodeToProcess::Extension(node, depth, piececount));
+    if (visits > 1) {
+      minibatch_.push_back(
+          NodeToProcess::Collision(node, depth, piececount, visits - 1));
+    }
+    return;
+  }
+  if (ShouldReevaluate(node)) {
+    // Likewise for the evaluation by the main network.
+    minibatch_.push_back(
+        NodeToProcess::Reevaluation(node, depth, piececount));
+    if (visits > 1) {
+      minibatch_.push_back(
+          NodeToProcess::Collision(node, depth, piececount, visits - 1));
+    }
+    return;
+  }
+  node->IncrementNInFlight(visits - 1);
+  // If the cached best child stays best for all the visits, they all go to
+  // it. Along a stable principal variation, that passes each node without
+  // scoring its children. The cache is not updated atomically, so it's only
+  // used when threads pick one at a time.
+  const bool lock_free = params_->GetLockFreeSelection();
+  if (Node* cached_child = lock_free ? nullptr : node->GetCachedBestChild()) {
+    PickNodesToExtendLocked(cached_child, visits, depth + 1, best_node_n);
+    return;
+  }
+
+  const float cpuct = ComputeCpuct(*params_, node->GetN());
+  const float puct_mult =
+      cpuct * std::sqrt(std::max(node->GetChildrenVisits(), 1u));
+  const float fpu = GetFpu(*params_, node, is_root_node);
+  Node::Iterator forced_edge;
+  const int possible_moves = ScoreChildren(node, is_root_node, best_node_n,
+                                           puct_mult, fpu, &forced_edge);
+  if (is_root_node && possible_moves <= 1 && !search_->limits_.infinite) {
+    search_->only_one_possible_move_left_.store(true,
+                                                std::memory_order_release);
+  }
+
+  // Hand the visits out as picking them one by one would, each run to the
+  // best child until it would fall behind the second best.
+  while (picks_by_depth_.size() <= depth) picks_by_depth_.emplace_back();
+  auto& picks = picks_by_depth_[depth];
+  picks.clear();
+  const int scored_count = scored_children_.size();
+  if (forced_edge) {
+    picks.emplace_back(forced_edge, visits);
+  } else if (scored_count > 0) {
+    child_visits_.assign(scored_count, 0);
+    for (int left = visits; left > 0;) {
+      const BestTwoScores best_two =
+          FindBestTwoScores(child_scores_.data(), scored_count);
+      const int best = best_two.best;
+      int run = left;
+      if (best_two.second_best >= 0) {
+        run = std::min(
+            run, GetVisitsToReachScore(child_p_[best], child_n_started_[best],
+                                       child_q_[best], puct_mult,
+                                       child_scores_[best_two.second_best]));
+      }
+      child_visits_[best] += run;
+      left -= run;
+      child_n_started_[best] += run;
+      ComputePuctScoresScalar(puct_mult, &child_p_[best],
+                              &child_n_started_[best], &child_q_[best],
+                              &child_scores_[best], 1);
+    }
+    for (int i = 0; i < scored_count; ++i) {
+      if (child_visits_[i]) picks.emplace_back(scored_children_[i],
+                                               child_visits_[i]);
+    }
+    // Cache the child which is best after the visits, for as long as the
+    // next visits would keep going to it. The counts already include the
+    // visits booked, as does the node's n_in_flight_.
+    const BestTwoScores best_two =
+        FindBestTwoScores(child_scores_.data(), scored_count);
+    const int best = best_two.best;
+    if (!lock_free && best_two.second_best >= 0) {
+      const int visits_to_change_best = GetVisitsToReachScore(
+          child_p_[best], child_n_started_[best], child_q_[best], puct_mult,
+          child_scores_[best_two.second_best]);
+      // Less 2 for the rounding, as in PickNodeToExtendLocked().
+      node->UpdateBestChild(scored_children_[best],
+                            std::max(0, visits_to_change_best - 2));
+    }
+  } else {
+    // Nothing to pick, give the visits back.
+    node->CancelScoreUpdate(visits);
+    minibatch_.push_back(
+        NodeToProcess::Collision(node, depth, piececount, visits));
+    return;
+  }
+
+  // The scratch space of deeper levels is reused, but not this one's.
+  for (size_t i = 0; i < picks.size(); ++i) {
+    // After a stop, the visits not handed down yet are given back rather
+    // than make the bestmove wait for the rest of the descent. Not before
+    // the root has a visit, so that there's a move.
+    if (search_->stop_.load(std::memory_order_acquire) &&
+        search_->root_node_->GetN() > 0) {
+      int left = 0;
+      for (size_t j = i; j < picks.size(); ++j) left += picks[j].second;
+      node->CancelScoreUpdate(left);
+      minibatch_.push_back(
+          NodeToProcess::Collision(node, depth, piececount, left));
+      return;
+    }
+    auto& pick = picks[i];
+    Node* child;
+    if (lock_free) {
+      Mutex::Lock spawn_lock(search_->GetSpawnMutex(node));
+      child = pick.first.GetOrSpawnNode(node, &precached_node_);
+    } else {
+      child = pick.first.GetOrSpawnNode(node, &precached_node_);
+    }
+    PickNodesToExtendLocked(child, pick.second, depth + 1, best_node_n);
+  }
+}
+
+namespace {
+CertaintyResult TablebaseResult(WDLScore wdl) {
+  // If the colors seem backwards, check the checkmate check in EvalPosition.
+  if (wdl == WDL_WIN) {
+    return {GameResult::BLACK_WON, CertaintyTrigger::TB_HIT};
+  } else if (wdl == WDL_LOSS) {
+    return {GameResult::WHITE_WON, CertaintyTrigger::TB_HIT};
+  }
+  // Cursed wins and blessed losses count as draws.
+  return {GameResult::DRAW, CertaintyTrigger::NORMAL};
+}
+}  // namespace
+
 CertaintyResult SearchWorker::EvalPosition(const Node* node,
-                                           const MoveList& legal_moves,
-                                           const ChessBoard& board) {
+                                           const FixedMoveList& legal_moves,
+                                           const ChessBoard& board,
+                                           bool* tb_deferred) {
   CertaintyResult certaintyresult = { GameResult::UNDECIDED,
                                       CertaintyTrigger::NONE };
   // Check whether it's a draw/lose by position. Importantly, we must check
@@ -1110,20 +2263,20 @@ CertaintyResult SearchWorker::EvalPosition(const Node* node,
         history_.Last().GetNoCaptureNoPawnPly() == 0 &&
         (board.ours() | board.theirs()).count() <=
             search_->syzygy_tb_->max_cardinality()) {
-      ProbeState state;
-      const WDLScore wdl =
-          search_->syzygy_tb_->probe_wdl(history_.Last(), &state);
+      if (!params_->GetSyzygyAsyncProbe()) {
+        // Probed with the rest of the minibatch.
+        tb_positions_.push_back(history_.Last());
+        *tb_deferred = true;
+        return certaintyresult;
+      }
+      ProbeState state = FAIL;
+      WDLScore wdl = WDL_DRAW;
+      // Not probed yet, the network evaluates the node instead.
+      search_->syzygy_tb_->probe_wdl_async(history_.Last(), &wdl, &state);
       // Only fail state means the WDL is wrong, probe_wdl may produce correct
       // result with a stat other than OK.
       if (state != FAIL) {
-        // If the colors seem backwards, check the checkmate check above.
-        if (wdl == WDL_WIN) {
-          certaintyresult = { GameResult::BLACK_WON, CertaintyTrigger::TB_HIT };
-        } else if (wdl == WDL_LOSS) {
-          certaintyresult = { GameResult::WHITE_WON, CertaintyTrigger::TB_HIT };
-        } else {  // Cursed wins and blessed losses count as draws.
-          certaintyresult = { GameResult::DRAW, CertaintyTrigger::NORMAL };
-        }
+        certaintyresult = TablebaseResult(wdl);
         search_->tb_hits_.fetch_add(1, std::memory_order_acq_rel);
       }
     }
@@ -1131,75 +2284,228 @@ CertaintyResult SearchWorker::EvalPosition(const Node* node,
   return certaintyresult;
 }
 
-void SearchWorker::ExtendNode(Node* node) {
-  // Initialize position sequence with pre-move position.
-  history_.Trim(search_->played_history_.GetLength());
-  std::vector<Move> to_add;
-  // Could instead reserve one more than the difference between history_.size()
-  // and history_.capacity().
-  to_add.reserve(60);
+void SearchWorker::SetHistoryToNode(Node* node) {
+  const int interval = params_->GetBoardSnapshotInterval();
+  // Moves from the node up to the root.
+  path_to_root_.clear();
+  path_nodes_.clear();
   Node* cur = node;
   while (cur != search_->root_node_) {
     Node* prev = cur->GetParent();
-    to_add.push_back(prev->GetEdgeToNode(cur)->GetMove());
+    path_to_root_.push_back(prev->GetEdgeToNode(cur)->GetMove());
+    if (interval > 0) path_nodes_.push_back(cur);
     cur = prev;
   }
-  for (int i = to_add.size() - 1; i >= 0; i--) {
-    history_.Append(to_add[i]);
+  // Keeps the positions the previous node shares with this one, usually most
+  // of them, and only appends the others.
+  const int base = search_->played_history_.GetLength();
+  const int depth = path_to_root_.size();
+  const int max_common = std::min(depth, history_.GetLength() - base);
+  int common = 0;
+  while (common < max_common &&
+         history_.GetMoveAt(base + common) ==
+             path_to_root_[depth - 1 - common]) {
+    ++common;
+  }
+  history_.Trim(base + common);
+  if (interval == 0) {
+    for (int i = depth - 1 - common; i >= 0; i--) {
+      history_.Append(path_to_root_[i]);
+    }
+    return;
+  }
+
+  // Copies the positions up to the deepest snapshot below those kept.
+  for (int ply = depth / interval * interval; ply > common; ply -= interval) {
+    const Node* anchor = path_nodes_[depth - ply];
+    auto iter = board_snapshots_.find(anchor);
+    if (iter == board_snapshots_.end()) continue;
+    const auto& moves = iter->second.moves;
+    if (!std::equal(moves.begin(), moves.end(), path_to_root_.rbegin(),
+                    path_to_root_.rbegin() + ply)) {
+      board_snapshot_bytes_ -= iter->second.GetBytes();
+      board_snapshots_.erase(iter);
+      continue;
+    }
+    history_.AppendTail(iter->second, base + ply);
+    common = ply;
+    break;
+  }
+  for (int i = depth - 1 - common; i >= 0; i--) {
+    history_.Append(path_to_root_[i]);
+    const int ply = depth - i;
+    if (ply % interval != 0) continue;
+    const Node* anchor = path_nodes_[i];
+    if (anchor->GetN() < kBoardSnapshotMinVisits ||
+        board_snapshots_.count(anchor)) {
+      continue;
+    }
+    auto& snapshot = board_snapshots_[anchor];
+    history_.GetTail(base, &snapshot);
+    board_snapshot_bytes_ += snapshot.GetBytes();
+    // Starts over when full; the lines searched now take them again.
+    if (board_snapshot_bytes_ > params_->GetBoardSnapshotMemory()) {
+      board_snapshots_.clear();
+      board_snapshot_bytes_ = 0;
+    }
   }
+}
+
+bool SearchWorker::ExtendNode(Node* node) {
+  SetHistoryToNode(node);
 
   // We don't need the mutex because other threads will see that N=0 and
   // N-in-flight=1 and will not touch this node.
   const auto& board = history_.Last().GetBoard();
-  auto legal_moves = board.GenerateLegalMoves();
+  FixedMoveList legal_moves;
+  board.GenerateLegalMoves(&legal_moves);
+  bool tb_deferred = false;
   CertaintyResult certaintyresult =
-      EvalPosition(node, legal_moves, board);
+      EvalPosition(node, legal_moves, board, &tb_deferred);
+  if (tb_deferred) return true;
 
   if (certaintyresult.trigger != CertaintyTrigger::NONE) {
     if (certaintyresult.trigger == CertaintyTrigger::TERMINAL)
       node->MakeTerminal(certaintyresult.gameresult);
     else
       node->MakeCertain(certaintyresult);
-    return;
+    return false;
   }
   // Add legal moves as edges of this node.
   node->CreateEdges(legal_moves);
+  return false;
 }
 
-// Returns whether node was already in cache.
-bool SearchWorker::AddNodeToComputation(Node* node, bool add_if_cached) {
-  const auto hash = history_.HashLast(params_.GetCacheHistoryLength() + 1);
-  // If already in cache, no need to do anything.
-  if (add_if_cached) {
-    if (computation_->AddInputByHash(hash)) return true;
-  } else {
-    if (search_->cache_->ContainsKey(hash)) return true;
+void SearchWorker::ProbeTablebaseLeaves() {
+  if (tb_leaves_.empty()) return;
+  tb_wdl_.resize(tb_positions_.size());
+  tb_states_.resize(tb_positions_.size());
+  search_->syzygy_tb_->probe_wdl_batch(tb_positions_, tb_wdl_.data(),
+                                       tb_states_.data());
+  // Leaves found are certain now, the others go to the end of the minibatch,
+  // in the order they are added to the computation.
+  std::vector<NodeToProcess> not_found;
+  for (size_t i = tb_leaves_.size(); i-- > 0;) {
+    NodeToProcess& picked_node = minibatch_[tb_leaves_[i]];
+    // Only fail state means the WDL is wrong.
+    if (tb_states_[i] != FAIL) {
+      picked_node.node->MakeCertain(TablebaseResult(tb_wdl_[i]));
+      search_->tb_hits_.fetch_add(1, std::memory_order_acq_rel);
+      FetchSingleNodeResult(&picked_node, -1);
+      certain_leaves_.push_back(picked_node);
+      ++number_certain_;
+    } else {
+      not_found.push_back(picked_node);
+    }
+    minibatch_.erase(minibatch_.begin() + tb_leaves_[i]);
   }
-  auto planes = EncodePositionForNN(history_, 8, params_.GetHistoryFill());
+  for (auto iter = not_found.rbegin(); iter != not_found.rend(); ++iter) {
+    minibatch_.push_back(*iter);
+    auto& picked_node = minibatch_.back();
+    Node* node = picked_node.node;
+    SetHistoryToNode(node);
+    FixedMoveList legal_moves;
+    history_.Last().GetBoard().GenerateLegalMoves(&legal_moves);
+    node->CreateEdges(legal_moves);
+    picked_node.nn_queried = true;
+    picked_node.is_cache_hit =
+        AddNodeToComputation(node, node->GetParent(), true);
+    if (params_->GetTranspositions()) {
+      picked_node.transposition =
+          search_->FindOrAddTransposition(history_.HashLast(1), node);
+    }
+  }
+  tb_leaves_.clear();
+  tb_positions_.clear();
+}
 
-  std::vector<uint16_t> moves;
+void SearchWorker::BackupCertainLeaves() {
+  if (certain_leaves_.empty()) return;
+  {
+    const auto lock_start = SearchProfile::Clock::now();
+    SharedMutex::Lock lock(search_->nodes_mutex_);
+    profile_.Add(SearchProfile::kLockWait, lock_start);
+    for (const NodeToProcess& node_to_process : certain_leaves_) {
+      DoBackupUpdateSingleNode(node_to_process);
+    }
+  }
+  certain_leaves_.clear();
+  NotifyBackup();
+}
 
+// Returns whether node was already in cache.
+namespace {
+// Fills @moves with the policy indices to keep in cache for the position of
+// @node.
+void GetMovesToCache(const Node* node, const ChessBoard& board,
+                     std::vector<uint16_t>* moves) {
+  moves->clear();
   if (node && node->HasChildren()) {
     // Legal moves are known, use them.
-    moves.reserve(node->GetNumEdges());
     for (const auto& edge : node->Edges()) {
-      moves.emplace_back(edge.GetMove().as_nn_index());
+      moves->emplace_back(edge.GetMove().as_nn_index());
     }
   } else {
     // Cache pseudolegal moves. A bit of a waste, but faster.
-    const auto& pseudolegal_moves =
-        history_.Last().GetBoard().GeneratePseudolegalMoves();
-    moves.reserve(pseudolegal_moves.size());
+    const auto& pseudolegal_moves = board.GeneratePseudolegalMoves();
     for (auto iter = pseudolegal_moves.begin(), end = pseudolegal_moves.end();
          iter != end; ++iter) {
-      moves.emplace_back(iter->as_nn_index());
+      moves->emplace_back(iter->as_nn_index());
     }
   }
+}
+}  // namespace
 
-  computation_->AddInput(hash, std::move(planes), std::move(moves));
+bool SearchWorker::AddNodeToComputation(Node* node, Node* parent,
+                                        bool add_if_cached, bool allow_small) {
+  const auto hash = search_->GetCacheHash(history_);
+  const bool has_small = allow_small && search_->small_network_;
+  // If already in cache, no need to do anything. An evaluation of the small
+  // network does as well, until the node is re-evaluated.
+  bool small = false;
+  if (add_if_cached) {
+    if (computation_->AddInputByHash(hash)) return true;
+    if (has_small) {
+      if (computation_->AddInputByHash(hash, true)) return true;
+      const Edge* edge = node->GetOwnEdge();
+      small = edge && edge->GetP() < params_->GetSmallNetworkPrior();
+    }
+  } else {
+    if (search_->cache_->ContainsKey(hash)) return true;
+    if (has_small) {
+      if (search_->cache_->ContainsKey(
+              CachingComputation::SmallNetworkHash(hash))) {
+        return true;
+      }
+      // Prefetched positions are all for the small network.
+      small = true;
+    }
+  }
+  // Siblings are often picked one after another, e.g. by prefetch.
+  if (parent && parent == last_encoded_parent_) {
+    last_encoded_planes_ = EncodePositionForNN(
+        last_encoded_planes_, history_, 8, params_->GetHistoryFill());
+  } else {
+    last_encoded_planes_ =
+        EncodePositionForNN(history_, 8, params_->GetHistoryFill());
+  }
+  last_encoded_parent_ = parent;
+  auto planes = last_encoded_planes_;
+  GetMovesToCache(node, history_.Last().GetBoard(), &moves_to_cache_);
+  // Only prefetch adds positions which are not needed right away.
+  computation_->AddInput(
+      hash, std::move(planes), moves_to_cache_, !add_if_cached,
+      history_.Last().GetGamePly() < params_->GetCacheOpeningPlies(), small);
   return false;
 }
 
+bool SearchWorker::ShouldReevaluate(Node* node) {
+  return node->IsSmallNetworkEval() &&
+         node->GetN() >=
+             static_cast<uint32_t>(params_->GetSmallNetworkVisits()) &&
+         node->TakeSmallNetworkEval();
+}
+
 // 3. Prefetch into cache.
 // ~~~~~~~~~~~~~~~~~~~~~~~
 void SearchWorker::MaybePrefetchIntoCache() {
@@ -1208,23 +2514,169 @@ void SearchWorker::MaybePrefetchIntoCache() {
   // nodes which are likely useful in future.
   // TODO(Videodr0me) Maybe use bounds here to more efficiently select nodes.
   if (search_->stop_.load(std::memory_order_acquire)) return;
+  MaybeWarmStart();
   if (computation_->GetCacheMisses() > 0 &&
-      computation_->GetCacheMisses() < params_.GetMaxPrefetchBatch()) {
+      computation_->GetCacheMisses() < params_->GetMaxPrefetchBatch()) {
+    ScopedPhaseTimer timer(&profile_, SearchProfile::kPrefetch);
     history_.Trim(search_->played_history_.GetLength());
+    const int misses_before = computation_->GetCacheMisses();
+    const auto lock_start = SearchProfile::Clock::now();
     SharedMutex::SharedLock lock(search_->nodes_mutex_);
-    PrefetchIntoCache(search_->root_node_, params_.GetMaxPrefetchBatch() -
-                                               computation_->GetCacheMisses());
+    profile_.Add(SearchProfile::kLockWait, lock_start);
+    if (params_->GetPrefetchThreads() > 1) {
+      prefetch_requests_.clear();
+      prefetch_path_.clear();
+    }
+    PrefetchIntoCache(search_->root_node_, nullptr,
+                      params_->GetMaxPrefetchBatch() - misses_before);
+    if (params_->GetPrefetchThreads() > 1) {
+      EncodePrefetchRequests();
+      for (auto& request : prefetch_requests_) {
+        if (request.cached) continue;
+        computation_->AddInput(request.hash, std::move(request.planes),
+                               request.moves, true, request.retain,
+                               search_->small_network_ != nullptr);
+      }
+    }
+    search_->prefetch_evals_ += computation_->GetCacheMisses() - misses_before;
   }
 }
 
+void SearchWorker::MaybeWarmStart() {
+  if (!params_->GetWarmStart() ||
+      search_->warm_started_.load(std::memory_order_relaxed)) {
+    return;
+  }
+  ScopedPhaseTimer timer(&profile_, SearchProfile::kPrefetch);
+  const auto lock_start = SearchProfile::Clock::now();
+  SharedMutex::SharedLock lock(search_->nodes_mutex_);
+  profile_.Add(SearchProfile::kLockWait, lock_start);
+  Node* root = search_->root_node_;
+  // Until then the root is being extended, by this worker or another.
+  if (root->GetN() == 0 || !root->HasChildren()) return;
+  if (search_->warm_started_.exchange(true)) return;
+  history_.Trim(search_->played_history_.GetLength());
+  const int misses_before = computation_->GetCacheMisses();
+
+  // Grandchildren by the product of their and their parent's prior.
+  typedef std::pair<float, std::pair<EdgeAndNode, EdgeAndNode>> Grandchild;
+  std::vector<Grandchild> grandchildren;
+  for (auto edge : root->Edges()) {
+    if (search_->stop_.load(std::memory_order_acquire)) return;
+    // Those being picked or visited are in the cache or on their way.
+    if (edge.GetNStarted() == 0) {
+      history_.Append(edge.GetMove());
+      AddNodeToComputation(edge.node(), root, false);
+      history_.Pop();
+      continue;
+    }
+    if (params_->GetWarmStartGrandchildren() == 0 || edge.GetN() == 0 ||
+        !edge.node()->HasChildren()) {
+      continue;
+    }
+    for (auto child : edge.node()->Edges()) {
+      if (child.GetNStarted() > 0) continue;
+      grandchildren.push_back({edge.GetP() * child.GetP(), {edge, child}});
+    }
+  }
+  const size_t count = std::min(
+      grandchildren.size(),
+      static_cast<size_t>(params_->GetWarmStartGrandchildren()));
+  std::partial_sort(grandchildren.begin(), grandchildren.begin() + count,
+                    grandchildren.end(),
+                    [](const Grandchild& a, const Grandchild& b) {
+                      return a.first > b.first;
+                    });
+  for (size_t i = 0; i < count; ++i) {
+    const auto& edge = grandchildren[i].second.first;
+    const auto& child = grandchildren[i].second.second;
+    history_.Append(edge.GetMove());
+    history_.Append(child.GetMove());
+    AddNodeToComputation(child.node(), edge.node(), false);
+    history_.Pop();
+    history_.Pop();
+  }
+  search_->prefetch_evals_ += computation_->GetCacheMisses() - misses_before;
+}
+
+void SearchWorker::EncodePrefetchRequests() {
+  // Not worth waking up a helper for fewer positions than that.
+  constexpr int kMinRequestsPerThread = 8;
+  // Helpers may start when the work is already done; they must not touch the
+  // worker then, so they check in with a state which outlives this call.
+  struct State {
+    std::atomic<size_t> next{0};
+    Mutex mutex;
+    std::condition_variable cv;
+    int active GUARDED_BY(mutex) = 0;
+    bool closed GUARDED_BY(mutex) = false;
+  };
+  auto state = std::make_shared<State>();
+  const int base_length = history_.GetLength();
+  auto work = [this, state, base_length]() {
+    PositionHistory history(history_);
+    for (size_t i = state->next++; i < prefetch_requests_.size();
+         i = state->next++) {
+      PrefetchRequest& request = prefetch_requests_[i];
+      history.Trim(base_length);
+      for (const Move move : request.path) history.Append(move);
+      request.hash = search_->GetCacheHash(history);
+      request.cached =
+          search_->cache_->ContainsKey(request.hash) ||
+          (search_->small_network_ &&
+           search_->cache_->ContainsKey(
+               CachingComputation::SmallNetworkHash(request.hash)));
+      if (request.cached) continue;
+      request.planes =
+          EncodePositionForNN(history, 8, params_->GetHistoryFill());
+      GetMovesToCache(request.node, history.Last().GetBoard(), &request.moves);
+      request.retain =
+          history.Last().GetGamePly() < params_->GetCacheOpeningPlies();
+    }
+  };
+
+  const int helpers =
+      std::min(params_->GetPrefetchThreads() - 1,
+               static_cast<int>(prefetch_requests_.size()) /
+                   kMinRequestsPerThread);
+  for (int i = 0; i < helpers; ++i) {
+    search_->prefetch_pool_.Add([state, work]() {
+      {
+        Mutex::Lock lock(state->mutex);
+        if (state->closed) return;
+        ++state->active;
+      }
+      work();
+      {
+        Mutex::Lock lock(state->mutex);
+        --state->active;
+      }
+      state->cv.notify_all();
+    });
+  }
+  work();
+  Mutex::Lock lock(state->mutex);
+  state->closed = true;
+  state->cv.wait(lock.get_raw(), [&]() NO_THREAD_SAFETY_ANALYSIS {
+    return state->active == 0;
+  });
+}
+
 // Prefetches up to @budget nodes into cache. Returns number of nodes
 // prefetched.
-int SearchWorker::PrefetchIntoCache(Node* node, int budget) {
+int SearchWorker::PrefetchIntoCache(Node* node, Node* parent, int budget) {
   if (budget <= 0) return 0;
 
   // We are in a leaf, which is not yet being processed.
   if (!node || node->GetNStarted() == 0) {
-    if (AddNodeToComputation(node, false)) {
+    if (params_->GetPrefetchThreads() > 1) {
+      // Encoded later by EncodePrefetchRequests().
+      prefetch_requests_.emplace_back();
+      prefetch_requests_.back().node = node;
+      prefetch_requests_.back().path = prefetch_path_;
+      return 1;
+    }
+    if (AddNodeToComputation(node, parent, false)) {
       // Make it return 0 to make it not use the slot, so that the function
       // tries hard to find something to cache even among unpopular moves.
       // In practice that slows things down a lot though, as it's not always
@@ -1243,10 +2695,10 @@ int SearchWorker::PrefetchIntoCache(Node* node, int budget) {
   // Populate all subnodes and their scores.
   typedef std::pair<float, EdgeAndNode> ScoredEdge;
   std::vector<ScoredEdge> scores;
-  const float cpuct = ComputeCpuct(params_, node->GetN());
+  const float cpuct = ComputeCpuct(*params_, node->GetN());
   const float puct_mult =
       cpuct * std::sqrt(std::max(node->GetChildrenVisits(), 1u));
-  const float fpu = GetFpu(params_, node, node == search_->root_node_);
+  const float fpu = GetFpu(*params_, node, node == search_->root_node_);
   for (auto edge : node->Edges()) {
     if (edge.GetP() == 0.0f) continue;
     // Flip the sign of a score to be able to easily sort.
@@ -1290,9 +2742,21 @@ int SearchWorker::PrefetchIntoCache(Node* node, int budget) {
         budget_to_spend = budget;
       }
     }
-    history_.Append(edge.GetMove());
-    const int budget_spent = PrefetchIntoCache(edge.node(), budget_to_spend);
-    history_.Pop();
+    // History is only needed to encode the leaves; with helper threads they
+    // replay the path themselves.
+    const bool track_path = params_->GetPrefetchThreads() > 1;
+    if (track_path) {
+      prefetch_path_.push_back(edge.GetMove());
+    } else {
+      history_.Append(edge.GetMove());
+    }
+    const int budget_spent =
+        PrefetchIntoCache(edge.node(), node, budget_to_spend);
+    if (track_path) {
+      prefetch_path_.pop_back();
+    } else {
+      history_.Pop();
+    }
     budget -= budget_spent;
     total_budget_spent += budget_spent;
   }
@@ -1301,17 +2765,41 @@ int SearchWorker::PrefetchIntoCache(Node* node, int budget) {
 
 // 4. Run NN computation.
 // ~~~~~~~~~~~~~~~~~~~~~~
-void SearchWorker::RunNNComputation() { computation_->ComputeBlocking(); }
+void SearchWorker::RunNNComputation() {
+  ScopedPhaseTimer timer(&profile_, SearchProfile::kCompute);
+  TRACE_SCOPE("search compute");
+  const auto start = std::chrono::steady_clock::now();
+  computation_->ComputeBlocking();
+  RecordBatchMetrics(computation_->GetCacheMisses(), start);
+}
+
+void SearchWorker::RecordBatchMetrics(
+    int batch_size, std::chrono::steady_clock::time_point start) {
+  if (batch_size == 0) return;
+  const auto latency_us =
+      std::chrono::duration_cast<std::chrono::microseconds>(
+          std::chrono::steady_clock::now() - start)
+          .count();
+  gNNBatchesMetric.Add();
+  gNNPositionsMetric.Add(batch_size);
+  gNNLatencyMetric.Add(latency_us);
+  counters_->nn_batches.fetch_add(1, std::memory_order_relaxed);
+  counters_->nn_us.fetch_add(latency_us, std::memory_order_relaxed);
+}
 
 // 5. Retrieve NN computations (and terminal values) into nodes.
 // ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 void SearchWorker::FetchMinibatchResults() {
+  ScopedPhaseTimer timer(&profile_, SearchProfile::kFetch);
+  TRACE_SCOPE("search fetch");
+  NodeArena::ScopedAccount scope(search_->tree_account_);
   // Populate NN/cached results, or terminal results, into nodes.
   int idx_in_computation = 0;
   for (auto& node_to_process : minibatch_) {
     FetchSingleNodeResult(&node_to_process, idx_in_computation);
     if (node_to_process.nn_queried) ++idx_in_computation;
   }
+  search_->prefetch_hits_ += computation_->GetPrefetchedHits();
 }
 
 void SearchWorker::FetchSingleNodeResult(NodeToProcess* node_to_process,
@@ -1330,7 +2818,7 @@ void SearchWorker::FetchSingleNodeResult(NodeToProcess* node_to_process,
   // Dynamic Trade Penalty
   auto Q = -computation_->GetQVal(idx_in_computation);
   if (Q > -0.25 && node_to_process->depth % 2 == 0) {
-    auto penalty = params_.GetTradePenalty() * (node_to_process->piececount - params_.GetTradePenalty2());
+    auto penalty = params_->GetTradePenalty() * (node_to_process->piececount - params_->GetTradePenalty2());
     if (Q < 0) {
       penalty *= (Q*4)+1;
     }
@@ -1338,7 +2826,7 @@ void SearchWorker::FetchSingleNodeResult(NodeToProcess* node_to_process,
   } else if (Q < 0.25 && node_to_process->depth % 2 == 1) {
     // We flip penalty sign for Leela's moves (odd depths)
     // (opponent depth is even depths and has opposite sign):
-    auto penalty = params_.GetTradePenalty() * (node_to_process->piececount - params_.GetTradePenalty2());    
+    auto penalty = params_->GetTradePenalty() * (node_to_process->piececount - params_->GetTradePenalty2());    
     if (Q > 0) {
       penalty *= 1-(Q*4);
     }
@@ -1346,28 +2834,45 @@ void SearchWorker::FetchSingleNodeResult(NodeToProcess* node_to_process,
   } else {
     node_to_process->v = Q;
   }
-  // ...and secondly, the policy data.
-  float total = 0.0;
+  // ...and secondly, the policy data, fetched for all moves at once.
+  const int num_edges = node->GetNumEdges();
+  policy_moves_.clear();
   for (auto edge : node->Edges()) {
-    float p =
-        computation_->GetPVal(idx_in_computation, edge.GetMove().as_nn_index());
-    if (params_.GetPolicySoftmaxTemp() != 1.0f) {
-      // Flush denormals to zero.
-      p = p < 1.17549435E-38
-              ? 0.0
-              : FastPow2(FastLog2(p) / params_.GetPolicySoftmaxTemp());
-    }
-    edge.edge()->SetP(p);
-    // Edge::SetP does some rounding, so only add to the total after rounding.
-    total += edge.edge()->GetP();
+    policy_moves_.push_back(edge.GetMove().as_nn_index());
+  }
+  policy_priors_.resize(num_edges);
+  computation_->GetPVals(idx_in_computation, policy_moves_.data(), num_edges,
+                         policy_priors_.data());
+  // With DevicePolicy the backend has tempered the priors already.
+  if (params_->GetPolicySoftmaxTemp() != 1.0f &&
+      search_->device_policy_temp_ == 0.0f) {
+    TemperPriors(policy_priors_.data(), num_edges,
+                 params_->GetPolicySoftmaxTemp());
+  }
+  // Edge::SetP does some rounding, so the total is of the rounded priors.
+  float total = 0.0;
+  for (auto& p : policy_priors_) {
+    p = Edge::RoundP(p);
+    total += p;
   }
   // Normalize P values to add up to 1.0.
-  if (total > 0.0f) {
-    const float scale = 1.0f / total;
-    for (auto edge : node->Edges()) edge.edge()->SetP(edge.GetP() * scale);
+  const float scale = total > 0.0f ? 1.0f / total : 1.0f;
+  if (node_to_process->is_reevaluation) {
+    // Other threads may be selecting through the node.
+    for (auto& p : policy_priors_) p *= scale;
+    SharedMutex::Lock lock(search_->nodes_mutex_);
+    node->ReplacePriors(policy_priors_.data());
+    return;
+  }
+  int i = 0;
+  for (auto edge : node->Edges()) {
+    edge.edge()->SetP(policy_priors_[i++] * scale);
+  }
+  if (computation_->IsFromSmallNetwork(idx_in_computation)) {
+    node->SetSmallNetworkEval();
   }
   // Add Dirichlet noise if enabled and at root.
-  if (params_.GetNoise() && node == search_->root_node_) {
+  if (params_->GetNoise() && node == search_->root_node_) {
     ApplyDirichletNoise(node, 0.25, 0.3);
   }
 }
@@ -1375,14 +2880,43 @@ void SearchWorker::FetchSingleNodeResult(NodeToProcess* node_to_process,
 // 6. Propagate the new nodes' information to all their parents in the tree.
 // ~~~~~~~~~~~~~~
 void SearchWorker::DoBackupUpdate() {
-  // Nodes mutex for doing node updates.
-  SharedMutex::Lock lock(search_->nodes_mutex_);
+  ScopedPhaseTimer timer(&profile_, SearchProfile::kBackup);
+  TRACE_SCOPE("search backup");
+  if (minibatch_.empty()) return;
+  NodeArena::ScopedAccount scope(search_->tree_account_);
+  if (params_->GetBatchedBackup()) {
+    DoBatchedBackupUpdate();
+  } else {
+    // Nodes mutex for doing node updates.
+    const auto lock_start = SearchProfile::Clock::now();
+    SharedMutex::Lock lock(search_->nodes_mutex_);
+    profile_.Add(SearchProfile::kLockWait, lock_start);
 
-  for (const NodeToProcess& node_to_process : minibatch_) {
-    DoBackupUpdateSingleNode(node_to_process);
+    for (const NodeToProcess& node_to_process : minibatch_) {
+      DoBackupUpdateSingleNode(node_to_process);
+    }
   }
+  // Even collisions free their nodes for picking again.
+  NotifyBackup();
+}
+
+constexpr std::chrono::milliseconds SearchWorker::kIdleTimeout;
+
+void SearchWorker::NotifyBackup() {
+  search_->NotifyBackup();
+  ++own_backups_;
 }
 
+void SearchWorker::DoBackupUpdateSingleNode(
+    const NodeToProcess& node_to_process) REQUIRES(search_->nodes_mutex_) {
+  if (params_->GetCertaintyPropagation()) {
+    DoBackupUpdateSingleNode<true>(node_to_process);
+  } else {
+    DoBackupUpdateSingleNode<false>(node_to_process);
+  }
+}
+
+template <bool kCertaintyPropagation>
 void SearchWorker::DoBackupUpdateSingleNode(
     const NodeToProcess& node_to_process) REQUIRES(search_->nodes_mutex_) {
   Node* node = node_to_process.node;
@@ -1398,6 +2932,13 @@ void SearchWorker::DoBackupUpdateSingleNode(
   // Backup V value up to a root. After 1 visit, V = Q.
   float v = node_to_process.v;
   float d = node_to_process.d;
+  // A transposition already has a better informed value than a single eval.
+  const Node* transposition = node_to_process.transposition;
+  if (transposition && transposition->GetN() > 0 &&
+      !transposition->IsCertain()) {
+    v = transposition->GetQ();
+    d = transposition->GetD();
+  }
   bool origin_bounded = node->IsBounded();
   for (Node* n = node; n != search_->root_node_->GetParent();
        n = n->GetParent()) {
@@ -1406,7 +2947,7 @@ void SearchWorker::DoBackupUpdateSingleNode(
     // check all childs, and update bounds/certainty.
     float prev_q = -100.0f;
     float prev_d = -100.0f;
-    if (params_.GetCertaintyPropagation() && n != node && (origin_bounded) &&
+    if (kCertaintyPropagation && n != node && (origin_bounded) &&
         !n->IsCertain()) {
       bool based_on_propagated_tbhit = false;
       int lower_bound = -1;
@@ -1443,7 +2984,7 @@ void SearchWorker::DoBackupUpdateSingleNode(
     }
 
     // Certainty propagation: reduce error by keeping score in proven bounds.
-    if (params_.GetCertaintyPropagation() && n->GetParent() &&
+    if (kCertaintyPropagation && n->GetParent() &&
         !n->IsCertain()) {
       if (n->GetOwnEdge()->IsUBounded() && v > 0.0f) v = 0.00f;
       if (n->GetOwnEdge()->IsLBounded() && v < 0.0f) v = 0.00f;
@@ -1453,7 +2994,7 @@ void SearchWorker::DoBackupUpdateSingleNode(
 
     // Certainty propagation: adjust Qs along the path as if all visits already
     // had propagated the certain result.
-    if (params_.GetCertaintyPropagation() && (prev_q != -100.0f) &&
+    if (kCertaintyPropagation && (prev_q != -100.0f) &&
         (prev_q != v) && n->IsCertain()) {
       v = v + (v - prev_q) * (n->GetN() - 1);
       d = d + (d - prev_d) * (n->GetN() - 1);
@@ -1470,23 +3011,125 @@ void SearchWorker::DoBackupUpdateSingleNode(
           search_->GetBestChildNoTemperature(search_->root_node_);
     }
   }
-  search_->total_playouts_ += node_to_process.multivisit;
-  search_->cum_depth_ += node_to_process.depth * node_to_process.multivisit;
-  search_->max_depth_ = std::max(search_->max_depth_, node_to_process.depth);
+  AddPlayouts(node_to_process.multivisit,
+              node_to_process.depth * node_to_process.multivisit,
+              node_to_process.depth);
 }  // namespace lczero
 
+void SearchWorker::DoBatchedBackupUpdate() {
+  // Q and D are running averages, so k updates of a node can be replaced by
+  // one update with the visit-weighted mean of the values and the sum of the
+  // visits.
+  backup_deltas_.clear();
+  sequential_backups_.clear();
+  const Node* const stop_node = search_->root_node_->GetParent();
+  int playouts = 0;
+  uint64_t cum_depth = 0;
+  uint16_t max_depth = 0;
+  {
+    // Bounds are only changed under the exclusive lock, so it's enough to
+    // read them under the shared one.
+    const auto lock_start = SearchProfile::Clock::now();
+    SharedMutex::SharedLock lock(search_->nodes_mutex_);
+    profile_.Add(SearchProfile::kLockWait, lock_start);
+    for (const NodeToProcess& node_to_process : minibatch_) {
+      Node* node = node_to_process.node;
+      const int multivisit = node_to_process.multivisit;
+      if (node_to_process.IsCollision()) {
+        for (Node* n = node->GetParent(); n != stop_node; n = n->GetParent()) {
+          backup_deltas_[n].cancels += multivisit;
+        }
+        continue;
+      }
+      // Bounded origin may make ancestors certain on the way up, which
+      // changes the values backed up above them.
+      if (params_->GetCertaintyPropagation() && node->IsBounded()) {
+        sequential_backups_.push_back(&node_to_process);
+        continue;
+      }
+      float v = node_to_process.v;
+      float d = node_to_process.d;
+      const Node* transposition = node_to_process.transposition;
+      if (transposition && transposition->GetN() > 0 &&
+          !transposition->IsCertain()) {
+        v = transposition->GetQ();
+        d = transposition->GetD();
+      }
+      for (Node* n = node; n != stop_node; n = n->GetParent()) {
+        if (params_->GetCertaintyPropagation() && n->GetParent() &&
+            !n->IsCertain()) {
+          if (n->GetOwnEdge()->IsUBounded() && v > 0.0f) v = 0.00f;
+          if (n->GetOwnEdge()->IsLBounded() && v < 0.0f) v = 0.00f;
+        }
+        BackupDelta& delta = backup_deltas_[n];
+        delta.v += v * multivisit;
+        delta.d += d * multivisit;
+        delta.visits += multivisit;
+        v = -v;
+      }
+      playouts += multivisit;
+      cum_depth += node_to_process.depth * multivisit;
+      max_depth = std::max(max_depth, node_to_process.depth);
+    }
+  }
+
+  const auto lock_start = SearchProfile::Clock::now();
+  SharedMutex::Lock lock(search_->nodes_mutex_);
+  profile_.Add(SearchProfile::kLockWait, lock_start);
+  bool root_child_updated = false;
+  for (const auto& entry : backup_deltas_) {
+    Node* n = entry.first;
+    const BackupDelta& delta = entry.second;
+    if (delta.cancels > 0) n->CancelScoreUpdate(delta.cancels);
+    if (delta.visits == 0) continue;
+    n->FinalizeScoreUpdate(delta.v / delta.visits, delta.d / delta.visits,
+                           delta.visits);
+    if (n->GetParent() == search_->root_node_) root_child_updated = true;
+  }
+  if (root_child_updated) {
+    search_->current_best_edge_ =
+        search_->GetBestChildNoTemperature(search_->root_node_);
+  }
+  AddPlayouts(playouts, cum_depth, max_depth);
+
+  for (const NodeToProcess* node_to_process : sequential_backups_) {
+    DoBackupUpdateSingleNode(*node_to_process);
+  }
+}
+
 // 7. Update the Search's status and progress information.
 //~~~~~~~~~~~~~~~~~~~~
+void SearchWorker::AddPlayouts(int playouts, uint64_t cum_depth,
+                               uint16_t max_depth) {
+  // No other thread writes them, so plain stores do.
+  auto& counters = *counters_;
+  counters.playouts.store(
+      counters.playouts.load(std::memory_order_relaxed) + playouts,
+      std::memory_order_relaxed);
+  counters.cum_depth.store(
+      counters.cum_depth.load(std::memory_order_relaxed) + cum_depth,
+      std::memory_order_relaxed);
+  if (max_depth > counters.max_depth.load(std::memory_order_relaxed)) {
+    counters.max_depth.store(max_depth, std::memory_order_relaxed);
+  }
+}
+
 void SearchWorker::UpdateCounters() {
-  search_->UpdateRemainingMoves();  // Updates smart pruning counters.
-  search_->UpdateKLDGain();
-  search_->MaybeTriggerStop();
-  search_->MaybeOutputInfo();
-
-  // If this thread had no work, not even out of order, then sleep for some
-  // milliseconds. Collisions don't count as work, so have to enumerate to find
-  // out if there was anything done.
-  bool work_done = number_out_of_order_ > 0;
+  // Before a stop may be triggered, so that the move stats include this
+  // iteration.
+  FlushProfile();
+  // Otherwise the watchdog does it. Deterministic searches have to stop after
+  // the same iteration every time.
+  if (params_->GetDeterministic() ||
+      !search_->has_watchdog_.load(std::memory_order_acquire)) {
+    search_->UpdateStatus();
+  }
+
+  // If this thread had no work, not even out of order, then wait until a
+  // backup of another thread might have freed some nodes, for at most some
+  // milliseconds. Collisions don't count as work, so have to enumerate to
+  // find out if there was anything done.
+  bool work_done = number_out_of_order_ > 0 || number_certain_ > 0;
   if (!work_done) {
     for (NodeToProcess& node_to_process : minibatch_) {
       if (!node_to_process.IsCollision()) {
@@ -1496,7 +3139,85 @@ void SearchWorker::UpdateCounters() {
     }
   }
   if (!work_done) {
-    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    const auto start = SearchProfile::Clock::now();
+    search_->WaitForBackup(idle_epoch_ + own_backups_, kIdleTimeout);
+    profile_.Add(SearchProfile::kIdle, start);
+    counters_->idle_us.fetch_add(
+        std::chrono::duration_cast<std::chrono::microseconds>(
+            SearchProfile::Clock::now() - start)
+            .count(),
+        std::memory_order_relaxed);
+  }
+}
+
+void SearchWorker::FlushProfile() {
+  {
+    Mutex::Lock lock(search_->profile_mutex_);
+    search_->profile_.Merge(profile_);
+  }
+  profile_.Clear();
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// SearchThreads
+//////////////////////////////////////////////////////////////////////////////
+
+SearchThreads::~SearchThreads() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    exit_ = true;
+  }
+  cv_.notify_all();
+  for (auto& thread : threads_) thread.join();
+}
+
+void SearchThreads::RunBlocking(Search* search, size_t how_many) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    while (threads_.size() < how_many) {
+      const size_t index = threads_.size();
+      workers_.emplace_back();
+      threads_.emplace_back([this, index]() { Worker(index); });
+    }
+    search_ = search;
+    active_ = how_many;
+    running_ = how_many;
+    ++generation_;
+  }
+  search->has_watchdog_.store(true, std::memory_order_release);
+  cv_.notify_all();
+  search->WatchdogThread();
+  std::unique_lock<std::mutex> lock(mutex_);
+  cv_.wait(lock, [this]() { return running_ == 0; });
+  search_ = nullptr;
+}
+
+void SearchThreads::Worker(size_t index) {
+  uint64_t generation = 0;
+  while (true) {
+    Search* search;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      cv_.wait(lock, [&]() {
+        return exit_ || (generation_ != generation && index < active_);
+      });
+      if (exit_) return;
+      generation = generation_;
+      search = search_;
+    }
+    auto& worker = workers_[index];
+    if (worker) {
+      worker->Reset(search);
+    } else {
+      worker = std::make_unique<SearchWorker>(search, search->GetParams(),
+                                              index);
+    }
+    worker->RunBlocking();
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      --running_;
+    }
+    cv_.notify_all();
   }
 }
 
@@ -27,28 +27,68 @@
 
 #pragma once
 
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
 #include <functional>
+#include <future>
 #include <shared_mutex>
 #include <thread>
+#include <unordered_map>
 #include "chess/callbacks.h"
 #include "chess/uciloop.h"
+#include "mcts/autotune.h"
 #include "mcts/node.h"
 #include "mcts/params.h"
+#include "mcts/profile.h"
 #include "neural/cache.h"
 #include "neural/network.h"
 #include "syzygy/syzygy.h"
 #include "utils/logging.h"
 #include "utils/mutex.h"
 #include "utils/optional.h"
+#include "utils/threadpool.h"
 
 namespace lczero {
 
+// Playout statistics of one worker. Only the worker writes them, without
+// locks, and the watchdog sums them up. Allocations are only 16 byte aligned,
+// so the padding keeps the counters of two workers off a common cache line.
+struct WorkerCounters {
+  std::atomic<int64_t> playouts{0};
+  std::atomic<uint64_t> cum_depth{0};
+  // Time the worker waited for others as it had nothing to pick.
+  std::atomic<uint64_t> idle_us{0};
+  // Picked visits, and those of them which collided, for the auto-tuner.
+  std::atomic<uint64_t> picked{0};
+  std::atomic<uint64_t> collisions{0};
+  // NN computations of the worker and the time they took.
+  std::atomic<uint64_t> nn_batches{0};
+  std::atomic<uint64_t> nn_us{0};
+  std::atomic<uint16_t> max_depth{0};
+  char padding[128 - 7 * sizeof(int64_t) - sizeof(uint16_t)];
+};
+
 struct SearchLimits {
   // Type for N in nodes is currently uint32_t, so set limit in order not to
   // overflow it.
   std::int64_t visits = 4000000000;
   std::int64_t playouts = -1;
   int depth = -1;
+  // Maximum number of bytes the search tree may take, -1 for no limit.
+  std::int64_t tree_memory = -1;
+  // When the tree nears tree_memory, prune the least visited subtrees off
+  // the principal variation so that the search goes on rather than stop.
+  bool prune_tree = false;
+  // When the search stops for a limit, it sends bestmove and then keeps
+  // searching silently until the root has that many visits, the tree memory
+  // limit is reached or it's stopped. -1 not to.
+  std::int64_t background_visits = -1;
+  // Visits per second expected from earlier searches, which smart pruning
+  // goes by until the search measured its own speed. 0 if unknown.
+  std::int64_t predicted_nps = 0;
   optional<std::chrono::steady_clock::time_point> search_deadline;
   bool infinite = false;
   MoveList searchmoves;
@@ -56,6 +96,65 @@ struct SearchLimits {
   std::string DebugString() const;
 };
 
+// Root statistics of the searches of a root parallel group, each searching
+// the same position on a tree of its own. The searches publish theirs as they
+// go, and pick moves by the visits summed over all trees. The trees may be
+// searched by other hosts (see mcts/distributed.h), and may each be limited
+// to a subset of the root moves.
+class SharedRootStats {
+ public:
+  struct EdgeStats {
+    Move move;
+    uint32_t n = 0;
+    float q = 0.0f;
+    float d = 0.0f;
+    float p = 0.0f;
+    // Most visited line after the move, only if the stats keep lines.
+    std::vector<Move> pv;
+  };
+  struct TreeStats {
+    std::vector<EdgeStats> edges;
+    uint64_t visits = 0;
+    int64_t playouts = 0;
+  };
+
+  // With @keep_pvs, the searches also publish the most visited line of every
+  // root move.
+  explicit SharedRootStats(int trees, bool keep_pvs = false)
+      : trees_(trees), owned_(trees), keep_pvs_(keep_pvs) {}
+
+  // Stores the root statistics of the tree @index.
+  void Publish(int index, const Node* root, int64_t playouts);
+  // Same, for a tree which isn't searched in this process.
+  void Publish(int index, TreeStats tree);
+  TreeStats Get(int index) const;
+  int GetTreeCount() const;
+  // Returns the visits of the root edge number @edge_index, which is @move,
+  // summed over the trees other than @index.
+  uint64_t GetOtherVisits(int index, int edge_index, Move move) const;
+  // Returns the stats of the root edge @move summed over the trees other than
+  // @index, Q and D averaged by visits, and the line of the tree with the
+  // most visits of it.
+  EdgeStats GetOtherEdge(int index, Move move) const;
+  // Returns the root visits and the playouts summed over the trees other
+  // than @index.
+  std::pair<uint64_t, int64_t> GetOtherTotals(int index) const;
+
+  // Limits the tree @index to the root @moves, empty for all of them.
+  void SetOwnedMoves(int index, MoveList moves);
+  // If the root moves of the tree @index changed since @epoch, updates
+  // @epoch, stores them to @moves and returns true.
+  bool GetOwnedMoves(int index, uint64_t* epoch, MoveList* moves) const;
+
+ private:
+  mutable Mutex mutex_;
+  std::vector<TreeStats> trees_ GUARDED_BY(mutex_);
+  std::vector<MoveList> owned_ GUARDED_BY(mutex_);
+  // Bumped whenever the owned moves change, read without the lock.
+  std::atomic<uint64_t> owned_epoch_{0};
+  const bool keep_pvs_;
+};
+
 class Search {
  public:
   Search(const NodeTree& tree, Network* network,
@@ -95,6 +194,31 @@ class Search {
   std::int64_t GetTotalPlayouts() const;
   // Returns the search parameters.
   const SearchParams& GetParams() const { return params_; }
+  // Makes the search the tree @index of a root parallel group. To be called
+  // before starting threads.
+  void SetRootStats(SharedRootStats* stats, int index) {
+    root_stats_ = stats;
+    root_stats_index_ = index;
+  }
+  // Makes the search take its minibatch size and number of active threads
+  // from @tuner, and feed it with measurements. To be called before starting
+  // threads.
+  void SetAutoTuner(AutoTuner* tuner);
+  // Has @network, which is smaller than the main one, evaluate prefetched
+  // positions and leaves of a low prior, see SmallNetworkPrior. To be called
+  // before starting threads.
+  void SetSmallNetwork(Network* network) { small_network_ = network; }
+  // Sets the priority of the search's NN computations, see
+  // ComputationPriority. Infinite searches are background ones unless set
+  // otherwise, as are searches going on after bestmove. To be called before
+  // starting threads.
+  void SetComputationPriority(ComputationPriority priority) {
+    priority_ = priority;
+  }
+  // With Noise, adds Dirichlet noise to the priors of a root which was
+  // expanded by an earlier search without it, as by pondering. To be called
+  // before starting threads.
+  void ApplyRootNoise();
 
  private:
   // Computes the best move, maybe with temperature (according to the settings).
@@ -111,14 +235,82 @@ class Search {
 
   int64_t GetTimeSinceStart() const;
   int64_t GetTimeToDeadline() const;
+  // Returns counters for a new worker of this search.
+  WorkerCounters* NewWorkerCounters();
+  // Counts a backup and wakes the workers waiting for one.
+  void NotifyBackup();
+  // Waits until backup_epoch_ is past @epoch, the search stops or @timeout
+  // passes.
+  void WaitForBackup(uint64_t epoch, std::chrono::microseconds timeout);
+  // Returns a line with the idle time of every worker.
+  std::string GetIdleStats() const;
+  // Sums the worker counters up into total_playouts_, cum_depth_ and
+  // max_depth_.
+  void AggregateCounters();
+  // Aggregates the counters, then checks the stop conditions and sends info
+  // on them. Runs on the watchdog, and on the workers in deterministic mode.
+  void UpdateStatus();
   void UpdateRemainingMoves();
   void UpdateKLDGain();
+  void PublishRootStats();
   void MaybeTriggerStop();
   void MaybeOutputInfo();
-  void SendUciInfo();  // Requires nodes_mutex_ to be held.
+  // Feeds the tuner with the interval since the last call, if it's long
+  // enough, and applies its settings.
+  void MaybeAutoTune();
+  // Minibatch size to gather, the tuner's if any.
+  int GetMiniBatchSize() const {
+    return minibatch_size_.load(std::memory_order_relaxed);
+  }
+  // Whether the worker number @index is to wait, as the tuner runs fewer
+  // threads.
+  bool IsParked(int index) const {
+    return index >= active_threads_.load(std::memory_order_relaxed);
+  }
+  // Waits until the worker number @index is no longer parked or the search
+  // stops.
+  void WaitWhileParked(int index);
+  // Requires nodes_mutex_ and counters_mutex_ to be held.
+  void SendUciInfo();
+  // Returns the info SendUciInfo() sends, and remembers it as sent.
+  std::vector<ThinkingInfo> GetUciInfos() REQUIRES(nodes_mutex_)
+      REQUIRES(counters_mutex_);
   // Sets stop to true and notifies watchdog thread.
   void FireStopInternal();
-  void SendMovesStats() const;
+  // Stops when a limit is reached, unless the search is to go on in the
+  // background after bestmove.
+  void StopForLimit() REQUIRES(nodes_mutex_) REQUIRES(counters_mutex_);
+  void SendBestMove() REQUIRES(nodes_mutex_) REQUIRES(counters_mutex_);
+  // Statistics of a child, as shown in the verbose move stats.
+  struct ChildStats {
+    // From the point of view of the player to move, and in the NN encoding.
+    Move move;
+    uint16_t nn_index;
+    uint32_t n;
+    uint32_t n_in_flight;
+    float p;
+    float q;
+    float d;
+    float u;
+    optional<float> v;
+    uint8_t certainty_state;
+  };
+  // Verbose move stats, taken under the nodes lock to be formatted later.
+  struct MovesStats {
+    std::vector<ChildStats> root;
+    // Children of the best move, if it's known.
+    std::vector<ChildStats> after_best;
+  };
+  MovesStats GetMovesStats() const REQUIRES(nodes_mutex_)
+      REQUIRES(counters_mutex_);
+  void SendMovesStats(const MovesStats& stats) const
+      REQUIRES(counters_mutex_);
+  // Returns whether the tree reached its memory limit. Prunes it when close
+  // to the limit, if allowed.
+  bool IsOutOfTreeMemory() REQUIRES(nodes_mutex_) REQUIRES(counters_mutex_);
+  // Collapses the least visited subtrees off the principal variation until
+  // about a quarter of the visits are gone.
+  void PruneTree() REQUIRES(nodes_mutex_);
   // Function which runs in a separate thread and watches for time and
   // uci `stop` command;
   void WatchdogThread();
@@ -132,18 +324,44 @@ class Search {
   // moves are root filtered, because kSyzygyFastPlayId sets the rep flag.
   int PopulateRootMoveLimit(MoveList* root_moves) const;
 
-  // Returns verbose information about given node, as vector of strings.
-  std::vector<std::string> GetVerboseStats(Node* node,
-                                           bool is_black_to_move) const;
+  // Returns the stats of the children of @node, in the order shown.
+  std::vector<ChildStats> GetChildStats(Node* node,
+                                        bool is_black_to_move) const;
+  // Formats child stats, one line per child.
+  static std::vector<std::string> FormatChildStats(
+      const std::vector<ChildStats>& stats);
+  // Adds the progress since the last call to the process metrics.
+  void PublishMetrics() REQUIRES(nodes_mutex_) REQUIRES(counters_mutex_);
+
+  // Returns a line with NN cache counters since the search started.
+  std::string GetCacheStats() const;
+  // Same for the Syzygy probe cache.
+  std::string GetTablebaseCacheStats() const;
 
   // Returns NN eval for a given node from cache, if that node is cached.
   NNCacheLock GetCachedNNEval(Node* node) const;
+  // Returns the NN cache key of the last position of @history.
+  uint64_t GetCacheHash(const PositionHistory& history) const;
+
+  // Returns mutex which guards spawning children of a @node when nodes are
+  // picked under a shared nodes_mutex_ lock.
+  Mutex& GetSpawnMutex(const Node* node) const;
 
-  mutable Mutex counters_mutex_ ACQUIRED_AFTER(nodes_mutex_);
+  // Returns the node which was first seen for the position with @hash, or
+  // remembers @node for it and returns nullptr.
+  Node* FindOrAddTransposition(uint64_t hash, Node* node);
+
+  mutable Mutex counters_mutex_ ACQUIRED_AFTER(nodes_mutex_){"counters"};
   // Tells all threads to stop.
   std::atomic<bool> stop_{false};
   // Condition variable used to watch stop_ variable.
   std::condition_variable watchdog_cv_;
+  // Counts backups, which may make nodes pickable again, for workers waiting
+  // in WaitForBackup() as they found nothing to do.
+  std::atomic<uint64_t> backup_epoch_{0};
+  std::atomic<int> idle_workers_{0};
+  Mutex idle_mutex_{"idle"};
+  std::condition_variable idle_cv_;
   // Tells whether it's ok to respond bestmove when limits are reached.
   // If false (e.g. during ponder or `go infinite`) the search stops but nothing
   // is responded until `stop` uci command.
@@ -152,7 +370,13 @@ class Search {
   // should not do that.
   bool bestmove_is_sent_ GUARDED_BY(counters_mutex_) = false;
   // Becomes true when smart pruning decides that no better move can be found.
-  bool only_one_possible_move_left_ GUARDED_BY(counters_mutex_) = false;
+  // Set by the workers without locks, the watchdog stops on it.
+  std::atomic<bool> only_one_possible_move_left_{false};
+  // Set when bestmove was sent and the search goes on for background_visits.
+  std::atomic<bool> in_background_{false};
+  // Set after pruning the tree, until its memory is back under the point
+  // where pruning starts.
+  bool tree_pruned_ GUARDED_BY(counters_mutex_) = false;
   // Stored so that in the case of non-zero temperature GetBestMove() returns
   // consistent results.
   EdgeAndNode final_bestmove_ GUARDED_BY(counters_mutex_);
@@ -160,45 +384,120 @@ class Search {
 
   Mutex threads_mutex_;
   std::vector<std::thread> threads_ GUARDED_BY(threads_mutex_);
+  // Set once a watchdog thread checks the limits. Searches driven one
+  // iteration at a time by the caller have none, their worker does it.
+  std::atomic<bool> has_watchdog_{false};
 
   Node* root_node_;
+  // The workers charge the nodes they allocate and release to it, so that
+  // the memory of the tree is told from that of other trees.
+  NodeArena::Account* const tree_account_;
   NNCache* cache_;
   SyzygyTablebase* syzygy_tb_;
   // Fixed positions which happened before the search.
   const PositionHistory& played_history_;
 
   Network* const network_;
+  Network* small_network_ = nullptr;
   const SearchLimits limits_;
+  ComputationPriority priority_;
+  // Root parallel group of the search, if any, and its tree in it.
+  SharedRootStats* root_stats_ = nullptr;
+  int root_stats_index_ = 0;
   const std::chrono::steady_clock::time_point start_time_;
   const int64_t initial_visits_;
+  // To report cache counters of this search only.
+  const NNCache::Stats initial_cache_stats_;
+  const SyzygyTablebase::CacheStats initial_tb_cache_stats_;
   optional<std::chrono::steady_clock::time_point> nps_start_time_;
 
-  mutable SharedMutex nodes_mutex_;
+  mutable SharedMutex nodes_mutex_{"nodes"};
   EdgeAndNode current_best_edge_ GUARDED_BY(nodes_mutex_);
   Edge* last_outputted_info_edge_ GUARDED_BY(nodes_mutex_) = nullptr;
   ThinkingInfo last_outputted_uci_info_ GUARDED_BY(nodes_mutex_);
-  int64_t total_playouts_ GUARDED_BY(nodes_mutex_) = 0;
-  int64_t remaining_playouts_ GUARDED_BY(nodes_mutex_) =
-      std::numeric_limits<int64_t>::max();
+  // Playouts smart pruning expects to be left, read by the workers at root
+  // without locks.
+  std::atomic<int64_t> remaining_playouts_{std::numeric_limits<int64_t>::max()};
+  // The fields below are only touched by UpdateStatus(), which runs on one
+  // thread at a time. Value of remaining_playouts_ when the root's cached best
+  // child was last cleared for it, and when that was.
+  int64_t cleared_remaining_playouts_ = std::numeric_limits<int64_t>::max();
+  std::chrono::steady_clock::time_point last_best_child_clear_;
   // If kldgain minimum checks enabled, this was the visit distribution at the
   // last kldgain interval triggering.
-  std::vector<uint32_t> prev_dist_ GUARDED_BY(counters_mutex_);
+  std::vector<uint32_t> prev_dist_;
   // Total visits at the last time prev_dist_ was cached.
-  uint32_t prev_dist_visits_total_ GUARDED_BY(counters_mutex_) = 0;
+  int64_t prev_dist_visits_total_ = 0;
   // If true, search should exit as kldgain evaluation showed too little change.
-  bool kldgain_too_small_ GUARDED_BY(counters_mutex_) = false;
+  std::atomic<bool> kldgain_too_small_{false};
+  // Counters of the workers, updated without locks, and their sums as of
+  // the last AggregateCounters(), which stop decisions and info go by.
+  mutable Mutex worker_counters_mutex_;
+  std::deque<WorkerCounters> worker_counters_
+      GUARDED_BY(worker_counters_mutex_);
+  int64_t total_playouts_ GUARDED_BY(counters_mutex_) = 0;
   // Maximum search depth = length of longest path taken in PickNodetoExtend.
-  uint16_t max_depth_ GUARDED_BY(nodes_mutex_) = 0;
+  uint16_t max_depth_ GUARDED_BY(counters_mutex_) = 0;
   // Cummulative depth of all paths taken in PickNodetoExtend.
-  uint64_t cum_depth_ GUARDED_BY(nodes_mutex_) = 0;
+  uint64_t cum_depth_ GUARDED_BY(counters_mutex_) = 0;
   std::atomic<int> tb_hits_{0};
-  std::atomic<int> root_syzygy_rank_{0};
+  // Root moves allowed by searchmoves or the tablebases, all if empty, and
+  // the tablebase rank they came with. Set before the threads start.
+  MoveList root_move_limit_;
+  int root_syzygy_rank_ = 0;
+  // Positions sent to the NN by prefetch, and how many of them were later
+  // found in cache by the search.
+  std::atomic<int64_t> prefetch_evals_{0};
+  std::atomic<int64_t> prefetch_hits_{0};
+  // Whether a worker took on the WarmStart batch.
+  std::atomic<bool> warm_started_{false};
+  // Counters as of the last PublishMetrics().
+  int64_t published_playouts_ GUARDED_BY(counters_mutex_) = 0;
+  int published_tb_hits_ GUARDED_BY(counters_mutex_) = 0;
+  NNCache::Stats published_cache_stats_ GUARDED_BY(counters_mutex_);
+  // Phase timings flushed by the workers, reported with the move stats.
+  mutable Mutex profile_mutex_;
+  SearchProfile profile_ GUARDED_BY(profile_mutex_);
+  // Held for whole iterations in the deterministic mode.
+  Mutex iteration_mutex_;
+  int64_t iterations_done_ GUARDED_BY(iteration_mutex_) = 0;
+  // Striped locks for GetSpawnMutex().
+  mutable std::array<Mutex, 64> spawn_mutexes_;
+  // First node extended for every position, when --transpositions is on.
+  // Nodes are not released while the search runs, so pointers stay valid.
+  Mutex transpositions_mutex_{"transpositions"};
+  std::unordered_map<uint64_t, Node*> transpositions_
+      GUARDED_BY(transpositions_mutex_);
 
   BestMoveInfo::Callback best_move_callback_;
   ThinkingInfo::Callback info_callback_;
   const SearchParams params_;
+  // Policy softmax temperature applied by the backend with DevicePolicy, or
+  // 0 if the priors are tempered by the search.
+  float device_policy_temp_ = 0.0f;
+  // Mixed into cache keys when the cached priors are tempered, so that they
+  // don't mix with raw ones or ones of another temperature.
+  uint64_t cache_salt_ = 0;
+  // Helper threads for SearchWorker::EncodePrefetchRequests().
+  ThreadPool prefetch_pool_;
+  // Tuner of the minibatch size and threads, if any, and its settings.
+  AutoTuner* tuner_ = nullptr;
+  std::atomic<int> minibatch_size_;
+  std::atomic<int> active_threads_{std::numeric_limits<int>::max()};
+  // Worker counter sums at the start of the tuner's interval, only touched
+  // by the watchdog.
+  struct TunerSnapshot {
+    std::chrono::steady_clock::time_point time;
+    int64_t playouts = 0;
+    uint64_t picked = 0;
+    uint64_t collisions = 0;
+    uint64_t nn_batches = 0;
+    uint64_t nn_us = 0;
+  };
+  optional<TunerSnapshot> tuner_snapshot_;
 
   friend class SearchWorker;
+  friend class SearchThreads;
 };
 
 // Single thread worker of the search engine.
@@ -206,17 +505,39 @@ class Search {
 // within one thread, have to split into stages.
 class SearchWorker {
  public:
-  SearchWorker(Search* search, const SearchParams& params)
-      : search_(search), history_(search_->played_history_), params_(params) {}
+  // @index is the number of the worker in the search, from 0.
+  SearchWorker(Search* search, const SearchParams& params, int index = 0)
+      : search_(search),
+        index_(index),
+        counters_(search->NewWorkerCounters()),
+        history_(search_->played_history_),
+        params_(&params),
+        root_move_filter_(search->root_move_limit_) {
+    history_.Reserve(history_.GetLength() + kHistoryReserve);
+  }
+
+  // Makes the worker run @search next, keeping the buffers it allocated.
+  void Reset(Search* search);
 
   // Runs iterations while needed.
   void RunBlocking() {
     LOGFILE << "Started search thread.";
-    // A very early stop may arrive before this point, so the test is at the end
-    // to ensure at least one iteration runs before exiting.
-    do {
-      ExecuteOneIteration();
-    } while (search_->IsSearchActive());
+    if (params_->GetDeterministic()) {
+      RunSerialized();
+    } else if (params_->GetPipelinedMinibatches() > 1) {
+      RunPipelined();
+    } else {
+      // A very early stop may arrive before this point, so the test is at the
+      // end to ensure at least one iteration runs before exiting.
+      do {
+        if (search_->IsParked(index_)) {
+          search_->WaitWhileParked(index_);
+          continue;
+        }
+        ExecuteOneIteration();
+      } while (search_->IsSearchActive());
+    }
+    FlushProfile();
   }
 
   // Does one full iteration of MCTS search:
@@ -239,6 +560,9 @@ class SearchWorker {
 
   // 3. Prefetch into cache.
   void MaybePrefetchIntoCache();
+  // Adds the root children, and the likeliest grandchildren, to the
+  // computation, once per search after the root is evaluated. See WarmStart.
+  void MaybeWarmStart();
 
   // 4. Run NN computation.
   void RunNNComputation();
@@ -253,6 +577,12 @@ class SearchWorker {
   void UpdateCounters();
 
  private:
+  // Merges profile_ into the search's one.
+  void FlushProfile();
+  // Adds a computation of @batch_size NN evaluations sent at @start to the
+  // process metrics.
+  void RecordBatchMetrics(int batch_size,
+                          std::chrono::steady_clock::time_point start);
  
   struct NodeToProcess {
     bool IsExtendable() const { return !is_collision && !node->IsCertain(); }
@@ -261,6 +591,8 @@ class SearchWorker {
 
     // The node to extend.
     Node* node;
+    // Earlier node of the same position, if any.
+    Node* transposition = nullptr;
     // Value from NN's value head, or -1/0/1 for terminal nodes.
     float v;
     // Draw probability for NN's with WDL value head
@@ -271,6 +603,9 @@ class SearchWorker {
     bool nn_queried = false;
     bool is_cache_hit = false;
     bool is_collision = false;
+    // The node has children, and its small network evaluation is replaced by
+    // one of the main network.
+    bool is_reevaluation = false;
 
     static NodeToProcess Collision(Node* node, uint16_t depth, uint16_t piececount,
                                    int collision_count) {
@@ -283,6 +618,12 @@ class SearchWorker {
                                      int visit_count) {
       return NodeToProcess(node, depth, piececount, false, visit_count);
     }
+    static NodeToProcess Reevaluation(Node* node, uint16_t depth,
+                                      uint16_t piececount) {
+      NodeToProcess result(node, depth, piececount, false, 1);
+      result.is_reevaluation = true;
+      return result;
+    }
 
    private:
     NodeToProcess(Node* node, uint16_t depth, uint16_t piececount, bool is_collision, int multivisit)
@@ -293,26 +634,209 @@ class SearchWorker {
           is_collision(is_collision) {}
   };
 
+  // Minibatch sent to the backend, waiting for the results.
+  struct InFlightMinibatch {
+    std::vector<NodeToProcess> minibatch;
+    std::unique_ptr<CachingComputation> computation;
+    int number_out_of_order = 0;
+    int number_certain = 0;
+    std::future<void> done;
+    // When the computation was sent, for the latency metric.
+    std::chrono::steady_clock::time_point start;
+  };
+
+  // Runs iterations like RunBlocking(), but keeps several minibatches in
+  // flight, gathering the next ones while earlier ones are being computed.
+  void RunPipelined();
+  // Runs iterations like RunBlocking(), one thread at a time, for the
+  // deterministic mode.
+  void RunSerialized();
+
   NodeToProcess PickNodeToExtend(int collision_limit);
-  CertaintyResult EvalPosition(const Node* node, const MoveList& legal_moves, const ChessBoard& board);
-  void ExtendNode(Node* node);
-  bool AddNodeToComputation(Node* node, bool add_if_cached);
-  int PrefetchIntoCache(Node* node, int budget);
+  NodeToProcess PickNodeToExtendLocked(int collision_limit)
+      REQUIRES_SHARED(search_->nodes_mutex_);
+  // Picks @visits playouts in one descent, appending the leaves, terminal
+  // hits and collisions to minibatch_.
+  void PickNodesToExtend(int visits);
+  void PickNodesToExtendLocked(Node* node, int visits, uint16_t depth,
+                               int64_t best_node_n)
+      REQUIRES_SHARED(search_->nodes_mutex_);
+  // Scores the children of @node which may be picked, into scored_children_
+  // and the child_ arrays. At root, sets @forced_edge to a certain win which
+  // is to be picked regardless. Returns the number of moves possible at root.
+  int ScoreChildren(Node* node, bool is_root_node, int64_t best_node_n,
+                    float puct_mult, float fpu, Node::Iterator* forced_edge)
+      REQUIRES_SHARED(search_->nodes_mutex_);
+  // ScoreChildren() for root or other nodes, with certainty propagation on or
+  // off, so that the loop over the children doesn't test them for each.
+  template <bool kRoot, bool kCertaintyPropagation>
+  int ScoreChildren(Node* node, int64_t best_node_n, float puct_mult,
+                    float fpu, Node::Iterator* forced_edge)
+      REQUIRES_SHARED(search_->nodes_mutex_);
+  // Sets @tb_deferred if the position is left for ProbeTablebaseLeaves().
+  CertaintyResult EvalPosition(const Node* node,
+                               const FixedMoveList& legal_moves,
+                               const ChessBoard& board, bool* tb_deferred);
+  // Returns whether the node waits for ProbeTablebaseLeaves(), without edges.
+  bool ExtendNode(Node* node);
+  // Resets history_ to the position of @node.
+  void SetHistoryToNode(Node* node);
+  // Gathers the minibatch, leaving tablebase leaves for the batched probe.
+  void GatherMinibatchLeaves();
+  // Probes the tablebase leaves of the minibatch all at once, moving those
+  // found to certain_leaves_, and sends the rest to the network like other
+  // leaves.
+  void ProbeTablebaseLeaves();
+  // Backs up certain_leaves_ all under one lock.
+  void BackupCertainLeaves();
+  // @parent is the node @node is a child of, @node itself may be null for a
+  // leaf never extended.
+  // With @allow_small, the small network may evaluate the position.
+  bool AddNodeToComputation(Node* node, Node* parent, bool add_if_cached,
+                            bool allow_small = true);
+  // Returns whether the small network evaluation of @node is to be replaced
+  // now, and if so, takes that on.
+  bool ShouldReevaluate(Node* node);
+  int PrefetchIntoCache(Node* node, Node* parent, int budget);
   void FetchSingleNodeResult(NodeToProcess* node_to_process,
                              int idx_in_computation);
   void DoBackupUpdateSingleNode(const NodeToProcess& node_to_process);
-
-  Search* const search_;
+  // DoBackupUpdateSingleNode() with certainty propagation on or off.
+  template <bool kCertaintyPropagation>
+  void DoBackupUpdateSingleNode(const NodeToProcess& node_to_process);
+  void DoBatchedBackupUpdate();
+  // Tells the search about a backup of this worker.
+  void NotifyBackup();
+  // Adds to the playout statistics of this worker.
+  void AddPlayouts(int playouts, uint64_t cum_depth, uint16_t max_depth);
+  // Fills planes of prefetch_requests_, using helper threads from
+  // search_->prefetch_pool_.
+  void EncodePrefetchRequests();
+
+  Search* search_;
+  const int index_;
+  // Playout statistics of this worker in search_.
+  WorkerCounters* counters_;
   // List of nodes to process.
   std::vector<NodeToProcess> minibatch_;
   std::unique_ptr<CachingComputation> computation_;
   // History is reset and extended by PickNodeToExtend().
   PositionHistory history_;
+  // Plies beyond the root the history has room for without allocating.
+  static constexpr int kHistoryReserve = 256;
+  // Scratch space for SetHistoryToNode(), and the nodes the moves lead to
+  // when board snapshots are kept.
+  std::vector<Move> path_to_root_;
+  std::vector<Node*> path_nodes_;
+  // Positions from the root to nodes every BoardSnapshotInterval plies, for
+  // SetHistoryToNode() to copy rather than replay, and the bytes they take.
+  // Nodes may be freed and reused meanwhile, so a snapshot is only used if
+  // its moves are those to the node.
+  std::unordered_map<const Node*, PositionHistory::Tail> board_snapshots_;
+  size_t board_snapshot_bytes_ = 0;
+  // Nodes take board snapshots once they have as many visits.
+  static constexpr uint32_t kBoardSnapshotMinVisits = 8;
+  // Copy of the root move limit of the search.
   MoveList root_move_filter_;
-  bool root_move_filter_populated_ = false;
+  // Root moves of this tree if its root parallel group splits them up, empty
+  // for all, as of the group's ownership epoch.
+  MoveList owned_moves_;
+  uint64_t owned_epoch_ = 0;
   int number_out_of_order_ = 0;
-  const SearchParams& params_;
+  // Search's backup count when the last iteration started, and the backups
+  // of this worker since, for waiting on the others' when idle.
+  uint64_t idle_epoch_ = 0;
+  int own_backups_ = 0;
+  // Longest wait for a backup of another worker.
+  static constexpr std::chrono::milliseconds kIdleTimeout{10};
+  // Certain leaves resolved by the gather, which take no minibatch slots.
+  int number_certain_ = 0;
+  const SearchParams* params_;
   std::unique_ptr<Node> precached_node_;
+  // Scratch space for the priors of a node in FetchSingleNodeResult().
+  std::vector<uint16_t> policy_moves_;
+  std::vector<float> policy_priors_;
+  // Scratch space for scoring children in PickNodeToExtend().
+  std::vector<Node::Iterator> scored_children_;
+  std::vector<float> child_p_;
+  std::vector<float> child_n_started_;
+  std::vector<float> child_q_;
+  std::vector<float> child_scores_;
+  // Visits handed to each scored child, and the children picked at each
+  // depth, by PickNodesToExtendLocked().
+  std::vector<int> child_visits_;
+  std::deque<std::vector<std::pair<Node::Iterator, int>>> picks_by_depth_;
+  // Per-node accumulated updates for DoBatchedBackupUpdate().
+  struct BackupDelta {
+    float v = 0.0f;
+    float d = 0.0f;
+    int visits = 0;
+    int cancels = 0;
+  };
+  std::unordered_map<Node*, BackupDelta> backup_deltas_;
+  std::vector<const NodeToProcess*> sequential_backups_;
+  // Speculative leaves collected by PrefetchIntoCache() when the encoding is
+  // done by several threads.
+  struct PrefetchRequest {
+    Node* node = nullptr;
+    // Moves from the root.
+    std::vector<Move> path;
+    uint64_t hash = 0;
+    bool cached = false;
+    bool retain = false;
+    InputPlanes planes;
+    std::vector<uint16_t> moves;
+  };
+  std::vector<PrefetchRequest> prefetch_requests_;
+  // Parent and planes of the last position encoded by AddNodeToComputation(),
+  // its siblings share all but the newest board. Reset every iteration, so
+  // that the node can't have been freed.
+  Node* last_encoded_parent_ = nullptr;
+  InputPlanes last_encoded_planes_;
+  // Scratch space for the moves AddNodeToComputation() caches.
+  std::vector<uint16_t> moves_to_cache_;
+  std::vector<Move> prefetch_path_;
+  // Tablebase leaves of the minibatch, by index in minibatch_, and their
+  // positions.
+  std::vector<size_t> tb_leaves_;
+  std::vector<Position> tb_positions_;
+  // Terminal, certain and tablebase resolved leaves waiting for
+  // BackupCertainLeaves(), out of minibatch_.
+  std::vector<NodeToProcess> certain_leaves_;
+  // Phase timings of this worker, merged into the search's by FlushProfile()
+  // every iteration.
+  SearchProfile profile_;
+  std::vector<WDLScore> tb_wdl_;
+  std::vector<ProbeState> tb_states_;
+};
+
+// Search threads kept from one search to the next, together with their
+// workers, so that consecutive searches (e.g. moves of a selfplay game) don't
+// start threads and allocate worker buffers every time.
+class SearchThreads {
+ public:
+  SearchThreads() = default;
+  ~SearchThreads();
+
+  // Runs @search with @how_many worker threads, until it is done. The calling
+  // thread acts as watchdog. Searches run one at a time.
+  void RunBlocking(Search* search, size_t how_many);
+
+ private:
+  void Worker(size_t index);
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::vector<std::thread> threads_;
+  // Worker of every thread, null until its first search.
+  std::vector<std::unique_ptr<SearchWorker>> workers_;
+  Search* search_ = nullptr;
+  // Threads taking part in the current search, and those still running it.
+  size_t active_ = 0;
+  size_t running_ = 0;
+  // Incremented for every search, to wake the threads.
+  uint64_t generation_ = 0;
+  bool exit_ = false;
 };
 
 }  // namespace lczero
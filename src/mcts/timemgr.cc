@@ -0,0 +1,90 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2018 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+
+  If you modify this Program, or any covered work, by linking or
+  combining it with NVIDIA Corporation's libraries from the NVIDIA CUDA
+  Toolkit and the NVIDIA CUDA Deep Neural Network library (or a
+  modified version of those libraries), containing parts covered by the
+  terms of the respective license agreement, the licensors of this
+  Program grant you additional permission to convey the resulting work.
+*/
+
+#include "mcts/timemgr.h"
+
+#include <algorithm>
+#include <cmath>
+#include <iomanip>
+#include <sstream>
+#include "utils/logging.h"
+
+namespace lczero {
+namespace {
+// Shorter searches are dominated by their startup, so their speed tells
+// little about the next one.
+const int64_t kMinMeasuredMs = 100;
+// Weight of the last search in the moving average.
+const double kNpsDecay = 0.3;
+}  // namespace
+
+int64_t TimeManager::GetPredictedNps() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return static_cast<int64_t>(nps_);
+}
+
+int64_t TimeManager::ShortenBudget(int64_t budget_ms, int64_t reused_visits,
+                                   float discount) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (nps_ <= 0.0 || budget_ms <= 0 || reused_visits <= 0) return budget_ms;
+  const double new_visits = nps_ * budget_ms / 1000.0;
+  const double reused_share = reused_visits / (reused_visits + new_visits);
+  return static_cast<int64_t>(budget_ms * (1.0 - discount * reused_share));
+}
+
+void TimeManager::StartSearch(int64_t budget_ms, int64_t reused_visits) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  budget_ms_ = budget_ms;
+  reused_visits_ = reused_visits;
+  predicted_nps_ = nps_;
+}
+
+void TimeManager::FinishSearch(int64_t nodes, int64_t elapsed_ms) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  const int64_t visits = std::max(int64_t(0), nodes - reused_visits_);
+  const double nps = elapsed_ms > 0 ? visits * 1000.0 / elapsed_ms : 0.0;
+  std::ostringstream report;
+  report << std::fixed << std::setprecision(1) << "Time manager: used "
+         << elapsed_ms << " of " << budget_ms_ << "ms, " << visits
+         << " visits (+" << reused_visits_ << " reused) at " << nps / 1000
+         << "kn/s";
+  if (elapsed_ms >= kMinMeasuredMs) {
+    if (predicted_nps_ > 0.0) {
+      const double error = (nps - predicted_nps_) / predicted_nps_;
+      total_error_ += std::abs(error);
+      ++predictions_;
+      report << ", " << predicted_nps_ / 1000 << "kn/s predicted ("
+             << std::showpos << error * 100 << std::noshowpos
+             << "%), mean error " << total_error_ * 100 / predictions_
+             << "% over " << predictions_ << " moves";
+    }
+    nps_ = nps_ > 0.0 ? (1 - kNpsDecay) * nps_ + kNpsDecay * nps : nps;
+  }
+  LOGFILE << report.str();
+}
+
+}  // namespace lczero
@@ -0,0 +1,69 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2018 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+
+  If you modify this Program, or any covered work, by linking or
+  combining it with NVIDIA Corporation's libraries from the NVIDIA CUDA
+  Toolkit and the NVIDIA CUDA Deep Neural Network library (or a
+  modified version of those libraries), containing parts covered by the
+  terms of the respective license agreement, the licensors of this
+  Program grant you additional permission to convey the resulting work.
+*/
+
+#pragma once
+
+#include <cstdint>
+#include <mutex>
+
+namespace lczero {
+
+// Predicts how fast the next search is going to be from the searches before
+// it, so that a move budget can be planned in visits rather than in time,
+// and logs after every move how good the prediction was.
+class TimeManager {
+ public:
+  // Visits per second expected of the next search, 0 until one was measured.
+  int64_t GetPredictedNps() const;
+
+  // Returns @budget_ms shortened by @discount times the share that the
+  // @reused_visits of the tree would have in the tree at the end of the
+  // search, if it goes at the predicted speed.
+  int64_t ShortenBudget(int64_t budget_ms, int64_t reused_visits,
+                        float discount) const;
+
+  // To be called when a search with a @budget_ms budget starts, with
+  // @reused_visits visits already at the root.
+  void StartSearch(int64_t budget_ms, int64_t reused_visits);
+  // To be called when it sends bestmove, @elapsed_ms after it started and
+  // with @nodes visits at the root.
+  void FinishSearch(int64_t nodes, int64_t elapsed_ms);
+
+ private:
+  mutable std::mutex mutex_;
+  // Moving average of the speed of past searches.
+  double nps_ = 0.0;
+  // Of the current search.
+  int64_t budget_ms_ = 0;
+  int64_t reused_visits_ = 0;
+  double predicted_nps_ = 0.0;
+  // Relative errors of the predictions so far.
+  double total_error_ = 0.0;
+  int predictions_ = 0;
+};
+
+}  // namespace lczero
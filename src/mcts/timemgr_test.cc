@@ -0,0 +1,69 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2019 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+
+  If you modify this Program, or any covered work, by linking or
+  combining it with NVIDIA Corporation's libraries from the NVIDIA CUDA
+  Toolkit and the NVIDIA CUDA Deep Neural Network library (or a
+  modified version of those libraries), containing parts covered by the
+  terms of the respective license agreement, the licensors of this
+  Program grant you additional permission to convey the resulting work.
+*/
+
+#include "mcts/timemgr.h"
+
+#include <gtest/gtest.h>
+
+namespace lczero {
+
+TEST(TimeManager, PredictsFromPastSearches) {
+  TimeManager manager;
+  EXPECT_EQ(0, manager.GetPredictedNps());
+  // Too short to be measured.
+  manager.StartSearch(1000, 0);
+  manager.FinishSearch(500, 50);
+  EXPECT_EQ(0, manager.GetPredictedNps());
+
+  manager.StartSearch(1000, 0);
+  manager.FinishSearch(10000, 1000);
+  EXPECT_EQ(10000, manager.GetPredictedNps());
+  // Reused visits are not counted as the search's own.
+  manager.StartSearch(1000, 5000);
+  manager.FinishSearch(25000, 1000);
+  EXPECT_EQ(13000, manager.GetPredictedNps());
+}
+
+TEST(TimeManager, ShortensBudgetForReusedTree) {
+  TimeManager manager;
+  // Nothing to go by yet.
+  EXPECT_EQ(1000, manager.ShortenBudget(1000, 10000, 0.5f));
+
+  manager.StartSearch(1000, 0);
+  manager.FinishSearch(10000, 1000);
+  EXPECT_EQ(1000, manager.ShortenBudget(1000, 0, 0.5f));
+  EXPECT_EQ(1000, manager.ShortenBudget(1000, 10000, 0.0f));
+  // Half of the final tree would be reused.
+  EXPECT_EQ(750, manager.ShortenBudget(1000, 10000, 0.5f));
+}
+
+}  // namespace lczero
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,98 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2019 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+
+  If you modify this Program, or any covered work, by linking or
+  combining it with NVIDIA Corporation's libraries from the NVIDIA CUDA
+  Toolkit and the NVIDIA CUDA Deep Neural Network library (or a
+  modified version of those libraries), containing parts covered by the
+  terms of the respective license agreement, the licensors of this
+  Program grant you additional permission to convey the resulting work.
+*/
+
+#pragma once
+
+#include <memory>
+#include <vector>
+#include "neural/network.h"
+
+namespace lczero {
+
+// A computation made by ComputationBatcher, which adds its inputs to a batch
+// shared with other computations.
+class BatchedComputation : public NetworkComputation {
+ public:
+  BatchedComputation(std::shared_ptr<NetworkComputation> batch)
+      : batch_(batch), offset_(batch->GetBatchSize()) {}
+
+  void AddInput(InputPlanes&& input) override {
+    batch_->AddInput(std::move(input));
+    ++size_;
+  }
+  // The batch is computed by ComputationBatcher::ComputeBlocking().
+  void ComputeBlocking() override {}
+  int GetBatchSize() const override { return size_; }
+  float GetQVal(int sample) const override {
+    return batch_->GetQVal(offset_ + sample);
+  }
+  float GetDVal(int sample) const override {
+    return batch_->GetDVal(offset_ + sample);
+  }
+  float GetPVal(int sample, int move_id) const override {
+    return batch_->GetPVal(offset_ + sample, move_id);
+  }
+
+ private:
+  const std::shared_ptr<NetworkComputation> batch_;
+  const int offset_;
+  int size_ = 0;
+};
+
+// Puts the inputs of many computations into few computations of @network,
+// of up to @max_batch_size inputs each. All inputs of a computation must be
+// added before the next one is made.
+class ComputationBatcher {
+ public:
+  ComputationBatcher(Network* network, int max_batch_size)
+      : network_(network), max_batch_size_(max_batch_size) {}
+
+  // Returns a computation for up to @max_inputs inputs.
+  std::unique_ptr<NetworkComputation> NewComputation(int max_inputs) {
+    if (batches_.empty() ||
+        batches_.back()->GetBatchSize() + max_inputs > max_batch_size_) {
+      batches_.emplace_back(network_->NewComputation());
+    }
+    return std::make_unique<BatchedComputation>(batches_.back());
+  }
+
+  // Computes the batches of all computations made since the last call, their
+  // results can be read then.
+  void ComputeBlocking() {
+    for (auto& batch : batches_) {
+      if (batch->GetBatchSize() > 0) batch->ComputeBlocking();
+    }
+    batches_.clear();
+  }
+
+ private:
+  Network* const network_;
+  const int max_batch_size_;
+  std::vector<std::shared_ptr<NetworkComputation>> batches_;
+};
+
+}  // namespace lczero
@@ -18,12 +18,14 @@
 
 #include "neural/blas/convolution1.h"
 #include "neural/blas/blas.h"
+#include "neural/shared/activation.h"
 
 namespace lczero {
 
 void Convolution1::Forward(const size_t batch_size, const size_t input_channels,
                            const size_t output_channels, const float* input,
-                           const float* weights, float* output) {
+                           const float* weights, float* output,
+                           const float* biases, bool relu) {
   for (size_t i = 0; i < batch_size; i++) {
     // C←αAB + βC
     // M Number of rows in matrices A and C.
@@ -59,6 +61,11 @@ void Convolution1::Forward(const size_t batch_size, const size_t input_channels,
                 0.0f,                  // beta
                 batch_output,          // C
                 kSquares);             // ldc, leading rank of B
+
+    if (biases) {
+      BiasResidualRelu(1, output_channels, batch_output, biases, nullptr,
+                       relu);
+    }
   }
 }
 
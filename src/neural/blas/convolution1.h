@@ -28,10 +28,12 @@ class Convolution1 {
  public:
   Convolution1() = delete;
 
-  // Batched forward inference.
+  // Batched forward inference. With @biases, adds them (and applies relu if
+  // @relu) to each sample's output while it's still in cache.
   static void Forward(const size_t batch_size, const size_t input_channels,
                       const size_t output_channels, const float* input,
-                      const float* weights, float* output);
+                      const float* weights, float* output,
+                      const float* biases = nullptr, bool relu = false);
 
  private:
   static constexpr auto kWidth = 8;
@@ -25,47 +25,99 @@
 #include "neural/network.h"
 #include "neural/network_legacy.h"
 #include "neural/shared/activation.h"
+#include "neural/shared/input_convolution.h"
+#include "neural/shared/planes.h"
 #include "neural/shared/policy_map.h"
+#include "neural/shared/shared_weights.h"
 #include "neural/shared/winograd_filter.h"
 
 #include <algorithm>
 #include <cassert>
 #include <cmath>
+#include <condition_variable>
+#include <functional>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include "utils/affinity.h"
+#include "utils/cpu.h"
+#include "utils/hashcat.h"
+#include "utils/threadpool.h"
+#include "utils/trace.h"
 
 namespace lczero {
 namespace {
 
+// Buffers to compute a batch with, and its results. Kept by the network
+// between computations, so repeated batches don't allocate.
+struct BlasWorkspace {
+  // Grows @buffer to at least @size elements.
+  static void Reserve(std::vector<float>* buffer, size_t size) {
+    if (buffer->size() < size) buffer->resize(size);
+  }
+
+  std::vector<float> output_val;
+  std::vector<float> output_pol;
+  std::vector<float> res_buffer1;
+  std::vector<float> res_buffer2;
+  std::vector<float> res_buffer3;
+  std::vector<float> policy_buffer;
+  std::vector<float> value_buffer;
+  std::vector<float> se_pool;
+  std::vector<float> se_fc_out;
+  std::vector<float> wdl;
+  // Batch size convolve3 was created for.
+  size_t convolve3_batch_size = 0;
+  std::unique_ptr<WinogradConvolution3> convolve3;
+
+  // Inputs, cleared when handed out again.
+  std::vector<InputPlanes> planes;
+  // Results, kPolicyOutputs policy values and 1 or 3 value outputs per
+  // sample.
+  std::vector<float> policies;
+  std::vector<float> q_values;
+};
+
+class BlasNetwork;
+
 class BlasComputation : public NetworkComputation {
  public:
-  BlasComputation(const LegacyWeights& weights, const size_t max_batch_size,
-                  const bool wdl, const bool conv_policy);
+  BlasComputation(BlasNetwork* network, const LegacyWeights& weights,
+                  const size_t max_batch_size, const bool wdl,
+                  const bool conv_policy, WinogradSgemm* sgemm);
 
-  virtual ~BlasComputation() {}
+  // Gives the workspace back to the network.
+  ~BlasComputation() override;
 
   // Adds a sample to the batch.
-  void AddInput(InputPlanes&& input) override { planes_.emplace_back(input); }
+  void AddInput(InputPlanes&& input) override {
+    if (!workspace_) AcquireWorkspace();
+    workspace_->planes.emplace_back(std::move(input));
+  }
 
   // Do the computation.
   void ComputeBlocking() override;
 
   // Returns how many times AddInput() was called.
-  int GetBatchSize() const override { return static_cast<int>(planes_.size()); }
+  int GetBatchSize() const override {
+    return workspace_ ? static_cast<int>(workspace_->planes.size()) : 0;
+  }
 
   // Returns Q value of @sample.
   float GetQVal(int sample) const override {
     if (wdl_) {
-      auto w = q_values_[3 * sample + 0];
-      auto l = q_values_[3 * sample + 2];
+      auto w = workspace_->q_values[3 * sample + 0];
+      auto l = workspace_->q_values[3 * sample + 2];
       return w - l;
     } else {
-      return q_values_[sample];
+      return workspace_->q_values[sample];
     }
   }
 
   float GetDVal(int sample) const override {
     if (wdl_) {
-      auto d = q_values_[3 * sample + 1];
+      auto d = workspace_->q_values[3 * sample + 1];
       return d;
     } else {
       return 0.0f;
@@ -74,11 +126,13 @@ class BlasComputation : public NetworkComputation {
 
   // Returns P value @move_id of @sample.
   float GetPVal(int sample, int move_id) const override {
-    return policies_[sample][move_id];
+    return workspace_->policies[sample * kPolicyOutputs + move_id];
   }
 
  private:
-  void EncodePlanes(const InputPlanes& sample, float* buffer);
+  void AcquireWorkspace();
+  // Computes samples [@begin, @end) using the buffers of @scratch.
+  void ComputeSlice(BlasWorkspace* scratch, size_t begin, size_t end);
 
   static constexpr auto kWidth = 8;
   static constexpr auto kHeight = 8;
@@ -87,47 +141,151 @@ class BlasComputation : public NetworkComputation {
   // Number of used planes with convolutional policy.
   // The real number of planes is higher because of padding.
   static constexpr auto kPolicyUsedPlanes = 73;
+  // Smallest part of a batch worth giving to another thread.
+  static constexpr size_t kMinSliceSize = 4;
 
+  BlasNetwork* network_;
   const LegacyWeights& weights_;
   size_t max_batch_size_;
-  std::vector<InputPlanes> planes_;
-  std::vector<std::vector<float>> policies_;
-  std::vector<float> q_values_;
+  // Taken from the network by the first AddInput(), holds the inputs and
+  // the results.
+  std::unique_ptr<BlasWorkspace> workspace_;
   bool wdl_;
   bool conv_policy_;
+  WinogradSgemm* sgemm_;
 };
 
 class BlasNetwork : public Network {
  public:
-  BlasNetwork(const WeightsFile& weights, const OptionsDict& options);
+  BlasNetwork(const WeightsFile& weights, const OptionsDict& options,
+              WinogradSgemm::Precision precision);
   virtual ~BlasNetwork(){};
 
   std::unique_ptr<NetworkComputation> NewComputation() override {
-    return std::make_unique<BlasComputation>(weights_, max_batch_size_, wdl_,
-                                             conv_policy_);
+    return std::make_unique<BlasComputation>(this, weights_, max_batch_size_,
+                                             wdl_, conv_policy_, sgemm_.get());
+  }
+
+  std::unique_ptr<BlasWorkspace> GetWorkspace() {
+    std::lock_guard<std::mutex> lock(workspaces_mutex_);
+    if (free_workspaces_.empty()) return std::make_unique<BlasWorkspace>();
+    auto workspace = std::move(free_workspaces_.back());
+    free_workspaces_.pop_back();
+    return workspace;
+  }
+
+  void ReleaseWorkspace(std::unique_ptr<BlasWorkspace> workspace) {
+    workspace->planes.clear();
+    std::lock_guard<std::mutex> lock(workspaces_mutex_);
+    free_workspaces_.push_back(std::move(workspace));
+  }
+
+  // Threads computing a batch, counting the calling one.
+  int GetThreads() const { return threads_; }
+  ThreadPool* GetThreadPool() { return thread_pool_.get(); }
+  // The input convolution working from the plane bitmasks, null when the
+  // planes are expanded for the Winograd one.
+  const InputConvolution* GetInputConvolution() const {
+    return input_convolution_.get();
+  }
+
+  // Data of the weight array @vec, which has moved to the shared weights
+  // file if there is one.
+  const float* Data(const LegacyWeights::Vec& vec) const {
+    if (shared_arrays_.empty()) return vec.data();
+    const auto iter = shared_arrays_.find(&vec);
+    return iter == shared_arrays_.end() ? vec.data() : iter->second;
   }
 
  private:
+  // Arrays which can go to the shared weights file, all but the small ones
+  // that also give the layer sizes.
+  std::vector<LegacyWeights::Vec*> GetSharedArrays();
+  // Converts the 3x3 convolution filters for the Winograd convolution.
+  void TransformWeights();
+
   // A cap on the max batch size since it consumes a lot of memory
   static constexpr auto kHardMaxBatchSize = 2048;
+  // Changes whenever the layout of the shared weights does.
+  static constexpr uint64_t kSharedWeightsVersion = 1;
 
   LegacyWeights weights_;
   size_t max_batch_size_;
   bool wdl_;
   bool conv_policy_;
+  // Set when the Winograd convolutions don't use the BLAS library.
+  std::unique_ptr<WinogradSgemm> sgemm_;
+  // Maps the arrays of GetSharedArrays() into the shared weights file.
+  std::unique_ptr<SharedWeights> shared_weights_;
+  std::unordered_map<const LegacyWeights::Vec*, const float*> shared_arrays_;
+  std::unique_ptr<InputConvolution> input_convolution_;
+
+  std::mutex workspaces_mutex_;
+  std::vector<std::unique_ptr<BlasWorkspace>> free_workspaces_;
+
+  int threads_ = 1;
+  // Runs the slices of a batch beyond the first, if threads_ > 1.
+  std::unique_ptr<ThreadPool> thread_pool_;
 };
 
-BlasComputation::BlasComputation(const LegacyWeights& weights,
+BlasComputation::BlasComputation(BlasNetwork* network,
+                                 const LegacyWeights& weights,
                                  const size_t max_batch_size, const bool wdl,
-                                 const bool conv_policy)
-    : weights_(weights),
+                                 const bool conv_policy, WinogradSgemm* sgemm)
+    : network_(network),
+      weights_(weights),
       max_batch_size_(max_batch_size),
-      policies_(0),
-      q_values_(0),
       wdl_(wdl),
-      conv_policy_(conv_policy) {}
+      conv_policy_(conv_policy),
+      sgemm_(sgemm) {}
+
+BlasComputation::~BlasComputation() {
+  if (workspace_) network_->ReleaseWorkspace(std::move(workspace_));
+}
+
+void BlasComputation::AcquireWorkspace() {
+  workspace_ = network_->GetWorkspace();
+}
 
 void BlasComputation::ComputeBlocking() {
+  TRACE_SCOPE("blas compute");
+  if (!workspace_) return;
+  const auto plane_count = workspace_->planes.size();
+  if (plane_count == 0) return;
+  BlasWorkspace::Reserve(&workspace_->policies, plane_count * kPolicyOutputs);
+  BlasWorkspace::Reserve(&workspace_->q_values, plane_count * (wdl_ ? 3 : 1));
+
+  // Split the batch between the calling thread and the network's threads,
+  // in slices of at least kMinSliceSize.
+  const size_t slices =
+      std::min(static_cast<size_t>(network_->GetThreads()),
+               std::max(size_t{1}, plane_count / kMinSliceSize));
+  const size_t slice_size = (plane_count + slices - 1) / slices;
+  const size_t helpers = (plane_count - 1) / slice_size;
+  std::mutex mutex;
+  std::condition_variable cv;
+  size_t running = helpers;
+  for (size_t begin = slice_size; begin < plane_count; begin += slice_size) {
+    network_->GetThreadPool()->Add([&, begin]() {
+      auto scratch = network_->GetWorkspace();
+      ComputeSlice(scratch.get(), begin,
+                   std::min(plane_count, begin + slice_size));
+      network_->ReleaseWorkspace(std::move(scratch));
+      std::lock_guard<std::mutex> lock(mutex);
+      if (--running == 0) cv.notify_one();
+    });
+  }
+  ComputeSlice(workspace_.get(), 0, std::min(plane_count, slice_size));
+  std::unique_lock<std::mutex> lock(mutex);
+  cv.wait(lock, [&]() { return running == 0; });
+}
+
+void BlasComputation::ComputeSlice(BlasWorkspace* scratch, size_t begin,
+                                   size_t end) {
+  const auto data = [this](const LegacyWeights::Vec& vec) {
+    return network_->Data(vec);
+  };
+
   // Retrieve network key dimensions from the weights structure.
   const auto num_value_channels = weights_.ip1_val_b.size();
   const auto num_value_input_planes = weights_.value.biases.size();
@@ -143,7 +301,10 @@ void BlasComputation::ComputeBlocking() {
   const auto max_channels = std::max(output_channels, input_channels);
 
   // Determine the largest batch for allocations.
-  const auto plane_count = planes_.size();
+  BlasWorkspace& ws = *scratch;
+  // Inputs and results are always in the computation's own workspace.
+  BlasWorkspace& io = *workspace_;
+  const auto plane_count = end - begin;
   const auto largest_batch_size = std::min(max_batch_size_, plane_count);
 
   /* Typically
@@ -156,42 +317,72 @@ void BlasComputation::ComputeBlocking() {
    num_output_policy = 1858
    */
 
-  // Allocate data for the whole batch.
-  std::vector<float> output_val(largest_batch_size * num_value_channels);
-  std::vector<float> output_pol(largest_batch_size * num_output_policy);
-
-  std::vector<float> res_buffer1(largest_batch_size * max_channels * kSquares);
-  std::vector<float> res_buffer2(largest_batch_size * output_channels *
-                                 kSquares);
-  std::vector<float> res_buffer3(largest_batch_size * output_channels *
-                                 kSquares);
-
-  WinogradConvolution3 convolve3(largest_batch_size, max_channels,
-                                 output_channels);
-
-  std::vector<float> policy_buffer(largest_batch_size *
-                                   num_policy_input_planes * kSquares);
-  std::vector<float> value_buffer(largest_batch_size * num_value_input_planes *
-                                  kSquares);
+  // Get buffers for the whole batch, they only grow the first times.
+  size_t max_se_fc_outputs = 0;
+  for (const auto& residual : weights_.residual) {
+    max_se_fc_outputs = std::max(max_se_fc_outputs, residual.se.b1.size());
+  }
+  BlasWorkspace::Reserve(&ws.output_val,
+                         largest_batch_size * num_value_channels);
+  BlasWorkspace::Reserve(&ws.output_pol,
+                         largest_batch_size * num_output_policy);
+  BlasWorkspace::Reserve(&ws.res_buffer1,
+                         largest_batch_size * max_channels * kSquares);
+  BlasWorkspace::Reserve(&ws.res_buffer2,
+                         largest_batch_size * output_channels * kSquares);
+  BlasWorkspace::Reserve(&ws.res_buffer3,
+                         largest_batch_size * output_channels * kSquares);
+  BlasWorkspace::Reserve(&ws.policy_buffer, largest_batch_size *
+                                                num_policy_input_planes *
+                                                kSquares);
+  BlasWorkspace::Reserve(&ws.value_buffer, largest_batch_size *
+                                               num_value_input_planes *
+                                               kSquares);
+  BlasWorkspace::Reserve(&ws.se_pool, 2 * largest_batch_size * output_channels);
+  BlasWorkspace::Reserve(&ws.se_fc_out, largest_batch_size * max_se_fc_outputs);
+  BlasWorkspace::Reserve(&ws.wdl, 3 * largest_batch_size);
+  if (ws.convolve3_batch_size < largest_batch_size) {
+    ws.convolve3 = std::make_unique<WinogradConvolution3>(
+        largest_batch_size, max_channels, output_channels, sgemm_);
+    ws.convolve3_batch_size = largest_batch_size;
+  }
+  WinogradConvolution3& convolve3 = *ws.convolve3;
+  float* output_val = ws.output_val.data();
+  float* output_pol = ws.output_pol.data();
+  float* policy_buffer = ws.policy_buffer.data();
+  float* value_buffer = ws.value_buffer.data();
 
   // These ones will rotate during the computation.
-  float* conv_in = res_buffer1.data();
-  float* conv_out = res_buffer2.data();
-  float* res = res_buffer3.data();
+  float* conv_in = ws.res_buffer1.data();
+  float* conv_out = ws.res_buffer2.data();
+  float* res = ws.res_buffer3.data();
 
-  for (size_t i = 0; i < plane_count; i += largest_batch_size) {
-    const auto batch_size = std::min(plane_count - i, largest_batch_size);
-    for (size_t j = 0; j < batch_size; j++) {
-      EncodePlanes(planes_[i + j], &conv_in[j * kSquares * kInputPlanes]);
-    }
+  const InputConvolution* input_convolution = network_->GetInputConvolution();
+
+  for (size_t i = begin; i < end; i += largest_batch_size) {
+    const auto batch_size = std::min(end - i, largest_batch_size);
 
     // Input convolution
 
-    convolve3.Forward(batch_size, kInputPlanes, output_channels, conv_in,
-                      weights_.input.weights.data(), conv_out);
+    if (input_convolution) {
+      // conv_in is free until the residual tower, a sample takes as much
+      // scratch as it has outputs.
+      for (size_t j = 0; j < batch_size; j++) {
+        input_convolution->Forward(io.planes[i + j],
+                                   &conv_out[j * output_channels * kSquares],
+                                   conv_in);
+      }
+    } else {
+      for (size_t j = 0; j < batch_size; j++) {
+        ExpandPlanes(io.planes[i + j], &conv_in[j * kSquares * kInputPlanes]);
+      }
 
-    BiasResidualRelu(batch_size, output_channels, conv_out,
-                     weights_.input.biases.data());
+      convolve3.Forward(batch_size, kInputPlanes, output_channels, conv_in,
+                        data(weights_.input.weights), conv_out);
+
+      BiasResidualRelu(batch_size, output_channels, conv_out,
+                       weights_.input.biases.data());
+    }
 
     // Residual tower
 
@@ -203,7 +394,7 @@ void BlasComputation::ComputeBlocking() {
       std::swap(conv_out, conv_in);
 
       convolve3.Forward(batch_size, output_channels, output_channels, conv_in,
-                        conv1.weights.data(), conv_out);
+                        data(conv1.weights), conv_out);
 
       BiasResidualRelu(batch_size, output_channels, &conv_out[0],
                        conv1.biases.data());
@@ -212,19 +403,17 @@ void BlasComputation::ComputeBlocking() {
       std::swap(conv_out, conv_in);
 
       convolve3.Forward(batch_size, output_channels, output_channels, conv_in,
-                        conv2.weights.data(), conv_out);
+                        data(conv2.weights), conv_out);
 
       if (residual.has_se) {
-        // No relu if followed by SE-unit and residual is added later
-        BiasResidualRelu(batch_size, output_channels, &conv_out[0],
-                         conv2.biases.data(), nullptr, false);
-
+        // The SE unit adds the bias, the residual and the relu itself.
         std::swap(conv_out, conv_in);
 
         auto se_fc_outputs = se.b1.size();
-        ApplySEUnit(batch_size, output_channels, se_fc_outputs, conv_in, res,
-                    se.w1.data(), se.b1.data(), se.w2.data(), se.b2.data(),
-                    conv_out);
+        ApplySEUnit(batch_size, output_channels, se_fc_outputs, conv_in,
+                    conv2.biases.data(), res, data(se.w1), se.b1.data(),
+                    data(se.w2), se.b2.data(), conv_out, ws.se_pool.data(),
+                    ws.se_fc_out.data());
       } else {
         BiasResidualRelu(batch_size, output_channels, &conv_out[0],
                          conv2.biases.data(), res);
@@ -234,17 +423,17 @@ void BlasComputation::ComputeBlocking() {
     if (conv_policy_) {
       // Need to preserve conv_out which is used for value head
       convolve3.Forward(batch_size, output_channels, output_channels, conv_out,
-                        weights_.policy1.weights.data(), res);
+                        data(weights_.policy1.weights), res);
 
       BiasResidualRelu(batch_size, output_channels, &res[0],
                        weights_.policy1.biases.data());
 
       convolve3.Forward(batch_size, output_channels, num_policy_input_planes,
-                        res, weights_.policy.weights.data(),
-                        policy_buffer.data());
+                        res, data(weights_.policy.weights),
+                        policy_buffer);
 
       BiasResidualRelu(batch_size, num_policy_input_planes,
-                       &policy_buffer.data()[0], weights_.policy.biases.data(),
+                       policy_buffer, weights_.policy.biases.data(),
                        nullptr, false);
 
       // Mapping from convolutional policy to lc0 policy
@@ -261,83 +450,65 @@ void BlasComputation::ComputeBlocking() {
     } else {
       Convolution1::Forward(
           batch_size, output_channels, num_policy_input_planes, conv_out,
-          weights_.policy.weights.data(), policy_buffer.data());
-
-      BiasResidualRelu(batch_size, num_policy_input_planes, &policy_buffer[0],
-                       weights_.policy.biases.data());
+          data(weights_.policy.weights), policy_buffer,
+          weights_.policy.biases.data(), true);
 
       FullyConnectedLayer::Forward1D(
           batch_size, num_policy_input_planes * kSquares, num_output_policy,
-          policy_buffer.data(), weights_.ip_pol_w.data(),
+          policy_buffer, data(weights_.ip_pol_w),
           weights_.ip_pol_b.data(),
           false,  // Relu Off
-          output_pol.data());
+          output_pol);
     }
 
     // Value head
     Convolution1::Forward(batch_size, output_channels, num_value_input_planes,
-                          conv_out, weights_.value.weights.data(),
-                          value_buffer.data());
-
-    BiasResidualRelu(batch_size, num_value_input_planes, &value_buffer[0],
-                     weights_.value.biases.data());
+                          conv_out, data(weights_.value.weights),
+                          value_buffer, weights_.value.biases.data(), true);
 
     FullyConnectedLayer::Forward1D(
         batch_size, num_value_input_planes * kSquares, num_value_channels,
-        value_buffer.data(), weights_.ip1_val_w.data(),
+        value_buffer, data(weights_.ip1_val_w),
         weights_.ip1_val_b.data(),
         true,  // Relu On
-        output_val.data());
+        output_val);
 
     for (size_t j = 0; j < batch_size; j++) {
-      std::vector<float> policy(num_output_policy);
-
       // Get the moves
       SoftmaxActivation(num_output_policy, &output_pol[j * num_output_policy],
-                        policy.data());
-
-      policies_.emplace_back(std::move(policy));
+                        &io.policies[(i + j) * num_output_policy]);
     }
 
     // Now get the score
     if (wdl_) {
-      std::vector<float> wdl(3 * batch_size);
+      float* wdl = ws.wdl.data();
       FullyConnectedLayer::Forward1D(
-          batch_size, num_value_channels, 3, output_val.data(),
-          weights_.ip2_val_w.data(), weights_.ip2_val_b.data(),
+          batch_size, num_value_channels, 3, output_val,
+          data(weights_.ip2_val_w), weights_.ip2_val_b.data(),
           false,  // Relu Off
-          wdl.data());
+          wdl);
 
       for (size_t j = 0; j < batch_size; j++) {
-        std::vector<float> wdl_softmax(3);
-        SoftmaxActivation(3, &wdl[j * 3], wdl_softmax.data());
-
-        q_values_.emplace_back(wdl_softmax[0]);
-        q_values_.emplace_back(wdl_softmax[1]);
-        q_values_.emplace_back(wdl_softmax[2]);
+        SoftmaxActivation(3, &wdl[j * 3], &io.q_values[(i + j) * 3]);
       }
     } else {
-      for (size_t j = 0; j < batch_size; j++) {
-        double winrate = FullyConnectedLayer::Forward0D(
-                             num_value_channels, weights_.ip2_val_w.data(),
-                             &output_val[j * num_value_channels]) +
-                         weights_.ip2_val_b[0];
+      // One product for the whole batch rather than a dot per sample.
+      float* winrate = ws.wdl.data();
+      FullyConnectedLayer::Forward1D(
+          batch_size, num_value_channels, 1, output_val,
+          data(weights_.ip2_val_w), weights_.ip2_val_b.data(),
+          false,  // Relu Off
+          winrate);
 
-        q_values_.emplace_back(std::tanh(winrate));
+      for (size_t j = 0; j < batch_size; j++) {
+        io.q_values[i + j] = std::tanh(winrate[j]);
       }
     }
   }
 }
 
-void BlasComputation::EncodePlanes(const InputPlanes& sample, float* buffer) {
-  for (const InputPlane& plane : sample) {
-    const float value = plane.value;
-    for (auto i = 0; i < kSquares; i++)
-      *(buffer++) = (plane.mask & (((uint64_t)1) << i)) != 0 ? value : 0;
-  }
-}
-
-BlasNetwork::BlasNetwork(const WeightsFile& file, const OptionsDict& options)
+BlasNetwork::BlasNetwork(const WeightsFile& file, const OptionsDict& options,
+                         WinogradSgemm::Precision precision)
     : weights_(file.weights()) {
   int blas_cores = options.GetOrDefault<int>("blas_cores", 1);
   max_batch_size_ =
@@ -356,27 +527,49 @@ BlasNetwork::BlasNetwork(const WeightsFile& file, const OptionsDict& options)
 
   const auto inputChannels = kInputPlanes;
   const auto channels = static_cast<int>(weights_.input.biases.size());
-  const auto residual_blocks = weights_.residual.size();
 
-  weights_.input.weights =
-      WinogradFilterTransformF(weights_.input.weights, channels, inputChannels);
-
-  // residual blocks
-  for (size_t i = 0; i < residual_blocks; i++) {
-    auto& residual = weights_.residual[i];
-    auto& conv1 = residual.conv1;
-    auto& conv2 = residual.conv2;
-
-    conv1.weights = WinogradFilterTransformF(conv1.weights, channels, channels);
-    conv2.weights = WinogradFilterTransformF(conv2.weights, channels, channels);
+  // The input planes are bitmasks, their convolution is cheaper computed
+  // from the set bits than from the expanded planes. Made while the input
+  // weights are still untransformed.
+  if (options.GetOrDefault<bool>("sparse_input", true)) {
+    input_convolution_ = std::make_unique<InputConvolution>(
+        weights_.input.weights.data(), weights_.input.biases.data(),
+        channels);
   }
 
-  if (conv_policy_) {
-    weights_.policy1.weights =
-        WinogradFilterTransformF(weights_.policy1.weights, channels, channels);
-    auto pol_channels = weights_.policy.biases.size();
-    weights_.policy.weights = WinogradFilterTransformF(weights_.policy.weights,
-                                                       pol_channels, channels);
+  // Processes running the same net can share the prepared weights through
+  // a file in this directory, /dev/shm being a good one on Linux.
+  const std::string shared_dir =
+      options.GetOrDefault<std::string>("shared_weights", "");
+  const auto shared_arrays = GetSharedArrays();
+  uint64_t shared_key = 0;
+  if (!shared_dir.empty()) {
+    shared_key =
+        HashCat({std::hash<std::string>()(file.weights().SerializeAsString()),
+                 kSharedWeightsVersion, conv_policy_});
+    shared_weights_ =
+        SharedWeights::Open(shared_dir, shared_key, shared_arrays.size());
+  }
+  if (!shared_weights_) {
+    TransformWeights();
+    if (!shared_dir.empty()) {
+      try {
+        shared_weights_ = SharedWeights::Create(
+            shared_dir, shared_key,
+            std::vector<const LegacyWeights::Vec*>(shared_arrays.begin(),
+                                                   shared_arrays.end()));
+      } catch (const Exception& e) {
+        std::cerr << e.what() << ", weights are not shared.\n";
+      }
+    }
+  } else {
+    std::cerr << "BLAS weights found in " << shared_dir << ".\n";
+  }
+  if (shared_weights_) {
+    for (size_t i = 0; i < shared_arrays.size(); i++) {
+      shared_arrays_[shared_arrays[i]] = shared_weights_->data(i);
+      LegacyWeights::Vec().swap(*shared_arrays[i]);
+    }
   }
 
 #ifdef USE_OPENBLAS
@@ -416,9 +609,111 @@ BlasNetwork::BlasNetwork(const WeightsFile& file, const OptionsDict& options)
             << ") parameter.\n";
 #endif
 
+  // Batches are split between the searching thread and threads-1 pool
+  // threads, which can be pinned to a list of CPUs like "4-31".
+  threads_ = std::max(1, options.GetOrDefault<int>("threads", 1));
+  if (threads_ > 1) {
+    // A single CPU is parsed as a number.
+    const auto cpus = ParseCpuList(
+        options.Exists<int>("cpus")
+            ? std::to_string(options.Get<int>("cpus"))
+            : options.GetOrDefault<std::string>("cpus", ""));
+    thread_pool_ = std::make_unique<ThreadPool>(
+        threads_ - 1, [cpus](int index) {
+          if (!cpus.empty()) PinCurrentThread({cpus[index % cpus.size()]});
+        });
+    std::cerr << "BLAS using " << threads_ << " thread(s) per batch";
+    if (!cpus.empty()) std::cerr << ", pinned";
+    std::cerr << ".\n";
+  }
+
+  // The 3x3 convolutions, which take nearly all the time, can do their
+  // matrix multiplication in-tree with a thread pool of their own. Reduced
+  // precision weights are only supported there.
+  const bool reduced = precision != WinogradSgemm::Precision::kFp32;
+  const int winograd_threads =
+      options.GetOrDefault<int>("winograd_threads", reduced ? 1 : 0);
+  if (winograd_threads > 0 || reduced) {
+    sgemm_ = std::make_unique<WinogradSgemm>(winograd_threads, precision);
+    std::cerr << "Winograd sgemm using " << sgemm_->GetThreads()
+              << " thread(s) instead of BLAS.\n";
+  }
+  if (reduced) {
+    std::cerr << "Winograd weights in "
+              << (precision == WinogradSgemm::Precision::kBf16 ? "bf16"
+                                                               : "fp16")
+              << (precision == WinogradSgemm::Precision::kBf16 &&
+                          WinogradSgemm::HasNativeBf16()
+                      ? ", using bf16 dot products.\n"
+                      : ", widened to fp32.\n");
+    const size_t tiles = 16;
+    if (!input_convolution_) {
+      sgemm_->PackWeights(tiles, channels, inputChannels,
+                          Data(weights_.input.weights));
+    }
+    for (const auto& residual : weights_.residual) {
+      sgemm_->PackWeights(tiles, channels, channels,
+                          Data(residual.conv1.weights));
+      sgemm_->PackWeights(tiles, channels, channels,
+                          Data(residual.conv2.weights));
+    }
+    if (conv_policy_) {
+      sgemm_->PackWeights(tiles, channels, channels,
+                          Data(weights_.policy1.weights));
+      sgemm_->PackWeights(tiles, weights_.policy.biases.size(), channels,
+                          Data(weights_.policy.weights));
+    }
+  }
+
+  std::cerr << "BLAS kernels for " << DescribeCpuFeatures() << ".\n";
   std::cerr << "BLAS max batch size is " << max_batch_size_ << ".\n";
 }
 
+std::vector<LegacyWeights::Vec*> BlasNetwork::GetSharedArrays() {
+  std::vector<LegacyWeights::Vec*> arrays = {&weights_.input.weights};
+  for (auto& residual : weights_.residual) {
+    arrays.push_back(&residual.conv1.weights);
+    arrays.push_back(&residual.conv2.weights);
+    arrays.push_back(&residual.se.w1);
+    arrays.push_back(&residual.se.w2);
+  }
+  for (auto* array :
+       {&weights_.policy1.weights, &weights_.policy.weights,
+        &weights_.ip_pol_w, &weights_.value.weights, &weights_.ip1_val_w,
+        &weights_.ip2_val_w}) {
+    arrays.push_back(array);
+  }
+  return arrays;
+}
+
+void BlasNetwork::TransformWeights() {
+  const auto inputChannels = kInputPlanes;
+  const auto channels = static_cast<int>(weights_.input.biases.size());
+  const auto residual_blocks = weights_.residual.size();
+
+  weights_.input.weights =
+      WinogradFilterTransformF(weights_.input.weights, channels, inputChannels);
+
+  // residual blocks
+  for (size_t i = 0; i < residual_blocks; i++) {
+    auto& residual = weights_.residual[i];
+    auto& conv1 = residual.conv1;
+    auto& conv2 = residual.conv2;
+
+    conv1.weights = WinogradFilterTransformF(conv1.weights, channels, channels);
+    conv2.weights = WinogradFilterTransformF(conv2.weights, channels, channels);
+  }
+
+  if (conv_policy_) {
+    weights_.policy1.weights =
+        WinogradFilterTransformF(weights_.policy1.weights, channels, channels);
+    auto pol_channels = weights_.policy.biases.size();
+    weights_.policy.weights = WinogradFilterTransformF(weights_.policy.weights,
+                                                       pol_channels, channels);
+  }
+}
+
+template <WinogradSgemm::Precision precision>
 std::unique_ptr<Network> MakeBlasNetwork(const WeightsFile& weights,
                                          const OptionsDict& options) {
   if (weights.format().network_format().network() !=
@@ -446,10 +741,14 @@ std::unique_ptr<Network> MakeBlasNetwork(const WeightsFile& weights,
                     std::to_string(weights.format().network_format().value()) +
                     " is not supported by BLAS backend.");
   }
-  return std::make_unique<BlasNetwork>(weights, options);
+  return std::make_unique<BlasNetwork>(weights, options, precision);
 }
 
-REGISTER_NETWORK("blas", MakeBlasNetwork, 50)
+REGISTER_NETWORK("blas", MakeBlasNetwork<WinogradSgemm::Precision::kFp32>, 50)
+REGISTER_NETWORK("blas-bf16",
+                 MakeBlasNetwork<WinogradSgemm::Precision::kBf16>, 49)
+REGISTER_NETWORK("blas-fp16",
+                 MakeBlasNetwork<WinogradSgemm::Precision::kFp16>, 48)
 
 }  // namespace
 }  // namespace lczero
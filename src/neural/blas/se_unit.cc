@@ -19,6 +19,7 @@
 #include "neural/blas/se_unit.h"
 #include "neural/blas/fully_connected_layer.h"
 
+#include <algorithm>
 #include <cmath>
 
 namespace lczero {
@@ -28,20 +29,26 @@ constexpr int kHeight = 8;
 constexpr int kSquares = kWidth * kHeight;
 }  // namespace
 
-static void global_avg_pooling(const size_t channels, const float* input,
+// Activations of the samples handled in one go: each block is pooled and
+// then scaled while still in L2, rather than streaming the whole batch from
+// memory twice.
+constexpr size_t kBlockBytes = 256 * 1024;
+
+static void global_avg_pooling(const size_t batch_size, const size_t channels,
+                               const float* input, const float* biases,
                                float* output) {
-  for (auto c = size_t{0}; c < channels; c++) {
+  for (auto c = size_t{0}; c < batch_size * channels; c++) {
     auto acc = 0.0f;
     for (auto i = size_t{0}; i < kSquares; i++) {
       acc += input[c * kSquares + i];
     }
-    output[c] = acc / kSquares;
+    output[c] = acc / kSquares + (biases ? biases[c % channels] : 0.0f);
   }
 }
 
 static void apply_se(const size_t channels, const size_t batch_size,
-                     const float* input, const float* res, const float* scale,
-                     float* output) {
+                     const float* input, const float* biases,
+                     const float* res, const float* scale, float* output) {
   const auto lambda_ReLU = [](const auto val) {
     return (val > 0.0f) ? val : 0;
   };
@@ -53,7 +60,9 @@ static void apply_se(const size_t channels, const size_t batch_size,
   for (auto c = size_t{0}; c < channels * batch_size; c++) {
     auto batch = c / channels;
     auto gamma = lambda_sigmoid(scale[c + batch * channels]);
-    auto beta = scale[c + batch * channels + channels];
+    // gamma * (x + bias) + beta, with the bias folded into beta.
+    auto beta = scale[c + batch * channels + channels] +
+                (biases ? gamma * biases[c % channels] : 0.0f);
     for (auto i = size_t{0}; i < kSquares; i++) {
       output[c * kSquares + i] = lambda_ReLU(gamma * input[c * kSquares + i] +
                                              beta + res[c * kSquares + i]);
@@ -63,26 +72,32 @@ static void apply_se(const size_t channels, const size_t batch_size,
 
 void ApplySEUnit(const size_t batch_size, const size_t channels,
                  const size_t se_fc_outputs, const float* input,
-                 const float* residual, const float* weights_w1,
-                 const float* weights_b1, const float* weights_w2,
-                 const float* weights_b2, float* output) {
-  std::vector<float> pool(2 * channels * batch_size);
-  std::vector<float> fc_out1(batch_size * se_fc_outputs);
-
-  global_avg_pooling(channels * batch_size, input, pool.data());
-
-  FullyConnectedLayer::Forward1D(batch_size, channels, se_fc_outputs,
-                                 pool.data(), weights_w1, weights_b1,
-                                 true,  // Relu On
-                                 fc_out1.data());
-
-  FullyConnectedLayer::Forward1D(batch_size, se_fc_outputs, 2 * channels,
-                                 fc_out1.data(), weights_w2, weights_b2,
-                                 false,  // Relu Off
-                                 pool.data());
-
-  // Sigmoid, scale and add residual
-  apply_se(channels, batch_size, input, residual, pool.data(), output);
+                 const float* input_biases, const float* residual,
+                 const float* weights_w1, const float* weights_b1,
+                 const float* weights_w2, const float* weights_b2,
+                 float* output, float* pool, float* fc_out1) {
+  const auto block_size = std::max(
+      size_t{1}, kBlockBytes / (channels * kSquares * sizeof(float)));
+  for (auto begin = size_t{0}; begin < batch_size; begin += block_size) {
+    const auto size = std::min(block_size, batch_size - begin);
+    const auto offset = begin * channels * kSquares;
+
+    global_avg_pooling(size, channels, input + offset, input_biases, pool);
+
+    FullyConnectedLayer::Forward1D(size, channels, se_fc_outputs, pool,
+                                   weights_w1, weights_b1,
+                                   true,  // Relu On
+                                   fc_out1);
+
+    FullyConnectedLayer::Forward1D(size, se_fc_outputs, 2 * channels,
+                                   fc_out1, weights_w2, weights_b2,
+                                   false,  // Relu Off
+                                   pool);
+
+    // Sigmoid, scale and add residual
+    apply_se(channels, size, input + offset, input_biases, residual + offset,
+             pool, output + offset);
+  }
 }
 
 }  // namespace lczero
@@ -22,10 +22,15 @@
 
 namespace lczero {
 
+// output = relu(SE(input + input_biases) + residual) in a single pass per
+// block of samples. @input_biases, the biases of the preceding convolution,
+// may be null if already added. @pool and @fc_out1 are scratch buffers of
+// 2 * channels * batch_size and se_fc_outputs * batch_size elements.
 void ApplySEUnit(const size_t batch_size, const size_t channels,
                  const size_t se_fc_outputs, const float* input,
-                 const float* residual, const float* weights_w1,
-                 const float* weights_b1, const float* weights_w2,
-                 const float* weights_b2, float* output);
+                 const float* input_biases, const float* residual,
+                 const float* weights_w1, const float* weights_b1,
+                 const float* weights_w2, const float* weights_b2,
+                 float* output, float* pool, float* fc_out1);
 
 }  // namespace lczero
@@ -33,9 +33,11 @@ namespace lczero {
 
 WinogradConvolution3::WinogradConvolution3(const size_t max_batch_size,
                                            const size_t max_input_layers,
-                                           const size_t max_output_layers)
+                                           const size_t max_output_layers,
+                                           WinogradSgemm* sgemm)
     : V_(max_batch_size * kWinogradTile * max_input_layers * kTiles),
-      M_(max_batch_size * kWinogradTile * max_output_layers * kTiles) {}
+      M_(max_batch_size * kWinogradTile * max_output_layers * kTiles),
+      sgemm_(sgemm) {}
 
 void WinogradConvolution3::Forward(const size_t batch_size,
                                    const size_t input_channels,
@@ -151,6 +153,13 @@ void WinogradConvolution3::TransformIn(const size_t batch_size,
 void WinogradConvolution3::Sgemm(const size_t batch_size, const float* weights,
                                  const size_t input_channels,
                                  const size_t output_channels) {
+  if (sgemm_) {
+    // Same products as below, the tiles are packed back to back.
+    sgemm_->Multiply(kWinogradTile, output_channels, batch_size * kTiles,
+                     input_channels, weights, &V_[0], &M_[0]);
+    return;
+  }
+
 #ifdef USE_MKL
 
   /*
@@ -20,6 +20,7 @@
 
 #include <cstddef>
 #include <vector>
+#include "neural/blas/winograd_sgemm.h"
 
 namespace lczero {
 
@@ -38,10 +39,12 @@ class WinogradConvolution3 {
  public:
   // The instance will allocate memory resources for the
   // largest batch size, and the largest input and output
-  // layers.
+  // layers. With @sgemm, matrix multiplication goes through it instead of
+  // the BLAS library.
   WinogradConvolution3(const size_t max_batch_size,
                        const size_t max_input_layers,
-                       const size_t max_output_layers);
+                       const size_t max_output_layers,
+                       WinogradSgemm* sgemm = nullptr);
 
   // Forward inference, batched.
   void Forward(const size_t batch_size, const size_t input_channels,
@@ -70,5 +73,6 @@ class WinogradConvolution3 {
 
   std::vector<float> V_;
   std::vector<float> M_;
+  WinogradSgemm* const sgemm_;
 };
 }  // namespace lczero
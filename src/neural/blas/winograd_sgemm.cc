@@ -0,0 +1,297 @@
+/*
+ This file is part of Leela Chess Zero.
+ Copyright (C) 2019 The LCZero Authors
+
+ Leela Chess is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ Leela Chess is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "neural/blas/winograd_sgemm.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstring>
+#include <mutex>
+#include "utils/cpu.h"
+#include "utils/fp16_utils.h"
+
+#if defined(LC0_CPU_DISPATCH)
+#include <immintrin.h>
+#endif
+
+namespace lczero {
+namespace {
+
+// How the A matrix is stored: element type and scalar loads.
+struct Fp32Weights {
+  using Type = float;
+  static float Get(const float* p) { return *p; }
+};
+
+struct Bf16Weights {
+  using Type = uint16_t;
+  static float Get(const uint16_t* p) { return BF16toFP32(*p); }
+};
+
+struct Fp16Weights {
+  using Type = uint16_t;
+  static float Get(const uint16_t* p) { return FP16toFP32(*p); }
+};
+
+// Columns of B processed by one job, small enough for their k x kJobColumns
+// block of B to stay in L2 while all rows of A are run over it.
+constexpr size_t kJobColumns = 64;
+// Columns per kernel call.
+constexpr size_t kKernelColumns = 4;
+
+// C[i0:i1, j0:j1] = A[i0:i1, :] x B[:, j0:j1].
+template <typename Weights>
+void ScalarBlock(size_t m, size_t k, const typename Weights::Type* A,
+                 const float* B, float* C, size_t i0, size_t i1, size_t j0,
+                 size_t j1) {
+  for (size_t j = j0; j < j1; j++) {
+    for (size_t i = i0; i < i1; i++) C[i + j * m] = 0.0f;
+    for (size_t p = 0; p < k; p++) {
+      const float b = B[p + j * k];
+      for (size_t i = i0; i < i1; i++) {
+        C[i + j * m] += Weights::Get(&A[i + p * m]) * b;
+      }
+    }
+  }
+}
+
+#if defined(LC0_CPU_DISPATCH)
+LC0_TARGET_BEGIN("avx512f,avx512bw,avx2,fma,f16c")
+namespace avx512 {
+using Vec = __m512;
+constexpr size_t kLanes = 16;
+inline Vec VecZero() { return _mm512_setzero_ps(); }
+inline Vec VecLoad(const float* p) { return _mm512_loadu_ps(p); }
+inline Vec VecBroadcast(const float* p) { return _mm512_set1_ps(*p); }
+inline Vec VecFma(Vec a, Vec b, Vec c) { return _mm512_fmadd_ps(a, b, c); }
+inline void VecStore(float* p, Vec v) { _mm512_storeu_ps(p, v); }
+inline Vec VecLoadBf16(const uint16_t* p) {
+  const __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+  return _mm512_castsi512_ps(_mm512_slli_epi32(_mm512_cvtepu16_epi32(x), 16));
+}
+inline Vec VecLoadFp16(const uint16_t* p) {
+  // The unmasked form trips -Wmaybe-uninitialized in GCC 12 headers.
+  return _mm512_mask_cvtph_ps(
+      _mm512_setzero_ps(), 0xFFFF,
+      _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p)));
+}
+#include "neural/blas/winograd_sgemm_kernel.inc"
+}  // namespace avx512
+LC0_TARGET_END
+
+LC0_TARGET_BEGIN("avx2,fma,f16c")
+namespace avx2 {
+using Vec = __m256;
+constexpr size_t kLanes = 8;
+inline Vec VecZero() { return _mm256_setzero_ps(); }
+inline Vec VecLoad(const float* p) { return _mm256_loadu_ps(p); }
+inline Vec VecBroadcast(const float* p) { return _mm256_broadcast_ss(p); }
+inline Vec VecFma(Vec a, Vec b, Vec c) { return _mm256_fmadd_ps(a, b, c); }
+inline void VecStore(float* p, Vec v) { _mm256_storeu_ps(p, v); }
+inline Vec VecLoadBf16(const uint16_t* p) {
+  const __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+  return _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_cvtepu16_epi32(x), 16));
+}
+inline Vec VecLoadFp16(const uint16_t* p) {
+  return _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p)));
+}
+#include "neural/blas/winograd_sgemm_kernel.inc"
+}  // namespace avx2
+LC0_TARGET_END
+#endif
+
+// Columns [j0, j1) of a single product, with the widest vectors the CPU
+// has.
+template <typename Weights>
+void MultiplyColumns(size_t m, size_t k, const typename Weights::Type* A,
+                     const float* B, float* C, size_t j0, size_t j1) {
+#if defined(LC0_CPU_DISPATCH)
+  const CpuFeatures& cpu = GetCpuFeatures();
+  if (cpu.avx512) {
+    return avx512::MultiplyColumns<Weights>(m, k, A, B, C, j0, j1);
+  }
+  if (cpu.avx2) return avx2::MultiplyColumns<Weights>(m, k, A, B, C, j0, j1);
+#endif
+  ScalarBlock<Weights>(m, k, A, B, C, 0, m, j0, j1);
+}
+
+#if defined(__AVX512BF16__)
+// With native bf16 dot products, A is stored as pairs of consecutive k, one
+// pair per row: element (i, p) is at ((p / 2) * m + i) * 2 + p % 2, with k
+// padded to even. Columns of B get converted to bf16 the same way, and each
+// instruction accumulates two k steps for 16 rows.
+constexpr size_t kBf16Rows = 32;
+
+// C block of kBf16Rows x kKernelColumns at (i, 0), @B holding the columns
+// of the block, 2 * @pairs elements each.
+void KernelBlockBf16(size_t m, size_t pairs, const uint16_t* A,
+                     const uint16_t* B, float* C, size_t i) {
+  __m512 acc[2][kKernelColumns];
+  for (size_t c = 0; c < kKernelColumns; c++) {
+    acc[0][c] = _mm512_setzero_ps();
+    acc[1][c] = _mm512_setzero_ps();
+  }
+  const uint16_t* a = A + 2 * i;
+  for (size_t q = 0; q < pairs; q++, a += 2 * m) {
+    const __m512i a0 = _mm512_loadu_si512(a);
+    const __m512i a1 = _mm512_loadu_si512(a + 32);
+    for (size_t c = 0; c < kKernelColumns; c++) {
+      uint32_t pair;
+      std::memcpy(&pair, B + c * 2 * pairs + 2 * q, sizeof(pair));
+      const __m512i bc = _mm512_set1_epi32(pair);
+      acc[0][c] = _mm512_dpbf16_ps(acc[0][c], (__m512bh)a0, (__m512bh)bc);
+      acc[1][c] = _mm512_dpbf16_ps(acc[1][c], (__m512bh)a1, (__m512bh)bc);
+    }
+  }
+  for (size_t c = 0; c < kKernelColumns; c++) {
+    _mm512_storeu_ps(C + i + c * m, acc[0][c]);
+    _mm512_storeu_ps(C + i + 16 + c * m, acc[1][c]);
+  }
+}
+
+// Same as MultiplyColumns(), with A in the paired layout.
+void MultiplyColumnsBf16(size_t m, size_t k, const uint16_t* A,
+                         const float* B, float* C, size_t j0, size_t j1) {
+  const size_t pairs = (k + 1) / 2;
+  thread_local std::vector<uint16_t> b16;
+  b16.assign(2 * pairs * (j1 - j0), 0);
+  for (size_t j = j0; j < j1; j++) {
+    for (size_t p = 0; p < k; p++) {
+      b16[(j - j0) * 2 * pairs + p] = FP32toBF16(B[p + j * k]);
+    }
+  }
+  auto scalar = [&](size_t i0, size_t i1, size_t jb0, size_t jb1) {
+    for (size_t j = jb0; j < jb1; j++) {
+      for (size_t i = i0; i < i1; i++) {
+        float sum = 0.0f;
+        for (size_t p = 0; p < k; p++) {
+          sum += BF16toFP32(A[((p / 2) * m + i) * 2 + p % 2]) *
+                 BF16toFP32(b16[(j - j0) * 2 * pairs + p]);
+        }
+        C[i + j * m] = sum;
+      }
+    }
+  };
+  const size_t m_vec = m - m % kBf16Rows;
+  const size_t j_vec = j0 + (j1 - j0) - (j1 - j0) % kKernelColumns;
+  for (size_t i = 0; i < m_vec; i += kBf16Rows) {
+    for (size_t j = j0; j < j_vec; j += kKernelColumns) {
+      KernelBlockBf16(m, pairs, A, &b16[(j - j0) * 2 * pairs], C + j * m, i);
+    }
+  }
+  scalar(m_vec, m, j0, j_vec);
+  scalar(0, m, j_vec, j1);
+}
+#endif
+
+}  // namespace
+
+WinogradSgemm::WinogradSgemm(int threads, Precision precision)
+    : threads_(std::max(threads, 1)),
+      precision_(precision),
+      pool_(std::max(threads - 1, 1)) {}
+
+bool WinogradSgemm::HasNativeBf16() {
+#if defined(__AVX512BF16__)
+  return true;
+#else
+  return false;
+#endif
+}
+
+void WinogradSgemm::PackWeights(size_t batches, size_t m, size_t k,
+                                const float* A) {
+  if (precision_ == Precision::kFp32) return;
+  const bool paired = precision_ == Precision::kBf16 && HasNativeBf16();
+  PackedWeights& packed = packed_[A];
+  packed.stride = paired ? m * 2 * ((k + 1) / 2) : m * k;
+  packed.data.assign(batches * packed.stride, 0);
+  for (size_t batch = 0; batch < batches; batch++) {
+    uint16_t* dst = &packed.data[batch * packed.stride];
+    const float* src = A + batch * m * k;
+    for (size_t p = 0; p < k; p++) {
+      for (size_t i = 0; i < m; i++) {
+        const float x = src[i + p * m];
+        dst[paired ? ((p / 2) * m + i) * 2 + p % 2 : i + p * m] =
+            precision_ == Precision::kBf16 ? FP32toBF16(x) : FP32toFP16(x);
+      }
+    }
+  }
+}
+
+template <typename Job>
+void WinogradSgemm::RunJobs(size_t batches, size_t n, const Job& job) {
+  const size_t column_jobs = (n + kJobColumns - 1) / kJobColumns;
+  const size_t jobs = batches * column_jobs;
+  std::atomic<size_t> next_job{0};
+  auto work = [&]() {
+    for (size_t index = next_job++; index < jobs; index = next_job++) {
+      const size_t j0 = (index % column_jobs) * kJobColumns;
+      job(index / column_jobs, j0, std::min(n, j0 + kJobColumns));
+    }
+  };
+
+  // Helpers share the jobs with the calling thread; they reference this
+  // stack frame, so all of them have to finish before returning.
+  const int helpers =
+      static_cast<int>(std::min<size_t>(threads_ - 1, jobs ? jobs - 1 : 0));
+  std::mutex mutex;
+  std::condition_variable cv;
+  int running = helpers;
+  for (int i = 0; i < helpers; i++) {
+    pool_.Add([&]() {
+      work();
+      std::lock_guard<std::mutex> lock(mutex);
+      if (--running == 0) cv.notify_one();
+    });
+  }
+  work();
+  std::unique_lock<std::mutex> lock(mutex);
+  cv.wait(lock, [&]() { return running == 0; });
+}
+
+void WinogradSgemm::Multiply(size_t batches, size_t m, size_t n, size_t k,
+                             const float* A, const float* B, float* C) {
+  const auto packed = packed_.find(A);
+  if (packed == packed_.end()) {
+    RunJobs(batches, n, [&](size_t batch, size_t j0, size_t j1) {
+      MultiplyColumns<Fp32Weights>(m, k, A + batch * m * k, B + batch * k * n,
+                                   C + batch * m * n, j0, j1);
+    });
+    return;
+  }
+
+  const uint16_t* A16 = packed->second.data.data();
+  const size_t stride = packed->second.stride;
+  RunJobs(batches, n, [&](size_t batch, size_t j0, size_t j1) {
+    const float* b = B + batch * k * n;
+    float* c = C + batch * m * n;
+    if (precision_ == Precision::kFp16) {
+      MultiplyColumns<Fp16Weights>(m, k, A16 + batch * stride, b, c, j0, j1);
+    } else {
+#if defined(__AVX512BF16__)
+      MultiplyColumnsBf16(m, k, A16 + batch * stride, b, c, j0, j1);
+#else
+      MultiplyColumns<Bf16Weights>(m, k, A16 + batch * stride, b, c, j0, j1);
+#endif
+    }
+  });
+}
+
+}  // namespace lczero
@@ -0,0 +1,74 @@
+/*
+ This file is part of Leela Chess Zero.
+ Copyright (C) 2019 The LCZero Authors
+
+ Leela Chess is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ Leela Chess is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+#include "utils/threadpool.h"
+
+namespace lczero {
+
+// Batched matrix multiplication for the Winograd convolution which doesn't
+// go through the BLAS library, so that its threading doesn't compete with
+// the search threads. Uses AVX2 or AVX-512 kernels when the CPU has them.
+class WinogradSgemm {
+ public:
+  // Precision of the weights (the A matrices). Products are always
+  // accumulated in fp32.
+  enum class Precision { kFp32, kBf16, kFp16 };
+
+  // Uses @threads threads, counting the calling one.
+  explicit WinogradSgemm(int threads, Precision precision = Precision::kFp32);
+
+  // Converts the @batches m x k matrices at @A to the reduced precision, to
+  // be used whenever Multiply() is given the same @A. Does nothing in fp32.
+  // Not thread safe, meant to be called while loading the weights.
+  void PackWeights(size_t batches, size_t m, size_t k, const float* A);
+
+  // For every one of @batches, C = A x B, where A is m x k, B is k x n and
+  // C is m x n. Matrices are column major and packed one batch after another.
+  void Multiply(size_t batches, size_t m, size_t n, size_t k, const float* A,
+                const float* B, float* C);
+
+  int GetThreads() const { return threads_; }
+  Precision GetPrecision() const { return precision_; }
+  // Whether bf16 uses the CPU's bf16 dot products, which also round B to
+  // bf16. Otherwise reduced precision weights are widened before use.
+  static bool HasNativeBf16();
+
+ private:
+  struct PackedWeights {
+    std::vector<uint16_t> data;
+    // Elements between consecutive batches.
+    size_t stride;
+  };
+
+  // Runs @job(batch, first column, end column) over all the column blocks.
+  template <typename Job>
+  void RunJobs(size_t batches, size_t n, const Job& job);
+
+  const int threads_;
+  const Precision precision_;
+  ThreadPool pool_;
+  std::unordered_map<const float*, PackedWeights> packed_;
+};
+
+}  // namespace lczero
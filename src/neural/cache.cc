@@ -25,101 +25,898 @@
   Program grant you additional permission to convey the resulting work.
 */
 #include "neural/cache.h"
+#include <algorithm>
 #include <cassert>
+#include <cstring>
+#include <fstream>
 #include <iostream>
+#include <memory>
+#include <unordered_set>
+#include "utils/exception.h"
+#include "utils/fp16_utils.h"
 
 namespace lczero {
+
+constexpr uint32_t NNCache::kNone;
+constexpr int NNCache::kMovesPerChunk;
+
+namespace {
+// Largest fp16 value below 1.0.
+const uint16_t kFP16BelowOne = 0x3BFF;
+
+// Returns the @i-th sketch counter of @key, double hashing a mix of the key.
+size_t SketchSlot(uint64_t key, uint32_t i, size_t mask) {
+  const uint64_t hash = (key ^ (key >> 29)) * 0xBF58476D1CE4E5B9ull;
+  const uint32_t h1 = hash >> 32;
+  const uint32_t h2 = static_cast<uint32_t>(hash) | 1;
+  return (h1 + i * h2) & mask;
+}
+
+// Cache file layout, in native byte order: FileHeader, FileIndexEntry
+// for every entry sorted by key, then for every entry a FileEntryHeader
+// followed by num_moves pairs of uint16 (move index, fp16 probability).
+const char kFileMagic[8] = {'L', 'c', '0', 'N', 'N', 'C', '0', '2'};
+struct FileHeader {
+  char magic[8];
+  uint64_t weights_hash;
+  uint64_t num_entries;
+};
+struct FileEntryHeader {
+  float q;
+  float d;
+  uint32_t num_moves;
+};
+}  // namespace
+
+NNCache::NNCache(int capacity) { SetCapacity(capacity); }
+
+NNCache::~NNCache() {
+#ifndef NDEBUG
+  for (auto& shard : shards_) {
+    Mutex::Lock lock(shard.mutex);
+    for (uint32_t i = 0; i < shard.num_entries; ++i) {
+      assert(shard.entries[i].pins == 0);
+    }
+  }
+#endif
+}
+
+NNCache::Shard& NNCache::GetShard(uint64_t key) {
+  // Keys are hashes already. The table index takes the low bits, the shard
+  // the high bits of a multiplicative mix.
+  static_assert(kShards == 16, "Shard index is the top 4 bits.");
+  return shards_[(key * 0x9E3779B97F4A7C15ull) >> 60];
+}
+
+void NNCache::Allocate(Shard* shard, int capacity) {
+  // Entries are not movable, so the storage is swapped in.
+  std::vector<Entry, LargeAllocator<Entry>>(capacity).swap(shard->entries);
+  shard->num_entries = capacity;
+  shard->free_entries.clear();
+  shard->free_entries.reserve(capacity);
+  for (int i = capacity - 1; i >= 0; --i) {
+    shard->entries[i].pins = 0;
+    shard->free_entries.push_back(i);
+  }
+
+  const size_t num_chunks = static_cast<size_t>(capacity) * kChunksPerEntry;
+  shard->chunks.assign(num_chunks, PolicyChunk());
+  shard->free_chunk = kNone;
+  for (size_t i = num_chunks; i-- > 0;) {
+    shard->chunks[i].next = shard->free_chunk;
+    shard->free_chunk = i;
+  }
+  shard->free_chunks = num_chunks;
+
+  // At most half full.
+  size_t table_size = 1;
+  while (table_size < static_cast<size_t>(capacity) * 2) table_size *= 2;
+  shard->table.assign(table_size, kNone);
+  for (auto& list : shard->lists) list = Shard::List();
+  shard->retained_capacity = capacity * kRetainedPercent / 100;
+
+  shard->sketch_additions = 0;
+  if (GetPolicy() == Policy::kTinyLfu && capacity > 0) {
+    shard->window_capacity = std::max(1, capacity * kWindowPercent / 100);
+    shard->sketch.assign(table_size, 0);
+    shard->sketch_period = 10 * capacity;
+  } else {
+    shard->window_capacity = 0;
+    std::vector<uint8_t>().swap(shard->sketch);
+    shard->sketch_period = 0;
+  }
+}
+
+size_t NNCache::FindSlot(const Shard& shard, uint64_t key) {
+  const size_t mask = shard.table.size() - 1;
+  size_t slot = key & mask;
+  while (shard.table[slot] != kNone &&
+         shard.entries[shard.table[slot]].key != key) {
+    slot = (slot + 1) & mask;
+  }
+  return slot;
+}
+
+void NNCache::Insert(uint64_t key, float q, float d, const IdxAndProb* policy,
+                     int num_moves, bool prefetched, bool retain) {
+  if (GetCapacity() == 0) return;
+  Shard& shard = GetShard(key);
+  Mutex::Lock lock(shard.mutex);
+
+  size_t slot = FindSlot(shard, key);
+  if (shard.table[slot] != kNone) {
+    if (shard.entries[shard.table[slot]].list == kRetainedList) return;
+    Evict(&shard, shard.table[slot]);
+  }
+  const bool tiny_lfu = GetPolicy() == Policy::kTinyLfu;
+  if (tiny_lfu) RecordAccess(&shard, key);
+
+  const uint32_t chunks_needed =
+      (num_moves + kMovesPerChunk - 1) / kMovesPerChunk;
+  while (shard.free_entries.empty() || shard.free_chunks < chunks_needed) {
+    // Everything left is pinned, or a position with too many moves.
+    if (!EvictForSpace(&shard)) return;
+  }
+
+  const uint32_t idx = shard.free_entries.back();
+  shard.free_entries.pop_back();
+  Entry& entry = shard.entries[idx];
+  entry.key = key;
+  entry.q = q;
+  entry.d = d;
+  entry.prefetched.store(prefetched, std::memory_order_relaxed);
+  entry.num_moves = num_moves;
+  entry.evicted = false;
+  entry.weight = 0;
+  entry.generation = generation_.load(std::memory_order_relaxed);
+  entry.pins = 0;
+
+  // Take chunks from the free list and fill them.
+  entry.first_chunk = chunks_needed ? shard.free_chunk : kNone;
+  uint32_t chunk = kNone;
+  for (int i = 0; i < num_moves; ++i) {
+    if (i % kMovesPerChunk == 0) {
+      chunk = shard.free_chunk;
+      shard.free_chunk = shard.chunks[chunk].next;
+      --shard.free_chunks;
+    }
+    auto& move = shard.chunks[chunk].moves[i % kMovesPerChunk];
+    move.idx = policy[i].first;
+    // Rounding must not turn a probability below one into exactly one, the
+    // fast log/pow pair of the policy softmax overshoots 1.0 there.
+    move.p = policy[i].second < 1.0f
+                 ? std::min(FP32toFP16(policy[i].second), kFP16BelowOne)
+                 : FP32toFP16(policy[i].second);
+  }
+  if (chunk != kNone) shard.chunks[chunk].next = kNone;
+
+  // Removal in Evict() may have shifted entries of the probe sequence.
+  slot = FindSlot(shard, key);
+  shard.table[slot] = idx;
+
+  if (retain &&
+      shard.lists[kRetainedList].size < shard.retained_capacity) {
+    PushFront(&shard, kRetainedList, idx);
+  } else {
+    PushFront(&shard, tiny_lfu ? kWindowList : kMainList, idx);
+  }
+  // While there is free memory, entries leave the window without admission.
+  while (shard.lists[kWindowList].size > shard.window_capacity) {
+    const uint32_t oldest = shard.lists[kWindowList].tail;
+    Unlink(&shard, oldest);
+    PushFront(&shard, kMainList, oldest);
+  }
+  size_.fetch_add(1, std::memory_order_relaxed);
+}
+
+bool NNCache::EvictForSpace(Shard* shard) {
+  Shard::List& main = shard->lists[kMainList];
+  const Shard::List& window = shard->lists[kWindowList];
+  switch (GetPolicy()) {
+    case Policy::kLru:
+      break;
+    case Policy::kTinyLfu:
+      if (window.tail != kNone &&
+          (window.size >= shard->window_capacity || main.tail == kNone)) {
+        // The oldest window entry either replaces the main victim, or is
+        // dropped itself.
+        const uint32_t candidate = window.tail;
+        if (main.tail == kNone) {
+          ++shard->stats.evictions;
+          Evict(shard, candidate);
+        } else if (EstimateFrequency(*shard, shard->entries[candidate].key) >
+                   EstimateFrequency(*shard, shard->entries[main.tail].key)) {
+          ++shard->stats.evictions;
+          Evict(shard, main.tail);
+          Unlink(shard, candidate);
+          PushFront(shard, kMainList, candidate);
+        } else {
+          ++shard->stats.rejections;
+          Evict(shard, candidate);
+        }
+        return true;
+      }
+      break;
+    case Policy::kWeighted:
+      for (int i = 0; i < kMaxWeightedSkips && main.tail != kNone &&
+                      shard->entries[main.tail].weight > 0;
+           ++i) {
+        const uint32_t oldest = main.tail;
+        shard->entries[oldest].weight /= 2;
+        Unlink(shard, oldest);
+        PushFront(shard, kMainList, oldest);
+      }
+      break;
+  }
+  if (main.tail == kNone) return false;
+  ++shard->stats.evictions;
+  Evict(shard, main.tail);
+  return true;
+}
+
+void NNCache::PushFront(Shard* shard, int list, uint32_t idx) {
+  Entry& entry = shard->entries[idx];
+  Shard::List& l = shard->lists[list];
+  entry.list = list;
+  entry.lru_prev = kNone;
+  entry.lru_next = l.head;
+  if (l.head != kNone) shard->entries[l.head].lru_prev = idx;
+  l.head = idx;
+  if (l.tail == kNone) l.tail = idx;
+  ++l.size;
+}
+
+void NNCache::PushBack(Shard* shard, int list, uint32_t idx) {
+  Entry& entry = shard->entries[idx];
+  Shard::List& l = shard->lists[list];
+  entry.list = list;
+  entry.lru_next = kNone;
+  entry.lru_prev = l.tail;
+  if (l.tail != kNone) shard->entries[l.tail].lru_next = idx;
+  l.tail = idx;
+  if (l.head == kNone) l.head = idx;
+  ++l.size;
+}
+
+void NNCache::Unlink(Shard* shard, uint32_t idx) {
+  Entry& entry = shard->entries[idx];
+  Shard::List& l = shard->lists[entry.list];
+  if (entry.lru_prev == kNone) {
+    l.head = entry.lru_next;
+  } else {
+    shard->entries[entry.lru_prev].lru_next = entry.lru_next;
+  }
+  if (entry.lru_next == kNone) {
+    l.tail = entry.lru_prev;
+  } else {
+    shard->entries[entry.lru_next].lru_prev = entry.lru_prev;
+  }
+  --l.size;
+}
+
+void NNCache::RecordAccess(Shard* shard, uint64_t key) {
+  auto& sketch = shard->sketch;
+  if (sketch.empty()) return;
+  const size_t mask = sketch.size() - 1;
+  for (uint32_t i = 0; i < 4; ++i) {
+    uint8_t& counter = sketch[SketchSlot(key, i, mask)];
+    if (counter < 15) ++counter;
+  }
+  // Aging, so that the sketch follows the search.
+  if (++shard->sketch_additions >= shard->sketch_period) {
+    for (auto& counter : sketch) counter /= 2;
+    shard->sketch_additions /= 2;
+  }
+}
+
+int NNCache::EstimateFrequency(const Shard& shard, uint64_t key) {
+  const auto& sketch = shard.sketch;
+  if (sketch.empty()) return 0;
+  const size_t mask = sketch.size() - 1;
+  int frequency = 15;
+  for (uint32_t i = 0; i < 4; ++i) {
+    frequency = std::min<int>(frequency, sketch[SketchSlot(key, i, mask)]);
+  }
+  return frequency;
+}
+
+bool NNCache::ContainsKey(uint64_t key) {
+  if (GetCapacity() == 0) return false;
+  {
+    Shard& shard = GetShard(key);
+    Mutex::Lock lock(shard.mutex);
+    const uint32_t idx = shard.table[FindSlot(shard, key)];
+    if (idx != kNone && shard.entries[idx].generation ==
+                            generation_.load(std::memory_order_relaxed)) {
+      return true;
+    }
+  }
+  return FindInFile(key) != nullptr;
+}
+
+const char* NNCache::FindInFile(uint64_t key) const {
+  if (!file_) return nullptr;
+  const FileIndexEntry* end = file_index_ + file_entries_;
+  const FileIndexEntry* iter = std::lower_bound(
+      file_index_, end, key,
+      [](const FileIndexEntry& a, uint64_t b) { return a.key < b; });
+  if (iter == end || iter->key != key) return nullptr;
+  return file_->data() + iter->offset;
+}
+
+bool NNCache::PromoteFromFile(uint64_t key) {
+  const char* data = FindInFile(key);
+  if (!data) return false;
+  FileEntryHeader header;
+  std::memcpy(&header, data, sizeof(header));
+  data += sizeof(header);
+  std::vector<IdxAndProb> policy(header.num_moves);
+  for (auto& move : policy) {
+    uint16_t raw[2];
+    std::memcpy(raw, data, sizeof(raw));
+    data += sizeof(raw);
+    move = {raw[0], FP16toFP32(raw[1])};
+  }
+  Insert(key, header.q, header.d, policy.data(), policy.size(), false);
+  return true;
+}
+
+void NNCache::CloseFile() {
+  file_.reset();
+  file_index_ = nullptr;
+  file_entries_ = 0;
+}
+
+bool NNCache::LoadFromFile(const std::string& filename,
+                           uint64_t weights_hash) {
+  CloseFile();
+  std::unique_ptr<MappedFile> file;
+  try {
+    file = std::make_unique<MappedFile>(filename);
+  } catch (const Exception&) {
+    return false;
+  }
+
+  FileHeader header;
+  if (file->size() < sizeof(header)) return false;
+  std::memcpy(&header, file->data(), sizeof(header));
+  if (std::memcmp(header.magic, kFileMagic, sizeof(kFileMagic)) != 0 ||
+      header.weights_hash != weights_hash) {
+    return false;
+  }
+  const size_t index_end =
+      sizeof(header) + header.num_entries * sizeof(FileIndexEntry);
+  if (header.num_entries > file->size() / sizeof(FileIndexEntry) ||
+      index_end > file->size()) {
+    return false;
+  }
+  const auto* index =
+      reinterpret_cast<const FileIndexEntry*>(file->data() + sizeof(header));
+  // Check all entries once, so that lookups may trust the file.
+  for (size_t i = 0; i < header.num_entries; ++i) {
+    if (i > 0 && index[i - 1].key >= index[i].key) return false;
+    if (index[i].offset < index_end ||
+        index[i].offset + sizeof(FileEntryHeader) > file->size()) {
+      return false;
+    }
+    FileEntryHeader entry;
+    std::memcpy(&entry, file->data() + index[i].offset, sizeof(entry));
+    if (entry.num_moves > (file->size() - index[i].offset -
+                           sizeof(FileEntryHeader)) / (2 * sizeof(uint16_t))) {
+      return false;
+    }
+  }
+
+  file_ = std::move(file);
+  file_index_ = index;
+  file_entries_ = header.num_entries;
+  return true;
+}
+
+void NNCache::SaveToFile(const std::string& filename, uint64_t weights_hash) {
+  std::vector<FileIndexEntry> index;
+  std::vector<char> data;
+  const size_t max_entries = std::max(0, GetCapacity());
+  auto append = [&data](const void* ptr, size_t size) {
+    const char* bytes = static_cast<const char*>(ptr);
+    data.insert(data.end(), bytes, bytes + size);
+  };
+
+  std::unordered_set<uint64_t> keys;
+  const uint16_t generation = generation_.load(std::memory_order_relaxed);
+  for (auto& shard : shards_) {
+    Mutex::Lock lock(shard.mutex);
+    for (const auto& list : shard.lists) {
+      for (uint32_t idx = list.head; idx != kNone;
+           idx = shard.entries[idx].lru_next) {
+        const Entry& entry = shard.entries[idx];
+        if (entry.generation != generation) continue;
+        index.push_back({entry.key, data.size()});
+        keys.insert(entry.key);
+        const FileEntryHeader header{entry.q, entry.d, entry.num_moves};
+        append(&header, sizeof(header));
+        uint32_t chunk = entry.first_chunk;
+        for (int i = 0; i < entry.num_moves; ++i) {
+          const PolicyEntry& move =
+              shard.chunks[chunk].moves[i % kMovesPerChunk];
+          append(&move, sizeof(move));
+          if (i % kMovesPerChunk == kMovesPerChunk - 1) {
+            chunk = shard.chunks[chunk].next;
+          }
+        }
+      }
+    }
+  }
+  for (size_t i = 0; i < file_entries_ && index.size() < max_entries; ++i) {
+    if (keys.count(file_index_[i].key)) continue;
+    const char* entry = file_->data() + file_index_[i].offset;
+    FileEntryHeader header;
+    std::memcpy(&header, entry, sizeof(header));
+    index.push_back({file_index_[i].key, data.size()});
+    append(entry, sizeof(header) + header.num_moves * 2 * sizeof(uint16_t));
+  }
+
+  std::sort(index.begin(), index.end(),
+            [](const FileIndexEntry& a, const FileIndexEntry& b) {
+              return a.key < b.key;
+            });
+  FileHeader header;
+  std::memcpy(header.magic, kFileMagic, sizeof(kFileMagic));
+  header.weights_hash = weights_hash;
+  header.num_entries = index.size();
+  const size_t data_start = sizeof(header) + index.size() * sizeof(index[0]);
+  for (auto& entry : index) entry.offset += data_start;
+
+  const std::string tmp_filename = filename + ".tmp";
+  {
+    std::ofstream out(tmp_filename, std::ios::binary | std::ios::trunc);
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char*>(index.data()),
+              index.size() * sizeof(index[0]));
+    out.write(data.data(), data.size());
+    if (!out) throw Exception("Cannot write NN cache file: " + tmp_filename);
+  }
+  // The old file cannot be replaced while mapped on some platforms.
+  CloseFile();
+  RenameFile(tmp_filename, filename);
+  LoadFromFile(filename, weights_hash);
+}
+
+void NNCache::Evict(Shard* shard, uint32_t idx) {
+  Entry& entry = shard->entries[idx];
+  size_.fetch_sub(1, std::memory_order_relaxed);
+  Unlink(shard, idx);
+
+  // Remove from the table, shifting back the following entries of the probe
+  // sequence so that no tombstones are needed.
+  const size_t mask = shard->table.size() - 1;
+  size_t hole = FindSlot(*shard, entry.key);
+  assert(shard->table[hole] == idx);
+  for (size_t slot = (hole + 1) & mask; shard->table[slot] != kNone;
+       slot = (slot + 1) & mask) {
+    const size_t home = shard->entries[shard->table[slot]].key & mask;
+    // Move the entry to the hole unless its home is cyclically in (hole, slot].
+    if (((slot - home) & mask) >= ((slot - hole) & mask)) {
+      shard->table[hole] = shard->table[slot];
+      hole = slot;
+    }
+  }
+  shard->table[hole] = kNone;
+
+  entry.evicted = true;
+  if (entry.pins == 0) Release(shard, idx);
+}
+
+void NNCache::Release(Shard* shard, uint32_t idx) {
+  Entry& entry = shard->entries[idx];
+  for (uint32_t chunk = entry.first_chunk; chunk != kNone;) {
+    const uint32_t next = shard->chunks[chunk].next;
+    shard->chunks[chunk].next = shard->free_chunk;
+    shard->free_chunk = chunk;
+    ++shard->free_chunks;
+    chunk = next;
+  }
+  shard->free_entries.push_back(idx);
+}
+
+void NNCache::Unpin(Shard* shard, uint32_t idx) {
+  Mutex::Lock lock(shard->mutex);
+  Entry& entry = shard->entries[idx];
+  assert(entry.pins > 0);
+  if (--entry.pins == 0 && entry.evicted) Release(shard, idx);
+}
+
+void NNCache::SetCapacity(int capacity) {
+  if (capacity < 0) capacity = 0;
+  if (capacity_.exchange(capacity) == capacity) return;
+  const int shard_capacity = (capacity + kShards - 1) / kShards;
+  for (auto& shard : shards_) {
+    Mutex::Lock lock(shard.mutex);
+    Allocate(&shard, shard_capacity);
+  }
+  size_.store(0, std::memory_order_relaxed);
+}
+
+void NNCache::SetPolicy(Policy policy) {
+  if (policy_.exchange(policy) == policy) return;
+  const int capacity = GetCapacity();
+  if (capacity < 0) return;
+  const int shard_capacity = (capacity + kShards - 1) / kShards;
+  for (auto& shard : shards_) {
+    Mutex::Lock lock(shard.mutex);
+    Allocate(&shard, shard_capacity);
+  }
+  size_.store(0, std::memory_order_relaxed);
+}
+
+void NNCache::Clear() {
+  for (auto& shard : shards_) {
+    Mutex::Lock lock(shard.mutex);
+    for (auto& list : shard.lists) {
+      while (list.tail != kNone) Evict(&shard, list.tail);
+    }
+  }
+}
+
+void NNCache::NewGeneration() {
+  generation_.fetch_add(1, std::memory_order_relaxed);
+  for (auto& shard : shards_) {
+    Mutex::Lock lock(shard.mutex);
+    // Stale retained entries go where they are evicted first.
+    Shard::List& retained = shard.lists[kRetainedList];
+    while (retained.head != kNone) {
+      const uint32_t idx = retained.head;
+      Unlink(&shard, idx);
+      PushBack(&shard, kMainList, idx);
+    }
+  }
+}
+
+size_t NNCache::GetBytesAllocated() const {
+  size_t bytes = 0;
+  for (const auto& shard : shards_) {
+    Mutex::Lock lock(shard.mutex);
+    bytes += shard.num_entries * sizeof(Entry) +
+             shard.free_entries.capacity() * sizeof(uint32_t) +
+             shard.chunks.capacity() * sizeof(PolicyChunk) +
+             shard.table.capacity() * sizeof(uint32_t) +
+             shard.sketch.capacity() * sizeof(uint8_t);
+  }
+  return bytes;
+}
+
+NNCache::Stats NNCache::GetStats() const {
+  Stats stats;
+  for (const auto& shard : shards_) {
+    Mutex::Lock lock(shard.mutex);
+    stats.hits += shard.stats.hits;
+    stats.misses += shard.stats.misses;
+    stats.evictions += shard.stats.evictions;
+    stats.rejections += shard.stats.rejections;
+    stats.retained_hits += shard.stats.retained_hits;
+  }
+  return stats;
+}
+
+NNCacheLock::NNCacheLock(NNCache* cache, uint64_t key) : cache_(cache) {
+  if (cache->GetCapacity() == 0) return;
+  shard_ = &cache->GetShard(key);
+  if (Pin(key, !cache->file_)) return;
+  if (cache->file_) {
+    cache->PromoteFromFile(key);
+    Pin(key, true);
+  }
+}
+
+bool NNCacheLock::Pin(uint64_t key, bool count_miss) {
+  Mutex::Lock lock(shard_->mutex);
+  uint32_t idx = shard_->table[NNCache::FindSlot(*shard_, key)];
+  if (idx != NNCache::kNone &&
+      shard_->entries[idx].generation !=
+          cache_->generation_.load(std::memory_order_relaxed)) {
+    // Stale, dropped now that it's found.
+    cache_->Evict(shard_, idx);
+    idx = NNCache::kNone;
+  }
+  if (idx == NNCache::kNone) {
+    if (count_miss) ++shard_->stats.misses;
+    return false;
+  }
+  ++shard_->stats.hits;
+  if (shard_->entries[idx].list == NNCache::kRetainedList) {
+    ++shard_->stats.retained_hits;
+  }
+  idx_ = idx;
+  entry_ = &shard_->entries[idx];
+  ++entry_->pins;
+  if (entry_->weight < 255) ++entry_->weight;
+  if (cache_->GetPolicy() == NNCache::Policy::kTinyLfu) {
+    NNCache::RecordAccess(shard_, key);
+  }
+  return true;
+}
+
+NNCacheLock::~NNCacheLock() {
+  if (entry_) cache_->Unpin(shard_, idx_);
+}
+
+NNCacheLock::NNCacheLock(NNCacheLock&& other)
+    : cache_(other.cache_),
+      shard_(other.shard_),
+      entry_(other.entry_),
+      idx_(other.idx_) {
+  other.entry_ = nullptr;
+}
+
+void NNCacheLock::operator=(NNCacheLock&& other) {
+  if (entry_) cache_->Unpin(shard_, idx_);
+  cache_ = other.cache_;
+  shard_ = other.shard_;
+  entry_ = other.entry_;
+  idx_ = other.idx_;
+  other.entry_ = nullptr;
+}
+
+float NNCacheLock::GetP(uint16_t move_id, PolicyCursor* cursor) const {
+  // Chunks of a pinned entry are not modified, so they can be read without
+  // the shard lock.
+  const auto& chunks = shard_->chunks;
+  const int num_moves = entry_->num_moves;
+  if (cursor->chunk == NNCache::kNone) {
+    cursor->chunk = entry_->first_chunk;
+    cursor->offset = 0;
+    cursor->index = 0;
+  }
+  for (int i = 0; i < num_moves; ++i) {
+    if (cursor->index == num_moves) {
+      cursor->chunk = entry_->first_chunk;
+      cursor->offset = 0;
+      cursor->index = 0;
+    }
+    const auto& move = chunks[cursor->chunk].moves[cursor->offset];
+    ++cursor->index;
+    if (++cursor->offset == NNCache::kMovesPerChunk) {
+      cursor->offset = 0;
+      cursor->chunk = chunks[cursor->chunk].next;
+    }
+    if (move.idx == move_id) return FP16toFP32(move.p);
+  }
+  return 0.0f;
+}
+
+void NNCacheLock::GetPs(const uint16_t* move_ids, int count,
+                        float* out) const {
+  // The cursor makes each lookup one step in the usual case.
+  PolicyCursor cursor;
+  for (int i = 0; i < count; ++i) out[i] = GetP(move_ids[i], &cursor);
+}
+
 CachingComputation::CachingComputation(
-    std::unique_ptr<NetworkComputation> parent, NNCache* cache)
-    : parent_(std::move(parent)), cache_(cache) {}
+    std::unique_ptr<NetworkComputation> parent, NNCache* cache,
+    float legal_policy_temp)
+    : parent_(std::move(parent)),
+      cache_(cache),
+      legal_policy_temp_(legal_policy_temp) {}
+
+void CachingComputation::Reset(std::unique_ptr<NetworkComputation> parent) {
+  // Cached entries of the previous batch don't stay pinned.
+  for (size_t i = 0; i < batch_size_; ++i) batch_[i].lock = NNCacheLock();
+  batch_size_ = 0;
+  prefetched_hits_ = 0;
+  parent_ = std::move(parent);
+  small_parent_.reset();
+}
+
+void CachingComputation::SetSmallParent(
+    std::unique_ptr<NetworkComputation> parent) {
+  assert(!small_parent_ || small_parent_->GetBatchSize() == 0);
+  small_parent_ = std::move(parent);
+}
+
+uint64_t CachingComputation::SmallNetworkHash(uint64_t hash) {
+  return hash ^ 0x5A17E1D0C0FFEE11ULL;
+}
+
+void CachingComputation::SetPriority(ComputationPriority priority) {
+  parent_->SetPriority(priority);
+  if (small_parent_) small_parent_->SetPriority(priority);
+}
 
 int CachingComputation::GetCacheMisses() const {
-  return parent_->GetBatchSize();
+  return parent_->GetBatchSize() +
+         (small_parent_ ? small_parent_->GetBatchSize() : 0);
 }
 
-int CachingComputation::GetBatchSize() const { return batch_.size(); }
+int CachingComputation::GetBatchSize() const { return batch_size_; }
 
-bool CachingComputation::AddInputByHash(uint64_t hash) {
-  NNCacheLock lock(cache_, hash);
+CachingComputation::WorkItem& CachingComputation::NewItem() {
+  if (batch_size_ == batch_.size()) batch_.emplace_back();
+  auto& item = batch_[batch_size_++];
+  item.idx_in_parent = -1;
+  item.probabilities_to_cache.clear();
+  item.cursor = NNCacheLock::PolicyCursor();
+  item.legal_cursor = 0;
+  item.prefetch = false;
+  item.retain = false;
+  item.small = false;
+  return item;
+}
+
+bool CachingComputation::AddInputByHash(uint64_t hash, bool small) {
+  return AddCachedInput(hash, true, small);
+}
+
+bool CachingComputation::AddCachedInput(uint64_t hash, bool count_prefetched,
+                                        bool small) {
+  NNCacheLock lock(cache_, small ? SmallNetworkHash(hash) : hash);
   if (!lock) return false;
-  batch_.emplace_back();
-  batch_.back().lock = std::move(lock);
-  batch_.back().hash = hash;
+  if (count_prefetched &&
+      lock->prefetched.exchange(false, std::memory_order_relaxed)) {
+    ++prefetched_hits_;
+  }
+  auto& item = NewItem();
+  item.lock = std::move(lock);
+  item.hash = hash;
+  item.small = small;
   return true;
 }
 
 void CachingComputation::PopCacheHit() {
-  assert(!batch_.empty());
-  assert(batch_.back().lock);
-  assert(batch_.back().idx_in_parent == -1);
-  batch_.pop_back();
+  assert(batch_size_ > 0);
+  assert(batch_[batch_size_ - 1].lock);
+  assert(batch_[batch_size_ - 1].idx_in_parent == -1);
+  batch_[--batch_size_].lock = NNCacheLock();
 }
 
 void CachingComputation::AddInput(
     uint64_t hash, InputPlanes&& input,
-    std::vector<uint16_t>&& probabilities_to_cache) {
-  if (AddInputByHash(hash)) return;
-  batch_.emplace_back();
-  batch_.back().hash = hash;
-  batch_.back().idx_in_parent = parent_->GetBatchSize();
-  batch_.back().probabilities_to_cache = probabilities_to_cache;
-  parent_->AddInput(std::move(input));
+    const std::vector<uint16_t>& probabilities_to_cache, bool prefetch,
+    bool retain, bool small) {
+  small = small && small_parent_;
+  if (AddCachedInput(hash, !prefetch, small)) return;
+  auto& item = NewItem();
+  item.hash = hash;
+  item.small = small;
+  NetworkComputation* parent = ParentOf(item);
+  item.idx_in_parent = parent->GetBatchSize();
+  // Copied into the slot's storage, which is reused across batches.
+  item.probabilities_to_cache.assign(probabilities_to_cache.begin(),
+                                     probabilities_to_cache.end());
+  item.prefetch = prefetch;
+  item.retain = retain;
+  if (legal_policy_temp_ != 0.0f) {
+    const auto& moves = item.probabilities_to_cache;
+    parent->AddInputWithMoves(std::move(input), moves.data(), moves.size(),
+                              legal_policy_temp_);
+  } else {
+    parent->AddInput(std::move(input));
+  }
 }
 
 void CachingComputation::PopLastInputHit() {
-  assert(!batch_.empty());
-  assert(batch_.back().idx_in_parent == -1);
-  batch_.pop_back();
+  assert(batch_size_ > 0);
+  assert(batch_[batch_size_ - 1].idx_in_parent == -1);
+  batch_[--batch_size_].lock = NNCacheLock();
 }
 
 void CachingComputation::ComputeBlocking() {
-  if (parent_->GetBatchSize() == 0) return;
-  parent_->ComputeBlocking();
+  if (GetCacheMisses() == 0) return;
+  if (parent_->GetBatchSize() > 0) parent_->ComputeBlocking();
+  if (small_parent_ && small_parent_->GetBatchSize() > 0) {
+    small_parent_->ComputeBlocking();
+  }
+  PopulateCache();
+}
 
+void CachingComputation::ComputeAsync(std::function<void()> callback) {
+  std::vector<NetworkComputation*> parents;
+  if (parent_->GetBatchSize() > 0) parents.push_back(parent_.get());
+  if (small_parent_ && small_parent_->GetBatchSize() > 0) {
+    parents.push_back(small_parent_.get());
+  }
+  if (parents.empty()) {
+    callback();
+    return;
+  }
+  // Both networks run at once, the last one to finish fills the cache.
+  auto pending = std::make_shared<std::atomic<int>>(parents.size());
+  for (auto* parent : parents) {
+    parent->ComputeAsync([this, callback, pending]() {
+      if (pending->fetch_sub(1, std::memory_order_acq_rel) != 1) return;
+      // Failed results are not cached, the error is for the caller.
+      try {
+        CheckAsyncError();
+        PopulateCache();
+      } catch (const Exception&) {
+      }
+      callback();
+    });
+  }
+}
+
+void CachingComputation::CheckAsyncError() const {
+  if (parent_->GetBatchSize() > 0) parent_->CheckAsyncError();
+  if (small_parent_ && small_parent_->GetBatchSize() > 0) {
+    small_parent_->CheckAsyncError();
+  }
+}
+
+void CachingComputation::PopulateCache() {
   // Fill cache with data from NN.
-  for (const auto& item : batch_) {
+  for (size_t j = 0; j < batch_size_; ++j) {
+    const auto& item = batch_[j];
     if (item.idx_in_parent == -1) continue;
-    auto req =
-        std::make_unique<CachedNNRequest>(item.probabilities_to_cache.size());
-    req->q = parent_->GetQVal(item.idx_in_parent);
-    req->d = parent_->GetDVal(item.idx_in_parent);
-    int idx = 0;
-    for (auto x : item.probabilities_to_cache) {
-      req->p[idx++] =
-          std::make_pair(x, parent_->GetPVal(item.idx_in_parent, x));
+    const NetworkComputation* parent = ParentOf(item);
+    policy_.clear();
+    for (size_t i = 0; i < item.probabilities_to_cache.size(); ++i) {
+      const auto x = item.probabilities_to_cache[i];
+      policy_.emplace_back(x, legal_policy_temp_ != 0.0f
+                                  ? parent->GetLegalPVal(item.idx_in_parent, i)
+                                  : parent->GetPVal(item.idx_in_parent, x));
     }
-    cache_->Insert(item.hash, std::move(req));
+    cache_->Insert(item.small ? SmallNetworkHash(item.hash) : item.hash,
+                   parent->GetQVal(item.idx_in_parent),
+                   parent->GetDVal(item.idx_in_parent), policy_.data(),
+                   policy_.size(), item.prefetch, item.retain);
   }
 }
 
 float CachingComputation::GetQVal(int sample) const {
   const auto& item = batch_[sample];
-  if (item.idx_in_parent >= 0) return parent_->GetQVal(item.idx_in_parent);
+  if (item.idx_in_parent >= 0) {
+    return ParentOf(item)->GetQVal(item.idx_in_parent);
+  }
   return item.lock->q;
 }
 
 float CachingComputation::GetDVal(int sample) const {
   const auto& item = batch_[sample];
-  if (item.idx_in_parent >= 0) return parent_->GetDVal(item.idx_in_parent);
+  if (item.idx_in_parent >= 0) {
+    return ParentOf(item)->GetDVal(item.idx_in_parent);
+  }
   return item.lock->d;
 }
 
 float CachingComputation::GetPVal(int sample, int move_id) const {
   auto& item = batch_[sample];
-  if (item.idx_in_parent >= 0)
-    return parent_->GetPVal(item.idx_in_parent, move_id);
-  const auto& moves = item.lock->p;
-
-  int total_count = 0;
-  while (total_count < moves.size()) {
-    // Optimization: usually moves are stored in the same order as queried.
-    const auto& move = moves[item.last_idx++];
-    if (item.last_idx == moves.size()) item.last_idx = 0;
-    if (move.first == move_id) return move.second;
-    ++total_count;
-  }
-  assert(false);  // Move not found.
-  return 0;
+  if (item.idx_in_parent < 0) return item.lock.GetP(move_id, &item.cursor);
+  if (legal_policy_temp_ == 0.0f) {
+    return ParentOf(item)->GetPVal(item.idx_in_parent, move_id);
+  }
+  // Moves are mostly asked for in the order they were given.
+  const auto& moves = item.probabilities_to_cache;
+  for (size_t i = 0; i < moves.size(); ++i) {
+    const size_t idx = (item.legal_cursor + i) % moves.size();
+    if (moves[idx] != move_id) continue;
+    item.legal_cursor = idx + 1;
+    return ParentOf(item)->GetLegalPVal(item.idx_in_parent, idx);
+  }
+  return 0.0f;
+}
+
+void CachingComputation::GetPVals(int sample, const uint16_t* move_ids,
+                                  int count, float* out) const {
+  const auto& item = batch_[sample];
+  if (item.idx_in_parent < 0) {
+    item.lock.GetPs(move_ids, count, out);
+    return;
+  }
+  if (legal_policy_temp_ == 0.0f) {
+    for (int i = 0; i < count; ++i) {
+      out[i] = ParentOf(item)->GetPVal(item.idx_in_parent, move_ids[i]);
+    }
+    return;
+  }
+  // The parent gathered the priors of the moves given, usually these.
+  const auto& moves = item.probabilities_to_cache;
+  if (moves.size() == static_cast<size_t>(count) &&
+      std::equal(moves.begin(), moves.end(), move_ids)) {
+    for (int i = 0; i < count; ++i) {
+      out[i] = ParentOf(item)->GetLegalPVal(item.idx_in_parent, i);
+    }
+    return;
+  }
+  for (int i = 0; i < count; ++i) out[i] = GetPVal(sample, move_ids[i]);
 }
 
 }  // namespace lczero
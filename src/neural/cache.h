@@ -26,72 +26,368 @@
 */
 #pragma once
 
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
 #include "neural/network.h"
-#include "utils/cache.h"
-#include "utils/smallarray.h"
+#include "utils/filesystem.h"
+#include "utils/largepages.h"
+#include "utils/mutex.h"
 
 namespace lczero {
 
-struct CachedNNRequest {
-  CachedNNRequest(size_t size) : p(size) {}
+// Cache of NN evaluations. All memory is allocated up front by SetCapacity():
+// evaluations live in fixed slots of an open-addressed table, and their
+// policies in fixed-size chunks with fp16 probabilities. It is split into
+// independently locked shards. Which entries are evicted depends on the
+// Policy; entries pinned by NNCacheLock stay readable until unpinned.
+class NNCache {
+ public:
   typedef std::pair<uint16_t, float> IdxAndProb;
-  float q;
-  float d;
-  // TODO(mooskagh) Don't really need index if using perfect hash.
-  SmallArray<IdxAndProb> p;
+
+  enum class Policy {
+    // Evicts the least recently inserted entry.
+    kLru,
+    // W-TinyLFU: new entries go to a small LRU window. An entry leaving the
+    // window when the cache is full replaces the LRU victim only if it was
+    // inserted or hit more often, as estimated by a count-min sketch.
+    kTinyLfu,
+    // Every hit adds weight to an entry. Weighted entries reaching the LRU tail
+    // are moved back to the head with their weight halved.
+    kWeighted,
+  };
+
+  // Counters since the cache was created.
+  struct Stats {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    // Entries dropped to make room for new ones.
+    uint64_t evictions = 0;
+    // New entries dropped by the TinyLFU admission filter.
+    uint64_t rejections = 0;
+    // Hits of retained entries.
+    uint64_t retained_hits = 0;
+  };
+
+  // Cached evaluation. Policy is read through NNCacheLock.
+  struct Entry {
+    uint64_t key;
+    float q;
+    float d;
+    // Whether the entry was computed by prefetch and not looked up since.
+    std::atomic<bool> prefetched;
+
+   private:
+    friend class NNCache;
+    friend class NNCacheLock;
+    uint32_t first_chunk;
+    uint32_t lru_prev;
+    uint32_t lru_next;
+    uint16_t num_moves;
+    bool evicted;
+    // Which of Shard::lists the entry is in.
+    uint8_t list;
+    // Hits, saturating, for Policy::kWeighted.
+    uint8_t weight;
+    // The entry is stale unless it's of the cache's generation.
+    uint16_t generation;
+    int pins;
+  };
+
+  explicit NNCache(int capacity = 128);
+  ~NNCache();
+
+  // Stores evaluation of position @key, replacing the old one if there is.
+  // @retain asks to never evict the entry, which is granted for up to a
+  // quarter of the capacity. Retained entries are not replaced either.
+  void Insert(uint64_t key, float q, float d, const IdxAndProb* policy,
+              int num_moves, bool prefetched, bool retain = false);
+  // Checks whether a key exists. Of course the next moment the key may be
+  // evicted.
+  bool ContainsKey(uint64_t key);
+  // Sets the capacity and preallocates storage for it. The content is dropped
+  // if the capacity changes; no entry may be pinned then.
+  void SetCapacity(int capacity);
+  void Clear();
+  // Makes all entries stale, as when the network changes. Stale entries are
+  // not found any more and are dropped lazily, when looked up or evicted, so
+  // this doesn't walk the cache. Retained entries lose their protection.
+  void NewGeneration();
+  // Sets the eviction policy. The content is dropped if the policy changes; no
+  // entry may be pinned then.
+  void SetPolicy(Policy policy);
+  Policy GetPolicy() const { return policy_.load(std::memory_order_relaxed); }
+  Stats GetStats() const;
+  int GetSize() const { return size_.load(std::memory_order_relaxed); }
+  int GetCapacity() const { return capacity_.load(std::memory_order_relaxed); }
+
+  // Maps a file written by SaveToFile(). On a miss, positions are looked up in
+  // the file and promoted into memory. Returns false and keeps no file if it
+  // doesn't exist, is malformed or was written for other weights.
+  // Must not be called while a search uses the cache.
+  bool LoadFromFile(const std::string& filename, uint64_t weights_hash);
+  // Writes the cache content and then entries of the loaded file which are not
+  // in memory, up to the capacity in total, and maps the new file. Throws
+  // exception on failure. Must not be called while a search uses the cache.
+  void SaveToFile(const std::string& filename, uint64_t weights_hash);
+  // Unmaps the file loaded by LoadFromFile().
+  void CloseFile();
+
+  // Returns the bytes taken by the storage preallocated for the capacity,
+  // which is all the cache takes in memory apart from a mapped file.
+  size_t GetBytesAllocated() const;
+
+ private:
+  friend class NNCacheLock;
+  static constexpr int kShards = 16;
+  static constexpr uint32_t kNone = 0xFFFFFFFF;
+  // 32 bytes per chunk.
+  static constexpr int kMovesPerChunk = 7;
+  // Chunks preallocated per entry, enough for 35 moves on average. If
+  // positions have more moves, fewer of them fit.
+  static constexpr int kChunksPerEntry = 5;
+  // Shard::lists indices.
+  static constexpr int kMainList = 0;
+  static constexpr int kWindowList = 1;
+  static constexpr int kRetainedList = 2;
+  // Percentage of the capacity for retained entries.
+  static constexpr int kRetainedPercent = 25;
+  // Percentage of the capacity for the TinyLFU window.
+  static constexpr int kWindowPercent = 1;
+  // Maximum number of weighted entries moved back to the head per eviction.
+  static constexpr int kMaxWeightedSkips = 8;
+
+  struct PolicyEntry {
+    uint16_t idx;
+    uint16_t p;
+  };
+  struct PolicyChunk {
+    PolicyEntry moves[kMovesPerChunk];
+    uint32_t next;
+  };
+
+  struct Shard {
+    mutable Mutex mutex{"nncache"};
+    // The large arrays follow the huge pages and NUMA policies.
+    std::vector<Entry, LargeAllocator<Entry>> entries GUARDED_BY(mutex);
+    uint32_t num_entries GUARDED_BY(mutex) = 0;
+    std::vector<uint32_t> free_entries GUARDED_BY(mutex);
+    std::vector<PolicyChunk, LargeAllocator<PolicyChunk>> chunks
+        GUARDED_BY(mutex);
+    uint32_t free_chunk GUARDED_BY(mutex) = kNone;
+    uint32_t free_chunks GUARDED_BY(mutex) = 0;
+    // Open-addressed table of entry indices, linear probing, power of 2 size.
+    std::vector<uint32_t, LargeAllocator<uint32_t>> table GUARDED_BY(mutex);
+    struct List {
+      uint32_t head = kNone;  // Newest elements.
+      uint32_t tail = kNone;  // Oldest elements.
+      uint32_t size = 0;
+    };
+    // The main LRU list, the admission window of Policy::kTinyLfu, and
+    // retained entries which are not evicted.
+    List lists[3] GUARDED_BY(mutex);
+    uint32_t window_capacity GUARDED_BY(mutex) = 0;
+    uint32_t retained_capacity GUARDED_BY(mutex) = 0;
+    // Count-min sketch of Policy::kTinyLfu with 4 probes into one array of
+    // counters saturating at 15, which are halved every sketch_period
+    // additions.
+    std::vector<uint8_t> sketch GUARDED_BY(mutex);
+    uint32_t sketch_additions GUARDED_BY(mutex) = 0;
+    uint32_t sketch_period GUARDED_BY(mutex) = 0;
+    Stats stats GUARDED_BY(mutex);
+  };
+
+  Shard& GetShard(uint64_t key);
+  void Allocate(Shard* shard, int capacity) REQUIRES(shard->mutex);
+  // Returns position in shard->table where @key is or would be.
+  static size_t FindSlot(const Shard& shard, uint64_t key)
+      REQUIRES(shard.mutex);
+  // Removes the entry from the table and LRU list, and frees it (or leaves it
+  // for Unpin() if it's pinned).
+  void Evict(Shard* shard, uint32_t idx) REQUIRES(shard->mutex);
+  // Evicts an entry, or drops a window entry, to free memory according to the
+  // policy. Returns false if there is nothing to evict.
+  bool EvictForSpace(Shard* shard) REQUIRES(shard->mutex);
+  static void PushFront(Shard* shard, int list, uint32_t idx)
+      REQUIRES(shard->mutex);
+  static void PushBack(Shard* shard, int list, uint32_t idx)
+      REQUIRES(shard->mutex);
+  static void Unlink(Shard* shard, uint32_t idx) REQUIRES(shard->mutex);
+  static void RecordAccess(Shard* shard, uint64_t key) REQUIRES(shard->mutex);
+  static int EstimateFrequency(const Shard& shard, uint64_t key)
+      REQUIRES(shard.mutex);
+  void Release(Shard* shard, uint32_t idx) REQUIRES(shard->mutex);
+  void Unpin(Shard* shard, uint32_t idx);
+  // Returns the entry of the mapped file for @key, or nullptr.
+  const char* FindInFile(uint64_t key) const;
+  // Inserts the entry of the mapped file for @key, if there is one.
+  bool PromoteFromFile(uint64_t key);
+
+  // -1 until storage is allocated.
+  std::atomic<int> capacity_{-1};
+  std::atomic<Policy> policy_{Policy::kLru};
+  std::atomic<int> size_{0};
+  std::atomic<uint16_t> generation_{0};
+  Shard shards_[kShards];
+
+  struct FileIndexEntry {
+    uint64_t key;
+    uint64_t offset;
+  };
+  std::unique_ptr<MappedFile> file_;
+  // Sorted by key.
+  const FileIndexEntry* file_index_ = nullptr;
+  size_t file_entries_ = 0;
 };
 
-typedef LruCache<uint64_t, CachedNNRequest> NNCache;
-typedef LruCacheLock<uint64_t, CachedNNRequest> NNCacheLock;
+// Pins a cache entry so that it stays valid until the lock is destroyed.
+class NNCacheLock {
+ public:
+  // Looks up the value in @cache by @key and pins it if found.
+  NNCacheLock(NNCache* cache, uint64_t key);
+  ~NNCacheLock();
+
+  NNCacheLock() {}
+  NNCacheLock(const NNCacheLock&) = delete;
+  NNCacheLock(NNCacheLock&& other);
+  void operator=(NNCacheLock&& other);
+
+  // Returns whether lock holds any value.
+  operator bool() const { return entry_; }
+  NNCache::Entry* operator->() const { return entry_; }
+
+  // Position of the last policy lookup, to speed up lookups in the same order
+  // as the moves were stored.
+  struct PolicyCursor {
+    uint32_t chunk = NNCache::kNone;
+    int offset = 0;
+    int index = 0;
+  };
+  // Returns P of @move_id, or 0 if it wasn't stored.
+  float GetP(uint16_t move_id, PolicyCursor* cursor) const
+      NO_THREAD_SAFETY_ANALYSIS;
+  // Writes P of each of the @count moves @move_ids to @out, in one walk over
+  // the stored moves when they are asked for in the order stored.
+  void GetPs(const uint16_t* move_ids, int count, float* out) const;
+
+ private:
+  NNCache* cache_ = nullptr;
+  NNCache::Shard* shard_ = nullptr;
+  NNCache::Entry* entry_ = nullptr;
+  uint32_t idx_ = 0;
+
+  // Returns whether @key was found and pinned. Counts a hit or, if
+  // @count_miss, a miss.
+  bool Pin(uint64_t key, bool count_miss);
+};
 
 // Wraps around NetworkComputation and caches result.
 // While it mostly repeats NetworkComputation interface, it's not derived
 // from it, as AddInput() needs hash and index of probabilities to store.
 class CachingComputation {
  public:
+  // With a nonzero @legal_policy_temp, the parent picks the priors of the
+  // moves to cache itself and softmaxes them with that temperature, see
+  // NetworkComputation::AddInputWithMoves().
   CachingComputation(std::unique_ptr<NetworkComputation> parent,
-                     NNCache* cache);
+                     NNCache* cache, float legal_policy_temp = 0.0f);
 
-  // How many inputs are not found in cache and will be forwarded to a wrapped
-  // computation.
+  // Starts a new batch on @parent. Storage of the previous batches is kept, so
+  // that a reused computation doesn't allocate once it has seen its largest
+  // batch.
+  void Reset(std::unique_ptr<NetworkComputation> parent);
+  // Sets the computation of a second, smaller network, which evaluates the
+  // inputs added with @small. Until the next Reset().
+  void SetSmallParent(std::unique_ptr<NetworkComputation> parent);
+  // Key of the small network's evaluation of position @hash, so that both
+  // networks share the cache without mixing their entries.
+  static uint64_t SmallNetworkHash(uint64_t hash);
+  // Sets the priority of the wrapped computations, see
+  // NetworkComputation::SetPriority(). Parents set later don't get it.
+  void SetPriority(ComputationPriority priority);
+  // How many inputs are not found in cache and will be forwarded to the wrapped
+  // computations.
   int GetCacheMisses() const;
   // Total number of times AddInput/AddInputByHash were (successfully) called.
   int GetBatchSize() const;
   // Adds input by hash only. If that hash is not in cache, returns false
-  // and does nothing. Otherwise adds.
-  bool AddInputByHash(uint64_t hash);
+  // and does nothing. Otherwise adds. With @small, looks up the evaluation of
+  // the small network.
+  bool AddInputByHash(uint64_t hash, bool small = false);
   // Adds a sample to the batch.
   // @hash is a hash to store/lookup it in the cache.
   // @probabilities_to_cache is which indices of policy head to store.
+  // @prefetch marks the input as speculative, see GetPrefetchedHits().
+  // @retain asks the cache not to evict the result, see NNCache::Insert().
+  // @small has the input evaluated by the small parent, if there is one.
   void AddInput(uint64_t hash, InputPlanes&& input,
-                std::vector<uint16_t>&& probabilities_to_cache);
+                const std::vector<uint16_t>& probabilities_to_cache,
+                bool prefetch = false, bool retain = false,
+                bool small = false);
   // Undos last AddInput. If it was a cache miss, the it's actually not removed
   // from parent's batch.
   void PopLastInputHit();
   // Do the computation.
   void ComputeBlocking();
+  // Starts the computation, @callback is called when it's done. See
+  // NetworkComputation::ComputeAsync().
+  void ComputeAsync(std::function<void()> callback);
+  // Throws the error of a failed ComputeAsync(), see
+  // NetworkComputation::CheckAsyncError(). The cache isn't populated then.
+  void CheckAsyncError() const;
   // Returns Q value of @sample.
   float GetQVal(int sample) const;
   // Returns probability of draw if NN has WDL value head
   float GetDVal(int sample) const;
   // Returns P value @move_id of @sample.
   float GetPVal(int sample, int move_id) const;
+  // Writes P values of the @count moves @move_ids of @sample to @out. Fastest
+  // when the moves come in the order given to AddInput().
+  void GetPVals(int sample, const uint16_t* move_ids, int count,
+                float* out) const;
+  // Returns whether @sample was evaluated by the small network.
+  bool IsFromSmallNetwork(int sample) const { return batch_[sample].small; }
   // Pops last input from the computation. Only allowed for inputs which were
   // cached.
   void PopCacheHit();
+  // Number of AddInputByHash() hits on entries which were prefetched and not
+  // used before.
+  int GetPrefetchedHits() const { return prefetched_hits_; }
 
  private:
+  bool AddCachedInput(uint64_t hash, bool count_prefetched, bool small);
+  // Fills cache with results of the parent computation.
+  void PopulateCache();
+
   struct WorkItem {
     uint64_t hash;
     NNCacheLock lock;
     int idx_in_parent = -1;
     std::vector<uint16_t> probabilities_to_cache;
-    mutable int last_idx = 0;
+    mutable NNCacheLock::PolicyCursor cursor;
+    // Where the last GetPVal() of a gathered policy found its move.
+    mutable size_t legal_cursor = 0;
+    bool prefetch = false;
+    bool retain = false;
+    bool small = false;
   };
+  // Returns the next slot of the batch, reset but for its storage.
+  WorkItem& NewItem();
+  NetworkComputation* ParentOf(const WorkItem& item) const {
+    return item.small ? small_parent_.get() : parent_.get();
+  }
 
   std::unique_ptr<NetworkComputation> parent_;
+  std::unique_ptr<NetworkComputation> small_parent_;
   NNCache* cache_;
+  const float legal_policy_temp_;
+  // Slots past batch_size_ are unused, and kept for their storage.
   std::vector<WorkItem> batch_;
+  size_t batch_size_ = 0;
+  int prefetched_hits_ = 0;
+  // Scratch space for PopulateCache().
+  std::vector<NNCache::IdxAndProb> policy_;
 };
 
 }  // namespace lczero
@@ -0,0 +1,354 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2018 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+
+  If you modify this Program, or any covered work, by linking or
+  combining it with NVIDIA Corporation's libraries from the NVIDIA CUDA
+  Toolkit and the NVIDIA CUDA Deep Neural Network library (or a
+  modified version of those libraries), containing parts covered by the
+  terms of the respective license agreement, the licensors of this
+  Program grant you additional permission to convey the resulting work.
+*/
+
+#include "neural/cache.h"
+#include <gtest/gtest.h>
+#include <cmath>
+#include <cstdio>
+#include <map>
+#include <vector>
+
+namespace lczero {
+namespace {
+std::vector<NNCache::IdxAndProb> MakePolicy(int num_moves, uint64_t key) {
+  std::vector<NNCache::IdxAndProb> policy;
+  for (int i = 0; i < num_moves; ++i) {
+    policy.emplace_back(static_cast<uint16_t>((key + i * 7) % 1858),
+                        1.0f / (i + 2));
+  }
+  return policy;
+}
+
+// Returns 1000 * sample + move as the full policy, and 1000 * sample + the
+// move's index as the gathered one.
+class FakeComputation : public NetworkComputation {
+ public:
+  void AddInput(InputPlanes&&) override { ++batch_size_; }
+  void AddInputWithMoves(InputPlanes&&, const uint16_t*, int,
+                         float softmax_temp) override {
+    temps_.push_back(softmax_temp);
+    ++batch_size_;
+  }
+  void ComputeBlocking() override {}
+  int GetBatchSize() const override { return batch_size_; }
+  float GetQVal(int) const override { return 0.0f; }
+  float GetDVal(int) const override { return 0.0f; }
+  float GetPVal(int sample, int move_id) const override {
+    return sample * 1000 + move_id;
+  }
+  float GetLegalPVal(int sample, int move_index) const override {
+    return sample * 1000 + move_index;
+  }
+  std::vector<float> temps_;
+
+ private:
+  int batch_size_ = 0;
+};
+}  // namespace
+
+TEST(NNCache, StoresQuantizedPolicy) {
+  NNCache cache(100);
+  const auto policy = MakePolicy(40, 12345);
+  cache.Insert(12345, 0.25f, 0.5f, policy.data(), policy.size(), false);
+  EXPECT_EQ(cache.GetSize(), 1);
+  NNCacheLock lock(&cache, 12345);
+  ASSERT_TRUE(lock);
+  EXPECT_EQ(lock->q, 0.25f);
+  EXPECT_EQ(lock->d, 0.5f);
+  NNCacheLock::PolicyCursor cursor;
+  // Out of order lookups wrap around.
+  for (int i = 39; i >= 0; --i) {
+    EXPECT_NEAR(lock.GetP(policy[i].first, &cursor), policy[i].second,
+                policy[i].second * 1e-3f);
+  }
+  EXPECT_FALSE(cache.ContainsKey(54321));
+}
+
+TEST(NNCache, MatchesMapUnderEviction) {
+  NNCache cache(512);
+  std::map<uint64_t, float> inserted;
+  for (uint64_t i = 0; i < 20000; ++i) {
+    const uint64_t key = (i * 0x2545F4914F6CDD1Dull) ^ (i % 97);
+    const auto policy = MakePolicy(static_cast<int>(key % 80), key);
+    cache.Insert(key, static_cast<float>(i), 0.0f, policy.data(),
+                 policy.size(), false);
+    inserted[key] = static_cast<float>(i);
+    EXPECT_LE(cache.GetSize(), 512);
+  }
+  int found = 0;
+  for (const auto& entry : inserted) {
+    NNCacheLock lock(&cache, entry.first);
+    if (!lock) continue;
+    ++found;
+    EXPECT_EQ(lock->q, entry.second);
+  }
+  EXPECT_EQ(found, cache.GetSize());
+  EXPECT_GT(found, 256);
+}
+
+TEST(NNCache, PinnedSurvivesEviction) {
+  NNCache cache(16);
+  const auto policy = MakePolicy(20, 1);
+  cache.Insert(1, 0.5f, 0.0f, policy.data(), policy.size(), false);
+  NNCacheLock lock(&cache, 1);
+  ASSERT_TRUE(lock);
+  cache.Clear();
+  EXPECT_FALSE(cache.ContainsKey(1));
+  // Fill the cache so that free memory would be reused.
+  for (uint64_t i = 2; i < 200; ++i) {
+    const auto other = MakePolicy(30, i);
+    cache.Insert(i, -1.0f, 0.0f, other.data(), other.size(), false);
+  }
+  EXPECT_EQ(lock->q, 0.5f);
+  NNCacheLock::PolicyCursor cursor;
+  EXPECT_NEAR(lock.GetP(policy[5].first, &cursor), policy[5].second, 1e-3f);
+}
+
+namespace {
+// Inserts 100 positions and looks each up 10 times, then inserts 4000 others
+// into a cache of 1600. Returns how many of the first ones are still cached.
+int CountRetainedHotEntries(NNCache::Policy policy, NNCache::Stats* stats) {
+  NNCache cache(1600);
+  cache.SetPolicy(policy);
+  const auto policy_data = MakePolicy(20, 0);
+  for (uint64_t i = 0; i < 100; ++i) {
+    cache.Insert(i, 0.0f, 0.0f, policy_data.data(), policy_data.size(), false);
+  }
+  for (int j = 0; j < 10; ++j) {
+    for (uint64_t i = 0; i < 100; ++i) NNCacheLock lock(&cache, i);
+  }
+  for (uint64_t i = 0; i < 4000; ++i) {
+    const uint64_t key = (i + 1000) * 0x2545F4914F6CDD1Dull;
+    cache.Insert(key, 0.0f, 0.0f, policy_data.data(), policy_data.size(),
+                 false);
+  }
+  *stats = cache.GetStats();
+  int found = 0;
+  for (uint64_t i = 0; i < 100; ++i) found += cache.ContainsKey(i);
+  return found;
+}
+}  // namespace
+
+TEST(NNCache, PoliciesRetainHotEntries) {
+  NNCache::Stats stats;
+  EXPECT_EQ(CountRetainedHotEntries(NNCache::Policy::kLru, &stats), 0);
+  EXPECT_EQ(stats.hits, 1000u);
+  EXPECT_EQ(stats.misses, 0u);
+  EXPECT_GT(stats.evictions, 2000u);
+  EXPECT_EQ(stats.rejections, 0u);
+
+  EXPECT_GE(CountRetainedHotEntries(NNCache::Policy::kTinyLfu, &stats), 95);
+  EXPECT_GT(stats.rejections, 2000u);
+
+  EXPECT_GE(CountRetainedHotEntries(NNCache::Policy::kWeighted, &stats), 95);
+  EXPECT_EQ(stats.rejections, 0u);
+}
+
+TEST(NNCache, RetainedEntriesAreKept) {
+  NNCache cache(1600);
+  const auto policy = MakePolicy(20, 0);
+  for (uint64_t i = 0; i < 100; ++i) {
+    cache.Insert(i, 0.5f, 0.0f, policy.data(), policy.size(), false, true);
+  }
+  for (uint64_t i = 0; i < 10000; ++i) {
+    const uint64_t key = (i + 1000) * 0x2545F4914F6CDD1Dull;
+    cache.Insert(key, 0.0f, 0.0f, policy.data(), policy.size(), false);
+  }
+  // Not replaced either.
+  cache.Insert(1, -0.5f, 0.0f, policy.data(), policy.size(), false);
+  for (uint64_t i = 0; i < 100; ++i) {
+    NNCacheLock lock(&cache, i);
+    ASSERT_TRUE(lock);
+    EXPECT_EQ(lock->q, 0.5f);
+  }
+  EXPECT_EQ(cache.GetStats().retained_hits, 100u);
+  EXPECT_LE(cache.GetSize(), 1600);
+}
+
+TEST(NNCache, NewGenerationMakesEntriesStale) {
+  NNCache cache(1600);
+  const auto policy = MakePolicy(20, 0);
+  for (uint64_t i = 0; i < 100; ++i) {
+    cache.Insert(i, 0.5f, 0.0f, policy.data(), policy.size(), false, i < 50);
+  }
+  cache.NewGeneration();
+  EXPECT_FALSE(cache.ContainsKey(1));
+  EXPECT_FALSE(NNCacheLock(&cache, 1));
+  // Stale entries are replaced, retained ones too.
+  cache.Insert(2, -0.5f, 0.0f, policy.data(), policy.size(), false);
+  EXPECT_EQ(NNCacheLock(&cache, 2)->q, -0.5f);
+  // And evicted before the new ones.
+  for (uint64_t i = 0; i < 1000; ++i) {
+    const uint64_t key = (i + 1000) * 0x2545F4914F6CDD1Dull;
+    cache.Insert(key, 0.0f, 0.0f, policy.data(), policy.size(), false);
+  }
+  EXPECT_TRUE(cache.ContainsKey(2));
+  EXPECT_LE(cache.GetSize(), 1600);
+}
+
+TEST(NNCache, CountsMisses) {
+  NNCache cache(16);
+  { NNCacheLock lock(&cache, 7); }
+  EXPECT_EQ(cache.GetStats().misses, 1u);
+  EXPECT_EQ(cache.GetStats().hits, 0u);
+}
+
+TEST(NNCache, WorksOnHugePages) {
+  SetLargeAllocationPolicy(HugePages::kTransparent, NumaPolicy::kInterleave);
+  {
+    // Large enough for the arrays to be mapped.
+    NNCache cache(200000);
+    for (uint64_t key = 1; key <= 1000; ++key) {
+      const auto policy = MakePolicy(30, key);
+      cache.Insert(key, key * 0.001f, 0.0f, policy.data(), policy.size(),
+                   false);
+    }
+    for (uint64_t key = 1; key <= 1000; ++key) {
+      NNCacheLock lock(&cache, key);
+      ASSERT_TRUE(lock);
+      EXPECT_EQ(lock->q, key * 0.001f);
+    }
+  }
+  SetLargeAllocationPolicy(HugePages::kOff, NumaPolicy::kDefault);
+}
+
+TEST(NNCache, SavesAndLoadsFile) {
+  const std::string filename = "nncache_test.bin";
+  {
+    NNCache cache(64);
+    for (uint64_t i = 0; i < 32; ++i) {
+      const auto policy = MakePolicy(10 + i, i);
+      cache.Insert(i, i * 0.01f, 0.1f, policy.data(), policy.size(), false);
+    }
+    cache.SaveToFile(filename, 1234);
+  }
+  NNCache cache(64);
+  EXPECT_FALSE(cache.LoadFromFile(filename, 4321));
+  EXPECT_FALSE(cache.ContainsKey(5));
+  ASSERT_TRUE(cache.LoadFromFile(filename, 1234));
+  EXPECT_EQ(cache.GetSize(), 0);
+  EXPECT_TRUE(cache.ContainsKey(5));
+  {
+    // Found in the file and promoted.
+    NNCacheLock lock(&cache, 5);
+    ASSERT_TRUE(lock);
+    EXPECT_FLOAT_EQ(lock->q, 5 * 0.01f);
+    const auto policy = MakePolicy(15, 5);
+    NNCacheLock::PolicyCursor cursor;
+    EXPECT_NEAR(lock.GetP(policy[14].first, &cursor), policy[14].second,
+                1e-3f);
+  }
+  EXPECT_EQ(cache.GetSize(), 1);
+  EXPECT_FALSE(cache.ContainsKey(100));
+  cache.CloseFile();
+  std::remove(filename.c_str());
+}
+
+TEST(CachingComputation, ReadsGatheredPolicy) {
+  NNCache cache(16);
+  auto parent = std::make_unique<FakeComputation>();
+  FakeComputation* fake = parent.get();
+  CachingComputation computation(std::move(parent), &cache, 2.0f);
+  computation.AddInput(1, InputPlanes(), {30, 10, 20});
+  computation.AddInput(2, InputPlanes(), {5});
+  EXPECT_EQ(fake->temps_, std::vector<float>({2.0f, 2.0f}));
+  computation.ComputeBlocking();
+  EXPECT_EQ(computation.GetPVal(0, 20), 2.0f);
+  EXPECT_EQ(computation.GetPVal(0, 30), 0.0f);
+  EXPECT_EQ(computation.GetPVal(0, 40), 0.0f);
+  EXPECT_EQ(computation.GetPVal(1, 5), 1000.0f);
+  // The cache gets the gathered priors too.
+  NNCacheLock lock(&cache, 1);
+  ASSERT_TRUE(lock);
+  NNCacheLock::PolicyCursor cursor;
+  EXPECT_EQ(lock.GetP(10, &cursor), 1.0f);
+}
+
+TEST(CachingComputation, ResetStartsNewBatch) {
+  NNCache cache(16);
+  const auto policy = MakePolicy(3, 7);
+  cache.Insert(7, 0.5f, 0.0f, policy.data(), policy.size(), false);
+  CachingComputation computation(std::make_unique<FakeComputation>(), &cache);
+  EXPECT_TRUE(computation.AddInputByHash(7));
+  computation.AddInput(1, InputPlanes(), {30, 10, 20});
+  computation.ComputeBlocking();
+  computation.Reset(std::make_unique<FakeComputation>());
+  EXPECT_EQ(computation.GetBatchSize(), 0);
+  EXPECT_EQ(computation.GetCacheMisses(), 0);
+  // Reused slots don't keep anything of the previous batch.
+  computation.AddInput(2, InputPlanes(), {5});
+  EXPECT_TRUE(computation.AddInputByHash(7));
+  EXPECT_EQ(computation.GetBatchSize(), 2);
+  EXPECT_EQ(computation.GetCacheMisses(), 1);
+  computation.ComputeBlocking();
+  EXPECT_EQ(computation.GetPVal(0, 5), 5.0f);
+  EXPECT_EQ(computation.GetQVal(1), 0.5f);
+  EXPECT_NEAR(computation.GetPVal(1, policy[2].first), policy[2].second,
+              policy[2].second * 1e-3f);
+  NNCacheLock lock(&cache, 2);
+  ASSERT_TRUE(lock);
+  NNCacheLock::PolicyCursor cursor;
+  EXPECT_EQ(lock.GetP(5, &cursor), 5.0f);
+}
+
+TEST(CachingComputation, SmallParentHasOwnEntries) {
+  NNCache cache(16);
+  auto parent = std::make_unique<FakeComputation>();
+  auto small_parent = std::make_unique<FakeComputation>();
+  FakeComputation* fake = parent.get();
+  FakeComputation* small_fake = small_parent.get();
+  CachingComputation computation(std::move(parent), &cache);
+  computation.SetSmallParent(std::move(small_parent));
+  computation.AddInput(1, InputPlanes(), {5}, false, false, true);
+  computation.AddInput(2, InputPlanes(), {5});
+  EXPECT_EQ(small_fake->GetBatchSize(), 1);
+  EXPECT_EQ(fake->GetBatchSize(), 1);
+  EXPECT_EQ(computation.GetCacheMisses(), 2);
+  computation.ComputeBlocking();
+  EXPECT_TRUE(computation.IsFromSmallNetwork(0));
+  EXPECT_FALSE(computation.IsFromSmallNetwork(1));
+  // Both are sample 0 of their parent.
+  EXPECT_EQ(computation.GetPVal(0, 5), 5.0f);
+  EXPECT_EQ(computation.GetPVal(1, 5), 5.0f);
+  // The small network's evaluation is not one of the main network.
+  EXPECT_FALSE(cache.ContainsKey(1));
+  EXPECT_TRUE(cache.ContainsKey(CachingComputation::SmallNetworkHash(1)));
+  computation.Reset(std::make_unique<FakeComputation>());
+  EXPECT_FALSE(computation.AddInputByHash(1));
+  EXPECT_TRUE(computation.AddInputByHash(1, true));
+  EXPECT_TRUE(computation.IsFromSmallNetwork(0));
+  // Without a small parent, the main network evaluates everything.
+  computation.AddInput(3, InputPlanes(), {5}, false, false, true);
+  EXPECT_FALSE(computation.IsFromSmallNetwork(1));
+}
+
+}  // namespace lczero
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
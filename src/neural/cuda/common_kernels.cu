@@ -66,12 +66,12 @@ __global__ void addVectors_kernel(T* c, T* a, T* b, int size, int asize,
 // activation.
 template <typename T>
 void addVectors(T* c, T* a, T* b, int size, int asize, int bsize, bool relu,
-                bool use_tanh, bool use_sigmoid) {
+                bool use_tanh, bool use_sigmoid, cudaStream_t stream) {
   const int kBlockSize = 256;
   int blocks = DivUp(size, kBlockSize);
 
-  addVectors_kernel<<<blocks, kBlockSize>>>(c, a, b, size, asize, bsize, relu,
-                                            use_tanh, use_sigmoid);
+  addVectors_kernel<<<blocks, kBlockSize, 0, stream>>>(
+      c, a, b, size, asize, bsize, relu, use_tanh, use_sigmoid);
   ReportCUDAErrors(cudaGetLastError());
 }
 
@@ -94,12 +94,13 @@ __global__ void addBias_NCHW_kernel(T* c, T* a, T* b, int N, int C, int H,
 
 // Add bias to convolution's output.
 template <typename T>
-void addBias_NCHW(T* c, T* a, T* b, int N, int C, int H, int W) {
+void addBias_NCHW(T* c, T* a, T* b, int N, int C, int H, int W,
+                  cudaStream_t stream) {
   int size = N * C * H * W;
   const int kBlockSize = 256;
   int blocks = DivUp(size, kBlockSize);
 
-  addBias_NCHW_kernel<<<blocks, kBlockSize>>>(c, a, b, N, C, H, W);
+  addBias_NCHW_kernel<<<blocks, kBlockSize, 0, stream>>>(c, a, b, N, C, H, W);
   ReportCUDAErrors(cudaGetLastError());
 }
 
@@ -159,10 +160,10 @@ __global__ void copyTypeConverted_kernel(DstType* op, SrcType* ip, int N) {
 }
 
 template <typename DstType, typename SrcType>
-void copyTypeConverted(DstType* op, SrcType* ip, int N) {
+void copyTypeConverted(DstType* op, SrcType* ip, int N, cudaStream_t stream) {
   const int kBlockSize = 256;
   int blocks = DivUp(N, kBlockSize);
-  copyTypeConverted_kernel<<<blocks, kBlockSize>>>(op, ip, N);
+  copyTypeConverted_kernel<<<blocks, kBlockSize, 0, stream>>>(op, ip, N);
 }
 
 template <typename T>
@@ -194,13 +195,14 @@ __global__ void batchNorm_kernel(T* output, const T* input, const T* skipInput,
 // Every thread processes single element.
 template <typename T>
 void batchNorm(T* output, const T* input, const T* skipInput, int N, int C,
-               int H, int W, float* means, float* var_multipliers, bool relu) {
+               int H, int W, float* means, float* var_multipliers, bool relu,
+               cudaStream_t stream) {
   const int total_elements = N * C * H * W;
   const int kBlockSize = 256;
   int blocks = DivUp(total_elements, kBlockSize);
 
-  batchNorm_kernel<<<blocks, kBlockSize>>>(output, input, skipInput, N, C, H, W,
-                                           means, var_multipliers, relu);
+  batchNorm_kernel<<<blocks, kBlockSize, 0, stream>>>(
+      output, input, skipInput, N, C, H, W, means, var_multipliers, relu);
 
   ReportCUDAErrors(cudaGetLastError());
 }
@@ -240,12 +242,12 @@ __global__ void expandPlanes_kernel_Fp32_NCHW(float* output,
 }
 
 void expandPlanes_Fp32_NCHW(float* output, const uint64_t* masks,
-                            const float* values, int n) {
+                            const float* values, int n, cudaStream_t stream) {
   int threads = n * 8 * 8;  // Each thread writes a single element.
   const int blockSize = 256;
   int blocks = DivUp(threads, blockSize);
-  expandPlanes_kernel_Fp32_NCHW<<<blocks, blockSize>>>(output, masks, values,
-                                                       n);
+  expandPlanes_kernel_Fp32_NCHW<<<blocks, blockSize, 0, stream>>>(
+      output, masks, values, n);
   ReportCUDAErrors(cudaGetLastError());
 }
 
@@ -272,12 +274,12 @@ __global__ void expandPlanes_kernel_Fp16_NHWC(half* output,
 }
 
 void expandPlanes_Fp16_NHWC(half* output, const uint64_t* masks,
-                            const float* values, int n) {
+                            const float* values, int n, cudaStream_t stream) {
   int threads = n * 8 * 8;  // Each thread writes a single element.
   const int kBlockSize = 256;
   int blocks = DivUp(threads, kBlockSize);
-  expandPlanes_kernel_Fp16_NHWC<<<blocks, kBlockSize>>>(output, masks, values,
-                                                        n);
+  expandPlanes_kernel_Fp16_NHWC<<<blocks, kBlockSize, 0, stream>>>(
+      output, masks, values, n);
   ReportCUDAErrors(cudaGetLastError());
 }
 
@@ -414,15 +416,15 @@ __global__ void globalAvgPool_kernel(float* output, const float* input,
 
 template <typename T>
 void globalAvgPool(int N, int C, T* output, const T* input,
-                   const T* prevLayerBias) {
+                   const T* prevLayerBias, cudaStream_t stream) {
   const int kPlaneSize = 64;
 
   const bool fp16 = std::is_same<half, T>::value;
   if (fp16) {
     // For NHWC fp16, simply launch N blocks, each with C threads.
-    globalAvgPool_kernel_NHWC_fp16<<<N, C>>>((half*)output, (half*)input,
-                                             (half*)prevLayerBias,
-                                             N * C * kPlaneSize, N * C);
+    globalAvgPool_kernel_NHWC_fp16<<<N, C, 0, stream>>>(
+        (half*)output, (half*)input, (half*)prevLayerBias, N * C * kPlaneSize,
+        N * C);
   } else {
     // For NCHW layout (used with fp32),
     // each warp processes a full plane (64 elements), and writes a single
@@ -433,16 +435,16 @@ void globalAvgPool(int N, int C, T* output, const T* input,
     const int kBlockSize = kWarpsPerBlock * 32;
 
     int blocks = DivUp(kTotalWarps, kWarpsPerBlock);
-    globalAvgPool_kernel<<<blocks, kBlockSize>>>((float*)output, (float*)input,
-                                                 (float*)prevLayerBias,
-                                                 N * C * kPlaneSize, N * C, C);
+    globalAvgPool_kernel<<<blocks, kBlockSize, 0, stream>>>(
+        (float*)output, (float*)input, (float*)prevLayerBias,
+        N * C * kPlaneSize, N * C, C);
   }
   ReportCUDAErrors(cudaGetLastError());
 }
 
 template <typename T>
 void globalScale(int N, int C, T* output, const T* input, const T* scaleBias,
-                 const T* prevLayerBias) {
+                 const T* prevLayerBias, cudaStream_t stream) {
   const bool fp16 = std::is_same<half, T>::value;
 
   // Each thread writes one output.
@@ -450,11 +452,11 @@ void globalScale(int N, int C, T* output, const T* input, const T* scaleBias,
   const int kBlocks = DivUp(N * 8 * 8 * C, kBlockSize);
 
   if (fp16) {
-    globalScale_kernel_fp16_nhwc<<<kBlocks, kBlockSize>>>(
+    globalScale_kernel_fp16_nhwc<<<kBlocks, kBlockSize, 0, stream>>>(
         (half*)output, (half*)input, (half*)scaleBias, (half*)prevLayerBias,
         N * C * 8 * 8, C, 8 * 8 * C);
   } else {
-    globalScale_kernel<<<kBlocks, kBlockSize>>>(
+    globalScale_kernel<<<kBlocks, kBlockSize, 0, stream>>>(
         (float*)output, (float*)input, (float*)scaleBias, (float*)prevLayerBias,
         N * C * 8 * 8, C);
   }
@@ -481,63 +483,109 @@ __global__ void policyMap_kernel(T* output, const T* input,
 
 template <typename T>
 void PolicyMap(int N, T* output, const T* input, const short* indices,
-               int inputSize, int usedSize, int outputSize) {
+               int inputSize, int usedSize, int outputSize,
+               cudaStream_t stream) {
   // Each thread processes one input element
   // Only some of the threads (with valid mapping) write output
   const int kBlockSize = 256;
   const int kBlocks = DivUp(N * usedSize, kBlockSize);
 
-  policyMap_kernel<T><<<kBlocks, kBlockSize>>>((T*)output, (T*)input,
-                                               (short*)indices, N, inputSize,
-                                               usedSize, outputSize);
+  policyMap_kernel<T><<<kBlocks, kBlockSize, 0, stream>>>(
+      (T*)output, (T*)input, (short*)indices, N, inputSize, usedSize,
+      outputSize);
+  ReportCUDAErrors(cudaGetLastError());
+}
+
+// One warp per sample.
+__global__ void gatherLegalPolicy_kernel(float* output, const float* policy,
+                                         const uint16_t* moves,
+                                         const int* offsets, const float* temps,
+                                         int policySize) {
+  const int n = blockIdx.x;
+  const int begin = offsets[n];
+  const int end = offsets[n + 1];
+  const float temp = temps[n];
+  const float* input = policy + n * policySize;
+
+  float sum = 0.0f;
+  for (int i = begin + threadIdx.x; i < end; i += 32) {
+    float p = input[moves[i]];
+    if (temp != 1.0f) {
+      // Flush denormals to zero, as the search does.
+      p = p < 1.17549435E-38f ? 0.0f : powf(p, 1.0f / temp);
+    }
+    output[i] = p;
+    sum += p;
+  }
+  for (int offset = 16; offset > 0; offset /= 2) {
+    sum += __shfl_down_sync(0xFFFFFFFF, sum, offset);
+  }
+  sum = __shfl_sync(0xFFFFFFFF, sum, 0);
+  if (sum <= 0.0f) return;
+  for (int i = begin + threadIdx.x; i < end; i += 32) output[i] /= sum;
+}
+
+void gatherLegalPolicy(float* output, const float* policy,
+                       const uint16_t* moves, const int* offsets,
+                       const float* temps, int N, int policySize,
+                       cudaStream_t stream) {
+  gatherLegalPolicy_kernel<<<N, 32, 0, stream>>>(output, policy, moves,
+                                                 offsets, temps, policySize);
   ReportCUDAErrors(cudaGetLastError());
 }
 
 // Template instantiation.
-template void copyTypeConverted<half, float>(half* op, float* ip, int N);
-template void copyTypeConverted<float, half>(float* op, half* ip, int N);
+template void copyTypeConverted<half, float>(half* op, float* ip, int N,
+                                             cudaStream_t stream);
+template void copyTypeConverted<float, half>(float* op, half* ip, int N,
+                                             cudaStream_t stream);
 
 template void batchNorm<float>(float* output, const float* input,
                                const float* skipInput, int N, int C, int H,
                                int W, float* means, float* var_multipliers,
-                               bool relu);
+                               bool relu, cudaStream_t stream);
 template void batchNorm<half>(half* output, const half* input,
                               const half* skipInput, int N, int C, int H, int W,
-                              float* means, float* var_multipliers, bool relu);
+                              float* means, float* var_multipliers, bool relu,
+                              cudaStream_t stream);
 
 template void addVectors<float>(float* c, float* a, float* b, int size,
                                 int asize, int bsize, bool relu, bool use_tanh,
-                                bool use_sigmoid);
+                                bool use_sigmoid, cudaStream_t stream);
 template void addVectors<half>(half* c, half* a, half* b, int size, int asize,
                                int bsize, bool relu, bool use_tanh,
-                               bool use_sigmoid);
+                               bool use_sigmoid, cudaStream_t stream);
 
 template void addBias_NCHW<float>(float* c, float* a, float* b, int N, int C,
-                                  int H, int W);
+                                  int H, int W, cudaStream_t stream);
 
 template void addBias_NCHW<half>(half* c, half* a, half* b, int N, int C, int H,
-                                 int W);
+                                 int W, cudaStream_t stream);
 
 template void globalAvgPool<float>(int N, int C, float* output,
                                    const float* input,
-                                   const float* prevLayerBias);
+                                   const float* prevLayerBias,
+                                   cudaStream_t stream);
 template void globalAvgPool<half>(int N, int C, half* output, const half* input,
-                                  const half* prevLayerBias);
+                                  const half* prevLayerBias,
+                                  cudaStream_t stream);
 
 template void globalScale<float>(int N, int C, float* output,
                                  const float* input, const float* scaleBias,
-                                 const float* prevLayerBias);
+                                 const float* prevLayerBias,
+                                 cudaStream_t stream);
 template void globalScale<half>(int N, int C, half* output, const half* input,
                                 const half* scaleBias,
-                                const half* prevLayerBias);
+                                const half* prevLayerBias, cudaStream_t stream);
 
 template void PolicyMap<float>(int N, float* output, const float* input,
                                const short* indices, int inputSize,
-                               int usedSize, int outputSize);
+                               int usedSize, int outputSize,
+                               cudaStream_t stream);
 
 template void PolicyMap<half>(int N, half* output, const half* input,
                               const short* indices, int inputSize, int usedSize,
-                              int outputSize);
+                              int outputSize, cudaStream_t stream);
 
 }  // namespace cudnn_backend
 }  // namespace lczero
@@ -25,6 +25,7 @@
   Program grant you additional permission to convey the resulting work.
 */
 
+#include <algorithm>
 #include "cuda_common.h"
 
 
@@ -130,59 +131,162 @@ __global__ void SE_Layer_NHWC(half* output, const half* skip, const half* input,
   }
 }
 
-bool Se_Fp16_NHWC(int N, int C, int numFc1Out, half* output, const half* skip,
-                  const half* input, const half* w1, const half* b1,
-                  const half* w2, const half* b2, const half* bPrev) {
-  // TODO: Think of more elegant way to avoid this hardcoding :-/
+namespace {
+template <int C>
+bool LaunchSe_Fp16_NHWC(int N, int numFc1Out, half* output, const half* skip,
+                        const half* input, const half* w1, const half* b1,
+                        const half* w2, const half* b2, const half* bPrev,
+                        cudaStream_t stream) {
+  // All supported channel counts are at least 64, so K <= C holds.
   if (numFc1Out == 16) {
-    if (C == 64) {
-      SE_Layer_NHWC<64, 16>
-          <<<N, C>>>(output, skip, input, w1, b1, w2, b2, bPrev);
-    } else {
-      // TODO: support other channel counts.
-      throw Exception("channel count unsupported by SE layer");
-    }
+    SE_Layer_NHWC<C, 16>
+        <<<N, C, 0, stream>>>(output, skip, input, w1, b1, w2, b2, bPrev);
   } else if (numFc1Out == 32) {
-    if (C == 64) {
-      SE_Layer_NHWC<64, 32>
-          <<<N, C>>>(output, skip, input, w1, b1, w2, b2, bPrev);
-    } else if (C == 128) {
-      SE_Layer_NHWC<128, 32>
-          <<<N, C>>>(output, skip, input, w1, b1, w2, b2, bPrev);
-    } else if (C == 192) {
-      SE_Layer_NHWC<192, 32>
-          <<<N, C>>>(output, skip, input, w1, b1, w2, b2, bPrev);
-    } else if (C == 256) {
-      SE_Layer_NHWC<256, 32>
-          <<<N, C>>>(output, skip, input, w1, b1, w2, b2, bPrev);
-    } else {
-      // TODO: support other channel counts.
-      return false;
-    }
+    SE_Layer_NHWC<C, 32>
+        <<<N, C, 0, stream>>>(output, skip, input, w1, b1, w2, b2, bPrev);
   } else if (numFc1Out == 64) {
-    if (C == 64) {
-      SE_Layer_NHWC<64, 64>
-          <<<N, C>>>(output, skip, input, w1, b1, w2, b2, bPrev);
-    } else if (C == 128) {
-      SE_Layer_NHWC<128, 64>
-          <<<N, C>>>(output, skip, input, w1, b1, w2, b2, bPrev);
-    } else if (C == 192) {
-      SE_Layer_NHWC<192, 64>
-          <<<N, C>>>(output, skip, input, w1, b1, w2, b2, bPrev);
-    } else if (C == 256) {
-      SE_Layer_NHWC<256, 64>
-          <<<N, C>>>(output, skip, input, w1, b1, w2, b2, bPrev);
-    } else {
-      // TODO: support other channel counts.
-      return false;
-    }
+    SE_Layer_NHWC<C, 64>
+        <<<N, C, 0, stream>>>(output, skip, input, w1, b1, w2, b2, bPrev);
   } else {
     // TODO: support other sizes.
     return false;
   }
+  return true;
+}
+}  // namespace
+
+bool Se_Fp16_NHWC_Supported(int C, int numFc1Out) {
+  if (numFc1Out != 16 && numFc1Out != 32 && numFc1Out != 64) return false;
+  switch (C) {
+    case 64:
+    case 128:
+    case 192:
+    case 256:
+    case 320:
+    case 384:
+    case 512:
+      return true;
+    default:
+      return false;
+  }
+}
+
+bool Se_Fp16_NHWC(int N, int C, int numFc1Out, half* output, const half* skip,
+                  const half* input, const half* w1, const half* b1,
+                  const half* w2, const half* b2, const half* bPrev,
+                  cudaStream_t stream) {
+  // One thread per channel, so C is bounded by the block size. Unsupported
+  // shapes return false and the caller falls back to the unfused path.
+  bool launched;
+  switch (C) {
+    case 64:
+      launched = LaunchSe_Fp16_NHWC<64>(N, numFc1Out, output, skip, input, w1,
+                                        b1, w2, b2, bPrev, stream);
+      break;
+    case 128:
+      launched = LaunchSe_Fp16_NHWC<128>(N, numFc1Out, output, skip, input, w1,
+                                         b1, w2, b2, bPrev, stream);
+      break;
+    case 192:
+      launched = LaunchSe_Fp16_NHWC<192>(N, numFc1Out, output, skip, input, w1,
+                                         b1, w2, b2, bPrev, stream);
+      break;
+    case 256:
+      launched = LaunchSe_Fp16_NHWC<256>(N, numFc1Out, output, skip, input, w1,
+                                         b1, w2, b2, bPrev, stream);
+      break;
+    case 320:
+      launched = LaunchSe_Fp16_NHWC<320>(N, numFc1Out, output, skip, input, w1,
+                                         b1, w2, b2, bPrev, stream);
+      break;
+    case 384:
+      launched = LaunchSe_Fp16_NHWC<384>(N, numFc1Out, output, skip, input, w1,
+                                         b1, w2, b2, bPrev, stream);
+      break;
+    case 512:
+      launched = LaunchSe_Fp16_NHWC<512>(N, numFc1Out, output, skip, input, w1,
+                                         b1, w2, b2, bPrev, stream);
+      break;
+    default:
+      // TODO: support other channel counts.
+      launched = false;
+  }
+  if (!launched) return false;
   ReportCUDAErrors(cudaGetLastError());
   return true;
 }
 
+__global__ void absMax_kernel(float* absmax, const half* input, int size) {
+  constexpr int kBlockSize = 256;
+  __shared__ float shMax[kBlockSize];
+
+  float m = 0;
+  for (int i = blockIdx.x * blockDim.x + threadIdx.x; i < size;
+       i += blockDim.x * gridDim.x) {
+    m = fmaxf(m, fabsf(__half2float(input[i])));
+  }
+  shMax[threadIdx.x] = m;
+  __syncthreads();
+
+  for (int s = kBlockSize / 2; s > 0; s >>= 1) {
+    if (threadIdx.x < s) {
+      shMax[threadIdx.x] = fmaxf(shMax[threadIdx.x], shMax[threadIdx.x + s]);
+    }
+    __syncthreads();
+  }
+
+  // Non-negative floats compare the same as their bit patterns.
+  if (threadIdx.x == 0) atomicMax((int*)absmax, __float_as_int(shMax[0]));
+}
+
+void absMax_Fp16(float* absmax, const half* input, int size,
+                 cudaStream_t stream) {
+  const int kBlockSize = 256;
+  const int blocks = std::min(DivUp(size, kBlockSize), 1024);
+  absMax_kernel<<<blocks, kBlockSize, 0, stream>>>(absmax, input, size);
+  ReportCUDAErrors(cudaGetLastError());
+}
+
+__global__ void quantize_kernel(int8_t* output, const half* input,
+                                float inv_scale, int size) {
+  const int i = blockIdx.x * blockDim.x + threadIdx.x;
+  if (i >= size) return;
+  const float val = rintf(__half2float(input[i]) * inv_scale);
+  output[i] = (int8_t)fminf(fmaxf(val, -127.0f), 127.0f);
+}
+
+void quantize_Fp16ToInt8(int8_t* output, const half* input, float scale,
+                         int size, cudaStream_t stream) {
+  const int kBlockSize = 256;
+  const int blocks = DivUp(size, kBlockSize);
+  quantize_kernel<<<blocks, kBlockSize, 0, stream>>>(output, input,
+                                                     1.0f / scale, size);
+  ReportCUDAErrors(cudaGetLastError());
+}
+
+__global__ void dequantize_kernel(half* output, const float* conv,
+                                  const float* scales, const float* bias,
+                                  const half* skip, int size, int C,
+                                  bool relu) {
+  const int i = blockIdx.x * blockDim.x + threadIdx.x;
+  if (i >= size) return;
+  const int c = i % C;
+  float val = conv[i] * scales[c];
+  if (bias) val += bias[c];
+  if (skip) val += __half2float(skip[i]);
+  if (relu && val < 0) val = 0;
+  output[i] = __float2half(val);
+}
+
+void dequantize_Int8Conv(half* output, const float* conv, const float* scales,
+                         const float* bias, const half* skip, int size, int C,
+                         bool relu, cudaStream_t stream) {
+  const int kBlockSize = 256;
+  const int blocks = DivUp(size, kBlockSize);
+  dequantize_kernel<<<blocks, kBlockSize, 0, stream>>>(
+      output, conv, scales, bias, skip, size, C, relu);
+  ReportCUDAErrors(cudaGetLastError());
+}
+
 }   // namespace cudnn_backend
 }   // namespace lczero
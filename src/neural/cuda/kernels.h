@@ -32,11 +32,12 @@ namespace cudnn_backend {
 // activation (relu, tanh or sigmoid).
 template <typename T>
 void addVectors(T* c, T* a, T* b, int size, int asize, int bsize, bool relu,
-                bool use_tanh, bool use_sigmoid);
+                bool use_tanh, bool use_sigmoid, cudaStream_t stream);
 
 // Add bias to convolution's output.
 template <typename T>
-void addBias_NCHW(T* c, T* a, T* b, int N, int C, int H, int W);
+void addBias_NCHW(T* c, T* a, T* b, int N, int C, int H, int W,
+                  cudaStream_t stream);
 
 // Conversion from: fp32 -> fp16 datatype, and NCHW -> NHWC layout.
 // Cudnn kernels work best with NCHW layout for fp32, and with NHWC for fp16.
@@ -45,39 +46,73 @@ void fp32NCHWtofp16NHWC(half* output_tensor, float* input_tensor, int Nin,
 
 // Plain data-type conversion (no layout conversion).
 template <typename DstType, typename SrcType>
-void copyTypeConverted(DstType* op, SrcType* ip, int N);
+void copyTypeConverted(DstType* op, SrcType* ip, int N, cudaStream_t stream);
 
 // Perform batch normilization.
 template <typename T>
 void batchNorm(T* output, const T* input, const T* skipInput, int N, int C,
-               int H, int W, float* means, float* var_multipliers, bool relu);
+               int H, int W, float* means, float* var_multipliers, bool relu,
+               cudaStream_t stream);
+
+// Kernels taking a stream are launched on it, 0 is the default stream.
 
 // Unpack planes (input to network).
 void expandPlanes_Fp32_NCHW(float* output, const uint64_t* masks,
-                            const float* values, int n);
+                            const float* values, int n, cudaStream_t stream);
 
 void expandPlanes_Fp16_NHWC(half* output, const uint64_t* masks,
-                            const float* values, int n);
+                            const float* values, int n, cudaStream_t stream);
 
 // Perform global avg pool.
 template <typename T>
 void globalAvgPool(int N, int C, T* output, const T* input,
-                   const T* prevLayerBias);
+                   const T* prevLayerBias, cudaStream_t stream);
 
 // Perform global scale.
 template <typename T>
 void globalScale(int N, int C, T* output, const T* input, const T* scaleBias,
-                 const T* prevLayerBias);
+                 const T* prevLayerBias, cudaStream_t stream);
+
+// Whether Se_Fp16_NHWC has a kernel for the sizes. The fused kernel expects
+// both FC weight matrices transposed.
+bool Se_Fp16_NHWC_Supported(int C, int numFc1Out);
 
 // Perform Squeeze-and-Excitation (SE) in a single fused kernel.
 // Returns false if the fused kernel can't handle the sizes.
 bool Se_Fp16_NHWC(int N, int C, int numFc1Out, half* output, const half* skip,
                   const half* input, const half* w1, const half* b1,
-                  const half* w2, const half* b2, const half* bPrev);
+                  const half* w2, const half* b2, const half* bPrev,
+                  cudaStream_t stream);
 
 template <typename T>
 void PolicyMap(int N, T* output, const T* input, const short* indices,
-               int inputSize, int usedSize, int outputSize);
+               int inputSize, int usedSize, int outputSize,
+               cudaStream_t stream);
+
+// For each of the @N samples, picks the probabilities of its moves, the
+// indices moves[offsets[n]] to moves[offsets[n + 1] - 1] into the softmaxed
+// @policy with @policySize entries per sample, raises them to 1 / temps[n]
+// and normalizes them over the moves into the same places of @output.
+void gatherLegalPolicy(float* output, const float* policy,
+                       const uint16_t* moves, const int* offsets,
+                       const float* temps, int N, int policySize,
+                       cudaStream_t stream);
+
+// Raises *absmax to the largest magnitude among the @size elements of @input.
+// *absmax must start non-negative.
+void absMax_Fp16(float* absmax, const half* input, int size,
+                 cudaStream_t stream);
+
+// Quantizes @input to int8 as round(input / scale), saturated to +-127.
+void quantize_Fp16ToInt8(int8_t* output, const half* input, float scale,
+                         int size, cudaStream_t stream);
+
+// Epilogue of an int8 convolution in NHWC layout: scales the accumulated
+// @conv per channel, adds the optional bias and skip connection and applies
+// the optional relu.
+void dequantize_Int8Conv(half* output, const float* conv, const float* scales,
+                         const float* bias, const half* skip, int size, int C,
+                         bool relu, cudaStream_t stream);
 
 }  // namespace cudnn_backend
 }  // namespace lczero
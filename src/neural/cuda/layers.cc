@@ -24,7 +24,9 @@
   terms of the respective license agreement, the licensors of this
   Program grant you additional permission to convey the resulting work.
 */
+#include <algorithm>
 #include <cassert>
+#include <cmath>
 #include <cstring>
 #include <vector>
 #include "cuda_common.h"
@@ -59,10 +61,12 @@ void SoftMaxLayer<DataType>::Eval(int N, DataType* output,
                                   const DataType* input,
                                   const DataType* /*input2*/, void* /*scratch*/,
                                   size_t /*scratch_size*/, cudnnHandle_t cudnn,
-                                  cublasHandle_t /*cublas*/) {
+                                  cublasHandle_t /*cublas*/,
+                                  cudaStream_t /*stream*/) {
   float alpha = 1.0f, beta = 0.0f;
 
   // Need to call this at Eval as 'N' changes :-/
+  std::lock_guard<std::mutex> lock(desc_mutex_);
   if (std::is_same<half, DataType>::value) {
     cudnnSetTensor4dDescriptor(out_tensor_desc_, CUDNN_TENSOR_NHWC,
                                CUDNN_DATA_HALF, N, GetC(), GetH(), GetW());
@@ -159,7 +163,7 @@ void ConvLayer<half>::LoadWeights(float* pfilter, float* pBias, void* scratch) {
     ReportCUDAErrors(
         cudaMemcpy(scratch, pBias, blas_size, cudaMemcpyHostToDevice));
 
-    copyTypeConverted((half*)biases, (float*)scratch, C);
+    copyTypeConverted((half*)biases, (float*)scratch, C, 0);
   }
 }
 
@@ -184,23 +188,18 @@ template <typename DataType>
 void ConvLayer<DataType>::Eval(int N, DataType* output, const DataType* input,
                                const DataType* input2, void* scratch,
                                size_t scratch_size, cudnnHandle_t cudnn,
-                               cublasHandle_t /*cublas*/) {
-  const bool fp16 = std::is_same<half, DataType>::value;
-
-  ReportCUDNNErrors(cudnnSetTensor4dDescriptor(
-      out_tensor_desc_, fp16 ? CUDNN_TENSOR_NHWC : CUDNN_TENSOR_NCHW,
-      fp16 ? CUDNN_DATA_HALF : CUDNN_DATA_FLOAT, N, C, H, W));
-
-  ReportCUDNNErrors(cudnnSetTensor4dDescriptor(
-      in_tensor_desc_, fp16 ? CUDNN_TENSOR_NHWC : CUDNN_TENSOR_NCHW,
-      fp16 ? CUDNN_DATA_HALF : CUDNN_DATA_FLOAT, N, c_input_, H, W));
+                               cublasHandle_t /*cublas*/, cudaStream_t stream) {
+  // The calls below only enqueue work, so the lock is held briefly.
+  std::lock_guard<std::mutex> lock(desc_mutex_);
+  SetTensorDescriptors(N);
+  const cudnnConvolutionFwdAlgo_t conv_algo = GetAlgo(N);
 
   float alpha = 1.0f, beta = 0.0f;
 
   if (!(use_relu_ || use_bias_ || input2)) {
     ReportCUDNNErrors(cudnnConvolutionForward(
         cudnn, &alpha, in_tensor_desc_, input, filter_desc_, weights,
-        conv_desc_, conv_algo_, scratch, scratch_size, &beta, out_tensor_desc_,
+        conv_desc_, conv_algo, scratch, scratch_size, &beta, out_tensor_desc_,
         output));
   }
 #if CUDNN_MAJOR != 7 || CUDNN_MINOR != 0
@@ -208,7 +207,7 @@ void ConvLayer<DataType>::Eval(int N, DataType* output, const DataType* input,
     // fused bias + sum + relu!
     ReportCUDNNErrors(cudnnConvolutionBiasActivationForward(
         cudnn, &alpha, in_tensor_desc_, input, filter_desc_, weights,
-        conv_desc_, conv_algo_, scratch, scratch_size, &alpha, out_tensor_desc_,
+        conv_desc_, conv_algo, scratch, scratch_size, &alpha, out_tensor_desc_,
         input2, bias_desc_, biases, activation_, out_tensor_desc_, output));
   } else {
     // For some reason cudnn doesn't support just Convolution + Bias with fp32
@@ -217,14 +216,14 @@ void ConvLayer<DataType>::Eval(int N, DataType* output, const DataType* input,
     if ((std::is_same<float, DataType>::value) && (!use_relu_)) {
       ReportCUDNNErrors(cudnnConvolutionForward(
           cudnn, &alpha, in_tensor_desc_, input, filter_desc_, weights,
-          conv_desc_, conv_algo_, scratch, scratch_size, &beta,
+          conv_desc_, conv_algo, scratch, scratch_size, &beta,
           out_tensor_desc_, output));
       // add bias
-      addBias_NCHW(output, output, biases, N, C, H, W);
+      addBias_NCHW(output, output, biases, N, C, H, W, stream);
     } else {
       ReportCUDNNErrors(cudnnConvolutionBiasActivationForward(
           cudnn, &alpha, in_tensor_desc_, input, filter_desc_, weights,
-          conv_desc_, conv_algo_, scratch, scratch_size, &beta,
+          conv_desc_, conv_algo, scratch, scratch_size, &beta,
           out_tensor_desc_, output, bias_desc_, biases, activation_,
           out_tensor_desc_, output));
     }
@@ -233,7 +232,7 @@ void ConvLayer<DataType>::Eval(int N, DataType* output, const DataType* input,
   else {
     ReportCUDNNErrors(cudnnConvolutionForward(
         cudnn, &alpha, in_tensor_desc_, input, filter_desc_, weights,
-        conv_desc_, conv_algo_, scratch, scratch_size,
+        conv_desc_, conv_algo, scratch, scratch_size,
         (input2 == output) ? &alpha : &beta, out_tensor_desc_, output));
     if (input2 && input2 != output) {
       ReportCUDNNErrors(cudnnAddTensor(cudnn, &alpha, out_tensor_desc_, input2,
@@ -252,6 +251,104 @@ void ConvLayer<DataType>::Eval(int N, DataType* output, const DataType* input,
 #endif
 }
 
+template <typename DataType>
+void ConvLayer<DataType>::SetTensorDescriptors(int N) {
+  const bool fp16 = std::is_same<half, DataType>::value;
+
+  ReportCUDNNErrors(cudnnSetTensor4dDescriptor(
+      out_tensor_desc_, fp16 ? CUDNN_TENSOR_NHWC : CUDNN_TENSOR_NCHW,
+      fp16 ? CUDNN_DATA_HALF : CUDNN_DATA_FLOAT, N, C, H, W));
+
+  ReportCUDNNErrors(cudnnSetTensor4dDescriptor(
+      in_tensor_desc_, fp16 ? CUDNN_TENSOR_NHWC : CUDNN_TENSOR_NCHW,
+      fp16 ? CUDNN_DATA_HALF : CUDNN_DATA_FLOAT, N, c_input_, H, W));
+}
+
+// Whether @perf runs on NHWC fp16 tensors as they are. Other algorithms
+// (FFT, Winograd) or math without tensor ops have cudnn transpose the tensors
+// to NCHW and back around the convolution.
+static bool RunsNativelyInNhwc(const cudnnConvolutionFwdAlgoPerf_t& perf) {
+  return perf.mathType == CUDNN_TENSOR_OP_MATH &&
+         (perf.algo == CUDNN_CONVOLUTION_FWD_ALGO_IMPLICIT_GEMM ||
+          perf.algo == CUDNN_CONVOLUTION_FWD_ALGO_IMPLICIT_PRECOMP_GEMM);
+}
+
+template <typename DataType>
+cudnnConvolutionFwdAlgo_t ConvLayer<DataType>::GetAlgo(int N) const {
+  for (const auto& entry : tuned_algos_) {
+    if (entry.first >= N) return entry.second;
+  }
+  return conv_algo_;
+}
+
+template <typename DataType>
+void ConvLayer<DataType>::Autotune(const std::vector<int>& batch_sizes,
+                                   DataType* input, DataType* output,
+                                   void* scratch, size_t scratch_size,
+                                   cudnnHandle_t cudnn) {
+  tuned_algos_.clear();
+#if CUDNN_MAJOR != 7 || CUDNN_MINOR != 0
+  // Bias without relu goes through the fused call with identity activation
+  // in fp16, which only implicit precomp gemm supports.
+  if (std::is_same<half, DataType>::value && use_bias_ && !use_relu_) return;
+#endif
+  std::lock_guard<std::mutex> lock(desc_mutex_);
+  for (int N : batch_sizes) {
+    SetTensorDescriptors(N);
+    cudnnConvolutionFwdAlgoPerf_t perf[CUDNN_CONVOLUTION_FWD_ALGO_COUNT];
+    int count = 0;
+    ReportCUDNNErrors(cudnnFindConvolutionForwardAlgorithmEx(
+        cudnn, in_tensor_desc_, input, filter_desc_, weights, conv_desc_,
+        out_tensor_desc_, output, CUDNN_CONVOLUTION_FWD_ALGO_COUNT, &count,
+        perf, scratch, scratch_size));
+    // Results are sorted by time. In fp16 only algorithms which keep the
+    // NHWC layout qualify, as the timing doesn't show the transposes'
+    // memory traffic competing with the other streams.
+    cudnnConvolutionFwdAlgo_t algo = conv_algo_;
+    for (int i = 0; i < count; i++) {
+      if (perf[i].status == CUDNN_STATUS_SUCCESS &&
+          perf[i].memory <= scratch_size &&
+          (!std::is_same<half, DataType>::value ||
+           RunsNativelyInNhwc(perf[i]))) {
+        algo = perf[i].algo;
+        break;
+      }
+    }
+    tuned_algos_.emplace_back(N, algo);
+  }
+}
+
+template <typename DataType>
+size_t ConvLayer<DataType>::GetTunedWorkspaceSize(cudnnHandle_t cudnn) {
+  std::lock_guard<std::mutex> lock(desc_mutex_);
+  size_t size = 0;
+  for (const auto& tuning : tuned_algos_) {
+    SetTensorDescriptors(tuning.first);
+    size_t algo_size = 0;
+    ReportCUDNNErrors(cudnnGetConvolutionForwardWorkspaceSize(
+        cudnn, in_tensor_desc_, filter_desc_, conv_desc_, out_tensor_desc_,
+        tuning.second, &algo_size));
+    size = std::max(size, algo_size);
+  }
+  return size;
+}
+
+template <typename DataType>
+bool ConvLayer<DataType>::HasSameShape(const ConvLayer& other) const {
+  return c_input_ == other.c_input_ && C == other.C &&
+         filter_size_ == other.filter_size_ && use_relu_ == other.use_relu_ &&
+         use_bias_ == other.use_bias_;
+}
+
+template <typename DataType>
+std::string ConvLayer<DataType>::TuningKey() const {
+  return std::string(std::is_same<half, DataType>::value ? "fp16 nhwc"
+                                                         : "fp32") +
+         " conv " + std::to_string(c_input_) + "x" + std::to_string(C) + " " +
+         std::to_string(filter_size_) + "x" + std::to_string(filter_size_) +
+         (use_relu_ ? " relu" : "") + (use_bias_ ? " bias" : "");
+}
+
 template <typename DataType>
 ConvLayer<DataType>::~ConvLayer() {
   ReportCUDAErrors(cudaFree(weights));
@@ -265,6 +362,155 @@ ConvLayer<DataType>::~ConvLayer() {
   cudnnDestroyActivationDescriptor(activation_);
 }
 
+namespace {
+// Keeps the buffers carved out of scratch aligned.
+size_t AlignScratch(size_t size) { return (size + 255) & ~size_t{255}; }
+}  // namespace
+
+ConvInt8Layer::ConvInt8Layer(BaseLayer<half>* ip, int C, int H, int W,
+                             int filter, int Cin, bool relu, bool bias)
+    : BaseLayer<half>(C, H, W, ip),
+      c_input_(Cin),
+      filter_size_(filter),
+      use_relu_(relu),
+      use_bias_(bias),
+      fp16_(ip, C, H, W, filter, Cin, relu, bias) {
+  // The int8 cudnn convolution needs channel counts divisible by 4.
+  if (C % 4 != 0 || Cin % 4 != 0) {
+    throw Exception("Channel count unsupported by int8 convolution");
+  }
+  const size_t weight_size = Cin * C * filter_size_ * filter_size_;
+  ReportCUDAErrors(cudaMalloc(&weights_, weight_size));
+  ReportCUDAErrors(cudaMalloc(&biases_, sizeof(float) * C));
+  ReportCUDAErrors(cudaMemset(biases_, 0, sizeof(float) * C));
+  ReportCUDAErrors(cudaMalloc(&channel_scales_, sizeof(float) * C));
+  ReportCUDAErrors(cudaMalloc(&absmax_, sizeof(float)));
+  ReportCUDAErrors(cudaMemset(absmax_, 0, sizeof(float)));
+
+  cudnnCreateFilterDescriptor(&filter_desc_);
+  cudnnCreateConvolutionDescriptor(&conv_desc_);
+  cudnnCreateTensorDescriptor(&in_tensor_desc_);
+  cudnnCreateTensorDescriptor(&out_tensor_desc_);
+
+  ReportCUDNNErrors(cudnnSetFilter4dDescriptor(filter_desc_, CUDNN_DATA_INT8,
+                                               CUDNN_TENSOR_NHWC, C, Cin,
+                                               filter_size_, filter_size_));
+  const int padding = filter_size_ / 2;
+  ReportCUDNNErrors(cudnnSetConvolution2dDescriptor(
+      conv_desc_, padding, padding, 1, 1, 1, 1, CUDNN_CROSS_CORRELATION,
+      CUDNN_DATA_INT32));
+}
+
+void ConvInt8Layer::LoadWeights(float* pfilter, float* pBias, void* scratch) {
+  fp16_.LoadWeights(pfilter, pBias, scratch);
+
+  // Quantize per output channel and reorder from KCRS to KRSC (NHWC).
+  const int filter_area = filter_size_ * filter_size_;
+  const int per_channel = c_input_ * filter_area;
+  std::vector<int8_t> quantized(C * per_channel);
+  weight_scales_.assign(C, 1.0f);
+  for (int k = 0; k < C; k++) {
+    const float* src = pfilter + k * per_channel;
+    float max = 0;
+    for (int i = 0; i < per_channel; i++) max = std::max(max, std::abs(src[i]));
+    if (max > 0) weight_scales_[k] = max / 127.0f;
+    for (int c = 0; c < c_input_; c++) {
+      for (int rs = 0; rs < filter_area; rs++) {
+        const float val =
+            std::round(src[c * filter_area + rs] / weight_scales_[k]);
+        quantized[(k * filter_area + rs) * c_input_ + c] =
+            static_cast<int8_t>(std::max(-127.0f, std::min(127.0f, val)));
+      }
+    }
+  }
+  ReportCUDAErrors(cudaMemcpy(weights_, quantized.data(), quantized.size(),
+                              cudaMemcpyHostToDevice));
+  if (pBias) {
+    ReportCUDAErrors(cudaMemcpy(biases_, pBias, sizeof(float) * C,
+                                cudaMemcpyHostToDevice));
+  }
+}
+
+void ConvInt8Layer::FinishCalibration() {
+  float absmax;
+  ReportCUDAErrors(
+      cudaMemcpy(&absmax, absmax_, sizeof(float), cudaMemcpyDeviceToHost));
+  input_scale_ = absmax > 0 ? absmax / 127.0f : 1.0f;
+  std::vector<float> scales(C);
+  for (int k = 0; k < C; k++) scales[k] = input_scale_ * weight_scales_[k];
+  ReportCUDAErrors(cudaMemcpy(channel_scales_, scales.data(),
+                              sizeof(float) * C, cudaMemcpyHostToDevice));
+  calibrated_ = true;
+}
+
+void ConvInt8Layer::SetTensorDescriptors(int N) {
+  ReportCUDNNErrors(cudnnSetTensor4dDescriptor(
+      in_tensor_desc_, CUDNN_TENSOR_NHWC, CUDNN_DATA_INT8, N, c_input_, H, W));
+  ReportCUDNNErrors(cudnnSetTensor4dDescriptor(
+      out_tensor_desc_, CUDNN_TENSOR_NHWC, CUDNN_DATA_FLOAT, N, C, H, W));
+}
+
+size_t ConvInt8Layer::GetScratchSize(int N, cudnnHandle_t cudnn) {
+  std::lock_guard<std::mutex> lock(desc_mutex_);
+  SetTensorDescriptors(N);
+  size_t workspace_size;
+  ReportCUDNNErrors(cudnnGetConvolutionForwardWorkspaceSize(
+      cudnn, in_tensor_desc_, filter_desc_, conv_desc_, out_tensor_desc_,
+      CUDNN_CONVOLUTION_FWD_ALGO_IMPLICIT_PRECOMP_GEMM, &workspace_size));
+  return AlignScratch(N * c_input_ * H * W) +
+         AlignScratch(sizeof(float) * N * C * H * W) + workspace_size;
+}
+
+void ConvInt8Layer::Eval(int N, half* output, const half* input,
+                         const half* input2, void* scratch,
+                         size_t scratch_size, cudnnHandle_t cudnn,
+                         cublasHandle_t cublas, cudaStream_t stream) {
+  const int input_size = N * c_input_ * H * W;
+  if (!calibrated_) {
+    absMax_Fp16(absmax_, input, input_size, stream);
+    fp16_.Eval(N, output, input, input2, scratch, scratch_size, cudnn, cublas,
+               stream);
+    return;
+  }
+
+  int8_t* quantized = static_cast<int8_t*>(scratch);
+  const size_t quantized_size = AlignScratch(input_size);
+  float* accumulators =
+      reinterpret_cast<float*>(static_cast<char*>(scratch) + quantized_size);
+  const size_t accumulators_size = AlignScratch(sizeof(float) * N * C * H * W);
+  void* workspace = reinterpret_cast<char*>(accumulators) + accumulators_size;
+  assert(scratch_size >= quantized_size + accumulators_size);
+  const size_t workspace_size =
+      scratch_size - quantized_size - accumulators_size;
+
+  quantize_Fp16ToInt8(quantized, input, input_scale_, input_size, stream);
+  {
+    // The calls below only enqueue work, so the lock is held briefly.
+    std::lock_guard<std::mutex> lock(desc_mutex_);
+    SetTensorDescriptors(N);
+    float alpha = 1.0f, beta = 0.0f;
+    ReportCUDNNErrors(cudnnConvolutionForward(
+        cudnn, &alpha, in_tensor_desc_, quantized, filter_desc_, weights_,
+        conv_desc_, CUDNN_CONVOLUTION_FWD_ALGO_IMPLICIT_PRECOMP_GEMM,
+        workspace, workspace_size, &beta, out_tensor_desc_, accumulators));
+  }
+  dequantize_Int8Conv(output, accumulators, channel_scales_,
+                      use_bias_ ? biases_ : nullptr, input2, N * C * H * W, C,
+                      use_relu_, stream);
+}
+
+ConvInt8Layer::~ConvInt8Layer() {
+  ReportCUDAErrors(cudaFree(weights_));
+  ReportCUDAErrors(cudaFree(biases_));
+  ReportCUDAErrors(cudaFree(channel_scales_));
+  ReportCUDAErrors(cudaFree(absmax_));
+
+  cudnnDestroyFilterDescriptor(filter_desc_);
+  cudnnDestroyConvolutionDescriptor(conv_desc_);
+  cudnnDestroyTensorDescriptor(in_tensor_desc_);
+  cudnnDestroyTensorDescriptor(out_tensor_desc_);
+}
+
 template <typename DataType>
 BNLayer<DataType>::BNLayer(BaseLayer<DataType>* ip, bool relu)
     : BaseLayer<DataType>(ip->GetC(), ip->GetH(), ip->GetW(), ip),
@@ -288,16 +534,18 @@ template <>
 void BNLayer<half>::Eval(int N, half* output, const half* input,
                          const half* input2, void* /*scratch*/,
                          size_t /*scratch_size*/, cudnnHandle_t /*cudnn*/,
-                         cublasHandle_t /*cublas*/) {
-  batchNorm(output, input, input2, N, C, H, W, means_, variances_, use_relu_);
+                         cublasHandle_t /*cublas*/, cudaStream_t stream) {
+  batchNorm(output, input, input2, N, C, H, W, means_, variances_, use_relu_,
+            stream);
 }
 
 template <>
 void BNLayer<float>::Eval(int N, float* output, const float* input,
                           const float* input2, void* /*scratch*/,
                           size_t /*scratch_size*/, cudnnHandle_t /*cudnn*/,
-                          cublasHandle_t /*cublas*/) {
-  batchNorm(output, input, input2, N, C, H, W, means_, variances_, use_relu_);
+                          cublasHandle_t /*cublas*/, cudaStream_t stream) {
+  batchNorm(output, input, input2, N, C, H, W, means_, variances_, use_relu_,
+            stream);
 }
 
 template <typename DataType>
@@ -373,11 +621,13 @@ void SELayer<half>::LoadWeights(float* w1, float* b1, float* w2, float* b2,
   const size_t num_weights2 = 2 * num_weights1;
   size_t weight_size2 = 2 * weight_size1;
 
-  // Transpose the weight matrices for the fused path.
+  // Transpose the weight matrices for the fused path. Sizes the fused kernel
+  // doesn't cover keep the cublas layout.
+  use_fused_ = kUseFusedSELayer && Se_Fp16_NHWC_Supported(C, numFc1Out_);
   std::vector<float> temp(weight_size2);
 
   // Weight for the first FC layer.
-  if (kUseFusedSELayer) {
+  if (use_fused_) {
     cpuTranspose(temp.data(), w1, numFc1Out_, C);
     ReportCUDAErrors(
         cudaMemcpy(scratch, temp.data(), weight_size1, cudaMemcpyHostToDevice));
@@ -385,10 +635,10 @@ void SELayer<half>::LoadWeights(float* w1, float* b1, float* w2, float* b2,
     ReportCUDAErrors(
         cudaMemcpy(scratch, w1, weight_size1, cudaMemcpyHostToDevice));
   }
-  copyTypeConverted((half*)w1_, (float*)scratch, num_weights1);
+  copyTypeConverted((half*)w1_, (float*)scratch, num_weights1, 0);
 
   // Weight for the second FC layer.
-  if (kUseFusedSELayer) {
+  if (use_fused_) {
     cpuTranspose(temp.data(), w2, 2 * C, numFc1Out_);
     ReportCUDAErrors(
         cudaMemcpy(scratch, temp.data(), weight_size2, cudaMemcpyHostToDevice));
@@ -396,23 +646,23 @@ void SELayer<half>::LoadWeights(float* w1, float* b1, float* w2, float* b2,
     ReportCUDAErrors(
         cudaMemcpy(scratch, w2, weight_size2, cudaMemcpyHostToDevice));
   }
-  copyTypeConverted((half*)w2_, (float*)scratch, num_weights2);
+  copyTypeConverted((half*)w2_, (float*)scratch, num_weights2, 0);
 
   // Bias for the first FC layer.
   ReportCUDAErrors(cudaMemcpy(scratch, b1, numFc1Out_ * sizeof(float),
                               cudaMemcpyHostToDevice));
-  copyTypeConverted((half*)b1_, (float*)scratch, numFc1Out_);
+  copyTypeConverted((half*)b1_, (float*)scratch, numFc1Out_, 0);
 
   // Bias for the second FC layer.
   ReportCUDAErrors(
       cudaMemcpy(scratch, b2, 2 * C * sizeof(float), cudaMemcpyHostToDevice));
-  copyTypeConverted((half*)b2_, (float*)scratch, 2 * C);
+  copyTypeConverted((half*)b2_, (float*)scratch, 2 * C, 0);
 
   // Bias for previous layer (Convolution).
   if (prevLayerBias) {
     ReportCUDAErrors(cudaMemcpy(scratch, prevLayerBias, C * sizeof(float),
                                 cudaMemcpyHostToDevice));
-    copyTypeConverted((half*)bPrev_, (float*)scratch, C);
+    copyTypeConverted((half*)bPrev_, (float*)scratch, C, 0);
   }
 }
 
@@ -420,14 +670,14 @@ template <>
 void SELayer<float>::Eval(int N, float* output, const float* input,
                           const float* /*input2*/, void* scratch,
                           size_t scratch_size, cudnnHandle_t /*cudnn*/,
-                          cublasHandle_t cublas) {
+                          cublasHandle_t cublas, cudaStream_t stream) {
   // Ping-pong between 'op1' and 'op2' (parts of scratch memory).
   float* op1 = (float*)scratch;
   float* op2 = (float*)scratch + scratch_size / sizeof(float) / 2;
 
   // 1. Global avg pooling (also adds previous layer bias before computing
   // averages).
-  globalAvgPool(N, C, op2, input, bPrev_);
+  globalAvgPool(N, C, op2, input, bPrev_, stream);
 
   // 2. First fully connected layer.
   float alpha = 1.0f, beta = 0.0f;
@@ -435,27 +685,29 @@ void SELayer<float>::Eval(int N, float* output, const float* input,
                                  N, C, &alpha, w1_, C, op2, C, &beta, op1,
                                  numFc1Out_));
   addVectors(op1, b1_, op1, numFc1Out_ * N, numFc1Out_, numFc1Out_ * N, true,
-             false, false);
+             false, false, stream);
 
   // 3. Second fully connected layer.
   ReportCUBLASErrors(cublasSgemm(cublas, CUBLAS_OP_T, CUBLAS_OP_N, 2 * C, N,
                                  numFc1Out_, &alpha, w2_, numFc1Out_, op1,
                                  numFc1Out_, &beta, op2, 2 * C));
-  addVectors(op2, b2_, op2, 2 * C * N, 2 * C, 2 * C * N, false, false, false);
+  addVectors(op2, b2_, op2, 2 * C * N, 2 * C, 2 * C * N, false, false, false,
+             stream);
 
   // 4. (Optional prev layer bias add), Global scale, residual add, relu and
   // bias.
-  globalScale(N, C, output, input, op2, bPrev_);
+  globalScale(N, C, output, input, op2, bPrev_, stream);
 }
 
 template <>
 void SELayer<half>::Eval(int N, half* output, const half* input,
                          const half* input2, void* scratch, size_t scratch_size,
-                         cudnnHandle_t /*cudnn*/, cublasHandle_t cublas) {
+                         cudnnHandle_t /*cudnn*/, cublasHandle_t cublas,
+                         cudaStream_t stream) {
   bool se_done = false;
-  if (kUseFusedSELayer) {
+  if (use_fused_) {
     se_done = Se_Fp16_NHWC(N, C, numFc1Out_, output, input2, input, w1_, b1_,
-                           w2_, b2_, bPrev_);
+                           w2_, b2_, bPrev_, stream);
   } 
   if (!se_done) {
     assert(output == input2);
@@ -465,7 +717,7 @@ void SELayer<half>::Eval(int N, half* output, const half* input,
 
     // 1. Global avg pooling (also adds previous layer bias before computing
     // averages).
-    globalAvgPool(N, C, op2, input, bPrev_);
+    globalAvgPool(N, C, op2, input, bPrev_, stream);
 
     // 2. First fully connected layer.
     __half_raw one_h{0x3C00};
@@ -476,17 +728,18 @@ void SELayer<half>::Eval(int N, half* output, const half* input,
                                    N, C, &alpha, w1_, C, op2, C, &beta, op1,
                                    numFc1Out_));
     addVectors(op1, b1_, op1, numFc1Out_ * N, numFc1Out_, numFc1Out_ * N, true,
-               false, false);
+               false, false, stream);
 
     // 3. Second fully connected layer.
     ReportCUBLASErrors(cublasHgemm(cublas, CUBLAS_OP_T, CUBLAS_OP_N, 2 * C, N,
                                    numFc1Out_, &alpha, w2_, numFc1Out_, op1,
                                    numFc1Out_, &beta, op2, 2 * C));
-    addVectors(op2, b2_, op2, 2 * C * N, 2 * C, 2 * C * N, false, false, false);
+    addVectors(op2, b2_, op2, 2 * C * N, 2 * C, 2 * C * N, false, false, false,
+               stream);
 
     // 4. (Optional prev layer bias add), Global scale, residual add, relu and
     // bias.
-    globalScale(N, C, output, input, op2, bPrev_);
+    globalScale(N, C, output, input, op2, bPrev_, stream);
   }
 }
 
@@ -530,7 +783,7 @@ void FCLayer<half>::LoadWeights(float* cpuWeight, float* cpuBias,
   if (cpuBias) {
     ReportCUDAErrors(
         cudaMemcpy(scratch, cpuBias, blas_size, cudaMemcpyHostToDevice));
-    copyTypeConverted((half*)biases_, (float*)scratch, num_biases);
+    copyTypeConverted((half*)biases_, (float*)scratch, num_biases, 0);
   }
 }
 
@@ -555,7 +808,7 @@ template <>
 void FCLayer<half>::Eval(int N, half* output_tensor, const half* input_tensor,
                          const half* /*input2*/, void* /*scratch*/,
                          size_t /*scratch_size*/, cudnnHandle_t /*cudnn*/,
-                         cublasHandle_t cublas) {
+                         cublasHandle_t cublas, cudaStream_t stream) {
   const int num_outputs = C * H * W;
   const int num_inputs = input_->GetC() * input_->GetH() * input_->GetW();
 
@@ -572,7 +825,7 @@ void FCLayer<half>::Eval(int N, half* output_tensor, const half* input_tensor,
   if (use_bias_ || use_relu_ || use_tanh_ || use_sigmoid_) {
     addVectors(output_tensor, biases_, output_tensor, num_outputs * N,
                num_outputs, num_outputs * N, use_relu_, use_tanh_,
-               use_sigmoid_);
+               use_sigmoid_, stream);
   }
 }
 
@@ -580,7 +833,8 @@ template <>
 void FCLayer<float>::Eval(int N, float* output_tensor,
                           const float* input_tensor, const float* /*input2*/,
                           void* /*scratch*/, size_t /*scratch_size*/,
-                          cudnnHandle_t /*cudnn*/, cublasHandle_t cublas) {
+                          cudnnHandle_t /*cudnn*/, cublasHandle_t cublas,
+                          cudaStream_t stream) {
   const int num_outputs = C * H * W;
   const int num_inputs = input_->GetC() * input_->GetH() * input_->GetW();
 
@@ -593,7 +847,7 @@ void FCLayer<float>::Eval(int N, float* output_tensor,
   if (use_bias_ || use_relu_ || use_tanh_ || use_sigmoid_) {
     addVectors(output_tensor, biases_, output_tensor, num_outputs * N,
                num_outputs, num_outputs * N, use_relu_, use_tanh_,
-               use_sigmoid_);
+               use_sigmoid_, stream);
   }
 }
 
@@ -692,12 +946,13 @@ void PolicyMapLayer<DataType>::Eval(int N, DataType* output_tensor,
                                     const DataType* /*input2*/,
                                     void* /*scratch*/, size_t /*scratch_size*/,
                                     cudnnHandle_t /*cudnn*/,
-                                    cublasHandle_t /*cublas*/) {
+                                    cublasHandle_t /*cublas*/,
+                                    cudaStream_t stream) {
   int inputSize =
       this->input_->GetC() * this->input_->GetH() * this->input_->GetW();
   int outputSize = this->C * this->H * this->W;
   PolicyMap(N, output_tensor, input_tensor, weights_, inputSize, used_size_,
-            outputSize);
+            outputSize, stream);
 }
 
 template <typename DataType>
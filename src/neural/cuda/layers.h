@@ -27,8 +27,15 @@
 #pragma once
 
 #include <cstddef>
+#include <cstdint>
 #include <cublas_v2.h>
+#include <cuda_fp16.h>
+#include <cuda_runtime.h>
 #include <cudnn.h>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
 
 namespace lczero {
 namespace cudnn_backend {
@@ -47,10 +54,12 @@ class BaseLayer {
   virtual ~BaseLayer() = default;
   size_t GetOutputSize(int N) const { return sizeof(DataType) * N * C * H * W; }
 
-  // Input2 is optional (skip connection).
+  // Input2 is optional (skip connection). Work is enqueued to @stream, which
+  // the cudnn and cublas handles must be bound to.
   virtual void Eval(int N, DataType* output, const DataType* input,
                     const DataType* input2, void* scratch, size_t scratch_size,
-                    cudnnHandle_t cudnn, cublasHandle_t cublas) = 0;
+                    cudnnHandle_t cudnn, cublasHandle_t cublas,
+                    cudaStream_t stream) = 0;
 
  protected:
   BaseLayer* input_;
@@ -76,9 +85,36 @@ class ConvLayer : public BaseLayer<DataType> {
   void LoadWeights(float* pfilter, float* pBias, void* scratch);
   void Eval(int N, DataType* output, const DataType* input,
             const DataType* input2, void* scratch, size_t scratch_size,
-            cudnnHandle_t cudnn, cublasHandle_t cublas) override;
+            cudnnHandle_t cudnn, cublasHandle_t cublas,
+            cudaStream_t stream) override;
+
+  // Benchmarks the cudnn algorithms at each of @batch_sizes (ascending) on the
+  // @input and @output buffers, and keeps the fastest one whose workspace fits
+  // in @scratch_size. Eval() then uses the entry of the smallest tuned batch
+  // size not below N.
+  void Autotune(const std::vector<int>& batch_sizes, DataType* input,
+                DataType* output, void* scratch, size_t scratch_size,
+                cudnnHandle_t cudnn);
+  bool HasSameShape(const ConvLayer& other) const;
+  void CopyTuning(const ConvLayer& other) { tuned_algos_ = other.tuned_algos_; }
+  // Identifies the layer shape and precision in the tuning cache.
+  std::string TuningKey() const;
+  const std::vector<std::pair<int, cudnnConvolutionFwdAlgo_t>>& GetTuning()
+      const {
+    return tuned_algos_;
+  }
+  void SetTuning(
+      const std::vector<std::pair<int, cudnnConvolutionFwdAlgo_t>>& tuning) {
+    tuned_algos_ = tuning;
+  }
+  // Returns the largest workspace the tuned algorithms take at their batch
+  // sizes.
+  size_t GetTunedWorkspaceSize(cudnnHandle_t cudnn);
 
  private:
+  cudnnConvolutionFwdAlgo_t GetAlgo(int N) const;
+  void SetTensorDescriptors(int N);
+
   const int c_input_;
   const int filter_size_;
   const bool use_relu_;
@@ -90,11 +126,63 @@ class ConvLayer : public BaseLayer<DataType> {
   cudnnFilterDescriptor_t filter_desc_;
   cudnnConvolutionDescriptor_t conv_desc_;
   cudnnConvolutionFwdAlgo_t conv_algo_;
+  // Pairs of batch size and algorithm, ascending by batch size.
+  std::vector<std::pair<int, cudnnConvolutionFwdAlgo_t>> tuned_algos_;
 
   cudnnTensorDescriptor_t bias_desc_;
   cudnnTensorDescriptor_t in_tensor_desc_;
   cudnnTensorDescriptor_t out_tensor_desc_;
   cudnnActivationDescriptor_t activation_;
+  // Held while the tensor descriptors are set up for N and used, as
+  // evaluations on several streams may run Eval() concurrently.
+  std::mutex desc_mutex_;
+};
+
+// Convolution with int8 weights and activations (cudnn-int8). Weights are
+// quantized per output channel, the input with a single scale found by
+// calibration: until FinishCalibration() the layer runs in fp16 and records
+// the largest input magnitude it sees. Accumulation is done in int32, the
+// dequantize, bias, skip connection and relu happen in one epilogue kernel.
+class ConvInt8Layer : public BaseLayer<half> {
+ public:
+  ConvInt8Layer(BaseLayer<half>* ip, int C, int H, int W, int size, int Cin,
+                bool relu = false, bool bias = false);
+  ~ConvInt8Layer();
+  void LoadWeights(float* pfilter, float* pBias, void* scratch);
+  void FinishCalibration();
+  // Scratch Eval() needs at batch size N: the quantized input, the int32
+  // accumulators converted to float and the cudnn workspace.
+  size_t GetScratchSize(int N, cudnnHandle_t cudnn);
+  void Eval(int N, half* output, const half* input, const half* input2,
+            void* scratch, size_t scratch_size, cudnnHandle_t cudnn,
+            cublasHandle_t cublas, cudaStream_t stream) override;
+
+ private:
+  void SetTensorDescriptors(int N);
+
+  const int c_input_;
+  const int filter_size_;
+  const bool use_relu_;
+  const bool use_bias_;
+
+  // Runs the layer while calibrating.
+  ConvLayer<half> fp16_;
+  bool calibrated_ = false;
+  float* absmax_ = nullptr;
+  float input_scale_ = 1.0f;
+
+  int8_t* weights_ = nullptr;
+  float* biases_ = nullptr;
+  // Weight scale of every output channel, on the host.
+  std::vector<float> weight_scales_;
+  // Input scale times weight scale, per output channel.
+  float* channel_scales_ = nullptr;
+
+  cudnnFilterDescriptor_t filter_desc_;
+  cudnnConvolutionDescriptor_t conv_desc_;
+  cudnnTensorDescriptor_t in_tensor_desc_;
+  cudnnTensorDescriptor_t out_tensor_desc_;
+  std::mutex desc_mutex_;
 };
 
 template <typename DataType>
@@ -108,10 +196,14 @@ class SoftMaxLayer : public BaseLayer<DataType> {
   ~SoftMaxLayer();
   void Eval(int N, DataType* output, const DataType* input,
             const DataType* input2, void* scratch, size_t scratch_size,
-            cudnnHandle_t cudnn, cublasHandle_t cublas) override;
+            cudnnHandle_t cudnn, cublasHandle_t cublas,
+            cudaStream_t stream) override;
 
  private:
   cudnnTensorDescriptor_t out_tensor_desc_;
+  // Held while the descriptor is set up for N and used, as evaluations on
+  // several streams may run Eval() concurrently.
+  std::mutex desc_mutex_;
 };
 
 template <typename DataType>
@@ -125,7 +217,8 @@ class BNLayer : public BaseLayer<DataType> {
   void LoadWeights(float* cpuMeans, float* cpuVar);
   void Eval(int N, DataType* output, const DataType* input,
             const DataType* input2, void* scratch, size_t scratch_size,
-            cudnnHandle_t cudnn, cublasHandle_t cublas) override;
+            cudnnHandle_t cudnn, cublasHandle_t cublas,
+            cudaStream_t stream) override;
 
  private:
   const bool use_relu_;
@@ -146,7 +239,8 @@ class FCLayer : public BaseLayer<DataType> {
   void LoadWeights(float* cpuWeight, float* cpuBias, void* scratch);
   void Eval(int N, DataType* output, const DataType* input,
             const DataType* input2, void* scratch, size_t scratch_size,
-            cudnnHandle_t cudnn, cublasHandle_t cublas) override;
+            cudnnHandle_t cudnn, cublasHandle_t cublas,
+            cudaStream_t stream) override;
 
  private:
   const bool use_bias_;
@@ -166,7 +260,8 @@ class PolicyMapLayer: public BaseLayer<DataType> {
   void LoadWeights(const short* cpuWeight, void* scratch);
   void Eval(int N, DataType* output, const DataType* input,
             const DataType* input2, void* scratch, size_t scratch_size,
-            cudnnHandle_t cudnn, cublasHandle_t cublas) override;
+            cudnnHandle_t cudnn, cublasHandle_t cublas,
+            cudaStream_t stream) override;
 
  private:
   int used_size_; // Size of the input without padding (typically 73x64).
@@ -192,7 +287,8 @@ class SELayer : public BaseLayer<DataType> {
 
   void Eval(int N, DataType* output, const DataType* input,
             const DataType* input2, void* scratch, size_t scratch_size,
-            cudnnHandle_t cudnn, cublasHandle_t cublas) override;
+            cudnnHandle_t cudnn, cublasHandle_t cublas,
+            cudaStream_t stream) override;
 
  private:
   DataType* w1_ = nullptr;
@@ -202,6 +298,8 @@ class SELayer : public BaseLayer<DataType> {
   DataType* bPrev_ = nullptr;
   int numFc1Out_;
   bool addPrevLayerBias_;
+  // Pooling, both FC layers, scaling, skip add and relu in one kernel.
+  bool use_fused_ = false;
 };
 
 }  // namespace cudnn_backend
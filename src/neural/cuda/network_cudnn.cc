@@ -25,19 +25,32 @@
   Program grant you additional permission to convey the resulting work.
 */
 #include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
 #include <functional>
 #include <list>
+#include <map>
 #include <memory>
+#include <sstream>
 #include <mutex>
+#include <random>
+#include <thread>
+#include "chess/position.h"
 #include "cuda_common.h"
 #include "kernels.h"
 #include "layers.h"
+#include "neural/encoder.h"
 #include "neural/factory.h"
 #include "neural/network_legacy.h"
 #include "neural/shared/policy_map.h"
 #include "utils/bititer.h"
 #include "utils/exception.h"
+#include "utils/metrics.h"
+#include "utils/string.h"
+#include "utils/trace.h"
 
 //#define DEBUG_RAW_NPS
 
@@ -45,56 +58,273 @@ namespace lczero {
 using namespace cudnn_backend;
 
 static constexpr int kNumOutputPolicy = 1858;
+// Room for gathered priors, per position on average. No position has more
+// than 218 legal moves.
+static constexpr int kMaxMovesPerPosition = 256;
+
+namespace {
+Gauge gDeviceMemoryMetric(
+    "lc0_cudnn_device_memory_bytes",
+    "Device memory held by the cudnn networks of the process, weights aside.");
+std::atomic<int64_t> gDeviceMemoryBytes{0};
+
+// Device memory of all cudnn networks of the process on one GPU. Blocks given
+// back by an evaluation or a destroyed network go to the next request they
+// fit, so that networks sharing a GPU together only take what they use at
+// the same time rather than each its worst case.
+class DeviceMemoryPool {
+ public:
+  static DeviceMemoryPool* Get(int gpu_id) {
+    static std::mutex mutex;
+    // Never destroyed, the CUDA context may be gone by then.
+    static auto* pools = new std::map<int, std::unique_ptr<DeviceMemoryPool>>;
+    std::lock_guard<std::mutex> lock(mutex);
+    auto& pool = (*pools)[gpu_id];
+    if (!pool) pool.reset(new DeviceMemoryPool(gpu_id));
+    return pool.get();
+  }
+
+  // Returns a block of at least @size bytes. A free block more than twice as
+  // large is left for a larger request.
+  void* Acquire(size_t size) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    const auto iter = free_.lower_bound(size);
+    if (iter != free_.end() && iter->first <= 2 * size) {
+      void* mem = iter->second;
+      free_.erase(iter);
+      return mem;
+    }
+    ReportCUDAErrors(cudaSetDevice(gpu_id_));
+    void* mem = nullptr;
+    if (cudaMalloc(&mem, size) != cudaSuccess) {
+      // The failure isn't sticky, retry once the cached blocks are gone.
+      cudaGetLastError();
+      TrimLocked();
+      ReportCUDAErrors(cudaMalloc(&mem, size));
+    }
+    sizes_[mem] = size;
+    Account(size);
+    return mem;
+  }
+
+  void Release(void* mem) {
+    if (!mem) return;
+    std::lock_guard<std::mutex> lock(mutex_);
+    free_.emplace(sizes_.at(mem), mem);
+  }
+
+  // Gives the free blocks back to the driver, for other processes.
+  void Trim() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    TrimLocked();
+  }
+
+  void LogUsage() {
+    size_t free_bytes = 0;
+    size_t total_bytes = 0;
+    ReportCUDAErrors(cudaMemGetInfo(&free_bytes, &total_bytes));
+    std::lock_guard<std::mutex> lock(mutex_);
+    CERR << "GPU " << gpu_id_ << ": cudnn networks hold "
+         << (allocated_ >> 20) << " MB besides weights, " << (free_bytes >> 20)
+         << " MB of " << (total_bytes >> 20) << " MB free.";
+  }
+
+ private:
+  explicit DeviceMemoryPool(int gpu_id) : gpu_id_(gpu_id) {}
+
+  void TrimLocked() {
+    ReportCUDAErrors(cudaSetDevice(gpu_id_));
+    for (const auto& block : free_) {
+      ReportCUDAErrors(cudaFree(block.second));
+      sizes_.erase(block.second);
+      Account(-static_cast<int64_t>(block.first));
+    }
+    free_.clear();
+  }
+
+  void Account(int64_t delta) {
+    allocated_ += delta;
+    gDeviceMemoryMetric.Set(gDeviceMemoryBytes += delta);
+  }
+
+  const int gpu_id_;
+  std::mutex mutex_;
+  // Size of every block, and the free ones by size.
+  std::map<void*, size_t> sizes_;
+  std::multimap<size_t, void*> free_;
+  int64_t allocated_ = 0;
+};
+}  // namespace
 
 struct InputsOutputs {
-  InputsOutputs(int maxBatchSize) {
+  // Host buffers take @maxBatchSize positions. Device buffers start with
+  // room for @batchSize and grow on demand with ReserveDevice().
+  InputsOutputs(DeviceMemoryPool* pool, int maxBatchSize, int batchSize)
+      : pool_(pool), max_batch_size_(maxBatchSize) {
+    // Inputs stay in the packed mask + value form and are uploaded with one
+    // DMA copy each, the expand kernel then reads them from device memory. The
+    // host only ever writes them, so write-combined memory is fine.
     ReportCUDAErrors(cudaHostAlloc(
         &input_masks_mem_, maxBatchSize * kInputPlanes * sizeof(uint64_t),
-        cudaHostAllocMapped));
-    ReportCUDAErrors(
-        cudaHostGetDevicePointer(&input_masks_mem_gpu_, input_masks_mem_, 0));
-
+        cudaHostAllocWriteCombined));
     ReportCUDAErrors(cudaHostAlloc(&input_val_mem_,
                                    maxBatchSize * kInputPlanes * sizeof(float),
-                                   cudaHostAllocMapped));
-    ReportCUDAErrors(
-        cudaHostGetDevicePointer(&input_val_mem_gpu_, input_val_mem_, 0));
-
+                                   cudaHostAllocWriteCombined));
     ReportCUDAErrors(cudaHostAlloc(
         &op_policy_mem_, maxBatchSize * kNumOutputPolicy * sizeof(float), 0));
+    // Room for WDL, three values per position.
+    ReportCUDAErrors(
+        cudaHostAlloc(&op_value_mem_, 3 * maxBatchSize * sizeof(float), 0));
+
+    // Moves whose priors are gathered on the device, and the priors.
+    const size_t max_moves =
+        static_cast<size_t>(maxBatchSize) * kMaxMovesPerPosition;
+    ReportCUDAErrors(cudaHostAlloc(&legal_moves_mem_,
+                                   max_moves * sizeof(uint16_t),
+                                   cudaHostAllocWriteCombined));
+    ReportCUDAErrors(cudaHostAlloc(&legal_offsets_mem_,
+                                   (maxBatchSize + 1) * sizeof(int),
+                                   cudaHostAllocWriteCombined));
+    ReportCUDAErrors(cudaHostAlloc(&legal_temps_mem_,
+                                   maxBatchSize * sizeof(float),
+                                   cudaHostAllocWriteCombined));
+    ReportCUDAErrors(
+        cudaHostAlloc(&op_legal_policy_mem_, max_moves * sizeof(float), 0));
 
-    // Seperate device memory copy for policy output.
-    // It's faster to write to device memory and then copy to host memory
-    // than having the kernel write directly to it.
-    ReportCUDAErrors(cudaMalloc(
-        &op_policy_mem_gpu_, maxBatchSize * kNumOutputPolicy * sizeof(float)));
+    ReserveDevice(batchSize);
 
-    ReportCUDAErrors(cudaHostAlloc(&op_value_mem_, maxBatchSize * sizeof(float),
-                                   cudaHostAllocMapped));
     ReportCUDAErrors(
-        cudaHostGetDevicePointer(&op_value_mem_gpu_, op_value_mem_, 0));
+        cudaEventCreateWithFlags(&done_event_, cudaEventDisableTiming));
   }
   ~InputsOutputs() {
+    ReportCUDAErrors(cudaEventDestroy(done_event_));
     ReportCUDAErrors(cudaFreeHost(input_masks_mem_));
     ReportCUDAErrors(cudaFreeHost(input_val_mem_));
     ReportCUDAErrors(cudaFreeHost(op_policy_mem_));
-    ReportCUDAErrors(cudaFree(op_policy_mem_gpu_));
     ReportCUDAErrors(cudaFreeHost(op_value_mem_));
+    ReportCUDAErrors(cudaFreeHost(legal_moves_mem_));
+    ReportCUDAErrors(cudaFreeHost(legal_offsets_mem_));
+    ReportCUDAErrors(cudaFreeHost(legal_temps_mem_));
+    ReportCUDAErrors(cudaFreeHost(op_legal_policy_mem_));
+    ReleaseDevice();
   }
+
+  // Makes room for @batchSize positions in the device buffers, rounded up to
+  // a power of two so that they seldom grow. Their contents are lost, so
+  // only between evaluations.
+  void ReserveDevice(int batchSize) {
+    if (batchSize <= device_batch_size_) return;
+    ReleaseDevice();
+    int size = 1;
+    while (size < batchSize) size *= 2;
+    device_batch_size_ = std::min(size, max_batch_size_);
+    const size_t batch = device_batch_size_;
+    const size_t max_moves = batch * kMaxMovesPerPosition;
+
+    input_masks_mem_gpu_ = static_cast<uint64_t*>(
+        pool_->Acquire(batch * kInputPlanes * sizeof(uint64_t)));
+    input_val_mem_gpu_ = static_cast<float*>(
+        pool_->Acquire(batch * kInputPlanes * sizeof(float)));
+    // Seperate device memory copy for policy output.
+    // It's faster to write to device memory and then copy to host memory
+    // than having the kernel write directly to it.
+    op_policy_mem_gpu_ = static_cast<float*>(
+        pool_->Acquire(batch * kNumOutputPolicy * sizeof(float)));
+    op_value_mem_gpu_ =
+        static_cast<float*>(pool_->Acquire(3 * batch * sizeof(float)));
+    legal_moves_mem_gpu_ =
+        static_cast<uint16_t*>(pool_->Acquire(max_moves * sizeof(uint16_t)));
+    legal_offsets_mem_gpu_ =
+        static_cast<int*>(pool_->Acquire((batch + 1) * sizeof(int)));
+    legal_temps_mem_gpu_ =
+        static_cast<float*>(pool_->Acquire(batch * sizeof(float)));
+    op_legal_policy_mem_gpu_ =
+        static_cast<float*>(pool_->Acquire(max_moves * sizeof(float)));
+  }
+
+  DeviceMemoryPool* const pool_;
+  const int max_batch_size_;
+
+  // Pinned host memory.
   uint64_t* input_masks_mem_;
   float* input_val_mem_;
   float* op_policy_mem_;
   float* op_value_mem_;
+  // Moves of all positions one after another, those of position i from
+  // legal_offsets_mem_[i] to legal_offsets_mem_[i + 1], with the softmax
+  // temperature of each position, and the gathered priors in the same places.
+  uint16_t* legal_moves_mem_;
+  int* legal_offsets_mem_;
+  float* legal_temps_mem_;
+  float* op_legal_policy_mem_;
+
+  // Device copies of the above, moved with asynchronous copies, for
+  // device_batch_size_ positions.
+  int device_batch_size_ = 0;
+  uint64_t* input_masks_mem_gpu_ = nullptr;
+  float* input_val_mem_gpu_ = nullptr;
+  float* op_value_mem_gpu_ = nullptr;
+  float* op_policy_mem_gpu_ = nullptr;
+  uint16_t* legal_moves_mem_gpu_ = nullptr;
+  int* legal_offsets_mem_gpu_ = nullptr;
+  float* legal_temps_mem_gpu_ = nullptr;
+  float* op_legal_policy_mem_gpu_ = nullptr;
+
+  // Set by the computation: how many moves there are, and whether some
+  // position needs the whole policy.
+  int num_legal_moves_ = 0;
+  bool full_policy_ = true;
+
+  // Recorded after the last kernel of an asynchronous evaluation.
+  cudaEvent_t done_event_;
 
-  // GPU pointers for the above allocations.
-  uint64_t* input_masks_mem_gpu_;
-  float* input_val_mem_gpu_;
-  float* op_value_mem_gpu_;
+ private:
+  void ReleaseDevice() {
+    ReleaseBuffer(&input_masks_mem_gpu_);
+    ReleaseBuffer(&input_val_mem_gpu_);
+    ReleaseBuffer(&op_policy_mem_gpu_);
+    ReleaseBuffer(&op_value_mem_gpu_);
+    ReleaseBuffer(&legal_moves_mem_gpu_);
+    ReleaseBuffer(&legal_offsets_mem_gpu_);
+    ReleaseBuffer(&legal_temps_mem_gpu_);
+    ReleaseBuffer(&op_legal_policy_mem_gpu_);
+    device_batch_size_ = 0;
+  }
 
-  // This is a seperate copy.
-  float* op_policy_mem_gpu_;
+  template <typename T>
+  void ReleaseBuffer(T** mem) {
+    pool_->Release(*mem);
+    *mem = nullptr;
+  }
 };
 
+// Builds a 3x3 convolution of the residual tower, in int8 when
+// @int8_layers is given (only possible for fp16 networks).
+template <typename DataType>
+std::unique_ptr<BaseLayer<DataType>> MakeTowerConv(
+    BaseLayer<DataType>* ip, int filters, bool relu_and_bias, float* weights,
+    float* biases, void* scratch, std::vector<ConvInt8Layer*>* int8_layers) {
+  assert(!int8_layers);
+  auto conv = std::make_unique<ConvLayer<DataType>>(
+      ip, filters, 8, 8, 3, filters, relu_and_bias, relu_and_bias);
+  conv->LoadWeights(weights, biases, scratch);
+  return std::move(conv);
+}
+
+std::unique_ptr<BaseLayer<half>> MakeTowerConv(
+    BaseLayer<half>* ip, int filters, bool relu_and_bias, float* weights,
+    float* biases, void* scratch, std::vector<ConvInt8Layer*>* int8_layers) {
+  if (!int8_layers) {
+    return MakeTowerConv<half>(ip, filters, relu_and_bias, weights, biases,
+                               scratch, nullptr);
+  }
+  auto conv = std::make_unique<ConvInt8Layer>(
+      ip, filters, 8, 8, 3, filters, relu_and_bias, relu_and_bias);
+  conv->LoadWeights(weights, biases, scratch);
+  int8_layers->push_back(conv.get());
+  return std::move(conv);
+}
+
 template <typename DataType>
 class CudnnNetwork;
 
@@ -105,22 +335,17 @@ class CudnnNetworkComputation : public NetworkComputation {
   ~CudnnNetworkComputation();
 
   void AddInput(InputPlanes&& input) override {
-    const auto iter_mask =
-        &inputs_outputs_->input_masks_mem_[batch_size_ * kInputPlanes];
-    const auto iter_val =
-        &inputs_outputs_->input_val_mem_[batch_size_ * kInputPlanes];
-
-    int i = 0;
-    for (const auto& plane : input) {
-      iter_mask[i] = plane.mask;
-      iter_val[i] = plane.value;
-      i++;
-    }
+    inputs_outputs_->full_policy_ = true;
+    AddPlanes(input, nullptr, 0, 1.0f);
+  }
 
-    batch_size_++;
+  void AddInputWithMoves(InputPlanes&& input, const uint16_t* moves,
+                         int num_moves, float softmax_temp) override {
+    AddPlanes(input, moves, num_moves, softmax_temp);
   }
 
   void ComputeBlocking() override;
+  void ComputeAsync(std::function<void()> callback) override;
 
   int GetBatchSize() const override { return batch_size_; }
 
@@ -147,19 +372,82 @@ class CudnnNetworkComputation : public NetworkComputation {
     return inputs_outputs_->op_policy_mem_[sample * kNumOutputPolicy + move_id];
   }
 
+  float GetLegalPVal(int sample, int move_index) const override {
+    return inputs_outputs_->op_legal_policy_mem_[legal_offsets_[sample] +
+                                                 move_index];
+  }
+
  private:
+  void AddPlanes(const InputPlanes& input, const uint16_t* moves,
+                 int num_moves, float softmax_temp) {
+    const auto iter_mask =
+        &inputs_outputs_->input_masks_mem_[batch_size_ * kInputPlanes];
+    const auto iter_val =
+        &inputs_outputs_->input_val_mem_[batch_size_ * kInputPlanes];
+
+    int i = 0;
+    for (const auto& plane : input) {
+      iter_mask[i] = plane.mask;
+      iter_val[i] = plane.value;
+      i++;
+    }
+
+    int& total = inputs_outputs_->num_legal_moves_;
+    if (total + num_moves > (batch_size_ + 1) * kMaxMovesPerPosition) {
+      throw Exception("Too many moves to gather their policy");
+    }
+    std::copy(moves, moves + num_moves,
+              inputs_outputs_->legal_moves_mem_ + total);
+    inputs_outputs_->legal_temps_mem_[batch_size_] = softmax_temp;
+    total += num_moves;
+    inputs_outputs_->legal_offsets_mem_[batch_size_ + 1] = total;
+    legal_offsets_.push_back(total);
+
+    batch_size_++;
+  }
+
   // Memory holding inputs, outputs.
   std::unique_ptr<InputsOutputs> inputs_outputs_;
   int batch_size_;
   bool wdl_;
+  // Where the gathered priors of each position start. The pinned copy
+  // is write-combined, so slow to read.
+  std::vector<int> legal_offsets_;
 
   CudnnNetwork<DataType>* network_;
 };
 
 template <typename DataType>
 class CudnnNetwork : public Network {
+  // Everything one evaluation needs besides the weights: cudnn and cublas
+  // handles bound to the stream, activations and workspace.
+  struct StreamContext {
+    cudaStream_t stream;
+    cudnnHandle_t cudnn;
+    cublasHandle_t cublas;
+    // Pool memory for activations_batch positions, split into tensor_mem.
+    void* activations = nullptr;
+    int activations_batch = 0;
+    DataType* tensor_mem[3] = {};
+    void* scratch_mem = nullptr;
+    size_t scratch_size = 0;
+    // Graphs are captured with fixed pointers, so they run on the device
+    // buffers of graph_io, one graph per graph_batch_sizes_.
+    std::unique_ptr<InputsOutputs> graph_io;
+    std::vector<cudaGraphExec_t> graphs;
+  };
+
+  struct PendingEval {
+    cudaEvent_t done_event;
+    StreamContext* ctx;
+    std::function<void()> callback;
+  };
+
  public:
-  CudnnNetwork(const WeightsFile& file, const OptionsDict& options) {
+  // With @int8 the residual tower runs in int8 (cudnn-int8), the rest of the
+  // network in DataType, which must be half then.
+  CudnnNetwork(const WeightsFile& file, const OptionsDict& options,
+               bool int8 = false) {
     LegacyWeights weights(file.weights());
     gpu_id_ = options.GetOrDefault<int>("gpu", 0);
 
@@ -180,17 +468,34 @@ class CudnnNetwork : public Network {
 
     // Select GPU to run on (for *the current* thread).
     ReportCUDAErrors(cudaSetDevice(gpu_id_));
+    pool_ = DeviceMemoryPool::Get(gpu_id_);
 
-    ReportCUDNNErrors(cudnnCreate(&cudnn_));
-    ReportCUBLASErrors(cublasCreate(&cublas_));
+    const int num_streams = options.GetOrDefault<int>("streams", 1);
+    if (num_streams < 1) {
+      throw Exception("Invalid number of streams: " +
+                      std::to_string(num_streams));
+    }
 
-    if (std::is_same<half, DataType>::value) {
+    if (int8 && !std::is_same<half, DataType>::value) {
+      throw Exception("Int8 needs an fp16 network");
+    }
+    if (std::is_same<half, DataType>::value && deviceProp.major < 7) {
       // Check if the GPU support fp16 (Volta+).
-      if (deviceProp.major >= 7) {
+      throw Exception("Your GPU doesn't support FP16");
+    }
+
+    streams_.resize(num_streams);
+    for (auto& ctx : streams_) {
+      ReportCUDAErrors(
+          cudaStreamCreateWithFlags(&ctx.stream, cudaStreamNonBlocking));
+      ReportCUDNNErrors(cudnnCreate(&ctx.cudnn));
+      ReportCUDNNErrors(cudnnSetStream(ctx.cudnn, ctx.stream));
+      ReportCUBLASErrors(cublasCreate(&ctx.cublas));
+      ReportCUBLASErrors(cublasSetStream(ctx.cublas, ctx.stream));
+      if (std::is_same<half, DataType>::value) {
         // Enable Tensor cores!
-        ReportCUBLASErrors(cublasSetMathMode(cublas_, CUBLAS_TENSOR_OP_MATH));
-      } else {
-        throw Exception("Your GPU doesn't support FP16");
+        ReportCUBLASErrors(
+            cublasSetMathMode(ctx.cublas, CUBLAS_TENSOR_OP_MATH));
       }
     }
 
@@ -219,6 +524,13 @@ class CudnnNetwork : public Network {
     const int maxChannels = std::max(kInputPlanes, kNumFilters);
 
     const bool fp16 = std::is_same<half, DataType>::value;
+    // Tensor cores take NHWC fp16 channels in groups of 8, cudnn pads and
+    // transposes anything else.
+    if (fp16 && kNumFilters % 8 != 0) {
+      CERR << "WARNING: " << kNumFilters
+           << " filters are not a multiple of 8, fp16 convolutions will "
+              "need layout conversions.";
+    }
     ReportCUDNNErrors(cudnnSetFilter4dDescriptor(
         wDesc, fp16 ? CUDNN_DATA_HALF : CUDNN_DATA_FLOAT,
         fp16 ? CUDNN_TENSOR_NHWC : CUDNN_TENSOR_NCHW, maxChannels, maxChannels,
@@ -242,17 +554,23 @@ class CudnnNetwork : public Network {
     }
 
     // Query expected scratch space from cudnn.
+    size_t workspace_size;
     ReportCUDNNErrors(cudnnGetConvolutionForwardWorkspaceSize(
-        cudnn_, xDesc, wDesc, convDesc, xDesc, conv_algo, &scratch_size_));
-
-    // Have some minumum as we also use this for transforming weights.
-    const int maxWeightSize = 128 * 1024 * 1024;
-    if (scratch_size_ < maxWeightSize) scratch_size_ = maxWeightSize;
-
-    ReportCUDAErrors(cudaMalloc(&scratch_mem_, scratch_size_));
-#ifdef DEBUG_RAW_NPS
-    CERR << "allocated " << scratch_size_ << " bytes for scratch memory";
-#endif
+        streams_[0].cudnn, xDesc, wDesc, convDesc, xDesc, conv_algo,
+        &workspace_size));
+
+    // Have some minumum as the first stream's scratch is also used for
+    // transforming weights. The other streams only need room for cudnn and
+    // for the two halves the SE layer ping-pongs between.
+    const size_t maxWeightSize = 128 * 1024 * 1024;
+    const size_t seScratchSize =
+        4 * static_cast<size_t>(max_batch_size_) * kNumFilters * sizeof(float);
+    for (auto& ctx : streams_) {
+      ctx.scratch_size = std::max(
+          workspace_size, &ctx == &streams_[0] ? maxWeightSize : seScratchSize);
+      ctx.scratch_mem = pool_->Acquire(ctx.scratch_size);
+    }
+    void* scratch_mem = streams_[0].scratch_mem;
 
     // 2. Build the network, and copy the weights to GPU memory.
 
@@ -261,30 +579,26 @@ class CudnnNetwork : public Network {
       auto inputConv = std::make_unique<ConvLayer<DataType>>(
           nullptr, kNumFilters, 8, 8, 3, kNumInputPlanes, true, true);
       inputConv->LoadWeights(&weights.input.weights[0],
-                             &weights.input.biases[0], scratch_mem_);
+                             &weights.input.biases[0], scratch_mem);
       network_.emplace_back(std::move(inputConv));
     }
 
     // Residual block.
+    std::vector<ConvInt8Layer*>* int8_layers = int8 ? &int8_layers_ : nullptr;
     for (size_t block = 0; block < weights.residual.size(); block++) {
-      auto conv1 = std::make_unique<ConvLayer<DataType>>(
-          getLastLayer(), kNumFilters, 8, 8, 3, kNumFilters, true, true);
-      conv1->LoadWeights(&weights.residual[block].conv1.weights[0],
-                         &weights.residual[block].conv1.biases[0],
-                         scratch_mem_);
-      network_.emplace_back(std::move(conv1));
+      network_.emplace_back(MakeTowerConv(
+          getLastLayer(), kNumFilters, true,
+          &weights.residual[block].conv1.weights[0],
+          &weights.residual[block].conv1.biases[0], scratch_mem, int8_layers));
 
       // Relu and bias of second convolution is handled by SELayer.
       bool useReluAndBias = weights.residual[block].has_se ? false : true;
 
-      auto conv2 = std::make_unique<ConvLayer<DataType>>(
-          getLastLayer(), kNumFilters, 8, 8, 3, kNumFilters, useReluAndBias,
-          useReluAndBias);
-      conv2->LoadWeights(
+      network_.emplace_back(MakeTowerConv(
+          getLastLayer(), kNumFilters, useReluAndBias,
           &weights.residual[block].conv2.weights[0],
           useReluAndBias ? &weights.residual[block].conv2.biases[0] : nullptr,
-          scratch_mem_);
-      network_.emplace_back(std::move(conv2));
+          scratch_mem, int8_layers));
 
       if (weights.residual[block].has_se) {
         int numFCOut = weights.residual[block].se.b1.size();
@@ -294,7 +608,7 @@ class CudnnNetwork : public Network {
                         &weights.residual[block].se.b1[0],
                         &weights.residual[block].se.w2[0],
                         &weights.residual[block].se.b2[0],
-                        &weights.residual[block].conv2.biases[0], scratch_mem_);
+                        &weights.residual[block].conv2.biases[0], scratch_mem);
         network_.emplace_back(std::move(se));
       }
     }
@@ -306,7 +620,7 @@ class CudnnNetwork : public Network {
       auto conv1 = std::make_unique<ConvLayer<DataType>>(
           resi_last_, kNumFilters, 8, 8, 3, kNumFilters, true, true);
       conv1->LoadWeights(&weights.policy1.weights[0],
-                         &weights.policy1.biases[0], scratch_mem_);
+                         &weights.policy1.biases[0], scratch_mem);
       network_.emplace_back(std::move(conv1));
 
       auto pol_channels = weights.policy.biases.size();
@@ -315,12 +629,12 @@ class CudnnNetwork : public Network {
       auto conv2 = std::make_unique<ConvLayer<DataType>>(
           getLastLayer(), pol_channels, 8, 8, 3, kNumFilters, false, true);
       conv2->LoadWeights(&weights.policy.weights[0], &weights.policy.biases[0],
-                         scratch_mem_);
+                         scratch_mem);
       network_.emplace_back(std::move(conv2));
 
       auto policymap = std::make_unique<PolicyMapLayer<DataType>>(
           getLastLayer(), kNumOutputPolicy, 1, 1, 73 * 8 * 8);
-      policymap->LoadWeights(kConvPolicyMap, scratch_mem_);
+      policymap->LoadWeights(kConvPolicyMap, scratch_mem);
 
       network_.emplace_back(std::move(policymap));
 
@@ -332,13 +646,13 @@ class CudnnNetwork : public Network {
           resi_last_, weights.policy.biases.size(), 8, 8, 1, kNumFilters, true,
           true);
       convPol->LoadWeights(&weights.policy.weights[0],
-                           &weights.policy.biases[0], scratch_mem_);
+                           &weights.policy.biases[0], scratch_mem);
       network_.emplace_back(std::move(convPol));
 
       auto FCPol = std::make_unique<FCLayer<DataType>>(
           getLastLayer(), weights.ip_pol_b.size(), 1, 1, false, true);
       FCPol->LoadWeights(&weights.ip_pol_w[0], &weights.ip_pol_b[0],
-                         scratch_mem_);
+                         scratch_mem);
       network_.emplace_back(std::move(FCPol));
 
       auto softmaxPol =
@@ -353,13 +667,13 @@ class CudnnNetwork : public Network {
           resi_last_, weights.value.biases.size(), 8, 8, 1, kNumFilters, true,
           true);
       convVal->LoadWeights(&weights.value.weights[0], &weights.value.biases[0],
-                           scratch_mem_);
+                           scratch_mem);
       network_.emplace_back(std::move(convVal));
 
       auto FCVal1 = std::make_unique<FCLayer<DataType>>(
           getLastLayer(), weights.ip1_val_b.size(), 1, 1, true, true);
       FCVal1->LoadWeights(&weights.ip1_val_w[0], &weights.ip1_val_b[0],
-                          scratch_mem_);
+                          scratch_mem);
       network_.emplace_back(std::move(FCVal1));
 
       wdl_ = file.format().network_format().value() ==
@@ -370,7 +684,7 @@ class CudnnNetwork : public Network {
           getLastLayer(), weights.ip2_val_b.size(), 1, 1, false, true,
           fc2_tanh);
       FCVal2->LoadWeights(&weights.ip2_val_w[0], &weights.ip2_val_b[0],
-                          scratch_mem_);
+                          scratch_mem);
       network_.emplace_back(std::move(FCVal2));
 
       if (wdl_) {
@@ -381,42 +695,520 @@ class CudnnNetwork : public Network {
     }
     value_out_ = getLastLayer();
 
-    // 3. Allocate GPU memory for running the network:
-    //    - three buffers of max size are enough (one to hold input, second to
-    //      hold output and third to hold skip connection's input).
-    size_t maxSize = resi_last_->GetOutputSize(max_batch_size_);
-    for (auto& mem : tensor_mem_) {
-      ReportCUDAErrors(cudaMalloc(&mem, maxSize));
-      ReportCUDAErrors(cudaMemset(mem, 0, maxSize));
+    // Weights were transformed on the default stream, which the non-blocking
+    // evaluation streams don't wait for.
+    ReportCUDAErrors(cudaDeviceSynchronize());
+
+    // 3. With the weights loaded, every stream's scratch only needs to fit
+    //    an evaluation: cudnn, the SE layer and the buffers the int8
+    //    convolutions carve out of it. The activations, three buffers (input,
+    //    output and skip connection's input) per stream, come from the pool
+    //    for the batch at hand, see reserveActivations().
+    size_t evalScratchSize = std::max(workspace_size, seScratchSize);
+    for (auto layer : int8_layers_) {
+      evalScratchSize = std::max(
+          evalScratchSize,
+          layer->GetScratchSize(max_batch_size_, streams_[0].cudnn));
+    }
+    for (auto& ctx : streams_) {
+      if (ctx.scratch_size != evalScratchSize) {
+        pool_->Release(ctx.scratch_mem);
+        ctx.scratch_size = evalScratchSize;
+        ctx.scratch_mem = pool_->Acquire(ctx.scratch_size);
+      }
+      free_streams_.push_back(&ctx);
     }
 
     cudnnDestroyFilterDescriptor(wDesc);
     cudnnDestroyConvolutionDescriptor(convDesc);
     cudnnDestroyTensorDescriptor(xDesc);
 
-#ifdef DEBUG_RAW_NPS
-    CERR << "allocated " << 3 * maxSize
-         << " bytes of GPU memory to run the network";
-#endif
+    // Batch sizes to capture CUDA graphs for, see step 5.
+    const auto graph_batches =
+        options.GetOrDefault<std::string>("graph_batches", "");
+    if (!graph_batches.empty()) {
+      graph_batch_sizes_ = ParseIntList(graph_batches);
+    }
+    std::sort(graph_batch_sizes_.begin(), graph_batch_sizes_.end());
+    graph_batch_sizes_.erase(
+        std::unique(graph_batch_sizes_.begin(), graph_batch_sizes_.end()),
+        graph_batch_sizes_.end());
+    for (int size : graph_batch_sizes_) {
+      if (size < 1 || size > max_batch_size_) {
+        throw Exception("Invalid graph batch size: " + std::to_string(size));
+      }
+    }
+
+    // Int8 layers need their input scales before anything is captured.
+    if (int8) {
+      calibrate(options.GetOrDefault<int>("calibration_positions", 256));
+    }
+
+    // 4. Optionally benchmark the cudnn convolution algorithms instead of
+    //    using the fixed choice, separately for a range of batch sizes. Layers
+    //    of the same shape share the results, which are also kept per device
+    //    in the tuning cache file for later runs. With tuning_workspace (in
+    //    MB) above the scratch memory, algorithms get up to that much
+    //    workspace, and the scratch memory grows to what the chosen ones need.
+    if (options.GetOrDefault<bool>("autotune", false)) {
+      autotune(
+          options.GetOrDefault<std::string>("tuning_cache", "lc0_cudnn_tuning"),
+          static_cast<size_t>(options.GetOrDefault<int>("tuning_workspace", 0))
+              << 20);
+    }
+
+    // 5. Capture the forward pass into CUDA graphs for the requested batch
+    //    sizes, smaller batches are padded up to the next one.
+    if (!graph_batch_sizes_.empty()) {
+      for (auto& ctx : streams_) captureGraphs(&ctx);
+    }
+
+    // The first stream's scratch for weights is no longer needed.
+    pool_->Trim();
+    pool_->LogUsage();
   }
 
   void forwardEval(InputsOutputs* io, int batchSize) {
-    std::lock_guard<std::mutex> lock(lock_);
+    TRACE_SCOPE("cudnn compute");
+    StreamContext* ctx = acquireStream();
 
 #ifdef DEBUG_RAW_NPS
     auto t_start = std::chrono::high_resolution_clock::now();
 #endif
 
+    enqueue(io, batchSize, ctx);
+    ReportCUDAErrors(cudaStreamSynchronize(ctx->stream));
+    releaseStream(ctx);
+
+#ifdef DEBUG_RAW_NPS
+    // The counters are shared by all streams.
+    std::lock_guard<std::mutex> lock(streams_mutex_);
+    const int reportingCalls = 100;
+    static int numCalls = 0;
+    static int sumBatchSize = 0;
+    static double totalTime = 0;
+
+    sumBatchSize += batchSize;
+    numCalls++;
+
+    auto t_end = std::chrono::high_resolution_clock::now();
+
+    double dt = std::chrono::duration<double>(t_end - t_start).count();
+    totalTime += dt;
+    if (numCalls == reportingCalls) {
+      double avgBatchSize = ((double)sumBatchSize) / numCalls;
+      double nps = sumBatchSize / totalTime;
+      CERR << "Avg batch size: " << avgBatchSize
+           << ", NN eval time: " << totalTime << " seconds per " << sumBatchSize
+           << " evals. NPS: " << nps;
+      sumBatchSize = 0;
+      totalTime = 0;
+      numCalls = 0;
+    }
+#endif
+  }
+
+  // Enqueues the evaluation and returns without waiting for the GPU. The
+  // stream stays taken until the evaluation completes; @callback is called
+  // from the completion thread once outputs of @io are in host memory.
+  void forwardEvalAsync(InputsOutputs* io, int batchSize,
+                        std::function<void()> callback) {
+    TRACE_SCOPE("cudnn enqueue");
+    StreamContext* ctx = acquireStream();
+    enqueue(io, batchSize, ctx);
+    ReportCUDAErrors(cudaEventRecord(io->done_event_, ctx->stream));
+    std::lock_guard<std::mutex> lock(completion_mutex_);
+    if (!completion_thread_.joinable()) {
+      completion_thread_ = std::thread([this]() { completionWorker(); });
+    }
+    completion_queue_.push_back({io->done_event_, ctx, std::move(callback)});
+    completion_cv_.notify_one();
+  }
+
+  ~CudnnNetwork() {
+    {
+      std::lock_guard<std::mutex> lock(completion_mutex_);
+      completion_stop_ = true;
+    }
+    completion_cv_.notify_one();
+    if (completion_thread_.joinable()) completion_thread_.join();
+    for (auto& ctx : streams_) {
+      for (auto graph : ctx.graphs) cudaGraphExecDestroy(graph);
+      releaseActivations(&ctx);
+      pool_->Release(ctx.scratch_mem);
+      ctx.graph_io.reset();
+      cudnnDestroy(ctx.cudnn);
+      cublasDestroy(ctx.cublas);
+      cudaStreamDestroy(ctx.stream);
+    }
+    free_inputs_outputs_.clear();
+    // Networks still alive keep what they use, the rest goes back to the
+    // driver for other processes.
+    pool_->Trim();
+  }
+
+  bool GathersLegalPolicy() const override { return true; }
+
+  std::unique_ptr<NetworkComputation> NewComputation() override {
+    // Set correct gpu id for this computation (as it might have been called
+    // from a different thread).
+    ReportCUDAErrors(cudaSetDevice(gpu_id_));
+    return std::make_unique<CudnnNetworkComputation<DataType>>(this, wdl_);
+  }
+
+  std::unique_ptr<InputsOutputs> GetInputsOutputs() {
+    std::lock_guard<std::mutex> lock(inputs_outputs_lock_);
+    if (free_inputs_outputs_.empty()) {
+      return std::make_unique<InputsOutputs>(pool_, max_batch_size_, 1);
+    } else {
+      std::unique_ptr<InputsOutputs> resource =
+          std::move(free_inputs_outputs_.front());
+      free_inputs_outputs_.pop_front();
+      return resource;
+    }
+  }
+
+  void ReleaseInputsOutputs(std::unique_ptr<InputsOutputs> resource) {
+    std::lock_guard<std::mutex> lock(inputs_outputs_lock_);
+    free_inputs_outputs_.push_back(std::move(resource));
+  }
+
+  // Apparently nvcc doesn't see constructor invocations through make_unique.
+  // This function invokes constructor just to please complier and silence
+  // warning. Is never called (but compiler thinks that it could).
+  void UglyFunctionToSilenceNvccWarning() { InputsOutputs io(nullptr, 0, 0); }
+
+ private:
+  // Enqueues the evaluation of @io on @ctx: uploads the inputs, runs the
+  // network (replaying the smallest captured graph that fits the batch if
+  // there is one) and downloads the outputs, all asynchronously.
+  void enqueue(InputsOutputs* io, int batchSize, StreamContext* ctx) {
+    io->ReserveDevice(batchSize);
+    const auto iter = std::lower_bound(graph_batch_sizes_.begin(),
+                                       graph_batch_sizes_.end(), batchSize);
+    if (iter == graph_batch_sizes_.end()) {
+      uploadInputs(io, io, batchSize, ctx->stream);
+      enqueueForward(io, batchSize, ctx);
+      gatherPolicy(io, io, batchSize, ctx->stream);
+      downloadOutputs(io, io, batchSize, ctx->stream);
+      return;
+    }
+    // Rows past @batchSize keep whatever the previous batch left there.
+    InputsOutputs* graph_io = ctx->graph_io.get();
+    uploadInputs(io, graph_io, batchSize, ctx->stream);
+    ReportCUDAErrors(cudaGraphLaunch(
+        ctx->graphs[iter - graph_batch_sizes_.begin()], ctx->stream));
+    gatherPolicy(graph_io, io, batchSize, ctx->stream);
+    downloadOutputs(graph_io, io, batchSize, ctx->stream);
+  }
+
+  // Copies the packed inputs from the host buffers of @src to the device
+  // buffers of @dst.
+  void uploadInputs(const InputsOutputs* src, InputsOutputs* dst,
+                    int batchSize, cudaStream_t stream) const {
+    ReportCUDAErrors(cudaMemcpyAsync(
+        dst->input_masks_mem_gpu_, src->input_masks_mem_,
+        batchSize * kInputPlanes * sizeof(uint64_t), cudaMemcpyHostToDevice,
+        stream));
+    ReportCUDAErrors(cudaMemcpyAsync(
+        dst->input_val_mem_gpu_, src->input_val_mem_,
+        batchSize * kInputPlanes * sizeof(float), cudaMemcpyHostToDevice,
+        stream));
+  }
+
+  // Picks the priors of the moves of @io from the policy computed in @src,
+  // on the device buffers of @io. As this runs outside of the captured
+  // graphs, @io's buffers can be used even when @src is a graph's.
+  void gatherPolicy(const InputsOutputs* src, InputsOutputs* io,
+                    int batchSize, cudaStream_t stream) const {
+    if (io->num_legal_moves_ == 0) return;
+    ReportCUDAErrors(cudaMemcpyAsync(
+        io->legal_moves_mem_gpu_, io->legal_moves_mem_,
+        io->num_legal_moves_ * sizeof(uint16_t), cudaMemcpyHostToDevice,
+        stream));
+    ReportCUDAErrors(cudaMemcpyAsync(
+        io->legal_offsets_mem_gpu_, io->legal_offsets_mem_,
+        (batchSize + 1) * sizeof(int), cudaMemcpyHostToDevice, stream));
+    ReportCUDAErrors(cudaMemcpyAsync(
+        io->legal_temps_mem_gpu_, io->legal_temps_mem_,
+        batchSize * sizeof(float), cudaMemcpyHostToDevice, stream));
+    gatherLegalPolicy(io->op_legal_policy_mem_gpu_, src->op_policy_mem_gpu_,
+                      io->legal_moves_mem_gpu_, io->legal_offsets_mem_gpu_,
+                      io->legal_temps_mem_gpu_, batchSize, kNumOutputPolicy,
+                      stream);
+  }
+
+  // Copies the outputs from the device buffers of @src to the host buffers
+  // of @dst, the whole policy only if a position of @dst needs it. Gathered
+  // priors are always in the device buffers of @dst.
+  void downloadOutputs(const InputsOutputs* src, InputsOutputs* dst,
+                       int batchSize, cudaStream_t stream) const {
+    if (dst->full_policy_) {
+      ReportCUDAErrors(cudaMemcpyAsync(
+          dst->op_policy_mem_, src->op_policy_mem_gpu_,
+          batchSize * kNumOutputPolicy * sizeof(float), cudaMemcpyDeviceToHost,
+          stream));
+    }
+    if (dst->num_legal_moves_ > 0) {
+      ReportCUDAErrors(cudaMemcpyAsync(
+          dst->op_legal_policy_mem_, dst->op_legal_policy_mem_gpu_,
+          dst->num_legal_moves_ * sizeof(float), cudaMemcpyDeviceToHost,
+          stream));
+    }
+    ReportCUDAErrors(cudaMemcpyAsync(
+        dst->op_value_mem_, src->op_value_mem_gpu_,
+        batchSize * (wdl_ ? 3 : 1) * sizeof(float), cudaMemcpyDeviceToHost,
+        stream));
+  }
+
+  // Runs positions from pseudo-random games, the same ones every time,
+  // through the network while the int8 layers still run in fp16, so that
+  // they can pick their input scales.
+  void calibrate(int num_positions) {
+    std::mt19937 rng(0);
+    auto io = GetInputsOutputs();
+    StreamContext* ctx = &streams_[0];
+    const ChessBoard startpos(ChessBoard::kStartposFen);
+    PositionHistory history;
+    history.Reset(startpos, 0, 0);
+    int batch_size = 0;
+    for (int i = 0; i < num_positions; i++) {
+      const auto moves = history.Last().GetBoard().GenerateLegalMoves();
+      if (moves.empty() ||
+          history.ComputeGameResult() != GameResult::UNDECIDED) {
+        history.Reset(startpos, 0, 0);
+      } else {
+        history.Append(moves[rng() % moves.size()]);
+      }
+      int plane = batch_size * kInputPlanes;
+      for (const auto& input :
+           EncodePositionForNN(history, 8, FillEmptyHistory::FEN_ONLY)) {
+        io->input_masks_mem_[plane] = input.mask;
+        io->input_val_mem_[plane] = input.value;
+        plane++;
+      }
+      if (++batch_size == max_batch_size_ || i + 1 == num_positions) {
+        io->ReserveDevice(batch_size);
+        uploadInputs(io.get(), io.get(), batch_size, ctx->stream);
+        enqueueForward(io.get(), batch_size, ctx);
+        ReportCUDAErrors(cudaStreamSynchronize(ctx->stream));
+        batch_size = 0;
+      }
+    }
+    ReleaseInputsOutputs(std::move(io));
+    releaseActivations(ctx);
+    for (auto layer : int8_layers_) layer->FinishCalibration();
+  }
+
+  // Each line of the tuning cache is "<key> = <algo> <algo> ...", with an
+  // algorithm per tuned batch size.
+  using TuningCache = std::map<std::string, std::vector<int>>;
+
+  static TuningCache loadTuningCache(const std::string& path) {
+    TuningCache cache;
+    std::ifstream file(path);
+    std::string line;
+    while (std::getline(file, line)) {
+      const auto pos = line.rfind(" = ");
+      if (pos == std::string::npos) continue;
+      std::istringstream algos(line.substr(pos + 3));
+      auto& entry = cache[line.substr(0, pos)];
+      int algo;
+      while (algos >> algo) entry.push_back(algo);
+    }
+    return cache;
+  }
+
+  static void saveTuningCache(const std::string& path,
+                              const TuningCache& cache) {
+    std::ofstream file(path);
+    for (const auto& entry : cache) {
+      file << entry.first << " =";
+      for (int algo : entry.second) file << " " << algo;
+      file << std::endl;
+    }
+    if (file.fail()) CERR << "Could not save the tuning cache to " << path;
+  }
+
+  void autotune(const std::string& cache_path, size_t workspace_limit) {
+    // Powers of two, the graph batch sizes and the maximum, so that every
+    // batch has a tuned size not far above it. Graphs bake in the algorithm
+    // of their exact size.
+    std::vector<int> sizes = graph_batch_sizes_;
+    for (int size = 1; size < max_batch_size_; size *= 2) sizes.push_back(size);
+    sizes.push_back(max_batch_size_);
+    std::sort(sizes.begin(), sizes.end());
+    sizes.erase(std::unique(sizes.begin(), sizes.end()), sizes.end());
+
+    // Every stream has to fit the chosen algorithm's workspace, unless the
+    // scratch memory is to grow for it.
+    size_t scratch_size = streams_[0].scratch_size;
+    for (const auto& ctx : streams_) {
+      scratch_size = std::min(scratch_size, ctx.scratch_size);
+    }
+    void* tuning_scratch = streams_[0].scratch_mem;
+    if (workspace_limit > scratch_size) {
+      scratch_size = workspace_limit;
+      tuning_scratch = pool_->Acquire(scratch_size);
+    }
+
+    // Results only carry over to the same device, cudnn version, workspace
+    // limit and batch sizes.
+    cudaDeviceProp deviceProp = {};
+    cudaGetDeviceProperties(&deviceProp, gpu_id_);
+    std::string prefix = std::string(deviceProp.name) + "|cudnn " +
+                         std::to_string(cudnnGetVersion()) + "|scratch " +
+                         std::to_string(scratch_size) + "|batches";
+    for (int size : sizes) prefix += " " + std::to_string(size);
+    TuningCache cache;
+    if (!cache_path.empty()) cache = loadTuningCache(cache_path);
+    bool cache_changed = false;
+
+    StreamContext& ctx = streams_[0];
+    reserveActivations(&ctx, max_batch_size_);
+    std::vector<ConvLayer<DataType>*> tuned;
+    for (auto& layer : network_) {
+      auto conv = dynamic_cast<ConvLayer<DataType>*>(layer.get());
+      if (!conv) continue;
+      const auto same_shape =
+          std::find_if(tuned.begin(), tuned.end(), [conv](const auto* other) {
+            return conv->HasSameShape(*other);
+          });
+      if (same_shape != tuned.end()) {
+        conv->CopyTuning(**same_shape);
+        continue;
+      }
+      tuned.push_back(conv);
+
+      const std::string key = prefix + "|" + conv->TuningKey();
+      const auto cached = cache.find(key);
+      // Layers which can't be tuned are stored with no algorithms.
+      if (cached != cache.end() && (cached->second.empty() ||
+                                    cached->second.size() == sizes.size())) {
+        std::vector<std::pair<int, cudnnConvolutionFwdAlgo_t>> tuning;
+        for (size_t i = 0; i < cached->second.size(); i++) {
+          tuning.emplace_back(sizes[i], static_cast<cudnnConvolutionFwdAlgo_t>(
+                                            cached->second[i]));
+        }
+        conv->SetTuning(tuning);
+        continue;
+      }
+      conv->Autotune(sizes, ctx.tensor_mem[0], ctx.tensor_mem[1],
+                     tuning_scratch, scratch_size, ctx.cudnn);
+      auto& entry = cache[key];
+      entry.clear();
+      for (const auto& tuning : conv->GetTuning()) {
+        entry.push_back(tuning.second);
+      }
+      cache_changed = true;
+    }
+    ReportCUDAErrors(cudaStreamSynchronize(ctx.stream));
+    releaseActivations(&ctx);
+    if (cache_changed && !cache_path.empty()) {
+      saveTuningCache(cache_path, cache);
+    }
+    if (tuning_scratch == ctx.scratch_mem) return;
+
+    pool_->Release(tuning_scratch);
+    size_t workspace_size = 0;
+    for (auto conv : tuned) {
+      workspace_size =
+          std::max(workspace_size, conv->GetTunedWorkspaceSize(ctx.cudnn));
+    }
+    for (auto& stream : streams_) {
+      if (stream.scratch_size >= workspace_size) continue;
+      pool_->Release(stream.scratch_mem);
+      stream.scratch_size = workspace_size;
+      stream.scratch_mem = pool_->Acquire(stream.scratch_size);
+    }
+    CERR << "Tuned convolutions take " << (workspace_size >> 20)
+         << " MB of workspace.";
+  }
+
+  // Graphs keep the pointers they were captured with, so their stream keeps
+  // activations for the largest batch for good.
+  void captureGraphs(StreamContext* ctx) {
+    reserveActivations(ctx, max_batch_size_);
+    for (auto mem : ctx->tensor_mem) {
+      ReportCUDAErrors(cudaMemsetAsync(
+          mem, 0, resi_last_->GetOutputSize(max_batch_size_), ctx->stream));
+    }
+    ctx->graph_io = std::make_unique<InputsOutputs>(pool_, max_batch_size_,
+                                                    max_batch_size_);
+    ReportCUDAErrors(cudaMemsetAsync(
+        ctx->graph_io->input_masks_mem_gpu_, 0,
+        max_batch_size_ * kInputPlanes * sizeof(uint64_t), ctx->stream));
+    ReportCUDAErrors(cudaMemsetAsync(
+        ctx->graph_io->input_val_mem_gpu_, 0,
+        max_batch_size_ * kInputPlanes * sizeof(float), ctx->stream));
+    // One eager run first, so that cudnn and cublas do their lazy setup
+    // outside of the capture.
+    enqueueForward(ctx->graph_io.get(), graph_batch_sizes_.back(), ctx);
+    ReportCUDAErrors(cudaStreamSynchronize(ctx->stream));
+    for (int size : graph_batch_sizes_) {
+      cudaGraph_t graph;
+#if CUDART_VERSION >= 10010
+      ReportCUDAErrors(cudaStreamBeginCapture(
+          ctx->stream, cudaStreamCaptureModeThreadLocal));
+#else
+      ReportCUDAErrors(cudaStreamBeginCapture(ctx->stream));
+#endif
+      enqueueForward(ctx->graph_io.get(), size, ctx);
+      ReportCUDAErrors(cudaStreamEndCapture(ctx->stream, &graph));
+      cudaGraphExec_t exec;
+      ReportCUDAErrors(cudaGraphInstantiate(&exec, graph, nullptr, nullptr, 0));
+      ReportCUDAErrors(cudaGraphDestroy(graph));
+      ctx->graphs.push_back(exec);
+    }
+  }
+
+  // Points the activations of @ctx at pool memory for @batchSize positions,
+  // rounded up to a power of two so that they seldom grow.
+  void reserveActivations(StreamContext* ctx, int batchSize) {
+    if (batchSize <= ctx->activations_batch) return;
+    releaseActivations(ctx);
+    int size = 1;
+    while (size < batchSize) size *= 2;
+    ctx->activations_batch = std::min(size, max_batch_size_);
+    // Each tensor aligned as cudaMalloc would.
+    const size_t tensor_size =
+        (resi_last_->GetOutputSize(ctx->activations_batch) + 255) &
+        ~size_t{255};
+    ctx->activations = pool_->Acquire(3 * tensor_size);
+    for (int i = 0; i < 3; i++) {
+      ctx->tensor_mem[i] = reinterpret_cast<DataType*>(
+          static_cast<char*>(ctx->activations) + i * tensor_size);
+    }
+  }
+
+  // Only once the work using them is done.
+  void releaseActivations(StreamContext* ctx) {
+    pool_->Release(ctx->activations);
+    ctx->activations = nullptr;
+    ctx->activations_batch = 0;
+    for (auto& mem : ctx->tensor_mem) mem = nullptr;
+  }
+
+  // Runs the network on the device buffers of @io.
+  void enqueueForward(InputsOutputs* io, int batchSize, StreamContext* ctx) {
+    reserveActivations(ctx, batchSize);
+    DataType** tensor_mem = ctx->tensor_mem;
+    void* scratch_mem = ctx->scratch_mem;
+    const size_t scratch_size = ctx->scratch_size;
+    cudnnHandle_t cudnn = ctx->cudnn;
+    cublasHandle_t cublas = ctx->cublas;
+    cudaStream_t stream = ctx->stream;
+
     // Expand packed planes to full planes.
     uint64_t* ipDataMasks = io->input_masks_mem_gpu_;
     float* ipDataValues = io->input_val_mem_gpu_;
 
     if (std::is_same<half, DataType>::value) {
-      expandPlanes_Fp16_NHWC((half*)(tensor_mem_[0]), ipDataMasks, ipDataValues,
-                             batchSize * kInputPlanes);
+      expandPlanes_Fp16_NHWC((half*)(tensor_mem[0]), ipDataMasks, ipDataValues,
+                             batchSize * kInputPlanes, stream);
     } else {
-      expandPlanes_Fp32_NCHW((float*)(tensor_mem_[0]), ipDataMasks,
-                             ipDataValues, batchSize * kInputPlanes);
+      expandPlanes_Fp32_NCHW((float*)(tensor_mem[0]), ipDataMasks,
+                             ipDataValues, batchSize * kInputPlanes, stream);
     }
 
     float* opPol = io->op_policy_mem_gpu_;
@@ -424,220 +1216,204 @@ class CudnnNetwork : public Network {
 
     int l = 0;
     // Input.
-    network_[l++]->Eval(batchSize, tensor_mem_[2], tensor_mem_[0], nullptr,
-                        scratch_mem_, scratch_size_, cudnn_,
-                        cublas_);  // input conv
+    network_[l++]->Eval(batchSize, tensor_mem[2], tensor_mem[0], nullptr,
+                        scratch_mem, scratch_size, cudnn, cublas,
+                        stream);  // input conv
 
     // Residual block.
     for (int block = 0; block < numBlocks_; block++) {
-      network_[l++]->Eval(batchSize, tensor_mem_[0], tensor_mem_[2], nullptr,
-                          scratch_mem_, scratch_size_, cudnn_,
-                          cublas_);  // conv1
+      network_[l++]->Eval(batchSize, tensor_mem[0], tensor_mem[2], nullptr,
+                          scratch_mem, scratch_size, cudnn, cublas,
+                          stream);  // conv1
 
       // For SE Resnet, skip connection is added after SE (and bias is added as
       // part of SE).
       if (has_se_) {
-        network_[l++]->Eval(batchSize, tensor_mem_[1], tensor_mem_[0], nullptr,
-                            scratch_mem_, scratch_size_, cudnn_,
-                            cublas_);  // conv2
+        network_[l++]->Eval(batchSize, tensor_mem[1], tensor_mem[0], nullptr,
+                            scratch_mem, scratch_size, cudnn, cublas,
+                            stream);  // conv2
       } else {
-        network_[l++]->Eval(batchSize, tensor_mem_[2], tensor_mem_[0],
-                            tensor_mem_[2], scratch_mem_, scratch_size_, cudnn_,
-                            cublas_);  // conv2
+        network_[l++]->Eval(batchSize, tensor_mem[2], tensor_mem[0],
+                            tensor_mem[2], scratch_mem, scratch_size, cudnn,
+                            cublas, stream);  // conv2
       }
 
       if (has_se_) {
-        network_[l++]->Eval(batchSize, tensor_mem_[2], tensor_mem_[1],
-                            tensor_mem_[2], scratch_mem_, scratch_size_, cudnn_,
-                            cublas_);  // SE layer
+        network_[l++]->Eval(batchSize, tensor_mem[2], tensor_mem[1],
+                            tensor_mem[2], scratch_mem, scratch_size, cudnn,
+                            cublas, stream);  // SE layer
       }
     }
 
     // Policy head.
     if (conv_policy_) {
-      network_[l++]->Eval(batchSize, tensor_mem_[0], tensor_mem_[2], nullptr,
-                          scratch_mem_, scratch_size_, cudnn_,
-                          cublas_);  // conv1
+      network_[l++]->Eval(batchSize, tensor_mem[0], tensor_mem[2], nullptr,
+                          scratch_mem, scratch_size, cudnn, cublas,
+                          stream);  // conv1
 
-      network_[l++]->Eval(batchSize, tensor_mem_[1], tensor_mem_[0], nullptr,
-                          scratch_mem_, scratch_size_, cudnn_,
-                          cublas_);  // conv1
+      network_[l++]->Eval(batchSize, tensor_mem[1], tensor_mem[0], nullptr,
+                          scratch_mem, scratch_size, cudnn, cublas,
+                          stream);  // conv1
 
-      network_[l++]->Eval(batchSize, tensor_mem_[0], tensor_mem_[1], nullptr,
-                          scratch_mem_, scratch_size_, cudnn_,
-                          cublas_);  // pol FC
+      network_[l++]->Eval(batchSize, tensor_mem[0], tensor_mem[1], nullptr,
+                          scratch_mem, scratch_size, cudnn, cublas,
+                          stream);  // pol FC
       if (std::is_same<half, DataType>::value) {
         // TODO: consider softmax layer that writes directly to fp32
-        network_[l++]->Eval(batchSize, tensor_mem_[1], tensor_mem_[0], nullptr,
-                            scratch_mem_, scratch_size_, cudnn_,
-                            cublas_);  // pol softmax
-        copyTypeConverted(opPol, (half*)(tensor_mem_[1]),
-                          batchSize * kNumOutputPolicy);  // POLICY
+        network_[l++]->Eval(batchSize, tensor_mem[1], tensor_mem[0], nullptr,
+                            scratch_mem, scratch_size, cudnn, cublas,
+                            stream);  // pol softmax
+        copyTypeConverted(opPol, (half*)(tensor_mem[1]),
+                          batchSize * kNumOutputPolicy, stream);  // POLICY
       } else {
-        network_[l++]->Eval(batchSize, (DataType*)opPol, tensor_mem_[0],
-                            nullptr, scratch_mem_, scratch_size_, cudnn_,
-                            cublas_);  // pol softmax  // POLICY
+        network_[l++]->Eval(batchSize, (DataType*)opPol, tensor_mem[0],
+                            nullptr, scratch_mem, scratch_size, cudnn,
+                            cublas, stream);  // pol softmax  // POLICY
       }
     } else {
-      network_[l++]->Eval(batchSize, tensor_mem_[0], tensor_mem_[2], nullptr,
-                          scratch_mem_, scratch_size_, cudnn_,
-                          cublas_);  // pol conv
-      network_[l++]->Eval(batchSize, tensor_mem_[1], tensor_mem_[0], nullptr,
-                          scratch_mem_, scratch_size_, cudnn_,
-                          cublas_);  // pol FC
+      network_[l++]->Eval(batchSize, tensor_mem[0], tensor_mem[2], nullptr,
+                          scratch_mem, scratch_size, cudnn, cublas,
+                          stream);  // pol conv
+      network_[l++]->Eval(batchSize, tensor_mem[1], tensor_mem[0], nullptr,
+                          scratch_mem, scratch_size, cudnn, cublas,
+                          stream);  // pol FC
       if (std::is_same<half, DataType>::value) {
         // TODO: consider softmax layer that writes directly to fp32.
-        network_[l++]->Eval(batchSize, tensor_mem_[0], tensor_mem_[1], nullptr,
-                            scratch_mem_, scratch_size_, cudnn_,
-                            cublas_);  // pol softmax
-        copyTypeConverted(opPol, (half*)(tensor_mem_[0]),
-                          batchSize * kNumOutputPolicy);  // POLICY
+        network_[l++]->Eval(batchSize, tensor_mem[0], tensor_mem[1], nullptr,
+                            scratch_mem, scratch_size, cudnn, cublas,
+                            stream);  // pol softmax
+        copyTypeConverted(opPol, (half*)(tensor_mem[0]),
+                          batchSize * kNumOutputPolicy, stream);  // POLICY
       } else {
-        network_[l++]->Eval(batchSize, (DataType*)opPol, tensor_mem_[1],
-                            nullptr, scratch_mem_, scratch_size_, cudnn_,
-                            cublas_);  // pol softmax  // POLICY
+        network_[l++]->Eval(batchSize, (DataType*)opPol, tensor_mem[1],
+                            nullptr, scratch_mem, scratch_size, cudnn,
+                            cublas, stream);  // pol softmax  // POLICY
       }
     }
 
-    // Copy policy output from device memory to host memory.
-    ReportCUDAErrors(cudaMemcpyAsync(
-        io->op_policy_mem_, io->op_policy_mem_gpu_,
-        sizeof(float) * kNumOutputPolicy * batchSize, cudaMemcpyDeviceToHost));
-
     // value head
-    network_[l++]->Eval(batchSize, tensor_mem_[0], tensor_mem_[2], nullptr,
-                        scratch_mem_, scratch_size_, cudnn_,
-                        cublas_);  // value conv
+    network_[l++]->Eval(batchSize, tensor_mem[0], tensor_mem[2], nullptr,
+                        scratch_mem, scratch_size, cudnn, cublas,
+                        stream);  // value conv
 
-    network_[l++]->Eval(batchSize, tensor_mem_[1], tensor_mem_[0], nullptr,
-                        scratch_mem_, scratch_size_, cudnn_,
-                        cublas_);  // value FC1
+    network_[l++]->Eval(batchSize, tensor_mem[1], tensor_mem[0], nullptr,
+                        scratch_mem, scratch_size, cudnn, cublas,
+                        stream);  // value FC1
 
     if (wdl_) {
-      network_[l++]->Eval(batchSize, tensor_mem_[2], tensor_mem_[1], nullptr,
-                          scratch_mem_, scratch_size_, cudnn_,
-                          cublas_);  // value FC2    // VALUE
+      network_[l++]->Eval(batchSize, tensor_mem[2], tensor_mem[1], nullptr,
+                          scratch_mem, scratch_size, cudnn, cublas,
+                          stream);  // value FC2    // VALUE
 
       // Value softmax
       if (std::is_same<half, DataType>::value) {
         // TODO: consider fusing the bias-add of FC2 with format conversion.
-        network_[l++]->Eval(batchSize, tensor_mem_[0], tensor_mem_[2], nullptr,
-                            scratch_mem_, scratch_size_, cudnn_,
-                            cublas_);  // value FC2
-        copyTypeConverted(opVal, (half*)(tensor_mem_[0]),
-                          3 * batchSize);  // VALUE
+        network_[l++]->Eval(batchSize, tensor_mem[0], tensor_mem[2], nullptr,
+                            scratch_mem, scratch_size, cudnn, cublas,
+                            stream);  // value FC2
+        copyTypeConverted(opVal, (half*)(tensor_mem[0]),
+                          3 * batchSize, stream);  // VALUE
       } else {
-        network_[l++]->Eval(batchSize, (DataType*)opVal, tensor_mem_[2],
-                            nullptr, scratch_mem_, scratch_size_, cudnn_,
-                            cublas_);  // value FC2    // VALUE
+        network_[l++]->Eval(batchSize, (DataType*)opVal, tensor_mem[2],
+                            nullptr, scratch_mem, scratch_size, cudnn,
+                            cublas, stream);  // value FC2    // VALUE
       }
     } else {
       if (std::is_same<half, DataType>::value) {
         // TODO: consider fusing the bias-add of FC2 with format conversion.
-        network_[l++]->Eval(batchSize, tensor_mem_[2], tensor_mem_[1], nullptr,
-                            scratch_mem_, scratch_size_, cudnn_,
-                            cublas_);  // value FC2
-        copyTypeConverted(opVal, (half*)(tensor_mem_[2]), batchSize);  // VALUE
+        network_[l++]->Eval(batchSize, tensor_mem[2], tensor_mem[1], nullptr,
+                            scratch_mem, scratch_size, cudnn, cublas,
+                            stream);  // value FC2
+        copyTypeConverted(opVal, (half*)(tensor_mem[2]), batchSize,
+                          stream);  // VALUE
       } else {
-        network_[l++]->Eval(batchSize, (DataType*)opVal, tensor_mem_[1],
-                            nullptr, scratch_mem_, scratch_size_, cudnn_,
-                            cublas_);  // value FC2    // VALUE
+        network_[l++]->Eval(batchSize, (DataType*)opVal, tensor_mem[1],
+                            nullptr, scratch_mem, scratch_size, cudnn,
+                            cublas, stream);  // value FC2    // VALUE
       }
     }
-    ReportCUDAErrors(cudaDeviceSynchronize());
-
-#ifdef DEBUG_RAW_NPS
-    const int reportingCalls = 100;
-    static int numCalls = 0;
-    static int sumBatchSize = 0;
-    static double totalTime = 0;
-
-    sumBatchSize += batchSize;
-    numCalls++;
-
-    auto t_end = std::chrono::high_resolution_clock::now();
-
-    double dt = std::chrono::duration<double>(t_end - t_start).count();
-    totalTime += dt;
-    if (numCalls == reportingCalls) {
-      double avgBatchSize = ((double)sumBatchSize) / numCalls;
-      double nps = sumBatchSize / totalTime;
-      CERR << "Avg batch size: " << avgBatchSize
-           << ", NN eval time: " << totalTime << " seconds per " << sumBatchSize
-           << " evals. NPS: " << nps;
-      sumBatchSize = 0;
-      totalTime = 0;
-      numCalls = 0;
-    }
-#endif
   }
 
-  ~CudnnNetwork() {
-    for (auto mem : tensor_mem_) {
-      if (mem) ReportCUDAErrors(cudaFree(mem));
+  // Waits for asynchronous evaluations in the order they were enqueued, hands
+  // their streams back and fires their callbacks. With several streams a later
+  // evaluation may finish first, its callback then just waits for its turn.
+  void completionWorker() {
+    ReportCUDAErrors(cudaSetDevice(gpu_id_));
+    while (true) {
+      PendingEval item;
+      {
+        std::unique_lock<std::mutex> lock(completion_mutex_);
+        completion_cv_.wait(lock, [this]() {
+          return completion_stop_ || !completion_queue_.empty();
+        });
+        if (completion_queue_.empty()) return;
+        item = std::move(completion_queue_.front());
+        completion_queue_.pop_front();
+      }
+      {
+        TRACE_SCOPE("cudnn async wait");
+        ReportCUDAErrors(cudaEventSynchronize(item.done_event));
+      }
+      releaseStream(item.ctx);
+      item.callback();
     }
-    if (scratch_mem_) ReportCUDAErrors(cudaFree(scratch_mem_));
-    cudnnDestroy(cudnn_);
-    cublasDestroy(cublas_);
   }
 
-  std::unique_ptr<NetworkComputation> NewComputation() override {
-    // Set correct gpu id for this computation (as it might have been called
-    // from a different thread).
-    ReportCUDAErrors(cudaSetDevice(gpu_id_));
-    return std::make_unique<CudnnNetworkComputation<DataType>>(this, wdl_);
+  // Blocks until one of the streams is free and takes it.
+  StreamContext* acquireStream() {
+    std::unique_lock<std::mutex> lock(streams_mutex_);
+    streams_cv_.wait(lock, [this]() { return !free_streams_.empty(); });
+    StreamContext* ctx = free_streams_.back();
+    free_streams_.pop_back();
+    return ctx;
   }
 
-  std::unique_ptr<InputsOutputs> GetInputsOutputs() {
-    std::lock_guard<std::mutex> lock(inputs_outputs_lock_);
-    if (free_inputs_outputs_.empty()) {
-      return std::make_unique<InputsOutputs>(max_batch_size_);
-    } else {
-      std::unique_ptr<InputsOutputs> resource =
-          std::move(free_inputs_outputs_.front());
-      free_inputs_outputs_.pop_front();
-      return resource;
+  // Called once the stream's work is done. Without graphs its activations go
+  // back to the pool, for the other streams and networks.
+  void releaseStream(StreamContext* ctx) {
+    if (graph_batch_sizes_.empty()) releaseActivations(ctx);
+    {
+      std::lock_guard<std::mutex> lock(streams_mutex_);
+      free_streams_.push_back(ctx);
     }
+    streams_cv_.notify_one();
   }
 
-  void ReleaseInputsOutputs(std::unique_ptr<InputsOutputs> resource) {
-    std::lock_guard<std::mutex> lock(inputs_outputs_lock_);
-    free_inputs_outputs_.push_back(std::move(resource));
-  }
-
-  // Apparently nvcc doesn't see constructor invocations through make_unique.
-  // This function invokes constructor just to please complier and silence
-  // warning. Is never called (but compiler thinks that it could).
-  void UglyFunctionToSilenceNvccWarning() { InputsOutputs io(0); }
-
- private:
-  cudnnHandle_t cudnn_;
-  cublasHandle_t cublas_;
   int gpu_id_;
+  DeviceMemoryPool* pool_;
   int max_batch_size_;
   bool wdl_;
 
-  // Currently only one NN Eval can happen a time (we can fix this if needed
-  // by allocating more memory).
-  mutable std::mutex lock_;
+  // Evaluations on different streams run concurrently, one evaluation per
+  // stream at a time.
+  std::vector<StreamContext> streams_;
+  std::vector<StreamContext*> free_streams_;
+  std::mutex streams_mutex_;
+  std::condition_variable streams_cv_;
+  // Batch sizes with a captured graph, ascending.
+  std::vector<int> graph_batch_sizes_;
 
   int numBlocks_;
   bool has_se_;
   bool conv_policy_;
   std::vector<std::unique_ptr<BaseLayer<DataType>>> network_;
+  // Int8 layers among network_, all calibrated together.
+  std::vector<ConvInt8Layer*> int8_layers_;
   BaseLayer<DataType>* getLastLayer() { return network_.back().get(); }
 
   BaseLayer<DataType>* resi_last_;
   BaseLayer<DataType>* policy_out_;
   BaseLayer<DataType>* value_out_;
 
-  DataType* tensor_mem_[3];
-  void* scratch_mem_;
-  size_t scratch_size_;
-
   mutable std::mutex inputs_outputs_lock_;
   std::list<std::unique_ptr<InputsOutputs>> free_inputs_outputs_;
 
+  std::mutex completion_mutex_;
+  std::condition_variable completion_cv_;
+  std::deque<PendingEval> completion_queue_;
+  bool completion_stop_ = false;
+  std::thread completion_thread_;
+
   void showInfo(const cudaDeviceProp& deviceProp) const {
     CERR << "GPU: " << deviceProp.name;
     CERR << "GPU memory: " << deviceProp.totalGlobalMem / std::pow(2.0f, 30)
@@ -695,6 +1471,10 @@ CudnnNetworkComputation<DataType>::CudnnNetworkComputation(
     : wdl_(wdl), network_(network) {
   batch_size_ = 0;
   inputs_outputs_ = network_->GetInputsOutputs();
+  inputs_outputs_->num_legal_moves_ = 0;
+  inputs_outputs_->full_policy_ = false;
+  inputs_outputs_->legal_offsets_mem_[0] = 0;
+  legal_offsets_.push_back(0);
 }
 
 template <typename DataType>
@@ -707,9 +1487,17 @@ void CudnnNetworkComputation<DataType>::ComputeBlocking() {
   network_->forwardEval(inputs_outputs_.get(), GetBatchSize());
 }
 
+template <typename DataType>
+void CudnnNetworkComputation<DataType>::ComputeAsync(
+    std::function<void()> callback) {
+  network_->forwardEvalAsync(inputs_outputs_.get(), GetBatchSize(),
+                             std::move(callback));
+}
+
 template <typename DataType>
 std::unique_ptr<Network> MakeCudnnNetwork(const WeightsFile& weights,
-                                          const OptionsDict& options) {
+                                          const OptionsDict& options,
+                                          bool int8 = false) {
   if (weights.format().network_format().network() !=
           pblczero::NetworkFormat::NETWORK_CLASSICAL_WITH_HEADFORMAT &&
       weights.format().network_format().network() !=
@@ -735,10 +1523,16 @@ std::unique_ptr<Network> MakeCudnnNetwork(const WeightsFile& weights,
                     std::to_string(weights.format().network_format().value()) +
                     " is not supported by CuDNN backend.");
   }
-  return std::make_unique<CudnnNetwork<DataType>>(weights, options);
+  return std::make_unique<CudnnNetwork<DataType>>(weights, options, int8);
+}
+
+std::unique_ptr<Network> MakeCudnnInt8Network(const WeightsFile& weights,
+                                              const OptionsDict& options) {
+  return MakeCudnnNetwork<half>(weights, options, true);
 }
 
 REGISTER_NETWORK("cudnn", MakeCudnnNetwork<float>, 110)
 REGISTER_NETWORK("cudnn-fp16", MakeCudnnNetwork<half>, 105)
+REGISTER_NETWORK("cudnn-int8", MakeCudnnInt8Network, 95)
 
 }  // namespace lczero
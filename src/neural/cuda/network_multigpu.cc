@@ -0,0 +1,333 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2019 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+
+  If you modify this Program, or any covered work, by linking or
+  combining it with NVIDIA Corporation's libraries from the NVIDIA CUDA
+  Toolkit and the NVIDIA CUDA Deep Neural Network library (or a
+  modified version of those libraries), containing parts covered by the
+  terms of the respective license agreement, the licensors of this
+  Program grant you additional permission to convey the resulting work.
+*/
+
+#include <cuda_runtime.h>
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <condition_variable>
+#include <fstream>
+#include <queue>
+#include <thread>
+#include "neural/factory.h"
+#include "utils/affinity.h"
+#include "utils/exception.h"
+#include "utils/logging.h"
+#include "utils/trace.h"
+
+namespace lczero {
+namespace {
+
+// CPUs of the NUMA node the GPU is attached to, empty if unknown.
+std::vector<int> GetGpuCpus(int gpu_id) {
+  std::vector<int> cpus;
+#ifdef __linux__
+  char bus_id[32];
+  if (cudaDeviceGetPCIBusId(bus_id, sizeof(bus_id), gpu_id) != cudaSuccess) {
+    return cpus;
+  }
+  // Sysfs spells the bus id in lower case.
+  std::string pci(bus_id);
+  std::transform(pci.begin(), pci.end(), pci.begin(),
+                 [](unsigned char c) { return std::tolower(c); });
+  int node = -1;
+  std::ifstream("/sys/bus/pci/devices/" + pci + "/numa_node") >> node;
+  if (node < 0) return cpus;
+
+  std::string cpulist;
+  std::ifstream("/sys/devices/system/node/node" + std::to_string(node) +
+                "/cpulist") >>
+      cpulist;
+  cpus = ParseCpuList(cpulist);
+#else
+  (void)gpu_id;
+#endif
+  return cpus;
+}
+
+class MultiGpuNetwork;
+
+class MultiGpuComputation : public NetworkComputation {
+ public:
+  MultiGpuComputation(MultiGpuNetwork* network) : network_(network) {}
+
+  void AddInput(InputPlanes&& input) override {
+    planes_.emplace_back(std::move(input));
+    moves_.emplace_back();
+  }
+
+  void AddInputWithMoves(InputPlanes&& input, const uint16_t* moves,
+                         int num_moves, float softmax_temp) override {
+    planes_.emplace_back(std::move(input));
+    moves_.emplace_back();
+    moves_.back().moves.assign(moves, moves + num_moves);
+    moves_.back().softmax_temp = softmax_temp;
+  }
+
+  void ComputeBlocking() override;
+  void ComputeAsync(std::function<void()> callback) override;
+
+  int GetBatchSize() const override { return planes_.size(); }
+
+  float GetQVal(int sample) const override {
+    return parent_->GetQVal(sample + idx_in_parent_);
+  }
+
+  float GetDVal(int sample) const override {
+    return parent_->GetDVal(sample + idx_in_parent_);
+  }
+
+  float GetPVal(int sample, int move_id) const override {
+    return parent_->GetPVal(sample + idx_in_parent_, move_id);
+  }
+
+  float GetLegalPVal(int sample, int move_index) const override {
+    return parent_->GetLegalPVal(sample + idx_in_parent_, move_index);
+  }
+
+  void PopulateToParent(std::shared_ptr<NetworkComputation> parent) {
+    parent_ = parent;
+    idx_in_parent_ = parent->GetBatchSize();
+    for (size_t i = 0; i < planes_.size(); ++i) {
+      if (moves_[i].softmax_temp == 0.0f) {
+        parent_->AddInput(std::move(planes_[i]));
+      } else {
+        parent_->AddInputWithMoves(std::move(planes_[i]),
+                                   moves_[i].moves.data(),
+                                   moves_[i].moves.size(),
+                                   moves_[i].softmax_temp);
+      }
+    }
+  }
+
+  void NotifyReady() {
+    std::function<void()> callback;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      dataready_ = true;
+      callback = std::move(callback_);
+      dataready_cv_.notify_one();
+    }
+    // The callback may destroy this computation, so nothing is touched after.
+    if (callback) callback();
+  }
+
+ private:
+  std::vector<InputPlanes> planes_;
+  // Moves of the inputs added with AddInputWithMoves(), temperature 0 for
+  // the others.
+  struct Moves {
+    std::vector<uint16_t> moves;
+    float softmax_temp = 0.0f;
+  };
+  std::vector<Moves> moves_;
+  MultiGpuNetwork* network_;
+  std::shared_ptr<NetworkComputation> parent_;
+  int idx_in_parent_ = 0;
+
+  std::mutex mutex_;
+  std::condition_variable dataready_cv_;
+  bool dataready_ = false;
+  std::function<void()> callback_;
+};
+
+// One backend per visible GPU, each fed by its own worker threads that run
+// on the GPU's NUMA node, so that the host buffers the backend allocates
+// from them are local too. Computations go to the GPU expected to finish
+// them first, judging by queued positions and measured time per position.
+class MultiGpuNetwork : public Network {
+ public:
+  MultiGpuNetwork(const WeightsFile& weights, const OptionsDict& options) {
+    int gpu_count = 0;
+    if (cudaGetDeviceCount(&gpu_count) != cudaSuccess || gpu_count == 0) {
+      throw Exception("No GPU found for multigpu backend");
+    }
+    const std::string backend =
+        options.GetOrDefault<std::string>("backend", "cudnn");
+    const int nn_threads = options.GetOrDefault<int>("threads", 2);
+    const int max_batch = options.GetOrDefault<int>("max_batch", 256);
+
+    for (int gpu = 0; gpu < gpu_count; gpu++) {
+      devices_.emplace_back(new Device());
+      Device* device = devices_.back().get();
+      device->cpus = GetGpuCpus(gpu);
+      device->options = std::make_unique<OptionsDict>(&options);
+      device->options->Set<int>("gpu", gpu);
+      CERR << "multigpu: GPU " << gpu << " on "
+           << (device->cpus.empty() ? std::string("any CPU")
+                                    : std::to_string(device->cpus.size()) +
+                                          " local CPUs");
+
+      // Construct from a pinned thread, so that startup allocations are
+      // local to the GPU as well.
+      std::exception_ptr error;
+      std::thread([&]() {
+        PinCurrentThread(device->cpus);
+        try {
+          device->network = NetworkFactory::Get()->Create(backend, weights,
+                                                           *device->options);
+        } catch (...) {
+          error = std::current_exception();
+        }
+      }).join();
+      if (error) std::rethrow_exception(error);
+
+      for (int i = 0; i < nn_threads; ++i) {
+        threads_.emplace_back(
+            [this, device, max_batch]() { Worker(device, max_batch); });
+      }
+    }
+  }
+
+  std::unique_ptr<NetworkComputation> NewComputation() override {
+    return std::make_unique<MultiGpuComputation>(this);
+  }
+
+  bool GathersLegalPolicy() const override {
+    return devices_[0]->network->GathersLegalPolicy();
+  }
+
+  void Enqueue(MultiGpuComputation* computation) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    Device* best = nullptr;
+    double best_time = 0;
+    for (auto& device : devices_) {
+      const double time =
+          (device->pending + computation->GetBatchSize()) *
+          device->seconds_per_position;
+      if (!best || time < best_time) {
+        best = device.get();
+        best_time = time;
+      }
+    }
+    best->queue.push(computation);
+    best->pending += computation->GetBatchSize();
+    best->cv.notify_one();
+  }
+
+  ~MultiGpuNetwork() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      abort_ = true;
+    }
+    for (auto& device : devices_) device->cv.notify_all();
+    for (auto& thread : threads_) thread.join();
+    // Unstuck waiting computations.
+    for (auto& device : devices_) {
+      while (!device->queue.empty()) {
+        device->queue.front()->NotifyReady();
+        device->queue.pop();
+      }
+    }
+  }
+
+ private:
+  struct Device {
+    std::vector<int> cpus;
+    std::unique_ptr<OptionsDict> options;
+    std::unique_ptr<Network> network;
+    // Guarded by mutex_, cv waits on it too.
+    std::queue<MultiGpuComputation*> queue;
+    std::condition_variable cv;
+    // Positions queued or being computed.
+    int pending = 0;
+    // Moving average, starts equal on all devices until measured.
+    double seconds_per_position = 1.0;
+    bool measured = false;
+  };
+
+  void Worker(Device* device, const int max_batch) {
+    PinCurrentThread(device->cpus);
+    while (true) {
+      std::vector<MultiGpuComputation*> children;
+      std::shared_ptr<NetworkComputation> parent(
+          device->network->NewComputation());
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        device->cv.wait(lock,
+                        [&] { return abort_ || !device->queue.empty(); });
+        if (abort_) return;
+        while (!device->queue.empty()) {
+          // A single computation larger than the limit still goes alone.
+          if (parent->GetBatchSize() != 0 &&
+              parent->GetBatchSize() + device->queue.front()->GetBatchSize() >
+                  max_batch) {
+            break;
+          }
+          children.push_back(device->queue.front());
+          device->queue.pop();
+          children.back()->PopulateToParent(parent);
+        }
+      }
+
+      TRACE_SCOPE("multigpu compute");
+      const auto start = std::chrono::steady_clock::now();
+      parent->ComputeBlocking();
+      const double elapsed = std::chrono::duration<double>(
+                                 std::chrono::steady_clock::now() - start)
+                                 .count();
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        const int batch_size = parent->GetBatchSize();
+        const double per_position = elapsed / std::max(batch_size, 1);
+        device->seconds_per_position =
+            device->measured ? 0.9 * device->seconds_per_position +
+                                   0.1 * per_position
+                             : per_position;
+        device->measured = true;
+        device->pending -= batch_size;
+      }
+      for (auto child : children) child->NotifyReady();
+    }
+  }
+
+  std::vector<std::unique_ptr<Device>> devices_;
+  std::vector<std::thread> threads_;
+  std::mutex mutex_;
+  bool abort_ = false;
+};
+
+void MultiGpuComputation::ComputeBlocking() {
+  network_->Enqueue(this);
+  std::unique_lock<std::mutex> lock(mutex_);
+  dataready_cv_.wait(lock, [this]() { return dataready_; });
+}
+
+void MultiGpuComputation::ComputeAsync(std::function<void()> callback) {
+  callback_ = std::move(callback);
+  network_->Enqueue(this);
+}
+
+std::unique_ptr<Network> MakeMultiGpuNetwork(const WeightsFile& weights,
+                                             const OptionsDict& options) {
+  return std::make_unique<MultiGpuNetwork>(weights, options);
+}
+
+REGISTER_NETWORK("multigpu", MakeMultiGpuNetwork, -1001)
+
+}  // namespace
+}  // namespace lczero
@@ -0,0 +1,663 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2018-2019 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+
+  If you modify this Program, or any covered work, by linking or
+  combining it with NVIDIA Corporation's libraries from the NVIDIA CUDA
+  Toolkit and the NVIDIA CUDA Deep Neural Network library (or a
+  modified version of those libraries), containing parts covered by the
+  terms of the respective license agreement, the licensors of this
+  Program grant you additional permission to convey the resulting work.
+*/
+
+// TensorRT backend. The network is described to TensorRT layer by layer from
+// the weights, and TensorRT picks and fuses the kernels into an engine for
+// the GPU. Building takes a while, so engines are cached on disk, keyed by
+// the weights, the GPU and the build options. Needs TensorRT 8.5 or newer.
+
+#include <NvInfer.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <fstream>
+#include <iterator>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <vector>
+
+#include "cuda_common.h"
+#include "kernels.h"
+#include "neural/factory.h"
+#include "neural/network_legacy.h"
+#include "neural/shared/policy_map.h"
+#include "utils/commandline.h"
+#include "utils/exception.h"
+#include "utils/filesystem.h"
+#include "utils/logging.h"
+#include "utils/trace.h"
+
+namespace lczero {
+using namespace cudnn_backend;
+
+namespace {
+constexpr int kNumOutputPolicy = 1858;
+constexpr const char* kInputName = "input";
+constexpr const char* kPolicyName = "policy";
+constexpr const char* kValueName = "value";
+
+class TrtLogger : public nvinfer1::ILogger {
+ public:
+  void log(Severity severity, const char* msg) noexcept override {
+    if (severity <= Severity::kWARNING) {
+      CERR << "TensorRT: " << msg;
+    } else if (severity == Severity::kINFO) {
+      LOGFILE << "TensorRT: " << msg;
+    }
+  }
+};
+
+TrtLogger& Logger() {
+  static TrtLogger logger;
+  return logger;
+}
+
+// Describes the network to TensorRT. Weights passed to TensorRT have to stay
+// alive until the engine is built, so those made up here are kept.
+class TrtNetworkBuilder {
+ public:
+  explicit TrtNetworkBuilder(nvinfer1::INetworkDefinition* network)
+      : network_(network) {}
+
+  // Convolution of @block with @filter_size x @filter_size filters, padded to
+  // keep the 8x8 board.
+  nvinfer1::ITensor* Conv(nvinfer1::ITensor* input,
+                          const LegacyWeights::ConvBlock& block,
+                          int filter_size, bool relu) {
+    auto conv = network_->addConvolutionNd(
+        *input, block.biases.size(), nvinfer1::DimsHW{filter_size, filter_size},
+        Weights(block.weights), Weights(block.biases));
+    conv->setPaddingNd(nvinfer1::DimsHW{filter_size / 2, filter_size / 2});
+    return relu ? Relu(conv->getOutput(0)) : conv->getOutput(0);
+  }
+
+  // Fully connected layer over all of @input, which has @size x @size
+  // planes. As the weights are in the layout of filters covering the whole
+  // input, this is a convolution without padding.
+  nvinfer1::ITensor* FullyConnected(nvinfer1::ITensor* input,
+                                    const std::vector<float>& weights,
+                                    const std::vector<float>& biases, int size,
+                                    bool relu) {
+    auto fc = network_->addConvolutionNd(*input, biases.size(),
+                                         nvinfer1::DimsHW{size, size},
+                                         Weights(weights), Weights(biases));
+    return relu ? Relu(fc->getOutput(0)) : fc->getOutput(0);
+  }
+
+  // Squeeze and excitation: the second fully connected layer gives a scale,
+  // put through a sigmoid, and a bias for every channel of @input.
+  nvinfer1::ITensor* SqueezeExcitation(nvinfer1::ITensor* input,
+                                       const LegacyWeights::SEunit& se,
+                                       int channels) {
+    auto pooled =
+        network_->addReduce(*input, nvinfer1::ReduceOperation::kAVG,
+                            (1 << 2) | (1 << 3), /* keepDimensions */ true)
+            ->getOutput(0);
+    auto fc1 = FullyConnected(pooled, se.w1, se.b1, 1, true);
+    const size_t half = se.w2.size() / 2;
+    const auto& scale_weights =
+        Keep(std::vector<float>(se.w2.begin(), se.w2.begin() + half));
+    const auto& scale_biases =
+        Keep(std::vector<float>(se.b2.begin(), se.b2.begin() + channels));
+    const auto& bias_weights =
+        Keep(std::vector<float>(se.w2.begin() + half, se.w2.end()));
+    const auto& bias_biases =
+        Keep(std::vector<float>(se.b2.begin() + channels, se.b2.end()));
+    auto scale = network_
+                     ->addActivation(*FullyConnected(fc1, scale_weights,
+                                                     scale_biases, 1, false),
+                                     nvinfer1::ActivationType::kSIGMOID)
+                     ->getOutput(0);
+    auto bias = FullyConnected(fc1, bias_weights, bias_biases, 1, false);
+    auto scaled =
+        network_
+            ->addElementWise(*input, *scale, nvinfer1::ElementWiseOperation::kPROD)
+            ->getOutput(0);
+    return Add(scaled, bias);
+  }
+
+  nvinfer1::ITensor* Add(nvinfer1::ITensor* a, nvinfer1::ITensor* b) {
+    return network_->addElementWise(*a, *b, nvinfer1::ElementWiseOperation::kSUM)
+        ->getOutput(0);
+  }
+
+  nvinfer1::ITensor* Relu(nvinfer1::ITensor* input) {
+    return network_->addActivation(*input, nvinfer1::ActivationType::kRELU)
+        ->getOutput(0);
+  }
+
+  // Reshapes [N, C, H, W] to [N, C * H * W].
+  nvinfer1::ITensor* Flatten(nvinfer1::ITensor* input) {
+    auto shuffle = network_->addShuffle(*input);
+    nvinfer1::Dims dims;
+    dims.nbDims = 2;
+    dims.d[0] = 0;
+    dims.d[1] = -1;
+    shuffle->setReshapeDimensions(dims);
+    return shuffle->getOutput(0);
+  }
+
+  // Softmax over the second dimension of [N, C].
+  nvinfer1::ITensor* Softmax(nvinfer1::ITensor* input) {
+    auto softmax = network_->addSoftMax(*input);
+    softmax->setAxes(1 << 1);
+    return softmax->getOutput(0);
+  }
+
+  // Picks the 1858 policy outputs from the flattened policy planes.
+  nvinfer1::ITensor* PolicyMap(nvinfer1::ITensor* input, int input_size) {
+    std::vector<int32_t> indices(kNumOutputPolicy);
+    for (int i = 0; i < input_size; ++i) {
+      if (kConvPolicyMap[i] >= 0) indices[kConvPolicyMap[i]] = i;
+    }
+    int_storage_.push_back(std::move(indices));
+    const auto& kept = int_storage_.back();
+    nvinfer1::Dims dims;
+    dims.nbDims = 1;
+    dims.d[0] = kNumOutputPolicy;
+    auto constant = network_->addConstant(
+        dims, {nvinfer1::DataType::kINT32, kept.data(),
+               static_cast<int64_t>(kept.size())});
+    return network_->addGather(*input, *constant->getOutput(0), 1)
+        ->getOutput(0);
+  }
+
+ private:
+  static nvinfer1::Weights Weights(const std::vector<float>& values) {
+    return {nvinfer1::DataType::kFLOAT, values.data(),
+            static_cast<int64_t>(values.size())};
+  }
+
+  const std::vector<float>& Keep(std::vector<float> values) {
+    storage_.push_back(std::move(values));
+    return storage_.back();
+  }
+
+  nvinfer1::INetworkDefinition* network_;
+  // Deques, as they don't move their elements when growing.
+  std::deque<std::vector<float>> storage_;
+  std::deque<std::vector<int32_t>> int_storage_;
+};
+
+// FNV-1a, to key the engine cache.
+uint64_t HashBytes(const std::string& bytes, uint64_t hash = 14695981039346656037ULL) {
+  for (const unsigned char c : bytes) {
+    hash ^= c;
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+// Host and device buffers of one computation.
+struct TrtInputsOutputs {
+  explicit TrtInputsOutputs(int max_batch_size) {
+    // The host only ever writes the inputs, so write-combined memory is fine.
+    ReportCUDAErrors(cudaHostAlloc(
+        &input_masks_mem_, max_batch_size * kInputPlanes * sizeof(uint64_t),
+        cudaHostAllocWriteCombined));
+    ReportCUDAErrors(cudaHostAlloc(
+        &input_val_mem_, max_batch_size * kInputPlanes * sizeof(float),
+        cudaHostAllocWriteCombined));
+    ReportCUDAErrors(cudaHostAlloc(
+        &op_policy_mem_, max_batch_size * kNumOutputPolicy * sizeof(float), 0));
+    // Room for WDL, three values per position.
+    ReportCUDAErrors(
+        cudaHostAlloc(&op_value_mem_, 3 * max_batch_size * sizeof(float), 0));
+  }
+  ~TrtInputsOutputs() {
+    ReportCUDAErrors(cudaFreeHost(input_masks_mem_));
+    ReportCUDAErrors(cudaFreeHost(input_val_mem_));
+    ReportCUDAErrors(cudaFreeHost(op_policy_mem_));
+    ReportCUDAErrors(cudaFreeHost(op_value_mem_));
+  }
+  uint64_t* input_masks_mem_;
+  float* input_val_mem_;
+  float* op_policy_mem_;
+  float* op_value_mem_;
+};
+
+class TrtNetwork;
+
+class TrtNetworkComputation : public NetworkComputation {
+ public:
+  TrtNetworkComputation(TrtNetwork* network, bool wdl);
+  ~TrtNetworkComputation();
+
+  void AddInput(InputPlanes&& input) override {
+    const auto iter_mask =
+        &inputs_outputs_->input_masks_mem_[batch_size_ * kInputPlanes];
+    const auto iter_val =
+        &inputs_outputs_->input_val_mem_[batch_size_ * kInputPlanes];
+    int i = 0;
+    for (const auto& plane : input) {
+      iter_mask[i] = plane.mask;
+      iter_val[i] = plane.value;
+      i++;
+    }
+    batch_size_++;
+  }
+
+  void ComputeBlocking() override;
+
+  int GetBatchSize() const override { return batch_size_; }
+
+  float GetQVal(int sample) const override {
+    if (wdl_) {
+      auto w = inputs_outputs_->op_value_mem_[3 * sample + 0];
+      auto l = inputs_outputs_->op_value_mem_[3 * sample + 2];
+      return w - l;
+    }
+    return inputs_outputs_->op_value_mem_[sample];
+  }
+
+  float GetDVal(int sample) const override {
+    if (wdl_) return inputs_outputs_->op_value_mem_[3 * sample + 1];
+    return 0.0f;
+  }
+
+  float GetPVal(int sample, int move_id) const override {
+    return inputs_outputs_->op_policy_mem_[sample * kNumOutputPolicy + move_id];
+  }
+
+ private:
+  std::unique_ptr<TrtInputsOutputs> inputs_outputs_;
+  int batch_size_ = 0;
+  bool wdl_;
+  TrtNetwork* network_;
+};
+
+class TrtNetwork : public Network {
+  // An execution context with its own stream, optimization profile and
+  // device buffers, so that several batches can run at once.
+  struct StreamContext {
+    std::unique_ptr<nvinfer1::IExecutionContext> context;
+    cudaStream_t stream;
+    uint64_t* input_masks_mem_gpu = nullptr;
+    float* input_val_mem_gpu = nullptr;
+    float* input_mem_gpu = nullptr;
+    float* op_policy_mem_gpu = nullptr;
+    float* op_value_mem_gpu = nullptr;
+  };
+
+ public:
+  TrtNetwork(const WeightsFile& file, const OptionsDict& options, bool fp16) {
+    gpu_id_ = options.GetOrDefault<int>("gpu", 0);
+    max_batch_size_ = options.GetOrDefault<int>("max_batch", 1024);
+    // The batch size TensorRT tunes the kernels for.
+    const int opt_batch_size =
+        std::min(options.GetOrDefault<int>("opt_batch", 256), max_batch_size_);
+    const int num_streams = options.GetOrDefault<int>("streams", 1);
+    if (num_streams < 1) {
+      throw Exception("Invalid number of streams: " +
+                      std::to_string(num_streams));
+    }
+    wdl_ = file.format().network_format().value() ==
+           pblczero::NetworkFormat::VALUE_WDL;
+
+    int total_gpus;
+    ReportCUDAErrors(cudaGetDeviceCount(&total_gpus));
+    if (gpu_id_ >= total_gpus) {
+      throw Exception("Invalid GPU Id: " + std::to_string(gpu_id_));
+    }
+    ReportCUDAErrors(cudaSetDevice(gpu_id_));
+    cudaDeviceProp deviceProp = {};
+    ReportCUDAErrors(cudaGetDeviceProperties(&deviceProp, gpu_id_));
+    CERR << "GPU: " << deviceProp.name << ", compute capability "
+         << deviceProp.major << "." << deviceProp.minor << ", TensorRT "
+         << getInferLibVersion();
+
+    // Everything the engine depends on goes into the cache key.
+    std::ostringstream key;
+    key << deviceProp.name << ' ' << deviceProp.major << '.'
+        << deviceProp.minor << ' ' << getInferLibVersion() << ' ' << fp16
+        << ' ' << max_batch_size_ << ' ' << opt_batch_size << ' '
+        << num_streams;
+    const uint64_t hash =
+        HashBytes(key.str(), HashBytes(file.SerializeAsString()));
+    char name[32];
+    std::snprintf(name, sizeof(name), "lc0-%016llx.trt",
+                  static_cast<unsigned long long>(hash));
+    const std::string cache_path =
+        options.GetOrDefault<std::string>("engine_cache",
+                                          CommandLine::BinaryDirectory()) +
+        "/" + name;
+
+    runtime_.reset(nvinfer1::createInferRuntime(Logger()));
+    if (!runtime_) throw Exception("Cannot create TensorRT runtime");
+    std::ifstream cached(cache_path, std::ios::binary);
+    if (cached) {
+      const std::string plan((std::istreambuf_iterator<char>(cached)),
+                             std::istreambuf_iterator<char>());
+      engine_.reset(runtime_->deserializeCudaEngine(plan.data(), plan.size()));
+      if (engine_) {
+        CERR << "Loaded TensorRT engine " << cache_path;
+      } else {
+        CERR << "Rebuilding TensorRT engine " << cache_path
+             << ", it couldn't be loaded.";
+      }
+    }
+    if (!engine_) {
+      const std::string plan = BuildPlan(file, fp16, opt_batch_size,
+                                         num_streams);
+      engine_.reset(runtime_->deserializeCudaEngine(plan.data(), plan.size()));
+      if (!engine_) throw Exception("Cannot load built TensorRT engine");
+      SavePlan(plan, cache_path);
+    }
+
+    streams_.resize(num_streams);
+    for (int i = 0; i < num_streams; ++i) {
+      auto& ctx = streams_[i];
+      ReportCUDAErrors(
+          cudaStreamCreateWithFlags(&ctx.stream, cudaStreamNonBlocking));
+      ctx.context.reset(engine_->createExecutionContext());
+      if (!ctx.context) throw Exception("Cannot create TensorRT context");
+      ctx.context->setOptimizationProfileAsync(i, ctx.stream);
+      ReportCUDAErrors(cudaMalloc(
+          &ctx.input_masks_mem_gpu,
+          max_batch_size_ * kInputPlanes * sizeof(uint64_t)));
+      ReportCUDAErrors(cudaMalloc(
+          &ctx.input_val_mem_gpu, max_batch_size_ * kInputPlanes * sizeof(float)));
+      ReportCUDAErrors(cudaMalloc(
+          &ctx.input_mem_gpu,
+          max_batch_size_ * kInputPlanes * 8 * 8 * sizeof(float)));
+      ReportCUDAErrors(cudaMalloc(
+          &ctx.op_policy_mem_gpu,
+          max_batch_size_ * kNumOutputPolicy * sizeof(float)));
+      ReportCUDAErrors(cudaMalloc(&ctx.op_value_mem_gpu,
+                                  3 * max_batch_size_ * sizeof(float)));
+      // The buffers are the same for every batch.
+      ctx.context->setTensorAddress(kInputName, ctx.input_mem_gpu);
+      ctx.context->setTensorAddress(kPolicyName, ctx.op_policy_mem_gpu);
+      ctx.context->setTensorAddress(kValueName, ctx.op_value_mem_gpu);
+      free_streams_.push_back(&ctx);
+    }
+    ReportCUDAErrors(cudaDeviceSynchronize());
+  }
+
+  ~TrtNetwork() {
+    for (auto& ctx : streams_) {
+      ctx.context.reset();
+      ReportCUDAErrors(cudaFree(ctx.input_masks_mem_gpu));
+      ReportCUDAErrors(cudaFree(ctx.input_val_mem_gpu));
+      ReportCUDAErrors(cudaFree(ctx.input_mem_gpu));
+      ReportCUDAErrors(cudaFree(ctx.op_policy_mem_gpu));
+      ReportCUDAErrors(cudaFree(ctx.op_value_mem_gpu));
+      cudaStreamDestroy(ctx.stream);
+    }
+  }
+
+  std::unique_ptr<NetworkComputation> NewComputation() override {
+    // Set correct gpu id for this computation (as it might have been called
+    // from a different thread).
+    ReportCUDAErrors(cudaSetDevice(gpu_id_));
+    return std::make_unique<TrtNetworkComputation>(this, wdl_);
+  }
+
+  void forwardEval(TrtInputsOutputs* io, int batch_size) {
+    TRACE_SCOPE("tensorrt compute");
+    if (batch_size == 0) return;
+    if (batch_size > max_batch_size_) {
+      throw Exception("Batch of " + std::to_string(batch_size) +
+                      " is larger than max_batch");
+    }
+    StreamContext* ctx = acquireStream();
+    const cudaStream_t stream = ctx->stream;
+    ReportCUDAErrors(cudaMemcpyAsync(
+        ctx->input_masks_mem_gpu, io->input_masks_mem_,
+        batch_size * kInputPlanes * sizeof(uint64_t), cudaMemcpyHostToDevice,
+        stream));
+    ReportCUDAErrors(cudaMemcpyAsync(
+        ctx->input_val_mem_gpu, io->input_val_mem_,
+        batch_size * kInputPlanes * sizeof(float), cudaMemcpyHostToDevice,
+        stream));
+    expandPlanes_Fp32_NCHW(ctx->input_mem_gpu, ctx->input_masks_mem_gpu,
+                           ctx->input_val_mem_gpu, batch_size * kInputPlanes,
+                           stream);
+    if (!ctx->context->setInputShape(
+            kInputName, nvinfer1::Dims4{batch_size, kInputPlanes, 8, 8}) ||
+        !ctx->context->enqueueV3(stream)) {
+      releaseStream(ctx);
+      throw Exception("TensorRT failed to run the network");
+    }
+    ReportCUDAErrors(cudaMemcpyAsync(
+        io->op_policy_mem_, ctx->op_policy_mem_gpu,
+        batch_size * kNumOutputPolicy * sizeof(float), cudaMemcpyDeviceToHost,
+        stream));
+    ReportCUDAErrors(cudaMemcpyAsync(
+        io->op_value_mem_, ctx->op_value_mem_gpu,
+        batch_size * (wdl_ ? 3 : 1) * sizeof(float), cudaMemcpyDeviceToHost,
+        stream));
+    ReportCUDAErrors(cudaStreamSynchronize(stream));
+    releaseStream(ctx);
+  }
+
+  std::unique_ptr<TrtInputsOutputs> GetInputsOutputs() {
+    std::lock_guard<std::mutex> lock(inputs_outputs_lock_);
+    if (free_inputs_outputs_.empty()) {
+      return std::make_unique<TrtInputsOutputs>(max_batch_size_);
+    }
+    auto resource = std::move(free_inputs_outputs_.front());
+    free_inputs_outputs_.pop_front();
+    return resource;
+  }
+
+  void ReleaseInputsOutputs(std::unique_ptr<TrtInputsOutputs> resource) {
+    std::lock_guard<std::mutex> lock(inputs_outputs_lock_);
+    free_inputs_outputs_.push_back(std::move(resource));
+  }
+
+ private:
+  // Describes the network of @file to TensorRT and returns the serialized
+  // engine, with one optimization profile per stream.
+  std::string BuildPlan(const WeightsFile& file, bool fp16, int opt_batch_size,
+                        int num_profiles) {
+    CERR << "Building TensorRT engine, this may take a few minutes.";
+    const LegacyWeights weights(file.weights());
+    std::unique_ptr<nvinfer1::IBuilder> builder(
+        nvinfer1::createInferBuilder(Logger()));
+    if (!builder) throw Exception("Cannot create TensorRT builder");
+    std::unique_ptr<nvinfer1::INetworkDefinition> network(
+        builder->createNetworkV2(
+            1U << static_cast<uint32_t>(
+                nvinfer1::NetworkDefinitionCreationFlag::kEXPLICIT_BATCH)));
+    TrtNetworkBuilder net(network.get());
+    const int num_filters = weights.input.biases.size();
+
+    // Input and residual tower.
+    auto input = network->addInput(kInputName, nvinfer1::DataType::kFLOAT,
+                                   nvinfer1::Dims4{-1, kInputPlanes, 8, 8});
+    auto flow = net.Conv(input, weights.input, 3, true);
+    for (const auto& block : weights.residual) {
+      auto conv1 = net.Conv(flow, block.conv1, 3, true);
+      auto conv2 = net.Conv(conv1, block.conv2, 3, false);
+      if (block.has_se) {
+        conv2 = net.SqueezeExcitation(conv2, block.se, num_filters);
+      }
+      flow = net.Relu(net.Add(conv2, flow));
+    }
+
+    // Policy head.
+    nvinfer1::ITensor* policy;
+    if (file.format().network_format().policy() ==
+        pblczero::NetworkFormat::POLICY_CONVOLUTION) {
+      auto conv1 = net.Conv(flow, weights.policy1, 3, true);
+      auto conv2 = net.Conv(conv1, weights.policy, 3, false);
+      policy = net.PolicyMap(net.Flatten(conv2), 73 * 8 * 8);
+    } else {
+      auto conv = net.Conv(flow, weights.policy, 1, true);
+      policy = net.Flatten(
+          net.FullyConnected(conv, weights.ip_pol_w, weights.ip_pol_b, 8, false));
+    }
+    policy = net.Softmax(policy);
+    policy->setName(kPolicyName);
+    network->markOutput(*policy);
+
+    // Value head.
+    auto conv = net.Conv(flow, weights.value, 1, true);
+    auto fc1 =
+        net.FullyConnected(conv, weights.ip1_val_w, weights.ip1_val_b, 8, true);
+    auto value = net.Flatten(
+        net.FullyConnected(fc1, weights.ip2_val_w, weights.ip2_val_b, 1, false));
+    if (wdl_) {
+      value = net.Softmax(value);
+    } else {
+      value = network->addActivation(*value, nvinfer1::ActivationType::kTANH)
+                  ->getOutput(0);
+    }
+    value->setName(kValueName);
+    network->markOutput(*value);
+
+    std::unique_ptr<nvinfer1::IBuilderConfig> config(
+        builder->createBuilderConfig());
+    if (fp16) {
+      if (!builder->platformHasFastFp16()) {
+        throw Exception("Your GPU doesn't support FP16");
+      }
+      config->setFlag(nvinfer1::BuilderFlag::kFP16);
+    }
+    for (int i = 0; i < num_profiles; ++i) {
+      auto profile = builder->createOptimizationProfile();
+      profile->setDimensions(kInputName, nvinfer1::OptProfileSelector::kMIN,
+                             nvinfer1::Dims4{1, kInputPlanes, 8, 8});
+      profile->setDimensions(
+          kInputName, nvinfer1::OptProfileSelector::kOPT,
+          nvinfer1::Dims4{opt_batch_size, kInputPlanes, 8, 8});
+      profile->setDimensions(
+          kInputName, nvinfer1::OptProfileSelector::kMAX,
+          nvinfer1::Dims4{max_batch_size_, kInputPlanes, 8, 8});
+      config->addOptimizationProfile(profile);
+    }
+    std::unique_ptr<nvinfer1::IHostMemory> plan(
+        builder->buildSerializedNetwork(*network, *config));
+    if (!plan) throw Exception("TensorRT failed to build the engine");
+    return std::string(static_cast<const char*>(plan->data()), plan->size());
+  }
+
+  static void SavePlan(const std::string& plan, const std::string& path) {
+    // Written aside and renamed, so that a concurrent start doesn't load
+    // half of it.
+    const std::string temp_path = path + ".tmp";
+    {
+      std::ofstream out(temp_path, std::ios::binary);
+      out.write(plan.data(), plan.size());
+      if (!out) {
+        CERR << "Cannot write TensorRT engine cache " << temp_path;
+        return;
+      }
+    }
+    try {
+      RenameFile(temp_path, path);
+    } catch (const Exception& e) {
+      CERR << "Cannot save TensorRT engine cache: " << e.what();
+    }
+  }
+
+  StreamContext* acquireStream() {
+    std::unique_lock<std::mutex> lock(streams_mutex_);
+    streams_cv_.wait(lock, [this]() { return !free_streams_.empty(); });
+    StreamContext* ctx = free_streams_.back();
+    free_streams_.pop_back();
+    return ctx;
+  }
+
+  void releaseStream(StreamContext* ctx) {
+    {
+      std::lock_guard<std::mutex> lock(streams_mutex_);
+      free_streams_.push_back(ctx);
+    }
+    streams_cv_.notify_one();
+  }
+
+  int gpu_id_;
+  int max_batch_size_;
+  bool wdl_;
+  std::unique_ptr<nvinfer1::IRuntime> runtime_;
+  std::unique_ptr<nvinfer1::ICudaEngine> engine_;
+  // Contexts are destroyed before the engine.
+  std::vector<StreamContext> streams_;
+  std::mutex streams_mutex_;
+  std::condition_variable streams_cv_;
+  std::vector<StreamContext*> free_streams_;
+  std::mutex inputs_outputs_lock_;
+  std::list<std::unique_ptr<TrtInputsOutputs>> free_inputs_outputs_;
+};
+
+TrtNetworkComputation::TrtNetworkComputation(TrtNetwork* network, bool wdl)
+    : wdl_(wdl), network_(network) {
+  inputs_outputs_ = network_->GetInputsOutputs();
+}
+
+TrtNetworkComputation::~TrtNetworkComputation() {
+  network_->ReleaseInputsOutputs(std::move(inputs_outputs_));
+}
+
+void TrtNetworkComputation::ComputeBlocking() {
+  network_->forwardEval(inputs_outputs_.get(), GetBatchSize());
+}
+
+std::unique_ptr<Network> MakeTrtNetwork(const WeightsFile& weights,
+                                        const OptionsDict& options,
+                                        bool fp16) {
+  const auto& format = weights.format().network_format();
+  if (format.network() !=
+          pblczero::NetworkFormat::NETWORK_CLASSICAL_WITH_HEADFORMAT &&
+      format.network() != pblczero::NetworkFormat::NETWORK_SE_WITH_HEADFORMAT) {
+    throw Exception("Network format " + std::to_string(format.network()) +
+                    " is not supported by TensorRT backend.");
+  }
+  if (format.policy() != pblczero::NetworkFormat::POLICY_CLASSICAL &&
+      format.policy() != pblczero::NetworkFormat::POLICY_CONVOLUTION) {
+    throw Exception("Policy format " + std::to_string(format.policy()) +
+                    " is not supported by TensorRT backend.");
+  }
+  if (format.value() != pblczero::NetworkFormat::VALUE_CLASSICAL &&
+      format.value() != pblczero::NetworkFormat::VALUE_WDL) {
+    throw Exception("Value format " + std::to_string(format.value()) +
+                    " is not supported by TensorRT backend.");
+  }
+  return std::make_unique<TrtNetwork>(weights, options, fp16);
+}
+
+std::unique_ptr<Network> MakeTrtFp32Network(const WeightsFile& weights,
+                                            const OptionsDict& options) {
+  return MakeTrtNetwork(weights, options, false);
+}
+
+std::unique_ptr<Network> MakeTrtFp16Network(const WeightsFile& weights,
+                                            const OptionsDict& options) {
+  return MakeTrtNetwork(weights, options, true);
+}
+}  // namespace
+
+REGISTER_NETWORK("tensorrt", MakeTrtFp16Network, 94)
+REGISTER_NETWORK("tensorrt-fp32", MakeTrtFp32Network, 93)
+
+}  // namespace lczero
@@ -35,26 +35,49 @@ namespace {
 const int kMoveHistory = 8;
 const int kPlanesPerBoard = 13;
 const int kAuxPlaneBase = kPlanesPerBoard * kMoveHistory;
+
+void EncodeAuxPlanes(const Position& position, InputPlanes* result) {
+  const ChessBoard& board = position.GetBoard();
+  const bool we_are_black = board.flipped();
+  auto& planes = *result;
+  if (board.castlings().we_can_000()) planes[kAuxPlaneBase + 0].SetAll();
+  if (board.castlings().we_can_00()) planes[kAuxPlaneBase + 1].SetAll();
+  if (board.castlings().they_can_000()) planes[kAuxPlaneBase + 2].SetAll();
+  if (board.castlings().they_can_00()) planes[kAuxPlaneBase + 3].SetAll();
+  if (we_are_black) planes[kAuxPlaneBase + 4].SetAll();
+  planes[kAuxPlaneBase + 5].Fill(position.GetNoCaptureNoPawnPly());
+  // Plane kAuxPlaneBase + 6 used to be movecount plane, now it's all zeros.
+  // Plane kAuxPlaneBase + 7 is all ones to help NN find board edges.
+  planes[kAuxPlaneBase + 7].SetAll();
+}
+
+void EncodeBoard(const ChessBoard& board, int repetitions, int base,
+                 InputPlanes* result) {
+  auto& planes = *result;
+  planes[base + 0].mask = (board.ours() & board.pawns()).as_int();
+  planes[base + 1].mask = (board.our_knights()).as_int();
+  planes[base + 2].mask = (board.ours() & board.bishops()).as_int();
+  planes[base + 3].mask = (board.ours() & board.rooks()).as_int();
+  planes[base + 4].mask = (board.ours() & board.queens()).as_int();
+  planes[base + 5].mask = (board.our_king()).as_int();
+
+  planes[base + 6].mask = (board.theirs() & board.pawns()).as_int();
+  planes[base + 7].mask = (board.their_knights()).as_int();
+  planes[base + 8].mask = (board.theirs() & board.bishops()).as_int();
+  planes[base + 9].mask = (board.theirs() & board.rooks()).as_int();
+  planes[base + 10].mask = (board.theirs() & board.queens()).as_int();
+  planes[base + 11].mask = (board.their_king()).as_int();
+
+  if (repetitions >= 1) planes[base + 12].SetAll();
+}
 }  // namespace
 
 InputPlanes EncodePositionForNN(const PositionHistory& history,
                                 int history_planes,
                                 FillEmptyHistory fill_empty_history) {
-  InputPlanes result(kAuxPlaneBase + 8);
-
-  {
-    const ChessBoard& board = history.Last().GetBoard();
-    const bool we_are_black = board.flipped();
-    if (board.castlings().we_can_000()) result[kAuxPlaneBase + 0].SetAll();
-    if (board.castlings().we_can_00()) result[kAuxPlaneBase + 1].SetAll();
-    if (board.castlings().they_can_000()) result[kAuxPlaneBase + 2].SetAll();
-    if (board.castlings().they_can_00()) result[kAuxPlaneBase + 3].SetAll();
-    if (we_are_black) result[kAuxPlaneBase + 4].SetAll();
-    result[kAuxPlaneBase + 5].Fill(history.Last().GetNoCaptureNoPawnPly());
-    // Plane kAuxPlaneBase + 6 used to be movecount plane, now it's all zeros.
-    // Plane kAuxPlaneBase + 7 is all ones to help NN find board edges.
-    result[kAuxPlaneBase + 7].SetAll();
-  }
+  static_assert(kAuxPlaneBase + 8 == kInputPlanes, "Wrong plane count");
+  InputPlanes result;
+  EncodeAuxPlanes(history.Last(), &result);
 
   bool flip = false;
   int history_idx = history.GetLength() - 1;
@@ -72,22 +95,7 @@ InputPlanes EncodePositionForNN(const PositionHistory& history,
     }
 
     const int base = i * kPlanesPerBoard;
-    result[base + 0].mask = (board.ours() & board.pawns()).as_int();
-    result[base + 1].mask = (board.our_knights()).as_int();
-    result[base + 2].mask = (board.ours() & board.bishops()).as_int();
-    result[base + 3].mask = (board.ours() & board.rooks()).as_int();
-    result[base + 4].mask = (board.ours() & board.queens()).as_int();
-    result[base + 5].mask = (board.our_king()).as_int();
-
-    result[base + 6].mask = (board.theirs() & board.pawns()).as_int();
-    result[base + 7].mask = (board.their_knights()).as_int();
-    result[base + 8].mask = (board.theirs() & board.bishops()).as_int();
-    result[base + 9].mask = (board.theirs() & board.rooks()).as_int();
-    result[base + 10].mask = (board.theirs() & board.queens()).as_int();
-    result[base + 11].mask = (board.their_king()).as_int();
-
-    const int repetitions = position.GetRepetitions();
-    if (repetitions >= 1) result[base + 12].SetAll();
+    EncodeBoard(board, position.GetRepetitions(), base, &result);
 
     // If en passant flag is set, undo last pawn move by removing the pawn from
     // the new square and putting into pre-move square.
@@ -107,4 +115,21 @@ InputPlanes EncodePositionForNN(const PositionHistory& history,
   return result;
 }
 
+InputPlanes EncodePositionForNN(const InputPlanes& sibling,
+                                const PositionHistory& history,
+                                int history_planes,
+                                FillEmptyHistory fill_empty_history) {
+  // Without a parent position there are no older boards to share.
+  if (history.GetLength() < 2 || history_planes < 1) {
+    return EncodePositionForNN(history, history_planes, fill_empty_history);
+  }
+  InputPlanes result = sibling;
+  std::fill(result.begin(), result.begin() + kPlanesPerBoard, InputPlane());
+  std::fill(result.begin() + kAuxPlaneBase, result.end(), InputPlane());
+  EncodeAuxPlanes(history.Last(), &result);
+  EncodeBoard(history.Last().GetBoard(), history.Last().GetRepetitions(), 0,
+              &result);
+  return result;
+}
+
 }  // namespace lczero
@@ -39,4 +39,12 @@ InputPlanes EncodePositionForNN(const PositionHistory& history,
                                 int history_planes,
                                 FillEmptyHistory fill_empty_history);
 
+// Same as above, given @sibling, the encoding of a history which only differs
+// from @history in the last position. The older boards are the same for both,
+// so only the planes of the last board and the auxiliary planes are computed.
+InputPlanes EncodePositionForNN(const InputPlanes& sibling,
+                                const PositionHistory& history,
+                                int history_planes,
+                                FillEmptyHistory fill_empty_history);
+
 }  // namespace lczero
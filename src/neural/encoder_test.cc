@@ -129,6 +129,39 @@ TEST(EncodePositionForNN, EncodeFiftyMoveCounter) {
   EXPECT_EQ(fifty_move_counter_plane.value, 2.0f);
 }
 
+TEST(EncodePositionForNN, EncodeFromSibling) {
+  ChessBoard board;
+  PositionHistory history;
+  board.SetFromFen(ChessBoard::kStartposFen);
+  history.Reset(board, 0, 1);
+
+  // Shorter and longer than the history planes, with castling, a capture and
+  // a repetition among the siblings.
+  const char* moves[] = {"e2e4", "e7e5", "g1f3", "b8c6", "f1c4", "g8f6",
+                         "f3g1", "f6g8", "g1f3", "g8f6"};
+  for (const char* move : moves) {
+    for (const auto fill : {FillEmptyHistory::NO, FillEmptyHistory::FEN_ONLY,
+                            FillEmptyHistory::ALWAYS}) {
+      const auto legal_moves = history.Last().GetBoard().GenerateLegalMoves();
+      history.Append(legal_moves[0]);
+      const InputPlanes sibling = EncodePositionForNN(history, 8, fill);
+      for (const Move m : legal_moves) {
+        history.Pop();
+        history.Append(m);
+        const InputPlanes expected = EncodePositionForNN(history, 8, fill);
+        const InputPlanes planes =
+            EncodePositionForNN(sibling, history, 8, fill);
+        for (int i = 0; i < kInputPlanes; i++) {
+          EXPECT_EQ(planes[i].mask, expected[i].mask) << i;
+          EXPECT_EQ(planes[i].value, expected[i].value) << i;
+        }
+      }
+      history.Pop();
+    }
+    history.Append(Move(move, history.IsBlackToMove()));
+  }
+}
+
 }  // namespace lczero
 
 int main(int argc, char** argv) {
@@ -29,7 +29,10 @@
 #include "neural/loader.h"
 
 #include <algorithm>
+#include <chrono>
+#include "neural/encoder.h"
 #include "utils/logging.h"
+#include "utils/string.h"
 
 namespace lczero {
 
@@ -46,6 +49,16 @@ const OptionId NetworkFactory::kBackendOptionsId{
     "Parameters of neural network backend. "
     "Exact parameters differ per backend.",
     'o'};
+const OptionId NetworkFactory::kBackendWarmupId{
+    "backend-warmup", "BackendWarmup",
+    "Comma separated list of batch sizes to run through the backend right "
+    "after it's loaded, so that the first moves don't pay for lazy "
+    "initialization and tuning. Timings are logged. Empty to disable."};
+const OptionId NetworkFactory::kPreparedWeightsId{
+    "prepared-weights", "PreparedWeights",
+    "Keep a decompressed copy of a gzipped weights file next to it, with a "
+    ".prepared suffix, and load from that copy while the weights file is "
+    "unchanged. It is written on the first load."};
 const char* kAutoDiscover = "<autodiscover>";
 
 NetworkFactory* NetworkFactory::Get() {
@@ -64,6 +77,8 @@ void NetworkFactory::PopulateOptions(OptionsParser* options) {
   options->Add<ChoiceOption>(NetworkFactory::kBackendId, backends) =
       backends.empty() ? "<none>" : backends[0];
   options->Add<StringOption>(NetworkFactory::kBackendOptionsId);
+  options->Add<StringOption>(NetworkFactory::kBackendWarmupId);
+  options->Add<BoolOption>(NetworkFactory::kPreparedWeightsId) = false;
 }
 
 void NetworkFactory::RegisterNetwork(const std::string& name,
@@ -103,7 +118,7 @@ bool NetworkFactory::BackendConfiguration::operator==(
 }
 
 std::unique_ptr<Network> NetworkFactory::LoadNetwork(
-    const OptionsDict& options) {
+    const OptionsDict& options, std::string* weights_path) {
   std::string net_path = options.Get<std::string>(kWeightsId.GetId());
   const std::string backend = options.Get<std::string>(kBackendId.GetId());
   const std::string backend_options =
@@ -114,12 +129,44 @@ std::unique_ptr<Network> NetworkFactory::LoadNetwork(
   } else {
     CERR << "Loading weights file from: " << net_path;
   }
-  const WeightsFile weights = LoadWeightsFromFile(net_path);
+  const WeightsFile weights = LoadWeightsFromFile(
+      net_path,
+      options.GetOrDefault<bool>(kPreparedWeightsId.GetId(), false));
+  if (weights_path) *weights_path = net_path;
 
   OptionsDict network_options(&options);
   network_options.AddSubdictFromString(backend_options);
 
-  return NetworkFactory::Get()->Create(backend, weights, network_options);
+  auto network =
+      NetworkFactory::Get()->Create(backend, weights, network_options);
+  const std::string warmup =
+      options.GetOrDefault<std::string>(kBackendWarmupId.GetId(), "");
+  if (!warmup.empty()) WarmupNetwork(network.get(), ParseIntList(warmup));
+  return network;
+}
+
+void NetworkFactory::WarmupNetwork(Network* network,
+                                   const std::vector<int>& batch_sizes) {
+  PositionHistory history;
+  history.Reset(ChessBoard(ChessBoard::kStartposFen), 0, 1);
+  const InputPlanes planes =
+      EncodePositionForNN(history, 8, FillEmptyHistory::FEN_ONLY);
+  for (int batch_size : batch_sizes) {
+    // The first run pays for the lazy setup, the second one shows the
+    // steady state.
+    for (int run = 0; run < 2; ++run) {
+      auto computation = network->NewComputation();
+      for (int i = 0; i < batch_size; ++i) {
+        computation->AddInput(InputPlanes(planes));
+      }
+      const auto start = std::chrono::steady_clock::now();
+      computation->ComputeBlocking();
+      const std::chrono::duration<double, std::milli> elapsed =
+          std::chrono::steady_clock::now() - start;
+      CERR << "Warmup batch " << batch_size << (run ? "" : " (first)") << ": "
+           << elapsed.count() << "ms";
+    }
+  }
 }
 
 }  // namespace lczero
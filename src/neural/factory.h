@@ -65,13 +65,22 @@ class NetworkFactory {
                                   const OptionsDict& options);
 
   // Helper function to load the network from the options. Returns nullptr
-  // if no network options changed since the previous call.
-  static std::unique_ptr<Network> LoadNetwork(const OptionsDict& options);
+  // if no network options changed since the previous call. If @weights_path
+  // is not null, stores there the path of the weights file used.
+  static std::unique_ptr<Network> LoadNetwork(
+      const OptionsDict& options, std::string* weights_path = nullptr);
+
+  // Runs a couple of batches of each of @batch_sizes through @network and
+  // logs how long they take.
+  static void WarmupNetwork(Network* network,
+                            const std::vector<int>& batch_sizes);
 
   // Parameter IDs.
   static const OptionId kWeightsId;
   static const OptionId kBackendId;
   static const OptionId kBackendOptionsId;
+  static const OptionId kBackendWarmupId;
+  static const OptionId kPreparedWeightsId;
 
   struct BackendConfiguration {
     BackendConfiguration() = default;
@@ -33,7 +33,9 @@
 #include <algorithm>
 #include <cctype>
 #include <cstdio>
+#include <cstring>
 #include <fstream>
+#include <random>
 #include <sstream>
 #include <string>
 
@@ -48,6 +50,66 @@ namespace lczero {
 
 namespace {
 const std::uint32_t kWeightMagic = 0x1c0;
+const char kPreparedMagic[8] = {'L', 'c', '0', 'P', 'r', 'e', 'p', '1'};
+
+// Header of a prepared weights file, the decompressed protobuf follows. The
+// source file is identified by its size, time and the gzip trailer, which has
+// the CRC32 and the length of the uncompressed data.
+struct PreparedHeader {
+  char magic[8];
+  std::uint64_t source_size;
+  std::int64_t source_time;
+  std::uint32_t source_crc;
+  std::uint32_t source_isize;
+};
+
+// Fills @header for @filename. Returns false if the file is not gzipped, then
+// there is nothing to prepare.
+bool GetPreparedHeader(const std::string& filename, PreparedHeader* header) {
+  std::memset(header, 0, sizeof(*header));
+  std::memcpy(header->magic, kPreparedMagic, sizeof(kPreparedMagic));
+  std::ifstream file(filename, std::ios::binary);
+  unsigned char id[2];
+  if (!file.read(reinterpret_cast<char*>(id), sizeof(id))) return false;
+  if (id[0] != 0x1f || id[1] != 0x8b) return false;
+  unsigned char trailer[8];
+  if (!file.seekg(-8, std::ios::end) ||
+      !file.read(reinterpret_cast<char*>(trailer), sizeof(trailer))) {
+    return false;
+  }
+  // The trailer is little endian.
+  for (int i = 3; i >= 0; i--) {
+    header->source_crc = (header->source_crc << 8) | trailer[i];
+    header->source_isize = (header->source_isize << 8) | trailer[i + 4];
+  }
+  header->source_size = GetFileSize(filename);
+  header->source_time = GetFileTime(filename);
+  return true;
+}
+
+void WritePreparedFile(const std::string& filename,
+                       const PreparedHeader& header,
+                       const std::string& buffer) {
+  // Processes loading the same weights may all write it, each to its own file.
+  const std::string tmp_filename =
+      filename + "." + std::to_string(std::random_device()()) + ".tmp";
+  {
+    std::ofstream out(tmp_filename, std::ios::binary | std::ios::trunc);
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    out.write(buffer.data(), buffer.size());
+    if (!out) {
+      CERR << "Cannot write prepared weights file " << tmp_filename;
+      std::remove(tmp_filename.c_str());
+      return;
+    }
+  }
+  try {
+    RenameFile(tmp_filename, filename);
+  } catch (const Exception& e) {
+    CERR << e.what();
+    std::remove(tmp_filename.c_str());
+  }
+}
 
 std::string DecompressGzip(const std::string& filename) {
   const int kStartingSize = 8 * 1024 * 1024;  // 8M
@@ -78,12 +140,12 @@ std::string DecompressGzip(const std::string& filename) {
   return buffer;
 }
 
-WeightsFile ParseWeightsProto(const std::string& buffer) {
+WeightsFile ParseWeightsProto(const char* data, size_t size) {
   WeightsFile net;
   using namespace google::protobuf::io;
   using nf = pblczero::NetworkFormat;
 
-  ArrayInputStream raw_input_stream(buffer.data(), buffer.size());
+  ArrayInputStream raw_input_stream(data, size);
   CodedInputStream input_stream(&raw_input_stream);
   // Set protobuf limit to 2GB, print warning at 500MB.
   input_stream.SetTotalBytesLimit(2000 * 1000000, 500 * 1000000);
@@ -142,8 +204,26 @@ WeightsFile ParseWeightsProto(const std::string& buffer) {
 
 }  // namespace
 
-WeightsFile LoadWeightsFromFile(const std::string& filename) {
-  FloatVectors vecs;
+WeightsFile LoadWeightsFromFile(const std::string& filename,
+                                bool use_prepared) {
+  PreparedHeader header;
+  const bool prepared = use_prepared && GetPreparedHeader(filename, &header);
+  const std::string prepared_filename = filename + ".prepared";
+  if (prepared) {
+    try {
+      // Parsed straight from the mapping, without decompressing or copying
+      // the whole file first.
+      MappedFile file(prepared_filename);
+      if (file.size() >= sizeof(header) &&
+          std::memcmp(file.data(), &header, sizeof(header)) == 0) {
+        return ParseWeightsProto(file.data() + sizeof(header),
+                                 file.size() - sizeof(header));
+      }
+    } catch (const Exception&) {
+      // Missing or broken, it's written again below.
+    }
+  }
+
   auto buffer = DecompressGzip(filename);
 
   if (buffer.size() < 2)
@@ -155,7 +235,9 @@ WeightsFile LoadWeightsFromFile(const std::string& filename) {
         "Text format weights files are no longer supported. Use a command line "
         "tool to convert it to the new format.");
 
-  return ParseWeightsProto(buffer);
+  auto net = ParseWeightsProto(buffer.data(), buffer.size());
+  if (prepared) WritePreparedFile(prepared_filename, header, buffer);
+  return net;
 }
 
 std::string DiscoverWeightsFile() {
@@ -40,8 +40,12 @@ using FloatVectors = std::vector<FloatVector>;
 
 using WeightsFile = pblczero::Net;
 
-// Read weights file and fill the weights structure.
-WeightsFile LoadWeightsFromFile(const std::string& filename);
+// Read weights file and fill the weights structure. With @use_prepared, a
+// gzipped file is decompressed once into a sidecar file, <filename>.prepared,
+// which is memory mapped and parsed directly by later loads as long as the
+// source file doesn't change.
+WeightsFile LoadWeightsFromFile(const std::string& filename,
+                                bool use_prepared = false);
 
 // Tries to find a file which looks like a weights file, and located in
 // directory of binary_name or one of subdirectories. If there are several such
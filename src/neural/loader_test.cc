@@ -0,0 +1,85 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2019 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "neural/loader.h"
+
+#include <gtest/gtest.h>
+#include <zlib.h>
+#include <cstdio>
+#include <fstream>
+#include <string>
+
+namespace lczero {
+
+namespace {
+void WriteGzippedNet(const std::string& filename, const std::string& params) {
+  WeightsFile net;
+  net.set_magic(0x1c0);
+  net.mutable_format()->set_weights_encoding(pblczero::Format::LINEAR16);
+  auto* layer = net.mutable_weights()->mutable_ip_pol_b();
+  layer->set_min_val(-1.0f);
+  layer->set_max_val(1.0f);
+  layer->set_params(params);
+  const std::string data = net.SerializeAsString();
+  const gzFile file = gzopen(filename.c_str(), "wb");
+  ASSERT_TRUE(file);
+  ASSERT_EQ(gzwrite(file, data.data(), data.size()),
+            static_cast<int>(data.size()));
+  gzclose(file);
+}
+}  // namespace
+
+TEST(LoadWeightsFromFile, PreparedFile) {
+  const std::string filename = "loader_test.pb.gz";
+  const std::string prepared = filename + ".prepared";
+  std::remove(prepared.c_str());
+  WriteGzippedNet(filename, std::string("\x01\x02\x03\x04", 4));
+
+  // Not written unless asked for.
+  LoadWeightsFromFile(filename);
+  EXPECT_FALSE(std::ifstream(prepared).good());
+
+  auto net = LoadWeightsFromFile(filename, true);
+  EXPECT_EQ(net.weights().ip_pol_b().params(), "\x01\x02\x03\x04");
+  ASSERT_TRUE(std::ifstream(prepared).good());
+  // Old nets get their format filled in from the prepared file as well.
+  net = LoadWeightsFromFile(filename, true);
+  EXPECT_EQ(net.weights().ip_pol_b().params(), "\x01\x02\x03\x04");
+  EXPECT_EQ(net.format().network_format().network(),
+            pblczero::NetworkFormat::NETWORK_CLASSICAL_WITH_HEADFORMAT);
+
+  // A changed source replaces the prepared file.
+  WriteGzippedNet(filename, std::string("\x05\x06\x07\x08\x09\x0a", 6));
+  net = LoadWeightsFromFile(filename, true);
+  EXPECT_EQ(net.weights().ip_pol_b().params(),
+            "\x05\x06\x07\x08\x09\x0a");
+
+  // A broken prepared file is not trusted.
+  {
+    std::ofstream out(prepared, std::ios::binary | std::ios::trunc);
+    out << "garbage";
+  }
+  net = LoadWeightsFromFile(filename, true);
+  EXPECT_EQ(net.weights().ip_pol_b().params(),
+            "\x05\x06\x07\x08\x09\x0a");
+
+  std::remove(filename.c_str());
+  std::remove(prepared.c_str());
+}
+
+}  // namespace lczero
@@ -0,0 +1,80 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2019 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+
+  If you modify this Program, or any covered work, by linking or
+  combining it with NVIDIA Corporation's libraries from the NVIDIA CUDA
+  Toolkit and the NVIDIA CUDA Deep Neural Network library (or a
+  modified version of those libraries), containing parts covered by the
+  terms of the respective license agreement, the licensors of this
+  Program grant you additional permission to convey the resulting work.
+*/
+
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <string>
+
+#include "neural/network_legacy.h"
+
+namespace lczero {
+namespace metal_backend {
+
+constexpr int kNumOutputPolicy = 1858;
+
+// Buffers of one evaluation, in memory shared by the CPU and the GPU: the
+// CPU writes the inputs and reads the outputs in place, the GPU uses them
+// without copies.
+struct MetalBuffers {
+  virtual ~MetalBuffers() = default;
+  // Expanded input planes, kInputPlanes * 64 floats per position.
+  float* input = nullptr;
+  // Softmaxed policy, kNumOutputPolicy per position.
+  float* policy = nullptr;
+  // WDL probabilities, or the value, per position.
+  float* value = nullptr;
+};
+
+// The network as an MPSGraph on a Metal device. Plain C++, so that only
+// metal_graph.mm is Objective-C++.
+class MetalGraph {
+ public:
+  // Builds the graph of @weights on the @gpu_id-th Metal device, computing
+  // in fp16 if @fp16.
+  MetalGraph(const LegacyWeights& weights, bool conv_policy, bool wdl,
+             bool fp16, int gpu_id);
+  ~MetalGraph();
+
+  std::string GetDeviceName() const;
+
+  std::unique_ptr<MetalBuffers> NewBuffers(int max_batch_size);
+
+  // Runs the first @batch_size positions of @buffers and returns at once.
+  // @done is called from a Metal thread once the outputs are in @buffers,
+  // with an error message if the evaluation failed.
+  void ComputeAsync(MetalBuffers* buffers, int batch_size,
+                    std::function<void(const std::string& error)> done);
+
+ private:
+  struct Impl;
+  std::unique_ptr<Impl> impl_;
+};
+
+}  // namespace metal_backend
+}  // namespace lczero
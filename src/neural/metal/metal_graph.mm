@@ -0,0 +1,331 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2019 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+
+  If you modify this Program, or any covered work, by linking or
+  combining it with NVIDIA Corporation's libraries from the NVIDIA CUDA
+  Toolkit and the NVIDIA CUDA Deep Neural Network library (or a
+  modified version of those libraries), containing parts covered by the
+  terms of the respective license agreement, the licensors of this
+  Program grant you additional permission to convey the resulting work.
+*/
+
+#import <Metal/Metal.h>
+#import <MetalPerformanceShadersGraph/MetalPerformanceShadersGraph.h>
+
+#include "neural/metal/metal_graph.h"
+
+#include <mutex>
+#include <vector>
+
+#include "neural/network.h"
+#include "neural/shared/policy_map.h"
+#include "utils/exception.h"
+#include "utils/fp16_utils.h"
+
+namespace lczero {
+namespace metal_backend {
+namespace {
+
+struct SharedBuffers : MetalBuffers {
+  id<MTLBuffer> input_buffer;
+  id<MTLBuffer> policy_buffer;
+  id<MTLBuffer> value_buffer;
+};
+
+// Layers as MPSGraph operations, on NCHW tensors of @type_. Weights become
+// constants of @type_, which lets the graph compiler fold them.
+class GraphBuilder {
+ public:
+  GraphBuilder(MPSGraph* graph, MPSDataType type) : graph_(graph), type_(type) {}
+
+  MPSGraphTensor* Constant(const std::vector<float>& data,
+                           NSArray<NSNumber*>* shape) {
+    NSData* bytes;
+    if (type_ == MPSDataTypeFloat16) {
+      std::vector<uint16_t> half(data.size());
+      for (size_t i = 0; i < data.size(); i++) half[i] = FP32toFP16(data[i]);
+      bytes = [NSData dataWithBytes:half.data()
+                             length:half.size() * sizeof(uint16_t)];
+    } else {
+      bytes = [NSData dataWithBytes:data.data()
+                             length:data.size() * sizeof(float)];
+    }
+    return [graph_ constantWithData:bytes shape:shape dataType:type_];
+  }
+
+  // Same padding convolution with bias.
+  MPSGraphTensor* Conv(MPSGraphTensor* x, const LegacyWeights::ConvBlock& block,
+                       int kernel, bool relu) {
+    const int outputs = block.biases.size();
+    const int inputs = block.weights.size() / (outputs * kernel * kernel);
+    MPSGraphConvolution2DOpDescriptor* desc =
+        [MPSGraphConvolution2DOpDescriptor
+            descriptorWithStrideInX:1
+                          strideInY:1
+                    dilationRateInX:1
+                    dilationRateInY:1
+                             groups:1
+                       paddingStyle:MPSGraphPaddingStyleTF_SAME
+                         dataLayout:MPSGraphTensorNamedDataLayoutNCHW
+                      weightsLayout:MPSGraphTensorNamedDataLayoutOIHW];
+    MPSGraphTensor* weights =
+        Constant(block.weights, @[ @(outputs), @(inputs), @(kernel), @(kernel) ]);
+    MPSGraphTensor* y = [graph_ convolution2DWithSourceTensor:x
+                                                weightsTensor:weights
+                                                   descriptor:desc
+                                                         name:nil];
+    y = [graph_ additionWithPrimaryTensor:y
+                          secondaryTensor:Constant(block.biases,
+                                                   @[ @1, @(outputs), @1, @1 ])
+                                     name:nil];
+    return relu ? [graph_ reLUWithTensor:y name:nil] : y;
+  }
+
+  // Fully connected layer of [outputs, inputs] weights on [N, inputs].
+  MPSGraphTensor* FC(MPSGraphTensor* x, const LegacyWeights::Vec& weights,
+                     const LegacyWeights::Vec& biases, bool relu) {
+    const int outputs = biases.size();
+    const int inputs = weights.size() / outputs;
+    MPSGraphTensor* w = [graph_
+        transposeTensor:Constant(weights, @[ @(outputs), @(inputs) ])
+              dimension:0
+          withDimension:1
+                   name:nil];
+    MPSGraphTensor* y = [graph_ matrixMultiplicationWithPrimaryTensor:x
+                                                      secondaryTensor:w
+                                                                 name:nil];
+    y = [graph_ additionWithPrimaryTensor:y
+                          secondaryTensor:Constant(biases, @[ @1, @(outputs) ])
+                                     name:nil];
+    return relu ? [graph_ reLUWithTensor:y name:nil] : y;
+  }
+
+  // [N, C, 8, 8] to [N, C * 64], in the order of the weights.
+  MPSGraphTensor* Flatten(MPSGraphTensor* x, int channels) {
+    return [graph_ reshapeTensor:x withShape:@[ @-1, @(channels * 64) ] name:nil];
+  }
+
+  // Squeeze-excitation of @x, which has the bias of the convolution before,
+  // followed by the residual connection and relu.
+  MPSGraphTensor* SE(MPSGraphTensor* x, MPSGraphTensor* skip,
+                     const LegacyWeights::SEunit& se, int channels) {
+    MPSGraphTensor* pooled = [graph_ meanOfTensor:x axes:@[ @2, @3 ] name:nil];
+    pooled = [graph_ reshapeTensor:pooled withShape:@[ @-1, @(channels) ] name:nil];
+    MPSGraphTensor* fc = FC(FC(pooled, se.w1, se.b1, true), se.w2, se.b2, false);
+    MPSGraphTensor* gammas = [graph_ sliceTensor:fc
+                                       dimension:1
+                                           start:0
+                                          length:channels
+                                            name:nil];
+    MPSGraphTensor* betas = [graph_ sliceTensor:fc
+                                      dimension:1
+                                          start:channels
+                                         length:channels
+                                           name:nil];
+    NSArray<NSNumber*>* shape = @[ @-1, @(channels), @1, @1 ];
+    gammas = [graph_ reshapeTensor:[graph_ sigmoidWithTensor:gammas name:nil]
+                         withShape:shape
+                              name:nil];
+    betas = [graph_ reshapeTensor:betas withShape:shape name:nil];
+    MPSGraphTensor* y = [graph_ multiplicationWithPrimaryTensor:x
+                                                secondaryTensor:gammas
+                                                           name:nil];
+    y = [graph_ additionWithPrimaryTensor:y secondaryTensor:betas name:nil];
+    y = [graph_ additionWithPrimaryTensor:y secondaryTensor:skip name:nil];
+    return [graph_ reLUWithTensor:y name:nil];
+  }
+
+  // Picks the kNumOutputPolicy moves out of the flattened policy planes.
+  MPSGraphTensor* PolicyMap(MPSGraphTensor* x) {
+    std::vector<int32_t> indices(kNumOutputPolicy);
+    const int size = sizeof(kConvPolicyMap) / sizeof(kConvPolicyMap[0]);
+    for (int i = 0; i < size; i++) {
+      if (kConvPolicyMap[i] >= 0) indices[kConvPolicyMap[i]] = i;
+    }
+    MPSGraphTensor* index_tensor = [graph_
+        constantWithData:[NSData dataWithBytes:indices.data()
+                                        length:indices.size() * sizeof(int32_t)]
+                   shape:@[ @(kNumOutputPolicy) ]
+                dataType:MPSDataTypeInt32];
+    return [graph_ gatherWithUpdatesTensor:x
+                             indicesTensor:index_tensor
+                                      axis:1
+                           batchDimensions:0
+                                      name:nil];
+  }
+
+  // Softmax over the second dimension, in fp32.
+  MPSGraphTensor* Softmax(MPSGraphTensor* x) {
+    return [graph_ softMaxWithTensor:ToFloat(x) axis:1 name:nil];
+  }
+
+  MPSGraphTensor* ToFloat(MPSGraphTensor* x) {
+    if (type_ == MPSDataTypeFloat32) return x;
+    return [graph_ castTensor:x toType:MPSDataTypeFloat32 name:nil];
+  }
+
+  MPSGraphTensor* FromFloat(MPSGraphTensor* x) {
+    if (type_ == MPSDataTypeFloat32) return x;
+    return [graph_ castTensor:x toType:type_ name:nil];
+  }
+
+ private:
+  MPSGraph* const graph_;
+  const MPSDataType type_;
+};
+
+}  // namespace
+
+struct MetalGraph::Impl {
+  id<MTLDevice> device;
+  id<MTLCommandQueue> queue;
+  MPSGraph* graph;
+  MPSGraphTensor* input;
+  MPSGraphTensor* policy;
+  MPSGraphTensor* value;
+  int value_size;
+  // Encoding into the graph from several threads at once isn't safe.
+  std::mutex mutex;
+};
+
+MetalGraph::MetalGraph(const LegacyWeights& weights, bool conv_policy,
+                       bool wdl, bool fp16, int gpu_id)
+    : impl_(new Impl) {
+  if (@available(macOS 12.0, *)) {
+  } else {
+    throw Exception("Metal backend needs macOS 12 or newer");
+  }
+  NSArray<id<MTLDevice>>* devices = MTLCopyAllDevices();
+  if (gpu_id < 0 || gpu_id >= static_cast<int>(devices.count)) {
+    throw Exception("Invalid Metal device: " + std::to_string(gpu_id));
+  }
+  impl_->device = devices[gpu_id];
+  impl_->queue = [impl_->device newCommandQueue];
+  impl_->graph = [MPSGraph new];
+  impl_->value_size = wdl ? 3 : 1;
+
+  GraphBuilder builder(impl_->graph,
+                       fp16 ? MPSDataTypeFloat16 : MPSDataTypeFloat32);
+  const int filters = weights.input.biases.size();
+  impl_->input = [impl_->graph placeholderWithShape:@[ @-1, @(kInputPlanes), @8, @8 ]
+                                           dataType:MPSDataTypeFloat32
+                                               name:@"input"];
+
+  // Input convolution and residual tower.
+  MPSGraphTensor* flow =
+      builder.Conv(builder.FromFloat(impl_->input), weights.input, 3, true);
+  for (const auto& residual : weights.residual) {
+    MPSGraphTensor* conv = builder.Conv(flow, residual.conv1, 3, true);
+    conv = builder.Conv(conv, residual.conv2, 3, false);
+    if (residual.has_se) {
+      flow = builder.SE(conv, flow, residual.se, filters);
+    } else {
+      flow = [impl_->graph
+          reLUWithTensor:[impl_->graph additionWithPrimaryTensor:conv
+                                                 secondaryTensor:flow
+                                                            name:nil]
+                    name:nil];
+    }
+  }
+
+  // Policy head.
+  MPSGraphTensor* policy;
+  if (conv_policy) {
+    policy = builder.Conv(flow, weights.policy1, 3, true);
+    policy = builder.Conv(policy, weights.policy, 3, false);
+    policy = builder.PolicyMap(
+        builder.Flatten(policy, weights.policy.biases.size()));
+  } else {
+    policy = builder.Conv(flow, weights.policy, 1, true);
+    policy = builder.FC(builder.Flatten(policy, weights.policy.biases.size()),
+                        weights.ip_pol_w, weights.ip_pol_b, false);
+  }
+  impl_->policy = builder.Softmax(policy);
+
+  // Value head.
+  MPSGraphTensor* value = builder.Conv(flow, weights.value, 1, true);
+  value = builder.FC(builder.Flatten(value, weights.value.biases.size()),
+                     weights.ip1_val_w, weights.ip1_val_b, true);
+  value = builder.FC(value, weights.ip2_val_w, weights.ip2_val_b, false);
+  impl_->value = wdl ? builder.Softmax(value)
+                     : [impl_->graph tanhWithTensor:builder.ToFloat(value)
+                                               name:nil];
+}
+
+MetalGraph::~MetalGraph() = default;
+
+std::string MetalGraph::GetDeviceName() const {
+  return [impl_->device.name UTF8String];
+}
+
+std::unique_ptr<MetalBuffers> MetalGraph::NewBuffers(int max_batch_size) {
+  auto buffers = std::make_unique<SharedBuffers>();
+  const auto make_buffer = [&](size_t floats, float** contents) {
+    id<MTLBuffer> buffer =
+        [impl_->device newBufferWithLength:floats * max_batch_size * sizeof(float)
+                                   options:MTLResourceStorageModeShared];
+    if (!buffer) throw Exception("Cannot allocate Metal buffers");
+    *contents = static_cast<float*>(buffer.contents);
+    return buffer;
+  };
+  buffers->input_buffer = make_buffer(kInputPlanes * 64, &buffers->input);
+  buffers->policy_buffer = make_buffer(kNumOutputPolicy, &buffers->policy);
+  buffers->value_buffer = make_buffer(impl_->value_size, &buffers->value);
+  return std::move(buffers);
+}
+
+void MetalGraph::ComputeAsync(
+    MetalBuffers* buffers, int batch_size,
+    std::function<void(const std::string& error)> done) {
+  auto* shared = static_cast<SharedBuffers*>(buffers);
+  @autoreleasepool {
+    MPSGraphTensorData* input = [[MPSGraphTensorData alloc]
+        initWithMTLBuffer:shared->input_buffer
+                    shape:@[ @(batch_size), @(kInputPlanes), @8, @8 ]
+                 dataType:MPSDataTypeFloat32];
+    MPSGraphTensorData* policy = [[MPSGraphTensorData alloc]
+        initWithMTLBuffer:shared->policy_buffer
+                    shape:@[ @(batch_size), @(kNumOutputPolicy) ]
+                 dataType:MPSDataTypeFloat32];
+    MPSGraphTensorData* value = [[MPSGraphTensorData alloc]
+        initWithMTLBuffer:shared->value_buffer
+                    shape:@[ @(batch_size), @(impl_->value_size) ]
+                 dataType:MPSDataTypeFloat32];
+
+    // The results go straight into the shared buffers.
+    MPSGraphExecutionDescriptor* desc = [MPSGraphExecutionDescriptor new];
+    __block auto callback = std::move(done);
+    desc.completionHandler = ^(MPSGraphTensorDataDictionary*, NSError* error) {
+      callback(error ? std::string([error.localizedDescription UTF8String])
+                     : std::string());
+    };
+    std::lock_guard<std::mutex> lock(impl_->mutex);
+    [impl_->graph runAsyncWithMTLCommandQueue:impl_->queue
+                                        feeds:@{impl_->input : input}
+                             targetOperations:nil
+                            resultsDictionary:@{
+                              impl_->policy : policy,
+                              impl_->value : value
+                            }
+                          executionDescriptor:desc];
+  }
+}
+
+}  // namespace metal_backend
+}  // namespace lczero
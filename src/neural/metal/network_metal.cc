@@ -0,0 +1,226 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2019 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+
+  If you modify this Program, or any covered work, by linking or
+  combining it with NVIDIA Corporation's libraries from the NVIDIA CUDA
+  Toolkit and the NVIDIA CUDA Deep Neural Network library (or a
+  modified version of those libraries), containing parts covered by the
+  terms of the respective license agreement, the licensors of this
+  Program grant you additional permission to convey the resulting work.
+*/
+
+// Metal backend for Apple GPUs. The network runs as an MPSGraph, see
+// metal_graph.mm, on inputs and outputs in unified memory.
+
+#include <algorithm>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "neural/factory.h"
+#include "neural/metal/metal_graph.h"
+#include "neural/network_legacy.h"
+#include "neural/shared/planes.h"
+#include "utils/exception.h"
+#include "utils/logging.h"
+#include "utils/trace.h"
+
+namespace lczero {
+namespace {
+
+using metal_backend::kNumOutputPolicy;
+using metal_backend::MetalBuffers;
+using metal_backend::MetalGraph;
+
+// MPSGraph compiles the graph for every batch size it sees, batches are
+// padded up to a multiple of this to see fewer of them.
+constexpr int kBatchGranularity = 8;
+
+class MetalNetwork;
+
+class MetalComputation : public NetworkComputation {
+ public:
+  MetalComputation(MetalNetwork* network, bool wdl);
+  ~MetalComputation() override;
+
+  void AddInput(InputPlanes&& input) override;
+
+  void ComputeBlocking() override;
+  void ComputeAsync(std::function<void()> callback) override;
+
+  int GetBatchSize() const override { return batch_size_; }
+
+  float GetQVal(int sample) const override {
+    if (wdl_) {
+      auto w = buffers_->value[3 * sample + 0];
+      auto l = buffers_->value[3 * sample + 2];
+      return w - l;
+    }
+    return buffers_->value[sample];
+  }
+
+  float GetDVal(int sample) const override {
+    if (wdl_) return buffers_->value[3 * sample + 1];
+    return 0.0f;
+  }
+
+  float GetPVal(int sample, int move_id) const override {
+    return buffers_->policy[sample * kNumOutputPolicy + move_id];
+  }
+
+ private:
+  MetalNetwork* network_;
+  std::unique_ptr<MetalBuffers> buffers_;
+  int batch_size_ = 0;
+  bool wdl_;
+};
+
+class MetalNetwork : public Network {
+ public:
+  MetalNetwork(const WeightsFile& file, const OptionsDict& options) {
+    const LegacyWeights weights(file.weights());
+    wdl_ = file.format().network_format().value() ==
+           pblczero::NetworkFormat::VALUE_WDL;
+    const bool conv_policy = file.format().network_format().policy() ==
+                             pblczero::NetworkFormat::POLICY_CONVOLUTION;
+    max_batch_size_ = options.GetOrDefault<int>("max_batch", 1024);
+    const bool fp16 = options.GetOrDefault<bool>("fp16", true);
+    graph_ = std::make_unique<MetalGraph>(weights, conv_policy, wdl_, fp16,
+                                          options.GetOrDefault<int>("gpu", 0));
+    CERR << "Metal device: " << graph_->GetDeviceName() << ", "
+         << (fp16 ? "fp16" : "fp32");
+  }
+
+  std::unique_ptr<NetworkComputation> NewComputation() override {
+    return std::make_unique<MetalComputation>(this, wdl_);
+  }
+
+  int GetMaxBatchSize() const { return max_batch_size_; }
+
+  // Pads the batch and starts its evaluation, see MetalGraph::ComputeAsync().
+  void Compute(MetalBuffers* buffers, int batch_size,
+               std::function<void(const std::string& error)> done) {
+    TRACE_SCOPE("metal enqueue");
+    const int padded =
+        std::min(max_batch_size_, (batch_size + kBatchGranularity - 1) /
+                                      kBatchGranularity * kBatchGranularity);
+    graph_->ComputeAsync(buffers, padded, std::move(done));
+  }
+
+  std::unique_ptr<MetalBuffers> GetBuffers() {
+    {
+      std::lock_guard<std::mutex> lock(buffers_mutex_);
+      if (!free_buffers_.empty()) {
+        auto buffers = std::move(free_buffers_.back());
+        free_buffers_.pop_back();
+        return buffers;
+      }
+    }
+    return graph_->NewBuffers(max_batch_size_);
+  }
+
+  void ReleaseBuffers(std::unique_ptr<MetalBuffers> buffers) {
+    std::lock_guard<std::mutex> lock(buffers_mutex_);
+    free_buffers_.push_back(std::move(buffers));
+  }
+
+ private:
+  std::unique_ptr<MetalGraph> graph_;
+  int max_batch_size_;
+  bool wdl_;
+  std::mutex buffers_mutex_;
+  std::vector<std::unique_ptr<MetalBuffers>> free_buffers_;
+};
+
+MetalComputation::MetalComputation(MetalNetwork* network, bool wdl)
+    : network_(network), buffers_(network->GetBuffers()), wdl_(wdl) {}
+
+MetalComputation::~MetalComputation() {
+  network_->ReleaseBuffers(std::move(buffers_));
+}
+
+void MetalComputation::AddInput(InputPlanes&& input) {
+  if (batch_size_ == network_->GetMaxBatchSize()) {
+    throw Exception("Batch is larger than max_batch");
+  }
+  ExpandPlanes(input, &buffers_->input[batch_size_ * kInputPlanes * 64]);
+  batch_size_++;
+}
+
+void MetalComputation::ComputeBlocking() {
+  if (batch_size_ == 0) return;
+  TRACE_SCOPE("metal compute");
+  std::mutex mutex;
+  std::condition_variable cv;
+  bool finished = false;
+  std::string error;
+  network_->Compute(buffers_.get(), batch_size_,
+                    [&](const std::string& message) {
+                      // Notified under the lock, as the waiting thread
+                      // destroys cv once woken.
+                      std::lock_guard<std::mutex> lock(mutex);
+                      error = message;
+                      finished = true;
+                      cv.notify_one();
+                    });
+  std::unique_lock<std::mutex> lock(mutex);
+  cv.wait(lock, [&]() { return finished; });
+  if (!error.empty()) throw Exception("Metal: " + error);
+}
+
+void MetalComputation::ComputeAsync(std::function<void()> callback) {
+  if (batch_size_ == 0) {
+    callback();
+    return;
+  }
+  network_->Compute(buffers_.get(), batch_size_,
+                    [callback](const std::string& error) {
+                      if (!error.empty()) CERR << "Metal: " << error;
+                      callback();
+                    });
+}
+
+std::unique_ptr<Network> MakeMetalNetwork(const WeightsFile& weights,
+                                          const OptionsDict& options) {
+  const auto& format = weights.format().network_format();
+  if (format.network() !=
+          pblczero::NetworkFormat::NETWORK_CLASSICAL_WITH_HEADFORMAT &&
+      format.network() != pblczero::NetworkFormat::NETWORK_SE_WITH_HEADFORMAT) {
+    throw Exception("Network format " + std::to_string(format.network()) +
+                    " is not supported by Metal backend.");
+  }
+  if (format.policy() != pblczero::NetworkFormat::POLICY_CLASSICAL &&
+      format.policy() != pblczero::NetworkFormat::POLICY_CONVOLUTION) {
+    throw Exception("Policy format " + std::to_string(format.policy()) +
+                    " is not supported by Metal backend.");
+  }
+  if (format.value() != pblczero::NetworkFormat::VALUE_CLASSICAL &&
+      format.value() != pblczero::NetworkFormat::VALUE_WDL) {
+    throw Exception("Value format " + std::to_string(format.value()) +
+                    " is not supported by Metal backend.");
+  }
+  return std::make_unique<MetalNetwork>(weights, options);
+}
+
+}  // namespace
+
+REGISTER_NETWORK("metal", MakeMetalNetwork, 105)
+
+}  // namespace lczero
@@ -27,8 +27,13 @@
 
 #pragma once
 
+#include <array>
+#include <cstdint>
+#include <exception>
+#include <functional>
 #include <memory>
 #include <vector>
+#include "utils/threadpool.h"
 
 namespace lczero {
 
@@ -47,15 +52,63 @@ struct InputPlane {
   std::uint64_t mask = 0ull;
   float value = 1.0f;
 };
-using InputPlanes = std::vector<InputPlane>;
+// Planes of one position, stored inline so that a position travels through
+// the cache, the mux/demux layers and into the backend batch buffers without
+// heap allocations.
+using InputPlanes = std::array<InputPlane, kInputPlanes>;
+
+// How urgently the results of a computation are needed, for backends which
+// serve several searches at once.
+enum class ComputationPriority {
+  // Searches whose move is waited for.
+  kNormal,
+  // Pondering, infinite analysis and the like, served when the others leave
+  // room.
+  kBackground,
+};
 
 // An interface to implement by computing backends.
 class NetworkComputation {
  public:
   // Adds a sample to the batch.
   virtual void AddInput(InputPlanes&& input) = 0;
+  // Adds a sample with the NN indices of the moves whose priors are needed.
+  // Networks which gather the policy themselves, see
+  // Network::GathersLegalPolicy(), then return just these priors from
+  // GetLegalPVal(), softmaxed over them with @softmax_temp, and GetPVal() is
+  // not available for the sample. Others ignore the moves.
+  virtual void AddInputWithMoves(InputPlanes&& input,
+                                 const uint16_t* /*moves*/, int /*num_moves*/,
+                                 float /*softmax_temp*/) {
+    AddInput(std::move(input));
+  }
+  // Sets how urgent the computation is, before it's computed. Backends which
+  // don't share a device between searches ignore it.
+  virtual void SetPriority(ComputationPriority /*priority*/) {}
   // Do the computation.
   virtual void ComputeBlocking() = 0;
+  // Starts the computation and returns immediately. @callback is called, from
+  // an arbitrary thread, once the results are available. The computation must
+  // not be destroyed before that. Default implementation runs
+  // ComputeBlocking() on the shared thread pool, and keeps what it throws for
+  // CheckAsyncError().
+  virtual void ComputeAsync(std::function<void()> callback) {
+    ThreadPool::Default().Add([this, callback]() {
+      try {
+        ComputeBlocking();
+      } catch (...) {
+        async_error_ = std::current_exception();
+      }
+      callback();
+    });
+  }
+  // Once the callback of ComputeAsync() was called, throws the error the
+  // computation failed with, if any; its results are not to be used then.
+  // Backends which override ComputeAsync() override this too, unless their
+  // asynchronous computations don't fail that way.
+  virtual void CheckAsyncError() const {
+    if (async_error_) std::rethrow_exception(async_error_);
+  }
   // Returns how many times AddInput() was called.
   virtual int GetBatchSize() const = 0;
   // Returns Q value of @sample.
@@ -63,12 +116,24 @@ class NetworkComputation {
   virtual float GetDVal(int sample) const = 0;
   // Returns P value @move_id of @sample.
   virtual float GetPVal(int sample, int move_id) const = 0;
+  // Returns the prior of the @move_index-th move passed to
+  // AddInputWithMoves() for @sample.
+  virtual float GetLegalPVal(int /*sample*/, int /*move_index*/) const {
+    return 0.0f;
+  }
   virtual ~NetworkComputation() {}
+
+ private:
+  // What the default ComputeAsync() threw.
+  std::exception_ptr async_error_;
 };
 
 class Network {
  public:
   virtual std::unique_ptr<NetworkComputation> NewComputation() = 0;
+  // Whether computations pick and softmax the priors of the moves given to
+  // AddInputWithMoves() themselves, so that only those leave the backend.
+  virtual bool GathersLegalPolicy() const { return false; }
   virtual ~Network(){};
 };
 
@@ -27,18 +27,41 @@
 
 #include <algorithm>
 #include <cmath>
+#include <condition_variable>
+#include <deque>
 #include <iomanip>
+#include <mutex>
+#include <thread>
 
 #include "neural/factory.h"
 #include "neural/network.h"
+#include "utils/affinity.h"
 #include "utils/histogram.h"
 #include "utils/logging.h"
+#include "utils/metrics.h"
 #include "utils/random.h"
 
 namespace lczero {
 
 namespace {
 
+Counter gCheckedPositionsMetric("lc0_check_positions_total",
+                                "Positions compared by the check backend.");
+Counter gCheckFailuresMetric(
+    "lc0_check_failures_total",
+    "Positions on which the check backend found the outputs to differ.");
+Counter gCheckDroppedMetric(
+    "lc0_check_dropped_total",
+    "Sampled positions not compared as the reference backend lagged behind.");
+Gauge gCheckValueErrorMetric(
+    "lc0_check_value_error",
+    "Largest absolute value error of the latest asynchronous check.");
+Gauge gCheckPolicyErrorMetric(
+    "lc0_check_policy_error",
+    "Largest absolute policy error of the latest asynchronous check.");
+
+constexpr int kNumOutputPolicies = 1858;
+
 class CheckNetwork;
 
 enum CheckMode {
@@ -51,6 +74,21 @@ struct CheckParams {
   CheckMode mode;
   double absolute_tolerance;
   double relative_tolerance;
+
+  bool IsAlmostEqual(double a, double b) const {
+    return std::abs(a - b) <=
+           std::max(relative_tolerance * std::max(std::abs(a), std::abs(b)),
+                    absolute_tolerance);
+  }
+};
+
+// Positions sampled from a batch with the work backend's outputs for them,
+// to compare against the reference backend later.
+struct CheckJob {
+  std::vector<InputPlanes> planes;
+  std::vector<float> q;
+  // kNumOutputPolicies per position.
+  std::vector<float> policy;
 };
 
 class CheckComputation : public NetworkComputation {
@@ -63,10 +101,13 @@ class CheckComputation : public NetworkComputation {
         check_comp_(std::move(check_comp)) {}
 
   void AddInput(InputPlanes&& input) override {
-    InputPlanes x = input;
-    InputPlanes y = input;
-    work_comp_->AddInput(std::move(x));
-    check_comp_->AddInput(std::move(y));
+    work_comp_->AddInput(InputPlanes(input));
+    check_comp_->AddInput(std::move(input));
+  }
+
+  void SetPriority(ComputationPriority priority) override {
+    work_comp_->SetPriority(priority);
+    check_comp_->SetPriority(priority);
   }
 
   void ComputeBlocking() override {
@@ -102,7 +143,6 @@ class CheckComputation : public NetworkComputation {
   }
 
  private:
-  static constexpr int kNumOutputPolicies = 1858;
   const CheckParams& params_;
 
   void CheckOnly() const {
@@ -145,9 +185,7 @@ class CheckComputation : public NetworkComputation {
   }
 
   bool IsAlmostEqual(double a, double b) const {
-    return std::abs(a - b) <= std::max(params_.relative_tolerance *
-                                           std::max(std::abs(a), std::abs(b)),
-                                       params_.absolute_tolerance);
+    return params_.IsAlmostEqual(a, b);
   }
 
   void DisplayHistogram() {
@@ -228,6 +266,63 @@ class CheckComputation : public NetworkComputation {
   std::unique_ptr<NetworkComputation> check_comp_;
 };
 
+// Runs the batch on the work backend only, keeping a copy of up to
+// @positions randomly chosen inputs, all with 0. The network compares them on
+// the reference backend in the background.
+class SampledCheckComputation : public NetworkComputation {
+ public:
+  SampledCheckComputation(CheckNetwork* network,
+                          std::unique_ptr<NetworkComputation> work_comp,
+                          int positions)
+      : network_(network),
+        work_comp_(std::move(work_comp)),
+        positions_(positions) {}
+
+  void AddInput(InputPlanes&& input) override {
+    // Reservoir sampling, every input ends up kept with equal chance.
+    const int index = work_comp_->GetBatchSize();
+    if (positions_ == 0 || index < positions_) {
+      sampled_.push_back(index);
+      planes_.push_back(input);
+    } else {
+      const int slot = Random::Get().GetInt(0, index);
+      if (slot < positions_) {
+        sampled_[slot] = index;
+        planes_[slot] = input;
+      }
+    }
+    work_comp_->AddInput(std::move(input));
+  }
+
+  void SetPriority(ComputationPriority priority) override {
+    work_comp_->SetPriority(priority);
+  }
+
+  void ComputeBlocking() override;
+
+  int GetBatchSize() const override { return work_comp_->GetBatchSize(); }
+
+  float GetQVal(int sample) const override {
+    return work_comp_->GetQVal(sample);
+  }
+
+  float GetDVal(int sample) const override {
+    return work_comp_->GetDVal(sample);
+  }
+
+  float GetPVal(int sample, int move_id) const override {
+    return work_comp_->GetPVal(sample, move_id);
+  }
+
+ private:
+  CheckNetwork* network_;
+  std::unique_ptr<NetworkComputation> work_comp_;
+  const int positions_;
+  // Indices in the batch of the kept inputs.
+  std::vector<int> sampled_;
+  std::vector<InputPlanes> planes_;
+};
+
 class CheckNetwork : public Network {
  public:
   static constexpr CheckMode kDefaultMode = kCheckOnly;
@@ -306,11 +401,49 @@ class CheckNetwork : public Network {
     }
     CERR << "Check rate: " << std::fixed << std::setprecision(0)
          << 100 * check_frequency_ << "%.";
+
+    // In the background, the work backend never waits for the reference.
+    check_positions_ = options.GetOrDefault<int>("positions", 0);
+    if (options.GetOrDefault<bool>("async", false)) {
+      CERR << "Checking "
+           << (check_positions_ == 0 ? std::string("all")
+                                     : std::to_string(check_positions_))
+           << " positions of a batch in the background.";
+      checker_ = std::thread([this]() { CheckerLoop(); });
+    }
+  }
+
+  ~CheckNetwork() {
+    if (!checker_.joinable()) return;
+    {
+      std::lock_guard<std::mutex> lock(jobs_mutex_);
+      stop_ = true;
+    }
+    jobs_cv_.notify_one();
+    checker_.join();
+  }
+
+  // Queues @job for the reference backend, or drops it if too much is
+  // pending already.
+  void Submit(CheckJob&& job) {
+    {
+      std::lock_guard<std::mutex> lock(jobs_mutex_);
+      if (jobs_.size() < kMaxPendingJobs) {
+        jobs_.push_back(std::move(job));
+        jobs_cv_.notify_one();
+        return;
+      }
+    }
+    gCheckDroppedMetric.Add(job.planes.size());
   }
 
   std::unique_ptr<NetworkComputation> NewComputation() override {
     const double draw = Random::Get().GetDouble(1.0);
     const bool check = draw < check_frequency_;
+    if (check && checker_.joinable()) {
+      return std::make_unique<SampledCheckComputation>(
+          this, work_net_->NewComputation(), check_positions_);
+    }
     if (check) {
       std::unique_ptr<NetworkComputation> work_comp =
           work_net_->NewComputation();
@@ -325,12 +458,81 @@ class CheckNetwork : public Network {
  private:
   CheckParams params_;
 
+  // Compares the queued jobs on the reference backend, at low priority.
+  void CheckerLoop() {
+    LowerCurrentThreadPriority();
+    while (true) {
+      CheckJob job;
+      {
+        std::unique_lock<std::mutex> lock(jobs_mutex_);
+        jobs_cv_.wait(lock, [this]() { return stop_ || !jobs_.empty(); });
+        if (stop_) return;
+        job = std::move(jobs_.front());
+        jobs_.pop_front();
+      }
+      const int size = job.planes.size();
+      auto computation = check_net_->NewComputation();
+      for (auto& planes : job.planes) computation->AddInput(std::move(planes));
+      computation->ComputeBlocking();
+
+      double value_error = 0;
+      double policy_error = 0;
+      int failures = 0;
+      for (int i = 0; i < size; i++) {
+        const float q = computation->GetQVal(i);
+        bool equal = params_.IsAlmostEqual(job.q[i], q);
+        value_error = std::max<double>(value_error, std::abs(job.q[i] - q));
+        for (int j = 0; j < kNumOutputPolicies; j++) {
+          const float p1 = job.policy[i * kNumOutputPolicies + j];
+          const float p2 = computation->GetPVal(i, j);
+          equal &= params_.IsAlmostEqual(p1, p2);
+          policy_error = std::max<double>(policy_error, std::abs(p1 - p2));
+        }
+        if (!equal) failures++;
+      }
+      gCheckedPositionsMetric.Add(size);
+      gCheckFailuresMetric.Add(failures);
+      gCheckValueErrorMetric.Set(value_error);
+      gCheckPolicyErrorMetric.Set(policy_error);
+      if (failures > 0) {
+        CERR << "*** ERROR check failed for " << failures << " of " << size
+             << " sampled positions, maximum value error " << std::scientific
+             << std::setprecision(1) << value_error << ", policy error "
+             << policy_error << ".";
+      }
+    }
+  }
+
+  // Jobs queued beyond this are dropped.
+  static constexpr size_t kMaxPendingJobs = 16;
+
   // How frequently an iteration is checked (0: never, 1: always).
   double check_frequency_;
+  // Positions of a batch checked in the background, 0 for all.
+  int check_positions_ = 0;
   std::unique_ptr<Network> work_net_;
   std::unique_ptr<Network> check_net_;
+
+  std::mutex jobs_mutex_;
+  std::condition_variable jobs_cv_;
+  std::deque<CheckJob> jobs_;
+  bool stop_ = false;
+  std::thread checker_;
 };
 
+void SampledCheckComputation::ComputeBlocking() {
+  work_comp_->ComputeBlocking();
+  CheckJob job;
+  for (const int sample : sampled_) {
+    job.q.push_back(work_comp_->GetQVal(sample));
+    for (int j = 0; j < kNumOutputPolicies; j++) {
+      job.policy.push_back(work_comp_->GetPVal(sample, j));
+    }
+  }
+  job.planes = std::move(planes_);
+  network_->Submit(std::move(job));
+}
+
 std::unique_ptr<Network> MakeCheckNetwork(const WeightsFile& weights,
                                           const OptionsDict& options) {
   return std::make_unique<CheckNetwork>(weights, options);
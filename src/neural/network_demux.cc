@@ -27,71 +27,111 @@
 
 #include "neural/factory.h"
 
+#include <algorithm>
+#include <chrono>
 #include <condition_variable>
-#include <queue>
+#include <numeric>
 #include <thread>
+#include "utils/affinity.h"
 #include "utils/exception.h"
+#include "utils/mpmc_queue.h"
+#include "utils/trace.h"
 
 namespace lczero {
 namespace {
 
+// Splits waiting for a worker; Enqueue() yields while it's full.
+const size_t kQueueCapacity = 1024;
+
 class DemuxingNetwork;
+class DemuxingComputation;
+
+// Part @part of the computation, to be computed by network @network.
+struct Split {
+  DemuxingComputation* computation = nullptr;
+  int part = 0;
+  int network = 0;
+};
+
 class DemuxingComputation : public NetworkComputation {
  public:
   DemuxingComputation(DemuxingNetwork* network) : network_(network) {}
 
-  void AddInput(InputPlanes&& input) override { planes_.emplace_back(input); }
+  void AddInput(InputPlanes&& input) override {
+    planes_.emplace_back(std::move(input));
+  }
+
+  void SetPriority(ComputationPriority priority) override {
+    priority_ = priority;
+  }
 
   void ComputeBlocking() override;
+  void ComputeAsync(std::function<void()> callback) override;
 
   int GetBatchSize() const override { return planes_.size(); }
 
   float GetQVal(int sample) const override {
-    const int idx = sample / partial_size_;
-    const int offset = sample % partial_size_;
-    return parents_[idx]->GetQVal(offset);
+    const int idx = PartOf(sample);
+    return parents_[idx]->GetQVal(sample - offsets_[idx]);
   }
 
   float GetDVal(int sample) const override {
-    int idx = sample / partial_size_;
-    int offset = sample % partial_size_;
-    return parents_[idx]->GetDVal(offset);
+    const int idx = PartOf(sample);
+    return parents_[idx]->GetDVal(sample - offsets_[idx]);
   }
 
   float GetPVal(int sample, int move_id) const override {
-    const int idx = sample / partial_size_;
-    const int offset = sample % partial_size_;
-    return parents_[idx]->GetPVal(offset, move_id);
+    const int idx = PartOf(sample);
+    return parents_[idx]->GetPVal(sample - offsets_[idx], move_id);
   }
 
   void NotifyComplete() {
-    std::unique_lock<std::mutex> lock(mutex_);
-    dataready_--;
-    if (dataready_ == 0) {
+    std::function<void()> callback;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      dataready_--;
+      if (dataready_ != 0) return;
+      callback = std::move(callback_);
       dataready_cv_.notify_one();
     }
+    // The callback may destroy this computation, so nothing is touched after.
+    if (callback) callback();
   }
 
-  NetworkComputation* AddParentFromNetwork(Network* network) {
+  NetworkComputation* AddParentFromNetwork(int part, Network* network) {
     std::unique_lock<std::mutex> lock(mutex_);
-    parents_.emplace_back(network->NewComputation());
-    const int cur_idx = (parents_.size() - 1) * partial_size_;
-    for (int i = cur_idx; i < std::min(GetBatchSize(), cur_idx + partial_size_);
-         i++) {
-      parents_.back()->AddInput(std::move(planes_[i]));
+    parents_[part] = network->NewComputation();
+    parents_[part]->SetPriority(priority_);
+    const int end = part + 1 < static_cast<int>(offsets_.size())
+                        ? offsets_[part + 1]
+                        : GetBatchSize();
+    for (int i = offsets_[part]; i < end; i++) {
+      parents_[part]->AddInput(std::move(planes_[i]));
     }
-    return parents_.back().get();
+    return parents_[part].get();
   }
 
  private:
+  int PartOf(int sample) const {
+    return std::upper_bound(offsets_.begin(), offsets_.end(), sample) -
+           offsets_.begin() - 1;
+  }
+
   std::vector<InputPlanes> planes_;
   DemuxingNetwork* network_;
+  ComputationPriority priority_ = ComputationPriority::kNormal;
   std::vector<std::unique_ptr<NetworkComputation>> parents_;
+  // First sample of every part.
+  std::vector<int> offsets_;
 
   std::mutex mutex_;
   std::condition_variable dataready_cv_;
   int dataready_ = 0;
-  int partial_size_ = 0;
+  // Set by ComputeAsync(), called when the last split completes.
+  std::function<void()> callback_;
+
+  // Splits the batch and enqueues the parts. Must be called with mutex_ held.
+  void EnqueueSplits();
 };
 
 class DemuxingNetwork : public Network {
@@ -109,18 +149,36 @@ class DemuxingNetwork : public Network {
     for (const auto& name : parents) {
       AddBackend(name, weights, options.GetSubdict(name));
     }
+    // Backends without a weight get 1 if any has one.
+    for (auto& weight : manual_weights_) {
+      if (weight > 0) {
+        for (auto& w : manual_weights_) {
+          if (w <= 0) w = 1.0;
+        }
+        break;
+      }
+    }
   }
 
   void AddBackend(const std::string& name, const WeightsFile& weights,
                   const OptionsDict& opts) {
     const int nn_threads = opts.GetOrDefault<int>("threads", 1);
     const std::string backend = opts.GetOrDefault<std::string>("backend", name);
+    // Share of the batch given to this backend. If no backend sets it, the
+    // shares follow the measured throughput instead.
+    manual_weights_.push_back(
+        opts.Exists<float>("weight") ? opts.Get<float>("weight")
+                                     : opts.GetOrDefault<int>("weight", 0));
+    seconds_per_position_.push_back(0.0);
 
     networks_.emplace_back(
         NetworkFactory::Get()->Create(backend, weights, opts));
 
     for (int i = 0; i < nn_threads; ++i) {
-      threads_.emplace_back([this]() { Worker(); });
+      threads_.emplace_back([this]() {
+        PinnedThread pinned(ThreadRole::kBackend);
+        Worker();
+      });
     }
   }
 
@@ -128,59 +186,87 @@ class DemuxingNetwork : public Network {
     return std::make_unique<DemuxingComputation>(this);
   }
 
-  void Enqueue(DemuxingComputation* computation) {
-    std::lock_guard<std::mutex> lock(mutex_);
-    queue_.push(computation);
-    cv_.notify_one();
+  void Enqueue(const Split& split) { queue_.Push(split); }
+
+  // Number of positions of a @batch_size batch to give to every backend.
+  std::vector<int> GetSplitSizes(int batch_size) {
+    const int count = networks_.size();
+    std::vector<double> weights(count);
+    if (manual_weights_[0] > 0) {
+      weights = manual_weights_;
+    } else {
+      std::lock_guard<std::mutex> lock(stats_mutex_);
+      // Unmeasured backends are assumed as fast as the fastest one.
+      double fastest = 0.0;
+      for (auto spp : seconds_per_position_) {
+        if (spp > 0 && (fastest == 0.0 || spp < fastest)) fastest = spp;
+      }
+      for (int i = 0; i < count; ++i) {
+        const double spp = seconds_per_position_[i];
+        weights[i] = spp > 0 ? fastest / spp : 1.0;
+      }
+    }
+
+    std::vector<int> sizes(count);
+    while (true) {
+      // Largest remainder apportionment of the batch.
+      const double total = std::accumulate(weights.begin(), weights.end(), 0.0);
+      std::vector<std::pair<double, int>> remainders;
+      int assigned = 0;
+      for (int i = 0; i < count; ++i) {
+        const double exact = batch_size * weights[i] / total;
+        sizes[i] = static_cast<int>(exact);
+        assigned += sizes[i];
+        if (weights[i] > 0) remainders.emplace_back(exact - sizes[i], i);
+      }
+      std::sort(remainders.rbegin(), remainders.rend());
+      for (int i = 0; assigned < batch_size; ++i, ++assigned) {
+        ++sizes[remainders[i].second];
+      }
+      // Drop the smallest share below the minimum split size, if there's
+      // another backend left, and try again.
+      if (remainders.size() < 2) break;
+      int smallest = -1;
+      for (const auto& remainder : remainders) {
+        const int i = remainder.second;
+        if (sizes[i] < std::min(batch_size, minimum_split_size_) &&
+            (smallest < 0 || sizes[i] < sizes[smallest])) {
+          smallest = i;
+        }
+      }
+      if (smallest < 0) break;
+      weights[smallest] = 0.0;
+      sizes[smallest] = 0;
+    }
+    return sizes;
   }
 
   ~DemuxingNetwork() {
     Abort();
     Wait();
     // Unstuck waiting computations.
-    while (!queue_.empty()) {
-      queue_.front()->NotifyComplete();
-      queue_.pop();
-    }
+    Split split;
+    while (queue_.TryPop(&split)) split.computation->NotifyComplete();
   }
 
   void Worker() {
-    // While Abort() is not called (and it can only be called from destructor).
-    while (!abort_) {
-      {
-        {
-          std::unique_lock<std::mutex> lock(mutex_);
-          // Wait until there's come work to compute.
-          cv_.wait(lock, [&] { return abort_ || !queue_.empty(); });
-          if (abort_) break;
-        }
-
-        // While there is a work in queue, process it.
-        while (true) {
-          DemuxingComputation* to_notify;
-          {
-            std::unique_lock<std::mutex> lock(mutex_);
-            if (queue_.empty()) break;
-            to_notify = queue_.front();
-            queue_.pop();
-          }
-          long long net_idx = ++(counter_) % networks_.size();
-          NetworkComputation* to_compute =
-              to_notify->AddParentFromNetwork(networks_[net_idx].get());
-          to_compute->ComputeBlocking();
-          to_notify->NotifyComplete();
-        }
-      }
+    Split split;
+    // Wait until there's come work to compute, until Abort() is called (and
+    // it can only be called from destructor).
+    while (queue_.Pop(&split)) {
+      NetworkComputation* to_compute = split.computation->AddParentFromNetwork(
+          split.part, networks_[split.network].get());
+      TRACE_SCOPE("demux compute");
+      const auto start = std::chrono::steady_clock::now();
+      to_compute->ComputeBlocking();
+      const std::chrono::duration<double> elapsed =
+          std::chrono::steady_clock::now() - start;
+      RecordLatency(split.network, to_compute->GetBatchSize(), elapsed.count());
+      split.computation->NotifyComplete();
     }
   }
 
-  void Abort() {
-    {
-      std::lock_guard<std::mutex> lock(mutex_);
-      abort_ = true;
-    }
-    cv_.notify_all();
-  }
+  void Abort() { queue_.Close(); }
 
   void Wait() {
     while (!threads_.empty()) {
@@ -189,35 +275,62 @@ class DemuxingNetwork : public Network {
     }
   }
 
+ private:
+  void RecordLatency(int network, int batch_size, double seconds) {
+    if (batch_size == 0) return;
+    std::lock_guard<std::mutex> lock(stats_mutex_);
+    double& spp = seconds_per_position_[network];
+    const double sample = seconds / batch_size;
+    spp = spp > 0 ? 0.9 * spp + 0.1 * sample : sample;
+  }
+
   std::vector<std::unique_ptr<Network>> networks_;
-  std::queue<DemuxingComputation*> queue_;
+  MpmcQueue<Split> queue_{kQueueCapacity};
   int minimum_split_size_ = 0;
-  std::atomic<long long> counter_;
-  bool abort_ = false;
+  std::vector<double> manual_weights_;
 
-  std::mutex mutex_;
-  std::condition_variable cv_;
+  std::mutex stats_mutex_;
+  // Moving average, 0 until measured.
+  std::vector<double> seconds_per_position_;
 
   std::vector<std::thread> threads_;
 };
 
-void DemuxingComputation::ComputeBlocking() {
-  if (GetBatchSize() == 0) return;
-  partial_size_ = (GetBatchSize() + network_->networks_.size() - 1) /
-                  network_->networks_.size();
-  if (partial_size_ < network_->minimum_split_size_) {
-    partial_size_ = std::min(GetBatchSize(), network_->minimum_split_size_);
+void DemuxingComputation::EnqueueSplits() {
+  const auto sizes = network_->GetSplitSizes(GetBatchSize());
+  std::vector<Split> splits;
+  offsets_.clear();
+  int offset = 0;
+  for (size_t i = 0; i < sizes.size(); i++) {
+    if (sizes[i] == 0) continue;
+    splits.push_back({this, static_cast<int>(offsets_.size()),
+                      static_cast<int>(i)});
+    offsets_.push_back(offset);
+    offset += sizes[i];
   }
-  const int splits = (GetBatchSize() + partial_size_ - 1) / partial_size_;
+  parents_.resize(splits.size());
+
+  dataready_ = splits.size();
+  for (const auto& split : splits) network_->Enqueue(split);
+}
 
+void DemuxingComputation::ComputeBlocking() {
+  if (GetBatchSize() == 0) return;
   std::unique_lock<std::mutex> lock(mutex_);
-  dataready_ = splits;
-  for (int j = 0; j < splits; j++) {
-    network_->Enqueue(this);
-  }
+  EnqueueSplits();
   dataready_cv_.wait(lock, [this]() { return dataready_ == 0; });
 }
 
+void DemuxingComputation::ComputeAsync(std::function<void()> callback) {
+  if (GetBatchSize() == 0) {
+    callback();
+    return;
+  }
+  std::unique_lock<std::mutex> lock(mutex_);
+  callback_ = std::move(callback);
+  EnqueueSplits();
+}
+
 std::unique_ptr<Network> MakeDemuxingNetwork(const WeightsFile& weights,
                                              const OptionsDict& options) {
   return std::make_unique<DemuxingNetwork>(weights, options);
@@ -27,22 +27,139 @@
 
 #include "neural/factory.h"
 
+#include <algorithm>
+#include <chrono>
 #include <condition_variable>
-#include <queue>
+#include <deque>
 #include <thread>
+#include "utils/affinity.h"
 #include "utils/exception.h"
+#include "utils/metrics.h"
+#include "utils/mpmc_queue.h"
+#include "utils/mutex.h"
+#include "utils/trace.h"
 
 namespace lczero {
 namespace {
 
+using Clock = std::chrono::steady_clock;
+
+// Computations waiting for a worker; Enqueue() yields while it's full.
+const size_t kQueueCapacity = 1024;
+
+Counter gNormalComputationsMetric(
+    "lc0_mux_computations_total",
+    "Computations of normal priority served by the multiplexing backend.");
+Counter gNormalLatencyMetric(
+    "lc0_mux_latency_microseconds_total",
+    "Time from enqueueing normal priority computations to having their "
+    "results in the multiplexing backend, summed.");
+Counter gBackgroundComputationsMetric(
+    "lc0_mux_background_computations_total",
+    "Computations of background priority served by the multiplexing backend.");
+Counter gBackgroundLatencyMetric(
+    "lc0_mux_background_latency_microseconds_total",
+    "Time from enqueueing background priority computations to having their "
+    "results in the multiplexing backend, summed.");
+
+// Keeps a moving average of the child backend latency per batch size bucket
+// (powers of two) and picks the batch size to gather for the next flush.
+class BatchLatencyModel {
+ public:
+  BatchLatencyModel(int max_batch, double max_latency)
+      : max_batch_(max_batch), max_latency_(max_latency) {
+    int buckets = 1;
+    while ((1 << (buckets - 1)) < max_batch) ++buckets;
+    buckets_.resize(buckets);
+  }
+
+  void Record(int batch_size, double seconds) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto& bucket = buckets_[BucketOf(batch_size)];
+    if (bucket.count == 0) {
+      bucket.size = batch_size;
+      bucket.seconds = seconds;
+    } else {
+      bucket.size = 0.9 * bucket.size + 0.1 * batch_size;
+      bucket.seconds = 0.9 * bucket.seconds + 0.1 * seconds;
+    }
+    ++bucket.count;
+  }
+
+  // Batch size with the best measured positions per second among those
+  // within the latency bound. When the best one is also the largest seen,
+  // the next bucket is tried, as it may be faster yet.
+  int Target() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    int best = -1;
+    int largest = -1;
+    for (size_t i = 0; i < buckets_.size(); ++i) {
+      const auto& bucket = buckets_[i];
+      if (bucket.count == 0) continue;
+      if (max_latency_ > 0 && bucket.seconds > max_latency_) continue;
+      largest = i;
+      if (best < 0 || Throughput(bucket) > Throughput(buckets_[best])) {
+        best = i;
+      }
+    }
+    if (best < 0) return max_batch_;
+    if (best == largest && best + 1 < static_cast<int>(buckets_.size())) {
+      ++best;
+    }
+    return std::min(1 << best, max_batch_);
+  }
+
+  // How long it's worth waiting for @target positions to arrive: not more
+  // than it takes to compute them.
+  std::chrono::microseconds MaxWait(int target,
+                                    std::chrono::microseconds limit) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    const auto& bucket = buckets_[BucketOf(target)];
+    if (bucket.count == 0) return limit;
+    return std::min(limit, std::chrono::microseconds(
+                               static_cast<int64_t>(bucket.seconds * 1e6)));
+  }
+
+ private:
+  struct Bucket {
+    double size = 0;
+    double seconds = 0;
+    int count = 0;
+  };
+
+  static double Throughput(const Bucket& bucket) {
+    return bucket.size / std::max(bucket.seconds, 1e-9);
+  }
+
+  int BucketOf(int batch_size) const {
+    int bucket = 0;
+    while ((1 << bucket) < batch_size) ++bucket;
+    return std::min(bucket, static_cast<int>(buckets_.size()) - 1);
+  }
+
+  const int max_batch_;
+  const double max_latency_;
+  std::mutex mutex_;
+  std::vector<Bucket> buckets_;
+};
+
 class MuxingNetwork;
 class MuxingComputation : public NetworkComputation {
  public:
   MuxingComputation(MuxingNetwork* network) : network_(network) {}
 
-  void AddInput(InputPlanes&& input) override { planes_.emplace_back(input); }
+  void AddInput(InputPlanes&& input) override {
+    planes_.emplace_back(std::move(input));
+  }
+
+  void SetPriority(ComputationPriority priority) override {
+    priority_ = priority;
+  }
+  ComputationPriority GetPriority() const { return priority_; }
+  Clock::time_point GetEnqueueTime() const { return enqueued_; }
 
   void ComputeBlocking() override;
+  void ComputeAsync(std::function<void()> callback) override;
 
   int GetBatchSize() const override { return planes_.size(); }
 
@@ -66,25 +183,50 @@ class MuxingComputation : public NetworkComputation {
   }
 
   void NotifyReady() {
-    std::unique_lock<std::mutex> lock(mutex_);
-    dataready_ = true;
-    dataready_cv_.notify_one();
+    const auto latency_us =
+        std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() -
+                                                              enqueued_)
+            .count();
+    if (priority_ == ComputationPriority::kBackground) {
+      gBackgroundComputationsMetric.Add();
+      gBackgroundLatencyMetric.Add(latency_us);
+    } else {
+      gNormalComputationsMetric.Add();
+      gNormalLatencyMetric.Add(latency_us);
+    }
+    std::function<void()> callback;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      dataready_ = true;
+      callback = std::move(callback_);
+      dataready_cv_.notify_one();
+    }
+    // The callback may destroy this computation, so nothing is touched after.
+    if (callback) callback();
   }
 
  private:
+  void Enqueue();
+
   std::vector<InputPlanes> planes_;
   MuxingNetwork* network_;
+  ComputationPriority priority_ = ComputationPriority::kNormal;
+  Clock::time_point enqueued_;
   std::shared_ptr<NetworkComputation> parent_;
   int idx_in_parent_ = 0;
 
   std::mutex mutex_;
   std::condition_variable dataready_cv_;
   bool dataready_ = false;
+  // Set by ComputeAsync(), called instead of waking up the waiter.
+  std::function<void()> callback_;
 };
 
 class MuxingNetwork : public Network {
  public:
-  MuxingNetwork(const WeightsFile& weights, const OptionsDict& options) {
+  MuxingNetwork(const WeightsFile& weights, const OptionsDict& options)
+      : background_wait_(std::chrono::milliseconds(
+            options.GetOrDefault<int>("background_wait_ms", 50))) {
     // int threads, int max_batch)
     //: network_(std::move(network)), max_batch_(max_batch) {
 
@@ -106,14 +248,26 @@ class MuxingNetwork : public Network {
     const int nn_threads = opts.GetOrDefault<int>("threads", 1);
     const int max_batch = opts.GetOrDefault<int>("max_batch", 256);
     const std::string backend = opts.GetOrDefault<std::string>("backend", name);
+    // Adaptive batching: gather the batch size with the best measured
+    // throughput, waiting at most max_wait_us for it to fill up.
+    BatchLatencyModel* model = nullptr;
+    if (opts.GetOrDefault<bool>("adaptive", false)) {
+      models_.emplace_back(std::make_unique<BatchLatencyModel>(
+          max_batch, opts.GetOrDefault<int>("max_latency_us", 0) / 1e6));
+      model = models_.back().get();
+    }
+    const std::chrono::microseconds max_wait(
+        opts.GetOrDefault<int>("max_wait_us", 1000));
 
     networks_.emplace_back(
         NetworkFactory::Get()->Create(backend, weights, opts));
     Network* net = networks_.back().get();
 
     for (int i = 0; i < nn_threads; ++i) {
-      threads_.emplace_back(
-          [this, net, max_batch]() { Worker(net, max_batch); });
+      threads_.emplace_back([this, net, max_batch, model, max_wait]() {
+        PinnedThread pinned(ThreadRole::kBackend);
+        Worker(net, max_batch, model, max_wait);
+      });
     }
   }
 
@@ -121,67 +275,104 @@ class MuxingNetwork : public Network {
     return std::make_unique<MuxingComputation>(this);
   }
 
-  void Enqueue(MuxingComputation* computation) {
-    std::lock_guard<std::mutex> lock(mutex_);
-    queue_.push(computation);
-    cv_.notify_one();
-  }
+  void Enqueue(MuxingComputation* computation) { queue_.Push(computation); }
 
   ~MuxingNetwork() {
     Abort();
     Wait();
     // Unstuck waiting computations.
-    while (!queue_.empty()) {
-      queue_.front()->NotifyReady();
-      queue_.pop();
+    MuxingComputation* computation;
+    while (queue_.TryPop(&computation)) computation->NotifyReady();
+    Mutex::Lock lock(background_mutex_);
+    for (auto* waiting : background_) waiting->NotifyReady();
+  }
+
+  // Takes the next computation to batch. Those of normal priority go first,
+  // in the order they came, unless a background one waited for longer than
+  // background_wait_ already. With @wait, waits until @deadline for one if
+  // there's none. Returns false if there's none, or when aborted.
+  bool Next(MuxingComputation** next, bool wait, Clock::time_point deadline) {
+    {
+      Mutex::Lock lock(background_mutex_);
+      if (!background_.empty() &&
+          Clock::now() - background_.front()->GetEnqueueTime() >
+              background_wait_) {
+        *next = background_.front();
+        background_.pop_front();
+        return true;
+      }
     }
+    MuxingComputation* computation;
+    while (queue_.TryPop(&computation)) {
+      if (computation->GetPriority() == ComputationPriority::kNormal) {
+        *next = computation;
+        return true;
+      }
+      Mutex::Lock lock(background_mutex_);
+      background_.push_back(computation);
+    }
+    {
+      Mutex::Lock lock(background_mutex_);
+      if (!background_.empty()) {
+        *next = background_.front();
+        background_.pop_front();
+        return true;
+      }
+    }
+    return wait && queue_.PopUntil(next, deadline);
   }
 
-  void Worker(Network* network, const int max_batch) {
-    // While Abort() is not called (and it can only be called from destructor).
-    while (!abort_) {
+  void Worker(Network* network, const int max_batch, BatchLatencyModel* model,
+              const std::chrono::microseconds max_wait) {
+    // A computation which didn't fit into the previous batch.
+    MuxingComputation* next = nullptr;
+    while (true) {
       std::vector<MuxingComputation*> children;
       // Create new computation in "upstream" network, to gather batch into
       // there.
       std::shared_ptr<NetworkComputation> parent(network->NewComputation());
-      {
-        std::unique_lock<std::mutex> lock(mutex_);
-        // Wait until there's come work to compute.
-        cv_.wait(lock, [&] { return abort_ || !queue_.empty(); });
-        if (abort_) break;
-
-        // While there is a work in queue, add it.
-        while (!queue_.empty()) {
-          // If we are reaching batch size limit, stop adding.
-          // However, if a single input batch is larger than output batch limit,
-          // we still have to add it.
-          if (parent->GetBatchSize() != 0 &&
-              parent->GetBatchSize() + queue_.front()->GetBatchSize() >
-                  max_batch) {
-            break;
-          }
-          // Remember which of "input" computations we serve.
-          children.push_back(queue_.front());
-          queue_.pop();
-          // Make "input" computation populate data into output batch.
-          children.back()->PopulateToParent(parent);
+      // Wait until there's come work to compute, until Abort() is called
+      // (and it can only be called from destructor).
+      if (!next && !Next(&next, true, Clock::time_point::max())) break;
+
+      const int target = model ? model->Target() : max_batch;
+      const auto deadline = std::chrono::steady_clock::now() +
+                            (model ? model->MaxWait(target, max_wait)
+                                   : std::chrono::microseconds(0));
+      while (next) {
+        // If we are reaching batch size limit, stop adding and keep the
+        // computation for the next batch. However, if a single input batch
+        // is larger than output batch limit, we still have to add it.
+        if (parent->GetBatchSize() != 0 &&
+            parent->GetBatchSize() + next->GetBatchSize() > target) {
+          break;
         }
+        // Remember which of "input" computations we serve.
+        children.push_back(next);
+        next = nullptr;
+        // Make "input" computation populate data into output batch.
+        children.back()->PopulateToParent(parent);
+        if (parent->GetBatchSize() >= target) break;
+        // Add what's in the queue. Without the model, compute whatever was
+        // there right away.
+        Next(&next, model != nullptr, deadline);
       }
 
       // Compute.
+      TRACE_SCOPE("mux compute");
+      const auto start = std::chrono::steady_clock::now();
       parent->ComputeBlocking();
+      if (model) {
+        const std::chrono::duration<double> elapsed =
+            std::chrono::steady_clock::now() - start;
+        model->Record(parent->GetBatchSize(), elapsed.count());
+      }
       // Notify children that data is ready!
       for (auto child : children) child->NotifyReady();
     }
   }
 
-  void Abort() {
-    {
-      std::lock_guard<std::mutex> lock(mutex_);
-      abort_ = true;
-    }
-    cv_.notify_all();
-  }
+  void Abort() { queue_.Close(); }
 
   void Wait() {
     while (!threads_.empty()) {
@@ -192,21 +383,33 @@ class MuxingNetwork : public Network {
 
  private:
   std::vector<std::unique_ptr<Network>> networks_;
-  std::queue<MuxingComputation*> queue_;
-  bool abort_ = false;
-
-  std::mutex mutex_;
-  std::condition_variable cv_;
+  std::vector<std::unique_ptr<BatchLatencyModel>> models_;
+  MpmcQueue<MuxingComputation*> queue_{kQueueCapacity};
+  // Longest a background computation waits for normal ones to go first.
+  const std::chrono::milliseconds background_wait_;
+  Mutex background_mutex_{"mux background"};
+  // Background computations taken off queue_, oldest first.
+  std::deque<MuxingComputation*> background_ GUARDED_BY(background_mutex_);
 
   std::vector<std::thread> threads_;
 };
 
-void MuxingComputation::ComputeBlocking() {
+void MuxingComputation::Enqueue() {
+  enqueued_ = Clock::now();
   network_->Enqueue(this);
+}
+
+void MuxingComputation::ComputeBlocking() {
+  Enqueue();
   std::unique_lock<std::mutex> lock(mutex_);
   dataready_cv_.wait(lock, [this]() { return dataready_; });
 }
 
+void MuxingComputation::ComputeAsync(std::function<void()> callback) {
+  callback_ = std::move(callback);
+  Enqueue();
+}
+
 std::unique_ptr<Network> MakeMuxingNetwork(const WeightsFile& weights,
                                            const OptionsDict& options) {
   return std::make_unique<MuxingNetwork>(weights, options);
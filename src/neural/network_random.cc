@@ -32,6 +32,7 @@
 #include <thread>
 #include "neural/factory.h"
 #include "utils/hashcat.h"
+#include "utils/trace.h"
 
 namespace lczero {
 namespace {
@@ -51,9 +52,27 @@ class RandomNetworkComputation : public NetworkComputation {
       hash = HashCat({hash, value_hash});
     }
     inputs_.push_back(hash);
+    legal_policies_.emplace_back();
+  }
+
+  // Mimics a backend gathering the policy on the device.
+  void AddInputWithMoves(InputPlanes&& input, const uint16_t* moves,
+                         int num_moves, float softmax_temp) override {
+    AddInput(std::move(input));
+    auto& policy = legal_policies_.back();
+    float total = 0.0f;
+    for (int i = 0; i < num_moves; ++i) {
+      policy.push_back(
+          std::pow(GetPVal(inputs_.size() - 1, moves[i]), 1.0f / softmax_temp));
+      total += policy.back();
+    }
+    if (total > 0.0f) {
+      for (auto& p : policy) p /= total;
+    }
   }
 
   void ComputeBlocking() override {
+    TRACE_SCOPE("random compute");
     if (delay_ms_) {
       std::this_thread::sleep_for(std::chrono::milliseconds(delay_ms_));
     }
@@ -83,8 +102,13 @@ class RandomNetworkComputation : public NetworkComputation {
            10000.0;
   }
 
+  float GetLegalPVal(int sample, int move_index) const override {
+    return legal_policies_[sample][move_index];
+  }
+
  private:
   std::vector<std::uint64_t> inputs_;
+  std::vector<std::vector<float>> legal_policies_;
   int delay_ms_ = 0;
   int seed_ = 0;
   bool uniform_mode_ = false;
@@ -99,6 +123,7 @@ class RandomNetwork : public Network {
   std::unique_ptr<NetworkComputation> NewComputation() override {
     return std::make_unique<RandomNetworkComputation>(delay_ms_, seed_, uniform_mode_);
   }
+  bool GathersLegalPolicy() const override { return true; }
 
  private:
   int delay_ms_ = 0;
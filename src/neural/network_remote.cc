@@ -0,0 +1,320 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2019 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+
+  If you modify this Program, or any covered work, by linking or
+  combining it with NVIDIA Corporation's libraries from the NVIDIA CUDA
+  Toolkit and the NVIDIA CUDA Deep Neural Network library (or a
+  modified version of those libraries), containing parts covered by the
+  terms of the respective license agreement, the licensors of this
+  Program grant you additional permission to convey the resulting work.
+*/
+
+// Evaluates on an lc0 eval server (lc0 evalserver) over TCP. Requests are
+// pipelined: ComputeAsync() returns as soon as the batch is sent, and any
+// number of batches may be in flight on a connection.
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "neural/factory.h"
+#include "neural/remote_protocol.h"
+#include "utils/exception.h"
+#include "utils/logging.h"
+#include "utils/metrics.h"
+#include "utils/trace.h"
+
+#ifndef _WIN32
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+namespace lczero {
+namespace {
+
+Counter gPositionsMetric("lc0_remote_positions",
+                         "Positions evaluated by the remote backend.");
+Gauge gLatencyMetric("lc0_remote_latency_ms",
+                     "Average round trip of remote batches, in milliseconds.");
+Gauge gThroughputMetric("lc0_remote_positions_per_second",
+                        "Positions per second evaluated remotely.");
+
+#ifndef _WIN32
+class RemoteNetwork;
+
+class RemoteComputation : public NetworkComputation {
+ public:
+  RemoteComputation(RemoteNetwork* network) : network_(network) {}
+
+  void AddInput(InputPlanes&& input) override {
+    EncodeRemotePlanes(input, &request_);
+    ++batch_size_;
+  }
+
+  void ComputeBlocking() override;
+  void ComputeAsync(std::function<void()> callback) override;
+
+  int GetBatchSize() const override { return batch_size_; }
+
+  float GetQVal(int sample) const override {
+    return GetRemoteQ(results_, sample);
+  }
+  float GetDVal(int sample) const override {
+    return GetRemoteD(results_, sample);
+  }
+  float GetPVal(int sample, int move_id) const override {
+    return GetRemoteP(results_, sample, move_id);
+  }
+
+  const std::string& GetRequest() const { return request_; }
+  std::chrono::steady_clock::time_point GetStart() const { return start_; }
+
+  void CheckAsyncError() const override {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!error_.empty()) throw Exception("Remote backend: " + error_);
+  }
+
+  // Takes the results, or the error if @error isn't empty. The error is
+  // thrown by ComputeBlocking() or CheckAsyncError() then.
+  void Finish(std::string&& results, const std::string& error) {
+    results_ = std::move(results);
+    std::function<void()> callback;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      error_ = error;
+      done_ = true;
+      callback = std::move(callback_);
+      cv_.notify_one();
+    }
+    // The callback may destroy this computation.
+    if (callback) callback();
+  }
+
+ private:
+  RemoteNetwork* network_;
+  std::string request_;
+  std::string results_;
+  int batch_size_ = 0;
+  std::chrono::steady_clock::time_point start_;
+
+  mutable std::mutex mutex_;
+  std::condition_variable cv_;
+  bool done_ = false;
+  std::string error_;
+  std::function<void()> callback_;
+};
+
+// A connection to the server, with the computations waiting for it.
+class Connection {
+ public:
+  Connection(const std::string& host, int port, RemoteStats* stats)
+      : stats_(stats) {
+    addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* addresses = nullptr;
+    if (getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints,
+                    &addresses) != 0) {
+      throw Exception("Remote backend: unable to resolve " + host);
+    }
+    for (auto* address = addresses; address; address = address->ai_next) {
+      socket_ = socket(address->ai_family, address->ai_socktype,
+                       address->ai_protocol);
+      if (socket_ < 0) continue;
+      if (connect(socket_, address->ai_addr, address->ai_addrlen) == 0) break;
+      close(socket_);
+      socket_ = -1;
+    }
+    freeaddrinfo(addresses);
+    if (socket_ < 0) {
+      throw Exception("Remote backend: unable to connect to " + host + ":" +
+                      std::to_string(port));
+    }
+    // Batches are small and latency bound.
+    const int on = 1;
+    setsockopt(socket_, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    receiver_ = std::thread([this]() { Receive(); });
+  }
+
+  ~Connection() {
+    shutdown(socket_, SHUT_RDWR);
+    receiver_.join();
+    close(socket_);
+  }
+
+  void Send(RemoteComputation* computation) {
+    RemoteHeader header;
+    header.type = RemoteMessage::kEvaluate;
+    header.count = computation->GetBatchSize();
+    if (header.count == 0) {
+      computation->Finish({}, "");
+      return;
+    }
+    bool broken;
+    {
+      std::lock_guard<std::mutex> lock(pending_mutex_);
+      broken = broken_;
+      if (!broken) {
+        header.id = next_id_++;
+        pending_[header.id] = computation;
+      }
+    }
+    if (broken) {
+      computation->Finish({}, "connection lost");
+      return;
+    }
+    bool sent;
+    {
+      std::lock_guard<std::mutex> lock(send_mutex_);
+      sent = SendRemoteMessage(socket_, header, computation->GetRequest());
+    }
+    // A failed send also fails recv(), which answers the pending ones.
+    if (!sent) shutdown(socket_, SHUT_RDWR);
+  }
+
+ private:
+  void Receive() {
+    RemoteHeader header;
+    std::string payload;
+    std::string error = "connection lost";
+    while (ReceiveRemoteMessage(socket_, &header, &payload)) {
+      RemoteComputation* computation = nullptr;
+      {
+        std::lock_guard<std::mutex> lock(pending_mutex_);
+        auto iter = pending_.find(header.id);
+        if (iter != pending_.end()) {
+          computation = iter->second;
+          pending_.erase(iter);
+        }
+      }
+      if (!computation) continue;
+      if (header.type == RemoteMessage::kError) {
+        computation->Finish({}, payload);
+        continue;
+      }
+      if (header.type != RemoteMessage::kResults ||
+          payload.size() != computation->GetBatchSize() * kRemoteResultSize) {
+        computation->Finish({}, "malformed results");
+        error = "malformed results";
+        break;
+      }
+      const std::chrono::duration<double> elapsed =
+          std::chrono::steady_clock::now() - computation->GetStart();
+      const int count = computation->GetBatchSize();
+      computation->Finish(std::move(payload), "");
+      gPositionsMetric.Add(count);
+      const std::string summary = stats_->Record(count, elapsed.count());
+      if (!summary.empty()) {
+        gLatencyMetric.Set(stats_->GetLatencyMs());
+        gThroughputMetric.Set(stats_->GetPositionsPerSecond());
+        LOGFILE << "Remote backend: " << summary;
+      }
+    }
+    std::unordered_map<uint32_t, RemoteComputation*> pending;
+    {
+      std::lock_guard<std::mutex> lock(pending_mutex_);
+      broken_ = true;
+      pending.swap(pending_);
+    }
+    for (auto& entry : pending) entry.second->Finish({}, error);
+  }
+
+  RemoteStats* const stats_;
+  int socket_ = -1;
+  std::thread receiver_;
+  std::mutex send_mutex_;
+
+  std::mutex pending_mutex_;
+  uint32_t next_id_ = 0;
+  std::unordered_map<uint32_t, RemoteComputation*> pending_;
+  bool broken_ = false;
+};
+
+class RemoteNetwork : public Network {
+ public:
+  RemoteNetwork(const OptionsDict& options)
+      : stats_(std::chrono::seconds(10)) {
+    const std::string host =
+        options.GetOrDefault<std::string>("host", "localhost");
+    const int port = options.GetOrDefault<int>("port", 7778);
+    const int connections =
+        std::max(1, options.GetOrDefault<int>("connections", 1));
+    for (int i = 0; i < connections; ++i) {
+      connections_.emplace_back(std::make_unique<Connection>(host, port, &stats_));
+    }
+    CERR << "Remote backend connected to " << host << ":" << port << " with "
+         << connections << " connection(s)";
+  }
+
+  std::unique_ptr<NetworkComputation> NewComputation() override {
+    return std::make_unique<RemoteComputation>(this);
+  }
+
+  // Batches go to the connections in turn.
+  void Send(RemoteComputation* computation) {
+    TRACE_SCOPE("remote send");
+    const size_t connection = next_connection_++ % connections_.size();
+    connections_[connection]->Send(computation);
+  }
+
+ private:
+  RemoteStats stats_;
+  std::vector<std::unique_ptr<Connection>> connections_;
+  std::atomic<size_t> next_connection_{0};
+};
+
+void RemoteComputation::ComputeBlocking() {
+  TRACE_SCOPE("remote compute");
+  start_ = std::chrono::steady_clock::now();
+  network_->Send(this);
+  std::unique_lock<std::mutex> lock(mutex_);
+  cv_.wait(lock, [this]() { return done_; });
+  lock.unlock();
+  CheckAsyncError();
+}
+
+void RemoteComputation::ComputeAsync(std::function<void()> callback) {
+  callback_ = std::move(callback);
+  start_ = std::chrono::steady_clock::now();
+  network_->Send(this);
+}
+#endif
+
+std::unique_ptr<Network> MakeRemoteNetwork(const WeightsFile& /*weights*/,
+                                           const OptionsDict& options) {
+#ifdef _WIN32
+  (void)options;
+  throw Exception("The remote backend is not supported on Windows.");
+#else
+  return std::make_unique<RemoteNetwork>(options);
+#endif
+}
+
+REGISTER_NETWORK("remote", MakeRemoteNetwork, -900)
+
+}  // namespace
+}  // namespace lczero
@@ -27,17 +27,110 @@
 
 #include "neural/factory.h"
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <condition_variable>
+#include <mutex>
 #include <queue>
 #include <thread>
 #include "utils/exception.h"
+#include "utils/logging.h"
 
 namespace lczero {
 namespace {
 
+class RoundRobinNetwork;
+
+// How computations are spread over the children.
+enum class Routing {
+  // Plain rotation, regardless of the children's load.
+  kRoundRobin,
+  // The child with the fewest positions queued or being computed.
+  kLeastOutstanding,
+  // The child expected to finish first, judging by the positions it has
+  // outstanding and its measured time per position. Children not measured yet
+  // get a computation first, and every kExploreInterval-th computation goes
+  // to the child picked least recently, to keep all estimates current.
+  kLatency,
+};
+
+constexpr int64_t kExploreInterval = 64;
+
+// Computation which picks its child once its batch size is known, when it's
+// computed. Inputs are kept until then.
+class RoutedComputation : public NetworkComputation {
+ public:
+  explicit RoutedComputation(RoundRobinNetwork* network) : network_(network) {}
+
+  void AddInput(InputPlanes&& input) override {
+    planes_.emplace_back(std::move(input));
+    moves_.emplace_back();
+  }
+
+  void AddInputWithMoves(InputPlanes&& input, const uint16_t* moves,
+                         int num_moves, float softmax_temp) override {
+    planes_.emplace_back(std::move(input));
+    moves_.emplace_back();
+    moves_.back().moves.assign(moves, moves + num_moves);
+    moves_.back().softmax_temp = softmax_temp;
+  }
+
+  void ComputeBlocking() override;
+  void ComputeAsync(std::function<void()> callback) override;
+  void CheckAsyncError() const override { computation_->CheckAsyncError(); }
+
+  int GetBatchSize() const override { return planes_.size(); }
+
+  float GetQVal(int sample) const override {
+    return computation_->GetQVal(sample);
+  }
+
+  float GetDVal(int sample) const override {
+    return computation_->GetDVal(sample);
+  }
+
+  float GetPVal(int sample, int move_id) const override {
+    return computation_->GetPVal(sample, move_id);
+  }
+
+  float GetLegalPVal(int sample, int move_index) const override {
+    return computation_->GetLegalPVal(sample, move_index);
+  }
+
+ private:
+  // Picks the child and hands it the inputs, returns the child's index.
+  int Dispatch();
+
+  RoundRobinNetwork* network_;
+  std::vector<InputPlanes> planes_;
+  // Moves of the inputs added with AddInputWithMoves(), temperature 0 for
+  // the others.
+  struct Moves {
+    std::vector<uint16_t> moves;
+    float softmax_temp = 0.0f;
+  };
+  std::vector<Moves> moves_;
+  std::unique_ptr<NetworkComputation> computation_;
+  std::chrono::steady_clock::time_point start_;
+};
+
 class RoundRobinNetwork : public Network {
  public:
   RoundRobinNetwork(const WeightsFile& weights, const OptionsDict& options) {
+    const auto routing =
+        options.GetOrDefault<std::string>("routing", "roundrobin");
+    if (routing == "roundrobin") {
+      routing_ = Routing::kRoundRobin;
+    } else if (routing == "outstanding") {
+      routing_ = Routing::kLeastOutstanding;
+    } else if (routing == "latency") {
+      routing_ = Routing::kLatency;
+    } else {
+      throw Exception("Unknown roundrobin routing: " + routing +
+                      ", expected roundrobin, outstanding or latency");
+    }
+
     const auto parents = options.ListSubdicts();
     if (parents.empty()) {
       // If options are empty, or multiplexer configured in root object,
@@ -49,6 +142,7 @@ class RoundRobinNetwork : public Network {
     for (const auto& name : parents) {
       AddBackend(name, weights, options.GetSubdict(name));
     }
+    children_.resize(networks_.size());
   }
 
   void AddBackend(const std::string& name, const WeightsFile& weights,
@@ -57,20 +151,170 @@ class RoundRobinNetwork : public Network {
 
     networks_.emplace_back(
         NetworkFactory::Get()->Create(backend, weights, opts));
+    names_.push_back(name);
   }
 
   std::unique_ptr<NetworkComputation> NewComputation() override {
-    const long long val = ++counter_;
-    return networks_[val % networks_.size()]->NewComputation();
+    if (routing_ == Routing::kRoundRobin) {
+      const long long val = ++counter_;
+      return networks_[val % networks_.size()]->NewComputation();
+    }
+    return std::make_unique<RoutedComputation>(this);
+  }
+
+  // Inputs are passed on with their moves, so it's up to the children, which
+  // all have to agree.
+  bool GathersLegalPolicy() const override {
+    return std::all_of(networks_.begin(), networks_.end(),
+                       [](const std::unique_ptr<Network>& network) {
+                         return network->GathersLegalPolicy();
+                       });
+  }
+
+  // Picks the child for a computation of @batch_size positions, and counts
+  // them as outstanding on it.
+  int Pick(int batch_size) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    ++picks_;
+    // Busy children which weren't measured yet are assumed to be as fast as
+    // the fastest one.
+    double fastest = -1.0;
+    for (const auto& child : children_) {
+      if (child.measured &&
+          (fastest < 0.0 || child.seconds_per_position < fastest)) {
+        fastest = child.seconds_per_position;
+      }
+    }
+    if (fastest < 0.0) fastest = 1.0;
+    int best = 0;
+    double best_cost = 0;
+    for (size_t i = 0; i < children_.size(); ++i) {
+      const auto& child = children_[i];
+      double cost = child.outstanding;
+      if (routing_ == Routing::kLatency) {
+        if (picks_ % kExploreInterval == 0) {
+          cost = child.last_pick;
+        } else if (!child.measured && child.outstanding == 0) {
+          cost = -1.0;
+        } else {
+          cost = (child.outstanding + batch_size) *
+                 (child.measured ? child.seconds_per_position : fastest);
+        }
+      }
+      if (i == 0 || cost < best_cost) {
+        best = i;
+        best_cost = cost;
+      }
+    }
+    auto& child = children_[best];
+    child.last_pick = picks_;
+    child.outstanding += batch_size;
+    child.max_outstanding = std::max(child.max_outstanding, child.outstanding);
+    return best;
+  }
+
+  std::unique_ptr<NetworkComputation> NewChildComputation(int child) {
+    return networks_[child]->NewComputation();
+  }
+
+  // Records a finished computation of @batch_size positions on @child which
+  // took @seconds, negative if it failed.
+  void Done(int child, int batch_size, double seconds) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto& stats = children_[child];
+    stats.outstanding -= batch_size;
+    if (seconds < 0) return;
+    stats.computations++;
+    stats.positions += batch_size;
+    const double per_position = seconds / std::max(batch_size, 1);
+    stats.seconds_per_position =
+        stats.measured
+            ? 0.9 * stats.seconds_per_position + 0.1 * per_position
+            : per_position;
+    stats.measured = true;
   }
 
-  ~RoundRobinNetwork() {}
+  ~RoundRobinNetwork() {
+    if (routing_ == Routing::kRoundRobin) return;
+    for (size_t i = 0; i < children_.size(); ++i) {
+      const auto& stats = children_[i];
+      LOGFILE << "roundrobin child " << names_[i] << ": " << stats.computations
+              << " computations, " << stats.positions
+              << " positions, max outstanding " << stats.max_outstanding
+              << ", " << stats.seconds_per_position * 1e6
+              << "us per position.";
+    }
+  }
 
  private:
+  // Load of a child, guarded by mutex_.
+  struct ChildStats {
+    // Positions queued or being computed.
+    int outstanding = 0;
+    int max_outstanding = 0;
+    int64_t computations = 0;
+    int64_t positions = 0;
+    // Moving average, valid once measured.
+    double seconds_per_position = 1.0;
+    bool measured = false;
+    // Value of picks_ when the child was last picked.
+    int64_t last_pick = 0;
+  };
+
   std::vector<std::unique_ptr<Network>> networks_;
+  std::vector<std::string> names_;
   std::atomic<long long> counter_;
+  Routing routing_;
+  std::mutex mutex_;
+  std::vector<ChildStats> children_;
+  // Computations routed so far.
+  int64_t picks_ = 0;
 };
 
+int RoutedComputation::Dispatch() {
+  const int child = network_->Pick(GetBatchSize());
+  computation_ = network_->NewChildComputation(child);
+  for (size_t i = 0; i < planes_.size(); ++i) {
+    if (moves_[i].softmax_temp == 0.0f) {
+      computation_->AddInput(std::move(planes_[i]));
+    } else {
+      computation_->AddInputWithMoves(std::move(planes_[i]),
+                                      moves_[i].moves.data(),
+                                      moves_[i].moves.size(),
+                                      moves_[i].softmax_temp);
+    }
+  }
+  start_ = std::chrono::steady_clock::now();
+  return child;
+}
+
+void RoutedComputation::ComputeBlocking() {
+  const int child = Dispatch();
+  try {
+    computation_->ComputeBlocking();
+  } catch (...) {
+    network_->Done(child, GetBatchSize(), -1.0);
+    throw;
+  }
+  network_->Done(child, GetBatchSize(),
+                 std::chrono::duration<double>(
+                     std::chrono::steady_clock::now() - start_)
+                     .count());
+}
+
+void RoutedComputation::ComputeAsync(std::function<void()> callback) {
+  const int child = Dispatch();
+  computation_->ComputeAsync([this, child, callback]() {
+    network_->Done(child, GetBatchSize(),
+                   std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - start_)
+                       .count());
+    // The callback may destroy this computation, so nothing is touched
+    // after.
+    callback();
+  });
+}
+
 std::unique_ptr<Network> MakeRoundRobinNetwork(const WeightsFile& weights,
                                                const OptionsDict& options) {
   return std::make_unique<RoundRobinNetwork>(weights, options);
@@ -27,10 +27,14 @@
 
 #include "neural/factory.h"
 #include "neural/network_legacy.h"
+#include "neural/shared/planes.h"
 #include "utils/bititer.h"
 #include "utils/optionsdict.h"
 #include "utils/transpose.h"
+#include "utils/trace.h"
 
+#include <map>
+#include <mutex>
 #include <tensorflow/cc/client/client_session.h>
 #include <tensorflow/cc/ops/standard_ops.h>
 #include <tensorflow/core/framework/tensor.h>
@@ -64,6 +68,19 @@ Output MakeVals(const Scope& scope, TensorShape shape, float val) {
   return Const(scope, tensor);
 }
 
+// Batch sizes input tensors are allocated for: powers of two up to
+// kMaxBatchBucket, then its multiples.
+const int kMaxBatchBucket = 256;
+int GetBatchBucket(int batch_size) {
+  int bucket = 1;
+  while (bucket < batch_size && bucket < kMaxBatchBucket) bucket *= 2;
+  if (bucket < batch_size) {
+    bucket = (batch_size + kMaxBatchBucket - 1) / kMaxBatchBucket *
+             kMaxBatchBucket;
+  }
+  return bucket;
+}
+
 Output Zeros(const Scope& scope, TensorShape shape) {
   return MakeVals(scope, shape, 0.0f);
 }
@@ -176,10 +193,24 @@ class TFNetwork : public Network {
 
   std::unique_ptr<NetworkComputation> NewComputation() override;
 
-  tensorflow::Status Compute(tensorflow::Tensor& input,
+  // Runs the first @batch_size samples of @input, which came from
+  // AcquireInput().
+  tensorflow::Status Compute(const tensorflow::Tensor& input, int batch_size,
                              std::vector<tensorflow::Tensor>* outputs) const;
 
+  // Returns an input tensor of the bucket of @batch_size, reused from an
+  // earlier computation if there is one.
+  tensorflow::Tensor AcquireInput(int batch_size) const;
+  void ReleaseInput(tensorflow::Tensor&& input) const;
+
  private:
+  // With XLA the graph is compiled for every input shape, so whole buckets
+  // are run, padded, instead of the exact batch.
+  bool xla_ = false;
+  mutable std::mutex inputs_mutex_;
+  // Free input tensors, by batch bucket.
+  mutable std::map<int, std::vector<tensorflow::Tensor>> free_inputs_;
+
   tensorflow::Scope scope_;
   std::unique_ptr<tensorflow::ClientSession> session_;
 
@@ -192,12 +223,16 @@ template <bool CPU>
 class TFNetworkComputation : public NetworkComputation {
  public:
   TFNetworkComputation(const TFNetwork<CPU>* network) : network_(network) {}
+  ~TFNetworkComputation() override {
+    if (input_.IsInitialized()) network_->ReleaseInput(std::move(input_));
+  }
   void AddInput(InputPlanes&& input) override {
-    raw_input_.emplace_back(input);
+    raw_input_.emplace_back(std::move(input));
   }
   void ComputeBlocking() override {
+    TRACE_SCOPE("tensorflow compute");
     PrepareInput();
-    status_ = network_->Compute(input_, &output_);
+    status_ = network_->Compute(input_, GetBatchSize(), &output_);
     CHECK(status_.ok()) << status_.ToString();
   }
 
@@ -224,33 +259,25 @@ class TFNetworkComputation : public NetworkComputation {
 // Version for GPU.
 template <>
 void TFNetworkComputation<false>::PrepareInput() {
-  input_ = tensorflow::Tensor(
-      tensorflow::DataType::DT_FLOAT,
-      {static_cast<int>(raw_input_.size()), kInputPlanes, 8, 8});
+  if (!input_.IsInitialized()) input_ = network_->AcquireInput(GetBatchSize());
 
   auto flat = input_.flat<float>();
-  memset(flat.data(), 0, flat.size() * sizeof(*flat.data()));
   auto iter = flat.data();
   for (const auto& sample : raw_input_) {
-    CHECK_EQ(sample.size(), kInputPlanes);
-    for (const auto& plane : sample) {
-      for (auto bit : IterateBits(plane.mask)) {
-        *(iter + bit) = plane.value;
-      }
-      iter += 64;
-    }
+    ExpandPlanes(sample, iter);
+    iter += kInputPlanes * 64;
   }
 }
 
 // Version for CPU.
 template <>
 void TFNetworkComputation<true>::PrepareInput() {
-  input_ = tensorflow::Tensor(
-      tensorflow::DataType::DT_FLOAT,
-      {static_cast<int>(raw_input_.size()), 8, 8, kInputPlanes});
+  if (!input_.IsInitialized()) input_ = network_->AcquireInput(GetBatchSize());
 
   auto flat = input_.flat<float>();
-  memset(flat.data(), 0, flat.size() * sizeof(*flat.data()));
+  // Only the samples of this batch, padding is never read back.
+  memset(flat.data(), 0,
+         raw_input_.size() * kInputPlanes * 64 * sizeof(*flat.data()));
   auto* data = flat.data();
   for (size_t input_idx = 0; input_idx < raw_input_.size(); ++input_idx) {
     const auto& sample = raw_input_[input_idx];
@@ -267,12 +294,18 @@ void TFNetworkComputation<true>::PrepareInput() {
 }  // namespace
 
 template <bool CPU>
-TFNetwork<CPU>::TFNetwork(const WeightsFile& file,
-                          const OptionsDict& /*options*/)
-    : scope_(Scope::NewRootScope()) {
+TFNetwork<CPU>::TFNetwork(const WeightsFile& file, const OptionsDict& options)
+    : xla_(options.GetOrDefault<bool>("xla", false)),
+      scope_(Scope::NewRootScope()) {
   const LegacyWeights weights(file.weights());
   tensorflow::SessionOptions session_options;
   if (CPU) (*session_options.config.mutable_device_count())["GPU"] = 0;
+  if (xla_) {
+    // Auto-clustering, which compiles the whole network into one cluster.
+    session_options.config.mutable_graph_options()
+        ->mutable_optimizer_options()
+        ->set_global_jit_level(tensorflow::OptimizerOptions::ON_1);
+  }
   session_ =
       std::make_unique<tensorflow::ClientSession>(scope_, session_options);
 
@@ -295,15 +328,43 @@ TFNetwork<CPU>::TFNetwork(const WeightsFile& file,
   // First request to tensorflow is slow (0.6s), so doing an empty request for
   // preheating.
   auto fake_request = NewComputation();
-  fake_request->AddInput(InputPlanes(kInputPlanes));
+  fake_request->AddInput(InputPlanes());
   fake_request->ComputeBlocking();
 }
 
 template <bool CPU>
-tensorflow::Status TFNetwork<CPU>::Compute(tensorflow::Tensor& input,
+tensorflow::Status TFNetwork<CPU>::Compute(const tensorflow::Tensor& input,
+                                           int batch_size,
                                            std::vector<Tensor>* outputs) const {
-  return session_->Run({{*input_, input}}, {*value_head_, *policy_head_},
-                       outputs);
+  // Slices share the buffer of the tensor.
+  return session_->Run({{*input_, xla_ ? input : input.Slice(0, batch_size)}},
+                       {*value_head_, *policy_head_}, outputs);
+}
+
+template <bool CPU>
+tensorflow::Tensor TFNetwork<CPU>::AcquireInput(int batch_size) const {
+  const int bucket = GetBatchBucket(batch_size);
+  {
+    std::lock_guard<std::mutex> lock(inputs_mutex_);
+    auto& inputs = free_inputs_[bucket];
+    if (!inputs.empty()) {
+      tensorflow::Tensor input = std::move(inputs.back());
+      inputs.pop_back();
+      return input;
+    }
+  }
+  tensorflow::Tensor input(tensorflow::DataType::DT_FLOAT,
+                           CPU ? TensorShape({bucket, 8, 8, kInputPlanes})
+                               : TensorShape({bucket, kInputPlanes, 8, 8}));
+  // Padding is computed with XLA, keep it finite.
+  input.flat<float>().setZero();
+  return input;
+}
+
+template <bool CPU>
+void TFNetwork<CPU>::ReleaseInput(tensorflow::Tensor&& input) const {
+  std::lock_guard<std::mutex> lock(inputs_mutex_);
+  free_inputs_[input.dim_size(0)].push_back(std::move(input));
 }
 
 template <bool CPU>
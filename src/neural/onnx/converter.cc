@@ -0,0 +1,361 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2019 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+
+  If you modify this Program, or any covered work, by linking or
+  combining it with NVIDIA Corporation's libraries from the NVIDIA CUDA
+  Toolkit and the NVIDIA CUDA Deep Neural Network library (or a
+  modified version of those libraries), containing parts covered by the
+  terms of the respective license agreement, the licensors of this
+  Program grant you additional permission to convey the resulting work.
+*/
+
+#include "neural/onnx/converter.h"
+
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <vector>
+
+#include "neural/network.h"
+#include "neural/network_legacy.h"
+#include "neural/onnx/onnx.pb.h"
+#include "neural/shared/policy_map.h"
+#include "utils/exception.h"
+#include "utils/optionsparser.h"
+#include "version.h"
+
+namespace lczero {
+
+const char* const kOnnxInputName = "input";
+const char* const kOnnxPolicyName = "policy";
+const char* const kOnnxValueName = "value";
+
+namespace {
+
+using pblczero::onnx::AttributeProto;
+using pblczero::onnx::NodeProto;
+using pblczero::onnx::TensorProto;
+
+// The version of the operators used and the matching file format version.
+constexpr int kOpsetVersion = 13;
+constexpr int kIrVersion = 7;
+constexpr int kNumOutputPolicy = 1858;
+
+// Adds nodes and weights to an ONNX graph. Every node gets one output, named
+// after the node.
+class OnnxBuilder {
+ public:
+  explicit OnnxBuilder(pblczero::onnx::GraphProto* graph) : graph_(graph) {}
+
+  // Declares a graph input or output of floats, the first dimension being
+  // the batch size.
+  void AddInput(const std::string& name, std::vector<int> dims) {
+    AddValueInfo(graph_->add_input(), name, dims);
+  }
+  void AddOutput(const std::string& name, std::vector<int> dims) {
+    AddValueInfo(graph_->add_output(), name, dims);
+  }
+
+  std::string AddWeights(const std::string& name,
+                         const std::vector<int64_t>& dims,
+                         const std::vector<float>& values) {
+    auto tensor = graph_->add_initializer();
+    tensor->set_name(name);
+    for (const auto dim : dims) tensor->add_dims(dim);
+    tensor->set_data_type(TensorProto::FLOAT);
+    tensor->set_raw_data(values.data(), values.size() * sizeof(float));
+    return name;
+  }
+
+  std::string AddInt64s(const std::string& name,
+                        const std::vector<int64_t>& values) {
+    auto tensor = graph_->add_initializer();
+    tensor->set_name(name);
+    tensor->add_dims(values.size());
+    tensor->set_data_type(TensorProto::INT64);
+    for (const auto value : values) tensor->add_int64_data(value);
+    return name;
+  }
+
+  // Convolution with @weights over @input of @input_channels channels,
+  // padded to keep the 8x8 board. The filter size follows from the size of
+  // the weights.
+  std::string Conv(const std::string& name, const std::string& input,
+                   int input_channels, const LegacyWeights::ConvBlock& block) {
+    const int output_channels = block.biases.size();
+    const int filter_size = std::lround(std::sqrt(
+        block.weights.size() / (output_channels * input_channels)));
+    auto node = AddNode(name, "Conv", {input,
+                                       AddWeights(name + "/w",
+                                                  {output_channels,
+                                                   input_channels, filter_size,
+                                                   filter_size},
+                                                  block.weights),
+                                       AddWeights(name + "/b",
+                                                  {output_channels},
+                                                  block.biases)});
+    AddInts(node, "kernel_shape", {filter_size, filter_size});
+    const int pad = filter_size / 2;
+    AddInts(node, "pads", {pad, pad, pad, pad});
+    return node->output(0);
+  }
+
+  // Fully connected layer, [batch, inputs] to [batch, outputs].
+  std::string FullyConnected(const std::string& name, const std::string& input,
+                             const std::vector<float>& weights,
+                             const std::vector<float>& biases) {
+    const int64_t outputs = biases.size();
+    const int64_t inputs = weights.size() / outputs;
+    auto node = AddNode(name, "Gemm",
+                        {input,
+                         AddWeights(name + "/w", {outputs, inputs}, weights),
+                         AddWeights(name + "/b", {outputs}, biases)});
+    AddInt(node, "transB", 1);
+    return node->output(0);
+  }
+
+  // Squeeze and excitation of @input, which has @channels channels.
+  std::string SqueezeExcitation(const std::string& name,
+                                const std::string& input, int channels,
+                                const LegacyWeights::SEunit& se) {
+    auto pooled = Unary(name + "/pool", "GlobalAveragePool", input);
+    auto flat = Flatten(name + "/flatten", pooled);
+    auto fc1 =
+        Unary(name + "/relu", "Relu",
+              FullyConnected(name + "/fc1", flat, se.w1, se.b1));
+    auto fc2 = FullyConnected(name + "/fc2", fc1, se.w2, se.b2);
+    // The first half of the outputs scales the channels, the second half is
+    // added to them.
+    auto split = graph_->add_node();
+    split->set_name(name + "/split");
+    split->set_op_type("Split");
+    split->add_input(fc2);
+    split->add_output(name + "/split/scale");
+    split->add_output(name + "/split/bias");
+    AddInt(split, "axis", 1);
+    const auto shape = AddInt64s(name + "/shape", {-1, channels, 1, 1});
+    auto scale = Binary(name + "/scale", "Reshape",
+                        Unary(name + "/sigmoid", "Sigmoid", split->output(0)),
+                        shape);
+    auto bias = Binary(name + "/bias", "Reshape", split->output(1), shape);
+    return Binary(name + "/add", "Add", Binary(name + "/mul", "Mul", input, scale),
+                  bias);
+  }
+
+  std::string Flatten(const std::string& name, const std::string& input) {
+    auto node = AddNode(name, "Flatten", {input});
+    AddInt(node, "axis", 1);
+    return node->output(0);
+  }
+
+  std::string Softmax(const std::string& name, const std::string& input) {
+    auto node = AddNode(name, "Softmax", {input});
+    AddInt(node, "axis", 1);
+    return node->output(0);
+  }
+
+  std::string Unary(const std::string& name, const std::string& op,
+                    const std::string& input) {
+    return AddNode(name, op, {input})->output(0);
+  }
+
+  std::string Binary(const std::string& name, const std::string& op,
+                     const std::string& a, const std::string& b) {
+    return AddNode(name, op, {a, b})->output(0);
+  }
+
+  NodeProto* AddNode(const std::string& name, const std::string& op,
+                     const std::vector<std::string>& inputs) {
+    auto node = graph_->add_node();
+    node->set_name(name);
+    node->set_op_type(op);
+    for (const auto& input : inputs) node->add_input(input);
+    node->add_output(name);
+    return node;
+  }
+
+  void AddInt(NodeProto* node, const std::string& name, int64_t value) {
+    auto attribute = node->add_attribute();
+    attribute->set_name(name);
+    attribute->set_type(AttributeProto::INT);
+    attribute->set_i(value);
+  }
+
+  void AddInts(NodeProto* node, const std::string& name,
+               const std::vector<int64_t>& values) {
+    auto attribute = node->add_attribute();
+    attribute->set_name(name);
+    attribute->set_type(AttributeProto::INTS);
+    for (const auto value : values) attribute->add_ints(value);
+  }
+
+ private:
+  void AddValueInfo(pblczero::onnx::ValueInfoProto* info,
+                    const std::string& name, const std::vector<int>& dims) {
+    info->set_name(name);
+    auto tensor_type = info->mutable_type()->mutable_tensor_type();
+    tensor_type->set_elem_type(TensorProto::FLOAT);
+    auto shape = tensor_type->mutable_shape();
+    shape->add_dim()->set_dim_param("batch");
+    for (const auto dim : dims) shape->add_dim()->set_dim_value(dim);
+  }
+
+  pblczero::onnx::GraphProto* graph_;
+};
+
+}  // namespace
+
+std::string ConvertWeightsToOnnx(const WeightsFile& file) {
+  const auto& format = file.format().network_format();
+  if (format.network() !=
+          pblczero::NetworkFormat::NETWORK_CLASSICAL_WITH_HEADFORMAT &&
+      format.network() != pblczero::NetworkFormat::NETWORK_SE_WITH_HEADFORMAT) {
+    throw Exception("Network format " + std::to_string(format.network()) +
+                    " is not supported by the ONNX converter.");
+  }
+  if (format.policy() != pblczero::NetworkFormat::POLICY_CLASSICAL &&
+      format.policy() != pblczero::NetworkFormat::POLICY_CONVOLUTION) {
+    throw Exception("Policy format " + std::to_string(format.policy()) +
+                    " is not supported by the ONNX converter.");
+  }
+  if (format.value() != pblczero::NetworkFormat::VALUE_CLASSICAL &&
+      format.value() != pblczero::NetworkFormat::VALUE_WDL) {
+    throw Exception("Value format " + std::to_string(format.value()) +
+                    " is not supported by the ONNX converter.");
+  }
+  const bool wdl = format.value() == pblczero::NetworkFormat::VALUE_WDL;
+  const LegacyWeights weights(file.weights());
+  const int num_filters = weights.input.biases.size();
+
+  pblczero::onnx::ModelProto model;
+  model.set_ir_version(kIrVersion);
+  model.set_producer_name("lc0");
+  model.set_producer_version(GetVersionStr());
+  auto opset = model.add_opset_import();
+  opset->set_domain("");
+  opset->set_version(kOpsetVersion);
+  auto graph = model.mutable_graph();
+  graph->set_name("lc0");
+  OnnxBuilder builder(graph);
+
+  // Input and residual tower.
+  builder.AddInput(kOnnxInputName, {kInputPlanes, 8, 8});
+  auto flow = builder.Unary(
+      "input/relu", "Relu",
+      builder.Conv("input/conv", kOnnxInputName, kInputPlanes, weights.input));
+  for (size_t i = 0; i < weights.residual.size(); ++i) {
+    const auto& block = weights.residual[i];
+    const std::string name = "block" + std::to_string(i);
+    auto conv1 = builder.Unary(
+        name + "/conv1/relu", "Relu",
+        builder.Conv(name + "/conv1", flow, num_filters, block.conv1));
+    auto conv2 = builder.Conv(name + "/conv2", conv1, num_filters, block.conv2);
+    if (block.has_se) {
+      conv2 = builder.SqueezeExcitation(name + "/se", conv2, num_filters,
+                                        block.se);
+    }
+    flow = builder.Unary(name + "/relu", "Relu",
+                         builder.Binary(name + "/add", "Add", conv2, flow));
+  }
+
+  // Policy head.
+  std::string policy;
+  if (format.policy() == pblczero::NetworkFormat::POLICY_CONVOLUTION) {
+    auto conv1 = builder.Unary(
+        "policy/conv1/relu", "Relu",
+        builder.Conv("policy/conv1", flow, num_filters, weights.policy1));
+    auto conv2 = builder.Conv("policy/conv2", conv1, num_filters,
+                              weights.policy);
+    const int64_t planes = weights.policy.biases.size() * 8 * 8;
+    auto flat = builder.Binary("policy/flatten", "Reshape", conv2,
+                               builder.AddInt64s("policy/shape", {-1, planes}));
+    // Picks the policy outputs from the planes.
+    std::vector<int64_t> indices(kNumOutputPolicy);
+    for (size_t i = 0; i < sizeof(kConvPolicyMap) / sizeof(kConvPolicyMap[0]);
+         ++i) {
+      if (kConvPolicyMap[i] >= 0) indices[kConvPolicyMap[i]] = i;
+    }
+    auto gather = builder.AddNode(
+        "policy/map", "Gather",
+        {flat, builder.AddInt64s("policy/indices", indices)});
+    builder.AddInt(gather, "axis", 1);
+    policy = gather->output(0);
+  } else {
+    auto conv = builder.Unary(
+        "policy/conv/relu", "Relu",
+        builder.Conv("policy/conv", flow, num_filters, weights.policy));
+    policy = builder.FullyConnected("policy/fc",
+                                    builder.Flatten("policy/flatten", conv),
+                                    weights.ip_pol_w, weights.ip_pol_b);
+  }
+  auto policy_out = builder.AddNode(kOnnxPolicyName, "Softmax", {policy});
+  builder.AddInt(policy_out, "axis", 1);
+  builder.AddOutput(kOnnxPolicyName, {kNumOutputPolicy});
+
+  // Value head.
+  auto conv = builder.Unary(
+      "value/conv/relu", "Relu",
+      builder.Conv("value/conv", flow, num_filters, weights.value));
+  auto fc1 = builder.Unary(
+      "value/fc1/relu", "Relu",
+      builder.FullyConnected("value/fc1", builder.Flatten("value/flatten", conv),
+                             weights.ip1_val_w, weights.ip1_val_b));
+  auto fc2 = builder.FullyConnected("value/fc2", fc1, weights.ip2_val_w,
+                                    weights.ip2_val_b);
+  if (wdl) {
+    builder.AddInt(builder.AddNode(kOnnxValueName, "Softmax", {fc2}), "axis",
+                   1);
+  } else {
+    builder.AddNode(kOnnxValueName, "Tanh", {fc2});
+  }
+  builder.AddOutput(kOnnxValueName, {wdl ? 3 : 1});
+
+  return model.SerializeAsString();
+}
+
+namespace {
+const OptionId kWeightsId{"weights", "",
+                          "Weights file to convert, in lc0 format."};
+const OptionId kOutputId{"output", "", "ONNX model file to write."};
+}  // namespace
+
+void OnnxExporter::Run() {
+  OptionsParser options;
+  options.Add<StringOption>(kWeightsId);
+  options.Add<StringOption>(kOutputId);
+  if (!options.ProcessAllFlags()) return;
+
+  try {
+    const auto option_dict = options.GetOptionsDict();
+    const auto weights = option_dict.Get<std::string>(kWeightsId.GetId());
+    const auto output = option_dict.Get<std::string>(kOutputId.GetId());
+    if (weights.empty() || output.empty()) {
+      throw Exception("Both --weights and --output are needed.");
+    }
+    const auto model = ConvertWeightsToOnnx(LoadWeightsFromFile(weights));
+    std::ofstream out(output, std::ios::binary | std::ios::trunc);
+    out.write(model.data(), model.size());
+    if (!out) throw Exception("Cannot write " + output);
+    std::cerr << "Wrote " << output << std::endl;
+  } catch (Exception& ex) {
+    std::cerr << ex.what() << std::endl;
+  }
+}
+
+}  // namespace lczero
@@ -0,0 +1,57 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2019 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+
+  If you modify this Program, or any covered work, by linking or
+  combining it with NVIDIA Corporation's libraries from the NVIDIA CUDA
+  Toolkit and the NVIDIA CUDA Deep Neural Network library (or a
+  modified version of those libraries), containing parts covered by the
+  terms of the respective license agreement, the licensors of this
+  Program grant you additional permission to convey the resulting work.
+*/
+
+#pragma once
+
+#include <string>
+
+#include "neural/loader.h"
+
+namespace lczero {
+
+// Names of the graph's input and outputs. The input is the expanded planes,
+// [batch, kInputPlanes, 8, 8]. The outputs are the policy, [batch, 1858],
+// after softmax, and the value, [batch, 1] after tanh or [batch, 3] WDL
+// probabilities.
+extern const char* const kOnnxInputName;
+extern const char* const kOnnxPolicyName;
+extern const char* const kOnnxValueName;
+
+// Converts the network of @weights to a serialized ONNX model, with the batch
+// size left open. Throws if the network format isn't supported.
+std::string ConvertWeightsToOnnx(const WeightsFile& weights);
+
+// Writes the ONNX model of a weights file, to profile the network with tools
+// that read ONNX.
+class OnnxExporter {
+ public:
+  OnnxExporter() = default;
+
+  void Run();
+};
+
+}  // namespace lczero
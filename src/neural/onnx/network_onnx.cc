@@ -0,0 +1,267 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2019 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+
+  If you modify this Program, or any covered work, by linking or
+  combining it with NVIDIA Corporation's libraries from the NVIDIA CUDA
+  Toolkit and the NVIDIA CUDA Deep Neural Network library (or a
+  modified version of those libraries), containing parts covered by the
+  terms of the respective license agreement, the licensors of this
+  Program grant you additional permission to convey the resulting work.
+*/
+
+// ONNX Runtime backend. Runs the network converted to ONNX, or a model file
+// exported before, on the execution provider picked with the "provider"
+// backend option: cpu, cuda, or any other provider name ONNX Runtime knows.
+
+#include <onnxruntime_cxx_api.h>
+
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "neural/factory.h"
+#include "neural/onnx/converter.h"
+#include "neural/shared/planes.h"
+#include "utils/exception.h"
+#include "utils/logging.h"
+#include "utils/trace.h"
+
+namespace lczero {
+namespace {
+
+constexpr int kNumOutputPolicy = 1858;
+
+// Inputs and results of a batch, with the binding of the session to them.
+// Kept by the network between computations, the binding is only redone when
+// the batch size changes.
+struct OnnxWorkspace {
+  explicit OnnxWorkspace(Ort::Session* session) : binding(*session) {}
+
+  // Binds the buffers for a batch of @batch_size, growing them if needed.
+  void Bind(int batch_size, int value_size) {
+    if (batch_size == bound_batch_size) return;
+    if (input.size() < static_cast<size_t>(batch_size) * kInputPlanes * 64) {
+      input.resize(batch_size * kInputPlanes * 64);
+      policy.resize(batch_size * kNumOutputPolicy);
+      value.resize(batch_size * value_size);
+    }
+    const auto memory_info =
+        Ort::MemoryInfo::CreateCpu(OrtArenaAllocator, OrtMemTypeDefault);
+    const int64_t input_shape[] = {batch_size, kInputPlanes, 8, 8};
+    const int64_t policy_shape[] = {batch_size, kNumOutputPolicy};
+    const int64_t value_shape[] = {batch_size, value_size};
+    binding.ClearBoundInputs();
+    binding.ClearBoundOutputs();
+    binding.BindInput(kOnnxInputName,
+                      Ort::Value::CreateTensor<float>(
+                          memory_info, input.data(),
+                          batch_size * kInputPlanes * 64, input_shape, 4));
+    binding.BindOutput(kOnnxPolicyName,
+                       Ort::Value::CreateTensor<float>(
+                           memory_info, policy.data(),
+                           batch_size * kNumOutputPolicy, policy_shape, 2));
+    binding.BindOutput(kOnnxValueName,
+                       Ort::Value::CreateTensor<float>(
+                           memory_info, value.data(), batch_size * value_size,
+                           value_shape, 2));
+    bound_batch_size = batch_size;
+  }
+
+  Ort::IoBinding binding;
+  int bound_batch_size = 0;
+  // Expanded input planes, and the outputs.
+  std::vector<float> input;
+  std::vector<float> policy;
+  std::vector<float> value;
+  // Inputs added, cleared when handed out again.
+  std::vector<InputPlanes> planes;
+};
+
+class OnnxNetwork;
+
+class OnnxComputation : public NetworkComputation {
+ public:
+  OnnxComputation(OnnxNetwork* network, bool wdl);
+  ~OnnxComputation() override;
+
+  void AddInput(InputPlanes&& input) override {
+    workspace_->planes.emplace_back(std::move(input));
+  }
+
+  void ComputeBlocking() override;
+
+  int GetBatchSize() const override {
+    return static_cast<int>(workspace_->planes.size());
+  }
+
+  float GetQVal(int sample) const override {
+    if (wdl_) {
+      auto w = workspace_->value[3 * sample + 0];
+      auto l = workspace_->value[3 * sample + 2];
+      return w - l;
+    }
+    return workspace_->value[sample];
+  }
+
+  float GetDVal(int sample) const override {
+    if (wdl_) return workspace_->value[3 * sample + 1];
+    return 0.0f;
+  }
+
+  float GetPVal(int sample, int move_id) const override {
+    return workspace_->policy[sample * kNumOutputPolicy + move_id];
+  }
+
+ private:
+  OnnxNetwork* network_;
+  std::unique_ptr<OnnxWorkspace> workspace_;
+  bool wdl_;
+};
+
+class OnnxNetwork : public Network {
+ public:
+  OnnxNetwork(const WeightsFile& file, const OptionsDict& options)
+      : env_(ORT_LOGGING_LEVEL_WARNING, "lc0") {
+    const auto provider = options.GetOrDefault<std::string>("provider", "cpu");
+    const auto model_file = options.GetOrDefault<std::string>("model", "");
+    max_batch_size_ = options.GetOrDefault<int>("max_batch", 1024);
+
+    Ort::SessionOptions session_options;
+    session_options.SetGraphOptimizationLevel(
+        GraphOptimizationLevel::ORT_ENABLE_ALL);
+    if (options.Exists<int>("threads")) {
+      session_options.SetIntraOpNumThreads(options.Get<int>("threads"));
+    }
+    if (provider == "cuda") {
+      OrtCUDAProviderOptions cuda_options;
+      cuda_options.device_id = options.GetOrDefault<int>("gpu", 0);
+      session_options.AppendExecutionProvider_CUDA(cuda_options);
+    } else if (provider != "cpu") {
+      session_options.AppendExecutionProvider(provider);
+    }
+
+    std::string model;
+    if (model_file.empty()) {
+      model = ConvertWeightsToOnnx(file);
+    } else {
+      std::ifstream in(model_file, std::ios::binary);
+      if (!in) throw Exception("Cannot read ONNX model " + model_file);
+      model.assign(std::istreambuf_iterator<char>(in),
+                   std::istreambuf_iterator<char>());
+    }
+    session_ = std::make_unique<Ort::Session>(env_, model.data(), model.size(),
+                                              session_options);
+
+    // The value output tells whether it's a WDL network, as a model loaded
+    // from a file may not be the one of the weights.
+    for (size_t i = 0; i < session_->GetOutputCount(); ++i) {
+      Ort::AllocatorWithDefaultOptions allocator;
+      if (std::string(session_->GetOutputNameAllocated(i, allocator).get()) !=
+          kOnnxValueName) {
+        continue;
+      }
+      const auto shape = session_->GetOutputTypeInfo(i)
+                             .GetTensorTypeAndShapeInfo()
+                             .GetShape();
+      value_size_ = shape.size() == 2 ? shape[1] : 0;
+    }
+    if (value_size_ != 1 && value_size_ != 3) {
+      throw Exception("ONNX model has no usable value output");
+    }
+    CERR << "ONNX Runtime " << Ort::GetVersionString() << ", provider "
+         << provider << (model_file.empty() ? "" : ", model " + model_file);
+  }
+
+  std::unique_ptr<NetworkComputation> NewComputation() override {
+    return std::make_unique<OnnxComputation>(this, value_size_ == 3);
+  }
+
+  void Compute(OnnxWorkspace* workspace) {
+    TRACE_SCOPE("onnx compute");
+    const int batch_size = workspace->planes.size();
+    if (batch_size == 0) return;
+    if (batch_size > max_batch_size_) {
+      throw Exception("Batch of " + std::to_string(batch_size) +
+                      " is larger than max_batch");
+    }
+    workspace->Bind(batch_size, value_size_);
+    for (int i = 0; i < batch_size; ++i) {
+      ExpandPlanes(workspace->planes[i],
+                   &workspace->input[i * kInputPlanes * 64]);
+    }
+    session_->Run(Ort::RunOptions{nullptr}, workspace->binding);
+  }
+
+  std::unique_ptr<OnnxWorkspace> GetWorkspace() {
+    std::lock_guard<std::mutex> lock(workspaces_mutex_);
+    if (free_workspaces_.empty()) {
+      return std::make_unique<OnnxWorkspace>(session_.get());
+    }
+    auto workspace = std::move(free_workspaces_.back());
+    free_workspaces_.pop_back();
+    return workspace;
+  }
+
+  void ReleaseWorkspace(std::unique_ptr<OnnxWorkspace> workspace) {
+    workspace->planes.clear();
+    std::lock_guard<std::mutex> lock(workspaces_mutex_);
+    free_workspaces_.push_back(std::move(workspace));
+  }
+
+ private:
+  Ort::Env env_;
+  std::unique_ptr<Ort::Session> session_;
+  int max_batch_size_;
+  int value_size_ = 0;
+  std::mutex workspaces_mutex_;
+  // Destroyed before the session they bind to.
+  std::vector<std::unique_ptr<OnnxWorkspace>> free_workspaces_;
+};
+
+OnnxComputation::OnnxComputation(OnnxNetwork* network, bool wdl)
+    : network_(network), workspace_(network->GetWorkspace()), wdl_(wdl) {}
+
+OnnxComputation::~OnnxComputation() {
+  network_->ReleaseWorkspace(std::move(workspace_));
+}
+
+void OnnxComputation::ComputeBlocking() {
+  try {
+    network_->Compute(workspace_.get());
+  } catch (const Ort::Exception& e) {
+    throw Exception(std::string("ONNX Runtime: ") + e.what());
+  }
+}
+
+std::unique_ptr<Network> MakeOnnxNetwork(const WeightsFile& weights,
+                                         const OptionsDict& options) {
+  try {
+    return std::make_unique<OnnxNetwork>(weights, options);
+  } catch (const Ort::Exception& e) {
+    throw Exception(std::string("ONNX Runtime: ") + e.what());
+  }
+}
+
+}  // namespace
+
+REGISTER_NETWORK("onnx", MakeOnnxNetwork, 40)
+
+}  // namespace lczero
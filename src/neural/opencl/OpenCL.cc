@@ -229,7 +229,7 @@ std::vector<size_t> OpenCL::get_sgemm_tuners(void) {
   return tuners;
 }
 
-void OpenCL::initialize(const int channels, const OpenCLParams& params) {
+void OpenCL::select_device(const OpenCLParams& params) {
   CERR << "Initializing OpenCL.";
   std::vector<cl::Platform> platforms;
   try {
@@ -335,6 +335,10 @@ void OpenCL::initialize(const int channels, const OpenCLParams& params) {
   }
   m_context = context;
   m_device = best_device;
+}
+
+void OpenCL::initialize(const int channels, const OpenCLParams& params) {
+  if (!m_device()) select_device(params);
 
   // Make program of the source code in the context.
   try {
@@ -350,8 +354,8 @@ void OpenCL::initialize(const int channels, const OpenCLParams& params) {
   m_cl_args = cl_args;
 
   auto t = Tuner(*this, params, m_context, m_device);
-  auto sgemm_tuners = t.load_sgemm_tuners(
-      channels, params.tune_batch_size * WINOGRAD_P, channels, WINOGRAD_TILE);
+  auto sgemm_tuners = t.load_sgemm_tuners(channels, channels,
+                                          params.tune_batch_size, &m_tuned);
 
   // Build program for these specific devices.
   try {
@@ -371,11 +375,11 @@ void OpenCL::initialize(const int channels, const OpenCLParams& params) {
   m_wavefront_size =
       sgemm_kernel
           .getWorkGroupInfo<CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE>(
-              best_device);
+              m_device);
   CERR << "Wavefront/Warp size: " << m_wavefront_size << std::endl;
 
-  m_max_workgroup_size = best_device.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>();
-  m_max_workgroup_dims = best_device.getInfo<CL_DEVICE_MAX_WORK_ITEM_SIZES>();
+  m_max_workgroup_size = m_device.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>();
+  m_max_workgroup_dims = m_device.getInfo<CL_DEVICE_MAX_WORK_ITEM_SIZES>();
 
   CERR << "Max workgroup size: " << m_max_workgroup_size;
   std::ostringstream ss;
@@ -398,6 +402,10 @@ void OpenCL_Network::release_buffers(
   m_buffers_pool.push_back(std::move(buffers));
 }
 
+std::string OpenCL::get_driver_version() {
+  return m_device.getInfo<CL_DRIVER_VERSION>();
+}
+
 std::string OpenCL::get_device_name() {
   std::stringstream ss;
 
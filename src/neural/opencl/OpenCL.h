@@ -215,8 +215,15 @@ class OpenCL {
   friend class Tuner;
 
  public:
+  // Picks the device of params.gpuId, or the best scoring one, and creates
+  // its context. Called by initialize() unless done before.
+  void select_device(const OpenCLParams& params);
   void initialize(const int channels, const OpenCLParams& params);
   std::string get_device_name();
+  std::string get_driver_version();
+  // False if initialize() went with a preset or another batch size's
+  // tuning, to be tuned in background.
+  bool is_tuned() const { return m_tuned; }
 
   std::vector<size_t> get_sgemm_tuners(void);
 
@@ -240,6 +247,7 @@ class OpenCL {
   size_t m_max_workgroup_size{0};
   std::vector<size_t> m_max_workgroup_dims;
   bool m_init_ok{false};
+  bool m_tuned{true};
 };
 
 extern const std::string sourceCode_sgemm;
@@ -36,6 +36,7 @@ OpenCLBuffers::OpenCLBuffers(const OpenCL_Network& opencl_net)
       cl::Kernel(program, "out_transform_fused_bn_in");
   m_global_avg_pooling_kernel = cl::Kernel(program, "global_avg_pooling");
   m_apply_se_kernel = cl::Kernel(program, "apply_se");
+  m_apply_se_in_kernel = cl::Kernel(program, "apply_se_in");
   m_policymap_kernel = cl::Kernel(program, "policymap");
   m_sgemv_kernel = cl::Kernel(program, "Xgemv");
   m_commandqueue = cl::CommandQueue(context, device);
@@ -105,12 +106,18 @@ void OpenCLBuffers::forward(const std::vector<net_t>& input,
                             std::vector<net_t>& output_pol,
                             std::vector<net_t>& output_val,
                             const int batch_size) {
+  enqueue(input, batch_size);
+  wait(output_pol, output_val);
+}
+
+void OpenCLBuffers::enqueue(const std::vector<net_t>& input,
+                            const int batch_size) {
   auto& layers = m_opencl_net.m_layers;
 
   auto finalSize_pol = layers[layers.size() - 2].ip_out_size * sizeof(net_t);
   auto finalSize_val = layers.back().ip_out_size * sizeof(net_t);
 
-  const auto inSize = sizeof(net_t) * input.size();
+  const auto inSize = sizeof(net_t) * batch_size * layers[0].channels * 8 * 8;
   m_commandqueue.enqueueWriteBuffer(m_inBuffer, CL_FALSE, 0, inSize,
                                     input.data());
 
@@ -190,6 +197,12 @@ void OpenCLBuffers::forward(const std::vector<net_t>& input,
       // Output will be written in inBuffer
       assert(niter != cend(layers));
       auto se_weights = begin(layer.weights);
+      // The input transform of a following 3x3 convolution is done by the
+      // SE kernel.
+      auto skip_next_in_trans = false;
+      if (niter->is_residual_block || niter->is_conv_policy) {
+        skip_next_in_trans = true;
+      }
       squeeze_excitation(layer.outputs,        // channels
                          layer.se_fc_outputs,  // fc_outputs
                          m_inBuffer2,          // bufferIn
@@ -197,7 +210,9 @@ void OpenCLBuffers::forward(const std::vector<net_t>& input,
                          m_MBuffer,            // bufferTemp2
                          se_weights,           // weights
                          m_inBuffer,           // residual
+                         skip_next_in_trans ? &m_VBuffer : nullptr,  // V
                          batch_size);          // batch_size
+      skip_in_trans = skip_next_in_trans;
     } else if (layer.is_conv_policy) {
       assert(niter != cend(layers));
       auto conv1_weights = begin(layer.weights);
@@ -263,24 +278,39 @@ void OpenCLBuffers::forward(const std::vector<net_t>& input,
     }
   }
 
-  auto pinnedOutBufferHost_pol = m_commandqueue.enqueueMapBuffer(
+  m_pinnedOutBufferHost_pol = m_commandqueue.enqueueMapBuffer(
       m_pinnedOutBuffer_pol, CL_FALSE, CL_MAP_READ, 0,
       batch_size * finalSize_pol);
-  auto pinnedOutBufferHost_val = m_commandqueue.enqueueMapBuffer(
+  // The queue is in order, so the last map completing means all is done.
+  m_pinnedOutBufferHost_val = m_commandqueue.enqueueMapBuffer(
       m_pinnedOutBuffer_val, CL_FALSE, CL_MAP_READ, 0,
-      batch_size * finalSize_val);
+      batch_size * finalSize_val, nullptr, &m_outputs_ready);
+  m_pending_batch_size = batch_size;
+
+  // Submit now rather than when someone waits.
+  m_commandqueue.flush();
+}
+
+void OpenCLBuffers::wait(std::vector<net_t>& output_pol,
+                         std::vector<net_t>& output_val) {
+  auto& layers = m_opencl_net.m_layers;
 
-  m_commandqueue.finish();
+  auto finalSize_pol = layers[layers.size() - 2].ip_out_size * sizeof(net_t);
+  auto finalSize_val = layers.back().ip_out_size * sizeof(net_t);
+  const auto batch_size = m_pending_batch_size;
 
-  std::memcpy(output_pol.data(), pinnedOutBufferHost_pol,
+  m_outputs_ready.wait();
+
+  std::memcpy(output_pol.data(), m_pinnedOutBufferHost_pol,
               batch_size * finalSize_pol);
-  std::memcpy(output_val.data(), pinnedOutBufferHost_val,
+  std::memcpy(output_val.data(), m_pinnedOutBufferHost_val,
               batch_size * finalSize_val);
 
   m_commandqueue.enqueueUnmapMemObject(m_pinnedOutBuffer_pol,
-                                       pinnedOutBufferHost_pol);
+                                       m_pinnedOutBufferHost_pol);
   m_commandqueue.enqueueUnmapMemObject(m_pinnedOutBuffer_val,
-                                       pinnedOutBufferHost_val);
+                                       m_pinnedOutBufferHost_val);
+  m_pending_batch_size = 0;
 }
 
 void OpenCLBuffers::convolve3(int channels, int outputs, cl::Buffer& bufferIn,
@@ -414,7 +444,7 @@ void OpenCLBuffers::convolve3(int channels, int outputs, cl::Buffer& bufferIn,
 void OpenCLBuffers::squeeze_excitation(
     int channels, int fc_outputs, cl::Buffer& bufferIn, cl::Buffer& bufferTemp1,
     cl::Buffer& bufferTemp2, weight_slice_t weights, cl::Buffer& bufferResidual,
-    int batch_size) {
+    cl::Buffer* bufferV, int batch_size) {
   constexpr int width = 8;
 
   try {
@@ -438,15 +468,37 @@ void OpenCLBuffers::squeeze_excitation(
                2 * channels, false, batch_size);
 
   try {
-    m_apply_se_kernel.setArg(0, channels);
-    m_apply_se_kernel.setArg(1, batch_size);
-    m_apply_se_kernel.setArg(2, bufferIn);
-    m_apply_se_kernel.setArg(3, bufferResidual);
-    m_apply_se_kernel.setArg(4, bufferTemp1);
+    if (bufferV) {
+      // Same padding as convolve3() uses for the next convolution.
+      const auto& tuners = m_opencl.m_sgemm_tuners;
+      auto k_ceil = int(
+          ceilMultiple(ceilMultiple(channels, tuners.kwg), tuners.vwm));
+      auto n_ceil = int(ceilMultiple(
+          ceilMultiple(batch_size * WINOGRAD_P, tuners.nwg), tuners.vwn));
+
+      m_apply_se_in_kernel.setArg(0, channels);
+      m_apply_se_in_kernel.setArg(1, batch_size);
+      m_apply_se_in_kernel.setArg(2, bufferIn);
+      m_apply_se_in_kernel.setArg(3, bufferResidual);
+      m_apply_se_in_kernel.setArg(4, bufferTemp1);
+      m_apply_se_in_kernel.setArg(5, *bufferV);
+      m_apply_se_in_kernel.setArg(6, k_ceil);
+      m_apply_se_in_kernel.setArg(7, n_ceil);
 
-    m_commandqueue.enqueueNDRangeKernel(
-        m_apply_se_kernel, cl::NullRange,
-        cl::NDRange(width, batch_size * channels));
+      m_commandqueue.enqueueNDRangeKernel(
+          m_apply_se_in_kernel, cl::NullRange,
+          cl::NDRange(width, batch_size * channels), cl::NDRange(width, 1));
+    } else {
+      m_apply_se_kernel.setArg(0, channels);
+      m_apply_se_kernel.setArg(1, batch_size);
+      m_apply_se_kernel.setArg(2, bufferIn);
+      m_apply_se_kernel.setArg(3, bufferResidual);
+      m_apply_se_kernel.setArg(4, bufferTemp1);
+
+      m_commandqueue.enqueueNDRangeKernel(
+          m_apply_se_kernel, cl::NullRange,
+          cl::NDRange(width, batch_size * channels));
+    }
   } catch (const cl::Error& e) {
     CERR << "Error in squeeze_excitation/apply_se: " << e.what() << ": "
          << e.err() << std::endl;
@@ -51,6 +51,15 @@ class OpenCLBuffers {
   void forward(const std::vector<net_t>& input, std::vector<net_t>& output_pol,
                std::vector<net_t>& output_val, const int batch_size);
 
+  // Queues the upload of @input, the network and the download of the
+  // outputs, and returns without waiting. @input has to stay valid until
+  // wait(). Buffers sets have a command queue each, so the transfers of one
+  // overlap with the kernels of another.
+  void enqueue(const std::vector<net_t>& input, const int batch_size);
+
+  // Blocks until the last enqueue() is done and copies its outputs.
+  void wait(std::vector<net_t>& output_pol, std::vector<net_t>& output_val);
+
  private:
   using weight_slice_t = std::vector<cl::Buffer>::const_iterator;
 
@@ -72,7 +81,7 @@ class OpenCLBuffers {
   void squeeze_excitation(int channels, int fc_outputs, cl::Buffer& bufferIn,
                           cl::Buffer& bufferTemp1, cl::Buffer& bufferTemp2,
                           weight_slice_t weights, cl::Buffer& bufferResidual,
-                          int batch_size);
+                          cl::Buffer* bufferV, int batch_size);
 
   void policymap(int N, const cl::Buffer& input, cl::Buffer& output,
                  const cl::Buffer& indices, int inputSize, int usedSize,
@@ -91,6 +100,7 @@ class OpenCLBuffers {
   cl::Kernel m_out_transform_bn_in_kernel;
   cl::Kernel m_global_avg_pooling_kernel;
   cl::Kernel m_apply_se_kernel;
+  cl::Kernel m_apply_se_in_kernel;
   cl::Kernel m_policymap_kernel;
   cl::Buffer m_inBuffer;
   cl::Buffer m_inBuffer2;
@@ -99,4 +109,10 @@ class OpenCLBuffers {
   cl::Buffer m_pool_buffer;
   cl::Buffer m_pinnedOutBuffer_pol;
   cl::Buffer m_pinnedOutBuffer_val;
+
+  // State of the batch between enqueue() and wait().
+  int m_pending_batch_size = 0;
+  void* m_pinnedOutBufferHost_pol = nullptr;
+  void* m_pinnedOutBufferHost_val = nullptr;
+  cl::Event m_outputs_ready;
 };
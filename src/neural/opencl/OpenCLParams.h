@@ -28,4 +28,7 @@ struct OpenCLParams {
   bool force_tune = false;
   bool tune_exhaustive = false;
   int tune_batch_size = 1;
+  // Start with the nearest tuned batch size or a preset, and leave the
+  // tuning to the caller rather than blocking initialization.
+  bool tune_in_background = false;
 };
@@ -22,6 +22,7 @@
 #include <array>
 #include <cassert>
 #include <cmath>
+#include <cstdlib>
 #include <fstream>
 #include <iomanip>
 #include <map>
@@ -37,6 +38,10 @@
 
 const auto TUNER_FILE_LOCAL = std::string("leelaz_opencl_tuning");
 constexpr auto MAX_ERROR = 1e-4f;
+// Used until tuning is done: small work groups that every device supports.
+const auto PRESET_TUNERS = std::string(
+    " -DKWG=32 -DKWI=2 -DMDIMA=8 -DMDIMC=8 -DMWG=32 -DNDIMB=8 -DNDIMC=8"
+    " -DNWG=32 -DSA=0 -DSB=0 -DSTRM=0 -DSTRN=0 -DVWM=2 -DVWN=2");
 
 static void sgemmBatched_ref(const std::vector<float>& a,
                              const std::vector<float>& b, std::vector<float>& c,
@@ -271,6 +276,9 @@ std::string Tuner::tune_sgemm(const int m, const int n, const int k,
 
   for (const auto& i : valid_params) {
     param_counter++;
+    if (m_abort && *m_abort) {
+      throw std::runtime_error("Tuning aborted.");
+    }
 
     auto p = get_parameters_by_int(opts, i);
     auto defines = parameters_to_defines(p);
@@ -366,8 +374,14 @@ std::string Tuner::tune_sgemm(const int m, const int n, const int k,
   return best_params;
 }
 
-void Tuner::store_sgemm_tuners(const int m, const int n, const int k,
-                               const int batch_size, std::string tuners) {
+int Tuner::batch_bucket(const int batch_size) {
+  auto bucket = 1;
+  while (bucket < batch_size) bucket *= 2;
+  return bucket;
+}
+
+void Tuner::store_sgemm_tuners(const int m, const int k, const int bucket,
+                               std::string tuners) {
   auto file_contents = std::vector<std::string>();
   {
     // Read the previous contents to string.
@@ -381,19 +395,21 @@ void Tuner::store_sgemm_tuners(const int m, const int n, const int k,
   }
   auto file = std::ofstream{TUNER_FILE_LOCAL};
 
-  auto device_name = m_opencl.get_device_name();
   auto tuning_params = std::stringstream{};
-  tuning_params << m << ";" << n << ";" << k << ";" << batch_size;
+  tuning_params << m << ";" << k << ";" << bucket;
 
   auto tuning_line_prefix = std::to_string(TUNER_VERSION) + ";XgemmBatched;" +
                             tuning_params.str() + ";";
-  auto tuning_line = tuning_line_prefix + tuners + ";" + device_name;
+  auto tuning_line = tuning_line_prefix + tuners + ";" +
+                     m_opencl.get_device_name() + ";" +
+                     m_opencl.get_driver_version();
 
   // Write back previous data as long as it's not the device and
   // tuning we just tuned.
   for (const auto& line : file_contents) {
-    if (line.find(tuning_line_prefix) == std::string::npos ||
-        line.find(device_name) == std::string::npos) {
+    auto line_bucket = 0;
+    if (line.find(tuning_line_prefix) != 0 ||
+        sgemm_tuners_from_line(line, m, k, &line_bucket).empty()) {
       file << line << std::endl;
     }
   }
@@ -408,8 +424,7 @@ void Tuner::store_sgemm_tuners(const int m, const int n, const int k,
 }
 
 std::string Tuner::sgemm_tuners_from_line(std::string line, const int m,
-                                          const int n, const int k,
-                                          const int batch_size) {
+                                          const int k, int* bucket) {
   auto s = std::vector<std::string>{};
   auto ss = std::stringstream{line};
   auto item = std::string{};
@@ -418,6 +433,7 @@ std::string Tuner::sgemm_tuners_from_line(std::string line, const int m,
     s.emplace_back(item);
   }
 
+  // Version; kernel; m; k; batch bucket; tuners; device; driver version.
   if (s.size() != 8) {
     return "";
   }
@@ -434,48 +450,68 @@ std::string Tuner::sgemm_tuners_from_line(std::string line, const int m,
     return "";
   }
 
-  if (s[3] != std::to_string(n)) {
-    return "";
-  }
-
-  if (s[4] != std::to_string(k)) {
+  if (s[3] != std::to_string(k)) {
     return "";
   }
 
-  if (s[5] != std::to_string(batch_size)) {
+  if (s[6] != m_opencl.get_device_name()) {
     return "";
   }
 
-  if (s[7] != m_opencl.get_device_name()) {
+  if (s[7] != m_opencl.get_driver_version()) {
     return "";
   }
 
-  return s[6];
+  *bucket = std::atoi(s[4].c_str());
+  return s[5];
 }
 
-std::string Tuner::load_sgemm_tuners(const int m, const int n, const int k,
-                                     const int batch_size) {
+std::string Tuner::load_sgemm_tuners(const int m, const int k,
+                                     const int batch_size, bool* tuned) {
+  const auto bucket = batch_bucket(batch_size);
+  *tuned = true;
   if (!m_params.force_tune) {
+    auto nearest = std::string{};
+    auto nearest_bucket = 0;
     auto file = std::ifstream{TUNER_FILE_LOCAL};
     if (file.good()) {
       auto line = std::string{};
       while (std::getline(file, line)) {
-        auto tuners = sgemm_tuners_from_line(line, m, n, k, batch_size);
-        if (tuners.size() != 0) {
-          // batch_size argument is the number of batched sgemm calls, which
-          // equals the number of elements in one tile.
-          // Convolution batch size affects the "n" dimension of
-          // the matrix multiplication (n = WINOGRAD_P * batch_size).
-          CERR << "Loaded existing SGEMM tuning for batch size "
-               << n / WINOGRAD_P << ".";
+        auto line_bucket = 0;
+        auto tuners = sgemm_tuners_from_line(line, m, k, &line_bucket);
+        if (tuners.size() == 0) continue;
+        if (line_bucket == bucket) {
+          CERR << "Loaded existing SGEMM tuning for batch size " << bucket
+               << ".";
           return tuners;
         }
+        // Buckets are powers of two, compare them by ratio.
+        auto distance = [bucket](int b) {
+          return std::abs(std::log2(double(b) / bucket));
+        };
+        if (nearest.empty() ||
+            distance(line_bucket) < distance(nearest_bucket)) {
+          nearest = tuners;
+          nearest_bucket = line_bucket;
+        }
       }
     }
+    if (!nearest.empty()) {
+      CERR << "Using SGEMM tuning of batch size " << nearest_bucket
+           << " for batch size " << bucket << ".";
+      // Good enough unless there's a chance to do better for free.
+      *tuned = !m_params.tune_in_background;
+      return nearest;
+    }
+    if (m_params.tune_in_background && !m_params.tune_only) {
+      CERR << "No SGEMM tuning for this device yet, using a preset until "
+              "it is tuned.";
+      *tuned = false;
+      return PRESET_TUNERS;
+    }
   }
 
-  auto tuners = tune_sgemm(m, n, k, batch_size);
-  store_sgemm_tuners(m, n, k, batch_size, tuners);
+  auto tuners = tune_and_store(m, k, batch_size);
 
   // Exit immediately after tuning. Some NVIDIA drivers are buggy,
   // and will fail to compile the rest of the kernels after a tuning,
@@ -485,3 +521,15 @@ std::string Tuner::load_sgemm_tuners(const int m, const int n, const int k,
   }
   return tuners;
 }
+
+std::string Tuner::tune_and_store(const int m, const int k,
+                                  const int batch_size) {
+  const auto bucket = batch_bucket(batch_size);
+  // batch_size argument of tune_sgemm() is the number of batched sgemm
+  // calls, which equals the number of elements in one tile. Convolution
+  // batch size affects the "n" dimension of the matrix multiplication
+  // (n = WINOGRAD_P * batch_size).
+  auto tuners = tune_sgemm(m, bucket * WINOGRAD_P, k, WINOGRAD_TILE);
+  store_sgemm_tuners(m, k, bucket, tuners);
+  return tuners;
+}
@@ -21,6 +21,7 @@
 
 #pragma once
 
+#include <atomic>
 #include <map>
 #include <string>
 #include <vector>
@@ -37,14 +38,29 @@ class Tuner {
   const OpenCLParams& m_params;
   cl::Context m_context;
   cl::Device m_device;
+  const std::atomic<bool>* m_abort = nullptr;
 
  public:
   std::string tune_sgemm(const int m, const int n, const int k,
                          const int batch_size, const int runs = 4);
-  std::string load_sgemm_tuners(const int m, const int n, const int k,
-                                const int batch_size);
 
-  static constexpr auto TUNER_VERSION = 0;
+  // Tuners of the Winograd sgemm for a m x k weight matrix and convolutions
+  // of @batch_size. Taken from the tuning cache, preferring the batch bucket
+  // of @batch_size and otherwise the nearest one tuned. If there is none,
+  // tunes now, unless tuning in background: then returns a preset. Sets
+  // @tuned to false when the exact bucket still needs tuning.
+  std::string load_sgemm_tuners(const int m, const int k, const int batch_size,
+                                bool* tuned);
+  // Tunes the batch bucket of @batch_size and stores it in the cache.
+  std::string tune_and_store(const int m, const int k, const int batch_size);
+
+  // Batch sizes are tuned and cached by the power of two at or above them.
+  static int batch_bucket(const int batch_size);
+
+  // Makes tune_sgemm() throw once @abort is set.
+  void set_abort(const std::atomic<bool>* abort) { m_abort = abort; }
+
+  static constexpr auto TUNER_VERSION = 1;
   Tuner(OpenCL& opencl, const OpenCLParams& params, cl::Context context,
         cl::Device device)
       : m_opencl(opencl),
@@ -53,13 +69,15 @@ class Tuner {
         m_device(device) {}
 
  private:
-  void store_sgemm_tuners(const int m, const int n, const int k,
-                          const int batch_size, std::string tuners);
+  void store_sgemm_tuners(const int m, const int k, const int bucket,
+                          std::string tuners);
   bool valid_config_sgemm(TuneParameters p, bool exhaustive);
   std::string parameters_to_defines(const TuneParameters& p);
   std::string parameters_to_string(const TuneParameters& p);
   TuneParameters get_parameters_by_int(const std::vector<Configurations>& opts,
                                        const int n);
-  std::string sgemm_tuners_from_line(std::string line, const int m, const int n,
-                                     const int k, const int batch_size);
+  // The tuners on a cache @line for this device and @m, @k, with their batch
+  // bucket in @bucket, or empty if the line is for something else.
+  std::string sgemm_tuners_from_line(std::string line, const int m,
+                                     const int k, int* bucket);
 };
@@ -20,20 +20,32 @@
 #include "neural/network.h"
 #include "neural/opencl/OpenCL.h"
 #include "neural/opencl/OpenCLParams.h"
+#include "neural/opencl/OpenCLTuner.h"
 #include "neural/shared/activation.h"
+#include "neural/shared/planes.h"
 #include "neural/shared/policy_map.h"
 #include "neural/shared/winograd_filter.h"
 
 #include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <chrono>
 #include <cmath>
 #include <condition_variable>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <set>
 #include <thread>
 
 #include "neural/network_legacy.h"
 #include "utils/bititer.h"
 #include "utils/exception.h"
 #include "utils/logging.h"
+#include "utils/string.h"
+#include "utils/threadpool.h"
+#include "utils/trace.h"
 #include "utils/weights_adapter.h"
 
 namespace lczero {
@@ -55,30 +67,187 @@ struct OpenCLWeights {
         num_value_channels(LayerAdapter(file.weights().ip1_val_b()).size()) {}
 };
 
+// The device with the weights uploaded and the kernels built for one set of
+// sgemm tuners.
+struct OpenCLInstance {
+  OpenCL opencl;
+  OpenCL_Network net{opencl};
+};
+
+// Samples per second each device has been computing at, for splitting the
+// batches across devices in proportion.
+class OpenCLThroughput {
+ public:
+  explicit OpenCLThroughput(size_t devices) : rates_(devices, 0.0) {}
+
+  // Returns how many of @samples each device gets. Until every device has
+  // been measured, they get equal shares.
+  std::vector<size_t> Split(size_t samples) const {
+    std::vector<double> rates;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      rates = rates_;
+    }
+    if (std::any_of(rates.begin(), rates.end(),
+                    [](double rate) { return rate <= 0.0; })) {
+      std::fill(rates.begin(), rates.end(), 1.0);
+    }
+    const auto total = std::accumulate(rates.begin(), rates.end(), 0.0);
+    std::vector<size_t> counts(rates.size());
+    std::vector<double> remainders(rates.size());
+    size_t assigned = 0;
+    for (size_t i = 0; i < rates.size(); i++) {
+      const auto share = samples * rates[i] / total;
+      counts[i] = static_cast<size_t>(share);
+      remainders[i] = share - counts[i];
+      assigned += counts[i];
+    }
+    // Largest remainders first.
+    while (assigned < samples) {
+      const auto i = std::max_element(remainders.begin(), remainders.end()) -
+                     remainders.begin();
+      counts[i]++;
+      remainders[i] = -1.0;
+      assigned++;
+    }
+    return counts;
+  }
+
+  void Update(size_t device, size_t samples, double seconds) {
+    if (samples == 0 || seconds <= 0.0) return;
+    const auto rate = samples / seconds;
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto& average = rates_[device];
+    average = average <= 0.0 ? rate : average + kDecay * (rate - average);
+  }
+
+ private:
+  static constexpr double kDecay = 0.1;
+
+  mutable std::mutex mutex_;
+  std::vector<double> rates_;
+};
+
 class OpenCLComputation : public NetworkComputation {
  public:
-  OpenCLComputation(const OpenCL_Network& opencl_net,
-                    const OpenCLWeights& weights, const bool wdl)
-      : opencl_net_(opencl_net),
+  OpenCLComputation(
+      std::vector<std::shared_ptr<const OpenCLInstance>> instances,
+      OpenCLThroughput* throughput, const OpenCLWeights& weights,
+      const bool wdl, const size_t pipeline_depth)
+      : instances_(std::move(instances)),
+        throughput_(throughput),
         weights_(weights),
         policies_(),
         q_values_(),
-        wdl_(wdl) {
-    buffers_ = opencl_net.acquire_buffers();
+        buffers_(instances_.size()),
+        wdl_(wdl),
+        pipeline_depth_(pipeline_depth) {
+    buffers_[0].emplace_back(instances_[0]->net.acquire_buffers());
   }
 
   virtual ~OpenCLComputation() {
-    opencl_net_.release_buffers(std::move(buffers_));
+    for (size_t device = 0; device < instances_.size(); device++) {
+      for (auto& buffers : buffers_[device]) {
+        instances_[device]->net.release_buffers(std::move(buffers));
+      }
+    }
   }
 
   // Adds a sample to the batch.
-  void AddInput(InputPlanes&& input) override { planes_.emplace_back(input); }
+  void AddInput(InputPlanes&& input) override {
+    planes_.emplace_back(std::move(input));
+  }
 
   // Do the computation.
   void ComputeBlocking() override {
-    // Determine the largest batch for allocations.
+    TRACE_SCOPE("opencl compute");
     const auto plane_count = planes_.size();
-    const auto max_batch_size = opencl_net_.getMaxMatchSize();
+    if (plane_count == 0) return;
+    policies_.resize(plane_count);
+    q_values_.resize(plane_count * (wdl_ ? 3 : 1));
+    if (instances_.size() == 1) {
+      Compute(0, 0, plane_count);
+      return;
+    }
+
+    // Each device takes its share on its own queues, the calling thread
+    // doing the last one and the threads of the pool the others.
+    const auto counts = throughput_->Split(plane_count);
+    std::vector<std::future<void>> done;
+    std::exception_ptr error;
+    std::mutex error_mutex;
+    size_t start = 0;
+    for (size_t device = 0; device < instances_.size(); device++) {
+      const auto end = start + counts[device];
+      if (start == end) continue;
+      auto compute = [this, device, start, end, &error, &error_mutex]() {
+        try {
+          const auto begin = std::chrono::steady_clock::now();
+          Compute(device, start, end);
+          const std::chrono::duration<double> seconds =
+              std::chrono::steady_clock::now() - begin;
+          throughput_->Update(device, end - start, seconds.count());
+        } catch (...) {
+          std::lock_guard<std::mutex> lock(error_mutex);
+          if (!error) error = std::current_exception();
+        }
+      };
+      start = end;
+      if (start == plane_count) {
+        compute();
+      } else {
+        auto promise = std::make_shared<std::promise<void>>();
+        done.push_back(promise->get_future());
+        ThreadPool::Default().Add([compute, promise]() {
+          compute();
+          promise->set_value();
+        });
+      }
+    }
+    for (auto& future : done) future.wait();
+    if (error) std::rethrow_exception(error);
+  }
+
+  // Returns how many times AddInput() was called.
+  int GetBatchSize() const override { return static_cast<int>(planes_.size()); }
+
+  // Returns Q value of @sample.
+  float GetQVal(int sample) const override {
+    if (wdl_) {
+      auto w = q_values_[3 * sample + 0];
+      auto l = q_values_[3 * sample + 2];
+      return w - l;
+    } else {
+      return q_values_[sample];
+    }
+  }
+
+  float GetDVal(int sample) const override {
+    if (wdl_) {
+      auto d = q_values_[3 * sample + 1];
+      return d;
+    } else {
+      return 0.0f;
+    }
+  }
+
+  // Returns P value @move_id of @sample.
+  float GetPVal(int sample, int move_id) const override {
+    return policies_[sample][move_id];
+  }
+
+ private:
+  static constexpr auto kWidth = 8;
+  static constexpr auto kHeight = 8;
+  static constexpr auto kSquares = kWidth * kHeight;
+
+  // Computes samples [@begin, @end) on @device.
+  void Compute(size_t device, size_t begin, size_t end) {
+    const auto& opencl_net = instances_[device]->net;
+    auto& buffers = buffers_[device];
+    const auto plane_count = end - begin;
+    // Determine the largest batch for allocations.
+    const auto max_batch_size = opencl_net.getMaxMatchSize();
     const auto largest_batch_size = std::min(max_batch_size, plane_count);
 
     const auto num_output_policies = weights_.num_output_policies;
@@ -91,24 +260,50 @@ class OpenCLComputation : public NetworkComputation {
 
     std::vector<float> output_pol(largest_batch_size * num_output_policies);
     std::vector<float> output_val(largest_batch_size * num_value_channels);
-    std::vector<float> input_data(largest_batch_size * kInputPlanes * kSquares);
 
-    for (size_t i = 0; i < plane_count; i += largest_batch_size) {
-      const auto batch_size = std::min(plane_count - i, largest_batch_size);
+    // Batches larger than the maximum are split in chunks, up to
+    // pipeline_depth_ of them in flight on as many buffer sets: the next
+    // chunks upload and compute while the host waits for and post-processes
+    // the current one.
+    const auto chunks =
+        (plane_count + largest_batch_size - 1) / largest_batch_size;
+    const auto depth = std::min(chunks, pipeline_depth_);
+    while (buffers.size() < depth) {
+      buffers.emplace_back(opencl_net.acquire_buffers());
+    }
+    std::vector<std::vector<float>> input_data(
+        depth,
+        std::vector<float>(largest_batch_size * kInputPlanes * kSquares));
+
+    auto enqueue = [&](size_t chunk) {
+      const auto slot = chunk % depth;
+      const auto start = chunk * largest_batch_size;
+      const auto batch_size = std::min(plane_count - start, largest_batch_size);
       for (size_t j = 0; j < batch_size; j++) {
-        EncodePlanes(planes_[i + j], &input_data[j * kSquares * kInputPlanes]);
+        ExpandPlanes(planes_[begin + start + j],
+                     &input_data[slot][j * kSquares * kInputPlanes]);
       }
+      buffers[slot]->enqueue(input_data[slot], batch_size);
+    };
 
-      buffers_->forward(input_data, output_pol, output_val, batch_size);
+    for (size_t chunk = 0; chunk < depth; chunk++) enqueue(chunk);
+
+    for (size_t chunk = 0; chunk < chunks; chunk++) {
+      const auto start = chunk * largest_batch_size;
+      const auto batch_size = std::min(plane_count - start, largest_batch_size);
+      buffers[chunk % depth]->wait(output_pol, output_val);
+      // The buffer set is free again, keep the device busy.
+      if (chunk + depth < chunks) enqueue(chunk + depth);
 
       for (size_t j = 0; j < batch_size; j++) {
+        const auto sample = begin + start + j;
         std::vector<float> policy(weights_.num_output_policies);
 
         // Get the moves.
         SoftmaxActivation(num_output_policies,
                           &output_pol[j * num_output_policies], policy.data());
 
-        policies_.emplace_back(std::move(policy));
+        policies_[sample] = std::move(policy);
 
         // Now get the score.
         if (wdl_) {
@@ -122,12 +317,7 @@ class OpenCLComputation : public NetworkComputation {
             }
           }
 
-          std::vector<float> wdl_softmax(3);
-          SoftmaxActivation(3, wdl.data(), wdl_softmax.data());
-
-          q_values_.emplace_back(wdl_softmax[0]);
-          q_values_.emplace_back(wdl_softmax[1]);
-          q_values_.emplace_back(wdl_softmax[2]);
+          SoftmaxActivation(3, wdl.data(), &q_values_[3 * sample]);
         } else {
           auto winrate = weights_.ip2_val_b[0];
           auto ptr_weights = weights_.ip2_val_w.data();
@@ -135,48 +325,16 @@ class OpenCLComputation : public NetworkComputation {
           for (size_t i = 0; i < num_value_channels; i++)
             winrate += ptr_weights[i] * ptr_outputs[i];
 
-          q_values_.emplace_back(std::tanh(winrate));
+          q_values_[sample] = std::tanh(winrate);
         }
       }
     }
   }
 
-  // Returns how many times AddInput() was called.
-  int GetBatchSize() const override { return static_cast<int>(planes_.size()); }
-
-  // Returns Q value of @sample.
-  float GetQVal(int sample) const override {
-    if (wdl_) {
-      auto w = q_values_[3 * sample + 0];
-      auto l = q_values_[3 * sample + 2];
-      return w - l;
-    } else {
-      return q_values_[sample];
-    }
-  }
-
-  float GetDVal(int sample) const override {
-    if (wdl_) {
-      auto d = q_values_[3 * sample + 1];
-      return d;
-    } else {
-      return 0.0f;
-    }
-  }
-
-  // Returns P value @move_id of @sample.
-  float GetPVal(int sample, int move_id) const override {
-    return policies_[sample][move_id];
-  }
-
- private:
-  static constexpr auto kWidth = 8;
-  static constexpr auto kHeight = 8;
-  static constexpr auto kSquares = kWidth * kHeight;
-
-  void EncodePlanes(const InputPlanes& sample, float* buffer);
-
-  const OpenCL_Network& opencl_net_;
+  // Kept alive until the computation is done with them, even if the network
+  // switches to newly tuned kernels meanwhile.
+  const std::vector<std::shared_ptr<const OpenCLInstance>> instances_;
+  OpenCLThroughput* const throughput_;
   const OpenCLWeights& weights_;
 
   std::vector<InputPlanes> planes_;
@@ -184,36 +342,46 @@ class OpenCLComputation : public NetworkComputation {
   std::vector<std::vector<float>> policies_;
   std::vector<float> q_values_;
 
-  std::unique_ptr<OpenCLBuffers> buffers_;
+  // Per device.
+  std::vector<std::vector<std::unique_ptr<OpenCLBuffers>>> buffers_;
   bool wdl_;
+  const size_t pipeline_depth_;
 };
 
-void OpenCLComputation::EncodePlanes(const InputPlanes& sample, float* buffer) {
-  for (const InputPlane& plane : sample) {
-    const float value = plane.value;
-    for (auto i = 0; i < kSquares; i++) {
-      *(buffer++) = (plane.mask & (((uint64_t)1) << i)) != 0 ? value : 0;
-    }
-  }
-}
-
 class OpenCLNetwork : public Network {
  public:
-  virtual ~OpenCLNetwork(){};
+  virtual ~OpenCLNetwork() {
+    if (tuner_thread_.joinable()) {
+      abort_tuning_ = true;
+      tuner_thread_.join();
+    }
+  }
 
   OpenCLNetwork(const WeightsFile& file, const OptionsDict& options)
-      : weights_(file), params_(), opencl_(), opencl_net_(opencl_) {
-    LegacyWeights weights(file.weights());
+      : weights_(file), params_() {
+    auto weights = std::make_unique<LegacyWeights>(file.weights());
     params_.gpuId = options.GetOrDefault<int>("gpu", -1);
+    // Several devices in one backend, e.g. gpus=0,1, instead of one each
+    // under demux.
+    const auto gpus = options.GetOrDefault<std::string>("gpus", "");
+    const auto gpu_ids =
+        gpus.empty() ? std::vector<int>{params_.gpuId} : ParseIntList(gpus);
     params_.force_tune = options.GetOrDefault<bool>("force_tune", false);
     params_.tune_only = options.GetOrDefault<bool>("tune_only", false);
     params_.tune_exhaustive =
         options.GetOrDefault<bool>("tune_exhaustive", false);
+    // Without a tuning for this device and batch size, start with the
+    // nearest one or a preset and tune while already computing.
+    params_.tune_in_background =
+        options.GetOrDefault<bool>("tune_background", true);
+    // Chunks of a large batch in flight at once, each with its own buffers
+    // and command queue.
+    pipeline_depth_ = std::max(1, options.GetOrDefault<int>("pipeline", 2));
 
     wdl_ = file.format().network_format().output() ==
            pblczero::NetworkFormat::OUTPUT_WDL;
 
-    auto max_batch_size_ =
+    max_batch_size_ =
         static_cast<size_t>(options.GetOrDefault<int>("batch_size", 16));
     if (max_batch_size_ > kHardMaxBatchSize) {
       max_batch_size_ = kHardMaxBatchSize;
@@ -227,6 +395,53 @@ class OpenCLNetwork : public Network {
     params_.tune_batch_size =
         options.GetOrDefault<int>("tune_batch_size", max_batch_size_);
 
+    conv_policy_ = file.format().network_format().policy() ==
+                   pblczero::NetworkFormat::POLICY_CONVOLUTION;
+
+    auto tuned = true;
+    for (const auto gpu_id : gpu_ids) {
+      auto params = params_;
+      params.gpuId = gpu_id;
+      instances_.emplace_back(Build(*weights, params));
+      gpu_ids_.push_back(gpu_id);
+      tuned = tuned && instances_.back()->opencl.is_tuned();
+    }
+    throughput_ = std::make_unique<OpenCLThroughput>(instances_.size());
+    if (instances_.size() > 1) {
+      CERR << "OpenCL, splitting batches across " << instances_.size()
+           << " devices.";
+    }
+    if (!tuned) {
+      tuner_thread_ = std::thread(
+          [this](std::unique_ptr<LegacyWeights> weights) {
+            TuneInBackground(std::move(weights));
+          },
+          std::move(weights));
+    }
+  }
+
+  std::unique_ptr<NetworkComputation> NewComputation() override {
+    return std::make_unique<OpenCLComputation>(
+        GetInstances(), throughput_.get(), weights_, wdl_, pipeline_depth_);
+  }
+
+ private:
+  std::vector<std::shared_ptr<const OpenCLInstance>> GetInstances() {
+    std::lock_guard<std::mutex> lock(instance_mutex_);
+    return {instances_.begin(), instances_.end()};
+  }
+
+  static std::string DeviceKey(OpenCL& opencl) {
+    return opencl.get_device_name() + ";" + opencl.get_driver_version();
+  }
+
+  // Initializes OpenCL and uploads @weights.
+  std::shared_ptr<OpenCLInstance> Build(const LegacyWeights& weights,
+                                        const OpenCLParams& params) {
+    auto instance = std::make_shared<OpenCLInstance>();
+    auto& opencl = instance->opencl;
+    auto& opencl_net = instance->net;
+
     const auto inputChannels = static_cast<size_t>(kInputPlanes);
     const auto channels = weights.input.biases.size();
     const auto residual_blocks = weights.residual.size();
@@ -246,9 +461,16 @@ class OpenCLNetwork : public Network {
 
     static constexpr auto kWinogradAlpha = 4;
 
-    opencl_.initialize(channels, params_);
+    // A device identical to one already initialized loads the tuning stored
+    // for that one rather than tuning again.
+    opencl.select_device(params);
+    auto device_params = params;
+    if (!tuned_devices_.insert(DeviceKey(opencl)).second) {
+      device_params.force_tune = false;
+    }
+    opencl.initialize(channels, device_params);
 
-    auto tuners = opencl_.get_sgemm_tuners();
+    auto tuners = opencl.get_sgemm_tuners();
 
     auto mwg = tuners[0];
     auto kwg = tuners[2];
@@ -264,11 +486,8 @@ class OpenCLNetwork : public Network {
                                        inputChannels, m_ceil, k_ceil);
 
     // Winograd filter transformation changes filter size to 4x4.
-    opencl_net_.push_input_convolution(kWinogradAlpha, inputChannels, channels,
-                                       Upad, weights.input.biases);
-
-    auto conv_policy = file.format().network_format().policy() ==
-                       pblczero::NetworkFormat::POLICY_CONVOLUTION;
+    opencl_net.push_input_convolution(kWinogradAlpha, inputChannels, channels,
+                                      Upad, weights.input.biases);
 
     // Residual blocks.
     for (auto i = size_t{0}; i < residual_blocks; i++) {
@@ -287,22 +506,21 @@ class OpenCLNetwork : public Network {
       auto Upad2 = WinogradFilterZeropadU(conv_weights_2, channels, channels,
                                           m_ceil, m_ceil);
 
-      opencl_net_.push_residual(kWinogradAlpha, channels, channels, Upad1,
-                                conv1.biases, Upad2, conv2.biases);
+      opencl_net.push_residual(kWinogradAlpha, channels, channels, Upad1,
+                               conv1.biases, Upad2, conv2.biases);
       if (residual.has_se) {
         auto se_fc_outputs = se.w1.size() / channels;
         if (se.b2.size() != 2 * channels) {
           throw Exception("SE-unit output bias is not right size.");
         }
-        opencl_net_.push_se(channels, se_fc_outputs, se.w1, se.b1, se.w2,
-                            se.b2);
+        opencl_net.push_se(channels, se_fc_outputs, se.w1, se.b1, se.w2, se.b2);
       }
     }
 
     constexpr unsigned int width = 8;
     constexpr unsigned int height = 8;
 
-    if (conv_policy) {
+    if (conv_policy_) {
       auto& policy1 = weights.policy1;
       auto& policy = weights.policy;
       auto pol_channels = policy.biases.size();
@@ -324,40 +542,100 @@ class OpenCLNetwork : public Network {
         indices.emplace_back(kConvPolicyMap[i]);
       }
 
-      opencl_net_.push_conv_policy(
+      opencl_net.push_conv_policy(
           channels, pol_channels, kPolicyUsedPlanes * width * height,
           num_output_policy, W1, weights.policy1.biases, W2,
           weights.policy.biases, indices);
     } else {
-      opencl_net_.push_policy(channels, num_policy_input_planes,
-                              num_policy_input_planes * width * height,
-                              num_output_policy, weights.policy.weights,
-                              weights.policy.biases, weights.ip_pol_w,
-                              weights.ip_pol_b);
+      opencl_net.push_policy(channels, num_policy_input_planes,
+                             num_policy_input_planes * width * height,
+                             num_output_policy, weights.policy.weights,
+                             weights.policy.biases, weights.ip_pol_w,
+                             weights.ip_pol_b);
     }
-    opencl_net_.push_value(channels, num_value_input_planes,
-                           num_value_input_planes * width * height,
-                           num_value_channels, weights.value.weights,
-                           weights.value.biases, weights.ip1_val_w,
-                           weights.ip1_val_b);
-
-    opencl_net_.setMaxMatchSize(max_batch_size_);
+    opencl_net.push_value(channels, num_value_input_planes,
+                          num_value_input_planes * width * height,
+                          num_value_channels, weights.value.weights,
+                          weights.value.biases, weights.ip1_val_w,
+                          weights.ip1_val_b);
+
+    opencl_net.setMaxMatchSize(max_batch_size_);
+    return instance;
   }
 
-  std::unique_ptr<NetworkComputation> NewComputation() override {
-    return std::make_unique<OpenCLComputation>(opencl_net_, weights_, wdl_);
+  // Tunes the batch size in use and switches to it, then tunes the ones
+  // next to it for later runs. Identical devices are tuned once and switch
+  // together.
+  void TuneInBackground(std::unique_ptr<LegacyWeights> weights) {
+    const auto channels = static_cast<int>(weights->input.biases.size());
+    const auto bucket = Tuner::batch_bucket(params_.tune_batch_size);
+    std::vector<int> buckets = {bucket};
+    if (bucket > 1) buckets.push_back(bucket / 2);
+    if (bucket < kHardMaxBatchSize) buckets.push_back(bucket * 2);
+
+    std::vector<std::shared_ptr<OpenCLInstance>> instances;
+    {
+      std::lock_guard<std::mutex> lock(instance_mutex_);
+      instances = instances_;
+    }
+    std::vector<std::string> keys;
+    for (const auto& instance : instances) {
+      keys.push_back(DeviceKey(instance->opencl));
+    }
+    std::set<std::string> done;
+    for (size_t device = 0; device < instances.size(); device++) {
+      if (instances[device]->opencl.is_tuned()) continue;
+      if (!done.insert(keys[device]).second) continue;
+      auto& opencl = instances[device]->opencl;
+      auto tuner = Tuner(opencl, params_, opencl.m_context, opencl.m_device);
+      tuner.set_abort(&abort_tuning_);
+      try {
+        for (size_t i = 0; i < buckets.size(); i++) {
+          tuner.tune_and_store(channels, channels, buckets[i]);
+          if (i != 0) continue;
+          // Loads the tuning just stored.
+          auto params = params_;
+          params.force_tune = false;
+          params.tune_in_background = false;
+          for (size_t other = device; other < instances.size(); other++) {
+            if (keys[other] != keys[device]) continue;
+            params.gpuId = gpu_ids_[other];
+            auto tuned = Build(*weights, params);
+            std::lock_guard<std::mutex> lock(instance_mutex_);
+            instances_[other] = tuned;
+          }
+          CERR << "OpenCL switched to the tuned kernels.";
+        }
+      } catch (const std::exception& e) {
+        if (!abort_tuning_) {
+          CERR << "OpenCL background tuning failed: " << e.what();
+        }
+        return;
+      }
+    }
   }
 
- private:
   static constexpr auto kHardMaxBatchSize = 32;
   static constexpr auto kPolicyUsedPlanes = 73;
   static constexpr auto kPolicyOutputs = 1858;
 
   OpenCLWeights weights_;
   OpenCLParams params_;
-  OpenCL opencl_;
-  OpenCL_Network opencl_net_;
+  size_t max_batch_size_;
+  bool conv_policy_;
   bool wdl_;
+  size_t pipeline_depth_;
+
+  // The options' device ids of the instances, -1 for the best scoring one.
+  std::vector<int> gpu_ids_;
+  // Name and driver of the devices initialized so far.
+  std::set<std::string> tuned_devices_;
+  std::unique_ptr<OpenCLThroughput> throughput_;
+
+  std::mutex instance_mutex_;
+  std::vector<std::shared_ptr<OpenCLInstance>> instances_;
+  std::thread tuner_thread_;
+  std::atomic<bool> abort_tuning_{false};
 };
 
 std::unique_ptr<Network> MakeOpenCLNetwork(const WeightsFile& weights,
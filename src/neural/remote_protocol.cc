@@ -0,0 +1,213 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2019 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+
+  If you modify this Program, or any covered work, by linking or
+  combining it with NVIDIA Corporation's libraries from the NVIDIA CUDA
+  Toolkit and the NVIDIA CUDA Deep Neural Network library (or a
+  modified version of those libraries), containing parts covered by the
+  terms of the respective license agreement, the licensors of this
+  Program grant you additional permission to convey the resulting work.
+*/
+
+#include "neural/remote_protocol.h"
+
+#include <cstring>
+#include <sstream>
+
+#include "utils/fp16_utils.h"
+
+#ifndef _WIN32
+#include <sys/socket.h>
+#endif
+
+namespace lczero {
+namespace {
+
+enum PlaneTag : uint8_t { kEmpty = 0, kMask = 1, kFull = 2, kMaskValue = 3 };
+constexpr size_t kTagBytes = (kInputPlanes + 3) / 4;
+
+template <typename T>
+void Append(const T& value, std::string* payload) {
+  payload->append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+template <typename T>
+T Read(const std::string& payload, size_t pos) {
+  T value;
+  std::memcpy(&value, payload.data() + pos, sizeof(value));
+  return value;
+}
+
+}  // namespace
+
+void EncodeRemotePlanes(const InputPlanes& planes, std::string* payload) {
+  const size_t tags_pos = payload->size();
+  payload->append(kTagBytes, '\0');
+  for (int i = 0; i < kInputPlanes; ++i) {
+    const auto& plane = planes[i];
+    PlaneTag tag;
+    if (plane.mask == 0) {
+      tag = kEmpty;
+    } else if (plane.value == 1.0f) {
+      tag = kMask;
+      Append(plane.mask, payload);
+    } else if (plane.mask == ~0ull) {
+      tag = kFull;
+      Append(plane.value, payload);
+    } else {
+      tag = kMaskValue;
+      Append(plane.mask, payload);
+      Append(plane.value, payload);
+    }
+    (*payload)[tags_pos + i / 4] |= static_cast<char>(tag << (2 * (i % 4)));
+  }
+}
+
+bool DecodeRemotePlanes(const std::string& payload, size_t* pos,
+                        InputPlanes* planes) {
+  if (payload.size() < *pos + kTagBytes) return false;
+  const size_t tags_pos = *pos;
+  *pos += kTagBytes;
+  for (int i = 0; i < kInputPlanes; ++i) {
+    const auto tag = (static_cast<uint8_t>(payload[tags_pos + i / 4]) >>
+                      (2 * (i % 4))) & 3;
+    auto& plane = (*planes)[i];
+    plane = InputPlane();
+    if (tag == kEmpty) continue;
+    const size_t size = (tag == kMask || tag == kMaskValue ? 8 : 0) +
+                        (tag == kFull || tag == kMaskValue ? 4 : 0);
+    if (payload.size() < *pos + size) return false;
+    if (tag == kFull) {
+      plane.mask = ~0ull;
+    } else {
+      plane.mask = Read<uint64_t>(payload, *pos);
+      *pos += sizeof(uint64_t);
+    }
+    if (tag != kMask) {
+      plane.value = Read<float>(payload, *pos);
+      *pos += sizeof(float);
+    }
+  }
+  return true;
+}
+
+void EncodeRemoteResult(const NetworkComputation& computation, int sample,
+                        std::string* payload) {
+  Append(computation.GetQVal(sample), payload);
+  Append(computation.GetDVal(sample), payload);
+  for (int i = 0; i < kRemotePolicySize; ++i) {
+    Append(FP32toFP16(computation.GetPVal(sample, i)), payload);
+  }
+}
+
+float GetRemoteQ(const std::string& payload, int sample) {
+  return Read<float>(payload, sample * kRemoteResultSize);
+}
+
+float GetRemoteD(const std::string& payload, int sample) {
+  return Read<float>(payload, sample * kRemoteResultSize + sizeof(float));
+}
+
+float GetRemoteP(const std::string& payload, int sample, int move_id) {
+  return FP16toFP32(Read<uint16_t>(
+      payload, sample * kRemoteResultSize + 2 * sizeof(float) +
+                   move_id * sizeof(uint16_t)));
+}
+
+#ifndef _WIN32
+bool SendRemoteMessage(int socket, RemoteHeader header,
+                       const std::string& payload) {
+  header.magic = kRemoteMagic;
+  header.size = payload.size();
+  // One send, so that small messages leave in one segment.
+  std::string message;
+  message.reserve(sizeof(header) + payload.size());
+  Append(header, &message);
+  message += payload;
+  size_t sent = 0;
+  while (sent < message.size()) {
+    const auto n = send(socket, message.data() + sent, message.size() - sent,
+                        MSG_NOSIGNAL);
+    if (n <= 0) return false;
+    sent += n;
+  }
+  return true;
+}
+
+namespace {
+bool ReceiveAll(int socket, char* data, size_t size) {
+  size_t received = 0;
+  while (received < size) {
+    const auto n = recv(socket, data + received, size - received, 0);
+    if (n <= 0) return false;
+    received += n;
+  }
+  return true;
+}
+}  // namespace
+
+bool ReceiveRemoteMessage(int socket, RemoteHeader* header,
+                          std::string* payload) {
+  if (!ReceiveAll(socket, reinterpret_cast<char*>(header), sizeof(*header))) {
+    return false;
+  }
+  if (header->magic != kRemoteMagic || header->size > kRemoteMaxPayload) {
+    return false;
+  }
+  payload->resize(header->size);
+  return ReceiveAll(socket, &(*payload)[0], header->size);
+}
+#else
+bool SendRemoteMessage(int, RemoteHeader, const std::string&) { return false; }
+bool ReceiveRemoteMessage(int, RemoteHeader*, std::string*) { return false; }
+#endif
+
+std::string RemoteStats::Record(int positions, double seconds) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  positions_ += positions;
+  ++batches_;
+  seconds_ += seconds;
+  const auto now = std::chrono::steady_clock::now();
+  const std::chrono::duration<double> elapsed = now - start_;
+  if (elapsed < interval_) return {};
+  latency_ms_ = 1000.0 * seconds_ / batches_;
+  positions_per_second_ = positions_ / elapsed.count();
+  std::ostringstream summary;
+  summary.precision(1);
+  summary << std::fixed << positions_per_second_ << " positions/s in "
+          << batches_ / elapsed.count() << " batches/s, " << latency_ms_
+          << " ms average round trip";
+  start_ = now;
+  positions_ = 0;
+  batches_ = 0;
+  seconds_ = 0.0;
+  return summary.str();
+}
+
+double RemoteStats::GetLatencyMs() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return latency_ms_;
+}
+
+double RemoteStats::GetPositionsPerSecond() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return positions_per_second_;
+}
+
+}  // namespace lczero
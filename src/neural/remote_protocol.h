@@ -0,0 +1,120 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2019 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+
+  If you modify this Program, or any covered work, by linking or
+  combining it with NVIDIA Corporation's libraries from the NVIDIA CUDA
+  Toolkit and the NVIDIA CUDA Deep Neural Network library (or a
+  modified version of those libraries), containing parts covered by the
+  terms of the respective license agreement, the licensors of this
+  Program grant you additional permission to convey the resulting work.
+*/
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+
+#include "neural/network.h"
+
+namespace lczero {
+
+// Wire format between the remote backend and the eval server. A message is a
+// RemoteHeader followed by its payload; everything is little endian.
+//
+// Evaluate requests carry the positions' planes, each as 2 bit tags of its
+// kInputPlanes planes followed by what the tags ask for: nothing for empty
+// planes, the mask for ones of value 1, the value for full ones, and both for
+// the rest. Results carry, per position, Q and D as floats and the policy as
+// kRemotePolicySize fp16 values.
+
+constexpr uint32_t kRemoteMagic = 0x3152434c;  // "LCR1"
+constexpr int kRemotePolicySize = 1858;
+// Larger payloads are taken for a corrupt stream.
+constexpr uint32_t kRemoteMaxPayload = 1 << 26;
+
+enum class RemoteMessage : uint32_t {
+  kEvaluate = 1,
+  kResults = 2,
+  // Payload is the error text.
+  kError = 3,
+};
+
+struct RemoteHeader {
+  uint32_t magic = kRemoteMagic;
+  RemoteMessage type;
+  // Chosen by the client, results carry the id of their request.
+  uint32_t id;
+  // Number of positions.
+  uint32_t count;
+  uint32_t size;
+};
+
+// Appends the planes of a position to @payload.
+void EncodeRemotePlanes(const InputPlanes& planes, std::string* payload);
+// Reads the planes of a position at @*pos of @payload, advancing @*pos.
+// Returns false if the payload is too short.
+bool DecodeRemotePlanes(const std::string& payload, size_t* pos,
+                        InputPlanes* planes);
+
+constexpr size_t kRemoteResultSize =
+    2 * sizeof(float) + kRemotePolicySize * sizeof(uint16_t);
+// Appends the results of @sample of @computation to @payload.
+void EncodeRemoteResult(const NetworkComputation& computation, int sample,
+                        std::string* payload);
+// Read the results of @sample from a results payload.
+float GetRemoteQ(const std::string& payload, int sample);
+float GetRemoteD(const std::string& payload, int sample);
+float GetRemoteP(const std::string& payload, int sample, int move_id);
+
+// Blocking I/O of whole messages on a connected socket. Return false when the
+// connection is closed or broken, or on a malformed message.
+bool SendRemoteMessage(int socket, RemoteHeader header,
+                       const std::string& payload);
+bool ReceiveRemoteMessage(int socket, RemoteHeader* header,
+                          std::string* payload);
+
+// Throughput and round trip latency of remote evaluations.
+class RemoteStats {
+ public:
+  explicit RemoteStats(std::chrono::seconds interval) : interval_(interval) {}
+
+  // Adds a batch of @positions answered after @seconds. Once per interval,
+  // returns a summary of the interval, and an empty string otherwise.
+  std::string Record(int positions, double seconds);
+
+  // Average latency in milliseconds and positions per second of the last
+  // interval.
+  double GetLatencyMs() const;
+  double GetPositionsPerSecond() const;
+
+ private:
+  const std::chrono::seconds interval_;
+  mutable std::mutex mutex_;
+  std::chrono::steady_clock::time_point start_ =
+      std::chrono::steady_clock::now();
+  int64_t positions_ = 0;
+  int64_t batches_ = 0;
+  double seconds_ = 0.0;
+  double latency_ms_ = 0.0;
+  double positions_per_second_ = 0.0;
+};
+
+}  // namespace lczero
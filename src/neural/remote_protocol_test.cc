@@ -0,0 +1,100 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2019 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "neural/remote_protocol.h"
+
+#include <gtest/gtest.h>
+
+#include "chess/position.h"
+#include "neural/encoder.h"
+
+namespace lczero {
+namespace {
+
+class FakeComputation : public NetworkComputation {
+ public:
+  void AddInput(InputPlanes&&) override {}
+  void ComputeBlocking() override {}
+  int GetBatchSize() const override { return 2; }
+  float GetQVal(int sample) const override { return 0.25f - sample; }
+  float GetDVal(int sample) const override { return 0.5f * sample; }
+  float GetPVal(int sample, int move_id) const override {
+    return (move_id % 7) / (16.0f + sample);
+  }
+};
+
+}  // namespace
+
+TEST(RemoteProtocol, PlanesRoundTrip) {
+  PositionHistory history;
+  history.Reset(ChessBoard(ChessBoard::kStartposFen), 13, 1);
+  InputPlanes startpos =
+      EncodePositionForNN(history, 8, FillEmptyHistory::FEN_ONLY);
+  InputPlanes odd = startpos;
+  odd[3].value = 0.5f;
+  odd[100].Fill(13.0f);
+
+  std::string payload;
+  EncodeRemotePlanes(startpos, &payload);
+  EncodeRemotePlanes(odd, &payload);
+  // Far smaller than the 12 bytes per plane of the planes themselves.
+  EXPECT_LT(payload.size(), 2 * kInputPlanes * 12 / 3);
+
+  size_t pos = 0;
+  for (const auto& expected : {startpos, odd}) {
+    InputPlanes planes;
+    ASSERT_TRUE(DecodeRemotePlanes(payload, &pos, &planes));
+    for (int i = 0; i < kInputPlanes; ++i) {
+      EXPECT_EQ(planes[i].mask, expected[i].mask) << i;
+      if (expected[i].mask) {
+        EXPECT_EQ(planes[i].value, expected[i].value) << i;
+      }
+    }
+  }
+  EXPECT_EQ(pos, payload.size());
+
+  payload.resize(payload.size() - 1);
+  pos = 0;
+  InputPlanes planes;
+  EXPECT_TRUE(DecodeRemotePlanes(payload, &pos, &planes));
+  EXPECT_FALSE(DecodeRemotePlanes(payload, &pos, &planes));
+}
+
+TEST(RemoteProtocol, ResultsRoundTrip) {
+  FakeComputation computation;
+  std::string payload;
+  for (int i = 0; i < 2; ++i) EncodeRemoteResult(computation, i, &payload);
+  EXPECT_EQ(payload.size(), 2 * kRemoteResultSize);
+  for (int i = 0; i < 2; ++i) {
+    EXPECT_EQ(GetRemoteQ(payload, i), computation.GetQVal(i));
+    EXPECT_EQ(GetRemoteD(payload, i), computation.GetDVal(i));
+    for (int move = 0; move < kRemotePolicySize; ++move) {
+      EXPECT_NEAR(GetRemoteP(payload, i, move), computation.GetPVal(i, move),
+                  1e-3);
+    }
+  }
+}
+
+}  // namespace lczero
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  lczero::InitializeMagicBitboards();
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,121 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2019 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+
+  If you modify this Program, or any covered work, by linking or
+  combining it with NVIDIA Corporation's libraries from the NVIDIA CUDA
+  Toolkit and the NVIDIA CUDA Deep Neural Network library (or a
+  modified version of those libraries), containing parts covered by the
+  terms of the respective license agreement, the licensors of this
+  Program grant you additional permission to convey the resulting work.
+*/
+
+#include "neural/shared/input_convolution.h"
+
+#include <algorithm>
+#include <cstdint>
+#include "utils/bititer.h"
+
+namespace lczero {
+namespace {
+
+// Region of a rank or file: 0 on the first, 2 on the last, 1 between.
+int RegionOf(int coord) { return coord == 0 ? 0 : coord == 7 ? 2 : 1; }
+
+}  // namespace
+
+InputConvolution::InputConvolution(const float* weights, const float* biases,
+                                   size_t output_channels)
+    : channels_(output_channels),
+      taps_(kInputPlanes * kTaps * output_channels),
+      full_(kInputPlanes * kRegions * output_channels, 0.0f),
+      biases_(biases, biases + output_channels) {
+  for (size_t c = 0; c < channels_; c++) {
+    for (int p = 0; p < kInputPlanes; p++) {
+      for (int k = 0; k < kTaps; k++) {
+        taps_[(p * kTaps + k) * channels_ + c] =
+            weights[(c * kInputPlanes + p) * kTaps + k];
+      }
+    }
+  }
+  // A tap is outside the board on the first rank or file for offset -1, on
+  // the last for offset +1.
+  for (int region = 0; region < kRegions; region++) {
+    const int rank_region = region / 3;
+    const int file_region = region % 3;
+    for (int k = 0; k < kTaps; k++) {
+      const int dy = k / 3 - 1;
+      const int dx = k % 3 - 1;
+      if ((dy == -1 && rank_region == 0) || (dy == 1 && rank_region == 2) ||
+          (dx == -1 && file_region == 0) || (dx == 1 && file_region == 2)) {
+        continue;
+      }
+      for (int p = 0; p < kInputPlanes; p++) {
+        const float* tap = &taps_[(p * kTaps + k) * channels_];
+        float* full = &full_[(p * kRegions + region) * channels_];
+        for (size_t c = 0; c < channels_; c++) full[c] += tap[c];
+      }
+    }
+  }
+}
+
+void InputConvolution::Forward(const InputPlanes& planes, float* output,
+                               float* scratch) const {
+  const size_t channels = channels_;
+  // Accumulates square by square, channels innermost.
+  for (int s = 0; s < 64; s++) {
+    std::copy(biases_.begin(), biases_.end(), scratch + s * channels);
+  }
+  for (int p = 0; p < kInputPlanes; p++) {
+    const std::uint64_t mask = planes[p].mask;
+    const float value = planes[p].value;
+    if (mask == 0 || value == 0.0f) continue;
+    if (mask == ~0ull) {
+      for (int s = 0; s < 64; s++) {
+        const int region = RegionOf(s / 8) * 3 + RegionOf(s % 8);
+        const float* full = &full_[(p * kRegions + region) * channels];
+        float* out = scratch + s * channels;
+        for (size_t c = 0; c < channels; c++) out[c] += value * full[c];
+      }
+      continue;
+    }
+    for (std::uint64_t bits = mask; bits != 0; bits &= bits - 1) {
+      const int t = static_cast<int>(GetLowestBit(bits));
+      const int rank = t / 8;
+      const int file = t % 8;
+      // Square s sees t through tap (dy, dx) when s + (dy, dx) = t.
+      for (int k = 0; k < kTaps; k++) {
+        const int out_rank = rank - (k / 3 - 1);
+        const int out_file = file - (k % 3 - 1);
+        if (out_rank < 0 || out_rank > 7 || out_file < 0 || out_file > 7) {
+          continue;
+        }
+        const float* tap = &taps_[(p * kTaps + k) * channels];
+        float* out = scratch + (out_rank * 8 + out_file) * channels;
+        for (size_t c = 0; c < channels; c++) out[c] += value * tap[c];
+      }
+    }
+  }
+  for (size_t c = 0; c < channels; c++) {
+    for (int s = 0; s < 64; s++) {
+      output[c * 64 + s] = std::max(0.0f, scratch[s * channels + c]);
+    }
+  }
+}
+
+}  // namespace lczero
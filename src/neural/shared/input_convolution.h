@@ -0,0 +1,67 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2019 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+
+  If you modify this Program, or any covered work, by linking or
+  combining it with NVIDIA Corporation's libraries from the NVIDIA CUDA
+  Toolkit and the NVIDIA CUDA Deep Neural Network library (or a
+  modified version of those libraries), containing parts covered by the
+  terms of the respective license agreement, the licensors of this
+  Program grant you additional permission to convey the resulting work.
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <vector>
+#include "neural/network.h"
+
+namespace lczero {
+
+// The 3x3 convolution of the input planes, computed from their bitmasks
+// rather than from expanded planes: each set bit adds its weights to the
+// squares around it, and planes with every bit set add a response
+// precomputed for the edge, corner and inner squares. The cost follows the
+// number of set bits, a few hundred, instead of kInputPlanes * 64.
+class InputConvolution {
+ public:
+  // @weights are in the usual [output][input][3][3] layout, with
+  // kInputPlanes inputs.
+  InputConvolution(const float* weights, const float* biases,
+                   size_t output_channels);
+
+  // Writes the convolution of @planes, with the biases added and relu
+  // applied, to the output_channels * 64 floats at @output. @scratch holds
+  // as many floats.
+  void Forward(const InputPlanes& planes, float* output, float* scratch) const;
+
+ private:
+  static constexpr int kTaps = 9;
+  // Squares with the same valid taps: inner, edge or corner, by rank and
+  // file.
+  static constexpr int kRegions = 9;
+
+  size_t channels_;
+  // The weights of each plane and tap, output channels innermost.
+  std::vector<float> taps_;
+  // The response of each plane with every bit set, per region.
+  std::vector<float> full_;
+  std::vector<float> biases_;
+};
+
+}  // namespace lczero
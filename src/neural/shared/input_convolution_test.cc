@@ -0,0 +1,86 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2019 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+
+  If you modify this Program, or any covered work, by linking or
+  combining it with NVIDIA Corporation's libraries from the NVIDIA CUDA
+  Toolkit and the NVIDIA CUDA Deep Neural Network library (or a
+  modified version of those libraries), containing parts covered by the
+  terms of the respective license agreement, the licensors of this
+  Program grant you additional permission to convey the resulting work.
+*/
+
+#include "neural/shared/input_convolution.h"
+
+#include <gtest/gtest.h>
+#include <algorithm>
+#include <random>
+#include <vector>
+#include "neural/shared/planes.h"
+
+namespace lczero {
+
+TEST(InputConvolution, MatchDense) {
+  const size_t channels = 24;
+  std::mt19937_64 gen(7);
+  std::uniform_real_distribution<float> real(-1.0f, 1.0f);
+  std::vector<float> weights(channels * kInputPlanes * 9);
+  std::vector<float> biases(channels);
+  for (auto& w : weights) w = real(gen);
+  for (auto& b : biases) b = real(gen);
+
+  InputPlanes planes;
+  for (auto& plane : planes) {
+    plane.mask = gen() & gen() & gen();
+    plane.value = 1.0f;
+  }
+  planes[100].mask = 0;
+  planes[104].SetAll();
+  planes[109].Fill(0.37f);
+  planes[110].mask = 1ull << 7 | 1ull << 56;
+  planes[110].value = -2.5f;
+  planes[111].SetAll();
+
+  std::vector<float> expanded(kInputPlanes * 64);
+  ExpandPlanes(planes, expanded.data());
+  std::vector<float> output(channels * 64);
+  std::vector<float> scratch(channels * 64);
+  InputConvolution(weights.data(), biases.data(), channels)
+      .Forward(planes, output.data(), scratch.data());
+
+  for (size_t c = 0; c < channels; c++) {
+    for (int y = 0; y < 8; y++) {
+      for (int x = 0; x < 8; x++) {
+        float sum = biases[c];
+        for (int p = 0; p < kInputPlanes; p++) {
+          for (int k = 0; k < 9; k++) {
+            const int iy = y + k / 3 - 1;
+            const int ix = x + k % 3 - 1;
+            if (iy < 0 || iy > 7 || ix < 0 || ix > 7) continue;
+            sum += weights[(c * kInputPlanes + p) * 9 + k] *
+                   expanded[p * 64 + iy * 8 + ix];
+          }
+        }
+        EXPECT_NEAR(std::max(0.0f, sum), output[c * 64 + y * 8 + x], 1e-4f)
+            << "channel " << c << " square " << y * 8 + x;
+      }
+    }
+  }
+}
+
+}  // namespace lczero
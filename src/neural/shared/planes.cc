@@ -0,0 +1,104 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2019 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+
+  If you modify this Program, or any covered work, by linking or
+  combining it with NVIDIA Corporation's libraries from the NVIDIA CUDA
+  Toolkit and the NVIDIA CUDA Deep Neural Network library (or a
+  modified version of those libraries), containing parts covered by the
+  terms of the respective license agreement, the licensors of this
+  Program grant you additional permission to convey the resulting work.
+*/
+
+#include "neural/shared/planes.h"
+
+#include "utils/cpu.h"
+
+#if defined(LC0_CPU_DISPATCH)
+#include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+namespace lczero {
+namespace {
+
+#if defined(LC0_CPU_DISPATCH)
+LC0_TARGET_BEGIN("avx512f")
+void ExpandPlaneAvx512(std::uint64_t mask, float value, float* output) {
+  const __m512 val = _mm512_set1_ps(value);
+  for (int i = 0; i < 4; i++) {
+    _mm512_storeu_ps(output + 16 * i,
+                     _mm512_maskz_mov_ps(static_cast<__mmask16>(mask), val));
+    mask >>= 16;
+  }
+}
+LC0_TARGET_END
+
+LC0_TARGET_BEGIN("avx2")
+void ExpandPlaneAvx2(std::uint64_t mask, float value, float* output) {
+  // Every lane tests one bit of a byte of the mask.
+  const __m256i bits = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+  const __m256 val = _mm256_set1_ps(value);
+  for (int i = 0; i < 8; i++) {
+    const __m256i byte = _mm256_set1_epi32(static_cast<int>(mask & 0xff));
+    const __m256i set =
+        _mm256_cmpeq_epi32(_mm256_and_si256(byte, bits), bits);
+    _mm256_storeu_ps(output + 8 * i,
+                     _mm256_and_ps(_mm256_castsi256_ps(set), val));
+    mask >>= 8;
+  }
+}
+LC0_TARGET_END
+#endif
+
+}  // namespace
+
+void ExpandPlaneScalar(std::uint64_t mask, float value, float* output) {
+  for (int i = 0; i < 64; i++) {
+    output[i] = (mask & (1ull << i)) != 0 ? value : 0.0f;
+  }
+}
+
+void ExpandPlane(std::uint64_t mask, float value, float* output) {
+#if defined(LC0_CPU_DISPATCH)
+  const CpuFeatures& cpu = GetCpuFeatures();
+  if (cpu.avx512) return ExpandPlaneAvx512(mask, value, output);
+  if (cpu.avx2) return ExpandPlaneAvx2(mask, value, output);
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+  const uint32x4_t bits = {1, 2, 4, 8};
+  const uint32x4_t val = vreinterpretq_u32_f32(vdupq_n_f32(value));
+  for (int i = 0; i < 16; i++) {
+    const uint32x4_t set =
+        vtstq_u32(vdupq_n_u32(static_cast<uint32_t>(mask & 0xf)), bits);
+    vst1q_f32(output + 4 * i, vreinterpretq_f32_u32(vandq_u32(set, val)));
+    mask >>= 4;
+  }
+  return;
+#endif
+  ExpandPlaneScalar(mask, value, output);
+}
+
+void ExpandPlanes(const InputPlanes& planes, float* output) {
+  for (const InputPlane& plane : planes) {
+    ExpandPlane(plane.mask, plane.value, output);
+    output += 64;
+  }
+}
+
+}  // namespace lczero
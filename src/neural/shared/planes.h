@@ -0,0 +1,46 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2019 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+
+  If you modify this Program, or any covered work, by linking or
+  combining it with NVIDIA Corporation's libraries from the NVIDIA CUDA
+  Toolkit and the NVIDIA CUDA Deep Neural Network library (or a
+  modified version of those libraries), containing parts covered by the
+  terms of the respective license agreement, the licensors of this
+  Program grant you additional permission to convey the resulting work.
+*/
+
+#pragma once
+
+#include <cstdint>
+#include "neural/network.h"
+
+namespace lczero {
+
+// Writes the 64 squares of a plane to @output: @value where the bit of @mask
+// is set, 0 elsewhere. Uses AVX-512, AVX2 or NEON when the CPU has them.
+void ExpandPlane(std::uint64_t mask, float value, float* output);
+
+// Plain scalar version of ExpandPlane(), used as a reference.
+void ExpandPlaneScalar(std::uint64_t mask, float value, float* output);
+
+// Expands all planes of a position, plane after plane, to the
+// kInputPlanes * 64 floats at @output.
+void ExpandPlanes(const InputPlanes& planes, float* output);
+
+}  // namespace lczero
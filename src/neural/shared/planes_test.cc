@@ -0,0 +1,61 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2019 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+
+  If you modify this Program, or any covered work, by linking or
+  combining it with NVIDIA Corporation's libraries from the NVIDIA CUDA
+  Toolkit and the NVIDIA CUDA Deep Neural Network library (or a
+  modified version of those libraries), containing parts covered by the
+  terms of the respective license agreement, the licensors of this
+  Program grant you additional permission to convey the resulting work.
+*/
+
+#include "neural/shared/planes.h"
+
+#include <gtest/gtest.h>
+#include <cstring>
+#include <random>
+#include <vector>
+
+namespace lczero {
+
+TEST(ExpandPlanes, MatchScalar) {
+  std::mt19937_64 gen(42);
+  std::uniform_real_distribution<float> value(-10.0f, 10.0f);
+  InputPlanes planes;
+  for (auto& plane : planes) {
+    plane.mask = gen();
+    plane.value = value(gen);
+  }
+  planes[0].mask = 0;
+  planes[1].mask = ~0ull;
+  planes[2].mask = 1ull << 63;
+
+  std::vector<float> output(kInputPlanes * 64, -1.0f);
+  ExpandPlanes(planes, output.data());
+  for (int i = 0; i < kInputPlanes; i++) {
+    float expected[64];
+    ExpandPlaneScalar(planes[i].mask, planes[i].value, expected);
+    EXPECT_EQ(0, std::memcmp(expected, &output[i * 64], sizeof(expected)))
+        << "plane " << i;
+  }
+  EXPECT_EQ(planes[2].value, output[2 * 64 + 63]);
+  EXPECT_EQ(0.0f, output[2 * 64 + 62]);
+}
+
+}  // namespace lczero
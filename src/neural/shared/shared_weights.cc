@@ -0,0 +1,144 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2019 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+
+  If you modify this Program, or any covered work, by linking or
+  combining it with NVIDIA Corporation's libraries from the NVIDIA CUDA
+  Toolkit and the NVIDIA CUDA Deep Neural Network library (or a
+  modified version of those libraries), containing parts covered by the
+  terms of the respective license agreement, the licensors of this
+  Program grant you additional permission to convey the resulting work.
+*/
+
+#include "neural/shared/shared_weights.h"
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <random>
+#include <sstream>
+
+#include "utils/exception.h"
+
+namespace lczero {
+
+namespace {
+const char kMagic[8] = {'L', 'c', '0', 'S', 'h', 'r', 'd', '1'};
+const size_t kAlignment = 64;
+
+// The file starts with the magic, the key and the number of arrays, then
+// the size of every array follows. Arrays start at multiples of kAlignment.
+struct Header {
+  char magic[8];
+  uint64_t key;
+  uint64_t count;
+};
+
+size_t Align(size_t offset) {
+  return (offset + kAlignment - 1) / kAlignment * kAlignment;
+}
+
+std::string GetFilename(const std::string& directory, uint64_t key) {
+  std::ostringstream filename;
+  filename << directory << "/lc0-weights-" << std::hex << key;
+  return filename.str();
+}
+}  // namespace
+
+std::unique_ptr<SharedWeights> SharedWeights::Open(
+    const std::string& directory, uint64_t key, size_t count) {
+  std::unique_ptr<SharedWeights> weights;
+  try {
+    weights.reset(new SharedWeights(GetFilename(directory, key)));
+  } catch (const Exception&) {
+    return nullptr;
+  }
+  if (!weights->ReadTable(key) || weights->count() != count) return nullptr;
+  return weights;
+}
+
+std::unique_ptr<SharedWeights> SharedWeights::Create(
+    const std::string& directory, uint64_t key,
+    const std::vector<const std::vector<float>*>& arrays) {
+  const std::string filename = GetFilename(directory, key);
+  // Processes starting together may all write it, each to its own file.
+  const std::string tmp_filename =
+      filename + "." + std::to_string(std::random_device()()) + ".tmp";
+  {
+    std::ofstream out(tmp_filename, std::ios::binary | std::ios::trunc);
+    Header header;
+    std::memcpy(header.magic, kMagic, sizeof(kMagic));
+    header.key = key;
+    header.count = arrays.size();
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    for (const auto* array : arrays) {
+      const uint64_t size = array->size();
+      out.write(reinterpret_cast<const char*>(&size), sizeof(size));
+    }
+    size_t offset = sizeof(header) + arrays.size() * sizeof(uint64_t);
+    const char padding[kAlignment] = {};
+    for (const auto* array : arrays) {
+      out.write(padding, Align(offset) - offset);
+      offset = Align(offset);
+      out.write(reinterpret_cast<const char*>(array->data()),
+                array->size() * sizeof(float));
+      offset += array->size() * sizeof(float);
+    }
+    if (!out) {
+      std::remove(tmp_filename.c_str());
+      throw Exception("Cannot write shared weights file " + tmp_filename);
+    }
+  }
+  try {
+    RenameFile(tmp_filename, filename);
+  } catch (const Exception&) {
+    std::remove(tmp_filename.c_str());
+    throw;
+  }
+  auto weights = Open(directory, key, arrays.size());
+  if (!weights) throw Exception("Cannot map shared weights file " + filename);
+  return weights;
+}
+
+bool SharedWeights::ReadTable(uint64_t key) {
+  Header header;
+  if (file_.size() < sizeof(header)) return false;
+  std::memcpy(&header, file_.data(), sizeof(header));
+  if (std::memcmp(header.magic, kMagic, sizeof(kMagic)) != 0 ||
+      header.key != key) {
+    return false;
+  }
+  size_t offset = sizeof(header) + header.count * sizeof(uint64_t);
+  if (header.count > file_.size() || offset > file_.size()) return false;
+  for (uint64_t i = 0; i < header.count; i++) {
+    uint64_t size;
+    std::memcpy(&size, file_.data() + sizeof(header) + i * sizeof(size),
+                sizeof(size));
+    offset = Align(offset);
+    if (offset > file_.size() ||
+        size > (file_.size() - offset) / sizeof(float)) {
+      return false;
+    }
+    offsets_.push_back(offset);
+    sizes_.push_back(size);
+    offset += size * sizeof(float);
+  }
+  return true;
+}
+
+}  // namespace lczero
@@ -0,0 +1,74 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2019 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+
+  If you modify this Program, or any covered work, by linking or
+  combining it with NVIDIA Corporation's libraries from the NVIDIA CUDA
+  Toolkit and the NVIDIA CUDA Deep Neural Network library (or a
+  modified version of those libraries), containing parts covered by the
+  terms of the respective license agreement, the licensors of this
+  Program grant you additional permission to convey the resulting work.
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "utils/filesystem.h"
+
+namespace lczero {
+
+// Read-only weight arrays shared between the processes of a host. The first
+// process to prepare them writes them to a file, the others map that file
+// instead of preparing their own copy. In a memory backed directory, like
+// /dev/shm on Linux, all of them then share the same physical pages.
+class SharedWeights {
+ public:
+  // Maps the file of @key in @directory. Returns nullptr if there is none or
+  // it doesn't hold @count arrays.
+  static std::unique_ptr<SharedWeights> Open(const std::string& directory,
+                                             uint64_t key, size_t count);
+
+  // Writes @arrays to the file of @key in @directory and maps it. Throws
+  // exception if the file cannot be written.
+  static std::unique_ptr<SharedWeights> Create(
+      const std::string& directory, uint64_t key,
+      const std::vector<const std::vector<float>*>& arrays);
+
+  size_t count() const { return offsets_.size(); }
+  // Array @i, aligned to 64 bytes.
+  const float* data(size_t i) const {
+    return reinterpret_cast<const float*>(file_.data() + offsets_[i]);
+  }
+  size_t size(size_t i) const { return sizes_[i]; }
+
+ private:
+  explicit SharedWeights(const std::string& filename) : file_(filename) {}
+  // Reads the table of arrays, returns false if it doesn't fit the file.
+  bool ReadTable(uint64_t key);
+
+  MappedFile file_;
+  std::vector<size_t> offsets_;
+  std::vector<size_t> sizes_;
+};
+
+}  // namespace lczero
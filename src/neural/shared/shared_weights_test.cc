@@ -0,0 +1,63 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2019 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "neural/shared/shared_weights.h"
+
+#include <gtest/gtest.h>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+
+namespace lczero {
+
+TEST(SharedWeights, CreateAndOpen) {
+  const std::vector<float> a = {1.0f, 2.0f, 3.0f};
+  const std::vector<float> b;
+  const std::vector<float> c = {4.0f, 5.0f};
+  const uint64_t key = 0x5eed;
+  EXPECT_FALSE(SharedWeights::Open(".", key, 3));
+
+  auto created = SharedWeights::Create(".", key, {&a, &b, &c});
+  ASSERT_EQ(created->count(), 3u);
+  auto opened = SharedWeights::Open(".", key, 3);
+  ASSERT_TRUE(opened);
+  EXPECT_FALSE(SharedWeights::Open(".", key, 2));
+  EXPECT_FALSE(SharedWeights::Open(".", key + 1, 3));
+
+  for (const auto* weights : {created.get(), opened.get()}) {
+    EXPECT_EQ(weights->size(0), 3u);
+    EXPECT_EQ(weights->size(1), 0u);
+    EXPECT_EQ(weights->size(2), 2u);
+    for (size_t i = 0; i < 3; i++) {
+      EXPECT_EQ(reinterpret_cast<uintptr_t>(weights->data(i)) % 64, 0u);
+    }
+    EXPECT_EQ(weights->data(0)[2], 3.0f);
+    EXPECT_EQ(weights->data(2)[0], 4.0f);
+    EXPECT_EQ(weights->data(2)[1], 5.0f);
+  }
+
+  // A truncated file is not used.
+  created.reset();
+  opened.reset();
+  std::ofstream("lc0-weights-5eed", std::ios::binary | std::ios::trunc)
+      << "Lc0Shrd1";
+  EXPECT_FALSE(SharedWeights::Open(".", key, 3));
+  std::remove("lc0-weights-5eed");
+}
+
+}  // namespace lczero
@@ -0,0 +1,672 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2019 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+
+  If you modify this Program, or any covered work, by linking or
+  combining it with NVIDIA Corporation's libraries from the NVIDIA CUDA
+  Toolkit and the NVIDIA CUDA Deep Neural Network library (or a
+  modified version of those libraries), containing parts covered by the
+  terms of the respective license agreement, the licensors of this
+  Program grant you additional permission to convey the resulting work.
+*/
+
+// Vulkan compute backend for GPUs of any vendor. The shaders in shaders/ are
+// compiled to SPIR-V at build time, once with fp32 and once with fp16 storage.
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "neural/factory.h"
+#include "neural/network_legacy.h"
+#include "neural/shared/policy_map.h"
+#include "neural/shared/winograd_filter.h"
+#include "neural/vulkan/vulkan_context.h"
+#include "utils/exception.h"
+#include "utils/fp16_utils.h"
+#include "utils/logging.h"
+#include "utils/trace.h"
+
+namespace lczero {
+namespace {
+
+using vulkan_backend::Buffer;
+using vulkan_backend::CheckVk;
+using vulkan_backend::kNumBindings;
+using vulkan_backend::PushConstants;
+using vulkan_backend::VulkanContext;
+
+constexpr int kNumOutputPolicy = 1858;
+constexpr int kSquares = 64;
+// Limit of the shared memory arrays of se.comp.
+constexpr int kMaxSeChannels = 1024;
+
+const uint32_t kExpandFp32[] = {
+#include "expand_fp32.h"
+};
+const uint32_t kExpandFp16[] = {
+#include "expand_fp16.h"
+};
+const uint32_t kWinogradInFp32[] = {
+#include "winograd_in_fp32.h"
+};
+const uint32_t kWinogradInFp16[] = {
+#include "winograd_in_fp16.h"
+};
+const uint32_t kWinogradGemmFp32[] = {
+#include "winograd_gemm_fp32.h"
+};
+const uint32_t kWinogradGemmFp16[] = {
+#include "winograd_gemm_fp16.h"
+};
+const uint32_t kWinogradOutFp32[] = {
+#include "winograd_out_fp32.h"
+};
+const uint32_t kWinogradOutFp16[] = {
+#include "winograd_out_fp16.h"
+};
+const uint32_t kConv1x1Fp32[] = {
+#include "conv1x1_fp32.h"
+};
+const uint32_t kConv1x1Fp16[] = {
+#include "conv1x1_fp16.h"
+};
+const uint32_t kFcFp32[] = {
+#include "fc_fp32.h"
+};
+const uint32_t kFcFp16[] = {
+#include "fc_fp16.h"
+};
+const uint32_t kSeFp32[] = {
+#include "se_fp32.h"
+};
+const uint32_t kSeFp16[] = {
+#include "se_fp16.h"
+};
+const uint32_t kPolicyMapFp32[] = {
+#include "policymap_fp32.h"
+};
+const uint32_t kPolicyMapFp16[] = {
+#include "policymap_fp16.h"
+};
+const uint32_t kOutputFp32[] = {
+#include "output_fp32.h"
+};
+const uint32_t kOutputFp16[] = {
+#include "output_fp16.h"
+};
+
+enum Kernel {
+  kExpand,
+  kWinogradIn,
+  kWinogradGemm,
+  kWinogradOut,
+  kConv1x1,
+  kFc,
+  kSe,
+  kPolicyMap,
+  kOutput,
+  kNumKernels
+};
+
+struct Spirv {
+  const uint32_t* code;
+  size_t size;
+};
+
+#define LC0_SPIRV(array) \
+  { array, sizeof(array) }
+const Spirv kSpirvFp32[kNumKernels] = {
+    LC0_SPIRV(kExpandFp32),       LC0_SPIRV(kWinogradInFp32),
+    LC0_SPIRV(kWinogradGemmFp32), LC0_SPIRV(kWinogradOutFp32),
+    LC0_SPIRV(kConv1x1Fp32),      LC0_SPIRV(kFcFp32),
+    LC0_SPIRV(kSeFp32),           LC0_SPIRV(kPolicyMapFp32),
+    LC0_SPIRV(kOutputFp32)};
+const Spirv kSpirvFp16[kNumKernels] = {
+    LC0_SPIRV(kExpandFp16),       LC0_SPIRV(kWinogradInFp16),
+    LC0_SPIRV(kWinogradGemmFp16), LC0_SPIRV(kWinogradOutFp16),
+    LC0_SPIRV(kConv1x1Fp16),      LC0_SPIRV(kFcFp16),
+    LC0_SPIRV(kSeFp16),           LC0_SPIRV(kPolicyMapFp16),
+    LC0_SPIRV(kOutputFp16)};
+#undef LC0_SPIRV
+
+// Buffers every evaluation slot has its own of.
+enum Slot {
+  kMasks,
+  kValues,
+  kAct0,
+  kAct1,
+  kAct2,
+  kWinogradV,
+  kWinogradM,
+  kPolicyOut,
+  kValueOut,
+  kNumSlots
+};
+
+// A binding of a step: the network's @weights, or the @slot buffer of the
+// evaluation slot. Neither for bindings the shader doesn't use.
+struct BufferRef {
+  BufferRef() = default;
+  BufferRef(const Buffer* weights) : weights(weights) {}
+  BufferRef(Slot slot) : slot(slot) {}
+  const Buffer* weights = nullptr;
+  int slot = -1;
+};
+
+using Groups = std::array<uint32_t, 3>;
+
+// One dispatch of the network.
+struct Step {
+  VkPipeline pipeline;
+  std::array<BufferRef, kNumBindings> bindings;
+  std::array<uint32_t, 3> params;
+  // Workgroup counts for a batch size.
+  std::function<Groups(uint32_t batch)> groups;
+};
+
+uint32_t DivUp(uint32_t a, uint32_t b) { return (a + b - 1) / b; }
+
+// Buffers, descriptor sets and command buffer to evaluate a batch with. The
+// descriptor sets are written once, and the command buffer is recorded again
+// only when the batch size changes.
+struct EvalSlot {
+  std::array<Buffer, kNumSlots> buffers;
+  VkDescriptorPool descriptor_pool = VK_NULL_HANDLE;
+  std::vector<VkDescriptorSet> sets;
+  VkCommandPool command_pool = VK_NULL_HANDLE;
+  VkCommandBuffer cmd = VK_NULL_HANDLE;
+  VkFence fence = VK_NULL_HANDLE;
+  int queue = 0;
+  int recorded_batch = 0;
+};
+
+class VulkanNetwork;
+
+class VulkanComputation : public NetworkComputation {
+ public:
+  VulkanComputation(VulkanNetwork* network, bool wdl);
+  ~VulkanComputation() override;
+
+  void AddInput(InputPlanes&& input) override;
+
+  void ComputeBlocking() override;
+
+  int GetBatchSize() const override { return batch_size_; }
+
+  float GetQVal(int sample) const override {
+    if (wdl_) return Value(3 * sample + 0) - Value(3 * sample + 2);
+    return Value(sample);
+  }
+
+  float GetDVal(int sample) const override {
+    if (wdl_) return Value(3 * sample + 1);
+    return 0.0f;
+  }
+
+  float GetPVal(int sample, int move_id) const override {
+    return static_cast<const float*>(
+        slot_->buffers[kPolicyOut].mapped)[sample * kNumOutputPolicy + move_id];
+  }
+
+ private:
+  float Value(int index) const {
+    return static_cast<const float*>(slot_->buffers[kValueOut].mapped)[index];
+  }
+
+  VulkanNetwork* network_;
+  std::unique_ptr<EvalSlot> slot_;
+  int batch_size_ = 0;
+  bool wdl_;
+};
+
+class VulkanNetwork : public Network {
+ public:
+  VulkanNetwork(const WeightsFile& file, const OptionsDict& options) {
+    LegacyWeights weights(file.weights());
+    wdl_ = file.format().network_format().value() ==
+           pblczero::NetworkFormat::VALUE_WDL;
+    const bool conv_policy = file.format().network_format().policy() ==
+                             pblczero::NetworkFormat::POLICY_CONVOLUTION;
+    max_batch_size_ = options.GetOrDefault<int>("max_batch", 256);
+
+    context_ = std::make_unique<VulkanContext>(
+        options.GetOrDefault<int>("gpu", 0),
+        options.GetOrDefault<int>("queues", 2),
+        options.GetOrDefault<std::string>("pipeline_cache",
+                                          "lc0_vulkan_pipeline_cache"));
+    fp16_ = options.GetOrDefault<bool>("fp16", context_->SupportsFp16Storage());
+    if (fp16_ && !context_->SupportsFp16Storage()) {
+      throw Exception("Vulkan device " + context_->GetDeviceName() +
+                      " has no fp16 storage, use fp16=false");
+    }
+    const Spirv* spirv = fp16_ ? kSpirvFp16 : kSpirvFp32;
+    for (int i = 0; i < kNumKernels; i++) {
+      pipelines_[i] = context_->CreatePipeline(spirv[i].code, spirv[i].size);
+    }
+    context_->SavePipelineCache();
+
+    BuildSteps(&weights, conv_policy);
+    dummy_ = context_->CreateBuffer(4, false);
+    CERR << "Vulkan device: " << context_->GetDeviceName() << ", "
+         << (fp16_ ? "fp16" : "fp32") << ", " << context_->GetQueueCount()
+         << " queue(s)";
+  }
+
+  ~VulkanNetwork() override {
+    vkDeviceWaitIdle(context_->GetDevice());
+    for (auto& slot : free_slots_) DestroySlot(slot.get());
+    for (auto& buffer : weights_) context_->DestroyBuffer(&buffer);
+    context_->DestroyBuffer(&dummy_);
+  }
+
+  std::unique_ptr<NetworkComputation> NewComputation() override {
+    return std::make_unique<VulkanComputation>(this, wdl_);
+  }
+
+  int GetMaxBatchSize() const { return max_batch_size_; }
+
+  std::unique_ptr<EvalSlot> GetSlot() {
+    {
+      std::lock_guard<std::mutex> lock(slots_mutex_);
+      if (!free_slots_.empty()) {
+        auto slot = std::move(free_slots_.back());
+        free_slots_.pop_back();
+        return slot;
+      }
+    }
+    return NewSlot();
+  }
+
+  void ReleaseSlot(std::unique_ptr<EvalSlot> slot) {
+    std::lock_guard<std::mutex> lock(slots_mutex_);
+    free_slots_.push_back(std::move(slot));
+  }
+
+  // Evaluates the first @batch_size inputs of @slot, waiting for the results.
+  void Compute(EvalSlot* slot, int batch_size) {
+    const VkDevice device = context_->GetDevice();
+    if (slot->recorded_batch != batch_size) Record(slot, batch_size);
+    CheckVk(vkResetFences(device, 1, &slot->fence), "vkResetFences");
+    context_->Submit(slot->queue, slot->cmd, slot->fence);
+    CheckVk(vkWaitForFences(device, 1, &slot->fence, VK_TRUE, UINT64_MAX),
+            "vkWaitForFences");
+  }
+
+ private:
+  const Buffer* AddWeights(const std::vector<float>& values) {
+    if (!fp16_) return AddRaw(values.data(), values.size() * sizeof(float));
+    std::vector<uint16_t> halves(values.size());
+    std::transform(values.begin(), values.end(), halves.begin(), FP32toFP16);
+    return AddRaw(halves.data(), halves.size() * sizeof(uint16_t));
+  }
+
+  const Buffer* AddRaw(const void* data, size_t size) {
+    weights_.push_back(context_->CreateBuffer(size, false));
+    context_->Upload(weights_.back(), data, size);
+    return &weights_.back();
+  }
+
+  void AddStep(Kernel kernel, std::array<BufferRef, kNumBindings> bindings,
+               std::array<uint32_t, 3> params,
+               std::function<Groups(uint32_t)> groups) {
+    steps_.push_back({pipelines_[kernel], bindings, params, std::move(groups)});
+  }
+
+  // 3x3 convolution of @in to @out through the Winograd buffers. With
+  // @residual the output adds it, and may be it.
+  void AddConv3(Slot in, Slot out, const Buffer* filter, const Buffer* bias,
+                uint32_t channels, uint32_t outputs, bool relu,
+                BufferRef residual = BufferRef()) {
+    AddStep(kWinogradIn, {in, kWinogradV}, {channels, 0, 0},
+            [channels](uint32_t batch) {
+              return Groups{DivUp(channels, 64), batch * 16, 1};
+            });
+    AddStep(kWinogradGemm, {filter, kWinogradV, kWinogradM},
+            {channels, outputs, 0}, [outputs](uint32_t batch) {
+              return Groups{DivUp(outputs, 16), batch, 16};
+            });
+    const uint32_t flags = (relu ? 1 : 0) | (residual.slot >= 0 ? 2 : 0);
+    AddStep(kWinogradOut, {kWinogradM, bias, out, residual}, {outputs, flags, 0},
+            [outputs](uint32_t batch) {
+              return Groups{DivUp(outputs, 64), batch * 16, 1};
+            });
+  }
+
+  // Uploads the weights and plans the dispatches of the whole network.
+  void BuildSteps(LegacyWeights* weights, bool conv_policy) {
+    const uint32_t channels = weights->input.biases.size();
+    const auto conv3 = [&](const LegacyWeights::ConvBlock& conv,
+                           uint32_t inputs) {
+      return AddWeights(WinogradFilterTransformF(
+          conv.weights, conv.biases.size(), inputs));
+    };
+
+    AddStep(kExpand, {kMasks, kValues, kAct0}, {kInputPlanes, 0, 0},
+            [](uint32_t batch) { return Groups{batch * kInputPlanes, 1, 1}; });
+    AddConv3(kAct0, kAct2, conv3(weights->input, kInputPlanes),
+             AddWeights(weights->input.biases), kInputPlanes, channels, true);
+
+    for (auto& residual : weights->residual) {
+      AddConv3(kAct2, kAct0, conv3(residual.conv1, channels),
+               AddWeights(residual.conv1.biases), channels, channels, true);
+      if (!residual.has_se) {
+        AddConv3(kAct0, kAct2, conv3(residual.conv2, channels),
+                 AddWeights(residual.conv2.biases), channels, channels, true,
+                 kAct2);
+        continue;
+      }
+      const uint32_t se_channels = residual.se.b1.size();
+      if (channels > kMaxSeChannels || se_channels > kMaxSeChannels) {
+        throw Exception("Vulkan backend supports SE of up to " +
+                        std::to_string(kMaxSeChannels) + " channels");
+      }
+      AddConv3(kAct0, kAct1, conv3(residual.conv2, channels),
+               AddWeights(residual.conv2.biases), channels, channels, false);
+      std::vector<float> se;
+      for (auto* vec : {&residual.se.w1, &residual.se.b1, &residual.se.w2,
+                        &residual.se.b2}) {
+        se.insert(se.end(), vec->begin(), vec->end());
+      }
+      AddStep(kSe, {kAct1, AddWeights(se), kAct2}, {channels, se_channels, 0},
+              [](uint32_t batch) { return Groups{batch, 1, 1}; });
+    }
+
+    // Softmax or tanh, a row per workgroup.
+    const auto rows = [](uint32_t batch) { return Groups{batch, 1, 1}; };
+
+    // Policy head.
+    const uint32_t policy_channels = weights->policy.biases.size();
+    if (conv_policy) {
+      AddConv3(kAct2, kAct0, conv3(weights->policy1, channels),
+               AddWeights(weights->policy1.biases), channels, channels, true);
+      AddConv3(kAct0, kAct1, conv3(weights->policy, channels),
+               AddWeights(weights->policy.biases), channels, policy_channels,
+               false);
+      std::vector<int32_t> indices(kNumOutputPolicy, 0);
+      for (size_t i = 0; i < sizeof(kConvPolicyMap) / sizeof(*kConvPolicyMap);
+           i++) {
+        if (kConvPolicyMap[i] >= 0) indices[kConvPolicyMap[i]] = i;
+      }
+      AddStep(kPolicyMap,
+              {kAct1, AddRaw(indices.data(), indices.size() * sizeof(int32_t)),
+               kAct0},
+              {policy_channels * kSquares, kNumOutputPolicy, 0},
+              [](uint32_t batch) {
+                return Groups{DivUp(kNumOutputPolicy, 64), batch, 1};
+              });
+    } else {
+      AddStep(kConv1x1,
+              {kAct2, AddWeights(weights->policy.weights),
+               AddWeights(weights->policy.biases), kAct0},
+              {channels, policy_channels, 0}, [policy_channels](uint32_t batch) {
+                return Groups{batch, policy_channels, 1};
+              });
+      AddStep(kFc,
+              {kAct0, AddWeights(weights->ip_pol_w),
+               AddWeights(weights->ip_pol_b), kAct1},
+              {policy_channels * kSquares, kNumOutputPolicy, 0},
+              [](uint32_t batch) {
+                return Groups{DivUp(kNumOutputPolicy, 64), batch, 1};
+              });
+    }
+    AddStep(kOutput, {conv_policy ? kAct0 : kAct1, kPolicyOut},
+            {kNumOutputPolicy, 0, 0}, rows);
+
+    // Value head.
+    const uint32_t value_channels = weights->value.biases.size();
+    const uint32_t value_hidden = weights->ip1_val_b.size();
+    const uint32_t value_outputs = wdl_ ? 3 : 1;
+    AddStep(kConv1x1,
+            {kAct2, AddWeights(weights->value.weights),
+             AddWeights(weights->value.biases), kAct0},
+            {channels, value_channels, 0}, [value_channels](uint32_t batch) {
+              return Groups{batch, value_channels, 1};
+            });
+    AddStep(kFc,
+            {kAct0, AddWeights(weights->ip1_val_w),
+             AddWeights(weights->ip1_val_b), kAct1},
+            {value_channels * kSquares, value_hidden, 1},
+            [value_hidden](uint32_t batch) {
+              return Groups{DivUp(value_hidden, 64), batch, 1};
+            });
+    AddStep(kFc,
+            {kAct1, AddWeights(weights->ip2_val_w),
+             AddWeights(weights->ip2_val_b), kAct0},
+            {value_hidden, value_outputs, 0},
+            [](uint32_t batch) { return Groups{1, batch, 1}; });
+    AddStep(kOutput, {kAct0, kValueOut}, {value_outputs, wdl_ ? 0u : 1u, 0},
+            rows);
+
+    // Buffer sizes of the slots, in elements.
+    const size_t largest = std::max<size_t>(
+        {kInputPlanes, channels, policy_channels, value_channels});
+    slot_sizes_[kMasks] = kInputPlanes * sizeof(uint64_t);
+    slot_sizes_[kValues] = kInputPlanes * sizeof(float);
+    const size_t store = fp16_ ? sizeof(uint16_t) : sizeof(float);
+    for (auto slot : {kAct0, kAct1, kAct2}) {
+      slot_sizes_[slot] =
+          std::max<size_t>({largest * kSquares, kNumOutputPolicy,
+                            value_hidden}) *
+          store;
+    }
+    slot_sizes_[kWinogradV] = 16 * 16 * largest * store;
+    slot_sizes_[kWinogradM] = 16 * 16 * largest * store;
+    slot_sizes_[kPolicyOut] = kNumOutputPolicy * sizeof(float);
+    slot_sizes_[kValueOut] = value_outputs * sizeof(float);
+  }
+
+  std::unique_ptr<EvalSlot> NewSlot() {
+    const VkDevice device = context_->GetDevice();
+    auto slot = std::make_unique<EvalSlot>();
+    // Batches evaluated at the same time go to different queues.
+    slot->queue = slot_count_++ % context_->GetQueueCount();
+    for (int i = 0; i < kNumSlots; i++) {
+      const bool host_visible =
+          i == kMasks || i == kValues || i == kPolicyOut || i == kValueOut;
+      slot->buffers[i] = context_->CreateBuffer(
+          slot_sizes_[i] * max_batch_size_, host_visible);
+    }
+
+    VkDescriptorPoolSize pool_size = {};
+    pool_size.type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    pool_size.descriptorCount = steps_.size() * kNumBindings;
+    VkDescriptorPoolCreateInfo pool_info = {};
+    pool_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    pool_info.maxSets = steps_.size();
+    pool_info.poolSizeCount = 1;
+    pool_info.pPoolSizes = &pool_size;
+    CheckVk(vkCreateDescriptorPool(device, &pool_info, nullptr,
+                                   &slot->descriptor_pool),
+            "vkCreateDescriptorPool");
+    const std::vector<VkDescriptorSetLayout> layouts(
+        steps_.size(), context_->GetSetLayout());
+    VkDescriptorSetAllocateInfo set_info = {};
+    set_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    set_info.descriptorPool = slot->descriptor_pool;
+    set_info.descriptorSetCount = layouts.size();
+    set_info.pSetLayouts = layouts.data();
+    slot->sets.resize(steps_.size());
+    CheckVk(vkAllocateDescriptorSets(device, &set_info, slot->sets.data()),
+            "vkAllocateDescriptorSets");
+
+    std::vector<VkDescriptorBufferInfo> infos(steps_.size() * kNumBindings);
+    std::vector<VkWriteDescriptorSet> writes(steps_.size());
+    for (size_t i = 0; i < steps_.size(); i++) {
+      for (int j = 0; j < kNumBindings; j++) {
+        const BufferRef& ref = steps_[i].bindings[j];
+        const Buffer& buffer = ref.weights ? *ref.weights
+                               : ref.slot >= 0 ? slot->buffers[ref.slot]
+                                               : dummy_;
+        infos[i * kNumBindings + j] = {buffer.buffer, 0, VK_WHOLE_SIZE};
+      }
+      writes[i].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+      writes[i].dstSet = slot->sets[i];
+      writes[i].descriptorCount = kNumBindings;
+      writes[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+      writes[i].pBufferInfo = &infos[i * kNumBindings];
+    }
+    vkUpdateDescriptorSets(device, writes.size(), writes.data(), 0, nullptr);
+
+    VkCommandPoolCreateInfo command_pool_info = {};
+    command_pool_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+    command_pool_info.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+    command_pool_info.queueFamilyIndex = context_->GetQueueFamily();
+    CheckVk(vkCreateCommandPool(device, &command_pool_info, nullptr,
+                                &slot->command_pool),
+            "vkCreateCommandPool");
+    VkCommandBufferAllocateInfo cmd_info = {};
+    cmd_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    cmd_info.commandPool = slot->command_pool;
+    cmd_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    cmd_info.commandBufferCount = 1;
+    CheckVk(vkAllocateCommandBuffers(device, &cmd_info, &slot->cmd),
+            "vkAllocateCommandBuffers");
+    VkFenceCreateInfo fence_info = {};
+    fence_info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+    CheckVk(vkCreateFence(device, &fence_info, nullptr, &slot->fence),
+            "vkCreateFence");
+    return slot;
+  }
+
+  void DestroySlot(EvalSlot* slot) {
+    const VkDevice device = context_->GetDevice();
+    vkDestroyFence(device, slot->fence, nullptr);
+    vkDestroyCommandPool(device, slot->command_pool, nullptr);
+    vkDestroyDescriptorPool(device, slot->descriptor_pool, nullptr);
+    for (auto& buffer : slot->buffers) context_->DestroyBuffer(&buffer);
+  }
+
+  void Record(EvalSlot* slot, int batch_size) {
+    TRACE_SCOPE("vulkan record");
+    const VkCommandBuffer cmd = slot->cmd;
+    CheckVk(vkResetCommandBuffer(cmd, 0), "vkResetCommandBuffer");
+    VkCommandBufferBeginInfo begin_info = {};
+    begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    CheckVk(vkBeginCommandBuffer(cmd, &begin_info), "vkBeginCommandBuffer");
+    VkMemoryBarrier barrier = {};
+    barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT |
+                            VK_ACCESS_SHADER_WRITE_BIT;
+    for (size_t i = 0; i < steps_.size(); i++) {
+      const Step& step = steps_[i];
+      vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, step.pipeline);
+      vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE,
+                              context_->GetPipelineLayout(), 0, 1,
+                              &slot->sets[i], 0, nullptr);
+      const PushConstants constants = {
+          static_cast<uint32_t>(batch_size),
+          {step.params[0], step.params[1], step.params[2]}};
+      vkCmdPushConstants(cmd, context_->GetPipelineLayout(),
+                         VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(constants),
+                         &constants);
+      const Groups groups = step.groups(batch_size);
+      vkCmdDispatch(cmd, groups[0], groups[1], groups[2]);
+      if (i + 1 == steps_.size()) {
+        barrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+      }
+      vkCmdPipelineBarrier(
+          cmd, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+          i + 1 == steps_.size() ? VK_PIPELINE_STAGE_HOST_BIT
+                                 : VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+          0, 1, &barrier, 0, nullptr, 0, nullptr);
+    }
+    CheckVk(vkEndCommandBuffer(cmd), "vkEndCommandBuffer");
+    slot->recorded_batch = batch_size;
+  }
+
+  std::unique_ptr<VulkanContext> context_;
+  bool wdl_;
+  bool fp16_;
+  int max_batch_size_;
+  std::array<VkPipeline, kNumKernels> pipelines_;
+  // A deque, as steps point to its elements.
+  std::deque<Buffer> weights_;
+  // Bound to the bindings a shader doesn't use.
+  Buffer dummy_;
+  std::vector<Step> steps_;
+  // Per position, in bytes.
+  std::array<size_t, kNumSlots> slot_sizes_;
+
+  std::mutex slots_mutex_;
+  std::vector<std::unique_ptr<EvalSlot>> free_slots_;
+  std::atomic<int> slot_count_{0};
+};
+
+VulkanComputation::VulkanComputation(VulkanNetwork* network, bool wdl)
+    : network_(network), slot_(network->GetSlot()), wdl_(wdl) {}
+
+VulkanComputation::~VulkanComputation() {
+  network_->ReleaseSlot(std::move(slot_));
+}
+
+void VulkanComputation::AddInput(InputPlanes&& input) {
+  if (batch_size_ == network_->GetMaxBatchSize()) {
+    throw Exception("Batch is larger than max_batch");
+  }
+  auto* masks = static_cast<uint64_t*>(slot_->buffers[kMasks].mapped) +
+                batch_size_ * kInputPlanes;
+  auto* values = static_cast<float*>(slot_->buffers[kValues].mapped) +
+                 batch_size_ * kInputPlanes;
+  for (size_t i = 0; i < input.size(); i++) {
+    masks[i] = input[i].mask;
+    values[i] = input[i].value;
+  }
+  batch_size_++;
+}
+
+void VulkanComputation::ComputeBlocking() {
+  if (batch_size_ == 0) return;
+  TRACE_SCOPE("vulkan compute");
+  network_->Compute(slot_.get(), batch_size_);
+}
+
+std::unique_ptr<Network> MakeVulkanNetwork(const WeightsFile& weights,
+                                           const OptionsDict& options) {
+  const auto& format = weights.format().network_format();
+  if (format.network() !=
+          pblczero::NetworkFormat::NETWORK_CLASSICAL_WITH_HEADFORMAT &&
+      format.network() != pblczero::NetworkFormat::NETWORK_SE_WITH_HEADFORMAT) {
+    throw Exception("Network format " + std::to_string(format.network()) +
+                    " is not supported by Vulkan backend.");
+  }
+  if (format.policy() != pblczero::NetworkFormat::POLICY_CLASSICAL &&
+      format.policy() != pblczero::NetworkFormat::POLICY_CONVOLUTION) {
+    throw Exception("Policy format " + std::to_string(format.policy()) +
+                    " is not supported by Vulkan backend.");
+  }
+  if (format.value() != pblczero::NetworkFormat::VALUE_CLASSICAL &&
+      format.value() != pblczero::NetworkFormat::VALUE_WDL) {
+    throw Exception("Value format " + std::to_string(format.value()) +
+                    " is not supported by Vulkan backend.");
+  }
+  return std::make_unique<VulkanNetwork>(weights, options);
+}
+
+}  // namespace
+
+REGISTER_NETWORK("vulkan", MakeVulkanNetwork, 99)
+
+}  // namespace lczero
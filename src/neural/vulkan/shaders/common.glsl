@@ -0,0 +1,17 @@
+// Included by every shader after #version. Activations and weights are
+// stored in fp16 when compiled with STORAGE_FP16, arithmetic is always fp32.
+
+#ifdef STORAGE_FP16
+#extension GL_EXT_shader_16bit_storage : require
+#define STORE float16_t
+#else
+#define STORE float
+#endif
+
+// Batch size and per shader parameters.
+layout(push_constant) uniform Params {
+  uint batch;
+  uint p0;
+  uint p1;
+  uint p2;
+} params;
@@ -0,0 +1,339 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2019 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+
+  If you modify this Program, or any covered work, by linking or
+  combining it with NVIDIA Corporation's libraries from the NVIDIA CUDA
+  Toolkit and the NVIDIA CUDA Deep Neural Network library (or a
+  modified version of those libraries), containing parts covered by the
+  terms of the respective license agreement, the licensors of this
+  Program grant you additional permission to convey the resulting work.
+*/
+
+#include "neural/vulkan/vulkan_context.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+
+#include "utils/exception.h"
+#include "utils/logging.h"
+
+namespace lczero {
+namespace vulkan_backend {
+
+void CheckVk(VkResult result, const char* what) {
+  if (result >= 0) return;
+  throw Exception(std::string("Vulkan: ") + what + " failed with error " +
+                  std::to_string(result));
+}
+
+VulkanContext::VulkanContext(int gpu_id, int max_queues,
+                             const std::string& pipeline_cache_path)
+    : pipeline_cache_path_(pipeline_cache_path) {
+  VkApplicationInfo app_info = {};
+  app_info.sType = VK_STRUCTURE_TYPE_APPLICATION_INFO;
+  app_info.pApplicationName = "lc0";
+  app_info.apiVersion = VK_API_VERSION_1_1;
+  VkInstanceCreateInfo instance_info = {};
+  instance_info.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO;
+  instance_info.pApplicationInfo = &app_info;
+  CheckVk(vkCreateInstance(&instance_info, nullptr, &instance_),
+          "vkCreateInstance");
+
+  uint32_t count = 0;
+  CheckVk(vkEnumeratePhysicalDevices(instance_, &count, nullptr),
+          "vkEnumeratePhysicalDevices");
+  std::vector<VkPhysicalDevice> devices(count);
+  CheckVk(vkEnumeratePhysicalDevices(instance_, &count, devices.data()),
+          "vkEnumeratePhysicalDevices");
+  if (gpu_id < 0 || gpu_id >= static_cast<int>(count)) {
+    throw Exception("Invalid Vulkan device: " + std::to_string(gpu_id));
+  }
+  physical_device_ = devices[gpu_id];
+  VkPhysicalDeviceProperties properties;
+  vkGetPhysicalDeviceProperties(physical_device_, &properties);
+  device_name_ = properties.deviceName;
+  vkGetPhysicalDeviceMemoryProperties(physical_device_, &memory_properties_);
+
+  VkPhysicalDevice16BitStorageFeatures storage_features = {};
+  storage_features.sType =
+      VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_16BIT_STORAGE_FEATURES;
+  VkPhysicalDeviceFeatures2 features = {};
+  features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+  features.pNext = &storage_features;
+  vkGetPhysicalDeviceFeatures2(physical_device_, &features);
+  fp16_storage_ = storage_features.storageBuffer16BitAccess == VK_TRUE;
+
+  // A compute only family, if there is one, runs beside graphics work.
+  uint32_t family_count = 0;
+  vkGetPhysicalDeviceQueueFamilyProperties(physical_device_, &family_count,
+                                           nullptr);
+  std::vector<VkQueueFamilyProperties> families(family_count);
+  vkGetPhysicalDeviceQueueFamilyProperties(physical_device_, &family_count,
+                                           families.data());
+  int family = -1;
+  for (uint32_t i = 0; i < family_count; i++) {
+    if (!(families[i].queueFlags & VK_QUEUE_COMPUTE_BIT)) continue;
+    const bool compute_only = !(families[i].queueFlags & VK_QUEUE_GRAPHICS_BIT);
+    if (family < 0 || compute_only) family = i;
+    if (compute_only) break;
+  }
+  if (family < 0) throw Exception("Vulkan device has no compute queue");
+  queue_family_ = family;
+  const uint32_t queue_count = std::max(
+      1u, std::min<uint32_t>(max_queues, families[family].queueCount));
+
+  const std::vector<float> priorities(queue_count, 1.0f);
+  VkDeviceQueueCreateInfo queue_info = {};
+  queue_info.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
+  queue_info.queueFamilyIndex = queue_family_;
+  queue_info.queueCount = queue_count;
+  queue_info.pQueuePriorities = priorities.data();
+  storage_features.pNext = nullptr;
+  storage_features.storageBuffer16BitAccess = fp16_storage_;
+  storage_features.uniformAndStorageBuffer16BitAccess = VK_FALSE;
+  storage_features.storagePushConstant16 = VK_FALSE;
+  storage_features.storageInputOutput16 = VK_FALSE;
+  VkDeviceCreateInfo device_info = {};
+  device_info.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
+  device_info.pNext = &storage_features;
+  device_info.queueCreateInfoCount = 1;
+  device_info.pQueueCreateInfos = &queue_info;
+  CheckVk(vkCreateDevice(physical_device_, &device_info, nullptr, &device_),
+          "vkCreateDevice");
+  queues_.resize(queue_count);
+  for (uint32_t i = 0; i < queue_count; i++) {
+    vkGetDeviceQueue(device_, queue_family_, i, &queues_[i]);
+  }
+  queue_mutexes_.reset(new std::mutex[queue_count]);
+
+  VkCommandPoolCreateInfo pool_info = {};
+  pool_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+  pool_info.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+  pool_info.queueFamilyIndex = queue_family_;
+  CheckVk(vkCreateCommandPool(device_, &pool_info, nullptr, &upload_pool_),
+          "vkCreateCommandPool");
+
+  VkDescriptorSetLayoutBinding bindings[kNumBindings] = {};
+  for (int i = 0; i < kNumBindings; i++) {
+    bindings[i].binding = i;
+    bindings[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    bindings[i].descriptorCount = 1;
+    bindings[i].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+  }
+  VkDescriptorSetLayoutCreateInfo set_info = {};
+  set_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+  set_info.bindingCount = kNumBindings;
+  set_info.pBindings = bindings;
+  CheckVk(vkCreateDescriptorSetLayout(device_, &set_info, nullptr,
+                                      &set_layout_),
+          "vkCreateDescriptorSetLayout");
+  VkPushConstantRange push_range = {};
+  push_range.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+  push_range.size = sizeof(PushConstants);
+  VkPipelineLayoutCreateInfo layout_info = {};
+  layout_info.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+  layout_info.setLayoutCount = 1;
+  layout_info.pSetLayouts = &set_layout_;
+  layout_info.pushConstantRangeCount = 1;
+  layout_info.pPushConstantRanges = &push_range;
+  CheckVk(vkCreatePipelineLayout(device_, &layout_info, nullptr,
+                                 &pipeline_layout_),
+          "vkCreatePipelineLayout");
+
+  // The driver checks that the cache is its own, and ignores it otherwise.
+  std::vector<char> cache_data;
+  if (!pipeline_cache_path_.empty()) {
+    std::ifstream file(pipeline_cache_path_, std::ios::binary);
+    cache_data.assign(std::istreambuf_iterator<char>(file),
+                      std::istreambuf_iterator<char>());
+  }
+  VkPipelineCacheCreateInfo cache_info = {};
+  cache_info.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+  cache_info.initialDataSize = cache_data.size();
+  cache_info.pInitialData = cache_data.empty() ? nullptr : cache_data.data();
+  CheckVk(vkCreatePipelineCache(device_, &cache_info, nullptr,
+                                &pipeline_cache_),
+          "vkCreatePipelineCache");
+}
+
+VulkanContext::~VulkanContext() {
+  if (device_) {
+    vkDeviceWaitIdle(device_);
+    for (auto pipeline : pipelines_) vkDestroyPipeline(device_, pipeline, nullptr);
+    for (auto module : modules_) vkDestroyShaderModule(device_, module, nullptr);
+    vkDestroyPipelineCache(device_, pipeline_cache_, nullptr);
+    vkDestroyPipelineLayout(device_, pipeline_layout_, nullptr);
+    vkDestroyDescriptorSetLayout(device_, set_layout_, nullptr);
+    vkDestroyCommandPool(device_, upload_pool_, nullptr);
+    vkDestroyDevice(device_, nullptr);
+  }
+  if (instance_) vkDestroyInstance(instance_, nullptr);
+}
+
+uint32_t VulkanContext::FindMemoryType(uint32_t type_bits,
+                                       VkMemoryPropertyFlags flags,
+                                       VkMemoryPropertyFlags preferred) const {
+  int found = -1;
+  for (uint32_t i = 0; i < memory_properties_.memoryTypeCount; i++) {
+    const auto type_flags = memory_properties_.memoryTypes[i].propertyFlags;
+    if (!(type_bits & (1u << i)) || (type_flags & flags) != flags) continue;
+    if ((type_flags & preferred) == preferred) return i;
+    if (found < 0) found = i;
+  }
+  if (found < 0) throw Exception("Vulkan: no suitable memory type");
+  return found;
+}
+
+Buffer VulkanContext::CreateBuffer(size_t size, bool host_visible) {
+  Buffer result;
+  result.size = size;
+  VkBufferCreateInfo buffer_info = {};
+  buffer_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+  buffer_info.size = std::max<size_t>(size, 4);
+  buffer_info.usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+                      VK_BUFFER_USAGE_TRANSFER_SRC_BIT |
+                      VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+  buffer_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+  CheckVk(vkCreateBuffer(device_, &buffer_info, nullptr, &result.buffer),
+          "vkCreateBuffer");
+  VkMemoryRequirements requirements;
+  vkGetBufferMemoryRequirements(device_, result.buffer, &requirements);
+  VkMemoryAllocateInfo allocate_info = {};
+  allocate_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+  allocate_info.allocationSize = requirements.size;
+  // Host visible memory which is also device local (integrated GPUs,
+  // resizable BAR) spares the GPU reads over the bus.
+  allocate_info.memoryTypeIndex =
+      host_visible
+          ? FindMemoryType(requirements.memoryTypeBits,
+                           VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                               VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                           VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT)
+          : FindMemoryType(requirements.memoryTypeBits,
+                           VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, 0);
+  CheckVk(vkAllocateMemory(device_, &allocate_info, nullptr, &result.memory),
+          "vkAllocateMemory");
+  CheckVk(vkBindBufferMemory(device_, result.buffer, result.memory, 0),
+          "vkBindBufferMemory");
+  if (host_visible) {
+    CheckVk(vkMapMemory(device_, result.memory, 0, VK_WHOLE_SIZE, 0,
+                        &result.mapped),
+            "vkMapMemory");
+  }
+  return result;
+}
+
+void VulkanContext::DestroyBuffer(Buffer* buffer) {
+  if (buffer->mapped) vkUnmapMemory(device_, buffer->memory);
+  vkDestroyBuffer(device_, buffer->buffer, nullptr);
+  vkFreeMemory(device_, buffer->memory, nullptr);
+  *buffer = Buffer();
+}
+
+void VulkanContext::Upload(const Buffer& buffer, const void* data,
+                           size_t size) {
+  Buffer staging = CreateBuffer(size, true);
+  std::memcpy(staging.mapped, data, size);
+
+  VkCommandBufferAllocateInfo allocate_info = {};
+  allocate_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+  allocate_info.commandPool = upload_pool_;
+  allocate_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+  allocate_info.commandBufferCount = 1;
+  VkCommandBuffer cmd;
+  CheckVk(vkAllocateCommandBuffers(device_, &allocate_info, &cmd),
+          "vkAllocateCommandBuffers");
+  VkCommandBufferBeginInfo begin_info = {};
+  begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+  begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+  CheckVk(vkBeginCommandBuffer(cmd, &begin_info), "vkBeginCommandBuffer");
+  VkBufferCopy region = {};
+  region.size = size;
+  vkCmdCopyBuffer(cmd, staging.buffer, buffer.buffer, 1, &region);
+  CheckVk(vkEndCommandBuffer(cmd), "vkEndCommandBuffer");
+
+  VkFenceCreateInfo fence_info = {};
+  fence_info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+  VkFence fence;
+  CheckVk(vkCreateFence(device_, &fence_info, nullptr, &fence),
+          "vkCreateFence");
+  Submit(0, cmd, fence);
+  CheckVk(vkWaitForFences(device_, 1, &fence, VK_TRUE, UINT64_MAX),
+          "vkWaitForFences");
+  vkDestroyFence(device_, fence, nullptr);
+  vkFreeCommandBuffers(device_, upload_pool_, 1, &cmd);
+  DestroyBuffer(&staging);
+}
+
+VkPipeline VulkanContext::CreatePipeline(const uint32_t* spirv, size_t size) {
+  VkShaderModuleCreateInfo module_info = {};
+  module_info.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+  module_info.codeSize = size;
+  module_info.pCode = spirv;
+  VkShaderModule module;
+  CheckVk(vkCreateShaderModule(device_, &module_info, nullptr, &module),
+          "vkCreateShaderModule");
+  modules_.push_back(module);
+
+  VkComputePipelineCreateInfo pipeline_info = {};
+  pipeline_info.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+  pipeline_info.stage.sType =
+      VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+  pipeline_info.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+  pipeline_info.stage.module = module;
+  pipeline_info.stage.pName = "main";
+  pipeline_info.layout = pipeline_layout_;
+  VkPipeline pipeline;
+  CheckVk(vkCreateComputePipelines(device_, pipeline_cache_, 1,
+                                   &pipeline_info, nullptr, &pipeline),
+          "vkCreateComputePipelines");
+  pipelines_.push_back(pipeline);
+  return pipeline;
+}
+
+void VulkanContext::SavePipelineCache() {
+  if (pipeline_cache_path_.empty()) return;
+  size_t size = 0;
+  CheckVk(vkGetPipelineCacheData(device_, pipeline_cache_, &size, nullptr),
+          "vkGetPipelineCacheData");
+  std::vector<char> data(size);
+  CheckVk(
+      vkGetPipelineCacheData(device_, pipeline_cache_, &size, data.data()),
+      "vkGetPipelineCacheData");
+  std::ofstream file(pipeline_cache_path_, std::ios::binary);
+  file.write(data.data(), size);
+  if (file.fail()) {
+    CERR << "Could not save the pipeline cache to " << pipeline_cache_path_;
+  }
+}
+
+void VulkanContext::Submit(int queue, VkCommandBuffer cmd, VkFence fence) {
+  VkSubmitInfo submit_info = {};
+  submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+  submit_info.commandBufferCount = 1;
+  submit_info.pCommandBuffers = &cmd;
+  std::lock_guard<std::mutex> lock(queue_mutexes_[queue]);
+  CheckVk(vkQueueSubmit(queues_[queue], 1, &submit_info, fence),
+          "vkQueueSubmit");
+}
+
+}  // namespace vulkan_backend
+}  // namespace lczero
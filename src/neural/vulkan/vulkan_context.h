@@ -0,0 +1,123 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2019 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+
+  If you modify this Program, or any covered work, by linking or
+  combining it with NVIDIA Corporation's libraries from the NVIDIA CUDA
+  Toolkit and the NVIDIA CUDA Deep Neural Network library (or a
+  modified version of those libraries), containing parts covered by the
+  terms of the respective license agreement, the licensors of this
+  Program grant you additional permission to convey the resulting work.
+*/
+
+#pragma once
+
+#include <vulkan/vulkan.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace lczero {
+namespace vulkan_backend {
+
+// Storage buffers of every pipeline; shaders using fewer leave the rest
+// unused.
+constexpr int kNumBindings = 4;
+
+// Push constants of every pipeline, see shaders/common.glsl.
+struct PushConstants {
+  uint32_t batch;
+  uint32_t params[3];
+};
+
+// Throws an Exception naming @what if @result is an error.
+void CheckVk(VkResult result, const char* what);
+
+struct Buffer {
+  VkBuffer buffer = VK_NULL_HANDLE;
+  VkDeviceMemory memory = VK_NULL_HANDLE;
+  size_t size = 0;
+  // Host visible buffers stay mapped.
+  void* mapped = nullptr;
+};
+
+// A Vulkan device with its compute queues, and the pipeline layout all the
+// shaders share.
+class VulkanContext {
+ public:
+  // Opens the @gpu_id-th physical device with up to @max_queues compute
+  // queues. Pipelines are cached in @pipeline_cache_path, if not empty.
+  VulkanContext(int gpu_id, int max_queues,
+                const std::string& pipeline_cache_path);
+  ~VulkanContext();
+
+  std::string GetDeviceName() const { return device_name_; }
+  // Whether shaders can store activations and weights in fp16.
+  bool SupportsFp16Storage() const { return fp16_storage_; }
+  int GetQueueCount() const { return static_cast<int>(queues_.size()); }
+
+  VkDevice GetDevice() const { return device_; }
+  uint32_t GetQueueFamily() const { return queue_family_; }
+  VkPipelineLayout GetPipelineLayout() const { return pipeline_layout_; }
+  VkDescriptorSetLayout GetSetLayout() const { return set_layout_; }
+
+  // Device local, or host visible, coherent and mapped if @host_visible.
+  Buffer CreateBuffer(size_t size, bool host_visible);
+  void DestroyBuffer(Buffer* buffer);
+  // Fills the device local @buffer through a staging buffer.
+  void Upload(const Buffer& buffer, const void* data, size_t size);
+
+  VkPipeline CreatePipeline(const uint32_t* spirv, size_t size);
+  // Writes the pipeline cache back, so that later starts skip compiling.
+  void SavePipelineCache();
+
+  // Submits @cmd to the @queue-th queue, signalling @fence.
+  void Submit(int queue, VkCommandBuffer cmd, VkFence fence);
+
+ private:
+  uint32_t FindMemoryType(uint32_t type_bits, VkMemoryPropertyFlags flags,
+                          VkMemoryPropertyFlags preferred) const;
+
+  VkInstance instance_ = VK_NULL_HANDLE;
+  VkPhysicalDevice physical_device_ = VK_NULL_HANDLE;
+  VkPhysicalDeviceMemoryProperties memory_properties_;
+  VkDevice device_ = VK_NULL_HANDLE;
+  std::string device_name_;
+  bool fp16_storage_ = false;
+  uint32_t queue_family_ = 0;
+  std::vector<VkQueue> queues_;
+  // Queues can't be submitted to from several threads at once.
+  std::unique_ptr<std::mutex[]> queue_mutexes_;
+
+  // For uploads, on the first queue.
+  VkCommandPool upload_pool_ = VK_NULL_HANDLE;
+
+  VkDescriptorSetLayout set_layout_ = VK_NULL_HANDLE;
+  VkPipelineLayout pipeline_layout_ = VK_NULL_HANDLE;
+  VkPipelineCache pipeline_cache_ = VK_NULL_HANDLE;
+  std::string pipeline_cache_path_;
+  std::vector<VkPipeline> pipelines_;
+  std::vector<VkShaderModule> modules_;
+};
+
+}  // namespace vulkan_backend
+}  // namespace lczero
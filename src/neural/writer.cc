@@ -27,16 +27,187 @@
 
 #include "neural/writer.h"
 
+#include <algorithm>
+#include <cstring>
 #include <iomanip>
+#include <memory>
 #include <sstream>
+#include "chess/bitboard.h"
 #include "utils/commandline.h"
 #include "utils/exception.h"
+#include "utils/fp16_utils.h"
 #include "utils/filesystem.h"
+#include "utils/logging.h"
 #include "utils/random.h"
 
 namespace lczero {
 
-TrainingDataWriter::TrainingDataWriter(int game_id) {
+namespace {
+const int kBoardPlanes = 13;
+const int kPlanes = 104;
+
+// Planes of the next record as far as they can be told from @planes, the
+// ones of the previous record.
+void PredictPlanes(const uint64_t* planes, uint64_t* next) {
+  const auto mirror = [](uint64_t plane) {
+    BitBoard board(plane);
+    board.Mirror();
+    return board.as_int();
+  };
+  std::fill(next, next + kBoardPlanes, 0);
+  for (int base = kBoardPlanes; base < kPlanes; base += kBoardPlanes) {
+    const uint64_t* older = planes + base - kBoardPlanes;
+    // Our pieces were theirs, from their side of the board.
+    for (int i = 0; i < 6; ++i) {
+      next[base + i] = mirror(older[6 + i]);
+      next[base + 6 + i] = mirror(older[i]);
+    }
+    next[base + 12] = older[12];
+  }
+}
+
+bool IsLegalMove(float probability) {
+  // Illegal moves are filled with all bits set.
+  uint32_t bits;
+  std::memcpy(&bits, &probability, sizeof(bits));
+  return bits != 0xFFFFFFFF;
+}
+
+template <typename T>
+void Append(const T& value, std::string* out) {
+  out->append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+}  // namespace
+
+void CompactTrainingEncoder::Encode(const V4TrainingData& data,
+                                    std::string* out) {
+  CompactTrainingHeader header{};
+  header.version = kCompactTrainingVersion;
+  for (const float probability : data.probabilities) {
+    if (IsLegalMove(probability)) ++header.policy_size;
+  }
+  uint64_t predicted[kPlanes];
+  PredictPlanes(planes_, predicted);
+  for (int i = 0; i < kPlanes; ++i) {
+    if (data.planes[i] != predicted[i]) {
+      header.stored_planes[i / 8] |= 1 << (i % 8);
+    }
+  }
+  header.castling_us_ooo = data.castling_us_ooo;
+  header.castling_us_oo = data.castling_us_oo;
+  header.castling_them_ooo = data.castling_them_ooo;
+  header.castling_them_oo = data.castling_them_oo;
+  header.side_to_move = data.side_to_move;
+  header.rule50_count = data.rule50_count;
+  header.move_count = data.move_count;
+  header.result = data.result;
+  header.root_q = data.root_q;
+  header.best_q = data.best_q;
+  header.root_d = data.root_d;
+  header.best_d = data.best_d;
+  Append(header, out);
+
+  for (uint16_t i = 0; i < 1858; ++i) {
+    if (!IsLegalMove(data.probabilities[i])) continue;
+    Append(i, out);
+    Append(FP32toFP16(data.probabilities[i]), out);
+  }
+  for (int i = 0; i < kPlanes; ++i) {
+    if (header.stored_planes[i / 8] & (1 << (i % 8))) {
+      Append(data.planes[i], out);
+    }
+  }
+  std::memcpy(planes_, data.planes, sizeof(planes_));
+}
+
+size_t CompactTrainingDecoder::Decode(const char* in, size_t size,
+                                      V4TrainingData* data) {
+  CompactTrainingHeader header;
+  if (size < sizeof(header)) return 0;
+  std::memcpy(&header, in, sizeof(header));
+  if (header.version != kCompactTrainingVersion) {
+    throw Exception("Not a compact training record");
+  }
+  int stored = 0;
+  for (const uint8_t bits : header.stored_planes) {
+    stored += BitBoard(bits).count();
+  }
+  const size_t record_size = sizeof(header) + header.policy_size * 4 +
+                             stored * sizeof(uint64_t);
+  if (size < record_size) return 0;
+  in += sizeof(header);
+
+  data->version = 4;
+  std::memset(data->probabilities, -1, sizeof(data->probabilities));
+  for (int i = 0; i < header.policy_size; ++i, in += 4) {
+    uint16_t idx;
+    uint16_t probability;
+    std::memcpy(&idx, in, sizeof(idx));
+    std::memcpy(&probability, in + 2, sizeof(probability));
+    if (idx >= 1858) throw Exception("Invalid move in training record");
+    data->probabilities[idx] = FP16toFP32(probability);
+  }
+  uint64_t planes[kPlanes];
+  PredictPlanes(planes_, planes);
+  for (int i = 0; i < kPlanes; ++i) {
+    if (!(header.stored_planes[i / 8] & (1 << (i % 8)))) continue;
+    std::memcpy(&planes[i], in, sizeof(uint64_t));
+    in += sizeof(uint64_t);
+  }
+  std::memcpy(data->planes, planes, sizeof(planes));
+  std::memcpy(planes_, planes, sizeof(planes));
+
+  data->castling_us_ooo = header.castling_us_ooo;
+  data->castling_us_oo = header.castling_us_oo;
+  data->castling_them_ooo = header.castling_them_ooo;
+  data->castling_them_oo = header.castling_them_oo;
+  data->side_to_move = header.side_to_move;
+  data->rule50_count = header.rule50_count;
+  data->move_count = header.move_count;
+  data->result = header.result;
+  data->root_q = header.root_q;
+  data->best_q = header.best_q;
+  data->root_d = header.root_d;
+  data->best_d = header.best_d;
+  return record_size;
+}
+
+void ConvertCompactTrainingData(const std::string& input,
+                                const std::string& output) {
+  gzFile fin = gzopen(input.c_str(), "rb");
+  if (!fin) throw Exception("Cannot read file " + input);
+  std::string buffer;
+  char block[1 << 16];
+  int bytes;
+  while ((bytes = gzread(fin, block, sizeof(block))) > 0) {
+    buffer.append(block, bytes);
+  }
+  gzclose(fin);
+  if (bytes < 0) throw Exception("Cannot read file " + input);
+
+  gzFile fout = gzopen(output.c_str(), "wb");
+  if (!fout) throw Exception("Cannot create gzip file " + output);
+  CompactTrainingDecoder decoder;
+  size_t pos = 0;
+  try {
+    while (pos < buffer.size()) {
+      V4TrainingData data;
+      const size_t size =
+          decoder.Decode(buffer.data() + pos, buffer.size() - pos, &data);
+      if (size == 0) throw Exception("Truncated training data in " + input);
+      pos += size;
+      if (gzwrite(fout, &data, sizeof(data)) != sizeof(data)) {
+        throw Exception("Unable to write into " + output);
+      }
+    }
+  } catch (...) {
+    gzclose(fout);
+    throw;
+  }
+  gzclose(fout);
+}
+
+std::string FileTrainingDataSink::Write(int game_id, const std::string& data) {
   static std::string directory =
       CommandLine::BinaryDirectory() + "/data-" + Random::Get().GetString(12);
   // It's fine if it already exists.
@@ -45,23 +216,112 @@ TrainingDataWriter::TrainingDataWriter(int game_id) {
   std::ostringstream oss;
   oss << directory << '/' << "game_" << std::setfill('0') << std::setw(6)
       << game_id << ".gz";
+  const std::string filename = oss.str();
 
-  filename_ = oss.str();
-  fout_ = gzopen(filename_.c_str(), "wb");
-  if (!fout_) throw Exception("Cannot create gzip file " + filename_);
+  std::ofstream file(filename, std::ios::binary);
+  if (!file) throw Exception("Cannot create file " + filename);
+  file.write(data.data(), data.size());
+  file.close();
+  if (!file) throw Exception("Unable to write into " + filename);
+  return filename;
 }
 
-void TrainingDataWriter::WriteChunk(const V4TrainingData& data) {
-  auto bytes_written =
-      gzwrite(fout_, reinterpret_cast<const char*>(&data), sizeof(data));
-  if (bytes_written != sizeof(data)) {
-    throw Exception("Unable to write into " + filename_);
+std::string StreamTrainingDataSink::Write(int game_id,
+                                          const std::string& data) {
+  std::string header("Lc0T");
+  const uint32_t id = game_id;
+  const uint64_t size = data.size();
+  Append(id, &header);
+  Append(size, &header);
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (!stream_.is_open()) {
+    stream_.open(path_, std::ios::binary);
+    if (!stream_) throw Exception("Cannot open " + path_);
   }
+  stream_.write(header.data(), header.size());
+  stream_.write(data.data(), data.size());
+  stream_.flush();
+  if (!stream_) throw Exception("Unable to write into " + path_);
+  return "";
+}
+
+std::string GzipCompress(const std::string& data, int compression_level) {
+  z_stream stream{};
+  // Window bits above 15 ask for a gzip header.
+  if (deflateInit2(&stream,
+                   compression_level < 0 ? Z_DEFAULT_COMPRESSION
+                                         : compression_level,
+                   Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+    throw Exception("Cannot initialize gzip compression");
+  }
+  std::string result(deflateBound(&stream, data.size()), '\0');
+  stream.next_in =
+      reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+  stream.avail_in = data.size();
+  stream.next_out = reinterpret_cast<Bytef*>(&result[0]);
+  stream.avail_out = result.size();
+  const int status = deflate(&stream, Z_FINISH);
+  result.resize(stream.total_out);
+  deflateEnd(&stream);
+  if (status != Z_STREAM_END) throw Exception("Gzip compression failed");
+  return result;
+}
+
+AsyncTrainingDataWriter::AsyncTrainingDataWriter(
+    std::unique_ptr<TrainingDataSink> sink, int games_per_file,
+    int compression_level, int threads, bool compact)
+    : sink_(std::move(sink)),
+      games_per_file_(games_per_file),
+      compression_level_(compression_level),
+      compact_(compact),
+      pool_(threads) {}
+
+void AsyncTrainingDataWriter::Write(int game_id,
+                                    std::vector<V4TrainingData> chunks,
+                                    Callback done) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  pending_.push_back({game_id, std::move(chunks), std::move(done)});
+  if (pending_.size() >= games_per_file_) WritePending();
+}
+
+void AsyncTrainingDataWriter::Flush() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (!pending_.empty()) WritePending();
+  cv_.wait(lock, [this]() { return in_flight_ == 0; });
 }
 
-void TrainingDataWriter::Finalize() {
-  gzclose(fout_);
-  fout_ = nullptr;
+void AsyncTrainingDataWriter::WritePending() {
+  auto games = std::make_shared<std::vector<Game>>();
+  games->swap(pending_);
+  ++in_flight_;
+  pool_.Add([this, games]() {
+    std::string filename;
+    try {
+      std::string records;
+      CompactTrainingEncoder encoder;
+      for (const auto& game : *games) {
+        for (const auto& chunk : game.chunks) {
+          if (compact_) {
+            encoder.Encode(chunk, &records);
+          } else {
+            Append(chunk, &records);
+          }
+        }
+      }
+      filename = sink_->Write(games->front().game_id,
+                              GzipCompress(records, compression_level_));
+    } catch (const Exception& e) {
+      CERR << e.what();
+    }
+    // Games that couldn't be written are reported with no file.
+    for (const auto& game : *games) game.done(filename);
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      --in_flight_;
+    }
+    cv_.notify_all();
+  });
 }
 
 }  // namespace lczero
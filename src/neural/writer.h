@@ -26,8 +26,15 @@
 */
 
 #include <zlib.h>
+#include <condition_variable>
 #include <fstream>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
 #include "utils/cppattributes.h"
+#include "utils/threadpool.h"
 
 #pragma once
 
@@ -54,30 +61,139 @@ struct V4TrainingData {
 } PACKED_STRUCT;
 static_assert(sizeof(V4TrainingData) == 8292, "Wrong struct size");
 
+// Start of a record in the compact format. It's followed by @policy_size
+// pairs of uint16 move index and fp16 probability (the legal moves), then by
+// the planes whose bit is set in @stored_planes. The other planes are the
+// ones the previous record predicts: the boards it had, one step older and
+// from the other side's point of view, and an empty newest board.
+struct CompactTrainingHeader {
+  uint32_t version;
+  uint16_t policy_size;
+  uint8_t stored_planes[13];
+  uint8_t castling_us_ooo;
+  uint8_t castling_us_oo;
+  uint8_t castling_them_ooo;
+  uint8_t castling_them_oo;
+  uint8_t side_to_move;
+  uint8_t rule50_count;
+  uint8_t move_count;
+  int8_t result;
+  float root_q;
+  float best_q;
+  float root_d;
+  float best_d;
+} PACKED_STRUCT;
+
 #pragma pack(pop)
 
-class TrainingDataWriter {
+const uint32_t kCompactTrainingVersion = 5;
+
+// Turns V4 records into compact ones. Every record is encoded against the
+// previous one, so they have to be decoded in the same order.
+class CompactTrainingEncoder {
+ public:
+  // Appends the compact record of @data to @out.
+  void Encode(const V4TrainingData& data, std::string* out);
+
+ private:
+  uint64_t planes_[104] = {};
+};
+
+// Turns compact records back into V4 ones, with probabilities rounded to
+// fp16.
+class CompactTrainingDecoder {
+ public:
+  // Decodes the record at the start of the @size bytes at @in. Returns the
+  // size of the record, or 0 if @in doesn't start with a whole record.
+  size_t Decode(const char* in, size_t size, V4TrainingData* data);
+
+ private:
+  uint64_t planes_[104] = {};
+};
+
+// Converts the compact training data file @input to a V4 file @output, both
+// gzipped. Throws if @input is not a valid compact file.
+void ConvertCompactTrainingData(const std::string& input,
+                                const std::string& output);
+
+// Where the gzipped training data files go. Write() may be called from
+// several threads at once.
+class TrainingDataSink {
  public:
-  // Creates a new file to write in data directory. It will has @game_id
-  // somewhere in the filename.
-  TrainingDataWriter(int game_id);
+  virtual ~TrainingDataSink() = default;
+  // Stores @data, a file whose first game is @game_id. Returns the name the
+  // games of that file are reported with, empty if there is none.
+  virtual std::string Write(int game_id, const std::string& data) = 0;
+};
 
-  ~TrainingDataWriter() {
-    if (fout_) Finalize();
-  }
+// Writes every file to the data directory next to the binary, with @game_id
+// in its name.
+class FileTrainingDataSink : public TrainingDataSink {
+ public:
+  std::string Write(int game_id, const std::string& data) override;
+};
+
+// Writes all files to a single file or named pipe @path, opened on the first
+// write. Every file is preceded by a 16 bytes header: the magic "Lc0T", the
+// id of its first game as uint32 and its size as uint64, little endian.
+class StreamTrainingDataSink : public TrainingDataSink {
+ public:
+  StreamTrainingDataSink(const std::string& path) : path_(path) {}
+  std::string Write(int game_id, const std::string& data) override;
+
+ private:
+  const std::string path_;
+  std::mutex mutex_;
+  std::ofstream stream_;
+};
+
+// Returns @data gzipped at @compression_level, from 1 to 9 or -1 for zlib's
+// default.
+std::string GzipCompress(const std::string& data, int compression_level);
+
+// Compresses the training data of finished games on background threads, so
+// that the games don't wait for it, and hands the files to @sink. Every file
+// holds @games_per_file games, and files are compressed in parallel on up to
+// @threads threads. With @compact, records are in the compact format.
+class AsyncTrainingDataWriter {
+ public:
+  // Called with the name the sink gave to the file holding the game, once
+  // it's written.
+  using Callback = std::function<void(const std::string& filename)>;
 
-  // Writes a chunk.
-  void WriteChunk(const V4TrainingData& data);
+  AsyncTrainingDataWriter(std::unique_ptr<TrainingDataSink> sink,
+                          int games_per_file, int compression_level,
+                          int threads, bool compact = false);
+  // Writes the games still pending.
+  ~AsyncTrainingDataWriter() { Flush(); }
 
-  // Flushes file and closes it.
-  void Finalize();
+  // Queues @chunks of game @game_id. @done is called from a background
+  // thread.
+  void Write(int game_id, std::vector<V4TrainingData> chunks, Callback done);
 
-  // Gets full filename of the file written.
-  std::string GetFileName() const { return filename_; }
+  // Writes the games still pending, and waits until all files are complete.
+  void Flush();
 
  private:
-  std::string filename_;
-  gzFile fout_;
+  struct Game {
+    int game_id;
+    std::vector<V4TrainingData> chunks;
+    Callback done;
+  };
+  // Starts writing the pending games to a file. Requires mutex_ to be held.
+  void WritePending();
+
+  const std::unique_ptr<TrainingDataSink> sink_;
+  const size_t games_per_file_;
+  const int compression_level_;
+  const bool compact_;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::vector<Game> pending_;
+  // Files being written.
+  int in_flight_ = 0;
+  // Last member, so that its threads are joined first.
+  ThreadPool pool_;
 };
 
 }  // namespace lczero
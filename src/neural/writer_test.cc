@@ -0,0 +1,99 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2019 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <gtest/gtest.h>
+
+#include <cstring>
+#include "src/neural/encoder.h"
+#include "src/neural/writer.h"
+
+namespace lczero {
+
+// Records of the first plies of a game, with made up policies.
+std::vector<V4TrainingData> MakeGame(int plies) {
+  ChessBoard board;
+  board.SetFromFen(ChessBoard::kStartposFen);
+  PositionHistory history;
+  history.Reset(board, 0, 1);
+  std::vector<V4TrainingData> game;
+  for (int ply = 0; ply < plies; ++ply) {
+    V4TrainingData data;
+    std::memset(&data, 0, sizeof(data));
+    data.version = 4;
+    const auto moves = history.Last().GetBoard().GenerateLegalMoves();
+    std::memset(data.probabilities, -1, sizeof(data.probabilities));
+    for (const auto& move : moves) {
+      data.probabilities[move.as_nn_index()] = 1.0f / moves.size();
+    }
+    const auto planes =
+        EncodePositionForNN(history, 8, FillEmptyHistory::FEN_ONLY);
+    for (int i = 0; i < 104; ++i) data.planes[i] = planes[i].mask;
+    data.side_to_move = ply % 2;
+    data.result = ply % 2 ? -1 : 1;
+    data.root_q = 0.1f * ply;
+    game.push_back(data);
+    history.Append(moves[ply % moves.size()]);
+  }
+  return game;
+}
+
+TEST(CompactTrainingData, RoundTrip) {
+  const auto game = MakeGame(20);
+  CompactTrainingEncoder encoder;
+  std::string compact;
+  for (const auto& data : game) encoder.Encode(data, &compact);
+  // Each record keeps little more than its newest board and its policy.
+  EXPECT_LT(compact.size(), game.size() * 400);
+
+  CompactTrainingDecoder decoder;
+  size_t pos = 0;
+  for (const auto& expected : game) {
+    V4TrainingData data;
+    const size_t size =
+        decoder.Decode(compact.data() + pos, compact.size() - pos, &data);
+    ASSERT_GT(size, 0u);
+    pos += size;
+    EXPECT_EQ(0, std::memcmp(data.planes, expected.planes,
+                             sizeof(data.planes)));
+    for (int i = 0; i < 1858; ++i) {
+      uint32_t bits;
+      std::memcpy(&bits, &expected.probabilities[i], sizeof(bits));
+      if (bits == 0xFFFFFFFF) {
+        std::memcpy(&bits, &data.probabilities[i], sizeof(bits));
+        EXPECT_EQ(bits, 0xFFFFFFFF);
+      } else {
+        EXPECT_NEAR(data.probabilities[i], expected.probabilities[i], 1e-3);
+      }
+    }
+    EXPECT_EQ(data.version, 4u);
+    EXPECT_EQ(data.side_to_move, expected.side_to_move);
+    EXPECT_EQ(data.result, expected.result);
+    EXPECT_EQ(data.root_q, expected.root_q);
+  }
+  EXPECT_EQ(pos, compact.size());
+  V4TrainingData data;
+  EXPECT_EQ(decoder.Decode(compact.data(), 10, &data), 0u);
+}
+
+}  // namespace lczero
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  lczero::InitializeMagicBitboards();
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,60 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2019 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+
+  If you modify this Program, or any covered work, by linking or
+  combining it with NVIDIA Corporation's libraries from the NVIDIA CUDA
+  Toolkit and the NVIDIA CUDA Deep Neural Network library (or a
+  modified version of those libraries), containing parts covered by the
+  terms of the respective license agreement, the licensors of this
+  Program grant you additional permission to convey the resulting work.
+*/
+
+#include "selfplay/converter.h"
+
+#include <iostream>
+#include "neural/writer.h"
+#include "utils/exception.h"
+#include "utils/optionsparser.h"
+
+namespace lczero {
+namespace {
+const OptionId kInputId{"input", "", "Compact training data file to read."};
+const OptionId kOutputId{"output", "", "V4 training data file to write."};
+}  // namespace
+
+void TrainingDataConverter::Run() {
+  OptionsParser options;
+  options.Add<StringOption>(kInputId);
+  options.Add<StringOption>(kOutputId);
+  if (!options.ProcessAllFlags()) return;
+
+  try {
+    const auto option_dict = options.GetOptionsDict();
+    const auto input = option_dict.Get<std::string>(kInputId.GetId());
+    const auto output = option_dict.Get<std::string>(kOutputId.GetId());
+    if (input.empty() || output.empty()) {
+      throw Exception("Both --input and --output are needed.");
+    }
+    ConvertCompactTrainingData(input, output);
+  } catch (Exception& ex) {
+    std::cerr << ex.what() << std::endl;
+  }
+}
+
+}  // namespace lczero
@@ -27,8 +27,10 @@
 
 #include "selfplay/game.h"
 #include <algorithm>
+#include <thread>
 
 #include "neural/writer.h"
+#include "utils/random.h"
 
 namespace lczero {
 
@@ -45,6 +47,54 @@ const OptionId kResignWDLStyleId{
 const OptionId kResignEarliestMoveId{"resign-earliest-move",
                                      "ResignEarliestMove",
                                      "Earliest move that resign is allowed."};
+const OptionId kFastSearchProbabilityId{
+    "fast-search-probability", "FastSearchProbability",
+    "Probability that a move gets only a fast search, of --fast-search-visits "
+    "visits and without noise, which doesn't go into the training data."};
+const OptionId kFastSearchVisitsId{
+    "fast-search-visits", "FastSearchVisits",
+    "Visits of the fast searches of --fast-search-probability, including "
+    "those kept from the tree of the previous move."};
+const OptionId kSyzygyAdjudicateId{
+    "syzygy-adjudicate", "SyzygyAdjudicate",
+    "Ends games as soon as they reach a tablebase position, with the result "
+    "from the tablebases."};
+const OptionId kPonderVisitsId{
+    "ponder-visits", "PonderVisits",
+    "When the players have trees of their own, the side not to move searches "
+    "its tree on the opponent's time, up to that many visits and as a "
+    "background computation. The visits under the move played are kept for "
+    "its own search, even without ReuseTree. 0 to not ponder."};
+const OptionId kSyzygyRecordEndgameId{
+    "syzygy-record-endgame", "SyzygyRecordEndgame",
+    "Still plays games adjudicated by the tablebases to the end, for their "
+    "training data, but with the result from the tablebases."};
+
+// Returns the result of the game if its last position is in the tablebases,
+// UNDECIDED otherwise.
+GameResult ProbeTablebase(SyzygyTablebase* tb, const PositionHistory& history) {
+  const Position& position = history.Last();
+  const ChessBoard& board = position.GetBoard();
+  // The result may be wrong with castling rights, and may not account for the
+  // 50-move rule without a fresh counter.
+  if (!board.castlings().no_legal_castle() ||
+      position.GetNoCaptureNoPawnPly() != 0 ||
+      (board.ours() | board.theirs()).count() > tb->max_cardinality()) {
+    return GameResult::UNDECIDED;
+  }
+  ProbeState state;
+  const WDLScore wdl = tb->probe_wdl(position, &state);
+  if (state == FAIL) return GameResult::UNDECIDED;
+  const bool black_to_move = position.IsBlackToMove();
+  if (wdl == WDL_WIN) {
+    return black_to_move ? GameResult::BLACK_WON : GameResult::WHITE_WON;
+  }
+  if (wdl == WDL_LOSS) {
+    return black_to_move ? GameResult::WHITE_WON : GameResult::BLACK_WON;
+  }
+  // Cursed wins and blessed losses count as draws.
+  return GameResult::DRAW;
+}
 }  // namespace
 
 void SelfPlayGame::PopulateUciParams(OptionsParser* options) {
@@ -52,110 +102,214 @@ void SelfPlayGame::PopulateUciParams(OptionsParser* options) {
   options->Add<BoolOption>(kResignWDLStyleId) = false;
   options->Add<FloatOption>(kResignPercentageId, 0.0f, 100.0f) = 0.0f;
   options->Add<IntOption>(kResignEarliestMoveId, 0, 1000) = 0;
+  options->Add<FloatOption>(kFastSearchProbabilityId, 0.0f, 1.0f) = 0.0f;
+  options->Add<IntOption>(kFastSearchVisitsId, 1, 999999999) = 100;
+  options->Add<BoolOption>(kSyzygyAdjudicateId) = true;
+  options->Add<BoolOption>(kSyzygyRecordEndgameId) = false;
+  options->Add<IntOption>(kPonderVisitsId, 0, 999999999) = 0;
 }
 
 SelfPlayGame::SelfPlayGame(PlayerOptions player1, PlayerOptions player2,
-                           bool shared_tree)
+                           bool shared_tree, const Opening& opening)
     : options_{player1, player2} {
   tree_[0] = std::make_shared<NodeTree>();
-  tree_[0]->ResetToPosition(ChessBoard::kStartposFen, {});
+  tree_[0]->ResetToPosition(opening.start_fen, opening.moves);
 
   if (shared_tree) {
     tree_[1] = tree_[0];
   } else {
     tree_[1] = std::make_shared<NodeTree>();
-    tree_[1]->ResetToPosition(ChessBoard::kStartposFen, {});
+    tree_[1]->ResetToPosition(opening.start_fen, opening.moves);
   }
+  blacks_move_ = tree_[0]->IsBlackToMove();
 }
 
 void SelfPlayGame::Play(int white_threads, int black_threads, bool training,
                         bool enable_resign) {
-  bool blacks_move = false;
-
   // Do moves while not end of the game. (And while not abort_)
-  while (!abort_) {
-    game_result_ = tree_[0]->GetPositionHistory().ComputeGameResult();
-
-    // If endgame, stop.
-    if (game_result_ != GameResult::UNDECIDED) break;
-
-    // Initialize search.
-    const int idx = blacks_move ? 1 : 0;
-    if (!options_[idx].uci_options->Get<bool>(kReuseTreeId.GetId())) {
-      tree_[idx]->TrimTreeAtHead();
-    }
-    if (options_[idx].search_limits.movetime > -1) {
-      options_[idx].search_limits.search_deadline =
-          std::chrono::steady_clock::now() +
-          std::chrono::milliseconds(options_[idx].search_limits.movetime);
+  while (StartMove()) {
+    std::thread ponder_thread;
+    if (StartPonder()) {
+      const int threads = blacks_move_ ? white_threads : black_threads;
+      ponder_thread = std::thread([this, threads]() {
+        ponder_threads_.RunBlocking(ponder_.get(), threads);
+      });
     }
-    {
+    // Do search.
+    search_threads_.RunBlocking(search_.get(),
+                                blacks_move_ ? black_threads : white_threads);
+    if (ponder_thread.joinable()) {
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        ponder_->Abort();
+      }
+      ponder_thread.join();
       std::lock_guard<std::mutex> lock(mutex_);
-      if (abort_) break;
-      search_ = std::make_unique<Search>(
-          *tree_[idx], options_[idx].network, options_[idx].best_move_callback,
-          options_[idx].info_callback, options_[idx].search_limits,
-          *options_[idx].uci_options, options_[idx].cache, nullptr);
-      // TODO: add Syzygy option for selfplay.
+      ponder_.reset();
     }
+    if (!FinishMove(training, enable_resign)) break;
+  }
+}
 
-    // Do search.
-    search_->RunBlocking(blacks_move ? black_threads : white_threads);
-    if (abort_) break;
+bool SelfPlayGame::StartMove() {
+  if (abort_) return false;
+  game_result_ = tree_[0]->GetPositionHistory().ComputeGameResult();
 
-    auto best_eval = search_->GetBestEval();
-    if (training) {
-      // Append training data. The GameResult is later overwritten.
-      auto best_q = best_eval.first;
-      auto best_d = best_eval.second;
-      training_data_.push_back(tree_[idx]->GetCurrentHead()->GetV4TrainingData(
-          GameResult::UNDECIDED, tree_[idx]->GetPositionHistory(),
-          search_->GetParams().GetHistoryFill(), best_q, best_d));
+  // If endgame, stop.
+  if (game_result_ != GameResult::UNDECIDED) return false;
+
+  const int idx = blacks_move_ ? 1 : 0;
+  if (options_[idx].syzygy_tb && tb_result_ == GameResult::UNDECIDED &&
+      options_[idx].uci_options->Get<bool>(kSyzygyAdjudicateId.GetId())) {
+    tb_result_ = ProbeTablebase(options_[idx].syzygy_tb,
+                                tree_[0]->GetPositionHistory());
+    if (tb_result_ != GameResult::UNDECIDED &&
+        !options_[idx].uci_options->Get<bool>(
+            kSyzygyRecordEndgameId.GetId())) {
+      return false;
     }
+  }
 
-    float eval = best_eval.first;
-    eval = (eval + 1) / 2;
-    if (eval < min_eval_[idx]) min_eval_[idx] = eval;
-    const int move_number = tree_[0]->GetPositionHistory().GetLength() / 2 + 1;
-    if (enable_resign && move_number >= options_[idx].uci_options->Get<int>(
-                                            kResignEarliestMoveId.GetId())) {
-      const float resignpct =
-          options_[idx].uci_options->Get<float>(kResignPercentageId.GetId()) /
-          100;
-      if (options_[idx].uci_options->Get<bool>(kResignWDLStyleId.GetId())) {
-        auto best_w = (best_eval.first + 1.0f - best_eval.second) / 2.0f;
-        auto best_d = best_eval.second;
-        auto best_l = best_w - best_eval.first;
-        auto threshold = 1.0f - resignpct;
-        if (best_w > threshold) {
-          game_result_ =
-              blacks_move ? GameResult::BLACK_WON : GameResult::WHITE_WON;
-          break;
-        }
-        if (best_l > threshold) {
-          game_result_ =
-              blacks_move ? GameResult::WHITE_WON : GameResult::BLACK_WON;
-          break;
-        }
-        if (best_d > threshold) {
-          game_result_ = GameResult::DRAW;
-          break;
-        }
-      } else {
-        if (eval < resignpct) {  // always false when resignpct == 0
-          game_result_ =
-              blacks_move ? GameResult::WHITE_WON : GameResult::BLACK_WON;
-          break;
-        }
+  // Initialize search. The tree was trimmed before pondering, if at all.
+  if (!options_[idx].uci_options->Get<bool>(kReuseTreeId.GetId()) &&
+      !pondered_[idx]) {
+    tree_[idx]->TrimTreeAtHead();
+  }
+  // Pondered visits don't count against the visits of the move.
+  const bool pondered = pondered_[idx];
+  int64_t pondered_visits = 0;
+  if (pondered) {
+    const Node* head = tree_[idx]->GetCurrentHead();
+    pondered_visits = head->GetN();
+    for (const auto& entry : visits_before_ponder_) {
+      if (entry.first == head) {
+        pondered_visits -= std::min<int64_t>(entry.second, pondered_visits);
       }
     }
+  }
+  pondered_[idx] = false;
+  if (options_[idx].search_limits.movetime > -1) {
+    options_[idx].search_limits.search_deadline =
+        std::chrono::steady_clock::now() +
+        std::chrono::milliseconds(options_[idx].search_limits.movetime);
+  }
+  SearchLimits limits = options_[idx].search_limits;
+  const OptionsDict* uci_options = options_[idx].uci_options;
+  fast_search_ =
+      Random::Get().GetFloat(1.0f) <
+      uci_options->Get<float>(kFastSearchProbabilityId.GetId());
+  if (fast_search_) {
+    limits.visits = uci_options->Get<int>(kFastSearchVisitsId.GetId());
+    limits.playouts = -1;
+    if (!fast_options_[idx]) {
+      fast_options_[idx] = std::make_unique<OptionsDict>(uci_options);
+      fast_options_[idx]->Set<bool>(SearchParams::kNoiseId.GetId(), false);
+    }
+    uci_options = fast_options_[idx].get();
+    ++fast_searches_;
+  } else {
+    ++full_searches_;
+  }
+  if (limits.visits >= 0) limits.visits += pondered_visits;
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (abort_) return false;
+  search_ = std::make_unique<Search>(
+      *tree_[idx], options_[idx].network, options_[idx].best_move_callback,
+      options_[idx].info_callback, limits, *uci_options, options_[idx].cache,
+      options_[idx].syzygy_tb);
+  // The root may have been expanded by pondering, which has no noise.
+  if (pondered) search_->ApplyRootNoise();
+  return true;
+}
+
+bool SelfPlayGame::StartPonder() {
+  const int idx = blacks_move_ ? 0 : 1;
+  if (tree_[0] == tree_[1]) return false;
+  const OptionsDict* uci_options = options_[idx].uci_options;
+  const int visits = uci_options->Get<int>(kPonderVisitsId.GetId());
+  if (visits == 0) return false;
+  if (!uci_options->Get<bool>(kReuseTreeId.GetId())) {
+    tree_[idx]->TrimTreeAtHead();
+  }
+  visits_before_ponder_.clear();
+  for (const Node* child : tree_[idx]->GetCurrentHead()->ChildNodes()) {
+    visits_before_ponder_.emplace_back(child, child->GetN());
+  }
+  if (!ponder_options_[idx]) {
+    ponder_options_[idx] = std::make_unique<OptionsDict>(uci_options);
+    ponder_options_[idx]->Set<bool>(SearchParams::kNoiseId.GetId(), false);
+  }
+  SearchLimits limits;
+  limits.visits = visits;
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (abort_) return false;
+  ponder_ = std::make_unique<Search>(
+      *tree_[idx], options_[idx].network, [](const BestMoveInfo&) {},
+      [](const std::vector<ThinkingInfo>&) {}, limits, *ponder_options_[idx],
+      options_[idx].cache, options_[idx].syzygy_tb);
+  // Behind the searches of moves being played, including those of other
+  // games sharing the network.
+  ponder_->SetComputationPriority(ComputationPriority::kBackground);
+  pondered_[idx] = true;
+  return true;
+}
 
-    // Add best move to the tree.
-    const Move move = search_->GetBestMove().first;
-    tree_[0]->MakeMove(move);
-    if (tree_[0] != tree_[1]) tree_[1]->MakeMove(move);
-    blacks_move = !blacks_move;
+bool SelfPlayGame::FinishMove(bool training, bool enable_resign) {
+  if (abort_) return false;
+  const int idx = blacks_move_ ? 1 : 0;
+  auto best_eval = search_->GetBestEval();
+  if (training && !fast_search_) {
+    // Append training data. The GameResult is later overwritten.
+    auto best_q = best_eval.first;
+    auto best_d = best_eval.second;
+    training_data_.push_back(tree_[idx]->GetCurrentHead()->GetV4TrainingData(
+        GameResult::UNDECIDED, tree_[idx]->GetPositionHistory(),
+        search_->GetParams().GetHistoryFill(), best_q, best_d));
   }
+
+  float eval = best_eval.first;
+  eval = (eval + 1) / 2;
+  if (eval < min_eval_[idx]) min_eval_[idx] = eval;
+  const int move_number = tree_[0]->GetPositionHistory().GetLength() / 2 + 1;
+  if (enable_resign && move_number >= options_[idx].uci_options->Get<int>(
+                                          kResignEarliestMoveId.GetId())) {
+    const float resignpct =
+        options_[idx].uci_options->Get<float>(kResignPercentageId.GetId()) /
+        100;
+    if (options_[idx].uci_options->Get<bool>(kResignWDLStyleId.GetId())) {
+      auto best_w = (best_eval.first + 1.0f - best_eval.second) / 2.0f;
+      auto best_d = best_eval.second;
+      auto best_l = best_w - best_eval.first;
+      auto threshold = 1.0f - resignpct;
+      if (best_w > threshold) {
+        game_result_ =
+            blacks_move_ ? GameResult::BLACK_WON : GameResult::WHITE_WON;
+        return false;
+      }
+      if (best_l > threshold) {
+        game_result_ =
+            blacks_move_ ? GameResult::WHITE_WON : GameResult::BLACK_WON;
+        return false;
+      }
+      if (best_d > threshold) {
+        game_result_ = GameResult::DRAW;
+        return false;
+      }
+    } else {
+      if (eval < resignpct) {  // always false when resignpct == 0
+        game_result_ =
+            blacks_move_ ? GameResult::WHITE_WON : GameResult::BLACK_WON;
+        return false;
+      }
+    }
+  }
+
+  // Add best move to the tree.
+  const Move move = search_->GetBestMove().first;
+  tree_[0]->MakeMove(move);
+  if (tree_[0] != tree_[1]) tree_[1]->MakeMove(move);
+  blacks_move_ = !blacks_move_;
+  return true;
 }
 
 std::vector<Move> SelfPlayGame::GetMoves() const {
@@ -171,8 +325,8 @@ std::vector<Move> SelfPlayGame::GetMoves() const {
 }
 
 float SelfPlayGame::GetWorstEvalForWinnerOrDraw() const {
-  if (game_result_ == GameResult::WHITE_WON) return min_eval_[0];
-  if (game_result_ == GameResult::BLACK_WON) return min_eval_[1];
+  if (GetGameResult() == GameResult::WHITE_WON) return min_eval_[0];
+  if (GetGameResult() == GameResult::BLACK_WON) return min_eval_[1];
   return std::min(min_eval_[0], min_eval_[1]);
 }
 
@@ -180,23 +334,24 @@ void SelfPlayGame::Abort() {
   std::lock_guard<std::mutex> lock(mutex_);
   abort_ = true;
   if (search_) search_->Abort();
+  if (ponder_) ponder_->Abort();
 }
 
-void SelfPlayGame::WriteTrainingData(TrainingDataWriter* writer) const {
-  assert(!training_data_.empty());
+std::vector<V4TrainingData> SelfPlayGame::GetTrainingData() const {
+  std::vector<V4TrainingData> chunks(training_data_);
   bool black_to_move =
       tree_[0]->GetPositionHistory().Starting().IsBlackToMove();
-  for (auto chunk : training_data_) {
-    if (game_result_ == GameResult::WHITE_WON) {
+  for (auto& chunk : chunks) {
+    if (GetGameResult() == GameResult::WHITE_WON) {
       chunk.result = black_to_move ? -1 : 1;
-    } else if (game_result_ == GameResult::BLACK_WON) {
+    } else if (GetGameResult() == GameResult::BLACK_WON) {
       chunk.result = black_to_move ? 1 : -1;
     } else {
       chunk.result = 0;
     }
-    writer->WriteChunk(chunk);
     black_to_move = !black_to_move;
   }
+  return chunks;
 }
 
 }  // namespace lczero
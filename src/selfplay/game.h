@@ -32,6 +32,8 @@
 #include "mcts/search.h"
 #include "neural/cache.h"
 #include "neural/network.h"
+#include "selfplay/openings.h"
+#include "syzygy/syzygy.h"
 #include "utils/optionsparser.h"
 
 namespace lczero {
@@ -54,6 +56,8 @@ struct PlayerOptions {
   const OptionsDict* uci_options;
   // Limits to use for every move.
   SelfPlayLimits search_limits;
+  // Tablebases to search with and adjudicate games, may be null.
+  SyzygyTablebase* syzygy_tb = nullptr;
 };
 
 // Plays a single game vs itself.
@@ -63,22 +67,46 @@ class SelfPlayGame {
   // If shared_tree is true, search tree is reused between players.
   // (useful for training games). Otherwise the tree is separate for black
   // and white (useful i.e. when they use different networks).
-  SelfPlayGame(PlayerOptions player1, PlayerOptions player2, bool shared_tree);
+  // The game starts from @opening.
+  SelfPlayGame(PlayerOptions player1, PlayerOptions player2, bool shared_tree,
+               const Opening& opening = Opening());
 
   // Populate command line options that it uses.
   static void PopulateUciParams(OptionsParser* options);
 
-  // Starts the game and blocks until the game is finished.
+  // Starts the game and blocks until the game is finished. The side not to
+  // move ponders with its thread count, see PonderVisits.
   void Play(int white_threads, int black_threads, bool training,
             bool enable_resign = true);
+  // The steps of Play(), for callers which run the searches themselves.
+  // Sets up the search of the next move, returns false if the game is over.
+  bool StartMove();
+  // Plays the move found by the search, returns false if the game ended.
+  bool FinishMove(bool training, bool enable_resign);
+  // After StartMove(), sets up the search of the side not to move on its own
+  // tree, if it ponders. Returns whether it does.
+  bool StartPonder();
+  // Search of the move being played, set by StartMove().
+  Search* GetSearch() const { return search_.get(); }
+  // Network of the side to move.
+  Network* GetNetwork() const {
+    return options_[blacks_move_ ? 1 : 0].network;
+  }
   // Aborts the game currently played, doesn't matter if it's synchronous or
   // not.
   void Abort();
 
-  // Writes training data to a file.
-  void WriteTrainingData(TrainingDataWriter* writer) const;
-
-  GameResult GetGameResult() const { return game_result_; }
+  // Returns the training data of the game, with the game result filled in.
+  // Empty if all moves had fast searches.
+  std::vector<V4TrainingData> GetTrainingData() const;
+  // Number of moves searched with full and fast searches.
+  int GetFullSearches() const { return full_searches_; }
+  int GetFastSearches() const { return fast_searches_; }
+
+  // The result from the tablebases, if the game reached them.
+  GameResult GetGameResult() const {
+    return tb_result_ != GameResult::UNDECIDED ? tb_result_ : game_result_;
+  }
   std::vector<Move> GetMoves() const;
   // Gets the eval which required the biggest swing up to get the final outcome.
   // Eval is the expected outcome in the range 0<->1.
@@ -91,14 +119,36 @@ class SelfPlayGame {
   // tree_[0] == tree_[1].
   std::shared_ptr<NodeTree> tree_[2];
 
+  // Threads running the searches of all moves of the game.
+  SearchThreads search_threads_;
   // Search that is currently in progress. Stored in members so that Abort()
   // can stop it.
   std::unique_ptr<Search> search_;
+  // Threads and search of the side not to move, while it ponders.
+  SearchThreads ponder_threads_;
+  std::unique_ptr<Search> ponder_;
+  // Options of pondering searches of either player, made on first use.
+  std::unique_ptr<OptionsDict> ponder_options_[2];
+  // Whether the player pondered since its last move.
+  bool pondered_[2] = {false, false};
+  // Visits of the children of the pondering player's head when pondering
+  // started, to tell the visits pondered from those of earlier searches.
+  std::vector<std::pair<const Node*, uint32_t>> visits_before_ponder_;
+  // Whether search_ is a fast search, see FastSearchProbability.
+  bool fast_search_ = false;
+  int full_searches_ = 0;
+  int fast_searches_ = 0;
+  // Options of fast searches of either player, made on first use.
+  std::unique_ptr<OptionsDict> fast_options_[2];
+  bool blacks_move_ = false;
   bool abort_ = false;
   GameResult game_result_ = GameResult::UNDECIDED;
   // Track minimum eval for each player so that GetWorstEvalForWinnerOrDraw()
   // can be calculated after end of game.
   float min_eval_[2] = {1.0f, 1.0f};
+  // Result given by the tablebases to a game still played to its end, see
+  // SyzygyRecordEndgame.
+  GameResult tb_result_ = GameResult::UNDECIDED;
   std::mutex mutex_;
 
   // Training data to send.
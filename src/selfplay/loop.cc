@@ -26,8 +26,11 @@
 */
 
 #include "selfplay/loop.h"
+#include "selfplay/sprt.h"
 #include "selfplay/tournament.h"
 #include "utils/configfile.h"
+#include "utils/metrics.h"
+#include "utils/random.h"
 
 namespace lczero {
 
@@ -47,8 +50,12 @@ void SelfPlayLoop::RunLoop() {
   SelfPlayTournament::PopulateOptions(&options_);
 
   options_.Add<BoolOption>(kInteractiveId) = false;
+  MetricsExporter::PopulateOptions(&options_);
+  Random::PopulateOptions(&options_);
 
   if (!options_.ProcessAllFlags()) return;
+  Random::SeedFromOptions(options_.GetOptionsDict());
+  MetricsExporter metrics(options_.GetOptionsDict());
   if (options_.GetOptionsDict().Get<bool>(kInteractiveId.GetId())) {
     UciLoop::RunLoop();
   } else {
@@ -101,6 +108,10 @@ void SelfPlayLoop::SendGameInfo(const GameInfo& info) {
         " fp_threshold " + std::to_string(*info.min_false_positive_threshold);
     responses.push_back(resign_res);
   }
+  // Same for the starting position, which contains spaces too.
+  if (!info.start_fen.empty() && info.start_fen != ChessBoard::kStartposFen) {
+    responses.push_back("opening_report fen " + info.start_fen);
+  }
   std::string res = "gameready";
   if (!info.training_filename.empty())
     res += " trainingfile " + info.training_filename;
@@ -135,8 +146,8 @@ void SelfPlayLoop::SendTournament(const TournamentInfo& info) {
 
   // Initialize variables.
   float percentage = -1;
-  optional<float> elo;
-  optional<float> los;
+  float elo = 0.0f;
+  float los = 0.0f;
 
   // Only caculate percentage if any games at all (avoid divide by 0).
   if ((winp1 + losep1 + draws) > 0) {
@@ -145,9 +156,10 @@ void SelfPlayLoop::SendTournament(const TournamentInfo& info) {
   }
   // Calculate elo and los if percentage strictly between 0 and 1 (avoids divide
   // by 0 or overflow).
-  if ((percentage < 1) && (percentage > 0))
-    elo = -400 * log(1 / percentage - 1) / log(10);
-  if ((winp1 + losep1) > 0) {
+  const bool has_elo = (percentage < 1) && (percentage > 0);
+  if (has_elo) elo = -400 * log(1 / percentage - 1) / log(10);
+  const bool has_los = (winp1 + losep1) > 0;
+  if (has_los) {
     los = .5f +
           .5f * std::erf((winp1 - losep1) / std::sqrt(2.0 * (winp1 + losep1)));
   }
@@ -160,20 +172,45 @@ void SelfPlayLoop::SendTournament(const TournamentInfo& info) {
     oss << " Win: " << std::fixed << std::setw(5) << std::setprecision(2)
         << (percentage * 100.0f) << "%";
   }
-  if (elo) {
+  if (has_elo) {
     oss << " Elo: " << std::fixed << std::setw(5) << std::setprecision(2)
-        << (elo.value_or(0.0f));
+        << elo << " +/- " << EloError(winp1, draws, losep1);
   }
-  if (los) {
+  if (has_los) {
     oss << " LOS: " << std::fixed << std::setw(5) << std::setprecision(2)
-        << (los.value_or(0.0f) * 100.0f) << "%";
+        << (los * 100.0f) << "%";
   }
 
   oss << " P1-W: +" << info.results[0][0] << " -" << info.results[2][0] << " ="
       << info.results[1][0];
   oss << " P1-B: +" << info.results[0][1] << " -" << info.results[2][1] << " ="
       << info.results[1][1];
+  if (info.fast_searches > 0) {
+    oss << " Searches: full " << info.full_searches << " fast "
+        << info.fast_searches;
+  }
+  oss << " Games/h: " << std::fixed << std::setprecision(1)
+      << info.games_per_hour;
+  if (info.sprt) {
+    oss << " LLR: " << std::fixed << std::setprecision(2) << info.llr << " ("
+        << info.llr_lower << ", " << info.llr_upper << ")";
+    if (info.sprt_result > 0) oss << " H1 accepted";
+    if (info.sprt_result < 0) oss << " H0 accepted";
+  }
   SendResponse(oss.str());
+
+  if (info.finished) {
+    std::ostringstream cache_oss;
+    cache_oss << "cachestatus";
+    for (int idx : {0, 1}) {
+      const int64_t lookups = info.cache_lookups[idx];
+      cache_oss << " P" << idx + 1 << ": hits " << info.cache_hits[idx] << "/"
+                << lookups << " (" << std::fixed << std::setprecision(2)
+                << info.cache_hits[idx] * 100.0 / std::max<int64_t>(lookups, 1)
+                << "%) opening " << info.cache_opening_hits[idx];
+    }
+    SendResponse(cache_oss.str());
+  }
 }
 
 }  // namespace lczero
@@ -0,0 +1,312 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2019 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+
+  If you modify this Program, or any covered work, by linking or
+  combining it with NVIDIA Corporation's libraries from the NVIDIA CUDA
+  Toolkit and the NVIDIA CUDA Deep Neural Network library (or a
+  modified version of those libraries), containing parts covered by the
+  terms of the respective license agreement, the licensors of this
+  Program grant you additional permission to convey the resulting work.
+*/
+
+#include "selfplay/openings.h"
+
+#include <algorithm>
+#include <cctype>
+#include <sstream>
+#include "utils/exception.h"
+#include "utils/logging.h"
+
+namespace lczero {
+namespace {
+bool IsNumber(const std::string& str) {
+  if (str.empty()) return false;
+  for (char c : str) {
+    if (!std::isdigit(static_cast<unsigned char>(c))) return false;
+  }
+  return true;
+}
+
+bool IsResult(const std::string& token) {
+  return token == "1-0" || token == "0-1" || token == "1/2-1/2" ||
+         token == "*";
+}
+
+Move::Promotion ParsePromotion(char c) {
+  switch (c) {
+    case 'Q':
+      return Move::Promotion::Queen;
+    case 'R':
+      return Move::Promotion::Rook;
+    case 'B':
+      return Move::Promotion::Bishop;
+    case 'N':
+      return Move::Promotion::Knight;
+    default:
+      return Move::Promotion::None;
+  }
+}
+}  // namespace
+
+Move ParseSanMove(const ChessBoard& board, const std::string& san) {
+  std::string str = san;
+  // Check, mate and annotation suffixes.
+  while (!str.empty() && std::string("+#!?").find(str.back()) !=
+                             std::string::npos) {
+    str.pop_back();
+  }
+  const auto legal_moves = board.GenerateLegalMoves();
+  if (str == "O-O" || str == "0-0" || str == "O-O-O" || str == "0-0-0") {
+    const int col = str.size() == 3 ? 6 : 2;
+    for (const auto& move : legal_moves) {
+      if (move.castling() && move.to().col() == col) return move;
+    }
+    throw Exception("Illegal move: " + san);
+  }
+
+  char piece = 'P';
+  if (!str.empty() && std::string("NBRQK").find(str[0]) != std::string::npos) {
+    piece = str[0];
+    str.erase(0, 1);
+  }
+  auto promotion = Move::Promotion::None;
+  if (piece == 'P' && !str.empty() &&
+      ParsePromotion(str.back()) != Move::Promotion::None) {
+    promotion = ParsePromotion(str.back());
+    str.pop_back();
+    if (!str.empty() && str.back() == '=') str.pop_back();
+  }
+  // What's left is the disambiguation and the destination, captures and
+  // long algebraic notation ("Ng1-f3") aside.
+  std::string squares;
+  for (char c : str) {
+    if (c != 'x' && c != '-' && c != ':') squares += c;
+  }
+  if (squares.size() < 2 || squares.size() > 4) {
+    throw Exception("Bad move: " + san);
+  }
+  const std::string to_str = squares.substr(squares.size() - 2);
+  const std::string from_str = squares.substr(0, squares.size() - 2);
+  if (to_str[0] < 'a' || to_str[0] > 'h' || to_str[1] < '1' ||
+      to_str[1] > '8') {
+    throw Exception("Bad move: " + san);
+  }
+  const BoardSquare to(to_str, board.flipped());
+
+  BitBoard pieces;
+  switch (piece) {
+    case 'P':
+      pieces = board.pawns();
+      break;
+    case 'N':
+      pieces = board.our_knights();
+      break;
+    case 'B':
+      pieces = board.bishops();
+      break;
+    case 'R':
+      pieces = board.rooks();
+      break;
+    case 'Q':
+      pieces = board.queens();
+      break;
+    case 'K':
+      pieces = board.our_king();
+      break;
+  }
+  pieces &= board.ours();
+
+  Move result;
+  for (const auto& move : legal_moves) {
+    if (move.to() != to || !pieces.get(move.from())) continue;
+    if (move.promotion() != promotion) continue;
+    // Castling is only written as O-O.
+    if (move.castling()) continue;
+    const BoardSquare from = move.from();
+    const int rank = board.flipped() ? 8 - from.row() : from.row() + 1;
+    bool matches = true;
+    for (char c : from_str) {
+      if (c >= 'a' && c <= 'h') {
+        matches &= from.col() == c - 'a';
+      } else if (c >= '1' && c <= '8') {
+        matches &= rank == c - '0';
+      } else {
+        throw Exception("Bad move: " + san);
+      }
+    }
+    if (!matches) continue;
+    if (result) throw Exception("Ambiguous move: " + san);
+    result = move;
+  }
+  if (!result) throw Exception("Illegal move: " + san);
+  return result;
+}
+
+OpeningBook::OpeningBook(const std::string& path)
+    : path_(path),
+      pgn_(path.size() >= 4 && path.substr(path.size() - 4) == ".pgn"),
+      file_(path) {
+  if (!file_) throw Exception("Unable to open opening book " + path);
+}
+
+Opening OpeningBook::Next() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  while (true) {
+    Opening opening;
+    try {
+      if (pgn_ ? ReadPgn(&opening) : ReadEpd(&opening)) {
+        ++read_;
+        return opening;
+      }
+    } catch (Exception& e) {
+      CERR << "Skipping opening from " << path_ << ": " << e.what();
+      continue;
+    }
+    if (read_ == 0) throw Exception("No openings in " + path_);
+    // Start over.
+    read_ = 0;
+    pending_line_.clear();
+    file_.clear();
+    file_.seekg(0);
+  }
+}
+
+bool OpeningBook::GetLine(std::string* line) {
+  if (!pending_line_.empty()) {
+    line->swap(pending_line_);
+    pending_line_.clear();
+    return true;
+  }
+  if (!std::getline(file_, *line)) return false;
+  if (!line->empty() && line->back() == '\r') line->pop_back();
+  return true;
+}
+
+bool OpeningBook::ReadEpd(Opening* opening) {
+  std::string line;
+  while (GetLine(&line)) {
+    std::istringstream iss(line);
+    std::string board, side, castlings, en_passant;
+    if (!(iss >> board) || board[0] == '#') continue;
+    if (!(iss >> side >> castlings >> en_passant)) {
+      throw Exception("Bad EPD: " + line);
+    }
+    // A FEN has the move counters that EPD opcodes would follow.
+    std::string no_capture_ply, full_moves;
+    iss >> no_capture_ply >> full_moves;
+    if (!IsNumber(no_capture_ply) || !IsNumber(full_moves)) {
+      no_capture_ply = "0";
+      full_moves = "1";
+    }
+    opening->start_fen = board + " " + side + " " + castlings + " " +
+                         en_passant + " " + no_capture_ply + " " + full_moves;
+    // Throws if the position is bad.
+    ChessBoard().SetFromFen(opening->start_fen);
+    return true;
+  }
+  return false;
+}
+
+bool OpeningBook::ReadPgn(Opening* opening) {
+  std::string line;
+  bool started = false;
+  bool in_moves = false;
+  bool in_comment = false;
+  bool finished = false;
+  int variation_depth = 0;
+  ChessBoard board;
+  // Set when a move fails to parse, the rest of the game is skipped then.
+  std::string error;
+  while (!finished && GetLine(&line)) {
+    if (!in_moves) {
+      const auto first = line.find_first_not_of(" \t");
+      if (first == std::string::npos || line[first] == '%') continue;
+      started = true;
+      if (line[first] == '[') {
+        const auto quote = line.find('"');
+        const auto end = line.rfind('"');
+        if (line.compare(first, 5, "[FEN ") == 0 && quote < end) {
+          opening->start_fen = line.substr(quote + 1, end - quote - 1);
+        }
+        continue;
+      }
+      in_moves = true;
+      board.SetFromFen(opening->start_fen);
+    } else if (!in_comment && variation_depth == 0 && !line.empty() &&
+               line[0] == '[') {
+      // Next game, this one had no result.
+      pending_line_ = line;
+      break;
+    }
+
+    size_t i = 0;
+    while (i < line.size()) {
+      const char c = line[i];
+      if (in_comment) {
+        if (c == '}') in_comment = false;
+        ++i;
+      } else if (c == '{') {
+        in_comment = true;
+        ++i;
+      } else if (c == ';') {
+        break;
+      } else if (c == '(' || c == ')') {
+        variation_depth += c == '(' ? 1 : -1;
+        ++i;
+      } else if (std::isspace(static_cast<unsigned char>(c))) {
+        ++i;
+      } else {
+        const auto end = std::min(line.find_first_of(" \t{}();", i),
+                                  line.size());
+        std::string token = line.substr(i, end - i);
+        i = end;
+        if (variation_depth > 0 || token[0] == '$') continue;
+        if (IsResult(token)) {
+          finished = true;
+          break;
+        }
+        // Move number, possibly stuck to the move as in "1.e4".
+        size_t digits = 0;
+        while (digits < token.size() &&
+               std::isdigit(static_cast<unsigned char>(token[digits]))) {
+          ++digits;
+        }
+        if (digits == token.size()) continue;
+        if (digits > 0 && token[digits] == '.') {
+          token.erase(0, token.find_first_not_of('.', digits));
+        }
+        if (token.empty() || !error.empty()) continue;
+        try {
+          Move move = ParseSanMove(board, token);
+          board.ApplyMove(move);
+          board.Mirror();
+          // The board is flipped now if the move was white's.
+          if (!board.flipped()) move.Mirror();
+          opening->moves.push_back(move);
+        } catch (Exception& e) {
+          error = e.what();
+        }
+      }
+    }
+  }
+  if (!error.empty()) throw Exception(error);
+  return started;
+}
+
+}  // namespace lczero
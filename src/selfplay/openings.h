@@ -0,0 +1,80 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2019 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+
+  If you modify this Program, or any covered work, by linking or
+  combining it with NVIDIA Corporation's libraries from the NVIDIA CUDA
+  Toolkit and the NVIDIA CUDA Deep Neural Network library (or a
+  modified version of those libraries), containing parts covered by the
+  terms of the respective license agreement, the licensors of this
+  Program grant you additional permission to convey the resulting work.
+*/
+
+#pragma once
+
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "chess/board.h"
+
+namespace lczero {
+
+// Position to start a game from: a FEN and the moves played from it, seen
+// from white's side as NodeTree::ResetToPosition() expects them.
+struct Opening {
+  std::string start_fen = ChessBoard::kStartposFen;
+  std::vector<Move> moves;
+};
+
+// Parses @san, a move in standard algebraic notation like "Nbd7", "exd8=Q+"
+// or "O-O", in @board. The move is returned from the side to move's point of
+// view, like the moves of ChessBoard::GenerateLegalMoves(). Throws if it's
+// not a legal move.
+Move ParseSanMove(const ChessBoard& board, const std::string& san);
+
+// Streams openings from an EPD file, or a PGN file if its name ends with
+// ".pgn", reading one at a time so that books of any size can be used. When
+// the end of the file is reached it starts over. Entries which can't be
+// parsed are reported and skipped. Thread safe.
+class OpeningBook {
+ public:
+  OpeningBook(const std::string& path);
+
+  Opening Next();
+
+ private:
+  // Both return false at the end of the file, and throw if the entry read
+  // is malformed.
+  bool ReadEpd(Opening* opening);
+  bool ReadPgn(Opening* opening);
+  // Next line of the file, honoring the one pushed back.
+  bool GetLine(std::string* line);
+
+  const std::string path_;
+  const bool pgn_;
+  std::mutex mutex_;
+  std::ifstream file_;
+  // Tag line of the next game, read while looking for the end of a game
+  // without a result.
+  std::string pending_line_;
+  // Openings read since the file was last rewound.
+  int read_ = 0;
+};
+
+}  // namespace lczero
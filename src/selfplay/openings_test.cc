@@ -0,0 +1,112 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2019 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <gtest/gtest.h>
+#include <fstream>
+#include "src/chess/bitboard.h"
+#include "src/selfplay/openings.h"
+#include "src/utils/exception.h"
+
+namespace lczero {
+
+std::string WriteFile(const std::string& name, const std::string& contents) {
+  const std::string path = ::testing::TempDir() + name;
+  std::ofstream(path) << contents;
+  return path;
+}
+
+TEST(Openings, ParseSanMove) {
+  ChessBoard board(ChessBoard::kStartposFen);
+  EXPECT_EQ(ParseSanMove(board, "e4"), Move("e2e4"));
+  EXPECT_EQ(ParseSanMove(board, "Nf3"), Move("g1f3"));
+  EXPECT_EQ(ParseSanMove(board, "Ng1-f3!?"), Move("g1f3"));
+  EXPECT_THROW(ParseSanMove(board, "e5"), Exception);
+
+  // Black to move, moves are from black's point of view.
+  board.SetFromFen("r3k2r/8/8/8/8/8/8/R3K2R b KQkq - 0 1");
+  EXPECT_EQ(ParseSanMove(board, "O-O-O"), Move("e1c1"));
+  EXPECT_EQ(ParseSanMove(board, "Rb8"), Move("a1b1"));
+  EXPECT_EQ(ParseSanMove(board, "Rxh1+"), Move("h1h8"));
+
+  board.SetFromFen("r3k2r/1P6/8/8/8/8/8/R3K2R w KQkq - 0 1");
+  EXPECT_EQ(ParseSanMove(board, "O-O"), Move("e1g1"));
+  EXPECT_EQ(ParseSanMove(board, "bxa8=N"), Move("b7a8n"));
+  EXPECT_EQ(ParseSanMove(board, "b8Q"), Move("b7b8q"));
+  EXPECT_THROW(ParseSanMove(board, "Nc3"), Exception);
+}
+
+TEST(Openings, Epd) {
+  OpeningBook book(WriteFile("openings.epd",
+                             "# Comment\n"
+                             "rnbqkbnr/pppppppp/8/8/4P3/8/PPPP1PPP/RNBQKBNR b "
+                             "KQkq e3 bm e5; id \"1\";\n"
+                             "\n"
+                             "8/8/8/8/8/8/8/K6k w - - 10 40\n"));
+  EXPECT_EQ(book.Next().start_fen,
+            "rnbqkbnr/pppppppp/8/8/4P3/8/PPPP1PPP/RNBQKBNR b KQkq e3 0 1");
+  EXPECT_EQ(book.Next().start_fen, "8/8/8/8/8/8/8/K6k w - - 10 40");
+  // Starts over.
+  EXPECT_EQ(book.Next().start_fen,
+            "rnbqkbnr/pppppppp/8/8/4P3/8/PPPP1PPP/RNBQKBNR b KQkq e3 0 1");
+}
+
+TEST(Openings, Pgn) {
+  OpeningBook book(WriteFile(
+      "openings.pgn",
+      "[Event \"One\"]\n"
+      "[Result \"*\"]\n"
+      "\n"
+      "1. e4 {A comment\n"
+      "spanning lines} e5 (1... c5 2. Nf3) 2.Nf3 $1 Nc6 ; rest of line\n"
+      "3. Bb5 *\n"
+      "\n"
+      "[Event \"Two\"]\n"
+      "[FEN \"4k3/8/8/8/8/8/4P3/4K3 b - - 0 1\"]\n"
+      "\n"
+      "1... Kd7 2. e4\n"
+      "[Event \"Three\"]\n"
+      "\n"
+      "1. e4 e4 1-0\n"
+      "[Event \"Four\"]\n"
+      "\n"
+      "1. d4 1/2-1/2\n"));
+  auto opening = book.Next();
+  EXPECT_EQ(opening.start_fen, ChessBoard::kStartposFen);
+  ASSERT_EQ(opening.moves.size(), 5u);
+  EXPECT_EQ(opening.moves[1], Move("e7e5"));
+  EXPECT_EQ(opening.moves[4], Move("f1b5"));
+
+  // No result, ends at the next game.
+  opening = book.Next();
+  EXPECT_EQ(opening.start_fen, "4k3/8/8/8/8/8/4P3/4K3 b - - 0 1");
+  ASSERT_EQ(opening.moves.size(), 2u);
+  EXPECT_EQ(opening.moves[0], Move("e8d7"));
+
+  // The illegal third game is skipped.
+  opening = book.Next();
+  ASSERT_EQ(opening.moves.size(), 1u);
+  EXPECT_EQ(opening.moves[0], Move("d2d4"));
+}
+
+}  // namespace lczero
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  lczero::InitializeMagicBitboards();
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,388 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2019 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+
+  If you modify this Program, or any covered work, by linking or
+  combining it with NVIDIA Corporation's libraries from the NVIDIA CUDA
+  Toolkit and the NVIDIA CUDA Deep Neural Network library (or a
+  modified version of those libraries), containing parts covered by the
+  terms of the respective license agreement, the licensors of this
+  Program grant you additional permission to convey the resulting work.
+*/
+
+#include "selfplay/rescorer.h"
+
+#include <zlib.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <thread>
+#include <vector>
+#include "chess/bitboard.h"
+#include "utils/exception.h"
+#include "utils/filesystem.h"
+#include "utils/logging.h"
+#include "utils/optionsparser.h"
+
+namespace lczero {
+namespace {
+const OptionId kInputId{"input", "",
+                        "Directory of V4 or compact training data files."};
+const OptionId kOutputId{
+    "output", "",
+    "Directory to write the rescored V4 files to, with the same names. "
+    "Without it, the files are only validated."};
+const OptionId kSyzygyTablebaseId{
+    "syzygy-paths", "",
+    "List of Syzygy tablebase directories, list entries separated by system "
+    "separator (\";\" for Windows, \":\" for Linux)."};
+const OptionId kThreadsId{"threads", "",
+                          "Number of files processed at the same time."};
+
+// Planes of the newest board, and of the one before, in the record.
+constexpr int kBoardPlanes = 13;
+constexpr int kPreviousBoard = kBoardPlanes;
+
+// The planes of V4 records have the bits of every rank reversed, this
+// swaps them back and forth.
+uint64_t ReverseBitsInBytes(uint64_t v) {
+  v = ((v >> 1) & 0x5555555555555555ull) | ((v & 0x5555555555555555ull) << 1);
+  v = ((v >> 2) & 0x3333333333333333ull) | ((v & 0x3333333333333333ull) << 2);
+  v = ((v >> 4) & 0x0F0F0F0F0F0F0F0Full) | ((v & 0x0F0F0F0F0F0F0F0Full) << 4);
+  return v;
+}
+
+BitBoard Plane(const V4TrainingData& data, int plane) {
+  return BitBoard(ReverseBitsInBytes(data.planes[plane]));
+}
+
+bool InRange(float value, float min, float max) {
+  // Also false for NaN.
+  return value >= min && value <= max;
+}
+
+// Counters of all the files.
+struct RescoreStats {
+  std::atomic<uint64_t> files{0};
+  std::atomic<uint64_t> failed_files{0};
+  std::atomic<uint64_t> records{0};
+  std::atomic<uint64_t> invalid{0};
+  std::atomic<uint64_t> probed{0};
+  std::atomic<uint64_t> changed{0};
+};
+
+// Reads the records of a gzipped V4 or compact training data file.
+std::vector<V4TrainingData> ReadTrainingData(const std::string& filename) {
+  gzFile file = gzopen(filename.c_str(), "rb");
+  if (!file) throw Exception("Cannot read file " + filename);
+  std::string buffer;
+  char block[1 << 16];
+  int bytes;
+  while ((bytes = gzread(file, block, sizeof(block))) > 0) {
+    buffer.append(block, bytes);
+  }
+  gzclose(file);
+  if (bytes < 0) throw Exception("Cannot read file " + filename);
+
+  std::vector<V4TrainingData> records;
+  uint32_t version = 0;
+  if (buffer.size() >= sizeof(version)) {
+    std::memcpy(&version, buffer.data(), sizeof(version));
+  }
+  if (version == kCompactTrainingVersion) {
+    CompactTrainingDecoder decoder;
+    for (size_t pos = 0; pos < buffer.size();) {
+      records.emplace_back();
+      const size_t size = decoder.Decode(buffer.data() + pos,
+                                         buffer.size() - pos, &records.back());
+      if (size == 0) throw Exception("Truncated training data in " + filename);
+      pos += size;
+    }
+    return records;
+  }
+  if (buffer.size() % sizeof(V4TrainingData) != 0) {
+    throw Exception("Truncated training data in " + filename);
+  }
+  records.resize(buffer.size() / sizeof(V4TrainingData));
+  if (!records.empty()) {
+    std::memcpy(records.data(), buffer.data(), buffer.size());
+  }
+  return records;
+}
+
+// Validates and rescores the records of @input, and writes the valid ones
+// to @output unless it's empty.
+void RescoreFile(const std::string& input, const std::string& output,
+                 SyzygyTablebase* tablebase, RescoreStats* stats) {
+  auto records = ReadTrainingData(input);
+  std::string valid;
+  valid.reserve(records.size() * sizeof(V4TrainingData));
+  uint64_t invalid = 0;
+  uint64_t probed = 0;
+  uint64_t changed = 0;
+  for (auto& data : records) {
+    const std::string error = ValidateTrainingData(data);
+    if (!error.empty()) {
+      // One message per file is enough to tell what's wrong with it.
+      if (invalid++ == 0) CERR << input << ": " << error;
+      continue;
+    }
+    int8_t result;
+    if (ProbeTrainingDataResult(tablebase, data, &result)) {
+      ++probed;
+      if (result != data.result) ++changed;
+      data.result = result;
+    }
+    valid.append(reinterpret_cast<const char*>(&data), sizeof(data));
+  }
+  stats->records += records.size();
+  stats->invalid += invalid;
+  stats->probed += probed;
+  stats->changed += changed;
+  if (output.empty()) return;
+
+  // Written aside first, so that an interrupted run leaves no partial file.
+  const std::string temporary = output + ".tmp";
+  const std::string compressed = GzipCompress(valid, -1);
+  {
+    std::ofstream file(temporary, std::ios::binary);
+    file.write(compressed.data(), compressed.size());
+    if (!file) throw Exception("Unable to write into " + temporary);
+  }
+  RenameFile(temporary, output);
+}
+
+}  // namespace
+
+std::string ValidateTrainingData(const V4TrainingData& data) {
+  if (data.version != 4) {
+    return "version " + std::to_string(data.version) + " instead of 4";
+  }
+  int legal = 0;
+  double sum = 0.0;
+  for (const float probability : data.probabilities) {
+    // Illegal moves are filled with all bits set.
+    uint32_t bits;
+    std::memcpy(&bits, &probability, sizeof(bits));
+    if (bits == 0xFFFFFFFF) continue;
+    if (!InRange(probability, 0.0f, 1.0f)) {
+      return "probability " + std::to_string(probability);
+    }
+    ++legal;
+    sum += probability;
+  }
+  if (legal == 0) return "no legal moves";
+  // Leaves room for fp16 probabilities of compact records.
+  if (std::abs(sum - 1.0) > 0.01) {
+    return "probabilities summing to " + std::to_string(sum);
+  }
+  for (const uint8_t flag :
+       {data.castling_us_ooo, data.castling_us_oo, data.castling_them_ooo,
+        data.castling_them_oo, data.side_to_move}) {
+    if (flag > 1) return "flag " + std::to_string(flag);
+  }
+  if (data.result < -1 || data.result > 1) {
+    return "result " + std::to_string(data.result);
+  }
+  if (!InRange(data.root_q, -1.0f, 1.0f) ||
+      !InRange(data.best_q, -1.0f, 1.0f) ||
+      !InRange(data.root_d, 0.0f, 1.0f) || !InRange(data.best_d, 0.0f, 1.0f)) {
+    return "evaluation out of range";
+  }
+  uint64_t occupied = 0;
+  for (int plane = 0; plane < kBoardPlanes - 1; plane++) {
+    const uint64_t pieces = Plane(data, plane).as_int();
+    if (occupied & pieces) return "two pieces on a square";
+    occupied |= pieces;
+  }
+  if (Plane(data, 5).count() != 1 || Plane(data, 11).count() != 1) {
+    return "not one king per side";
+  }
+  const uint64_t back_ranks = 0xFF000000000000FFull;
+  if ((Plane(data, 0).as_int() | Plane(data, 6).as_int()) & back_ranks) {
+    return "pawn on a back rank";
+  }
+  return "";
+}
+
+Position GetTrainingDataPosition(const V4TrainingData& data) {
+  static const char kPieces[] = "PNBRQKpnbrqk";
+  char squares[64];
+  std::memset(squares, 0, sizeof(squares));
+  for (int plane = 0; plane < kBoardPlanes - 1; plane++) {
+    for (auto square : Plane(data, plane)) {
+      squares[square.as_int()] = kPieces[plane];
+    }
+  }
+  std::string fen;
+  for (int rank = 7; rank >= 0; rank--) {
+    int empty = 0;
+    for (int file = 0; file < 8; file++) {
+      const char piece = squares[rank * 8 + file];
+      if (piece == 0) {
+        ++empty;
+        continue;
+      }
+      if (empty > 0) fen += std::to_string(empty);
+      empty = 0;
+      fen += piece;
+    }
+    if (empty > 0) fen += std::to_string(empty);
+    if (rank > 0) fen += '/';
+  }
+
+  // The previous board is from the other side's point of view, where its
+  // pawns start on the second rank. A pawn that left it for the fourth rank,
+  // passing an empty square, can be taken en passant.
+  std::string en_passant = "-";
+  BitBoard their_pawns = Plane(data, 6);
+  their_pawns.Mirror();
+  const BitBoard previous_pawns = Plane(data, kPreviousBoard + 0);
+  uint64_t previous_occupied = 0;
+  for (int plane = 0; plane < kBoardPlanes - 1; plane++) {
+    previous_occupied |= Plane(data, kPreviousBoard + plane).as_int();
+  }
+  const uint64_t our_pawns = Plane(data, 0).as_int();
+  for (int file = 0; file < 8; file++) {
+    const bool moved =
+        previous_pawns.get(1, file) && !their_pawns.get(1, file) &&
+        their_pawns.get(3, file) && !previous_pawns.get(3, file) &&
+        !(previous_occupied & (1ull << (16 + file))) &&
+        !(previous_occupied & (1ull << (24 + file)));
+    // Only set when a pawn of ours, on the fifth rank, can take it.
+    const uint64_t takers = ((file > 0 ? 1ull << (32 + file - 1) : 0) |
+                             (file < 7 ? 1ull << (32 + file + 1) : 0));
+    if (moved && (our_pawns & takers)) {
+      en_passant = std::string(1, 'a' + file) + "6";
+    }
+  }
+
+  fen += " w - " + en_passant + " " + std::to_string(data.rule50_count) +
+         " 1";
+  ChessBoard board;
+  int rule50 = 0;
+  board.SetFromFen(fen, &rule50);
+  return Position(board, rule50, 0);
+}
+
+bool ProbeTrainingDataResult(SyzygyTablebase* tablebase,
+                             const V4TrainingData& data, int8_t* result) {
+  if (data.castling_us_ooo || data.castling_us_oo || data.castling_them_ooo ||
+      data.castling_them_oo) {
+    return false;
+  }
+  uint64_t occupied = 0;
+  for (int plane = 0; plane < kBoardPlanes - 1; plane++) {
+    occupied |= data.planes[plane];
+  }
+  if (BitBoard(occupied).count() > tablebase->max_cardinality()) return false;
+
+  const Position position = GetTrainingDataPosition(data);
+  ProbeState state;
+  const WDLScore wdl = tablebase->probe_wdl(position, &state);
+  if (state == FAIL) return false;
+  int8_t score = wdl == WDL_WIN ? 1 : wdl == WDL_LOSS ? -1 : 0;
+  // The WDL tables assume a fresh 50-move counter, the plies already played
+  // can turn the win into a draw.
+  if (score != 0 && data.rule50_count > 0) {
+    const int dtz = tablebase->probe_dtz(position, &state);
+    if (state == FAIL) return false;
+    if (std::abs(dtz) + data.rule50_count > 100) score = 0;
+  }
+  *result = score;
+  return true;
+}
+
+void TrainingDataRescorer::Run() {
+  OptionsParser options;
+  options.Add<StringOption>(kInputId);
+  options.Add<StringOption>(kOutputId);
+  options.Add<StringOption>(kSyzygyTablebaseId);
+  options.Add<IntOption>(kThreadsId, 1, 1024) =
+      std::max(1u, std::thread::hardware_concurrency());
+  if (!options.ProcessAllFlags()) return;
+
+  try {
+    const auto option_dict = options.GetOptionsDict();
+    const auto input = option_dict.Get<std::string>(kInputId.GetId());
+    const auto output = option_dict.Get<std::string>(kOutputId.GetId());
+    if (input.empty()) throw Exception("--input is needed.");
+    if (!output.empty()) CreateDirectory(output);
+
+    SyzygyTablebase tablebase;
+    const auto paths = option_dict.Get<std::string>(kSyzygyTablebaseId.GetId());
+    if (!paths.empty() && !tablebase.init(paths)) {
+      throw Exception("No Syzygy tablebases found in " + paths);
+    }
+    if (tablebase.max_cardinality() > 0) {
+      CERR << "Rescoring with " << tablebase.max_cardinality()
+           << "-piece tablebases.";
+    }
+
+    std::vector<std::string> files;
+    for (const auto& name : GetFileList(input)) {
+      if (name.size() > 3 && name.compare(name.size() - 3, 3, ".gz") == 0) {
+        files.push_back(name);
+      }
+    }
+    std::sort(files.begin(), files.end());
+    CERR << "Processing " << files.size() << " files.";
+
+    const auto start = std::chrono::steady_clock::now();
+    RescoreStats stats;
+    std::atomic<size_t> next{0};
+    auto work = [&]() {
+      for (size_t i = next++; i < files.size(); i = next++) {
+        const auto& name = files[i];
+        try {
+          RescoreFile(input + "/" + name,
+                      output.empty() ? "" : output + "/" + name, &tablebase,
+                      &stats);
+        } catch (const Exception& e) {
+          CERR << e.what();
+          ++stats.failed_files;
+        }
+        if (++stats.files % 1000 == 0) {
+          CERR << "Processed " << stats.files << " files.";
+        }
+      }
+    };
+    std::vector<std::thread> threads;
+    const int thread_count = option_dict.Get<int>(kThreadsId.GetId());
+    for (int i = 1; i < thread_count; i++) threads.emplace_back(work);
+    work();
+    for (auto& thread : threads) thread.join();
+
+    const std::chrono::duration<double> time =
+        std::chrono::steady_clock::now() - start;
+    CERR << "Processed " << stats.files << " files (" << stats.failed_files
+         << " unreadable) with " << stats.records << " records in "
+         << time.count() << "s: " << stats.invalid << " invalid, "
+         << stats.probed << " probed, " << stats.changed
+         << " with a new result.";
+  } catch (Exception& ex) {
+    std::cerr << ex.what() << std::endl;
+  }
+}
+
+}  // namespace lczero
@@ -0,0 +1,66 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2019 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+
+  If you modify this Program, or any covered work, by linking or
+  combining it with NVIDIA Corporation's libraries from the NVIDIA CUDA
+  Toolkit and the NVIDIA CUDA Deep Neural Network library (or a
+  modified version of those libraries), containing parts covered by the
+  terms of the respective license agreement, the licensors of this
+  Program grant you additional permission to convey the resulting work.
+*/
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include "chess/position.h"
+#include "neural/writer.h"
+#include "syzygy/syzygy.h"
+
+namespace lczero {
+
+// Checks that @data is a well formed V4 record: legal move probabilities
+// summing to 1, flags, result and evaluations in range, and one king of each
+// side on a board without pawns on the back ranks. Returns an empty string
+// if so, otherwise what is wrong.
+std::string ValidateTrainingData(const V4TrainingData& data);
+
+// The position of @data, from its side to move's point of view, with white
+// to move. Castling rights are left out; en passant is taken from the
+// previous board of the record.
+Position GetTrainingDataPosition(const V4TrainingData& data);
+
+// Sets @result to what @tablebase says of the position of @data for its side
+// to move: 1, 0 or -1, wins beyond the 50-move rule counting as draws.
+// Returns false if the position isn't in the tablebases or has castling
+// rights.
+bool ProbeTrainingDataResult(SyzygyTablebase* tablebase,
+                             const V4TrainingData& data, int8_t* result);
+
+// Validates the V4 or compact training data files of a directory, rescores
+// their endgame records with the tablebases, and writes them as V4 files to
+// another directory. Files are processed in parallel, one per thread.
+class TrainingDataRescorer {
+ public:
+  TrainingDataRescorer() = default;
+
+  void Run();
+};
+
+}  // namespace lczero
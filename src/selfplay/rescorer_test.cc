@@ -0,0 +1,141 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2019 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "selfplay/rescorer.h"
+
+#include <gtest/gtest.h>
+#include <cstring>
+#include "chess/board.h"
+#include "neural/encoder.h"
+
+namespace lczero {
+namespace {
+
+uint64_t ReverseBitsInBytes(uint64_t v) {
+  v = ((v >> 1) & 0x5555555555555555ull) | ((v & 0x5555555555555555ull) << 1);
+  v = ((v >> 2) & 0x3333333333333333ull) | ((v & 0x3333333333333333ull) << 2);
+  v = ((v >> 4) & 0x0F0F0F0F0F0F0F0Full) | ((v & 0x0F0F0F0F0F0F0F0Full) << 4);
+  return v;
+}
+
+// The record of the last position of @history, with uniform probabilities.
+V4TrainingData MakeRecord(const PositionHistory& history) {
+  V4TrainingData data;
+  std::memset(&data, 0, sizeof(data));
+  data.version = 4;
+  std::memset(data.probabilities, -1, sizeof(data.probabilities));
+  const Position& position = history.Last();
+  const auto moves = position.GetBoard().GenerateLegalMoves();
+  for (const Move move : moves) {
+    data.probabilities[move.as_nn_index()] = 1.0f / moves.size();
+  }
+  const InputPlanes planes =
+      EncodePositionForNN(history, 8, FillEmptyHistory::NO);
+  for (int i = 0; i < 104; i++) {
+    data.planes[i] = ReverseBitsInBytes(planes[i].mask);
+  }
+  data.castling_us_ooo = position.CanCastle(Position::WE_CAN_OOO);
+  data.castling_us_oo = position.CanCastle(Position::WE_CAN_OO);
+  data.castling_them_ooo = position.CanCastle(Position::THEY_CAN_OOO);
+  data.castling_them_oo = position.CanCastle(Position::THEY_CAN_OO);
+  data.side_to_move = position.IsBlackToMove() ? 1 : 0;
+  data.rule50_count = position.GetNoCaptureNoPawnPly();
+  return data;
+}
+
+PositionHistory MakeHistory(const std::string& fen,
+                            const std::vector<std::string>& moves) {
+  ChessBoard board;
+  int rule50;
+  int game_ply;
+  board.SetFromFen(fen, &rule50, &game_ply);
+  PositionHistory history;
+  history.Reset(board, rule50, game_ply);
+  for (const auto& move : moves) {
+    history.Append(Move(move, history.IsBlackToMove()));
+  }
+  return history;
+}
+
+}  // namespace
+
+TEST(Rescorer, Validate) {
+  const auto history = MakeHistory(ChessBoard::kStartposFen, {"e2e4"});
+  auto data = MakeRecord(history);
+  EXPECT_EQ("", ValidateTrainingData(data));
+
+  auto bad = data;
+  bad.result = 2;
+  EXPECT_NE("", ValidateTrainingData(bad));
+  bad = data;
+  bad.probabilities[Move("e7e5").as_nn_index()] = 0.5f;
+  EXPECT_NE("", ValidateTrainingData(bad));
+  bad = data;
+  bad.best_q = 1.5f;
+  EXPECT_NE("", ValidateTrainingData(bad));
+  bad = data;
+  bad.planes[11] = 0;
+  EXPECT_NE("", ValidateTrainingData(bad));
+  bad = data;
+  bad.planes[0] |= bad.planes[1];
+  EXPECT_NE("", ValidateTrainingData(bad));
+}
+
+TEST(Rescorer, Position) {
+  // White to move can take d5 en passant.
+  auto history = MakeHistory(ChessBoard::kStartposFen,
+                             {"e2e4", "a7a6", "e4e5", "d7d5"});
+  auto position = GetTrainingDataPosition(MakeRecord(history));
+  ChessBoard expected;
+  expected.SetFromFen("rnbqkbnr/1pp1pppp/p7/3pP3/8/8/PPPP1PPP/RNBQKBNR w - d6 0 3");
+  EXPECT_EQ(expected, position.GetBoard());
+  EXPECT_EQ(0, position.GetNoCaptureNoPawnPly());
+
+  // Black to move gets the mirrored board, white to move.
+  history = MakeHistory("4k3/8/8/8/8/8/8/R3K3 w - - 7 40", {"a1a2"});
+  position = GetTrainingDataPosition(MakeRecord(history));
+  expected.SetFromFen("4k3/r7/8/8/8/8/8/4K3 w - - 8 1");
+  EXPECT_EQ(expected, position.GetBoard());
+  EXPECT_EQ(8, position.GetNoCaptureNoPawnPly());
+}
+
+TEST(Rescorer, Probe) {
+  SyzygyTablebase tablebase;
+  tablebase.init("syzygy");
+  if (tablebase.max_cardinality() < 3) return;
+
+  // Rook against bare king, for either side to move.
+  auto data = MakeRecord(MakeHistory("8/8/4k3/8/8/8/8/3RK3 w - - 0 1", {}));
+  int8_t result = 0;
+  ASSERT_TRUE(ProbeTrainingDataResult(&tablebase, data, &result));
+  EXPECT_EQ(1, result);
+  data = MakeRecord(MakeHistory("8/8/4k3/8/8/8/8/3RK3 w - - 0 1", {"e1e2"}));
+  ASSERT_TRUE(ProbeTrainingDataResult(&tablebase, data, &result));
+  EXPECT_EQ(-1, result);
+
+  // Too late to mate before the 50-move rule.
+  data = MakeRecord(MakeHistory("8/8/4k3/8/8/8/8/3RK3 w - - 99 80", {}));
+  ASSERT_TRUE(ProbeTrainingDataResult(&tablebase, data, &result));
+  EXPECT_EQ(0, result);
+
+  // Castling rights are not in the tablebases.
+  data = MakeRecord(MakeHistory("4k3/8/8/8/8/8/8/4K2R w K - 0 1", {}));
+  EXPECT_FALSE(ProbeTrainingDataResult(&tablebase, data, &result));
+}
+
+}  // namespace lczero
@@ -0,0 +1,87 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2019 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+
+  If you modify this Program, or any covered work, by linking or
+  combining it with NVIDIA Corporation's libraries from the NVIDIA CUDA
+  Toolkit and the NVIDIA CUDA Deep Neural Network library (or a
+  modified version of those libraries), containing parts covered by the
+  terms of the respective license agreement, the licensors of this
+  Program grant you additional permission to convey the resulting work.
+*/
+
+#include "selfplay/sprt.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace lczero {
+namespace {
+float EloToScore(float elo) {
+  return 1.0f / (1.0f + std::pow(10.0f, -elo / 400));
+}
+
+// Mean and variance of the score of a game.
+void ScoreStats(int wins, int draws, int losses, double* mean,
+                double* variance) {
+  const double n = wins + draws + losses;
+  *mean = (wins + 0.5 * draws) / n;
+  *variance = (wins * std::pow(1.0 - *mean, 2) +
+               draws * std::pow(0.5 - *mean, 2) +
+               losses * std::pow(*mean, 2)) /
+              n;
+}
+}  // namespace
+
+float ScoreToElo(float score) {
+  return -400.0f * std::log10(1.0f / score - 1.0f);
+}
+
+float EloError(int wins, int draws, int losses) {
+  const int n = wins + draws + losses;
+  if (n == 0 || wins + draws == 0 || losses + draws == 0) return 0.0f;
+  double mean, variance;
+  ScoreStats(wins, draws, losses, &mean, &variance);
+  const double deviation = 1.959964 * std::sqrt(variance / n);
+  const double low = std::max(mean - deviation, 1e-6);
+  const double high = std::min(mean + deviation, 1.0 - 1e-6);
+  return (ScoreToElo(high) - ScoreToElo(low)) / 2;
+}
+
+float SprtLlr(int wins, int draws, int losses, float elo0, float elo1) {
+  const int n = wins + draws + losses;
+  if (n == 0) return 0.0f;
+  double mean, variance;
+  ScoreStats(wins, draws, losses, &mean, &variance);
+  // No information yet while all games have the same result.
+  if (variance <= 0.0) return 0.0f;
+  const double score0 = EloToScore(elo0);
+  const double score1 = EloToScore(elo1);
+  return n * (score1 - score0) * (2 * mean - score0 - score1) /
+         (2 * variance);
+}
+
+float SprtLowerBound(float alpha, float beta) {
+  return std::log(beta / (1 - alpha));
+}
+
+float SprtUpperBound(float alpha, float beta) {
+  return std::log((1 - beta) / alpha);
+}
+
+}  // namespace lczero
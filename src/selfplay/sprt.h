@@ -0,0 +1,49 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2019 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+
+  If you modify this Program, or any covered work, by linking or
+  combining it with NVIDIA Corporation's libraries from the NVIDIA CUDA
+  Toolkit and the NVIDIA CUDA Deep Neural Network library (or a
+  modified version of those libraries), containing parts covered by the
+  terms of the respective license agreement, the licensors of this
+  Program grant you additional permission to convey the resulting work.
+*/
+
+#pragma once
+
+namespace lczero {
+
+// Elo difference of a @score between 0 and 1 (exclusive).
+float ScoreToElo(float score);
+
+// Half width of the 95% confidence interval of the Elo difference given by
+// @wins, @draws and @losses. 0 if it can't be told yet.
+float EloError(int wins, int draws, int losses);
+
+// Log likelihood ratio of the hypothesis that the Elo difference is @elo1
+// against the one that it is @elo0, in the normal approximation of the
+// trinomial (win/draw/loss) model.
+float SprtLlr(int wins, int draws, int losses, float elo0, float elo1);
+
+// Bounds of the SPRT with false positive rate @alpha and false negative rate
+// @beta: H1 (@elo1) is accepted at the upper bound, H0 at the lower one.
+float SprtLowerBound(float alpha, float beta);
+float SprtUpperBound(float alpha, float beta);
+
+}  // namespace lczero
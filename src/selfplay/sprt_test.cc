@@ -0,0 +1,51 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2019 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <gtest/gtest.h>
+#include "src/selfplay/sprt.h"
+
+namespace lczero {
+
+TEST(Sprt, Llr) {
+  EXPECT_NEAR(SprtLlr(100, 200, 70, 0.0f, 5.0f), 0.8686f, 1e-3f);
+  // Flipping the results flips the sign of a hypothesis symmetric around 0.
+  EXPECT_NEAR(SprtLlr(70, 200, 100, -5.0f, 5.0f),
+              -SprtLlr(100, 200, 70, -5.0f, 5.0f), 1e-3f);
+  // No information while all the games end the same.
+  EXPECT_EQ(SprtLlr(0, 0, 0, 0.0f, 5.0f), 0.0f);
+  EXPECT_EQ(SprtLlr(0, 10, 0, 0.0f, 5.0f), 0.0f);
+}
+
+TEST(Sprt, Bounds) {
+  EXPECT_NEAR(SprtLowerBound(0.05f, 0.05f), -2.9444f, 1e-3f);
+  EXPECT_NEAR(SprtUpperBound(0.05f, 0.05f), 2.9444f, 1e-3f);
+}
+
+TEST(Sprt, Elo) {
+  EXPECT_NEAR(ScoreToElo(0.5f), 0.0f, 1e-3f);
+  EXPECT_NEAR(ScoreToElo(100.0f / 370 + 0.5f * 200 / 370), 28.232f, 1e-2f);
+  EXPECT_NEAR(EloError(100, 200, 70), 24.02f, 1e-2f);
+  EXPECT_EQ(EloError(0, 0, 5), 0.0f);
+}
+
+}  // namespace lczero
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
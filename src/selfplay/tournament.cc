@@ -26,18 +26,38 @@
 */
 
 #include "selfplay/tournament.h"
+#include <unordered_map>
 #include "mcts/search.h"
+#include "neural/batcher.h"
 #include "neural/factory.h"
+#include "neural/network.h"
 #include "selfplay/game.h"
+#include "selfplay/sprt.h"
+#include "utils/logging.h"
+#include "utils/metrics.h"
 #include "utils/optionsparser.h"
 #include "utils/random.h"
 
 namespace lczero {
 namespace {
+Counter gGamesMetric("lc0_selfplay_games_total", "Finished selfplay games.");
+Gauge gGamesPerHourMetric("lc0_selfplay_games_per_hour",
+                          "Games per hour of the running tournament.");
+
 const OptionId kShareTreesId{"share-trees", "ShareTrees",
                              "When on, game tree is shared for two players; "
                              "when off, each side has a separate tree."};
 const OptionId kTotalGamesId{"games", "Games", "Number of games to play."};
+const OptionId kSyzygyTablebaseId{
+    "syzygy-paths", "SyzygyPath",
+    "List of Syzygy tablebase directories, list entries separated by system "
+    "separator (\";\" for Windows, \":\" for Linux)."};
+const OptionId kOpeningsId{
+    "openings", "Openings",
+    "EPD file, or PGN file if its name ends with .pgn, to take the starting "
+    "positions of the games from. Every opening is played twice, player1 "
+    "having white in one game and black in the other. The file is read as "
+    "the games start, and again from its beginning once all are played."};
 const OptionId kParallelGamesId{"parallelism", "Parallelism",
                                 "Number of games to play in parallel."};
 const OptionId kThreadsId{
@@ -46,7 +66,8 @@ const OptionId kThreadsId{
 const OptionId kNnCacheSizeId{
     "nncache", "NNCache",
     "Number of positions to store in a memory cache. A large cache can speed "
-    "up searching, but takes memory."};
+    "up searching, but takes memory. The cache is shared by all games, and by "
+    "both players if they use the same network."};
 const OptionId kPlayoutsId{"playouts", "Playouts",
                            "Number of playouts per move to search."};
 const OptionId kVisitsId{"visits", "Visits",
@@ -62,9 +83,62 @@ const OptionId kVerboseThinkingId{"verbose-thinking", "VerboseThinking",
 const OptionId kResignPlaythroughId{
     "resign-playthrough", "ResignPlaythrough",
     "The percentage of games which ignore resign."};
+const OptionId kGameBatchSizeId{
+    "game-batch-size", "GameBatchSize",
+    "When above 0, a single thread plays all the parallel games, and sends "
+    "the positions of all of them to the network together, in batches of up "
+    "to that many. Otherwise every game runs its own search threads."};
+const OptionId kTrainingCompressionId{
+    "training-compression", "TrainingCompression",
+    "Gzip compression level of training data, from 1 (fastest) to 9 "
+    "(smallest), or -1 for the zlib default."};
+const OptionId kTrainingGamesPerFileId{
+    "training-games-per-file", "TrainingGamesPerFile",
+    "Number of games written to every training data file."};
+const OptionId kTrainingFormatId{
+    "training-format", "TrainingFormat",
+    "Format of training data files. \"compact\" stores only the legal moves "
+    "of the policy, in fp16, and only the planes that can't be told from the "
+    "previous position. Convert it back with the converttrainingdata mode."};
+const OptionId kTrainingStreamId{
+    "training-stream", "TrainingStream",
+    "File or named pipe to stream the training data to, instead of writing "
+    "every file to the data directory. Each file is preceded by a 16 bytes "
+    "header: \"Lc0T\", the id of its first game (uint32) and its size "
+    "(uint64), little endian. Games are then reported without a file name."};
+const OptionId kTrainingWriterThreadsId{
+    "training-writer-threads", "TrainingWriterThreads",
+    "Number of background threads compressing training data files."};
+const OptionId kSprtId{
+    "sprt", "Sprt",
+    "Stop the tournament as soon as a sequential probability ratio test "
+    "tells whether player1 is SprtElo0 or SprtElo1 Elo stronger than "
+    "player2. Games in progress are then abandoned."};
+const OptionId kSprtElo0Id{"sprt-elo0", "SprtElo0",
+                           "Elo difference of the null hypothesis."};
+const OptionId kSprtElo1Id{"sprt-elo1", "SprtElo1",
+                           "Elo difference of the alternative hypothesis."};
+const OptionId kSprtAlphaId{
+    "sprt-alpha", "SprtAlpha",
+    "Probability of accepting SprtElo1 when SprtElo0 is true."};
+const OptionId kSprtBetaId{
+    "sprt-beta", "SprtBeta",
+    "Probability of accepting SprtElo0 when SprtElo1 is true."};
 
 }  // namespace
 
+struct SelfPlayTournament::GameState {
+  int game_number;
+  bool player1_black;
+  bool enable_resign;
+  Opening opening;
+  int white_threads;
+  int black_threads;
+  std::list<std::unique_ptr<SelfPlayGame>>::iterator game_iter;
+  // In non-verbose mode, the last "info" message, output with the bestmove.
+  std::vector<ThinkingInfo> last_thinking_info;
+};
+
 void SelfPlayTournament::PopulateOptions(OptionsParser* options) {
   options->AddContext("player1");
   options->AddContext("player2");
@@ -77,12 +151,26 @@ void SelfPlayTournament::PopulateOptions(OptionsParser* options) {
   options->Add<BoolOption>(kShareTreesId) = true;
   options->Add<IntOption>(kTotalGamesId, -1, 999999) = -1;
   options->Add<IntOption>(kParallelGamesId, 1, 256) = 8;
+  options->Add<StringOption>(kSyzygyTablebaseId);
+  options->Add<StringOption>(kOpeningsId);
   options->Add<IntOption>(kPlayoutsId, -1, 999999999) = -1;
   options->Add<IntOption>(kVisitsId, -1, 999999999) = -1;
   options->Add<IntOption>(kTimeMsId, -1, 999999999) = -1;
   options->Add<BoolOption>(kTrainingId) = false;
   options->Add<BoolOption>(kVerboseThinkingId) = false;
   options->Add<FloatOption>(kResignPlaythroughId, 0.0f, 100.0f) = 0.0f;
+  options->Add<IntOption>(kGameBatchSizeId, 0, 65536) = 0;
+  options->Add<IntOption>(kTrainingCompressionId, -1, 9) = -1;
+  options->Add<IntOption>(kTrainingGamesPerFileId, 1, 100000) = 1;
+  options->Add<IntOption>(kTrainingWriterThreadsId, 1, 128) = 1;
+  options->Add<StringOption>(kTrainingStreamId);
+  std::vector<std::string> training_formats = {"v4", "compact"};
+  options->Add<ChoiceOption>(kTrainingFormatId, training_formats) = "v4";
+  options->Add<BoolOption>(kSprtId) = false;
+  options->Add<FloatOption>(kSprtElo0Id, -1000.0f, 1000.0f) = 0.0f;
+  options->Add<FloatOption>(kSprtElo1Id, -1000.0f, 1000.0f) = 5.0f;
+  options->Add<FloatOption>(kSprtAlphaId, 0.0001f, 0.5f) = 0.05f;
+  options->Add<FloatOption>(kSprtBetaId, 0.0001f, 0.5f) = 0.05f;
 
   SelfPlayGame::PopulateUciParams(options);
 
@@ -123,7 +211,45 @@ SelfPlayTournament::SelfPlayTournament(const OptionsDict& options,
       kShareTree(options.Get<bool>(kShareTreesId.GetId())),
       kParallelism(options.Get<int>(kParallelGamesId.GetId())),
       kTraining(options.Get<bool>(kTrainingId.GetId())),
-      kResignPlaythrough(options.Get<float>(kResignPlaythroughId.GetId())) {
+      kResignPlaythrough(options.Get<float>(kResignPlaythroughId.GetId())),
+      kGameBatchSize(options.Get<int>(kGameBatchSizeId.GetId())),
+      kSprt(options.Get<bool>(kSprtId.GetId())),
+      kSprtElo0(options.Get<float>(kSprtElo0Id.GetId())),
+      kSprtElo1(options.Get<float>(kSprtElo1Id.GetId())) {
+  if (kSprt) {
+    const float alpha = options.Get<float>(kSprtAlphaId.GetId());
+    const float beta = options.Get<float>(kSprtBetaId.GetId());
+    tournament_info_.sprt = true;
+    tournament_info_.llr_lower = SprtLowerBound(alpha, beta);
+    tournament_info_.llr_upper = SprtUpperBound(alpha, beta);
+  }
+  if (kTraining) {
+    const auto stream = options.Get<std::string>(kTrainingStreamId.GetId());
+    std::unique_ptr<TrainingDataSink> sink;
+    if (stream.empty()) {
+      sink = std::make_unique<FileTrainingDataSink>();
+    } else {
+      sink = std::make_unique<StreamTrainingDataSink>(stream);
+    }
+    training_writer_ = std::make_unique<AsyncTrainingDataWriter>(
+        std::move(sink), options.Get<int>(kTrainingGamesPerFileId.GetId()),
+        options.Get<int>(kTrainingCompressionId.GetId()),
+        options.Get<int>(kTrainingWriterThreadsId.GetId()),
+        options.Get<std::string>(kTrainingFormatId.GetId()) == "compact");
+  }
+  const auto tb_paths = options.Get<std::string>(kSyzygyTablebaseId.GetId());
+  if (!tb_paths.empty()) {
+    syzygy_tb_ = std::make_unique<SyzygyTablebase>();
+    CERR << "Loading Syzygy tablebases from " << tb_paths;
+    if (!syzygy_tb_->init(tb_paths)) {
+      CERR << "Failed to load Syzygy tablebases!";
+      syzygy_tb_ = nullptr;
+    }
+  }
+  const auto openings = options.Get<std::string>(kOpeningsId.GetId());
+  if (!openings.empty()) {
+    openings_ = std::make_unique<OpeningBook>(openings);
+  }
   // If playing just one game, the player1 is white, otherwise randomize.
   if (kTotalGames != 1) {
     next_game_black_ = Random::Get().GetBool();
@@ -139,14 +265,17 @@ SelfPlayTournament::SelfPlayTournament(const OptionsDict& options,
                      ? networks_[0]
                      : NetworkFactory::LoadNetwork(player2_opts);
 
-  // Initializing cache.
-  cache_[0] = std::make_shared<NNCache>(
-      options.GetSubdict("player1").Get<int>(kNnCacheSizeId.GetId()));
-  if (kShareTree) {
+  // Initializing cache. Evaluations only depend on the network, so players
+  // with the same network share it.
+  const int cache_size[2] = {player1_opts.Get<int>(kNnCacheSizeId.GetId()),
+                             player2_opts.Get<int>(kNnCacheSizeId.GetId())};
+  if (networks_[0] == networks_[1]) {
+    cache_[0] =
+        std::make_shared<NNCache>(std::max(cache_size[0], cache_size[1]));
     cache_[1] = cache_[0];
   } else {
-    cache_[1] = std::make_shared<NNCache>(
-        options.GetSubdict("player2").Get<int>(kNnCacheSizeId.GetId()));
+    cache_[0] = std::make_shared<NNCache>(cache_size[0]);
+    cache_[1] = std::make_shared<NNCache>(cache_size[1]);
   }
 
   // SearchLimits.
@@ -169,17 +298,38 @@ SelfPlayTournament::SelfPlayTournament(const OptionsDict& options,
 }
 
 void SelfPlayTournament::PlayOneGame(int game_number) {
+  const auto state = StartGame(game_number);
+  // PLAY GAME!
+  (*state->game_iter)
+      ->Play(state->white_threads, state->black_threads, kTraining,
+             state->enable_resign);
+  FinishGame(*state);
+}
+
+std::unique_ptr<SelfPlayTournament::GameState> SelfPlayTournament::StartGame(
+    int game_number) {
+  auto state = std::make_unique<GameState>();
+  state->game_number = game_number;
   bool player1_black;  // Whether player1 will player as black in this game.
   {
     Mutex::Lock lock(mutex_);
     player1_black = next_game_black_;
     next_game_black_ = !next_game_black_;
+    if (openings_) {
+      // The second game of the pair swaps colors.
+      if (!opening_pending_) opening_ = openings_->Next();
+      opening_pending_ = !opening_pending_;
+      state->opening = opening_;
+    }
   }
+  state->player1_black = player1_black;
   const int color_idx[2] = {player1_black ? 1 : 0, player1_black ? 0 : 1};
+  state->white_threads = kThreads[color_idx[0]];
+  state->black_threads = kThreads[color_idx[1]];
 
   PlayerOptions options[2];
 
-  std::vector<ThinkingInfo> last_thinking_info;
+  std::vector<ThinkingInfo>& last_thinking_info = state->last_thinking_info;
   for (int pl_idx : {0, 1}) {
     const bool verbose_thinking =
         player_options_[pl_idx].Get<bool>(kVerboseThinkingId.GetId());
@@ -189,6 +339,7 @@ void SelfPlayTournament::PlayOneGame(int game_number) {
     opt.cache = cache_[pl_idx].get();
     opt.uci_options = &player_options_[pl_idx];
     opt.search_limits = search_limits_[pl_idx];
+    opt.syzygy_tb = syzygy_tb_.get();
 
     // "bestmove" callback.
     opt.best_move_callback = [this, game_number, pl_idx, player1_black,
@@ -227,23 +378,23 @@ void SelfPlayTournament::PlayOneGame(int game_number) {
   // Iterator to store the game in. Have to keep it so that later we can
   // delete it. Need to expose it in games_ member variable only because
   // of possible Abort() that should stop them all.
-  std::list<std::unique_ptr<SelfPlayGame>>::iterator game_iter;
   {
     Mutex::Lock lock(mutex_);
     games_.emplace_front(
-        std::make_unique<SelfPlayGame>(options[0], options[1], kShareTree));
-    game_iter = games_.begin();
+        std::make_unique<SelfPlayGame>(options[0], options[1], kShareTree,
+                                       state->opening));
+    state->game_iter = games_.begin();
   }
-  auto& game = **game_iter;
 
   // If kResignPlaythrough == 0, then this comparison is unconditionally true
-  const bool enable_resign =
-      Random::Get().GetFloat(100.0f) >= kResignPlaythrough;
-
-  // PLAY GAME!
-  game.Play(kThreads[color_idx[0]], kThreads[color_idx[1]], kTraining,
-            enable_resign);
+  state->enable_resign = Random::Get().GetFloat(100.0f) >= kResignPlaythrough;
+  return state;
+}
 
+void SelfPlayTournament::FinishGame(const GameState& state) {
+  const auto& game = **state.game_iter;
+  const int game_number = state.game_number;
+  const bool player1_black = state.player1_black;
   // If game was aborted, it's still undecided.
   if (game.GetGameResult() != GameResult::UNDECIDED) {
     // Game callback.
@@ -252,17 +403,22 @@ void SelfPlayTournament::PlayOneGame(int game_number) {
     game_info.is_black = player1_black;
     game_info.game_id = game_number;
     game_info.moves = game.GetMoves();
-    if (!enable_resign) {
+    game_info.start_fen = state.opening.start_fen;
+    if (!state.enable_resign) {
       game_info.min_false_positive_threshold =
           game.GetWorstEvalForWinnerOrDraw();
     }
-    if (kTraining) {
-      TrainingDataWriter writer(game_number);
-      game.WriteTrainingData(&writer);
-      writer.Finalize();
-      game_info.training_filename = writer.GetFileName();
+    auto training_data = game.GetTrainingData();
+    if (kTraining && !training_data.empty()) {
+      training_writer_->Write(
+          game_number, std::move(training_data),
+          [this, game_info](const std::string& filename) mutable {
+            game_info.training_filename = filename;
+            game_callback_(game_info);
+          });
+    } else {
+      game_callback_(game_info);
     }
-    game_callback_(game_info);
 
     // Update tournament stats.
     {
@@ -272,13 +428,23 @@ void SelfPlayTournament::PlayOneGame(int game_number) {
                        : game.GetGameResult() == GameResult::WHITE_WON ? 0 : 2;
       if (player1_black) result = 2 - result;
       ++tournament_info_.results[result][player1_black ? 1 : 0];
+      tournament_info_.full_searches += game.GetFullSearches();
+      tournament_info_.fast_searches += game.GetFastSearches();
+      ++games_finished_;
+      const std::chrono::duration<float, std::ratio<3600>> hours =
+          std::chrono::steady_clock::now() - start_time_;
+      tournament_info_.games_per_hour = games_finished_ / hours.count();
+      gGamesMetric.Add();
+      gGamesPerHourMetric.Set(tournament_info_.games_per_hour);
+      if (kSprt) UpdateSprt();
+      UpdateCacheStats();
       tournament_callback_(tournament_info_);
     }
   }
 
   {
     Mutex::Lock lock(mutex_);
-    games_.erase(game_iter);
+    games_.erase(state.game_iter);
   }
 }
 
@@ -296,20 +462,99 @@ void SelfPlayTournament::Worker() {
   }
 }
 
+void SelfPlayTournament::BatchedWorker() {
+  struct Slot {
+    std::unique_ptr<GameState> state;
+    // Runs the search of the current move.
+    std::unique_ptr<SearchWorker> worker;
+  };
+  std::vector<Slot> slots(kParallelism);
+  std::unordered_map<Network*, std::unique_ptr<ComputationBatcher>> batchers;
+  while (true) {
+    // Gather a minibatch of every game, starting new moves and new games as
+    // needed.
+    bool playing = false;
+    for (auto& slot : slots) {
+      while (!slot.worker) {
+        if (!slot.state) {
+          int game_id;
+          {
+            Mutex::Lock lock(mutex_);
+            if (abort_) break;
+            if (kTotalGames != -1 && games_count_ >= kTotalGames) break;
+            game_id = games_count_++;
+          }
+          slot.state = StartGame(game_id);
+        }
+        SelfPlayGame& game = **slot.state->game_iter;
+        if (game.StartMove()) {
+          slot.worker = std::make_unique<SearchWorker>(
+              game.GetSearch(), game.GetSearch()->GetParams());
+        } else {
+          FinishGame(*slot.state);
+          slot.state.reset();
+        }
+      }
+      if (!slot.worker) continue;
+      playing = true;
+      SelfPlayGame& game = **slot.state->game_iter;
+      auto& batcher = batchers[game.GetNetwork()];
+      if (!batcher) {
+        batcher = std::make_unique<ComputationBatcher>(game.GetNetwork(),
+                                                       kGameBatchSize);
+      }
+      const auto& params = game.GetSearch()->GetParams();
+      slot.worker->InitializeIteration(batcher->NewComputation(
+          params.GetMiniBatchSize() + params.GetMaxPrefetchBatch()));
+      slot.worker->GatherMinibatch();
+      slot.worker->MaybePrefetchIntoCache();
+    }
+    if (!playing) break;
+
+    for (auto& batcher : batchers) batcher.second->ComputeBlocking();
+
+    // Use the results, and play the moves of searches which are done.
+    for (auto& slot : slots) {
+      if (!slot.worker) continue;
+      slot.worker->RunNNComputation();
+      slot.worker->FetchMinibatchResults();
+      slot.worker->DoBackupUpdate();
+      slot.worker->UpdateCounters();
+      SelfPlayGame& game = **slot.state->game_iter;
+      if (game.GetSearch()->IsSearchActive()) continue;
+      slot.worker.reset();
+      if (!game.FinishMove(kTraining, slot.state->enable_resign)) {
+        FinishGame(*slot.state);
+        slot.state.reset();
+      }
+    }
+  }
+}
+
 void SelfPlayTournament::StartAsync() {
   Mutex::Lock lock(threads_mutex_);
+  if (kGameBatchSize > 0) {
+    if (threads_.empty()) threads_.emplace_back([&]() { BatchedWorker(); });
+    return;
+  }
   while (threads_.size() < kParallelism) {
     threads_.emplace_back([&]() { Worker(); });
   }
 }
 
 void SelfPlayTournament::RunBlocking() {
-  if (kParallelism == 1) {
+  if (kParallelism == 1 || kGameBatchSize > 0) {
     // No need for multiple threads if there is one worker.
-    Worker();
+    if (kGameBatchSize > 0) {
+      BatchedWorker();
+    } else {
+      Worker();
+    }
+    if (training_writer_) training_writer_->Flush();
     Mutex::Lock lock(mutex_);
-    if (!abort_) {
+    if ((!abort_ || sprt_stopped_) && !tournament_info_.finished) {
       tournament_info_.finished = true;
+      UpdateCacheStats();
       tournament_callback_(tournament_info_);
     }
   } else {
@@ -326,15 +571,46 @@ void SelfPlayTournament::Wait() {
       threads_.pop_back();
     }
   }
+  if (training_writer_) training_writer_->Flush();
   {
     Mutex::Lock lock(mutex_);
-    if (!abort_) {
+    if ((!abort_ || sprt_stopped_) && !tournament_info_.finished) {
       tournament_info_.finished = true;
+      UpdateCacheStats();
       tournament_callback_(tournament_info_);
     }
   }
 }
 
+void SelfPlayTournament::UpdateCacheStats() {
+  for (int idx : {0, 1}) {
+    const NNCache::Stats stats = cache_[idx]->GetStats();
+    tournament_info_.cache_hits[idx] = stats.hits;
+    tournament_info_.cache_lookups[idx] = stats.hits + stats.misses;
+    tournament_info_.cache_opening_hits[idx] = stats.retained_hits;
+  }
+}
+
+void SelfPlayTournament::UpdateSprt() {
+  if (sprt_stopped_) return;
+  const auto& results = tournament_info_.results;
+  tournament_info_.llr = SprtLlr(results[0][0] + results[0][1],
+                                 results[1][0] + results[1][1],
+                                 results[2][0] + results[2][1], kSprtElo0,
+                                 kSprtElo1);
+  if (tournament_info_.llr >= tournament_info_.llr_upper) {
+    tournament_info_.sprt_result = 1;
+  } else if (tournament_info_.llr <= tournament_info_.llr_lower) {
+    tournament_info_.sprt_result = -1;
+  } else {
+    return;
+  }
+  sprt_stopped_ = true;
+  abort_ = true;
+  for (auto& game : games_)
+    if (game) game->Abort();
+}
+
 void SelfPlayTournament::Abort() {
   Mutex::Lock lock(mutex_);
   abort_ = true;
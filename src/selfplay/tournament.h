@@ -27,8 +27,11 @@
 
 #pragma once
 
+#include <chrono>
 #include <list>
+#include "neural/writer.h"
 #include "selfplay/game.h"
+#include "selfplay/openings.h"
 #include "utils/mutex.h"
 #include "utils/optionsdict.h"
 #include "utils/optionsparser.h"
@@ -67,7 +70,20 @@ class SelfPlayTournament {
 
  private:
   void Worker();
+  // Plays up to kParallelism games at once on the calling thread, and puts
+  // the positions of all of them in the same network batches.
+  void BatchedWorker();
   void PlayOneGame(int game_id);
+  // A game in progress, and what is needed to finish it.
+  struct GameState;
+  // Sets up game @game_number, ready to play.
+  std::unique_ptr<GameState> StartGame(int game_number);
+  // Reports the outcome of the game and removes it from games_.
+  void FinishGame(const GameState& state);
+  void UpdateCacheStats() REQUIRES(mutex_);
+  // Updates the SPRT with the results so far and stops the tournament once
+  // it's decided.
+  void UpdateSprt() REQUIRES(mutex_);
 
   Mutex mutex_;
   // Whether next game will be black for player1.
@@ -81,6 +97,15 @@ class SelfPlayTournament {
   std::list<std::unique_ptr<SelfPlayGame>> games_ GUARDED_BY(mutex_);
   // Place to store tournament stats.
   TournamentInfo tournament_info_ GUARDED_BY(mutex_);
+  int games_finished_ GUARDED_BY(mutex_) = 0;
+  // Opening of the last game started, and whether its second game with
+  // colors swapped is still to be played.
+  Opening opening_ GUARDED_BY(mutex_);
+  bool opening_pending_ GUARDED_BY(mutex_) = false;
+  // Set when the SPRT stopped the tournament, which then still finishes.
+  bool sprt_stopped_ GUARDED_BY(mutex_) = false;
+  const std::chrono::steady_clock::time_point start_time_ =
+      std::chrono::steady_clock::now();
 
   Mutex threads_mutex_;
   std::vector<std::thread> threads_ GUARDED_BY(threads_mutex_);
@@ -89,6 +114,10 @@ class SelfPlayTournament {
   // Shared pointers for both players may point to the same object.
   std::shared_ptr<Network> networks_[2];
   std::shared_ptr<NNCache> cache_[2];
+  // Shared by both players, null if not loaded.
+  std::unique_ptr<SyzygyTablebase> syzygy_tb_;
+  // Null if games start from the initial position.
+  std::unique_ptr<OpeningBook> openings_;
   const OptionsDict player_options_[2];
   SelfPlayLimits search_limits_[2];
 
@@ -102,6 +131,14 @@ class SelfPlayTournament {
   const size_t kParallelism;
   const bool kTraining;
   const float kResignPlaythrough;
+  const int kGameBatchSize;
+  const bool kSprt;
+  const float kSprtElo0;
+  const float kSprtElo1;
+
+  // Writes the training data of finished games, if training. The games are
+  // reported by game_callback_ once their file is complete.
+  std::unique_ptr<AsyncTrainingDataWriter> training_writer_;
 };
 
 }  // namespace lczero
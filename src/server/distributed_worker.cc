@@ -0,0 +1,236 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2019 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+
+  If you modify this Program, or any covered work, by linking or
+  combining it with NVIDIA Corporation's libraries from the NVIDIA CUDA
+  Toolkit and the NVIDIA CUDA Deep Neural Network library (or a
+  modified version of those libraries), containing parts covered by the
+  terms of the respective license agreement, the licensors of this
+  Program grant you additional permission to convey the resulting work.
+*/
+
+#include "server/distributed_worker.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include "mcts/distributed.h"
+#include "mcts/search.h"
+#include "neural/cache.h"
+#include "neural/factory.h"
+#include "server/listen.h"
+#include "utils/exception.h"
+#include "utils/logging.h"
+#include "utils/optionsparser.h"
+#include "utils/string.h"
+
+#ifndef _WIN32
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+namespace lczero {
+namespace {
+
+const OptionId kThreadsOptionId{"threads", "Threads",
+                                "Number of (CPU) worker threads to use.", 't'};
+const OptionId kNNCacheSizeId{
+    "nncache", "NNCacheSize",
+    "Number of positions to store in a memory cache. A large cache can speed "
+    "up searching, but takes memory."};
+const OptionId kHostId{"host", "",
+                       "Address to accept the coordinator on, \"::\" for all "
+                       "interfaces. The coordinator is not authenticated."};
+const OptionId kPortId{"port", "", "TCP port to accept the coordinator on."};
+const OptionId kReportIntervalId{
+    "report-interval", "",
+    "Milliseconds between the root stats sent to the coordinator."};
+
+#ifndef _WIN32
+// A coordinator, served until it disconnects.
+class WorkerSession {
+ public:
+  WorkerSession(int socket, Network* network, const OptionsDict& options,
+                NNCache* cache, NodeTree* tree)
+      : socket_(socket),
+        network_(network),
+        options_(options),
+        cache_(cache),
+        tree_(tree),
+        interval_(options.Get<int>(kReportIntervalId.GetId())) {}
+  ~WorkerSession() {
+    StopSearch();
+    close(socket_);
+  }
+
+  void Serve() {
+    std::string buffer;
+    char data[4096];
+    ssize_t size;
+    while ((size = recv(socket_, data, sizeof(data), 0)) > 0) {
+      buffer.append(data, size);
+      size_t end;
+      while ((end = buffer.find('\n')) != std::string::npos) {
+        const auto words = StrSplitAtWhitespace(buffer.substr(0, end));
+        buffer.erase(0, end + 1);
+        if (words.empty()) continue;
+        try {
+          Handle(words);
+        } catch (Exception& ex) {
+          Send(std::string("error ") + ex.what());
+        }
+      }
+    }
+  }
+
+ private:
+  void Handle(const std::vector<std::string>& words) {
+    if (words[0] == "position" && words.size() >= 2 && words[1] == "fen") {
+      StopSearch();
+      size_t pos = 2;
+      std::string fen;
+      for (; pos < words.size() && words[pos] != "moves"; ++pos) {
+        fen += (fen.empty() ? "" : " ") + words[pos];
+      }
+      std::vector<Move> moves;
+      for (++pos; pos < words.size(); ++pos) moves.emplace_back(words[pos]);
+      tree_->ResetToPosition(fen, moves);
+    } else if (words[0] == "own") {
+      stats_.SetOwnedMoves(0, ParseMoves(words, 1));
+    } else if (words[0] == "go" && words.size() == 2) {
+      StartSearch(words[1]);
+    } else if (words[0] == "stop") {
+      StopSearch();
+    } else {
+      throw Exception("Unknown command: " + words[0]);
+    }
+  }
+
+  void StartSearch(const std::string& id) {
+    StopSearch();
+    // Nothing of the previous search goes out with the new id.
+    stats_.Publish(0, SharedRootStats::TreeStats());
+    SearchLimits limits;
+    limits.infinite = true;
+    search_ = std::make_unique<Search>(
+        *tree_, network_, [](const BestMoveInfo&) {},
+        [](const std::vector<ThinkingInfo>&) {}, limits, options_, cache_,
+        nullptr);
+    search_->SetRootStats(&stats_, 0);
+    search_->StartThreads(options_.Get<int>(kThreadsOptionId.GetId()));
+    reporter_stop_ = false;
+    reporter_ = std::thread([this, id]() {
+      std::unique_lock<std::mutex> lock(reporter_mutex_);
+      while (!reporter_cv_.wait_for(lock, interval_,
+                                    [this]() { return reporter_stop_; })) {
+        if (!Send("stats " + id + " " + FormatTreeStats(stats_.Get(0)))) {
+          break;
+        }
+      }
+    });
+  }
+
+  void StopSearch() {
+    if (!search_) return;
+    {
+      std::lock_guard<std::mutex> lock(reporter_mutex_);
+      reporter_stop_ = true;
+    }
+    reporter_cv_.notify_all();
+    reporter_.join();
+    search_->Abort();
+    search_->Wait();
+    search_.reset();
+  }
+
+  bool Send(const std::string& line) {
+    const std::string data = line + "\n";
+    std::lock_guard<std::mutex> lock(send_mutex_);
+    return send(socket_, data.data(), data.size(), MSG_NOSIGNAL) ==
+           static_cast<ssize_t>(data.size());
+  }
+
+  const int socket_;
+  Network* const network_;
+  const OptionsDict& options_;
+  NNCache* const cache_;
+  NodeTree* const tree_;
+  const std::chrono::milliseconds interval_;
+
+  SharedRootStats stats_{1, true};
+  std::unique_ptr<Search> search_;
+  std::thread reporter_;
+  std::mutex reporter_mutex_;
+  std::condition_variable reporter_cv_;
+  bool reporter_stop_ = false;
+  // Errors come from the session thread, stats from the reporter.
+  std::mutex send_mutex_;
+};
+#endif
+
+}  // namespace
+
+void DistributedWorker::Run() {
+  OptionsParser options;
+  NetworkFactory::PopulateOptions(&options);
+  options.Add<IntOption>(kThreadsOptionId, 1, 128) = 2;
+  options.Add<IntOption>(kNNCacheSizeId, 0, 999999999) = 2000000;
+  options.Add<StringOption>(kHostId) = "127.0.0.1";
+  options.Add<IntOption>(kPortId, 1, 65535) = 7779;
+  options.Add<IntOption>(kReportIntervalId, 10, 60000) = 250;
+  SearchParams::Populate(&options);
+
+  if (!options.ProcessAllFlags()) return;
+
+#ifdef _WIN32
+  CERR << "The search worker is not supported on Windows.";
+#else
+  try {
+    auto option_dict = options.GetOptionsDict();
+    auto network = NetworkFactory::LoadNetwork(option_dict);
+    NNCache cache;
+    cache.SetCapacity(option_dict.Get<int>(kNNCacheSizeId.GetId()));
+    NodeTree tree;
+    const std::string host = option_dict.Get<std::string>(kHostId.GetId());
+    const int port = option_dict.Get<int>(kPortId.GetId());
+
+    const int listener = ListenTcp(host, port, 1);
+    CERR << "Accepting a search coordinator on " << host << " port " << port;
+    const int on = 1;
+
+    while (true) {
+      const int client = accept(listener, nullptr, nullptr);
+      if (client < 0) continue;
+      setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+      CERR << "Coordinator connected.";
+      WorkerSession(client, network.get(), option_dict, &cache, &tree)
+          .Serve();
+      CERR << "Coordinator disconnected.";
+    }
+  } catch (Exception& ex) {
+    CERR << ex.what();
+  }
+#endif
+}
+
+}  // namespace lczero
@@ -0,0 +1,289 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2019 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+
+  If you modify this Program, or any covered work, by linking or
+  combining it with NVIDIA Corporation's libraries from the NVIDIA CUDA
+  Toolkit and the NVIDIA CUDA Deep Neural Network library (or a
+  modified version of those libraries), containing parts covered by the
+  terms of the respective license agreement, the licensors of this
+  Program grant you additional permission to convey the resulting work.
+*/
+
+#include "server/eval_server.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include "neural/factory.h"
+#include "neural/remote_protocol.h"
+#include "server/listen.h"
+#include "utils/exception.h"
+#include "utils/logging.h"
+#include "utils/metrics.h"
+#include "utils/optionsparser.h"
+
+#ifndef _WIN32
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+namespace lczero {
+namespace {
+
+const OptionId kHostId{"host", "",
+                       "Address to accept clients on, \"::\" for all "
+                       "interfaces. Clients are not authenticated."};
+const OptionId kPortId{"port", "", "TCP port to accept clients on."};
+const OptionId kMaxClientsId{"max-clients", "",
+                             "Most clients connected at the same time."};
+const OptionId kMaxBatchId{
+    "max-batch", "",
+    "Largest batch a client may send, larger ones are refused. Should not "
+    "exceed the largest batch the backend takes."};
+
+Counter gPositionsMetric("lc0_evalserver_positions",
+                         "Positions evaluated for remote clients.");
+Gauge gLatencyMetric(
+    "lc0_evalserver_latency_ms",
+    "Average time from receiving a batch to sending its results.");
+Gauge gThroughputMetric("lc0_evalserver_positions_per_second",
+                        "Positions per second evaluated for remote clients.");
+Gauge gClientsMetric("lc0_evalserver_clients", "Connected remote clients.");
+
+#ifndef _WIN32
+// A client. Owned by its reader thread and by its batches in flight, the
+// last one closes the socket. Results are sent by a writer thread of the
+// connection, so that a slow client doesn't hold up the backend's threads.
+class EvalConnection : public std::enable_shared_from_this<EvalConnection> {
+ public:
+  EvalConnection(int socket, Network* network, uint32_t max_batch,
+                 RemoteStats* stats)
+      : socket_(socket),
+        network_(network),
+        max_batch_(max_batch),
+        stats_(stats) {}
+  ~EvalConnection() { close(socket_); }
+
+  void Serve() {
+    std::thread writer([this]() { WriteResults(); });
+    RemoteHeader header;
+    std::string payload;
+    while (ReceiveRemoteMessage(socket_, &header, &payload)) {
+      if (header.type != RemoteMessage::kEvaluate) break;
+      Evaluate(header, payload);
+    }
+    // Nothing more arrives, the batches in flight are still answered.
+    shutdown(socket_, SHUT_RD);
+    {
+      std::lock_guard<std::mutex> lock(results_mutex_);
+      closing_ = true;
+    }
+    results_cv_.notify_one();
+    writer.join();
+  }
+
+ private:
+  struct Result {
+    std::unique_ptr<NetworkComputation> computation;
+    uint32_t id;
+    std::chrono::steady_clock::time_point start;
+  };
+
+  void Evaluate(const RemoteHeader& request, const std::string& payload) {
+    const auto start = std::chrono::steady_clock::now();
+    if (request.count > max_batch_) {
+      Send({kRemoteMagic, RemoteMessage::kError, request.id, 0, 0},
+           "batch larger than " + std::to_string(max_batch_));
+      return;
+    }
+    std::unique_ptr<NetworkComputation> computation =
+        network_->NewComputation();
+    size_t pos = 0;
+    for (uint32_t i = 0; i < request.count; ++i) {
+      InputPlanes planes;
+      if (!DecodeRemotePlanes(payload, &pos, &planes)) {
+        Send({kRemoteMagic, RemoteMessage::kError, request.id, 0, 0},
+             "malformed request");
+        return;
+      }
+      computation->AddInput(std::move(planes));
+    }
+    // Owned by the callback, which hands it to the writer once the results
+    // are in.
+    auto* raw = computation.release();
+    auto self = shared_from_this();
+    const uint32_t id = request.id;
+    {
+      std::lock_guard<std::mutex> lock(results_mutex_);
+      ++in_flight_;
+    }
+    raw->ComputeAsync([self, raw, id, start]() {
+      std::lock_guard<std::mutex> lock(self->results_mutex_);
+      self->results_.push_back(
+          {std::unique_ptr<NetworkComputation>(raw), id, start});
+      --self->in_flight_;
+      self->results_cv_.notify_one();
+    });
+  }
+
+  // Sends the results as they come in, until the connection is closing and
+  // no batch is left in flight.
+  void WriteResults() {
+    while (true) {
+      Result result;
+      {
+        std::unique_lock<std::mutex> lock(results_mutex_);
+        results_cv_.wait(lock, [this]() {
+          return !results_.empty() || (closing_ && in_flight_ == 0);
+        });
+        if (results_.empty()) return;
+        result = std::move(results_.front());
+        results_.pop_front();
+      }
+      try {
+        result.computation->CheckAsyncError();
+      } catch (const std::exception& e) {
+        result.computation.reset();
+        Send({kRemoteMagic, RemoteMessage::kError, result.id, 0, 0},
+             e.what());
+        continue;
+      }
+      const int count = result.computation->GetBatchSize();
+      std::string results;
+      results.reserve(count * kRemoteResultSize);
+      for (int i = 0; i < count; ++i) {
+        EncodeRemoteResult(*result.computation, i, &results);
+      }
+      result.computation.reset();
+      Send({kRemoteMagic, RemoteMessage::kResults, result.id,
+            static_cast<uint32_t>(count), 0},
+           results);
+      const std::chrono::duration<double> elapsed =
+          std::chrono::steady_clock::now() - result.start;
+      gPositionsMetric.Add(count);
+      const std::string summary = stats_->Record(count, elapsed.count());
+      if (!summary.empty()) {
+        gLatencyMetric.Set(stats_->GetLatencyMs());
+        gThroughputMetric.Set(stats_->GetPositionsPerSecond());
+        CERR << summary;
+      }
+    }
+  }
+
+  void Send(const RemoteHeader& header, const std::string& payload) {
+    std::lock_guard<std::mutex> lock(send_mutex_);
+    // A dropped client ends its reader through recv().
+    SendRemoteMessage(socket_, header, payload);
+  }
+
+  const int socket_;
+  Network* const network_;
+  const uint32_t max_batch_;
+  RemoteStats* const stats_;
+  // Errors are sent by the reader, results by the writer.
+  std::mutex send_mutex_;
+
+  // Batches whose results are ready to send, from backend threads.
+  std::mutex results_mutex_;
+  std::condition_variable results_cv_;
+  std::deque<Result> results_;
+  int in_flight_ = 0;
+  bool closing_ = false;
+};
+#endif
+
+}  // namespace
+
+void EvalServer::Run() {
+  OptionsParser options;
+  NetworkFactory::PopulateOptions(&options);
+  MetricsExporter::PopulateOptions(&options);
+  options.Add<StringOption>(kHostId) = "127.0.0.1";
+  options.Add<IntOption>(kPortId, 1, 65535) = 7778;
+  options.Add<IntOption>(kMaxClientsId, 1, 4096) = 256;
+  options.Add<IntOption>(kMaxBatchId, 1, 65536) = 1024;
+  // Gathers the batches of all clients.
+  options.GetMutableDefaultsOptions()->Set<std::string>(
+      NetworkFactory::kBackendId.GetId(), "multiplexing");
+
+  if (!options.ProcessAllFlags()) return;
+
+#ifdef _WIN32
+  CERR << "The eval server is not supported on Windows.";
+#else
+  try {
+    auto option_dict = options.GetOptionsDict();
+    MetricsExporter metrics(option_dict);
+    auto network = NetworkFactory::LoadNetwork(option_dict);
+    RemoteStats stats(std::chrono::seconds(10));
+    const int max_clients = option_dict.Get<int>(kMaxClientsId.GetId());
+    const uint32_t max_batch = option_dict.Get<int>(kMaxBatchId.GetId());
+    const std::string host = option_dict.Get<std::string>(kHostId.GetId());
+    const int port = option_dict.Get<int>(kPortId.GetId());
+
+    const int listener = ListenTcp(host, port, 64);
+    CERR << "Accepting remote backends on " << host << " port " << port;
+    const int on = 1;
+
+    struct Client {
+      std::thread thread;
+      std::atomic<bool> done{false};
+    };
+    std::list<Client> clients;
+    while (true) {
+      const int client = accept(listener, nullptr, nullptr);
+      if (client < 0) continue;
+      // Threads of gone clients are joined as new ones arrive.
+      for (auto iter = clients.begin(); iter != clients.end();) {
+        if (iter->done) {
+          iter->thread.join();
+          iter = clients.erase(iter);
+        } else {
+          ++iter;
+        }
+      }
+      if (static_cast<int>(clients.size()) >= max_clients) {
+        close(client);
+        continue;
+      }
+      setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+      clients.emplace_back();
+      gClientsMetric.Set(clients.size());
+      Client* entry = &clients.back();
+      Network* net = network.get();
+      entry->thread = std::thread([client, net, max_batch, &stats, entry]() {
+        std::make_shared<EvalConnection>(client, net, max_batch, &stats)
+            ->Serve();
+        entry->done = true;
+      });
+    }
+  } catch (Exception& ex) {
+    CERR << ex.what();
+  }
+#endif
+}
+
+}  // namespace lczero
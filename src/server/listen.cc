@@ -0,0 +1,80 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2019 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+
+  If you modify this Program, or any covered work, by linking or
+  combining it with NVIDIA Corporation's libraries from the NVIDIA CUDA
+  Toolkit and the NVIDIA CUDA Deep Neural Network library (or a
+  modified version of those libraries), containing parts covered by the
+  terms of the respective license agreement, the licensors of this
+  Program grant you additional permission to convey the resulting work.
+*/
+
+#include "server/listen.h"
+
+#include "utils/exception.h"
+
+#ifndef _WIN32
+#include <netdb.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+namespace lczero {
+
+int ListenTcp(const std::string& host, int port, int backlog) {
+#ifdef _WIN32
+  throw Exception("Listening for connections is not supported on Windows");
+#else
+  addrinfo hints = {};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+  addrinfo* addresses = nullptr;
+  const std::string service = std::to_string(port);
+  if (getaddrinfo(host.c_str(), service.c_str(), &hints, &addresses) != 0) {
+    throw Exception("Unable to resolve " + host);
+  }
+  int listener = -1;
+  for (auto* address = addresses; address; address = address->ai_next) {
+    listener =
+        socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+    if (listener < 0) continue;
+    const int on = 1;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if (address->ai_family == AF_INET6) {
+      const int off = 0;
+      setsockopt(listener, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+    }
+    if (bind(listener, address->ai_addr, address->ai_addrlen) == 0 &&
+        listen(listener, backlog) == 0) {
+      break;
+    }
+    close(listener);
+    listener = -1;
+  }
+  freeaddrinfo(addresses);
+  if (listener < 0) {
+    throw Exception("Unable to listen on " + host + " port " + service);
+  }
+  return listener;
+#endif
+}
+
+}  // namespace lczero
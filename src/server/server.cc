@@ -0,0 +1,239 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2018 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+
+  If you modify this Program, or any covered work, by linking or
+  combining it with NVIDIA Corporation's libraries from the NVIDIA CUDA
+  Toolkit and the NVIDIA CUDA Deep Neural Network library (or a
+  modified version of those libraries), containing parts covered by the
+  terms of the respective license agreement, the licensors of this
+  Program grant you additional permission to convey the resulting work.
+*/
+
+#include "server/server.h"
+
+#include <list>
+#include <memory>
+#include <thread>
+#include "engine.h"
+#include "neural/cache.h"
+#include "neural/factory.h"
+#include "server/listen.h"
+#include "syzygy/syzygy.h"
+#include "utils/exception.h"
+#include "utils/logging.h"
+#include "utils/optionsparser.h"
+
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+namespace lczero {
+namespace {
+
+const OptionId kHostId{"host", "",
+                       "Address to accept sessions on, \"::\" for all "
+                       "interfaces. Sessions are not authenticated."};
+const OptionId kPortId{"port", "", "TCP port to accept sessions on."};
+const OptionId kMaxSessionsId{"max-sessions", "",
+                              "Most sessions connected at the same time."};
+const OptionId kSessionThreadsId{
+    "session-threads", "", "Most search threads a session's search may use."};
+const OptionId kSessionNodesId{
+    "session-nodes", "",
+    "Most visits a session's search may reach, 0 for no limit."};
+const OptionId kNNCacheSizeId{
+    "nncache", "NNCacheSize",
+    "Number of positions to store in the NN cache shared by all sessions."};
+const OptionId kSyzygyTablebaseId{
+    "syzygy-paths", "SyzygyPath",
+    "List of Syzygy tablebase directories, list entries separated by system "
+    "separator (\";\" for Windows, \":\" for Linux)."};
+const OptionId kTreeDirId{
+    "tree-dir", "",
+    "Directory in which sessions may save and load trees with savetree and "
+    "loadtree, by file name. These commands are refused if it's empty."};
+
+#ifndef _WIN32
+// Longest line a session may send, far more than any UCI command needs.
+const size_t kMaxLineLength = 1 << 20;
+
+// A UCI engine whose input and output is a connection.
+class ServerSession : public EngineLoop {
+ public:
+  ServerSession(int socket, const EngineController::SharedResources* shared,
+                const std::string& tree_dir)
+      : EngineLoop(shared), socket_(socket), tree_dir_(tree_dir) {}
+  ~ServerSession() { close(socket_); }
+
+  void RunLoop() override {
+    std::string pending;
+    char buffer[4096];
+    while (true) {
+      const auto n = recv(socket_, buffer, sizeof(buffer), 0);
+      if (n <= 0) return;
+      pending.append(buffer, n);
+      size_t end;
+      while ((end = pending.find('\n')) != std::string::npos) {
+        std::string line = pending.substr(0, end);
+        pending.erase(0, end + 1);
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        if (!ProcessLine(line)) return;
+      }
+      if (pending.size() > kMaxLineLength) {
+        LOGFILE << "Session sent a line over " << kMaxLineLength
+                << " bytes, disconnecting.";
+        return;
+      }
+    }
+  }
+
+  void CmdSaveTree(const std::string& filename) override {
+    EngineLoop::CmdSaveTree(GetTreePath(filename));
+  }
+
+  void CmdLoadTree(const std::string& filename) override {
+    EngineLoop::CmdLoadTree(GetTreePath(filename));
+  }
+
+  void SendResponses(const std::vector<std::string>& responses) override {
+    std::string output;
+    for (const auto& response : responses) output += response + "\n";
+    std::lock_guard<std::mutex> lock(send_mutex_);
+    size_t sent = 0;
+    while (sent < output.size()) {
+      const auto n = send(socket_, output.data() + sent, output.size() - sent,
+                          MSG_NOSIGNAL);
+      // A dropped connection ends the session through recv().
+      if (n <= 0) return;
+      sent += n;
+    }
+  }
+
+ private:
+  // Remote clients may only use plain file names within the tree directory.
+  std::string GetTreePath(const std::string& filename) const {
+    if (tree_dir_.empty()) {
+      throw Exception("Trees can't be saved or loaded in this session");
+    }
+    if (filename.empty() || filename[0] == '.' ||
+        filename.find_first_of("/\\") != std::string::npos) {
+      throw Exception("Invalid tree file name: " + filename);
+    }
+    return tree_dir_ + "/" + filename;
+  }
+
+  const int socket_;
+  const std::string tree_dir_;
+  // Bestmove and info come from search threads.
+  std::mutex send_mutex_;
+};
+#endif
+
+}  // namespace
+
+void EngineServer::Run() {
+  OptionsParser options;
+  NetworkFactory::PopulateOptions(&options);
+  options.Add<StringOption>(kHostId) = "127.0.0.1";
+  options.Add<IntOption>(kPortId, 1, 65535) = 7777;
+  options.Add<IntOption>(kMaxSessionsId, 1, 1024) = 16;
+  options.Add<IntOption>(kSessionThreadsId, 1, 128) = 2;
+  options.Add<IntOption>(kSessionNodesId, 0, 999999999) = 0;
+  options.Add<IntOption>(kNNCacheSizeId, 0, 999999999) = 2000000;
+  options.Add<StringOption>(kSyzygyTablebaseId);
+  options.Add<StringOption>(kTreeDirId);
+
+  if (!options.ProcessAllFlags()) return;
+
+#ifdef _WIN32
+  CERR << "The engine server is not supported on Windows.";
+#else
+  try {
+    auto option_dict = options.GetOptionsDict();
+
+    auto network = NetworkFactory::LoadNetwork(option_dict);
+    NNCache cache(option_dict.Get<int>(kNNCacheSizeId.GetId()));
+    std::unique_ptr<SyzygyTablebase> syzygy_tb;
+    const std::string tb_paths =
+        option_dict.Get<std::string>(kSyzygyTablebaseId.GetId());
+    if (!tb_paths.empty()) {
+      syzygy_tb = std::make_unique<SyzygyTablebase>();
+      CERR << "Loading Syzygy tablebases from " << tb_paths;
+      if (!syzygy_tb->init(tb_paths)) {
+        CERR << "Failed to load Syzygy tablebases!";
+        syzygy_tb.reset();
+      }
+    }
+
+    EngineController::SharedResources shared;
+    shared.network = network.get();
+    shared.cache = &cache;
+    shared.syzygy_tb = syzygy_tb.get();
+    shared.max_threads = option_dict.Get<int>(kSessionThreadsId.GetId());
+    shared.max_visits = option_dict.Get<int>(kSessionNodesId.GetId());
+    const int max_sessions = option_dict.Get<int>(kMaxSessionsId.GetId());
+    const std::string tree_dir =
+        option_dict.Get<std::string>(kTreeDirId.GetId());
+    const std::string host = option_dict.Get<std::string>(kHostId.GetId());
+    const int port = option_dict.Get<int>(kPortId.GetId());
+
+    const int listener = ListenTcp(host, port, 16);
+    CERR << "Accepting sessions on " << host << " port " << port;
+
+    struct Session {
+      std::thread thread;
+      std::atomic<bool> done{false};
+    };
+    std::list<Session> sessions;
+    while (true) {
+      const int client = accept(listener, nullptr, nullptr);
+      if (client < 0) continue;
+      // Threads of closed sessions are joined as new ones arrive.
+      for (auto iter = sessions.begin(); iter != sessions.end();) {
+        if (iter->done) {
+          iter->thread.join();
+          iter = sessions.erase(iter);
+        } else {
+          ++iter;
+        }
+      }
+      if (static_cast<int>(sessions.size()) >= max_sessions) {
+        const std::string error = "error Too many sessions\n";
+        send(client, error.data(), error.size(), MSG_NOSIGNAL);
+        close(client);
+        continue;
+      }
+      sessions.emplace_back();
+      Session* session = &sessions.back();
+      session->thread = std::thread([client, &shared, &tree_dir, session]() {
+        {
+          ServerSession loop(client, &shared, tree_dir);
+          loop.RunLoop();
+        }
+        session->done = true;
+      });
+    }
+  } catch (Exception& ex) {
+    CERR << ex.what();
+  }
+#endif
+}
+
+}  // namespace lczero
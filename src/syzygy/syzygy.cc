@@ -31,16 +31,20 @@
   Program grant you additional permission to convey the resulting work.
 */
 
+#include <algorithm>
 #include <atomic>
+#include <condition_variable>
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <fstream>
+#include <functional>
 #include <mutex>
 #include <random>
 #include <sstream>
 #include <string>
+#include <tuple>
 
 #include "syzygy/syzygy.h"
 
@@ -130,9 +134,17 @@ struct EncInfo {
 
 struct BaseEntry {
   Key key;
+  // File name without suffix, e.g. "KQvK".
+  char name[16];
   uint8_t* data[3];
   map_t mapping[3];
   std::atomic<bool> ready[3];
+  // Whether the table is queued to the initializer thread.
+  std::atomic<bool> queued[3];
+  // Memory budget clock when the table was last probed, and whether it counts
+  // against the budget, i.e. it wasn't dropped from memory since.
+  std::atomic<uint32_t> last_used[3];
+  std::atomic<bool> resident[3];
   uint8_t num;
   bool symmetric;
   bool hasPawns;
@@ -994,6 +1006,8 @@ class SyzygyTablebaseImpl {
   }
 
   ~SyzygyTablebaseImpl() {
+    // Waits for the tables being initialized.
+    init_pool_.reset();
     // if pathString was set there may be entries in need of cleaning.
     if (!paths_.empty()) {
       for (int i = 0; i < num_piece_entries_; i++)
@@ -1005,8 +1019,82 @@ class SyzygyTablebaseImpl {
 
   int max_cardinality() const { return max_cardinality_; }
 
-  int probe_wdl_table(const ChessBoard& pos, int* success) {
-    return probe_table(pos, 0, success, WDL);
+  size_t preload(int max_pieces, bool lock) {
+    size_t bytes = 0;
+    bool lock_failed = false;
+    auto preload_entry = [&](BaseEntry* be) {
+      if (be->num > max_pieces) return;
+      for (int type : {WDL, DTZ}) {
+        if (type == DTZ && !be->hasDtz) continue;
+        {
+          Mutex::Lock ready_lock(ready_mutex_);
+          if (!atomic_load_explicit(&be->ready[type],
+                                    std::memory_order_relaxed)) {
+            if (!init_table(be, be->name, type)) continue;
+            atomic_store_explicit(&be->ready[type], true,
+                                  std::memory_order_release);
+          }
+        }
+#ifndef _WIN32
+        const size_t size = be->mapping[type];
+        madvise(be->data[type], size, MADV_WILLNEED);
+        if (lock && !lock_failed && mlock(be->data[type], size) != 0) {
+          CERR << "Could not lock Syzygy tables in memory, RLIMIT_MEMLOCK "
+                  "may be too low.";
+          lock_failed = true;
+        }
+        bytes += size;
+#else
+        (void)lock;
+#endif
+      }
+    };
+    for (int i = 0; i < num_piece_entries_; i++) {
+      preload_entry(&piece_entries_[i]);
+    }
+    for (int i = 0; i < num_pawn_entries_; i++) {
+      preload_entry(&pawn_entries_[i]);
+    }
+    return bytes;
+  }
+
+  void set_memory_budget(size_t bytes) {
+    memory_budget_.store(bytes, std::memory_order_relaxed);
+    if (bytes) queue_budget_check();
+  }
+
+  SyzygyTablebase::MappingStats get_mapping_stats() {
+    SyzygyTablebase::MappingStats stats;
+#ifndef _WIN32
+    // Without a budget, nothing is dropped from memory.
+    const bool budget = memory_budget_.load(std::memory_order_relaxed) != 0;
+    for_each_ready_table([&](BaseEntry* be, int type) {
+      stats.tables++;
+      stats.mapped_bytes += be->mapping[type];
+      if (!budget || be->resident[type].load(std::memory_order_relaxed)) {
+        stats.resident_bytes += be->mapping[type];
+      }
+    });
+#endif
+    stats.evictions = evictions_.load(std::memory_order_relaxed);
+    return stats;
+  }
+
+  // Queues the tables of all the material reachable from @pos by captures
+  // and promotions to the initializer thread.
+  void prepare(const ChessBoard& pos) {
+    int root[16] = {0};
+    for (int pt = PAWN; pt <= KING; pt++) {
+      root[pt] = count_pieces(pos, pt, pos.flipped());
+      root[pt + 8] = count_pieces(pos, pt, !pos.flipped());
+    }
+    int pcs[16] = {0};
+    pcs[W_KING] = pcs[B_KING] = 1;
+    prepare_side(root, pcs, 0, PAWN, 2);
+  }
+
+  int probe_wdl_table(const ChessBoard& pos, int* success, bool wait) {
+    return probe_table(pos, 0, success, WDL, wait);
   }
 
   int probe_dtm_table(const ChessBoard& pos, int won, int* success) {
@@ -1130,6 +1218,7 @@ class SyzygyTablebaseImpl {
             : static_cast<BaseEntry*>(&piece_entries_[num_piece_entries_++]);
     be->hasPawns = has_pawns;
     be->key = key;
+    snprintf(be->name, sizeof(be->name), "%s", str);
     be->symmetric = key == key2;
     be->num = 0;
     for (int i = 0; i < 16; i++) be->num += pcs[i];
@@ -1143,7 +1232,12 @@ class SyzygyTablebaseImpl {
       max_cardinality_dtm_ =
           std::max(max_cardinality_dtm_, static_cast<int>(be->num));
 
-    for (int type = 0; type < 3; type++) be->ready[type] = 0;
+    for (int type = 0; type < 3; type++) {
+      be->ready[type] = 0;
+      be->queued[type] = false;
+      be->last_used[type] = 0;
+      be->resident[type] = false;
+    }
 
     if (!be->hasPawns) {
       int j = 0;
@@ -1316,7 +1410,139 @@ class SyzygyTablebaseImpl {
     return true;
   }
 
-  int probe_table(const ChessBoard& pos, int s, int* success, const int type) {
+  template <typename Fn>
+  void for_each_ready_table(const Fn& fn) {
+    auto visit = [&](BaseEntry* be) {
+      for (int type = 0; type < 3; type++) {
+        if (atomic_load_explicit(&be->ready[type],
+                                 std::memory_order_acquire)) {
+          fn(be, type);
+        }
+      }
+    };
+    for (int i = 0; i < num_piece_entries_; i++) visit(&piece_entries_[i]);
+    for (int i = 0; i < num_pawn_entries_; i++) visit(&pawn_entries_[i]);
+  }
+
+  // Marks the table as probed now. A table not resident becomes so, which may
+  // take the memory budget over.
+  void touch(BaseEntry* be, int type) {
+    const uint32_t now = clock_.load(std::memory_order_relaxed);
+    // Only written when the clock moved, to keep the cache line shared.
+    if (be->last_used[type].load(std::memory_order_relaxed) != now) {
+      be->last_used[type].store(now, std::memory_order_relaxed);
+    }
+    if (be->resident[type].load(std::memory_order_relaxed) ||
+        atomic_exchange(&be->resident[type], true)) {
+      return;
+    }
+    be->last_used[type].store(clock_.fetch_add(1) + 1,
+                              std::memory_order_relaxed);
+    queue_budget_check();
+  }
+
+  void queue_budget_check() {
+    if (atomic_exchange(&budget_check_queued_, true)) return;
+    init_pool_->Add([this]() {
+      budget_check_queued_ = false;
+      enforce_budget();
+    });
+  }
+
+  // Drops the tables probed least recently from memory until the resident
+  // ones fit in the budget. They stay mapped, as probes may be reading them,
+  // and come back in page by page when probed again.
+  void enforce_budget() {
+#ifndef _WIN32
+    const size_t budget = memory_budget_.load(std::memory_order_relaxed);
+    if (budget == 0) return;
+    std::vector<std::tuple<uint32_t, BaseEntry*, int>> tables;
+    size_t total = 0;
+    for_each_ready_table([&](BaseEntry* be, int type) {
+      if (!be->resident[type].load(std::memory_order_relaxed)) return;
+      tables.emplace_back(be->last_used[type].load(std::memory_order_relaxed),
+                          be, type);
+      total += be->mapping[type];
+    });
+    std::sort(tables.begin(), tables.end());
+    // The table probed last is kept even if it doesn't fit alone.
+    for (size_t i = 0; i + 1 < tables.size() && total > budget; i++) {
+      BaseEntry* be = std::get<1>(tables[i]);
+      const int type = std::get<2>(tables[i]);
+      be->resident[type] = false;
+      madvise(be->data[type], be->mapping[type], MADV_DONTNEED);
+      // Also drops it from the page cache, e.g. of a network file system.
+      const std::string fname = name_for_tb(be->name, kSuffix[type]);
+      const int fd = ::open(fname.c_str(), O_RDONLY);
+      if (fd != -1) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        ::close(fd);
+      }
+      total -= be->mapping[type];
+      evictions_.fetch_add(1, std::memory_order_relaxed);
+    }
+#endif
+  }
+
+  int find_entry(Key key) const {
+    int hash_idx = key >> (64 - TB_HASHBITS);
+    while (tb_hash_[hash_idx].key && tb_hash_[hash_idx].key != key) {
+      hash_idx = (hash_idx + 1) & ((1 << TB_HASHBITS) - 1);
+    }
+    return hash_idx;
+  }
+
+  // Enumerates the piece counts of color @color (0 white, 8 black) from
+  // piece type @pt on, given @promotions pawns promoted so far, then those of
+  // the other color, up to max_cardinality_ pieces in all.
+  void prepare_side(const int* root, int* pcs, int color, int pt,
+                    int count) {
+    if (pt == KING) {
+      if (color == 0) {
+        prepare_side(root, pcs, 8, PAWN, count);
+        return;
+      }
+      if (count == 2) return;  // KvK has no table.
+      const int hash_idx = find_entry(calc_key_from_pcs(pcs, false));
+      BaseEntry* be = tb_hash_[hash_idx].ptr;
+      if (!be) return;
+      queue_init(be, hash_idx, WDL);
+      if (be->hasDtz) queue_init(be, hash_idx, DTZ);
+      return;
+    }
+    // Pawns come first, those missing may have promoted to any piece.
+    int promoted = root[color + PAWN];
+    for (int i = PAWN; i < pt; i++) {
+      promoted -= i == PAWN ? pcs[color + i]
+                            : std::max(0, pcs[color + i] - root[color + i]);
+    }
+    const int max = pt == PAWN ? root[color + pt] : root[color + pt] + promoted;
+    for (int n = 0; n <= max && count + n <= max_cardinality_; n++) {
+      pcs[color + pt] = n;
+      prepare_side(root, pcs, color, pt + 1, count + n);
+    }
+    pcs[color + pt] = 0;
+  }
+
+  void queue_init(BaseEntry* be, int hash_idx, int type) {
+    if (atomic_exchange(&be->queued[type], true)) return;
+    init_pool_->Add([this, be, hash_idx, type]() {
+      Mutex::Lock lock(ready_mutex_);
+      if (atomic_load_explicit(&be->ready[type], std::memory_order_relaxed)) {
+        return;
+      }
+      if (!init_table(be, be->name, type)) {
+        tb_hash_[hash_idx].ptr = nullptr;  // mark as deleted
+        return;
+      }
+      atomic_store_explicit(&be->ready[type], true, std::memory_order_release);
+    });
+  }
+
+  // Unless @wait, fails right away if the table isn't initialized, and queues
+  // it to the initializer thread.
+  int probe_table(const ChessBoard& pos, int s, int* success, const int type,
+                  bool wait = true) {
     // Obtain the position's material-signature key
     const Key key = calc_key_from_position(pos);
 
@@ -1326,10 +1552,7 @@ class SyzygyTablebaseImpl {
       return 0;
     }
 
-    int hash_idx = key >> (64 - TB_HASHBITS);
-    while (tb_hash_[hash_idx].key && tb_hash_[hash_idx].key != key) {
-      hash_idx = (hash_idx + 1) & ((1 << TB_HASHBITS) - 1);
-    }
+    const int hash_idx = find_entry(key);
     if (!tb_hash_[hash_idx].ptr) {
       *success = 0;
       return 0;
@@ -1343,6 +1566,11 @@ class SyzygyTablebaseImpl {
 
     // Use double-checked locking to reduce locking overhead
     if (!atomic_load_explicit(&be->ready[type], std::memory_order_acquire)) {
+      if (!wait) {
+        queue_init(be, hash_idx, type);
+        *success = 0;
+        return 0;
+      }
       Mutex::Lock lock(ready_mutex_);
       if (!atomic_load_explicit(&be->ready[type], std::memory_order_relaxed)) {
         char str[16];
@@ -1356,6 +1584,7 @@ class SyzygyTablebaseImpl {
                               std::memory_order_release);
       }
     }
+    if (memory_budget_.load(std::memory_order_relaxed)) touch(be, type);
 
     bool bside, flip;
     if (!be->symmetric) {
@@ -1449,6 +1678,14 @@ class SyzygyTablebaseImpl {
 
   Mutex ready_mutex_;
   std::string paths_;
+  // Initializes tables off the search threads.
+  std::unique_ptr<ThreadPool> init_pool_ = std::make_unique<ThreadPool>(1);
+  // Bytes of tables kept in memory at most, 0 for no limit.
+  std::atomic<size_t> memory_budget_{0};
+  // Ticks whenever a table becomes resident.
+  std::atomic<uint32_t> clock_{0};
+  std::atomic<bool> budget_check_queued_{false};
+  std::atomic<uint64_t> evictions_{0};
 
   int num_piece_entries_ = 0;
   int num_pawn_entries_ = 0;
@@ -1461,12 +1698,58 @@ class SyzygyTablebaseImpl {
   std::vector<TbHashEntry> tb_hash_;
 };
 
+SyzygyProbeCache::SyzygyProbeCache()
+    : entries_(new std::atomic<uint64_t>[1 << kSizeBits]) {
+  Clear();
+}
+
+void SyzygyProbeCache::Clear() {
+  for (int i = 0; i < 1 << kSizeBits; ++i) {
+    entries_[i].store(0, std::memory_order_relaxed);
+  }
+}
+
+// An entry is the upper 32 bits of the hash, then 8 bits of state (offset to
+// never be 0, which marks empty entries) and 24 bits of value.
+bool SyzygyProbeCache::Lookup(uint64_t hash, int* value, ProbeState* state) {
+  lookups_.fetch_add(1, std::memory_order_relaxed);
+  const uint64_t entry = entries_[hash & ((1 << kSizeBits) - 1)].load(
+      std::memory_order_relaxed);
+  if (entry == 0 || (entry >> 32) != (hash >> 32)) return false;
+  *state = static_cast<ProbeState>(static_cast<int>((entry >> 24) & 0xFF) - 2);
+  // Sign extend the value.
+  *value = static_cast<int32_t>(static_cast<uint32_t>(entry << 8)) >> 8;
+  hits_.fetch_add(1, std::memory_order_relaxed);
+  return true;
+}
+
+void SyzygyProbeCache::Insert(uint64_t hash, int value, ProbeState state) {
+  const uint64_t entry = (hash & 0xFFFFFFFF00000000ULL) |
+                         (static_cast<uint64_t>(state + 2) << 24) |
+                         (static_cast<uint32_t>(value) & 0xFFFFFF);
+  entries_[hash & ((1 << kSizeBits) - 1)].store(entry,
+                                                std::memory_order_relaxed);
+}
+
 SyzygyTablebase::SyzygyTablebase() : max_cardinality_(0) {}
 
 SyzygyTablebase::~SyzygyTablebase() = default;
 
 bool SyzygyTablebase::init(const std::string& paths) {
   paths_ = paths;
+  std::unique_ptr<ThreadPool> prober;
+  {
+    Mutex::Lock lock(pending_mutex_);
+    prober = std::move(prober_);
+  }
+  // Waits for the background probes, which lock pending_mutex_ when done.
+  prober.reset();
+  {
+    Mutex::Lock lock(pending_mutex_);
+    pending_.clear();
+  }
+  wdl_cache_.Clear();
+  dtz_cache_.Clear();
   impl_.reset(new SyzygyTablebaseImpl(paths_));
   max_cardinality_ = impl_->max_cardinality();
   if (max_cardinality_ <= 2) {
@@ -1490,7 +1773,8 @@ bool SyzygyTablebase::init(const std::string& paths) {
 // store wrong values for positions where the best move is an ep-move (even if
 // losing). So in all these cases set the state to ZEROING_BEST_MOVE.
 template <bool CheckZeroingMoves>
-WDLScore SyzygyTablebase::search(const Position& pos, ProbeState* result) {
+WDLScore SyzygyTablebase::search(const Position& pos, ProbeState* result,
+                                 bool wait) {
   WDLScore value;
   WDLScore best_value = WDL_LOSS;
   auto move_list = pos.GetBoard().GenerateLegalMoves();
@@ -1503,7 +1787,7 @@ WDLScore SyzygyTablebase::search(const Position& pos, ProbeState* result) {
     }
     move_count++;
     auto new_pos = Position(pos, move);
-    value = static_cast<WDLScore>(-search(new_pos, result));
+    value = static_cast<WDLScore>(-search(new_pos, result, wait));
     if (*result == FAIL) return WDL_DRAW;
     if (value > best_value) {
       best_value = value;
@@ -1525,7 +1809,7 @@ WDLScore SyzygyTablebase::search(const Position& pos, ProbeState* result) {
   } else {
     int raw_result = static_cast<int>(ProbeState::OK);
     value = static_cast<WDLScore>(
-        impl_->probe_wdl_table(pos.GetBoard(), &raw_result));
+        impl_->probe_wdl_table(pos.GetBoard(), &raw_result, wait));
     *result = static_cast<ProbeState>(raw_result);
     if (*result == FAIL) return WDL_DRAW;
   }
@@ -1547,8 +1831,15 @@ WDLScore SyzygyTablebase::search(const Position& pos, ProbeState* result) {
 //  1 : win, but draw under 50-move rule
 //  2 : win
 WDLScore SyzygyTablebase::probe_wdl(const Position& pos, ProbeState* result) {
+  const uint64_t hash = pos.GetBoard().Hash();
+  int value;
+  if (wdl_cache_.Lookup(hash, &value, result)) {
+    return static_cast<WDLScore>(value);
+  }
   *result = OK;
-  return search(pos, result);
+  const WDLScore wdl = search(pos, result);
+  wdl_cache_.Insert(hash, wdl, *result);
+  return wdl;
 }
 
 // Probe the DTZ table for a particular position.
@@ -1577,6 +1868,101 @@ WDLScore SyzygyTablebase::probe_wdl(const Position& pos, ProbeState* result) {
 // In short, if a move is available resulting in dtz + 50-move-counter <= 99,
 // then do not accept moves leading to dtz + 50-move-counter == 100.
 int SyzygyTablebase::probe_dtz(const Position& pos, ProbeState* result) {
+  // The result doesn't depend on the 50 move counter, so the board is
+  // enough of a key.
+  const uint64_t hash = pos.GetBoard().Hash();
+  int dtz;
+  if (dtz_cache_.Lookup(hash, &dtz, result)) return dtz;
+  dtz = probe_dtz_uncached(pos, result);
+  dtz_cache_.Insert(hash, dtz, *result);
+  return dtz;
+}
+
+WDLScore SyzygyTablebase::probe_wdl_nowait(const Position& pos,
+                                           ProbeState* result) {
+  const uint64_t hash = pos.GetBoard().Hash();
+  int value;
+  if (wdl_cache_.Lookup(hash, &value, result)) {
+    return static_cast<WDLScore>(value);
+  }
+  *result = OK;
+  const WDLScore wdl = search(pos, result, false);
+  // A failure may only mean that a table isn't initialized yet.
+  if (*result != FAIL) wdl_cache_.Insert(hash, wdl, *result);
+  return wdl;
+}
+
+void SyzygyTablebase::probe_wdl_batch(const std::vector<Position>& positions,
+                                      WDLScore* wdl, ProbeState* results) {
+  std::vector<std::tuple<Key, uint64_t, size_t>> order;
+  order.reserve(positions.size());
+  for (size_t i = 0; i < positions.size(); i++) {
+    const ChessBoard& board = positions[i].GetBoard();
+    order.emplace_back(calc_key_from_position(board), board.Hash(), i);
+  }
+  std::sort(order.begin(), order.end());
+  for (size_t i = 0; i < order.size(); i++) {
+    const size_t idx = std::get<2>(order[i]);
+    if (i > 0 && std::get<1>(order[i - 1]) == std::get<1>(order[i])) {
+      const size_t prev = std::get<2>(order[i - 1]);
+      wdl[idx] = wdl[prev];
+      results[idx] = results[prev];
+      continue;
+    }
+    wdl[idx] = probe_wdl_nowait(positions[idx], &results[idx]);
+  }
+}
+
+void SyzygyTablebase::prepare(const Position& pos) {
+  if (impl_) impl_->prepare(pos.GetBoard());
+}
+
+bool SyzygyTablebase::probe_wdl_async(const Position& pos, WDLScore* wdl,
+                                      ProbeState* result) {
+  const uint64_t hash = pos.GetBoard().Hash();
+  int value;
+  if (wdl_cache_.Lookup(hash, &value, result)) {
+    *wdl = static_cast<WDLScore>(value);
+    return true;
+  }
+  Mutex::Lock lock(pending_mutex_);
+  // Beyond that the disk is the bottleneck anyway.
+  const size_t kMaxPendingProbes = 256;
+  if (pending_.size() >= kMaxPendingProbes || !pending_.insert(hash).second) {
+    return false;
+  }
+  if (!prober_) prober_ = std::make_unique<ThreadPool>(4);
+  prober_->Add([this, pos, hash]() {
+    ProbeState state;
+    probe_wdl(pos, &state);
+    Mutex::Lock lock(pending_mutex_);
+    pending_.erase(hash);
+  });
+  return false;
+}
+
+size_t SyzygyTablebase::preload(int max_pieces, bool lock) {
+  if (!impl_) return 0;
+  return impl_->preload(max_pieces, lock);
+}
+
+void SyzygyTablebase::set_memory_budget(size_t bytes) {
+  if (impl_) impl_->set_memory_budget(bytes);
+}
+
+SyzygyTablebase::MappingStats SyzygyTablebase::GetMappingStats() const {
+  return impl_ ? impl_->get_mapping_stats() : MappingStats();
+}
+
+SyzygyTablebase::CacheStats SyzygyTablebase::GetCacheStats() const {
+  CacheStats stats;
+  stats.hits = wdl_cache_.GetHits() + dtz_cache_.GetHits();
+  stats.lookups = wdl_cache_.GetLookups() + dtz_cache_.GetLookups();
+  return stats;
+}
+
+int SyzygyTablebase::probe_dtz_uncached(const Position& pos,
+                                        ProbeState* result) {
   *result = OK;
   const WDLScore wdl = search<true>(pos, result);
   if (*result == FAIL || wdl == WDL_DRAW) {  // DTZ tables don't store draws
@@ -1608,7 +1994,7 @@ int SyzygyTablebase::probe_dtz(const Position& pos, ProbeState* result) {
                   : -probe_dtz(next_pos, result);
     // If the move mates, force minDTZ to 1
     if (dtz == 1 && next_pos.GetBoard().IsUnderCheck() &&
-        next_pos.GetBoard().GenerateLegalMoves().empty()) {
+        !next_pos.GetBoard().HasAnyLegalMove()) {
       min_DTZ = 1;
     }
     // Convert result from 1-ply search. Zeroing moves are already accounted by
@@ -1622,6 +2008,32 @@ int SyzygyTablebase::probe_dtz(const Position& pos, ProbeState* result) {
   return min_DTZ == 0xFFFF ? -1 : min_DTZ;
 }
 
+namespace {
+// Runs @fn(i) for every i in [0, count), on up to @threads threads of the
+// default pool, the calling one being one of them.
+void ParallelFor(int count, int threads, const std::function<void(int)>& fn) {
+  std::atomic<int> next{0};
+  const auto run = [&]() {
+    for (int i = next++; i < count; i = next++) fn(i);
+  };
+  const int helpers = std::max(0, std::min(threads, count) - 1);
+  Mutex mutex;
+  std::condition_variable cv;
+  int done = 0;
+  for (int i = 0; i < helpers; i++) {
+    ThreadPool::Default().Add([&]() {
+      run();
+      Mutex::Lock lock(mutex);
+      if (++done == helpers) cv.notify_one();
+    });
+  }
+  run();
+  Mutex::Lock lock(mutex);
+  cv.wait(lock.get_raw(),
+          [&]() NO_THREAD_SAFETY_ANALYSIS { return done == helpers; });
+}
+}  // namespace
+
 // Use the DTZ tables to rank root moves.
 // A return value 0 indicates that not all probes were successful.
 // Otherwise best rank is returned:
@@ -1630,20 +2042,20 @@ int SyzygyTablebase::probe_dtz(const Position& pos, ProbeState* result) {
 // If 50 draw in sight for losses: -1000 + (-dtz + cnt50).
 
 int SyzygyTablebase::root_probe(const Position& pos, bool has_repeated,
-                                 std::vector<Move>* safe_moves) {
-  ProbeState result;
+                                 std::vector<Move>* safe_moves, int threads) {
   auto root_moves = pos.GetBoard().GenerateLegalMoves();
   // Obtain 50-move counter for the root position
   const int cnt50 = pos.GetNoCaptureNoPawnPly();
   // Check whether a position was repeated since the last zeroing move.
   const bool rep = has_repeated;
-  int dtz;
-  std::vector<int> ranks;
-  ranks.reserve(root_moves.size());
-  int best_rank = -1000;
+  std::vector<int> ranks(root_moves.size());
+  std::atomic<bool> failed{false};
   // Probe and rank each move
-  for (auto& m : root_moves) {
-    Position next_pos = Position(pos, m);
+  ParallelFor(root_moves.size(), threads, [&](int idx) {
+    if (failed.load(std::memory_order_relaxed)) return;
+    ProbeState result;
+    int dtz;
+    Position next_pos = Position(pos, root_moves[idx]);
     // Calculate dtz for the current move counting from the root position
     if (next_pos.GetNoCaptureNoPawnPly() == 0) {
       // In case of a zeroing move, dtz is one of -101/-1/0/1/101
@@ -1656,20 +2068,24 @@ int SyzygyTablebase::root_probe(const Position& pos, bool has_repeated,
     }
     // Make sure that a mating move is assigned a dtz value of 1
     if (next_pos.GetBoard().IsUnderCheck() && dtz == 2 &&
-        next_pos.GetBoard().GenerateLegalMoves().size() == 0) {
+        !next_pos.GetBoard().HasAnyLegalMove()) {
       dtz = 1;
     }
-    if (result == FAIL) return 0;
+    if (result == FAIL) {
+      failed = true;
+      return;
+    }
     // Better moves are ranked higher. Certain wins are ranked equally.
     // Losing moves are ranked equally unless a 50-move draw is in sight.
-    int r = dtz > 0
-                ? (dtz + cnt50 <= 99 && !rep ? 1000 : 1000 - (dtz + cnt50))
+    ranks[idx] =
+        dtz > 0 ? (dtz + cnt50 <= 99 && !rep ? 1000 : 1000 - (dtz + cnt50))
                 : dtz < 0 ? (-dtz * 2 + cnt50 < 100 ? -1000
                                                     : -1000 + (-dtz + cnt50))
                           : 1;
-    if (r > best_rank) best_rank = r;
-    ranks.push_back(r);
-  }
+  });
+  if (failed) return 0;
+  const int best_rank =
+      ranks.empty() ? -1000 : *std::max_element(ranks.begin(), ranks.end());
   // Disable all but the equal best moves.
   int counter = 0;
   for (auto& m : root_moves) {
@@ -1688,21 +2104,27 @@ int SyzygyTablebase::root_probe(const Position& pos, bool has_repeated,
 // -1000 loss, -899 blessed loss, 1 draw, 899 cursed win and 1000 win.
 
 int SyzygyTablebase::root_probe_wdl(const Position& pos,
-                                     std::vector<Move>* safe_moves) {
+                                     std::vector<Move>* safe_moves,
+                                     int threads) {
   static const int WDL_to_rank[] = {-1000, -899, 1, 899, 1000};
   auto root_moves = pos.GetBoard().GenerateLegalMoves();
-  ProbeState result;
-  std::vector<int> ranks;
-  ranks.reserve(root_moves.size());
-  int best_rank = -1000;
+  std::vector<int> ranks(root_moves.size());
+  std::atomic<bool> failed{false};
   // Probe and rank each move
-  for (auto& m : root_moves) {
-    Position nextPos = Position(pos, m);
+  ParallelFor(root_moves.size(), threads, [&](int idx) {
+    if (failed.load(std::memory_order_relaxed)) return;
+    ProbeState result;
+    Position nextPos = Position(pos, root_moves[idx]);
     const WDLScore wdl = static_cast<WDLScore>(-probe_wdl(nextPos, &result));
-    if (result == FAIL) return false;
-    ranks.push_back(WDL_to_rank[wdl + 2]);
-    if (ranks.back() > best_rank) best_rank = ranks.back();
-  }
+    if (result == FAIL) {
+      failed = true;
+      return;
+    }
+    ranks[idx] = WDL_to_rank[wdl + 2];
+  });
+  if (failed) return false;
+  const int best_rank =
+      ranks.empty() ? -1000 : *std::max_element(ranks.begin(), ranks.end());
   // Disable all but the equal best moves.
   int counter = 0;
   for (auto& m : root_moves) {
@@ -32,8 +32,11 @@
 #include <deque>
 #include <memory>
 #include <tuple>
+#include <unordered_set>
 #include <vector>
 #include "chess/position.h"
+#include "utils/mutex.h"
+#include "utils/threadpool.h"
 
 namespace lczero {
 
@@ -55,6 +58,32 @@ enum ProbeState {
 
 class SyzygyTablebaseImpl;
 
+// Fixed size cache of probe results, keyed by board hash. Lock free: every
+// entry is a single atomic word holding the upper bits of the hash with the
+// result, so a racing writer can only make a lookup miss.
+class SyzygyProbeCache {
+ public:
+  SyzygyProbeCache();
+
+  // Returns whether the result for @hash is cached, and sets @value and
+  // @state to it if so.
+  bool Lookup(uint64_t hash, int* value, ProbeState* state);
+  void Insert(uint64_t hash, int value, ProbeState state);
+  // Not thread safe.
+  void Clear();
+
+  uint64_t GetHits() const { return hits_.load(std::memory_order_relaxed); }
+  uint64_t GetLookups() const {
+    return lookups_.load(std::memory_order_relaxed);
+  }
+
+ private:
+  static constexpr int kSizeBits = 18;
+  std::unique_ptr<std::atomic<uint64_t>[]> entries_;
+  std::atomic<uint64_t> hits_{0};
+  std::atomic<uint64_t> lookups_{0};
+};
+
 // Provides methods to load and probe syzygy tablebases.
 // Thread safe methods are thread safe subject to the non-thread sfaety
 // conditions of the init method.
@@ -76,6 +105,27 @@ class SyzygyTablebase {
   // Result is only strictly valid for positions with 0 ply 50 move counter.
   // Probe state will return FAIL if the position is not in the tablebase.
   WDLScore probe_wdl(const Position& pos, ProbeState* result);
+  // Same as probe_wdl() if the result is cached, and returns true then.
+  // Otherwise probes on a background thread, so that the caller doesn't wait
+  // for the table to be read from disk, and returns false. That result is
+  // cached for the next time the position is probed.
+  // Thread safe.
+  bool probe_wdl_async(const Position& pos, WDLScore* wdl,
+                       ProbeState* result);
+  // Same as probe_wdl(), but fails rather than wait for a table to be opened
+  // the first time, which is then done on a background thread.
+  // Thread safe.
+  WDLScore probe_wdl_nowait(const Position& pos, ProbeState* result);
+  // Probes every one of @positions as probe_wdl_nowait() does, into @wdl and
+  // @results of the same size. Positions are probed grouped by material, and
+  // repeated ones only once, so that each table is read in one go.
+  // Thread safe.
+  void probe_wdl_batch(const std::vector<Position>& positions, WDLScore* wdl,
+                       ProbeState* results);
+  // Opens the tables of all the material reachable from @pos on a background
+  // thread, ahead of their first probe.
+  // Thread safe.
+  void prepare(const Position& pos);
   // Probes DTZ tables for the given position to determine the number of ply
   // before a zeroing move under optimal play.
   // Thread safe.
@@ -93,8 +143,9 @@ class SyzygyTablebase {
   // If rep flag is set for wins  1000 - (dtz + cnt50) win.
   // If 50 draw in sight for losses: -1000 + (-dtz + cnt50).
   // Safe moves are added to the safe_moves output parameter.
+  // Moves are probed on up to @threads threads, the calling one included.
   int root_probe(const Position& pos, bool has_repeated,
-                  std::vector<Move>* safe_moves);
+                 std::vector<Move>* safe_moves, int threads = 1);
   // Probes WDL tables to determine which moves might be on the optimal play
   // path. If 50 move ply counter is non-zero some (or maybe even all) of the
   // returned safe moves in a 'winning' position, may actually be draws.
@@ -102,17 +153,66 @@ class SyzygyTablebase {
   // Otherwise best rank is returned:
   // -1000 loss, -899 blessed loss, 1 draw, 899 cursed win and 1000 win.
   // Safe moves are added to the safe_moves output parameter.
-  int root_probe_wdl(const Position& pos, std::vector<Move>* safe_moves);
+  // Moves are probed on up to @threads threads, the calling one included.
+  int root_probe_wdl(const Position& pos, std::vector<Move>* safe_moves,
+                     int threads = 1);
+
+  struct CacheStats {
+    uint64_t hits = 0;
+    uint64_t lookups = 0;
+  };
+  // Maps the WDL and DTZ tables of up to @max_pieces pieces now, rather than
+  // on first probe, and asks the OS to read them in. If @lock, also locks them
+  // in memory, which needs a large enough RLIMIT_MEMLOCK. Returns the number
+  // of bytes preloaded.
+  // Not thread safe.
+  size_t preload(int max_pieces, bool lock);
+
+  // Keeps the tables probed least recently out of memory, both out of the
+  // process and out of the page cache, so that those probed recently take up
+  // to @bytes. 0 for no limit. Tables stay mapped and are read in again when
+  // probed, so a budget trades probe speed for memory.
+  // Thread safe.
+  void set_memory_budget(size_t bytes);
+
+  struct MappingStats {
+    // Tables mapped so far, their size and that of those held in memory
+    // within the budget.
+    int tables = 0;
+    size_t mapped_bytes = 0;
+    size_t resident_bytes = 0;
+    // Tables dropped from memory to keep within the budget.
+    uint64_t evictions = 0;
+  };
+  // Thread safe.
+  MappingStats GetMappingStats() const;
+
+  // Counters of the caches of probe_wdl() and probe_dtz() results, since the
+  // tablebases were loaded.
+  // Thread safe.
+  CacheStats GetCacheStats() const;
 
  private:
+  // Unless @wait, fails if a table needed isn't initialized yet.
   template <bool CheckZeroingMoves = false>
-  WDLScore search(const Position& pos, ProbeState* result);
+  WDLScore search(const Position& pos, ProbeState* result, bool wait = true);
+  int probe_dtz_uncached(const Position& pos, ProbeState* result);
 
   std::string paths_;
   // Caches the max_cardinality from the impl, as max_cardinality may be a hot
   // path.
   int max_cardinality_;
   std::unique_ptr<SyzygyTablebaseImpl> impl_;
+  // Same positions get probed over and over in search, and a probe
+  // decompresses a block of the table.
+  SyzygyProbeCache wdl_cache_;
+  SyzygyProbeCache dtz_cache_;
+
+  // Positions queued by probe_wdl_async(), by board hash.
+  Mutex pending_mutex_;
+  std::unordered_set<uint64_t> pending_ GUARDED_BY(pending_mutex_);
+  // Declared last so that it's destroyed, waiting for its probes, first.
+  std::unique_ptr<ThreadPool> prober_ GUARDED_BY(pending_mutex_);
 };
 
 }  // namespace lczero
@@ -28,6 +28,7 @@
 #include <gtest/gtest.h>
 
 #include <iostream>
+#include <thread>
 #include "src/syzygy/syzygy.h"
 
 namespace lczero {
@@ -126,6 +127,74 @@ TEST(Syzygy, Simple3PieceProbes) {
                        -8);
 }
 
+TEST(Syzygy, AsyncProbe) {
+  SyzygyTablebase tablebase;
+  tablebase.init(kPaths);
+  if (tablebase.max_cardinality() < 3) return;
+  EXPECT_GT(tablebase.preload(3, false), 0u);
+  ChessBoard board;
+  PositionHistory history;
+  board.SetFromFen("8/8/8/8/8/8/2Rk4/1K6 b - - 0 1");
+  history.Reset(board, 0, 1);
+  WDLScore score;
+  ProbeState result;
+  // Not probed yet, but will be soon.
+  EXPECT_FALSE(tablebase.probe_wdl_async(history.Last(), &score, &result));
+  while (!tablebase.probe_wdl_async(history.Last(), &score, &result)) {
+    std::this_thread::yield();
+  }
+  EXPECT_NE(result, FAIL);
+  EXPECT_EQ(score, WDL_LOSS);
+}
+
+TEST(Syzygy, LazyInit) {
+  SyzygyTablebase tablebase;
+  tablebase.init(kPaths);
+  if (tablebase.max_cardinality() < 4) return;
+  ChessBoard board;
+  PositionHistory history;
+  board.SetFromFen("8/8/8/8/8/8/2Rk4/1KR5 b - - 0 1");
+  history.Reset(board, 0, 1);
+  // Opens KRvK as well, reachable by capturing a rook.
+  tablebase.prepare(history.Last());
+  board.SetFromFen("8/8/8/8/8/8/2Rk4/1K6 b - - 0 1");
+  history.Reset(board, 0, 1);
+  ProbeState result = FAIL;
+  WDLScore score = WDL_DRAW;
+  while (result == FAIL) {
+    score = tablebase.probe_wdl_nowait(history.Last(), &result);
+    std::this_thread::yield();
+  }
+  EXPECT_EQ(score, WDL_LOSS);
+}
+
+TEST(Syzygy, BatchProbe) {
+  SyzygyTablebase tablebase;
+  tablebase.init(kPaths);
+  if (tablebase.max_cardinality() < 4) return;
+  std::vector<Position> positions;
+  for (const char* fen :
+       {"8/8/8/8/8/8/2Rk4/1K6 b - - 0 1", "8/8/8/8/8/8/2Rk4/1KR5 b - - 0 1",
+        "8/8/8/8/8/8/2Rk4/1K6 b - - 0 1", "5Qk1/8/8/8/8/8/8/4K3 b - - 0 1"}) {
+    ChessBoard board;
+    board.SetFromFen(fen);
+    positions.emplace_back(board, 0, 1);
+  }
+  // Blocking probes open the tables, so that the batch doesn't fail.
+  for (const auto& pos : positions) {
+    ProbeState result;
+    tablebase.probe_wdl(pos, &result);
+  }
+  std::vector<WDLScore> scores(positions.size());
+  std::vector<ProbeState> results(positions.size());
+  tablebase.probe_wdl_batch(positions, scores.data(), results.data());
+  for (size_t i = 0; i < positions.size(); i++) {
+    ProbeState result;
+    EXPECT_EQ(scores[i], tablebase.probe_wdl(positions[i], &result));
+    EXPECT_EQ(results[i], result);
+  }
+}
+
 TEST(Syzygy, Root3PieceProbes) {
   SyzygyTablebase tablebase;
   tablebase.init(kPaths);
@@ -240,6 +309,26 @@ TEST(Syzygy, Root5PieceProbes) {
                            true);
 }
 
+TEST(Syzygy, ProbeCache) {
+  SyzygyProbeCache cache;
+  int value;
+  ProbeState state;
+  const uint64_t hash = 0x123456789abcdef0ULL;
+  EXPECT_FALSE(cache.Lookup(hash, &value, &state));
+  cache.Insert(hash, -1234, CHANGE_STM);
+  ASSERT_TRUE(cache.Lookup(hash, &value, &state));
+  EXPECT_EQ(value, -1234);
+  EXPECT_EQ(state, CHANGE_STM);
+  // Same slot, different position.
+  EXPECT_FALSE(cache.Lookup(hash ^ (1ULL << 40), &value, &state));
+  cache.Insert(hash, WDL_WIN, FAIL);
+  ASSERT_TRUE(cache.Lookup(hash, &value, &state));
+  EXPECT_EQ(value, WDL_WIN);
+  EXPECT_EQ(state, FAIL);
+  EXPECT_EQ(cache.GetHits(), 2u);
+  EXPECT_EQ(cache.GetLookups(), 4u);
+}
+
 }  // namespace lczero
 
 int main(int argc, char** argv) {
@@ -0,0 +1,282 @@
+/*
+ This file is part of Leela Chess Zero.
+ Copyright (C) 2019 The LCZero Authors
+
+ Leela Chess is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ Leela Chess is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+ Additional permission under GNU GPL version 3 section 7
+
+ If you modify this Program, or any covered work, by linking or
+ combining it with NVIDIA Corporation's libraries from the NVIDIA CUDA
+ Toolkit and the NVIDIA CUDA Deep Neural Network library (or a
+ modified version of those libraries), containing parts covered by the
+ terms of the respective license agreement, the licensors of this
+ Program grant you additional permission to convey the resulting work.
+ */
+
+#include "utils/affinity.h"
+
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <tuple>
+#include "utils/exception.h"
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#include <sys/resource.h>
+#endif
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+namespace lczero {
+
+bool PinCurrentThread(const std::vector<int>& cpus) {
+#ifdef __linux__
+  if (cpus.empty()) return false;
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (int cpu : cpus) CPU_SET(cpu, &set);
+  return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#elif defined(_WIN32)
+  // Processor group 0 only.
+  DWORD_PTR mask = 0;
+  for (int cpu : cpus) {
+    if (cpu < static_cast<int>(8 * sizeof(mask))) mask |= DWORD_PTR{1} << cpu;
+  }
+  return mask && SetThreadAffinityMask(GetCurrentThread(), mask) != 0;
+#else
+  (void)cpus;
+  return false;
+#endif
+}
+
+bool LowerCurrentThreadPriority() {
+#ifdef __linux__
+  // On Linux the nice value is per thread.
+  return setpriority(PRIO_PROCESS, 0, 10) == 0;
+#else
+  return false;
+#endif
+}
+
+std::vector<int> ParseCpuList(const std::string& list) {
+  std::vector<int> cpus;
+  std::istringstream stream(list);
+  int first;
+  while (stream >> first) {
+    int last = first;
+    if (stream.peek() == '-') {
+      stream.get();
+      stream >> last;
+    }
+    for (int cpu = first; cpu <= last; cpu++) cpus.push_back(cpu);
+    if (stream.peek() == ',') stream.get();
+  }
+  return cpus;
+}
+
+namespace {
+struct LogicalCpu {
+  int package;
+  int core;
+  int cpu;
+};
+
+// Logical CPUs the process may run on, with their package and core ids.
+std::vector<LogicalCpu> GetTopology() {
+  std::vector<LogicalCpu> topology;
+#ifdef __linux__
+  cpu_set_t allowed;
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) return topology;
+  std::string online;
+  std::ifstream("/sys/devices/system/cpu/online") >> online;
+  for (int cpu : ParseCpuList(online)) {
+    if (cpu >= CPU_SETSIZE || !CPU_ISSET(cpu, &allowed)) continue;
+    const std::string dir =
+        "/sys/devices/system/cpu/cpu" + std::to_string(cpu) + "/topology/";
+    LogicalCpu logical{0, cpu, cpu};
+    std::ifstream(dir + "physical_package_id") >> logical.package;
+    std::ifstream(dir + "core_id") >> logical.core;
+    topology.push_back(logical);
+  }
+#elif defined(_WIN32)
+  DWORD length = 0;
+  GetLogicalProcessorInformationEx(RelationAll, nullptr, &length);
+  std::vector<char> buffer(length);
+  auto* info =
+      reinterpret_cast<SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX*>(buffer.data());
+  if (!GetLogicalProcessorInformationEx(RelationAll, info, &length)) {
+    return topology;
+  }
+  // Masks of processor group 0 only, as PinCurrentThread().
+  std::vector<KAFFINITY> packages;
+  std::vector<KAFFINITY> cores;
+  for (DWORD offset = 0; offset < length;) {
+    auto* entry = reinterpret_cast<SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX*>(
+        buffer.data() + offset);
+    if (entry->Relationship == RelationProcessorPackage ||
+        entry->Relationship == RelationProcessorCore) {
+      const GROUP_AFFINITY& group = entry->Processor.GroupMask[0];
+      if (group.Group == 0) {
+        (entry->Relationship == RelationProcessorCore ? cores : packages)
+            .push_back(group.Mask);
+      }
+    }
+    offset += entry->Size;
+  }
+  DWORD_PTR process_mask;
+  DWORD_PTR system_mask;
+  GetProcessAffinityMask(GetCurrentProcess(), &process_mask, &system_mask);
+  for (size_t core = 0; core < cores.size(); ++core) {
+    for (int cpu = 0; cpu < static_cast<int>(8 * sizeof(KAFFINITY)); ++cpu) {
+      const KAFFINITY bit = KAFFINITY{1} << cpu;
+      if (!(cores[core] & bit) || !(process_mask & bit)) continue;
+      int package = 0;
+      while (package < static_cast<int>(packages.size()) &&
+             !(packages[package] & bit)) {
+        ++package;
+      }
+      topology.push_back({package, static_cast<int>(core), cpu});
+    }
+  }
+#endif
+  return topology;
+}
+
+struct RoleAffinity {
+  std::string spec = "none";
+  // CPUs the threads are pinned to in turn, empty for none.
+  std::vector<int> cpus;
+  // Which slots threads of the role hold.
+  std::vector<bool> taken;
+};
+
+std::mutex affinity_mutex;
+// Never destroyed, as GC threads which start during static initialization
+// use it until static destruction.
+RoleAffinity* GetRoleAffinity(ThreadRole role) {
+  static RoleAffinity* roles = new RoleAffinity[3];
+  return &roles[static_cast<int>(role)];
+}
+// Incremented by every SetThreadAffinity(), per role.
+std::atomic<uint64_t> affinity_generation[3];
+
+int RoleIndex(ThreadRole role) { return static_cast<int>(role); }
+}  // namespace
+
+std::vector<int> GetCpuOrder(bool scatter) {
+  const std::vector<LogicalCpu> topology = GetTopology();
+  // Siblings of a core, by package and core.
+  std::map<std::pair<int, int>, std::vector<int>> cores;
+  for (const auto& cpu : topology) {
+    cores[{cpu.package, cpu.core}].push_back(cpu.cpu);
+  }
+  // Rank of the core within its package, to interleave packages.
+  std::map<int, int> cores_in_package;
+  struct Placement {
+    int sibling;
+    int rank;
+    int package;
+    int cpu;
+  };
+  std::vector<Placement> placements;
+  for (auto& core : cores) {
+    const int rank = cores_in_package[core.first.first]++;
+    std::sort(core.second.begin(), core.second.end());
+    for (size_t i = 0; i < core.second.size(); ++i) {
+      placements.push_back({static_cast<int>(i), rank, core.first.first,
+                            core.second[i]});
+    }
+  }
+  // First siblings of all cores come before the second ones.
+  std::sort(placements.begin(), placements.end(),
+            [scatter](const Placement& a, const Placement& b) {
+              if (scatter) {
+                return std::tie(a.sibling, a.rank, a.package) <
+                       std::tie(b.sibling, b.rank, b.package);
+              }
+              return std::tie(a.sibling, a.package, a.rank) <
+                     std::tie(b.sibling, b.package, b.rank);
+            });
+  std::vector<int> order;
+  for (const auto& placement : placements) order.push_back(placement.cpu);
+  return order;
+}
+
+void SetThreadAffinity(ThreadRole role, const std::string& spec) {
+  {
+    std::lock_guard<std::mutex> lock(affinity_mutex);
+    if (GetRoleAffinity(role)->spec == spec) return;
+  }
+  std::vector<int> cpus;
+  if (spec == "compact" || spec == "scatter") {
+    cpus = GetCpuOrder(spec == "scatter");
+    if (role != ThreadRole::kSearch) std::reverse(cpus.begin(), cpus.end());
+  } else if (!spec.empty() && spec != "none") {
+    if (spec.find_first_not_of("0123456789,-") != std::string::npos) {
+      throw Exception("Invalid thread affinity: " + spec);
+    }
+    cpus = ParseCpuList(spec);
+    if (cpus.empty()) throw Exception("Invalid thread affinity: " + spec);
+  }
+  std::lock_guard<std::mutex> lock(affinity_mutex);
+  GetRoleAffinity(role)->spec = spec;
+  GetRoleAffinity(role)->cpus = std::move(cpus);
+  affinity_generation[RoleIndex(role)].fetch_add(1);
+}
+
+PinnedThread::PinnedThread(ThreadRole role) : role_(role) {
+  {
+    std::lock_guard<std::mutex> lock(affinity_mutex);
+    auto& taken = GetRoleAffinity(role_)->taken;
+    slot_ = std::find(taken.begin(), taken.end(), false) - taken.begin();
+    if (slot_ == static_cast<int>(taken.size())) taken.push_back(false);
+    taken[slot_] = true;
+  }
+  Pin();
+}
+
+PinnedThread::~PinnedThread() {
+  std::lock_guard<std::mutex> lock(affinity_mutex);
+  GetRoleAffinity(role_)->taken[slot_] = false;
+}
+
+void PinnedThread::Refresh() {
+  if (affinity_generation[RoleIndex(role_)].load() != generation_) Pin();
+}
+
+void PinnedThread::Pin() {
+  std::vector<int> cpus;
+  {
+    std::lock_guard<std::mutex> lock(affinity_mutex);
+    generation_ = affinity_generation[RoleIndex(role_)].load();
+    const auto& role_cpus = GetRoleAffinity(role_)->cpus;
+    if (!role_cpus.empty()) cpus = {role_cpus[slot_ % role_cpus.size()]};
+  }
+  if (cpus.empty()) {
+    // Back to all CPUs, if pinned before.
+    if (!pinned_) return;
+    for (const auto& cpu : GetTopology()) cpus.push_back(cpu.cpu);
+  }
+  pinned_ = PinCurrentThread(cpus) && cpus.size() == 1;
+}
+
+}  // namespace lczero
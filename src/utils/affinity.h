@@ -0,0 +1,86 @@
+/*
+ This file is part of Leela Chess Zero.
+ Copyright (C) 2019 The LCZero Authors
+
+ Leela Chess is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ Leela Chess is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+ Additional permission under GNU GPL version 3 section 7
+
+ If you modify this Program, or any covered work, by linking or
+ combining it with NVIDIA Corporation's libraries from the NVIDIA CUDA
+ Toolkit and the NVIDIA CUDA Deep Neural Network library (or a
+ modified version of those libraries), containing parts covered by the
+ terms of the respective license agreement, the licensors of this
+ Program grant you additional permission to convey the resulting work.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace lczero {
+
+// Restricts the calling thread to run on @cpus. Does nothing if @cpus is
+// empty or the platform doesn't support it; returns whether it succeeded.
+bool PinCurrentThread(const std::vector<int>& cpus);
+
+// Lowers the scheduling priority of the calling thread, for background work.
+// Does nothing if the platform doesn't support it; returns whether it
+// succeeded.
+bool LowerCurrentThreadPriority();
+
+// Parses a Linux style CPU list like "0-13,28-41".
+std::vector<int> ParseCpuList(const std::string& list);
+
+// Logical CPUs the process may run on, ordered for placing one thread per
+// physical core before using SMT siblings. "compact" fills the cores of one
+// package after the other, "scatter" takes a core of each package in turn.
+// Returns an empty list if the topology is unknown.
+std::vector<int> GetCpuOrder(bool scatter);
+
+enum class ThreadRole { kSearch, kBackend, kGc };
+
+// Sets where the threads of @role run: "none" leaves them to the scheduler,
+// "compact" and "scatter" pin each to its own CPU in the order of
+// GetCpuOrder(), and a CPU list pins them to its CPUs in turn. Backend and GC
+// threads are placed from the end of the order, away from search threads.
+// Applies to threads placed afterwards, and does nothing if @spec is the same
+// as before. Throws exception on a malformed @spec.
+void SetThreadAffinity(ThreadRole role, const std::string& spec);
+
+// Pins the calling thread to a CPU of its role for the lifetime of the
+// object, which claims the first CPU no other thread of the role has.
+class PinnedThread {
+ public:
+  explicit PinnedThread(ThreadRole role);
+  ~PinnedThread();
+  PinnedThread(const PinnedThread&) = delete;
+  void operator=(const PinnedThread&) = delete;
+
+  // Pins again if SetThreadAffinity() was called for the role since, for
+  // threads which outlive option changes.
+  void Refresh();
+
+ private:
+  void Pin();
+
+  const ThreadRole role_;
+  int slot_;
+  uint64_t generation_ = 0;
+  bool pinned_ = false;
+};
+
+}  // namespace lczero
@@ -0,0 +1,133 @@
+/*
+ This file is part of Leela Chess Zero.
+ Copyright (C) 2019 The LCZero Authors
+
+ Leela Chess is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ Leela Chess is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+ Additional permission under GNU GPL version 3 section 7
+
+ If you modify this Program, or any covered work, by linking or
+ combining it with NVIDIA Corporation's libraries from the NVIDIA CUDA
+ Toolkit and the NVIDIA CUDA Deep Neural Network library (or a
+ modified version of those libraries), containing parts covered by the
+ terms of the respective license agreement, the licensors of this
+ Program grant you additional permission to convey the resulting work.
+ */
+
+
+#include "utils/cpu.h"
+
+#include <cstring>
+#include <utility>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#elif defined(LC0_CPU_DISPATCH)
+#include <cpuid.h>
+#endif
+
+namespace lczero {
+namespace {
+
+#if defined(LC0_CPU_DISPATCH)
+// Executes cpuid, @regs receive eax, ebx, ecx and edx.
+void Cpuid(unsigned leaf, unsigned subleaf, unsigned regs[4]) {
+#if defined(_MSC_VER)
+  __cpuidex(reinterpret_cast<int*>(regs), leaf, subleaf);
+#else
+  __cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+
+// Register state the OS saves on context switches.
+unsigned long long Xgetbv() {
+#if defined(_MSC_VER)
+  return _xgetbv(0);
+#else
+  unsigned eax, edx;
+  asm volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+  return (static_cast<unsigned long long>(edx) << 32) | eax;
+#endif
+}
+
+CpuFeatures DetectCpuFeatures() {
+  CpuFeatures features;
+  unsigned regs[4];
+  Cpuid(0, 0, regs);
+  const unsigned max_leaf = regs[0];
+  char vendor[13] = {0};
+  std::memcpy(vendor, &regs[1], 4);
+  std::memcpy(vendor + 4, &regs[3], 4);
+  std::memcpy(vendor + 8, &regs[2], 4);
+  if (max_leaf < 1) return features;
+
+  Cpuid(1, 0, regs);
+  unsigned family = (regs[0] >> 8) & 0xF;
+  if (family == 0xF) family += (regs[0] >> 20) & 0xFF;
+  features.sse42 = regs[2] & (1 << 20);
+  const bool osxsave = regs[2] & (1 << 27);
+  const bool fma = regs[2] & (1 << 12);
+  const bool f16c = regs[2] & (1 << 29);
+  // The vector registers are only usable if the OS saves them: XMM and YMM
+  // for AVX, also the opmask and ZMM ones for AVX-512.
+  const unsigned long long xcr0 = osxsave ? Xgetbv() : 0;
+  const bool ymm = (xcr0 & 0x6) == 0x6;
+  const bool zmm = (xcr0 & 0xE6) == 0xE6;
+  features.avx = (regs[2] & (1 << 28)) && ymm;
+  if (max_leaf < 7) return features;
+
+  Cpuid(7, 0, regs);
+  features.avx2 = features.avx && (regs[1] & (1 << 5)) && fma && f16c;
+  features.avx512 =
+      features.avx2 && zmm && (regs[1] & (1 << 16)) && (regs[1] & (1 << 30));
+  features.bmi2 = regs[1] & (1 << 8);
+  // AMD before Zen 3 (family 19h), and Hygon, implement pext in microcode
+  // taking up to hundreds of cycles.
+  features.fast_pext = features.bmi2 &&
+                       std::strcmp(vendor, "HygonGenuine") != 0 &&
+                       (std::strcmp(vendor, "AuthenticAMD") != 0 ||
+                        family >= 0x19);
+  return features;
+}
+#else
+CpuFeatures DetectCpuFeatures() { return CpuFeatures(); }
+#endif
+
+}  // namespace
+
+const CpuFeatures& GetCpuFeatures() {
+  static const CpuFeatures features = DetectCpuFeatures();
+  return features;
+}
+
+std::string DescribeCpuFeatures() {
+  const CpuFeatures& features = GetCpuFeatures();
+  std::string result;
+  for (const auto& feature :
+       {std::make_pair(features.sse42, "SSE4.2"),
+        std::make_pair(features.avx, "AVX"),
+        std::make_pair(features.avx2, "AVX2"),
+        std::make_pair(features.avx512, "AVX-512"),
+        std::make_pair(features.fast_pext, "PEXT")}) {
+    if (!feature.first) continue;
+    if (!result.empty()) result += ' ';
+    result += feature.second;
+  }
+#if defined(__aarch64__) && defined(__ARM_NEON)
+  result = "NEON";
+#endif
+  return result.empty() ? "generic" : result;
+}
+
+}  // namespace lczero
@@ -0,0 +1,80 @@
+/*
+ This file is part of Leela Chess Zero.
+ Copyright (C) 2019 The LCZero Authors
+
+ Leela Chess is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ Leela Chess is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+ Additional permission under GNU GPL version 3 section 7
+
+ If you modify this Program, or any covered work, by linking or
+ combining it with NVIDIA Corporation's libraries from the NVIDIA CUDA
+ Toolkit and the NVIDIA CUDA Deep Neural Network library (or a
+ modified version of those libraries), containing parts covered by the
+ terms of the respective license agreement, the licensors of this
+ Program grant you additional permission to convey the resulting work.
+ */
+
+
+#pragma once
+
+#include <string>
+
+namespace lczero {
+
+// Instruction sets of the CPU running the program, beyond what the build
+// targets. Hot kernels are compiled in a variant per instruction set and
+// pick one with these, so that a generic build still runs them at full
+// speed.
+struct CpuFeatures {
+  bool sse42 = false;
+  bool avx = false;
+  // AVX2 with FMA and F16C, which every AVX2 CPU has.
+  bool avx2 = false;
+  // AVX-512 F and BW.
+  bool avx512 = false;
+  bool bmi2 = false;
+  // BMI2 with a pext faster than a magic multiplication.
+  bool fast_pext = false;
+};
+
+// Detected at the first call.
+const CpuFeatures& GetCpuFeatures();
+
+// Names of the detected instruction sets, like "SSE4.2 AVX AVX2".
+std::string DescribeCpuFeatures();
+
+}  // namespace lczero
+
+// Kernel variants for other instruction sets than the build's are compiled
+// on x86 between LC0_TARGET_BEGIN("avx2,fma") and LC0_TARGET_END. MSVC
+// allows the intrinsics anywhere.
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || \
+    defined(_M_IX86)
+#define LC0_CPU_DISPATCH
+#endif
+
+#define LC0_PRAGMA(x) _Pragma(#x)
+#if defined(__clang__)
+#define LC0_TARGET_BEGIN(isa)                                              \
+  LC0_PRAGMA(clang attribute push(__attribute__((target(isa))),            \
+                                  apply_to = function))
+#define LC0_TARGET_END LC0_PRAGMA(clang attribute pop)
+#elif defined(__GNUC__)
+#define LC0_TARGET_BEGIN(isa) \
+  LC0_PRAGMA(GCC push_options) LC0_PRAGMA(GCC target(isa))
+#define LC0_TARGET_END LC0_PRAGMA(GCC pop_options)
+#else
+#define LC0_TARGET_BEGIN(isa)
+#define LC0_TARGET_END
+#endif
@@ -47,4 +47,26 @@ uint64_t GetFileSize(const std::string& filename);
 // Returns modification time of a file. Throws exception if file doesn't exist.
 time_t GetFileTime(const std::string& filename);
 
+// Renames a file, replacing @to if it exists. Throws exception on failure.
+void RenameFile(const std::string& from, const std::string& to);
+
+// Read-only memory mapping of a whole file.
+class MappedFile {
+ public:
+  // Throws exception if the file cannot be opened or mapped.
+  explicit MappedFile(const std::string& filename);
+  ~MappedFile();
+  MappedFile(const MappedFile&) = delete;
+  void operator=(const MappedFile&) = delete;
+
+  const char* data() const { return data_; }
+  size_t size() const { return size_; }
+
+ private:
+  const char* data_ = nullptr;
+  size_t size_ = 0;
+  // Mapping handle on Windows.
+  void* handle_ = nullptr;
+};
+
 }  // namespace lczero
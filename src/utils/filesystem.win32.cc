@@ -71,4 +71,44 @@ time_t GetFileTime(const std::string& filename) {
          s.ftLastWriteTime.dwLowDateTime;
 }
 
+void RenameFile(const std::string& from, const std::string& to) {
+  if (!MoveFileExA(from.c_str(), to.c_str(), MOVEFILE_REPLACE_EXISTING)) {
+    throw Exception("Cannot rename file " + from + " to " + to);
+  }
+}
+
+MappedFile::MappedFile(const std::string& filename) {
+  const HANDLE file =
+      CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+                  OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+  if (file == INVALID_HANDLE_VALUE) {
+    throw Exception("Cannot open file: " + filename);
+  }
+  LARGE_INTEGER size;
+  if (!GetFileSizeEx(file, &size)) {
+    CloseHandle(file);
+    throw Exception("Cannot stat file: " + filename);
+  }
+  size_ = static_cast<size_t>(size.QuadPart);
+  if (size_ > 0) {
+    handle_ = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (handle_) {
+      data_ = static_cast<const char*>(
+          MapViewOfFile(handle_, FILE_MAP_READ, 0, 0, 0));
+    }
+    if (!data_) {
+      if (handle_) CloseHandle(handle_);
+      CloseHandle(file);
+      throw Exception("Cannot map file: " + filename);
+    }
+  }
+  // The mapping keeps its own reference to the file.
+  CloseHandle(file);
+}
+
+MappedFile::~MappedFile() {
+  if (data_) UnmapViewOfFile(data_);
+  if (handle_) CloseHandle(handle_);
+}
+
 }  // namespace lczero
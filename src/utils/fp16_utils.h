@@ -0,0 +1,107 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2018 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+
+  If you modify this Program, or any covered work, by linking or
+  combining it with NVIDIA Corporation's libraries from the NVIDIA CUDA
+  Toolkit and the NVIDIA CUDA Deep Neural Network library (or a
+  modified version of those libraries), containing parts covered by the
+  terms of the respective license agreement, the licensors of this
+  Program grant you additional permission to convey the resulting work.
+*/
+
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+
+namespace lczero {
+
+// IEEE 754 half precision conversions, rounding to nearest even.
+
+inline uint16_t FP32toFP16(float f32) {
+  uint32_t x;
+  std::memcpy(&x, &f32, sizeof(x));
+  const uint16_t sign = (x >> 16) & 0x8000;
+  const uint32_t abs = x & 0x7FFFFFFF;
+  // NaN stays NaN, overflow goes to infinity.
+  if (abs > 0x7F800000) return sign | 0x7E00;
+  if (abs >= 0x477FF000) return sign | 0x7C00;
+  if (abs < 0x38800000) {
+    // Subnormal half (or zero).
+    if (abs < 0x33000000) return sign;
+    const uint32_t shift = 126 - (abs >> 23);
+    const uint32_t mantissa = (abs & 0x007FFFFF) | 0x00800000;
+    uint32_t half = mantissa >> shift;
+    const uint32_t rest = mantissa & ((1u << shift) - 1);
+    const uint32_t halfway = 1u << (shift - 1);
+    if (rest > halfway || (rest == halfway && (half & 1))) ++half;
+    return sign | half;
+  }
+  // Rebias the exponent and round the mantissa; a carry correctly bumps the
+  // exponent.
+  uint32_t half = (abs - 0x38000000) >> 13;
+  const uint32_t rest = abs & 0x1FFF;
+  if (rest > 0x1000 || (rest == 0x1000 && (half & 1))) ++half;
+  return sign | half;
+}
+
+inline float FP16toFP32(uint16_t f16) {
+  const uint32_t sign = static_cast<uint32_t>(f16 & 0x8000) << 16;
+  uint32_t exponent = (f16 >> 10) & 0x1F;
+  uint32_t mantissa = f16 & 0x3FF;
+  uint32_t x;
+  if (exponent == 0x1F) {
+    x = sign | 0x7F800000 | (mantissa << 13);
+  } else if (exponent != 0) {
+    x = sign | ((exponent + 112) << 23) | (mantissa << 13);
+  } else if (mantissa == 0) {
+    x = sign;
+  } else {
+    // Normalize the subnormal half.
+    exponent = 113;
+    while (!(mantissa & 0x400)) {
+      mantissa <<= 1;
+      --exponent;
+    }
+    x = sign | (exponent << 23) | ((mantissa & 0x3FF) << 13);
+  }
+  float f32;
+  std::memcpy(&f32, &x, sizeof(f32));
+  return f32;
+}
+
+// bfloat16 is the upper half of a float, rounded to nearest even.
+
+inline uint16_t FP32toBF16(float f32) {
+  uint32_t x;
+  std::memcpy(&x, &f32, sizeof(x));
+  // Keep NaN quiet rather than rounding it to infinity.
+  if ((x & 0x7FFFFFFF) > 0x7F800000) return (x >> 16) | 0x0040;
+  x += 0x7FFF + ((x >> 16) & 1);
+  return x >> 16;
+}
+
+inline float BF16toFP32(uint16_t bf16) {
+  const uint32_t x = static_cast<uint32_t>(bf16) << 16;
+  float f32;
+  std::memcpy(&f32, &x, sizeof(f32));
+  return f32;
+}
+
+}  // namespace lczero
@@ -76,6 +76,28 @@ void Histogram::Add(double value) {
   if (count > max_) max_ = count;
 }
 
+void Histogram::Merge(const Histogram& other) {
+  for (size_t i = 0; i < buckets_.size(); i++) {
+    buckets_[i] += other.buckets_[i];
+    if (buckets_[i] > max_) max_ = buckets_[i];
+  }
+  total_ += other.total_;
+}
+
+double Histogram::GetQuantile(double fraction) const {
+  double seen = 0;
+  for (size_t i = 0; i < buckets_.size(); i++) {
+    seen += buckets_[i];
+    if (seen > 0 && seen >= fraction * total_) {
+      if (i == 0) return 0;
+      // Inverse of GetIndex(), index 4 is centered at 10^min_exp.
+      return std::pow(10.0, min_exp_ + (static_cast<int>(i) - 4) /
+                                           static_cast<double>(minor_scales_));
+    }
+  }
+  return 0;
+}
+
 void Histogram::Dump() const {
   const double ymax = 0.02 + max_ / (double)total_;
   for (int i = 0; i < 100; i++) {
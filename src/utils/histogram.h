@@ -67,6 +67,16 @@ class Histogram {
   // Adds a sample.
   void Add(double value);
 
+  // Adds the samples of @other, which must have the same scales.
+  void Merge(const Histogram& other);
+
+  // Number of samples.
+  double GetCount() const { return total_; }
+
+  // Value below which @fraction of the samples are, rounded to the center of
+  // its bucket. Samples outside of the scales count as 0 or just above them.
+  double GetQuantile(double fraction) const;
+
   // Dumps the histogram to stderr.
   void Dump() const;
 
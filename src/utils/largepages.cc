@@ -0,0 +1,196 @@
+/*
+ This file is part of Leela Chess Zero.
+ Copyright (C) 2019 The LCZero Authors
+
+ Leela Chess is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ Leela Chess is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+ Additional permission under GNU GPL version 3 section 7
+
+ If you modify this Program, or any covered work, by linking or
+ combining it with NVIDIA Corporation's libraries from the NVIDIA CUDA
+ Toolkit and the NVIDIA CUDA Deep Neural Network library (or a
+ modified version of those libraries), containing parts covered by the
+ terms of the respective license agreement, the licensors of this
+ Program grant you additional permission to convey the resulting work.
+ */
+
+
+#include "utils/largepages.h"
+
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <new>
+#include <string>
+#include <vector>
+#include "utils/affinity.h"
+#include "utils/logging.h"
+
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace lczero {
+
+namespace {
+std::atomic<HugePages> huge_pages{HugePages::kOff};
+std::atomic<NumaPolicy> numa_policy{NumaPolicy::kDefault};
+
+size_t RoundUp(size_t size, size_t alignment) {
+  return (size + alignment - 1) / alignment * alignment;
+}
+
+void* AllocateAligned(size_t size, size_t alignment) {
+  void* ptr = nullptr;
+#ifdef _WIN32
+  ptr = _aligned_malloc(size, alignment);
+#else
+  if (alignment < sizeof(void*)) alignment = sizeof(void*);
+  if (posix_memalign(&ptr, alignment, size) != 0) ptr = nullptr;
+#endif
+  if (!ptr) throw std::bad_alloc();
+  return ptr;
+}
+
+void FreeAligned(void* ptr) {
+#ifdef _WIN32
+  _aligned_free(ptr);
+#else
+  free(ptr);
+#endif
+}
+
+#ifdef __linux__
+// Not in the libc headers, numaif.h is part of libnuma.
+constexpr int kMpolInterleave = 3;
+
+// Mask of the online NUMA nodes, empty if there is only one.
+const std::vector<unsigned long>& GetNumaNodeMask() {
+  static const std::vector<unsigned long> mask = []() {
+    std::string list;
+    std::ifstream("/sys/devices/system/node/online") >> list;
+    const std::vector<int> nodes = ParseCpuList(list);
+    std::vector<unsigned long> mask;
+    if (nodes.size() < 2) return mask;
+    const int bits = 8 * sizeof(unsigned long);
+    for (int node : nodes) {
+      if (static_cast<size_t>(node / bits) >= mask.size()) {
+        mask.resize(node / bits + 1);
+      }
+      mask[node / bits] |= 1ul << (node % bits);
+    }
+    return mask;
+  }();
+  return mask;
+}
+
+void Interleave(void* ptr, size_t length) {
+  const auto& mask = GetNumaNodeMask();
+  if (mask.empty()) return;
+  // Only placement, the mapping is usable either way.
+  syscall(SYS_mbind, ptr, length, kMpolInterleave, mask.data(),
+          mask.size() * 8 * sizeof(unsigned long) + 1, 0);
+}
+
+void* MapHugeTlb(size_t length) {
+  static std::atomic<bool> warned{false};
+  void* ptr = mmap(nullptr, length, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  if (ptr != MAP_FAILED) return ptr;
+  if (!warned.exchange(true)) {
+    CERR << "No free huge pages, using transparent huge pages instead.";
+  }
+  return nullptr;
+}
+
+// Maps @length bytes aligned to kHugePageSize, which transparent huge pages
+// need.
+void* MapAligned(size_t length) {
+  const size_t mapped = length + kHugePageSize;
+  void* raw = mmap(nullptr, mapped, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (raw == MAP_FAILED) throw std::bad_alloc();
+  char* begin = static_cast<char*>(raw);
+  char* aligned = reinterpret_cast<char*>(
+      RoundUp(reinterpret_cast<uintptr_t>(begin), kHugePageSize));
+  if (aligned > begin) munmap(begin, aligned - begin);
+  char* end = begin + mapped;
+  if (end > aligned + length) munmap(aligned + length, end - aligned - length);
+  return aligned;
+}
+#endif
+}  // namespace
+
+void SetLargeAllocationPolicy(HugePages huge, NumaPolicy numa) {
+  huge_pages.store(huge, std::memory_order_relaxed);
+  numa_policy.store(numa, std::memory_order_relaxed);
+}
+
+HugePages GetHugePages() { return huge_pages.load(std::memory_order_relaxed); }
+
+NumaPolicy GetNumaPolicy() {
+  return numa_policy.load(std::memory_order_relaxed);
+}
+
+void* AllocateLarge(size_t size, size_t alignment) {
+  assert(alignment <= kHugePageSize);
+#ifdef __linux__
+  if (size < kHugePageSize) return AllocateAligned(size, alignment);
+  const size_t length = RoundUp(size, kHugePageSize);
+  const HugePages huge = GetHugePages();
+  void* ptr = nullptr;
+  if (huge == HugePages::kExplicit) ptr = MapHugeTlb(length);
+  if (!ptr) {
+    ptr = MapAligned(length);
+    if (huge != HugePages::kOff) madvise(ptr, length, MADV_HUGEPAGE);
+  }
+  // Before anything touches the memory, which is when it gets placed.
+  if (GetNumaPolicy() == NumaPolicy::kInterleave) Interleave(ptr, length);
+  return ptr;
+#else
+  return AllocateAligned(size, alignment);
+#endif
+}
+
+void FreeLarge(void* ptr, size_t size) {
+  if (!ptr) return;
+#ifdef __linux__
+  if (size >= kHugePageSize) {
+    munmap(ptr, RoundUp(size, kHugePageSize));
+    return;
+  }
+#else
+  (void)size;
+#endif
+  FreeAligned(ptr);
+}
+
+int GetCurrentNumaNode() {
+#ifdef __linux__
+  unsigned cpu;
+  unsigned node;
+  if (syscall(SYS_getcpu, &cpu, &node, nullptr) == 0) return node;
+#endif
+  return 0;
+}
+
+}  // namespace lczero
@@ -0,0 +1,101 @@
+/*
+ This file is part of Leela Chess Zero.
+ Copyright (C) 2019 The LCZero Authors
+
+ Leela Chess is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ Leela Chess is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+ Additional permission under GNU GPL version 3 section 7
+
+ If you modify this Program, or any covered work, by linking or
+ combining it with NVIDIA Corporation's libraries from the NVIDIA CUDA
+ Toolkit and the NVIDIA CUDA Deep Neural Network library (or a
+ modified version of those libraries), containing parts covered by the
+ terms of the respective license agreement, the licensors of this
+ Program grant you additional permission to convey the resulting work.
+ */
+
+
+#pragma once
+
+#include <cstddef>
+
+namespace lczero {
+
+// Backing of the large, long-lived allocations: the pages of the node arena
+// and the storage of the NN cache. Only supported on Linux; elsewhere these
+// are plain aligned allocations.
+
+enum class HugePages {
+  kOff,
+  // Asks the kernel to back the allocations with transparent huge pages.
+  kTransparent,
+  // Uses preallocated huge pages (vm.nr_hugepages), and transparent ones once
+  // they run out.
+  kExplicit,
+};
+
+enum class NumaPolicy {
+  // Memory goes to the NUMA node of the thread which touches it first.
+  kDefault,
+  // Memory is interleaved over all NUMA nodes.
+  kInterleave,
+  // As kDefault, and the node arena keeps freed pages per NUMA node, so that
+  // threads reuse memory local to them.
+  kFirstTouch,
+};
+
+// Allocations of at least this size are page mapped and follow the policies,
+// smaller ones come from the heap.
+constexpr size_t kHugePageSize = 2 * 1024 * 1024;
+
+// Sets the policies for the allocations made from then on.
+void SetLargeAllocationPolicy(HugePages huge_pages, NumaPolicy numa);
+HugePages GetHugePages();
+NumaPolicy GetNumaPolicy();
+
+// Allocates @size bytes aligned to @alignment, which is at most
+// kHugePageSize. Throws std::bad_alloc on failure.
+void* AllocateLarge(size_t size, size_t alignment);
+// @size is the one the allocation was made with.
+void FreeLarge(void* ptr, size_t size);
+
+// Returns the NUMA node of the CPU the calling thread runs on, 0 if unknown.
+int GetCurrentNumaNode();
+
+// Allocator for standard containers, from AllocateLarge().
+template <typename T>
+class LargeAllocator {
+ public:
+  using value_type = T;
+
+  LargeAllocator() = default;
+  template <typename U>
+  LargeAllocator(const LargeAllocator<U>&) {}
+
+  T* allocate(size_t n) {
+    return static_cast<T*>(AllocateLarge(n * sizeof(T), alignof(T)));
+  }
+  void deallocate(T* ptr, size_t n) { FreeLarge(ptr, n * sizeof(T)); }
+};
+
+template <typename T, typename U>
+bool operator==(const LargeAllocator<T>&, const LargeAllocator<U>&) {
+  return true;
+}
+template <typename T, typename U>
+bool operator!=(const LargeAllocator<T>&, const LargeAllocator<U>&) {
+  return false;
+}
+
+}  // namespace lczero
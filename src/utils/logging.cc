@@ -26,6 +26,8 @@
 */
 
 #include "utils/logging.h"
+#include <cstdlib>
+#include <exception>
 #include <iomanip>
 #include <iostream>
 #include <thread>
@@ -35,26 +37,88 @@ namespace lczero {
 namespace {
 size_t kBufferSizeLines = 200;
 const char* kStderrFilename = "<stderr>";
+std::terminate_handler previous_terminate_handler = nullptr;
 }  // namespace
 
+Logging::Logging() : writer_([this]() { WriterThread(); }) {
+  // The writer thread dies with the process, whatever it has left to write.
+  previous_terminate_handler = std::set_terminate([]() {
+    Logging::Get().Flush();
+    if (previous_terminate_handler) previous_terminate_handler();
+    std::abort();
+  });
+}
+
+Logging::~Logging() {
+  queue_.Close();
+  writer_.join();
+}
+
 Logging& Logging::Get() {
   static Logging logging;
   return logging;
 }
 
-void Logging::WriteLineRaw(const std::string& line) {
+void Logging::WriteLineRaw(std::string line, bool sync) {
+  if (sync) {
+    Mutex::Lock lock_(mutex_);
+    // After the lines queued before, and flushed with whatever came since.
+    DrainQueue();
+    WriteLine(line);
+    DrainQueue();
+    return;
+  }
+  if (!queue_.Offer(line)) {
+    dropped_lines_.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+void Logging::Flush() {
   Mutex::Lock lock_(mutex_);
+  DrainQueue();
+}
+
+void Logging::WriterThread() {
+  std::string line;
+  while (queue_.Pop(&line)) {
+    Mutex::Lock lock_(mutex_);
+    WriteLine(line);
+    DrainQueue();
+  }
+  // Closed, lines may still be left.
+  Mutex::Lock lock_(mutex_);
+  DrainQueue();
+}
+
+void Logging::DrainQueue() {
+  std::string line;
+  while (queue_.TryPop(&line)) WriteLine(line);
+  const uint64_t dropped = dropped_lines_.exchange(0, std::memory_order_relaxed);
+  if (dropped > 0) {
+    WriteLine(std::to_string(dropped) +
+              " log lines dropped, they came faster than written.");
+  }
+  // Flushed once there's nothing to write, rather than for every line.
+  if (!filename_.empty()) {
+    auto& file = (filename_ == kStderrFilename) ? std::cerr : file_;
+    file.flush();
+  }
+}
+
+void Logging::WriteLine(const std::string& line) {
   if (filename_.empty()) {
     buffer_.push_back(line);
     if (buffer_.size() > kBufferSizeLines) buffer_.pop_front();
   } else {
     auto& file = (filename_ == kStderrFilename) ? std::cerr : file_;
-    file << line << std::endl;
+    file << line << '\n';
   }
 }
 
 void Logging::SetFilename(const std::string& filename) {
   Mutex::Lock lock_(mutex_);
+  // Lines logged before go where the log went then.
+  DrainQueue();
   if (filename_ == filename) return;
   filename_ = filename;
   if (filename.empty() || filename == kStderrFilename) {
@@ -68,16 +132,16 @@ void Logging::SetFilename(const std::string& filename) {
   buffer_.clear();
 }
 
-LogMessage::LogMessage(const char* file, int line) {
+LogMessage::LogMessage(const char* file, int line, bool sync) : sync_(sync) {
   *this << FormatTime(std::chrono::system_clock::now()) << ' '
         << std::setfill(' ') << std::this_thread::get_id() << std::setfill('0')
         << ' ' << file << ':' << line << "] ";
 }
 
-LogMessage::~LogMessage() { Logging::Get().WriteLineRaw(str()); }
+LogMessage::~LogMessage() { Logging::Get().WriteLineRaw(str(), sync_); }
 
 StderrLogMessage::StderrLogMessage(const char* file, int line)
-    : log_(file, line) {}
+    : log_(file, line, true) {}
 
 StderrLogMessage::~StderrLogMessage() {
   std::cerr << str() << std::endl;
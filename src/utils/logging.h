@@ -27,40 +27,69 @@
 
 #pragma once
 
+#include <atomic>
 #include <deque>
 #include <fstream>
 #include <iomanip>
 #include <sstream>
 #include <string>
+#include <thread>
 
+#include "utils/mpmc_queue.h"
 #include "utils/mutex.h"
 
 namespace lczero {
 
+// Lines are written by a background thread, so that logging threads don't
+// wait for the disk. If they log faster than it writes, lines beyond
+// kQueueSizeLines are dropped, and how many is logged. Lines also going to
+// stderr, which errors do, are written before the logging returns, and so
+// is everything queued at exit or std::terminate(); so that they're not lost
+// with the process.
 class Logging {
  public:
   static Logging& Get();
+  ~Logging();
 
   // Sets the name of the log. Empty name disables logging.
   void SetFilename(const std::string& filename);
 
- private:
-  // Writes line to the log, and appends new line character.
-  void WriteLineRaw(const std::string& line);
+  // Writes the queued lines and flushes the log.
+  void Flush();
 
+ private:
+  static constexpr size_t kQueueSizeLines = 4096;
+
+  // Queues line for the log, to have a new line character appended. With
+  // @sync, writes it after the lines queued before and flushes the log.
+  void WriteLineRaw(std::string line, bool sync);
+  // Writes the queued lines until the queue is closed.
+  void WriterThread();
+  // Writes the lines left in the queue, and a note on those dropped.
+  void DrainQueue() REQUIRES(mutex_);
+  void WriteLine(const std::string& line) REQUIRES(mutex_);
+
+  MpmcQueue<std::string> queue_{kQueueSizeLines};
+  std::atomic<uint64_t> dropped_lines_{0};
   Mutex mutex_;
   std::string filename_ GUARDED_BY(mutex_);
   std::ofstream file_ GUARDED_BY(mutex_);
   std::deque<std::string> buffer_ GUARDED_BY(mutex_);
+  // Last, so that it starts with everything else constructed.
+  std::thread writer_;
 
-  Logging() = default;
+  Logging();
   friend class LogMessage;
 };
 
 class LogMessage : public std::ostringstream {
  public:
-  LogMessage(const char* file, int line);
+  // With @sync, the line is written before the destructor returns.
+  LogMessage(const char* file, int line, bool sync = false);
   ~LogMessage();
+
+ private:
+  const bool sync_;
 };
 
 class StderrLogMessage : public std::ostringstream {
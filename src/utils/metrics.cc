@@ -0,0 +1,258 @@
+/*
+ This file is part of Leela Chess Zero.
+ Copyright (C) 2018 The LCZero Authors
+
+ Leela Chess is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ Leela Chess is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+ Additional permission under GNU GPL version 3 section 7
+
+ If you modify this Program, or any covered work, by linking or
+ combining it with NVIDIA Corporation's libraries from the NVIDIA CUDA
+ Toolkit and the NVIDIA CUDA Deep Neural Network library (or a
+ modified version of those libraries), containing parts covered by the
+ terms of the respective license agreement, the licensors of this
+ Program grant you additional permission to convey the resulting work.
+ */
+
+#include "utils/metrics.h"
+
+#include <algorithm>
+#include <map>
+#include <sstream>
+#include "utils/exception.h"
+#include "utils/logging.h"
+
+#ifndef _WIN32
+#include <netdb.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#endif
+
+namespace lczero {
+namespace {
+
+const OptionId kMetricsPortId{
+    "metrics-port", "",
+    "Port to serve metrics on over HTTP, in Prometheus text format. 0 to "
+    "disable."};
+const OptionId kStatsdId{
+    "statsd", "", "host:port of a StatsD server to push metrics to over UDP."};
+const OptionId kStatsdIntervalId{
+    "statsd-interval", "", "Milliseconds between pushes to StatsD."};
+
+// StatsD packets are kept below the usual MTU.
+const size_t kMaxStatsdPacket = 1400;
+
+struct MetricRegistry {
+  Mutex mutex;
+  std::vector<const Metric*> metrics GUARDED_BY(mutex);
+};
+
+MetricRegistry* Registry() {
+  static MetricRegistry* registry = new MetricRegistry;
+  return registry;
+}
+
+std::string FormatValue(double value) {
+  std::ostringstream oss;
+  oss.precision(15);
+  oss << value;
+  return oss.str();
+}
+
+}  // namespace
+
+Metric::Metric(const char* name, const char* help, Type type)
+    : name_(name), help_(help), type_(type) {
+  MetricRegistry* registry = Registry();
+  Mutex::Lock lock(registry->mutex);
+  registry->metrics.push_back(this);
+}
+
+std::vector<const Metric*> Metric::GetAll() {
+  MetricRegistry* registry = Registry();
+  Mutex::Lock lock(registry->mutex);
+  auto metrics = registry->metrics;
+  std::sort(metrics.begin(), metrics.end(),
+            [](const Metric* a, const Metric* b) {
+              return std::string(a->name()) < b->name();
+            });
+  return metrics;
+}
+
+void MetricsExporter::PopulateOptions(OptionsParser* options) {
+  options->Add<IntOption>(kMetricsPortId, 0, 65535) = 0;
+  options->Add<StringOption>(kStatsdId);
+  options->Add<IntOption>(kStatsdIntervalId, 100, 3600000) = 10000;
+}
+
+std::string MetricsExporter::GetPrometheusText() {
+  std::ostringstream oss;
+  for (const Metric* metric : Metric::GetAll()) {
+    oss << "# HELP " << metric->name() << " " << metric->help() << "\n";
+    oss << "# TYPE " << metric->name() << " "
+        << (metric->type() == Metric::kCounter ? "counter" : "gauge") << "\n";
+    oss << metric->name() << " " << FormatValue(metric->GetValue()) << "\n";
+  }
+  return oss.str();
+}
+
+#ifdef _WIN32
+MetricsExporter::MetricsExporter(const OptionsDict& options)
+    : statsd_interval_(options.Get<int>(kStatsdIntervalId.GetId())) {
+  if (options.Get<int>(kMetricsPortId.GetId()) != 0 ||
+      !options.Get<std::string>(kStatsdId.GetId()).empty()) {
+    CERR << "Metrics export is not supported on Windows.";
+  }
+}
+
+MetricsExporter::~MetricsExporter() {}
+
+void MetricsExporter::ServeHttp() {}
+void MetricsExporter::PushStatsd() {}
+#else
+MetricsExporter::MetricsExporter(const OptionsDict& options)
+    : statsd_interval_(options.Get<int>(kStatsdIntervalId.GetId())) {
+  const int port = options.Get<int>(kMetricsPortId.GetId());
+  if (port != 0) {
+    http_socket_ = socket(AF_INET6, SOCK_STREAM, 0);
+    if (http_socket_ < 0) throw Exception("Unable to create metrics socket");
+    const int on = 1;
+    setsockopt(http_socket_, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    // Accept IPv4 as well.
+    const int off = 0;
+    setsockopt(http_socket_, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+    sockaddr_in6 addr = {};
+    addr.sin6_family = AF_INET6;
+    addr.sin6_addr = in6addr_any;
+    addr.sin6_port = htons(port);
+    if (bind(http_socket_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) <
+            0 ||
+        listen(http_socket_, 16) < 0) {
+      close(http_socket_);
+      throw Exception("Unable to listen for metrics on port " +
+                      std::to_string(port));
+    }
+    CERR << "Serving metrics on port " << port;
+    threads_.emplace_back([this]() { ServeHttp(); });
+  }
+
+  const std::string statsd = options.Get<std::string>(kStatsdId.GetId());
+  if (!statsd.empty()) {
+    const auto colon = statsd.rfind(':');
+    if (colon == std::string::npos) {
+      throw Exception("StatsD address must be host:port, got " + statsd);
+    }
+    addrinfo hints = {};
+    hints.ai_socktype = SOCK_DGRAM;
+    addrinfo* result = nullptr;
+    if (getaddrinfo(statsd.substr(0, colon).c_str(),
+                    statsd.substr(colon + 1).c_str(), &hints, &result) != 0 ||
+        !result) {
+      throw Exception("Unable to resolve StatsD address " + statsd);
+    }
+    statsd_socket_ =
+        socket(result->ai_family, result->ai_socktype, result->ai_protocol);
+    // Connected, so that send() goes to the server.
+    if (statsd_socket_ < 0 ||
+        connect(statsd_socket_, result->ai_addr, result->ai_addrlen) < 0) {
+      freeaddrinfo(result);
+      if (statsd_socket_ >= 0) close(statsd_socket_);
+      throw Exception("Unable to open StatsD socket to " + statsd);
+    }
+    freeaddrinfo(result);
+    threads_.emplace_back([this]() { PushStatsd(); });
+  }
+}
+
+MetricsExporter::~MetricsExporter() {
+  {
+    Mutex::Lock lock(mutex_);
+    stop_ = true;
+  }
+  cv_.notify_all();
+  for (auto& thread : threads_) thread.join();
+  if (http_socket_ >= 0) close(http_socket_);
+  if (statsd_socket_ >= 0) close(statsd_socket_);
+}
+
+void MetricsExporter::ServeHttp() {
+  while (true) {
+    {
+      Mutex::Lock lock(mutex_);
+      if (stop_) return;
+    }
+    // Wakes up now and then to see whether to stop.
+    pollfd fd = {http_socket_, POLLIN, 0};
+    if (poll(&fd, 1, 200) <= 0) continue;
+    const int client = accept(http_socket_, nullptr, nullptr);
+    if (client < 0) continue;
+    // Whatever was asked for, the answer is the metrics. The request is read
+    // so that closing doesn't reset the connection before the reply is read.
+    timeval timeout = {1, 0};
+    setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    char request[4096];
+    recv(client, request, sizeof(request), 0);
+    const std::string body = GetPrometheusText();
+    const std::string response =
+        "HTTP/1.0 200 OK\r\n"
+        "Content-Type: text/plain; version=0.0.4\r\n"
+        "Content-Length: " +
+        std::to_string(body.size()) + "\r\n\r\n" + body;
+    size_t sent = 0;
+    while (sent < response.size()) {
+      const auto n = send(client, response.data() + sent,
+                          response.size() - sent, MSG_NOSIGNAL);
+      if (n <= 0) break;
+      sent += n;
+    }
+    close(client);
+  }
+}
+
+void MetricsExporter::PushStatsd() {
+  // Counter values at the last push.
+  std::map<const Metric*, double> pushed;
+  while (true) {
+    {
+      Mutex::Lock lock(mutex_);
+      cv_.wait_for(lock.get_raw(), statsd_interval_,
+                   [this]() NO_THREAD_SAFETY_ANALYSIS { return stop_; });
+      if (stop_) return;
+    }
+    std::string packet;
+    for (const Metric* metric : Metric::GetAll()) {
+      const double value = metric->GetValue();
+      std::string line = metric->name();
+      if (metric->type() == Metric::kCounter) {
+        line += ":" + FormatValue(value - pushed[metric]) + "|c\n";
+        pushed[metric] = value;
+      } else {
+        line += ":" + FormatValue(value) + "|g\n";
+      }
+      if (packet.size() + line.size() > kMaxStatsdPacket) {
+        send(statsd_socket_, packet.data(), packet.size(), 0);
+        packet.clear();
+      }
+      packet += line;
+    }
+    if (!packet.empty()) send(statsd_socket_, packet.data(), packet.size(), 0);
+  }
+}
+#endif
+
+}  // namespace lczero
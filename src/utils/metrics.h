@@ -0,0 +1,124 @@
+/*
+ This file is part of Leela Chess Zero.
+ Copyright (C) 2018 The LCZero Authors
+
+ Leela Chess is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ Leela Chess is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+ Additional permission under GNU GPL version 3 section 7
+
+ If you modify this Program, or any covered work, by linking or
+ combining it with NVIDIA Corporation's libraries from the NVIDIA CUDA
+ Toolkit and the NVIDIA CUDA Deep Neural Network library (or a
+ modified version of those libraries), containing parts covered by the
+ terms of the respective license agreement, the licensors of this
+ Program grant you additional permission to convey the resulting work.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <string>
+#include <thread>
+#include <vector>
+#include "utils/mutex.h"
+#include "utils/optionsdict.h"
+#include "utils/optionsparser.h"
+
+namespace lczero {
+
+// Process wide metric. Metrics are static objects which register themselves,
+// updating one is a single relaxed atomic operation.
+class Metric {
+ public:
+  enum Type { kCounter, kGauge };
+
+  Metric(const char* name, const char* help, Type type);
+
+  const char* name() const { return name_; }
+  const char* help() const { return help_; }
+  Type type() const { return type_; }
+  virtual double GetValue() const = 0;
+
+  // All registered metrics.
+  static std::vector<const Metric*> GetAll();
+
+ protected:
+  ~Metric() = default;
+
+ private:
+  const char* const name_;
+  const char* const help_;
+  const Type type_;
+};
+
+// Monotonically increasing count.
+class Counter : public Metric {
+ public:
+  Counter(const char* name, const char* help) : Metric(name, help, kCounter) {}
+  void Add(int64_t value = 1) {
+    value_.fetch_add(value, std::memory_order_relaxed);
+  }
+  double GetValue() const override {
+    return value_.load(std::memory_order_relaxed);
+  }
+
+ private:
+  std::atomic<int64_t> value_{0};
+};
+
+// Value which goes up and down.
+class Gauge : public Metric {
+ public:
+  Gauge(const char* name, const char* help) : Metric(name, help, kGauge) {}
+  void Set(double value) { value_.store(value, std::memory_order_relaxed); }
+  double GetValue() const override {
+    return value_.load(std::memory_order_relaxed);
+  }
+
+ private:
+  std::atomic<double> value_{0.0};
+};
+
+// Publishes all metrics from a background thread, in Prometheus text format
+// to whoever connects to the HTTP port, and/or pushed to a StatsD server over
+// UDP: counters as the increment since the last push, gauges as they are.
+// Does nothing when neither is configured.
+class MetricsExporter {
+ public:
+  MetricsExporter(const OptionsDict& options);
+  ~MetricsExporter();
+
+  static void PopulateOptions(OptionsParser* options);
+
+  // Metrics in Prometheus text exposition format.
+  static std::string GetPrometheusText();
+
+ private:
+  void ServeHttp();
+  void PushStatsd();
+
+  int http_socket_ = -1;
+  int statsd_socket_ = -1;
+  std::chrono::milliseconds statsd_interval_;
+
+  Mutex mutex_;
+  std::condition_variable cv_;
+  bool stop_ GUARDED_BY(mutex_) = false;
+  std::vector<std::thread> threads_;
+};
+
+}  // namespace lczero
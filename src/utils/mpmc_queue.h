@@ -0,0 +1,196 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2018 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+
+  If you modify this Program, or any covered work, by linking or
+  combining it with NVIDIA Corporation's libraries from the NVIDIA CUDA
+  Toolkit and the NVIDIA CUDA Deep Neural Network library (or a
+  modified version of those libraries), containing parts covered by the
+  terms of the respective license agreement, the licensors of this
+  Program grant you additional permission to convey the resulting work.
+*/
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <memory>
+#include <thread>
+#include "utils/mutex.h"
+
+namespace lczero {
+
+// Bounded multi-producer multi-consumer queue. Pushing and popping are lock
+// free (ring of sequenced cells by Dmitry Vyukov); consumers that find it
+// empty spin for a while, and only then park on a condition variable.
+// Producers only touch the mutex when someone is parked.
+template <typename T>
+class MpmcQueue {
+ public:
+  using Clock = std::chrono::steady_clock;
+
+  // Capacity is rounded up to a power of two.
+  explicit MpmcQueue(size_t capacity) {
+    size_t size = 2;
+    while (size < capacity) size *= 2;
+    mask_ = size - 1;
+    cells_ = std::make_unique<Cell[]>(size);
+    for (size_t i = 0; i < size; ++i) {
+      cells_[i].sequence.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  // Returns false if the queue is full.
+  bool TryPush(T& item) {
+    size_t pos = push_pos_.value.load(std::memory_order_relaxed);
+    Cell* cell;
+    while (true) {
+      cell = &cells_[pos & mask_];
+      const size_t seq = cell->sequence.load(std::memory_order_acquire);
+      const auto diff = static_cast<std::ptrdiff_t>(seq - pos);
+      if (diff == 0) {
+        if (push_pos_.value.compare_exchange_weak(pos, pos + 1,
+                                                  std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = push_pos_.value.load(std::memory_order_relaxed);
+      }
+    }
+    cell->item = std::move(item);
+    cell->sequence.store(pos + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Returns false if the queue is empty.
+  bool TryPop(T* item) {
+    size_t pos = pop_pos_.value.load(std::memory_order_relaxed);
+    Cell* cell;
+    while (true) {
+      cell = &cells_[pos & mask_];
+      const size_t seq = cell->sequence.load(std::memory_order_acquire);
+      const auto diff = static_cast<std::ptrdiff_t>(seq - (pos + 1));
+      if (diff == 0) {
+        if (pop_pos_.value.compare_exchange_weak(pos, pos + 1,
+                                                 std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = pop_pos_.value.load(std::memory_order_relaxed);
+      }
+    }
+    *item = std::move(cell->item);
+    cell->sequence.store(pos + mask_ + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Yields while the queue is full.
+  void Push(T item) {
+    while (!TryPush(item)) std::this_thread::yield();
+    WakeConsumer();
+  }
+
+  // Like TryPush(), but wakes a parked consumer. Returns false, leaving
+  // @item alone, if the queue is full.
+  bool Offer(T& item) {
+    if (!TryPush(item)) return false;
+    WakeConsumer();
+    return true;
+  }
+
+  // Blocks until an item is available. Returns false once closed.
+  bool Pop(T* item) { return PopUntil(item, Clock::time_point::max()); }
+
+  // Same as Pop(), but also returns false when @deadline passes.
+  bool PopUntil(T* item, Clock::time_point deadline) {
+    for (int i = 0; i < kSpinCount; ++i) {
+      if (closed_.load(std::memory_order_acquire)) return false;
+      if (TryPop(item)) return true;
+      if (i >= kSpinCount / 2) std::this_thread::yield();
+    }
+    Mutex::Lock lock(mutex_);
+    sleepers_.fetch_add(1);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    bool result = false;
+    while (true) {
+      if (closed_.load(std::memory_order_acquire)) break;
+      if (TryPop(item)) {
+        result = true;
+        break;
+      }
+      if (deadline == Clock::time_point::max()) {
+        cv_.wait(lock.get_raw());
+      } else if (cv_.wait_until(lock.get_raw(), deadline) ==
+                 std::cv_status::timeout) {
+        result = !closed_.load(std::memory_order_acquire) && TryPop(item);
+        break;
+      }
+    }
+    sleepers_.fetch_sub(1);
+    return result;
+  }
+
+  // Wakes up all waiting consumers, further Pop()s return false. Items left
+  // in the queue can still be taken with TryPop().
+  void Close() {
+    closed_.store(true, std::memory_order_release);
+    Mutex::Lock lock(mutex_);
+    cv_.notify_all();
+  }
+
+ private:
+  static constexpr int kSpinCount = 128;
+
+  void WakeConsumer() {
+    // Pairs with the increment of sleepers_ in PopUntil(): either the
+    // sleeper sees the item, or we see the sleeper.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (sleepers_.load(std::memory_order_relaxed) > 0) {
+      Mutex::Lock lock(mutex_);
+      cv_.notify_one();
+    }
+  }
+
+  struct Cell {
+    std::atomic<size_t> sequence;
+    T item;
+  };
+
+  // Padding keeps producers and consumers off each other's cache line.
+  struct Position {
+    char pad[64];
+    std::atomic<size_t> value{0};
+  };
+
+  std::unique_ptr<Cell[]> cells_;
+  size_t mask_;
+  Position push_pos_;
+  Position pop_pos_;
+  std::atomic<int> sleepers_{0};
+  std::atomic<bool> closed_{false};
+  Mutex mutex_{"mpmc queue"};
+  std::condition_variable cv_;
+};
+
+}  // namespace lczero
@@ -0,0 +1,113 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2018 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+
+  If you modify this Program, or any covered work, by linking or
+  combining it with NVIDIA Corporation's libraries from the NVIDIA CUDA
+  Toolkit and the NVIDIA CUDA Deep Neural Network library (or a
+  modified version of those libraries), containing parts covered by the
+  terms of the respective license agreement, the licensors of this
+  Program grant you additional permission to convey the resulting work.
+*/
+
+#include "utils/mpmc_queue.h"
+
+#include <gtest/gtest.h>
+#include <thread>
+#include <vector>
+
+namespace lczero {
+
+TEST(MpmcQueue, FifoAndCapacity) {
+  MpmcQueue<int> queue(3);
+  for (int i = 0; i < 4; ++i) EXPECT_TRUE(queue.TryPush(i));
+  int item = 42;
+  EXPECT_FALSE(queue.TryPush(item));
+  for (int i = 0; i < 4; ++i) {
+    EXPECT_TRUE(queue.TryPop(&item));
+    EXPECT_EQ(item, i);
+  }
+  EXPECT_FALSE(queue.TryPop(&item));
+}
+
+TEST(MpmcQueue, PopUntilTimesOut) {
+  MpmcQueue<int> queue(4);
+  int item;
+  EXPECT_FALSE(queue.PopUntil(&item, MpmcQueue<int>::Clock::now() +
+                                         std::chrono::milliseconds(1)));
+}
+
+TEST(MpmcQueue, CloseWakesConsumers) {
+  MpmcQueue<int> queue(4);
+  std::thread consumer([&]() {
+    int item;
+    EXPECT_FALSE(queue.Pop(&item));
+  });
+  std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  queue.Close();
+  consumer.join();
+}
+
+TEST(MpmcQueue, OfferWakesConsumer) {
+  MpmcQueue<int> queue(2);
+  std::thread consumer([&]() {
+    int item;
+    ASSERT_TRUE(queue.Pop(&item));
+    EXPECT_EQ(item, 7);
+  });
+  std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  int item = 7;
+  EXPECT_TRUE(queue.Offer(item));
+  consumer.join();
+  for (int i = 0; i < 2; ++i) EXPECT_TRUE(queue.Offer(i));
+  item = 42;
+  EXPECT_FALSE(queue.Offer(item));
+  EXPECT_EQ(item, 42);
+}
+
+TEST(MpmcQueue, ManyProducersAndConsumers) {
+  const int kThreads = 4;
+  const int kItems = 20000;
+  // Small queue, so that producers hit it being full too.
+  MpmcQueue<int> queue(16);
+  std::vector<std::thread> threads;
+  std::vector<long long> sums(kThreads);
+  for (int t = 0; t < kThreads; ++t) {
+    threads.emplace_back([&queue]() {
+      for (int i = 1; i <= kItems; ++i) queue.Push(i);
+    });
+    threads.emplace_back([&queue, &sums, t]() {
+      int item;
+      for (int i = 0; i < kItems; ++i) {
+        ASSERT_TRUE(queue.Pop(&item));
+        sums[t] += item;
+      }
+    });
+  }
+  for (auto& thread : threads) thread.join();
+  long long total = 0;
+  for (auto sum : sums) total += sum;
+  EXPECT_EQ(total, kThreads * (kItems * (kItems + 1LL) / 2));
+}
+
+}  // namespace lczero
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
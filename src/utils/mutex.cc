@@ -0,0 +1,128 @@
+/*
+ This file is part of Leela Chess Zero.
+ Copyright (C) 2018 The LCZero Authors
+
+ Leela Chess is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ Leela Chess is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+ Additional permission under GNU GPL version 3 section 7
+
+ If you modify this Program, or any covered work, by linking or
+ combining it with NVIDIA Corporation's libraries from the NVIDIA CUDA
+ Toolkit and the NVIDIA CUDA Deep Neural Network library (or a
+ modified version of those libraries), containing parts covered by the
+ terms of the respective license agreement, the licensors of this
+ Program grant you additional permission to convey the resulting work.
+ */
+
+#include "utils/mutex.h"
+
+#if defined(LOCK_STATS)
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <sstream>
+
+namespace lczero {
+namespace {
+
+// Stats are never freed, named mutexes may be used until the very end of
+// static destruction.
+struct LockStatsRegistry {
+  std::mutex mutex;
+  std::map<std::string, LockStats*> stats;
+};
+
+LockStatsRegistry* Registry() {
+  static LockStatsRegistry* registry = new LockStatsRegistry;
+  return registry;
+}
+
+// Dumps all the stats when destroyed at exit.
+struct LockStatsDumper {
+  ~LockStatsDumper() {
+    LockStatsRegistry* registry = Registry();
+    std::lock_guard<std::mutex> lock(registry->mutex);
+    for (const auto& entry : registry->stats) {
+      std::cerr << "Lock " << entry.first << ": " << entry.second->GetStats()
+                << std::endl;
+    }
+  }
+};
+
+std::string FormatNanoseconds(uint64_t ns) {
+  std::ostringstream oss;
+  if (ns >= 1000000000) {
+    oss << ns / 1000000000 << "s";
+  } else if (ns >= 1000000) {
+    oss << ns / 1000000 << "ms";
+  } else if (ns >= 1000) {
+    oss << ns / 1000 << "us";
+  } else {
+    oss << ns << "ns";
+  }
+  return oss.str();
+}
+
+}  // namespace
+
+LockStats* LockStats::Get(const char* name) {
+  static LockStatsDumper dumper;
+  LockStatsRegistry* registry = Registry();
+  std::lock_guard<std::mutex> lock(registry->mutex);
+  LockStats*& stats = registry->stats[name];
+  if (!stats) stats = new LockStats;
+  return stats;
+}
+
+void LockStats::RecordWait(Clock::duration wait) {
+  contended_.fetch_add(1, std::memory_order_relaxed);
+  wait_ns_.fetch_add(
+      std::chrono::duration_cast<std::chrono::nanoseconds>(wait).count(),
+      std::memory_order_relaxed);
+}
+
+void LockStats::RecordHold(Clock::duration hold) {
+  const uint64_t ns =
+      std::chrono::duration_cast<std::chrono::nanoseconds>(hold).count();
+  hold_ns_.fetch_add(ns, std::memory_order_relaxed);
+  int bucket = 0;
+  while (bucket + 1 < kHoldBuckets && (ns >> (bucket + 1))) ++bucket;
+  holds_[bucket].fetch_add(1, std::memory_order_relaxed);
+}
+
+std::string LockStats::GetStats() const {
+  const uint64_t acquisitions = acquisitions_.load();
+  const uint64_t contended = contended_.load();
+  uint64_t holds = 0;
+  for (const auto& count : holds_) holds += count.load();
+  std::ostringstream oss;
+  oss << acquisitions << " acquisitions, " << contended << " contended ("
+      << std::fixed << std::setprecision(2)
+      << (acquisitions ? 100.0 * contended / acquisitions : 0.0)
+      << "%), waited " << FormatNanoseconds(wait_ns_.load()) << ", mean hold "
+      << FormatNanoseconds(holds ? hold_ns_.load() / holds : 0);
+  if (holds) oss << "\n  holds from:";
+  const char* delim = " ";
+  for (int i = 0; i < kHoldBuckets; ++i) {
+    const uint64_t count = holds_[i].load();
+    if (count == 0) continue;
+    oss << delim << FormatNanoseconds(uint64_t(1) << i) << ": " << count;
+    delim = ", ";
+  }
+  return oss.str();
+}
+
+}  // namespace lczero
+#endif
@@ -32,8 +32,62 @@
 #include <shared_mutex>
 #include "utils/cppattributes.h"
 
+#if defined(LOCK_STATS)
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#endif
+
 namespace lczero {
 
+#if defined(LOCK_STATS)
+// Contention counters shared by all Mutex and SharedMutex objects constructed
+// with the same name, dumped to stderr at exit. Only compiled with the
+// lock_stats build option. Hold times are of exclusive locks only, and include
+// condition variable waits done while holding the lock.
+class LockStats {
+ public:
+  using Clock = std::chrono::steady_clock;
+
+  // Returns the counters of @name, which live until exit.
+  static LockStats* Get(const char* name);
+
+  template <typename M>
+  void Lock(M& mutex) {
+    acquisitions_.fetch_add(1, std::memory_order_relaxed);
+    if (mutex.try_lock()) return;
+    const auto start = Clock::now();
+    mutex.lock();
+    RecordWait(Clock::now() - start);
+  }
+  template <typename M>
+  void LockShared(M& mutex) {
+    acquisitions_.fetch_add(1, std::memory_order_relaxed);
+    if (mutex.try_lock_shared()) return;
+    const auto start = Clock::now();
+    mutex.lock_shared();
+    RecordWait(Clock::now() - start);
+  }
+  void RecordHold(Clock::duration hold);
+
+  // One line of counters, and the hold time histogram.
+  std::string GetStats() const;
+
+  // Hold time buckets, bucket i counts holds from 2^i to 2^(i+1)-1 ns.
+  static constexpr int kHoldBuckets = 40;
+
+ private:
+  void RecordWait(Clock::duration wait);
+
+  std::atomic<uint64_t> acquisitions_{0};
+  std::atomic<uint64_t> contended_{0};
+  std::atomic<uint64_t> wait_ns_{0};
+  std::atomic<uint64_t> hold_ns_{0};
+  std::array<std::atomic<uint64_t>, kHoldBuckets> holds_{};
+};
+#endif
+
 // Implementation of reader-preferenced shared mutex. Based on fair shared
 // mutex.
 class CAPABILITY("mutex") RpSharedMutex {
@@ -62,31 +116,116 @@ class CAPABILITY("mutex") RpSharedMutex {
   std::atomic<int> waiting_readers_;
 };
 
-// std::mutex wrapper for clang thread safety annotation.
+// std::mutex wrapper for clang thread safety annotation. Named mutexes are
+// counted in LockStats when built with lock_stats.
 class CAPABILITY("mutex") Mutex {
  public:
+  explicit Mutex(const char* name = nullptr) {
+#if defined(LOCK_STATS)
+    if (name) stats_ = LockStats::Get(name);
+#else
+    (void)name;
+#endif
+  }
+
   // std::unique_lock<std::mutex> wrapper.
   class SCOPED_CAPABILITY Lock {
    public:
+#if defined(LOCK_STATS)
+    Lock(Mutex& m) ACQUIRE(m) : mutex_(&m) {
+      m.lock();
+      lock_ = std::unique_lock<std::mutex>(m.get_raw(), std::adopt_lock);
+    }
+    ~Lock() RELEASE() {
+      if (lock_.owns_lock()) {
+        lock_.release();
+        mutex_->unlock();
+      }
+    }
+#else
     Lock(Mutex& m) ACQUIRE(m) : lock_(m.get_raw()) {}
     ~Lock() RELEASE() {}
+#endif
     std::unique_lock<std::mutex>& get_raw() { return lock_; }
 
    private:
+#if defined(LOCK_STATS)
+    Mutex* const mutex_;
+#endif
     std::unique_lock<std::mutex> lock_;
   };
 
+#if defined(LOCK_STATS)
+  void lock() ACQUIRE() {
+    if (!stats_) return mutex_.lock();
+    stats_->Lock(mutex_);
+    locked_at_ = LockStats::Clock::now();
+  }
+  void unlock() RELEASE() {
+    if (stats_) stats_->RecordHold(LockStats::Clock::now() - locked_at_);
+    mutex_.unlock();
+  }
+#else
   void lock() ACQUIRE() { mutex_.lock(); }
   void unlock() RELEASE() { mutex_.unlock(); }
+#endif
   std::mutex& get_raw() { return mutex_; }
 
  private:
   std::mutex mutex_;
+#if defined(LOCK_STATS)
+  LockStats* stats_ = nullptr;
+  LockStats::Clock::time_point locked_at_;
+#endif
 };
 
-// std::shared_mutex wrapper for clang thread safety annotation.
+// std::shared_mutex wrapper for clang thread safety annotation. Named
+// mutexes are counted in LockStats when built with lock_stats.
 class CAPABILITY("mutex") SharedMutex {
  public:
+  explicit SharedMutex(const char* name = nullptr) {
+#if defined(LOCK_STATS)
+    if (name) stats_ = LockStats::Get(name);
+#else
+    (void)name;
+#endif
+  }
+
+#if defined(LOCK_STATS)
+  class SCOPED_CAPABILITY Lock {
+   public:
+    Lock(SharedMutex& m) ACQUIRE(m) : mutex_(m) { m.lock(); }
+    ~Lock() RELEASE() { mutex_.unlock(); }
+
+   private:
+    SharedMutex& mutex_;
+  };
+
+  class SCOPED_CAPABILITY SharedLock {
+   public:
+    SharedLock(SharedMutex& m) ACQUIRE_SHARED(m) : mutex_(m) {
+      m.lock_shared();
+    }
+    ~SharedLock() RELEASE() { mutex_.unlock_shared(); }
+
+   private:
+    SharedMutex& mutex_;
+  };
+
+  void lock() ACQUIRE() {
+    if (!stats_) return mutex_.lock();
+    stats_->Lock(mutex_);
+    locked_at_ = LockStats::Clock::now();
+  }
+  void unlock() RELEASE() {
+    if (stats_) stats_->RecordHold(LockStats::Clock::now() - locked_at_);
+    mutex_.unlock();
+  }
+  void lock_shared() ACQUIRE_SHARED() {
+    if (!stats_) return mutex_.lock_shared();
+    stats_->LockShared(mutex_);
+  }
+#else
   // std::unique_lock<std::shared_mutex> wrapper.
   class SCOPED_CAPABILITY Lock {
    public:
@@ -110,12 +249,17 @@ class CAPABILITY("mutex") SharedMutex {
   void lock() ACQUIRE() { mutex_.lock(); }
   void unlock() RELEASE() { mutex_.unlock(); }
   void lock_shared() ACQUIRE_SHARED() { mutex_.lock_shared(); }
+#endif
   void unlock_shared() RELEASE_SHARED() { mutex_.unlock_shared(); }
 
   std::shared_timed_mutex& get_raw() { return mutex_; }
 
  private:
   std::shared_timed_mutex mutex_;
+#if defined(LOCK_STATS)
+  LockStats* stats_ = nullptr;
+  LockStats::Clock::time_point locked_at_;
+#endif
 };
 
 }  // namespace lczero
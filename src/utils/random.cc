@@ -26,19 +26,84 @@
 */
 
 #include "random.h"
+
+#include <atomic>
 #include <random>
 
+#include "utils/optionsparser.h"
+
 namespace lczero {
 
-Random::Random() : gen_(std::random_device()()) {}
+namespace {
+const OptionId kSeedId{
+    "seed", "",
+    "Seed of the random generators, 0 for a random one. Threads are seeded "
+    "in the order they start, so only runs with one thread repeat exactly."};
+
+// Global seed, and how many threads were seeded from it.
+std::atomic<uint64_t> global_seed{std::random_device()() |
+                                  (uint64_t{std::random_device()()} << 32)};
+std::atomic<uint64_t> seeded_threads{0};
+
+// Splitmix64 step.
+uint64_t Mix(uint64_t* seed) {
+  uint64_t z = (*seed += 0x9E3779B97F4A7C15ULL);
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  return z ^ (z >> 31);
+}
+
+uint64_t NextThreadSeed() {
+  // Threads get consecutive streams of the mixed global seed, so that
+  // nearby global seeds don't share streams.
+  uint64_t seed = global_seed.load(std::memory_order_relaxed);
+  return Mix(&seed) + seeded_threads.fetch_add(1, std::memory_order_relaxed);
+}
+
+uint64_t Rotl(uint64_t x, int k) { return (x << k) | (x >> (64 - k)); }
+}  // namespace
+
+void Random::Generator::Seed(uint64_t seed) {
+  for (auto& s : state_) s = Mix(&seed);
+}
+
+Random::Generator::result_type Random::Generator::operator()() {
+  const uint64_t result = Rotl(state_[1] * 5, 7) * 9;
+  const uint64_t t = state_[1] << 17;
+  state_[2] ^= state_[0];
+  state_[3] ^= state_[1];
+  state_[1] ^= state_[2];
+  state_[0] ^= state_[3];
+  state_[2] ^= t;
+  state_[3] = Rotl(state_[3], 45);
+  return result;
+}
+
+Random::Random() { gen_.Seed(NextThreadSeed()); }
 
 Random& Random::Get() {
-  static Random rand;
+  thread_local Random rand;
   return rand;
 }
 
+void Random::Seed(uint64_t seed) {
+  // The calling thread may not have its generator yet.
+  Random& rand = Get();
+  global_seed.store(seed, std::memory_order_relaxed);
+  seeded_threads.store(0, std::memory_order_relaxed);
+  rand.gen_.Seed(NextThreadSeed());
+}
+
+void Random::PopulateOptions(OptionsParser* options) {
+  options->Add<IntOption>(kSeedId, 0, 999999999) = 0;
+}
+
+void Random::SeedFromOptions(const OptionsDict& options) {
+  const int seed = options.Get<int>(kSeedId.GetId());
+  if (seed != 0) Seed(seed);
+}
+
 int Random::GetInt(int min, int max) {
-  Mutex::Lock lock(mutex_);
   std::uniform_int_distribution<> dist(min, max);
   return dist(gen_);
 }
@@ -46,13 +111,11 @@ int Random::GetInt(int min, int max) {
 bool Random::GetBool() { return GetInt(0, 1) != 0; }
 
 double Random::GetDouble(double maxval) {
-  Mutex::Lock lock(mutex_);
   std::uniform_real_distribution<> dist(0.0, maxval);
   return dist(gen_);
 }
 
 float Random::GetFloat(float maxval) {
-  Mutex::Lock lock(mutex_);
   std::uniform_real_distribution<> dist(0.0, maxval);
   return dist(gen_);
 }
@@ -66,7 +129,6 @@ std::string Random::GetString(int length) {
 }
 
 double Random::GetGamma(double alpha, double beta) {
-  Mutex::Lock lock(mutex_);
   std::gamma_distribution<double> dist(alpha, beta);
   return dist(gen_);
 }
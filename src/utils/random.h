@@ -27,15 +27,31 @@
 
 #pragma once
 
+#include <cstdint>
 #include <random>
 #include <string>
-#include "utils/mutex.h"
 
 namespace lczero {
 
+class OptionsDict;
+class OptionsParser;
+
+// Every thread has its own generator, so that no lock is needed. Their seeds
+// are derived from a global seed, which is random unless set with Seed().
 class Random {
  public:
+  // Returns the generator of the calling thread.
   static Random& Get();
+  // Sets the global seed and reseeds the calling thread from it. Threads
+  // which get their generator after the call are seeded from it by the order
+  // they do; those which already have one keep it.
+  static void Seed(uint64_t seed);
+
+  // Adds the --seed flag.
+  static void PopulateOptions(OptionsParser* options);
+  // Calls Seed() with the flag, if given.
+  static void SeedFromOptions(const OptionsDict& options);
+
   double GetDouble(double max_val);
   float GetFloat(float max_val);
   double GetGamma(double alpha, double beta);
@@ -45,10 +61,23 @@ class Random {
   bool GetBool();
 
  private:
+  // xoshiro256**, usable with the standard distributions.
+  class Generator {
+   public:
+    using result_type = uint64_t;
+    static constexpr result_type min() { return 0; }
+    static constexpr result_type max() { return UINT64_MAX; }
+    // Fills the state with splitmix64 of @seed.
+    void Seed(uint64_t seed);
+    result_type operator()();
+
+   private:
+    uint64_t state_[4];
+  };
+
   Random();
 
-  Mutex mutex_;
-  std::mt19937 gen_ GUARDED_BY(mutex_);
+  Generator gen_;
 };
 
 }  // namespace lczero
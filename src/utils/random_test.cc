@@ -0,0 +1,85 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2018 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+
+  If you modify this Program, or any covered work, by linking or
+  combining it with NVIDIA Corporation's libraries from the NVIDIA CUDA
+  Toolkit and the NVIDIA CUDA Deep Neural Network library (or a
+  modified version of those libraries), containing parts covered by the
+  terms of the respective license agreement, the licensors of this
+  Program grant you additional permission to convey the resulting work.
+*/
+
+#include "utils/random.h"
+
+#include <gtest/gtest.h>
+
+#include <thread>
+#include <vector>
+
+namespace lczero {
+namespace {
+std::vector<int> Draw(int count) {
+  std::vector<int> result;
+  for (int i = 0; i < count; ++i) result.push_back(Random::Get().GetInt(0, 99));
+  return result;
+}
+}  // namespace
+
+TEST(Random, SeedRepeatsSequence) {
+  Random::Seed(42);
+  const auto first = Draw(100);
+  Random::Seed(42);
+  EXPECT_EQ(Draw(100), first);
+  Random::Seed(43);
+  EXPECT_NE(Draw(100), first);
+}
+
+TEST(Random, ThreadsGetOwnStreams) {
+  Random::Seed(42);
+  const auto main_draws = Draw(100);
+  std::vector<int> thread_draws;
+  std::thread thread([&]() { thread_draws = Draw(100); });
+  thread.join();
+  EXPECT_NE(thread_draws, main_draws);
+  // The second thread seeded from the global seed gets the same stream again.
+  Random::Seed(42);
+  Draw(100);
+  std::vector<int> repeated_draws;
+  std::thread repeated([&]() { repeated_draws = Draw(100); });
+  repeated.join();
+  EXPECT_EQ(repeated_draws, thread_draws);
+}
+
+TEST(Random, StaysInRange) {
+  for (int i = 0; i < 10000; ++i) {
+    const int x = Random::Get().GetInt(-3, 3);
+    EXPECT_GE(x, -3);
+    EXPECT_LE(x, 3);
+    const float f = Random::Get().GetFloat(2.0f);
+    EXPECT_GE(f, 0.0f);
+    EXPECT_LT(f, 2.0f);
+  }
+}
+
+}  // namespace lczero
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,100 @@
+/*
+ This file is part of Leela Chess Zero.
+ Copyright (C) 2018 The LCZero Authors
+
+ Leela Chess is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ Leela Chess is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+ Additional permission under GNU GPL version 3 section 7
+
+ If you modify this Program, or any covered work, by linking or
+ combining it with NVIDIA Corporation's libraries from the NVIDIA CUDA
+ Toolkit and the NVIDIA CUDA Deep Neural Network library (or a
+ modified version of those libraries), containing parts covered by the
+ terms of the respective license agreement, the licensors of this
+ Program grant you additional permission to convey the resulting work.
+ */
+
+#include "utils/threadpool.h"
+
+namespace lczero {
+
+ThreadPool::ThreadPool(int max_threads) : max_threads_(max_threads) {}
+
+ThreadPool::ThreadPool(int max_threads,
+                       std::function<void(int)> on_thread_start)
+    : max_threads_(max_threads), on_thread_start_(std::move(on_thread_start)) {}
+
+ThreadPool::~ThreadPool() {
+  std::vector<std::thread> threads;
+  {
+    Mutex::Lock lock(mutex_);
+    stop_ = true;
+    threads.swap(threads_);
+  }
+  cv_.notify_all();
+  for (auto& thread : threads) thread.join();
+}
+
+void ThreadPool::Add(std::function<void()> task) {
+  {
+    Mutex::Lock lock(mutex_);
+    tasks_.emplace_back(std::move(task));
+    const int threads = static_cast<int>(threads_.size());
+    if (idle_threads_ < static_cast<int>(tasks_.size()) &&
+        (max_threads_ == 0 || threads < max_threads_)) {
+      const int index = threads;
+      threads_.emplace_back([this, index]() { Worker(index); });
+      // Counted as idle until it picks up the task.
+      ++idle_threads_;
+    }
+  }
+  cv_.notify_one();
+}
+
+int ThreadPool::GetThreadCount() {
+  Mutex::Lock lock(mutex_);
+  return static_cast<int>(threads_.size());
+}
+
+ThreadPool& ThreadPool::Default() {
+  // Leaked intentionally: detached callbacks may still be running during
+  // static destruction.
+  static ThreadPool* pool = new ThreadPool();
+  return *pool;
+}
+
+void ThreadPool::Worker(int index) {
+  if (on_thread_start_) on_thread_start_(index);
+  while (true) {
+    std::function<void()> task;
+    {
+      Mutex::Lock lock(mutex_);
+      cv_.wait(lock.get_raw(), [&]() NO_THREAD_SAFETY_ANALYSIS {
+        return stop_ || !tasks_.empty();
+      });
+      if (tasks_.empty()) {
+        --idle_threads_;
+        return;
+      }
+      task = std::move(tasks_.front());
+      tasks_.pop_front();
+      --idle_threads_;
+    }
+    task();
+    Mutex::Lock lock(mutex_);
+    ++idle_threads_;
+  }
+}
+
+}  // namespace lczero
@@ -0,0 +1,72 @@
+/*
+ This file is part of Leela Chess Zero.
+ Copyright (C) 2018 The LCZero Authors
+
+ Leela Chess is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ Leela Chess is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+ Additional permission under GNU GPL version 3 section 7
+
+ If you modify this Program, or any covered work, by linking or
+ combining it with NVIDIA Corporation's libraries from the NVIDIA CUDA
+ Toolkit and the NVIDIA CUDA Deep Neural Network library (or a
+ modified version of those libraries), containing parts covered by the
+ terms of the respective license agreement, the licensors of this
+ Program grant you additional permission to convey the resulting work.
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <thread>
+#include <vector>
+#include "utils/mutex.h"
+
+namespace lczero {
+
+// Pool of worker threads running submitted tasks in FIFO order.
+// With @max_threads == 0 the pool grows by one thread whenever a task is
+// submitted while all existing threads are busy, so tasks never wait for each
+// other (which is required when tasks block on other tasks). Idle threads are
+// kept around to be reused.
+class ThreadPool {
+ public:
+  explicit ThreadPool(int max_threads = 0);
+  // Also runs @on_thread_start(index) first thing in every new thread, e.g.
+  // to pin it. Threads are indexed in the order they are started.
+  ThreadPool(int max_threads, std::function<void(int)> on_thread_start);
+  // Finishes all pending tasks and joins the threads.
+  ~ThreadPool();
+
+  void Add(std::function<void()> task);
+  int GetThreadCount();
+
+  // Process-wide elastic pool.
+  static ThreadPool& Default();
+
+ private:
+  void Worker(int index);
+
+  const int max_threads_;
+  const std::function<void(int)> on_thread_start_;
+  Mutex mutex_{"threadpool"};
+  std::condition_variable cv_;
+  std::deque<std::function<void()>> tasks_ GUARDED_BY(mutex_);
+  std::vector<std::thread> threads_ GUARDED_BY(mutex_);
+  int idle_threads_ GUARDED_BY(mutex_) = 0;
+  bool stop_ GUARDED_BY(mutex_) = false;
+};
+
+}  // namespace lczero
@@ -0,0 +1,135 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2019 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+
+  If you modify this Program, or any covered work, by linking or
+  combining it with NVIDIA Corporation's libraries from the NVIDIA CUDA
+  Toolkit and the NVIDIA CUDA Deep Neural Network library (or a
+  modified version of those libraries), containing parts covered by the
+  terms of the respective license agreement, the licensors of this
+  Program grant you additional permission to convey the resulting work.
+*/
+
+#include "utils/trace.h"
+
+#if defined(TRACE_EVENTS)
+#include <array>
+#include <atomic>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <vector>
+
+namespace lczero {
+namespace {
+
+const uint64_t kTraceCapacity = 1 << 16;
+
+struct TraceEvent {
+  const char* name;
+  int64_t start_ns;
+  int64_t duration_ns;
+};
+
+// Written by its own thread only. Older events are overwritten when full.
+struct TraceBuffer {
+  int tid;
+  std::atomic<uint64_t> count{0};
+  std::array<TraceEvent, kTraceCapacity> events;
+};
+
+// Buffers are never freed, threads may record until the very end of static
+// destruction.
+struct TraceRegistry {
+  std::mutex mutex;
+  std::vector<TraceBuffer*> buffers;
+  const ScopedTrace::Clock::time_point epoch = ScopedTrace::Clock::now();
+};
+
+TraceRegistry* Registry() {
+  static TraceRegistry* registry = new TraceRegistry;
+  return registry;
+}
+
+// Writes the trace when destroyed at exit.
+struct TraceDumper {
+  ~TraceDumper() {
+    const char* env = std::getenv("LC0_TRACE_FILE");
+    const std::string filename = env ? env : "lc0_trace.json";
+    std::ofstream file(filename);
+    if (!file) {
+      std::cerr << "Cannot write trace to " << filename << std::endl;
+      return;
+    }
+    file << std::fixed << std::setprecision(3) << "{\"traceEvents\":[";
+    bool first = true;
+    uint64_t total = 0;
+    TraceRegistry* registry = Registry();
+    std::lock_guard<std::mutex> lock(registry->mutex);
+    for (const TraceBuffer* buffer : registry->buffers) {
+      const uint64_t count = buffer->count.load(std::memory_order_acquire);
+      const uint64_t begin = count > kTraceCapacity ? count - kTraceCapacity : 0;
+      for (uint64_t i = begin; i < count; ++i) {
+        const TraceEvent& event = buffer->events[i % kTraceCapacity];
+        file << (first ? "\n" : ",\n") << "{\"name\":\"" << event.name
+             << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << buffer->tid
+             << ",\"ts\":" << event.start_ns / 1000.0
+             << ",\"dur\":" << event.duration_ns / 1000.0 << "}";
+        first = false;
+      }
+      total += count - begin;
+    }
+    file << "\n],\"displayTimeUnit\":\"ms\"}\n";
+    std::cerr << "Wrote " << total << " trace events to " << filename
+              << std::endl;
+  }
+};
+
+TraceBuffer* ThreadBuffer() {
+  static TraceDumper dumper;
+  thread_local TraceBuffer* buffer = nullptr;
+  if (!buffer) {
+    buffer = new TraceBuffer;
+    TraceRegistry* registry = Registry();
+    std::lock_guard<std::mutex> lock(registry->mutex);
+    buffer->tid = registry->buffers.size();
+    registry->buffers.push_back(buffer);
+  }
+  return buffer;
+}
+
+}  // namespace
+
+ScopedTrace::~ScopedTrace() {
+  const auto end = Clock::now();
+  TraceBuffer* buffer = ThreadBuffer();
+  const uint64_t count = buffer->count.load(std::memory_order_relaxed);
+  buffer->events[count % kTraceCapacity] = {
+      name_,
+      std::chrono::duration_cast<std::chrono::nanoseconds>(
+          start_ - Registry()->epoch)
+          .count(),
+      std::chrono::duration_cast<std::chrono::nanoseconds>(end - start_)
+          .count()};
+  buffer->count.store(count + 1, std::memory_order_release);
+}
+
+}  // namespace lczero
+#endif
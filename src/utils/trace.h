@@ -0,0 +1,68 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2019 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+
+  If you modify this Program, or any covered work, by linking or
+  combining it with NVIDIA Corporation's libraries from the NVIDIA CUDA
+  Toolkit and the NVIDIA CUDA Deep Neural Network library (or a
+  modified version of those libraries), containing parts covered by the
+  terms of the respective license agreement, the licensors of this
+  Program grant you additional permission to convey the resulting work.
+*/
+
+#pragma once
+
+#if defined(TRACE_EVENTS)
+#include <chrono>
+#include <cstdint>
+#endif
+
+namespace lczero {
+
+#if defined(TRACE_EVENTS)
+// Timeline of scoped events, only compiled with the trace build option.
+// Every thread records into its own ring buffer, keeping the latest
+// kTraceCapacity events, without locking. At exit all buffers are written
+// to lc0_trace.json (or $LC0_TRACE_FILE) in Chrome trace format, which
+// chrome://tracing and Perfetto open.
+class ScopedTrace {
+ public:
+  using Clock = std::chrono::steady_clock;
+
+  // @name must outlive the process, a string literal usually.
+  explicit ScopedTrace(const char* name) : name_(name), start_(Clock::now()) {}
+  ~ScopedTrace();
+
+  ScopedTrace(const ScopedTrace&) = delete;
+  ScopedTrace& operator=(const ScopedTrace&) = delete;
+
+ private:
+  const char* const name_;
+  const Clock::time_point start_;
+};
+
+#define TRACE_CONCAT_INNER(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_INNER(a, b)
+// Records the rest of the enclosing scope as event @name.
+#define TRACE_SCOPE(name) \
+  ::lczero::ScopedTrace TRACE_CONCAT(trace_scope_, __LINE__)(name)
+#else
+#define TRACE_SCOPE(name) static_cast<void>(0)
+#endif
+
+}  // namespace lczero